@@ -57,6 +57,7 @@
 #include <sys/namei.h>
 #include <sys/priv.h>
 #include <sys/queue.h>
+#include <sys/sysctl.h>
 #include <sys/vnode.h>
 #ifdef DARWIN_QUOTA
 #include <sys/quota.h>
@@ -102,6 +103,45 @@ int hfs_setattr(struct vop_setattr_args *);
 int hfs_getattr(struct vop_getattr_args *);
 int hfs_write_access(struct vnode*, struct ucred*, Boolean);
 
+/* hfs_xattr.c */
+struct hfsmount;
+int hfs_getextattr(struct vop_getextattr_args *);
+int hfs_setextattr(struct vop_setextattr_args *);
+int hfs_listextattr(struct vop_listextattr_args *);
+int hfs_deleteextattr(struct vop_deleteextattr_args *);
+int hfs_getxattr_kernel(struct vnode *vp, const char *name, void *buf, size_t *sizep);
+int hfs_removeallattr(struct hfsmount *hfsmp, u_int32_t fileID, proc_t *p);
+
+/* hfs_search.c */
+struct hfs_search_args;
+int hfs_searchfs(struct vnode *vp, struct hfs_search_args *args, struct ucred *cred);
+
+/* hfs_getpaths.c */
+struct hfs_getpaths_args;
+int hfs_getpaths(struct vnode *vp, struct hfs_getpaths_args *args, struct ucred *cred);
+
+/* hfs_btcompact.c */
+struct hfs_btcompact_args;
+int hfs_btcompact(struct vnode *vp, struct hfs_btcompact_args *args, struct ucred *cred);
+
+/* hfs_decmpfs.c */
+#define HFS_UF_COMPRESSED 0x00000020 /* Mac OS UF_COMPRESSED: file data lives in decmpfs */
+struct cnode;
+void hfs_decmpfs_init(void);
+void hfs_decmpfs_uninit(void);
+int hfs_decmpfs_iscompressed(struct vnode *vp);
+int hfs_decmpfs_size(struct vnode *vp, off_t *sizep);
+int hfs_decmpfs_read(struct vnode *vp, struct uio *uio);
+void hfs_decmpfs_cnode_destroy(struct cnode *cp);
+
+/* VolumeAllocation.c */
+struct hfsmount;
+void hfs_trim_init(struct hfsmount *hfsmp);
+void hfs_trim_flush(struct hfsmount *hfsmp);
+void hfs_trim_destroy(struct hfsmount *hfsmp);
+
+SYSCTL_DECL(_vfs_hfs);
+
 #endif
 
 struct uio;	 // This is more effective than #include <sys/uio.h> in case _KERNEL
@@ -152,6 +192,39 @@ extern struct timezone gTimeZone;
 #define HFS_MINFREE    1
 #define HFS_MAXRESERVE (u_int64_t)(250 * 1024 * 1024)
 
+/*
+ * Freed space waiting to be sent to the device as BIO_DELETE (TRIM/UNMAP).
+ *
+ * Extents freed by BlockDeallocate are kept sorted by device offset and
+ * coalesced with their neighbours, then issued as one batch at the next
+ * hfs_sync, once the metadata that stopped referencing them has been
+ * written.  Batches that have been issued but not yet completed stay on
+ * tl_inflight so that BlockAllocate can wait before reusing their blocks.
+ */
+#define HFS_TRIM_MAXEXTENTS 4096
+
+struct hfs_trim_extent {
+	off_t te_offset; /* device byte offset */
+	off_t te_length; /* length in bytes */
+};
+
+struct hfs_trim_batch {
+	TAILQ_ENTRY(hfs_trim_batch) tb_link;
+	u_int32_t tb_count;   /* extents in tb_extents */
+	u_int32_t tb_pending; /* BIO_DELETEs not yet completed */
+	struct hfs_trim_extent tb_extents[];
+};
+
+struct hfs_trim_list {
+	struct mtx tl_lock;
+	int tl_enabled;			 /* device accepts BIO_DELETE */
+	u_int32_t tl_count;		 /* pending extents */
+	struct hfs_trim_extent *tl_extents; /* HFS_TRIM_MAXEXTENTS entries */
+	TAILQ_HEAD(, hfs_trim_batch) tl_inflight;
+	int tl_scanning;		 /* mount-time free space scan running */
+	int tl_scanstop;		 /* ask the scan to stop (unmount) */
+};
+
 /* Internal Data structures*/
 
 struct vcb_t {
@@ -188,6 +261,7 @@ struct vcb_t {
 	struct vnode *extentsRefNum;
 	struct vnode *catalogRefNum;
 	struct vnode *allocationsRefNum;
+	struct vnode *attributesRefNum; /* NULL if the volume has no attributes file */
 
 	u_int8_t vcbVN[256]; /* volume name in UTF-8 */
 	u_int32_t volumeNameEncodingHint;
@@ -265,6 +339,9 @@ typedef struct hfsmount {
 	hfs_to_unicode_func_t hfs_get_unicode;
 	unicode_to_hfs_func_t hfs_get_hfsname;
 
+	struct hfs_trim_list hfs_trim; /* pending TRIM/UNMAP ranges */
+	u_int32_t hfs_max_inline_attrsize; /* largest attribute stored in a b-tree record */
+
 #ifdef DARWIN_QUOTA
 	struct quotafile hfs_qfiles[MAXQUOTAS]; /* quota files */
 #endif
@@ -486,6 +563,10 @@ extern int hfs_getnewvnode(struct hfsmount *hfsmp, struct cnode *cp, struct cat_
 
 extern int hfs_metafilelocking(struct hfsmount *hfsmp, u_long fileID, u_int flags, proc_t *p);
 
+extern int hfs_attrkeycompare(HFSPlusAttrKey *searchKey, HFSPlusAttrKey *trialKey);
+
+extern void hfs_xattr_init(struct hfsmount *hfsmp);
+
 extern u_int32_t hfs_freeblks(struct hfsmount *hfsmp, int wantreserve);
 
 extern void hfs_remove_orphans(struct hfsmount *);
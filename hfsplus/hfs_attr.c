@@ -162,6 +162,7 @@ hfs_getattr(struct vop_getattr_args *ap)
 	struct cnode *cp = VTOC(vp);
 	struct vattr *vap = ap->a_vap;
 	struct timeval tv;
+	off_t size;
 
 	getmicrotime(&tv);
 	CTIMES(cp, &tv, &tv);
@@ -209,6 +210,8 @@ hfs_getattr(struct vop_getattr_args *ap)
 		vap->va_bytes = 0;
 	} else {
 		vap->va_size = VTOF(vp)->ff_size;
+		if (hfs_decmpfs_iscompressed(vp) && hfs_decmpfs_size(vp, &size) == 0)
+			vap->va_size = size;
 		vap->va_bytes = (u_quad_t)cp->c_blocks * (u_quad_t)VTOVCB(vp)->blockSize;
 		if (vp->v_type == VBLK || vp->v_type == VCHR)
 			vap->va_rdev = cp->c_rdev;
@@ -0,0 +1,240 @@
+/*
+ * hfs_btcompact.c
+ *
+ * Online compaction of the metadata B-trees (HFSIOC_BTCOMPACT).
+ *
+ * Years of inserts and deletes leave the catalog and extents trees
+ * with half-empty leaves scattered through a file that never shrinks,
+ * so a key-order walk reads more nodes than it needs and seeks between
+ * them.  This repacks the leaves, renumbers the nodes into key order
+ * and gives the free space at the end of the file back to the volume.
+ * The B-tree work itself is in hfscommon/BTree/BTreeCompact.c; this
+ * drives it a bounded number of node writes per call under the tree's
+ * exclusive lock, so the volume stays usable while it runs.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/mount.h>
+#include <sys/priv.h>
+#include <sys/proc.h>
+#include <sys/vnode.h>
+
+#include <hfsplus/hfs.h>
+#include <hfsplus/hfs_cnode.h>
+#include <hfsplus/hfs_dbg.h>
+#include <hfsplus/hfs_fsctl.h>
+
+#include "hfscommon/headers/BTreesPrivate.h"
+#include "hfscommon/headers/FileMgrInternal.h"
+
+/* cc_phase */
+#define HFS_BTC_REPACK	 1
+#define HFS_BTC_RENUMBER 2
+#define HFS_BTC_TRIM	 3
+
+static int hfs_btcompact_stats(FCB *fcb, struct hfs_btstats *bs);
+static int hfs_btcompact_trim(struct hfsmount *hfsmp, struct vnode *btvp, u_int32_t fileid, proc_t *p);
+
+int
+hfs_btcompact(struct vnode *vp, struct hfs_btcompact_args *args, struct ucred *cred)
+{
+	struct hfsmount *hfsmp = VTOHFS(vp);
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	struct hfs_btcompact_cursor *pos = &args->bc_cursor;
+	struct vnode *btvp;
+	BTreeControlBlockPtr btcb;
+	BTreeRenumberState renumber;
+	FCB *fcb;
+	proc_t *p = curthread;
+	u_int32_t fillpct, budget, startwrites, used;
+	Boolean done;
+	int error;
+
+	args->bc_written = 0;
+	args->bc_options &= ~HFS_BTC_DONE;
+
+	if (vcb->vcbSigWord != kHFSPlusSigWord)
+		return (EOPNOTSUPP);
+	if ((error = priv_check_cred(cred, PRIV_VFS_ADMIN)))
+		return (error);
+	if (vp->v_mount->mnt_flag & MNT_RDONLY)
+		return (EROFS);
+
+	switch (args->bc_fileid) {
+	case kHFSExtentsFileID:
+		btvp = vcb->extentsRefNum;
+		break;
+	case kHFSCatalogFileID:
+		btvp = vcb->catalogRefNum;
+		break;
+	case kHFSAttributesFileID:
+		btvp = vcb->attributesRefNum;
+		break;
+	default:
+		return (EINVAL);
+	}
+	if (btvp == NULL)
+		return (ENOENT);
+
+	fillpct = (args->bc_fillpct != 0) ? args->bc_fillpct : HFS_BTC_DEFFILL;
+	if (fillpct < 50 || fillpct > 100)
+		return (EINVAL);
+	budget = (args->bc_budget != 0) ? min(args->bc_budget, HFS_BTC_MAXBUDGET) : HFS_BTC_DEFBUDGET;
+
+	if ((error = hfs_metafilelocking(hfsmp, args->bc_fileid, LK_EXCLUSIVE, p)))
+		return (error);
+
+	fcb = VTOF(btvp);
+	btcb = (BTreeControlBlockPtr)fcb->fcbBTCBPtr;
+	startwrites = btcb->numUpdateNodes;
+
+	if (args->bc_options & HFS_BTC_START) {
+		args->bc_options &= ~HFS_BTC_START;
+		bzero(pos, sizeof(*pos));
+		if ((error = hfs_btcompact_stats(fcb, &args->bc_before)))
+			goto out;
+		pos->cc_phase = HFS_BTC_REPACK;
+	} else if (pos->cc_phase < HFS_BTC_REPACK || pos->cc_phase > HFS_BTC_TRIM) {
+		error = EINVAL;
+		goto out;
+	} else if (pos->cc_phase == HFS_BTC_RENUMBER && pos->cc_writecount != btcb->writeCount) {
+		/*
+		 * The tree changed since the last call, so the saved level
+		 * walk may be stale.  Start the pass over; nodes already in
+		 * place cost nothing the second time.  (The repack phase
+		 * checks its saved leaf itself.)
+		 */
+		pos->cc_height = pos->cc_node = pos->cc_slot = 0;
+	}
+
+	while (error == 0 && !(args->bc_options & HFS_BTC_DONE)) {
+		used = btcb->numUpdateNodes - startwrites;
+		if (used >= budget)
+			break;
+
+		done = false;
+		switch (pos->cc_phase) {
+		case HFS_BTC_REPACK:
+			error = MacToVFSError(BTRepackLeaves(fcb, fillpct, budget - used, &pos->cc_node, &done));
+			if (error == 0 && done) {
+				pos->cc_phase = HFS_BTC_RENUMBER;
+				pos->cc_node = 0;
+			}
+			break;
+
+		case HFS_BTC_RENUMBER:
+			renumber.height = pos->cc_height;
+			renumber.nodeNum = pos->cc_node;
+			renumber.nextSlot = pos->cc_slot;
+			error = MacToVFSError(BTRenumberNodes(fcb, budget - used, &renumber, &done));
+			pos->cc_height = renumber.height;
+			pos->cc_node = renumber.nodeNum;
+			pos->cc_slot = renumber.nextSlot;
+			if (error == 0 && done)
+				pos->cc_phase = HFS_BTC_TRIM;
+			break;
+
+		case HFS_BTC_TRIM:
+			error = hfs_btcompact_trim(hfsmp, btvp, args->bc_fileid, p);
+			if (error == 0)
+				error = hfs_btcompact_stats(fcb, &args->bc_after);
+			if (error == 0) {
+				args->bc_options |= HFS_BTC_DONE;
+				done = true;
+			}
+			break;
+		}
+
+		/* A phase that stopped short has used up this call's budget. */
+		if (!done)
+			break;
+	}
+
+out:
+	pos->cc_writecount = btcb->writeCount;
+	(void)BTFlushPath(fcb);
+	args->bc_written = btcb->numUpdateNodes - startwrites;
+	(void)hfs_metafilelocking(hfsmp, args->bc_fileid, LK_RELEASE, p);
+
+	return (error);
+}
+
+static int
+hfs_btcompact_stats(FCB *fcb, struct hfs_btstats *bs)
+{
+	BTreeOccupancy occ;
+	OSStatus result;
+
+	if ((result = BTGetOccupancy(fcb, &occ)))
+		return (MacToVFSError(result));
+
+	bzero(bs, sizeof(*bs));
+	bs->bs_nodesize = occ.nodeSize;
+	bs->bs_depth = occ.treeDepth;
+	bs->bs_totalnodes = occ.totalNodes;
+	bs->bs_freenodes = occ.freeNodes;
+	bs->bs_indexnodes = occ.indexNodes;
+	bs->bs_leafnodes = occ.leafNodes;
+	bs->bs_leafrecords = occ.leafRecords;
+	bs->bs_outoforder = occ.leavesOutOfOrder;
+	if (occ.indexNodes > 0)
+		bs->bs_indexocc = occ.indexBytes * 10000 / ((u_int64_t)occ.indexNodes * occ.nodeCapacity);
+	if (occ.leafNodes > 0)
+		bs->bs_leafocc = occ.leafBytes * 10000 / ((u_int64_t)occ.leafNodes * occ.nodeCapacity);
+	bs->bs_filesize = fcb->fcbEOF;
+
+	return (0);
+}
+
+/*
+ * Cut the free nodes off the end of the B-tree file.  The caller holds
+ * the tree's lock; the extents lock (which also covers the volume
+ * bitmap) is taken here for the other trees, as in ExtendBTreeFile.
+ */
+static int
+hfs_btcompact_trim(struct hfsmount *hfsmp, struct vnode *btvp, u_int32_t fileid, proc_t *p)
+{
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	FCB *fcb = VTOF(btvp);
+	BTreeControlBlockPtr btcb = (BTreeControlBlockPtr)fcb->fcbBTCBPtr;
+	u_int32_t nodesperblock, newtotal;
+	OSStatus result;
+	int error;
+
+	/* The file can only give back whole allocation blocks. */
+	nodesperblock = 1;
+	if (vcb->blockSize > btcb->nodeSize)
+		nodesperblock = vcb->blockSize / btcb->nodeSize;
+
+	if (fileid != kHFSExtentsFileID) {
+		if ((error = hfs_metafilelocking(hfsmp, kHFSExtentsFileID, LK_EXCLUSIVE, p)))
+			return (error);
+	}
+
+	result = BTTrimFreeNodes(fcb, nodesperblock, &newtotal);
+	if (result == 0 && (u_int64_t)newtotal * btcb->nodeSize < fcb->fcbEOF) {
+		/* The header must say the tree is smaller before the space is freed. */
+		result = BTFlushPath(fcb);
+		if (result == 0)
+			result = TruncateFileC(vcb, fcb, (SInt64)newtotal * btcb->nodeSize, false);
+		fcb->fcbEOF = (u_int64_t)fcb->ff_blocks * (u_int64_t)vcb->blockSize;
+		if (result == 0)
+			(void)vtruncbuf(btvp, fcb->fcbEOF, btcb->nodeSize);
+
+		/* The fork lives in the volume header. */
+		MarkVCBDirty(vcb);
+		(void)hfs_flushvolumeheader(hfsmp, MNT_WAIT, HFS_ALTFLUSH);
+	}
+
+	if (fileid != kHFSExtentsFileID) {
+		(void)BTFlushPath(VTOF(vcb->extentsRefNum));
+		(void)VOP_FSYNC(vcb->extentsRefNum, MNT_WAIT, p);
+		(void)hfs_metafilelocking(hfsmp, kHFSExtentsFileID, LK_RELEASE, p);
+	}
+
+	return (MacToVFSError(result));
+}
@@ -339,6 +339,56 @@ exit:
 	return MacToVFSError(result);
 }
 
+/*
+ * cat_threadlookup - get the parent and name of a catalog node from its
+ * thread record, without looking up the node itself.
+ *
+ * The name is returned as NUL terminated UTF-8.  HFS Plus only.
+ */
+int
+cat_threadlookup(struct hfsmount *hfsmp, cnid_t cnid, cnid_t *parentcnid, char *nameptr, size_t bufsize, size_t *namelen)
+{
+	struct BTreeIterator *iterator;
+	FSBufferDescriptor btdata;
+	UInt16 datasize;
+	HFSPlusCatalogThread *threadp;
+	CatalogRecord *recp;
+	int result;
+
+	if (HFSTOVCB(hfsmp)->vcbSigWord != kHFSPlusSigWord)
+		return (EINVAL);
+
+	iterator = (BTreeIterator *)malloc(sizeof(*iterator), M_TEMP, M_WAITOK);
+	bzero(iterator, sizeof(*iterator));
+	buildthreadkey(cnid, 0, (CatalogKey *)&iterator->key);
+
+	recp = (CatalogRecord *)malloc(sizeof(CatalogRecord), M_TEMP, M_WAITOK);
+	BDINIT(btdata, recp);
+
+	result = BTSearchRecord(VTOF(HFSTOVCB(hfsmp)->catalogRefNum), iterator, &btdata, &datasize, iterator);
+	if (result)
+		goto exit;
+
+	switch (recp->recordType) {
+	case kHFSPlusFileThreadRecord:
+	case kHFSPlusFolderThreadRecord:
+		threadp = &recp->hfsPlusThread;
+		*parentcnid = threadp->parentID;
+		result = utf8_encodestr(threadp->nodeName.unicode, threadp->nodeName.length * sizeof(UniChar), (u_int8_t *)nameptr, namelen,
+		    bufsize, ':', 0);
+		break;
+
+	default:
+		result = ENOENT;
+		break;
+	}
+exit:
+	free(recp, M_TEMP);
+	free(iterator, M_TEMP);
+
+	return MacToVFSError(result);
+}
+
 /*
  * cat_lookupmangled - lookup a catalog node using a mangled name
  */
@@ -1059,6 +1109,7 @@ catrec_update(const CatalogKey *ckp, CatalogRecord *crp, u_int16_t reclen, struc
 		if ((ckp->hfsPlus.parentID != descp->cd_parentcnid) || (dir->folderID != descp->cd_cnid))
 			return (btNotFound);
 		dir->valence = attrp->ca_entries;
+		dir->flags = (dir->flags & ~kHFSHasAttributesMask) | (attrp->ca_recflags & kHFSHasAttributesMask);
 		dir->createDate = to_hfs_time(attrp->ca_itime);
 		dir->contentModDate = to_hfs_time(attrp->ca_mtime);
 		dir->backupDate = to_hfs_time(attrp->ca_btime);
@@ -1166,6 +1217,9 @@ catrec_update(const CatalogKey *ckp, CatalogRecord *crp, u_int16_t reclen, struc
 		else
 			file->flags &= ~kHFSFileLockedMask;
 
+		/* Synchronize the extended attribute hint */
+		file->flags = (file->flags & ~kHFSHasAttributesMask) | (attrp->ca_recflags & kHFSHasAttributesMask);
+
 		/* Push out special field if necessary */
 		if (S_ISBLK(attrp->ca_mode) || S_ISCHR(attrp->ca_mode))
 			file->bsdInfo.special.rawDevice = attrp->ca_rdev;
@@ -1939,6 +1993,7 @@ getbsdattr(struct hfsmount *hfsmp, const struct HFSPlusCatalogFile *crp, struct
 	}
 
 	attrp->ca_fileid = crp->fileID;
+	attrp->ca_recflags = crp->flags;
 
 	bcopy(&crp->userInfo, attrp->ca_finderinfo, 32);
 }
@@ -80,6 +80,7 @@ struct cat_attr {
 	time_t ca_itime;       /* file initialization time */
 	time_t ca_btime;       /* last backup time */
 	u_long ca_flags;       /* status flags (chflags) */
+	u_int16_t ca_recflags; /* catalog record flags (HFS Plus only) */
 	union {
 		u_int32_t cau_blocks;  /* total file blocks used (rsrc + data) */
 		u_int32_t cau_entries; /* total directory entries (valence) */
@@ -156,6 +157,8 @@ extern int cat_getdirentries(struct hfsmount *hfsmp, struct cat_desc *descp, str
 
 extern int cat_insertfilethread(struct hfsmount *hfsmp, struct cat_desc *descp);
 
+extern int cat_threadlookup(struct hfsmount *hfsmp, cnid_t cnid, cnid_t *parentcnid, char *nameptr, size_t bufsize, size_t *namelen);
+
 #endif /* __APPLE_API_PRIVATE */
 #endif /* _KERNEL */
 #endif /* __HFS_CATALOG__ */
@@ -132,11 +132,16 @@ hfs_inactive(struct vop_inactive_args *ap)
 			printf("hfs_inactive: attempting to delete a non-empty "
 			       "file!");
 
+		/* Its extended attributes go with it */
+		if (cp->c_recflags & kHFSHasAttributesMask)
+			error = hfs_removeallattr(hfsmp, cp->c_fileid, p);
+
 		/*
 		 * The descriptor name may be zero,
 		 * in which case the fileid is used.
 		 */
-		error = cat_delete(hfsmp, &cp->c_desc, &cp->c_attr);
+		if (error == 0)
+			error = cat_delete(hfsmp, &cp->c_desc, &cp->c_attr);
 
 		if (error && truncated && (error != ENXIO))
 			printf("hfs_inactive: couldn't delete a truncated file!");
@@ -288,6 +293,7 @@ hfs_reclaim(struct vop_reclaim_args *ap)
 			cp->c_desc.cd_namelen = 0;
 			free(nameptr, M_TEMP);
 		}
+		hfs_decmpfs_cnode_destroy(cp);
 		CLR(cp->c_flag, (C_ALLOC | C_TRANSIT));
 		if (ISSET(cp->c_flag, C_WALLOC) || ISSET(cp->c_flag, C_WTRANSIT))
 			wakeup(cp);
@@ -102,6 +102,7 @@ struct cnode {
 	SLIST_HEAD(hfs_indexhead, hfs_index) c_indexlist; /* directory index list */
 	struct filefork *c_datafork;			  /* cnode's data fork */
 	struct filefork *c_rsrcfork;			  /* cnode's rsrc fork */
+	struct decmpfs_cnode *c_decmp;			  /* compressed file state */
 };
 
 /* Aliases for common cnode fields */
@@ -123,6 +124,7 @@ struct cnode {
 #define c_itime	     c_attr.ca_itime
 #define c_btime	     c_attr.ca_btime
 #define c_xflags     c_attr.ca_flags
+#define c_recflags   c_attr.ca_recflags
 #define c_finderinfo c_attr.ca_finderinfo
 #define c_blocks     c_attr.ca_blocks
 #define c_entries    c_attr.ca_entries
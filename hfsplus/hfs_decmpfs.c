@@ -0,0 +1,1054 @@
+/*
+ * hfs_decmpfs.c
+ *
+ * Read support for HFS Plus transparently compressed files.
+ *
+ * A compressed file has UF_COMPRESSED set, an empty data fork and a
+ * "com.apple.decmpfs" extended attribute holding a little-endian
+ * header followed, for small files, by the compressed data itself.
+ * Larger files keep their data in the resource fork as a table of
+ * independently compressed 64K chunks.
+ *
+ * Supported compression types:
+ *
+ *	 1	uncompressed data in the attribute
+ *	 3, 4	zlib, attribute / resource fork
+ *	 7, 8	LZVN, attribute / resource fork
+ *	11, 12	LZFSE, attribute / resource fork (raw and LZVN blocks only)
+ *
+ * Resource fork files are decoded a chunk at a time into a small
+ * per-cnode cache.  Sequential reads spanning several chunks that are
+ * not yet cached have those chunks decoded in parallel on a shared
+ * taskqueue.
+ */
+
+/*
+ * xnu/tests/hfs_decmpfs_test.c builds only the decoders, with
+ * HFS_DECMPFS_TEST defined.
+ */
+#ifndef HFS_DECMPFS_TEST
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/bio.h>
+#include <sys/buf.h>
+#include <sys/endian.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/module.h>
+#include <sys/mount.h>
+#include <sys/mutex.h>
+#include <sys/proc.h>
+#include <sys/smp.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
+#include <sys/taskqueue.h>
+#include <sys/uio.h>
+#include <sys/vnode.h>
+
+#include <machine/atomic.h>
+
+#include <contrib/zlib/zlib.h>
+
+#include <hfsplus/hfs.h>
+#include <hfsplus/hfs_catalog.h>
+#include <hfsplus/hfs_cnode.h>
+#include <hfsplus/hfs_dbg.h>
+#include <hfsplus/hfs_format.h>
+
+#include "hfscommon/headers/BTreesInternal.h"
+#include "hfscommon/headers/FileMgrInternal.h"
+
+MODULE_DEPEND(hfs, zlib, 1, 1, 1);
+
+static MALLOC_DEFINE(M_HFSDECMP, "hfs_decmpfs", "HFS compressed file state");
+#endif /* !HFS_DECMPFS_TEST */
+
+#define DECMPFS_XATTR_NAME "com.apple.decmpfs"
+#define DECMPFS_MAGIC	   0x636d7066 /* 'cmpf' */
+
+#define DECMPFS_CHUNK_SIZE   65536
+#define DECMPFS_CHUNK_MAXSRC (DECMPFS_CHUNK_SIZE + 1024)     /* largest compressed chunk we accept */
+#define DECMPFS_XATTR_MAXSIZE (128 * 1024)		     /* largest decmpfs attribute */
+#define DECMPFS_XDATA_MAXSIZE (8 * 1024 * 1024)		     /* largest attribute-resident file */
+#define DECMPFS_RSRCFORK      0xFF			     /* extents B-tree fork type */
+#define DECMPFS_CACHE_CHUNKS 8				     /* decoded chunks cached per file */
+
+enum {
+	CMP_Type1 = 1,	 /* uncompressed data in xattr */
+	CMP_Type3 = 3,	 /* zlib data in xattr */
+	CMP_Type4 = 4,	 /* zlib data in resource fork */
+	CMP_Type7 = 7,	 /* LZVN data in xattr */
+	CMP_Type8 = 8,	 /* LZVN data in resource fork */
+	CMP_Type11 = 11, /* LZFSE data in xattr */
+	CMP_Type12 = 12, /* LZFSE data in resource fork */
+};
+
+#ifndef HFS_DECMPFS_TEST
+
+/* On-disk attribute header (little-endian) */
+struct decmpfs_disk_header {
+	u_int32_t compression_magic;
+	u_int32_t compression_type;
+	u_int64_t uncompressed_size;
+	u_int8_t attr_bytes[0];
+} __packed;
+
+struct decmpfs_chunk {
+	int64_t dc_index;   /* chunk number, -1 if empty */
+	u_int32_t dc_len;   /* decoded length */
+	u_int32_t dc_stamp; /* LRU clock */
+	u_int8_t *dc_data;  /* DECMPFS_CHUNK_SIZE bytes */
+};
+
+struct decmpfs_cnode {
+	struct sx dp_lock;   /* serializes loading and cache use */
+	u_int32_t dp_type;   /* CMP_Type* */
+	off_t dp_size;	     /* uncompressed size */
+	u_int dp_loaded;     /* data or chunk table below is set up */
+	u_int8_t *dp_xdata;  /* decoded data (attribute types) */
+
+	/* Resource fork types */
+	HFSPlusExtentDescriptor *dp_extents;
+	u_int32_t dp_nextents;
+	off_t dp_rsrcsize;
+	u_int32_t dp_nchunks;
+	u_int64_t *dp_chunkoff; /* offset of each chunk in the resource fork */
+	u_int32_t *dp_chunklen; /* compressed length of each chunk */
+	u_int32_t dp_clock;
+	struct decmpfs_chunk dp_cache[DECMPFS_CACHE_CHUNKS];
+};
+
+/* One chunk to decode on the taskqueue */
+struct decmpfs_job {
+	struct task dj_task;
+	struct decmpfs_batch *dj_batch;
+	u_int32_t dj_type;
+	u_int8_t *dj_src;
+	size_t dj_srclen;
+	struct decmpfs_chunk *dj_chunk;
+	size_t dj_dstlen;
+	int dj_error;
+};
+
+struct decmpfs_batch {
+	struct mtx db_lock;
+	int db_pending;
+};
+
+static struct taskqueue *hfs_decmpfs_tq;
+
+static int hfs_decmpfs_parallel = 1;
+SYSCTL_INT(_vfs_hfs, OID_AUTO, decmpfs_parallel, CTLFLAG_RW, &hfs_decmpfs_parallel, 0,
+    "Decode compressed chunks in parallel for large reads");
+
+static void hfs_decmpfs_free(struct decmpfs_cnode *dp);
+static struct decmpfs_cnode *hfs_decmpfs_get(struct vnode *vp, int *errorp);
+static int hfs_decmpfs_setup(struct vnode *vp, struct decmpfs_cnode *dp);
+static int hfs_decmpfs_load(struct vnode *vp, struct decmpfs_cnode *dp);
+static int hfs_decmpfs_xsetup(struct vnode *vp, struct decmpfs_cnode *dp);
+static int hfs_decmpfs_rsrcsetup(struct vnode *vp, struct decmpfs_cnode *dp);
+static int hfs_decmpfs_readrsrc(struct hfsmount *hfsmp, struct decmpfs_cnode *dp, off_t offset, size_t len, u_int8_t *buf);
+static struct decmpfs_chunk *hfs_decmpfs_slot(struct decmpfs_cnode *dp, int64_t first, int64_t last);
+static struct decmpfs_chunk *hfs_decmpfs_lookup(struct decmpfs_cnode *dp, int64_t index);
+static int hfs_decmpfs_fill(struct hfsmount *hfsmp, struct decmpfs_cnode *dp, int64_t first, int64_t last);
+static void hfs_decmpfs_task(void *arg, int pending);
+static size_t hfs_decmpfs_chunkbytes(struct decmpfs_cnode *dp, int64_t index);
+#endif /* !HFS_DECMPFS_TEST */
+static int hfs_decmpfs_decode(u_int32_t type, const u_int8_t *src, size_t srclen, u_int8_t *dst, size_t dstlen);
+static int hfs_decmpfs_inflate(const u_int8_t *src, size_t srclen, u_int8_t *dst, size_t dstlen, size_t *outlen);
+static int hfs_lzvn_decode(const u_int8_t *src, size_t srclen, u_int8_t *dst, size_t dstlen, size_t *outlen);
+static int hfs_lzfse_decode(const u_int8_t *src, size_t srclen, u_int8_t *dst, size_t dstlen, size_t *outlen);
+
+#ifndef HFS_DECMPFS_TEST
+
+void
+hfs_decmpfs_init(void)
+{
+	hfs_decmpfs_tq = taskqueue_create("hfs_decmpfs", M_WAITOK, taskqueue_thread_enqueue, &hfs_decmpfs_tq);
+	taskqueue_start_threads(&hfs_decmpfs_tq, min(mp_ncpus, 8), PVFS, "hfs decmpfs");
+}
+
+void
+hfs_decmpfs_uninit(void)
+{
+	if (hfs_decmpfs_tq != NULL) {
+		taskqueue_free(hfs_decmpfs_tq);
+		hfs_decmpfs_tq = NULL;
+	}
+}
+
+/*
+ * Is this vnode the data fork of a compressed file?
+ */
+int
+hfs_decmpfs_iscompressed(struct vnode *vp)
+{
+	struct cnode *cp = VTOC(vp);
+
+	return (vp->v_type == VREG && (cp->c_xflags & HFS_UF_COMPRESSED) && !VNODE_IS_RSRC(vp) &&
+	    VTOVCB(vp)->vcbSigWord == kHFSPlusSigWord);
+}
+
+/*
+ * Uncompressed size of a compressed file, for getattr.  Only the
+ * attribute header is read; the data is left for the first read.
+ */
+int
+hfs_decmpfs_size(struct vnode *vp, off_t *sizep)
+{
+	struct decmpfs_cnode *dp;
+	int error;
+
+	if ((dp = hfs_decmpfs_get(vp, &error)) == NULL)
+		return (error);
+	*sizep = dp->dp_size;
+
+	return (0);
+}
+
+void
+hfs_decmpfs_cnode_destroy(struct cnode *cp)
+{
+	if (cp->c_decmp != NULL) {
+		hfs_decmpfs_free(cp->c_decmp);
+		cp->c_decmp = NULL;
+	}
+}
+
+static void
+hfs_decmpfs_free(struct decmpfs_cnode *dp)
+{
+	int i;
+
+	for (i = 0; i < DECMPFS_CACHE_CHUNKS; i++) {
+		if (dp->dp_cache[i].dc_data != NULL)
+			free(dp->dp_cache[i].dc_data, M_HFSDECMP);
+	}
+	if (dp->dp_xdata != NULL)
+		free(dp->dp_xdata, M_HFSDECMP);
+	if (dp->dp_extents != NULL)
+		free(dp->dp_extents, M_HFSDECMP);
+	if (dp->dp_chunkoff != NULL)
+		free(dp->dp_chunkoff, M_HFSDECMP);
+	if (dp->dp_chunklen != NULL)
+		free(dp->dp_chunklen, M_HFSDECMP);
+	sx_destroy(&dp->dp_lock);
+	free(dp, M_HFSDECMP);
+}
+
+/*
+ * Return the compression state of a file, reading the decmpfs
+ * attribute header on first use.
+ */
+static struct decmpfs_cnode *
+hfs_decmpfs_get(struct vnode *vp, int *errorp)
+{
+	struct cnode *cp = VTOC(vp);
+	struct decmpfs_cnode *dp;
+	int i;
+
+	if ((dp = cp->c_decmp) != NULL)
+		return (dp);
+
+	dp = malloc(sizeof(*dp), M_HFSDECMP, M_WAITOK | M_ZERO);
+	sx_init(&dp->dp_lock, "hfs decmpfs");
+	for (i = 0; i < DECMPFS_CACHE_CHUNKS; i++)
+		dp->dp_cache[i].dc_index = -1;
+
+	if ((*errorp = hfs_decmpfs_setup(vp, dp)) != 0) {
+		hfs_decmpfs_free(dp);
+		return (NULL);
+	}
+
+	/* Readers may hold the vnode lock shared; first one in wins. */
+	if (!atomic_cmpset_ptr((volatile uintptr_t *)&cp->c_decmp, (uintptr_t)NULL, (uintptr_t)dp)) {
+		hfs_decmpfs_free(dp);
+		dp = cp->c_decmp;
+	}
+
+	return (dp);
+}
+
+static int
+hfs_decmpfs_setup(struct vnode *vp, struct decmpfs_cnode *dp)
+{
+	struct decmpfs_disk_header hdr;
+	size_t attrsize;
+	int error;
+
+	attrsize = sizeof(hdr);
+	if ((error = hfs_getxattr_kernel(vp, DECMPFS_XATTR_NAME, &hdr, &attrsize)))
+		return (error == ENOATTR ? EIO : error);
+	if (attrsize < sizeof(hdr) || attrsize > DECMPFS_XATTR_MAXSIZE)
+		return (EIO);
+	if (le32toh(hdr.compression_magic) != DECMPFS_MAGIC)
+		return (EIO);
+	dp->dp_type = le32toh(hdr.compression_type);
+	dp->dp_size = le64toh(hdr.uncompressed_size);
+	if (dp->dp_size < 0)
+		return (EIO);
+
+	switch (dp->dp_type) {
+	case CMP_Type1:
+	case CMP_Type3:
+	case CMP_Type7:
+	case CMP_Type11:
+		if (dp->dp_size > DECMPFS_XDATA_MAXSIZE)
+			return (EFBIG);
+		return (0);
+
+	case CMP_Type4:
+	case CMP_Type8:
+	case CMP_Type12:
+		return (0);
+
+	default:
+		return (EOPNOTSUPP);
+	}
+}
+
+/*
+ * Decode an attribute-resident file, or read a resource fork file's
+ * chunk table, on the first read.  The result stays on the cnode.
+ */
+static int
+hfs_decmpfs_load(struct vnode *vp, struct decmpfs_cnode *dp)
+{
+	int error;
+
+	if (atomic_load_acq_int(&dp->dp_loaded))
+		return (0);
+
+	sx_xlock(&dp->dp_lock);
+	error = 0;
+	if (!dp->dp_loaded) {
+		switch (dp->dp_type) {
+		case CMP_Type4:
+		case CMP_Type8:
+		case CMP_Type12:
+			error = hfs_decmpfs_rsrcsetup(vp, dp);
+			if (error) {
+				/* Start over on the next read */
+				if (dp->dp_extents != NULL)
+					free(dp->dp_extents, M_HFSDECMP);
+				if (dp->dp_chunkoff != NULL)
+					free(dp->dp_chunkoff, M_HFSDECMP);
+				if (dp->dp_chunklen != NULL)
+					free(dp->dp_chunklen, M_HFSDECMP);
+				dp->dp_extents = NULL;
+				dp->dp_nextents = 0;
+				dp->dp_chunkoff = NULL;
+				dp->dp_chunklen = NULL;
+				dp->dp_nchunks = 0;
+			}
+			break;
+		default:
+			error = hfs_decmpfs_xsetup(vp, dp);
+			break;
+		}
+		if (error == 0)
+			atomic_store_rel_int(&dp->dp_loaded, 1);
+	}
+	sx_xunlock(&dp->dp_lock);
+
+	return (error);
+}
+
+/*
+ * Decode the data that follows the header in the attribute.
+ */
+static int
+hfs_decmpfs_xsetup(struct vnode *vp, struct decmpfs_cnode *dp)
+{
+	struct decmpfs_disk_header *hdr;
+	u_int8_t *xdata;
+	size_t attrsize, datalen;
+	int error;
+
+	attrsize = 0;
+	if ((error = hfs_getxattr_kernel(vp, DECMPFS_XATTR_NAME, NULL, &attrsize)))
+		return (error == ENOATTR ? EIO : error);
+	if (attrsize < sizeof(*hdr) || attrsize > DECMPFS_XATTR_MAXSIZE)
+		return (EIO);
+
+	hdr = malloc(attrsize, M_HFSDECMP, M_WAITOK);
+	if ((error = hfs_getxattr_kernel(vp, DECMPFS_XATTR_NAME, hdr, &attrsize)))
+		goto out;
+	/* The header was checked when the file was first looked at */
+	if (le32toh(hdr->compression_type) != dp->dp_type || le64toh(hdr->uncompressed_size) != dp->dp_size) {
+		error = EIO;
+		goto out;
+	}
+	datalen = attrsize - sizeof(*hdr);
+
+	xdata = malloc(max(dp->dp_size, 1), M_HFSDECMP, M_WAITOK);
+	if (dp->dp_type == CMP_Type1) {
+		if (datalen < dp->dp_size)
+			error = EIO;
+		else
+			bcopy(hdr->attr_bytes, xdata, dp->dp_size);
+	} else if (dp->dp_size != 0) {
+		error = hfs_decmpfs_decode(dp->dp_type, hdr->attr_bytes, datalen, xdata, dp->dp_size);
+	}
+	if (error)
+		free(xdata, M_HFSDECMP);
+	else
+		dp->dp_xdata = xdata;
+out:
+	free(hdr, M_HFSDECMP);
+
+	return (error);
+}
+
+/*
+ * Collect the resource fork extents and parse its chunk table.
+ */
+static int
+hfs_decmpfs_rsrcsetup(struct vnode *vp, struct decmpfs_cnode *dp)
+{
+	struct cnode *cp = VTOC(vp);
+	struct hfsmount *hfsmp = VTOHFS(vp);
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	struct cat_fork rsrcfork;
+	HFSPlusExtentKey key;
+	HFSPlusExtentRecord extents;
+	proc_t *p = curthread;
+	u_int32_t blocks, hint, count, i;
+	u_int32_t *table = NULL;
+	u_int8_t hdr[16];
+	u_int32_t dataoff;
+	size_t tablelen;
+	int error;
+
+	/* Resource fork size and first extents come from the catalog */
+	bzero(&rsrcfork, sizeof(rsrcfork));
+	if (cp->c_rsrcfork != NULL) {
+		rsrcfork = cp->c_rsrcfork->ff_data;
+	} else {
+		if ((error = hfs_metafilelocking(hfsmp, kHFSCatalogFileID, LK_SHARED, p)))
+			return (error);
+		error = cat_lookup(hfsmp, &cp->c_desc, 1, NULL, NULL, &rsrcfork);
+		(void)hfs_metafilelocking(hfsmp, kHFSCatalogFileID, LK_RELEASE, p);
+		if (error)
+			return (error);
+	}
+	dp->dp_rsrcsize = rsrcfork.cf_size;
+
+	dp->dp_extents = malloc(kHFSPlusExtentDensity * sizeof(HFSPlusExtentDescriptor), M_HFSDECMP, M_WAITOK);
+	blocks = 0;
+	for (i = 0; i < kHFSPlusExtentDensity && rsrcfork.cf_extents[i].blockCount != 0; i++) {
+		dp->dp_extents[dp->dp_nextents].startBlock = rsrcfork.cf_extents[i].startBlock;
+		dp->dp_extents[dp->dp_nextents].blockCount = rsrcfork.cf_extents[i].blockCount;
+		dp->dp_nextents++;
+		blocks += rsrcfork.cf_extents[i].blockCount;
+	}
+
+	/* Pick up any overflow extents */
+	if (blocks < rsrcfork.cf_blocks) {
+		if ((error = hfs_metafilelocking(hfsmp, kHFSExtentsFileID, LK_SHARED, p)))
+			return (error);
+		while (blocks < rsrcfork.cf_blocks) {
+			error = MacToVFSError(FindExtentRecord(vcb, DECMPFS_RSRCFORK, cp->c_fileid, blocks, false, &key, extents, &hint));
+			if (error)
+				break;
+			dp->dp_extents = reallocf(dp->dp_extents, (dp->dp_nextents + kHFSPlusExtentDensity) * sizeof(HFSPlusExtentDescriptor),
+			    M_HFSDECMP, M_WAITOK);
+			for (i = 0; i < kHFSPlusExtentDensity && extents[i].blockCount != 0; i++) {
+				dp->dp_extents[dp->dp_nextents++] = extents[i];
+				blocks += extents[i].blockCount;
+			}
+			if (i == 0) {
+				error = EIO;
+				break;
+			}
+		}
+		(void)hfs_metafilelocking(hfsmp, kHFSExtentsFileID, LK_RELEASE, p);
+		if (error)
+			return (error);
+	}
+
+	count = howmany(dp->dp_size, DECMPFS_CHUNK_SIZE);
+	if ((off_t)count * 8 > dp->dp_rsrcsize)
+		return (EIO);
+	dp->dp_nchunks = count;
+	dp->dp_chunkoff = malloc(max(count, 1) * sizeof(u_int64_t), M_HFSDECMP, M_WAITOK);
+	dp->dp_chunklen = malloc(max(count, 1) * sizeof(u_int32_t), M_HFSDECMP, M_WAITOK);
+	if (count == 0)
+		return (0);
+
+	if (dp->dp_type == CMP_Type4) {
+		/*
+		 * zlib: a classic resource fork.  The data section holds a
+		 * 4-byte big-endian length, a little-endian chunk count and
+		 * (offset, length) pairs relative to the count field.
+		 */
+		if ((error = hfs_decmpfs_readrsrc(hfsmp, dp, 0, 4, hdr)))
+			return (error);
+		dataoff = be32dec(hdr);
+		if ((error = hfs_decmpfs_readrsrc(hfsmp, dp, dataoff, 8, hdr)))
+			return (error);
+		if (le32dec(hdr + 4) != count)
+			return (EIO);
+		tablelen = (size_t)count * 8;
+		table = malloc(tablelen, M_HFSDECMP, M_WAITOK);
+		if ((error = hfs_decmpfs_readrsrc(hfsmp, dp, dataoff + 8, tablelen, (u_int8_t *)table)))
+			goto out;
+		for (i = 0; i < count; i++) {
+			dp->dp_chunkoff[i] = (u_int64_t)dataoff + 4 + le32toh(table[2 * i]);
+			dp->dp_chunklen[i] = le32toh(table[2 * i + 1]);
+		}
+	} else {
+		/*
+		 * LZVN/LZFSE: the fork starts with count + 1 little-endian
+		 * offsets; chunk i spans [offset[i], offset[i + 1]).
+		 */
+		tablelen = ((size_t)count + 1) * 4;
+		table = malloc(tablelen, M_HFSDECMP, M_WAITOK);
+		if ((error = hfs_decmpfs_readrsrc(hfsmp, dp, 0, tablelen, (u_int8_t *)table)))
+			goto out;
+		if (le32toh(table[0]) != tablelen) {
+			error = EIO;
+			goto out;
+		}
+		for (i = 0; i < count; i++) {
+			dp->dp_chunkoff[i] = le32toh(table[i]);
+			if (le32toh(table[i + 1]) < le32toh(table[i])) {
+				error = EIO;
+				goto out;
+			}
+			dp->dp_chunklen[i] = le32toh(table[i + 1]) - le32toh(table[i]);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (dp->dp_chunklen[i] == 0 || dp->dp_chunklen[i] > DECMPFS_CHUNK_MAXSRC ||
+		    dp->dp_chunkoff[i] + dp->dp_chunklen[i] > (u_int64_t)dp->dp_rsrcsize) {
+			error = EIO;
+			break;
+		}
+	}
+out:
+	if (table != NULL)
+		free(table, M_HFSDECMP);
+
+	return (error);
+}
+
+/*
+ * Copy len bytes at offset in the resource fork into buf.
+ */
+static int
+hfs_decmpfs_readrsrc(struct hfsmount *hfsmp, struct decmpfs_cnode *dp, off_t offset, size_t len, u_int8_t *buf)
+{
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	struct buf *bp;
+	daddr_t blkno;
+	u_int32_t fileblock, i, base;
+	size_t skip, iosize;
+	int error;
+
+	if (offset < 0 || offset + (off_t)len > dp->dp_rsrcsize)
+		return (EIO);
+
+	while (len > 0) {
+		fileblock = offset / vcb->blockSize;
+		skip = offset % vcb->blockSize;
+
+		/* Map the fork block to a volume block */
+		for (i = 0, base = 0; i < dp->dp_nextents; base += dp->dp_extents[i].blockCount, i++) {
+			if (fileblock < base + dp->dp_extents[i].blockCount)
+				break;
+		}
+		if (i == dp->dp_nextents)
+			return (EIO);
+
+		blkno = (vcb->hfsPlusIOPosOffset + (off_t)(dp->dp_extents[i].startBlock + fileblock - base) * vcb->blockSize) / DEV_BSIZE;
+		error = bread(hfsmp->hfs_devvp, blkno, vcb->blockSize, NOCRED, &bp);
+		if (error) {
+			if (bp)
+				brelse(bp);
+			return (error);
+		}
+		iosize = min(len, vcb->blockSize - skip);
+		bcopy((char *)bp->b_data + skip, buf, iosize);
+		brelse(bp);
+
+		buf += iosize;
+		offset += iosize;
+		len -= iosize;
+	}
+
+	return (0);
+}
+#endif /* !HFS_DECMPFS_TEST */
+
+/*
+ * Decode a buffer that must expand to exactly dstlen bytes.
+ */
+static int
+hfs_decmpfs_decode(u_int32_t type, const u_int8_t *src, size_t srclen, u_int8_t *dst, size_t dstlen)
+{
+	size_t outlen = 0;
+	int error;
+
+	if (srclen == 0)
+		return (EIO);
+
+	switch (type) {
+	case CMP_Type3:
+	case CMP_Type4:
+		/* A low nibble of 0xF marks an uncompressed chunk */
+		if ((src[0] & 0x0F) == 0x0F) {
+			outlen = min(srclen - 1, dstlen);
+			bcopy(src + 1, dst, outlen);
+			error = 0;
+		} else {
+			error = hfs_decmpfs_inflate(src, srclen, dst, dstlen, &outlen);
+		}
+		break;
+
+	case CMP_Type7:
+	case CMP_Type8:
+	case CMP_Type11:
+	case CMP_Type12:
+		/* A leading LZVN end-of-stream opcode marks an uncompressed chunk */
+		if (src[0] == 0x06) {
+			outlen = min(srclen - 1, dstlen);
+			bcopy(src + 1, dst, outlen);
+			error = 0;
+		} else if (type == CMP_Type7 || type == CMP_Type8) {
+			error = hfs_lzvn_decode(src, srclen, dst, dstlen, &outlen);
+		} else {
+			error = hfs_lzfse_decode(src, srclen, dst, dstlen, &outlen);
+		}
+		break;
+
+	default:
+		error = EOPNOTSUPP;
+		break;
+	}
+
+	if (error == 0 && outlen != dstlen)
+		error = EIO;
+
+	return (error);
+}
+
+static void *
+hfs_decmpfs_zalloc(void *opaque, u_int items, u_int size)
+{
+	return (malloc((size_t)items * size, M_HFSDECMP, M_NOWAIT));
+}
+
+static void
+hfs_decmpfs_zfree(void *opaque, void *ptr)
+{
+	free(ptr, M_HFSDECMP);
+}
+
+static int
+hfs_decmpfs_inflate(const u_int8_t *src, size_t srclen, u_int8_t *dst, size_t dstlen, size_t *outlen)
+{
+	z_stream zs;
+	int zerr;
+
+	bzero(&zs, sizeof(zs));
+	zs.zalloc = hfs_decmpfs_zalloc;
+	zs.zfree = hfs_decmpfs_zfree;
+	zs.next_in = __DECONST(u_int8_t *, src);
+	zs.avail_in = srclen;
+	zs.next_out = dst;
+	zs.avail_out = dstlen;
+
+	if (inflateInit(&zs) != Z_OK)
+		return (ENOMEM);
+	zerr = inflate(&zs, Z_FINISH);
+	*outlen = zs.total_out;
+	inflateEnd(&zs);
+
+	return (zerr == Z_STREAM_END ? 0 : EIO);
+}
+
+/*
+ * LZVN decoder.
+ *
+ * Each opcode carries a literal length L, a match length M and
+ * optionally a new match distance D (otherwise the previous D is
+ * reused).  L literal bytes follow the opcode; then M bytes are
+ * copied from D bytes back in the output.
+ *
+ *	sml_d	LLMMMDDD DDDDDDDD
+ *	med_d	101LLMMM DDDDDDMM DDDDDDDD
+ *	lrg_d	LLMMM111 DDDDDDDD DDDDDDDD
+ *	pre_d	LLMMM110
+ *	sml_m	1111MMMM
+ *	lrg_m	11110000 MMMMMMMM
+ *	sml_l	1110LLLL
+ *	lrg_l	11100000 LLLLLLLL
+ *	nop	00001110, 00010110
+ *	eos	00000110
+ */
+static int
+hfs_lzvn_decode(const u_int8_t *src, size_t srclen, u_int8_t *dst, size_t dstlen, size_t *outlen)
+{
+	const u_int8_t *sp = src, *send = src + srclen;
+	u_int8_t *dp = dst, *dend = dst + dstlen;
+	size_t L, M, D = 0, oplen;
+	u_int8_t op;
+
+	while (sp < send) {
+		op = sp[0];
+
+		if (op == 0x06) /* eos */
+			break;
+		if (op == 0x0E || op == 0x16) { /* nop */
+			sp++;
+			continue;
+		}
+
+		if (op >= 0xF0) {
+			/* sml_m / lrg_m: match with previous distance */
+			L = 0;
+			if (op == 0xF0) {
+				if (send - sp < 2)
+					return (EIO);
+				M = sp[1] + 16;
+				oplen = 2;
+			} else {
+				M = op & 0x0F;
+				oplen = 1;
+			}
+		} else if (op >= 0xE0) {
+			/* sml_l / lrg_l: literal only */
+			M = 0;
+			if (op == 0xE0) {
+				if (send - sp < 2)
+					return (EIO);
+				L = sp[1] + 16;
+				oplen = 2;
+			} else {
+				L = op & 0x0F;
+				oplen = 1;
+			}
+		} else if (op >= 0xD0 || (op >= 0x70 && op < 0x80)) {
+			return (EIO); /* undefined */
+		} else if (op >= 0xA0 && op < 0xC0) {
+			/* med_d */
+			if (send - sp < 3)
+				return (EIO);
+			L = (op >> 3) & 3;
+			M = (((op & 7) << 2) | (sp[1] & 3)) + 3;
+			D = (sp[1] >> 2) | ((size_t)sp[2] << 6);
+			oplen = 3;
+		} else {
+			L = op >> 6;
+			M = ((op >> 3) & 7) + 3;
+			switch (op & 7) {
+			case 6: /* pre_d */
+				if (L == 0)
+					return (EIO); /* undefined */
+				oplen = 1;
+				break;
+			case 7: /* lrg_d */
+				if (send - sp < 3)
+					return (EIO);
+				D = sp[1] | ((size_t)sp[2] << 8);
+				oplen = 3;
+				break;
+			default: /* sml_d */
+				if (send - sp < 2)
+					return (EIO);
+				D = ((size_t)(op & 7) << 8) | sp[1];
+				oplen = 2;
+				break;
+			}
+		}
+
+		sp += oplen;
+		if ((size_t)(send - sp) < L || (size_t)(dend - dp) < L + M)
+			return (EIO);
+
+		bcopy(sp, dp, L);
+		sp += L;
+		dp += L;
+
+		if (M != 0) {
+			if (D == 0 || D > (size_t)(dp - dst))
+				return (EIO);
+			/* Byte copy: source and destination may overlap */
+			for (; M > 0; M--, dp++)
+				*dp = *(dp - D);
+		}
+	}
+
+	*outlen = dp - dst;
+	return (0);
+}
+
+/*
+ * LZFSE container decoder.  Raw and LZVN blocks are handled here;
+ * FSE-coded blocks (bvx1/bvx2) are not supported.
+ */
+#define LZFSE_ENDOFSTREAM_MAGIC	   0x24787662 /* bvx$ */
+#define LZFSE_UNCOMPRESSED_MAGIC   0x2d787662 /* bvx- */
+#define LZFSE_COMPRESSEDV1_MAGIC   0x31787662 /* bvx1 */
+#define LZFSE_COMPRESSEDV2_MAGIC   0x32787662 /* bvx2 */
+#define LZFSE_COMPRESSEDLZVN_MAGIC 0x6e787662 /* bvxn */
+
+static int
+hfs_lzfse_decode(const u_int8_t *src, size_t srclen, u_int8_t *dst, size_t dstlen, size_t *outlen)
+{
+	const u_int8_t *sp = src, *send = src + srclen;
+	size_t done = 0, nraw, npayload, n;
+	int error;
+
+	while ((size_t)(send - sp) >= 4) {
+		switch (le32dec(sp)) {
+		case LZFSE_ENDOFSTREAM_MAGIC:
+			*outlen = done;
+			return (0);
+
+		case LZFSE_UNCOMPRESSED_MAGIC:
+			if (send - sp < 8)
+				return (EIO);
+			nraw = le32dec(sp + 4);
+			sp += 8;
+			if ((size_t)(send - sp) < nraw || dstlen - done < nraw)
+				return (EIO);
+			bcopy(sp, dst + done, nraw);
+			sp += nraw;
+			done += nraw;
+			break;
+
+		case LZFSE_COMPRESSEDLZVN_MAGIC:
+			if (send - sp < 12)
+				return (EIO);
+			nraw = le32dec(sp + 4);
+			npayload = le32dec(sp + 8);
+			sp += 12;
+			if ((size_t)(send - sp) < npayload || dstlen - done < nraw)
+				return (EIO);
+			if ((error = hfs_lzvn_decode(sp, npayload, dst + done, nraw, &n)))
+				return (error);
+			if (n != nraw)
+				return (EIO);
+			sp += npayload;
+			done += nraw;
+			break;
+
+		case LZFSE_COMPRESSEDV1_MAGIC:
+		case LZFSE_COMPRESSEDV2_MAGIC:
+			return (EOPNOTSUPP);
+
+		default:
+			return (EIO);
+		}
+	}
+
+	return (EIO);
+}
+
+#ifndef HFS_DECMPFS_TEST
+
+/*
+ * Decoded length of a chunk.
+ */
+static size_t
+hfs_decmpfs_chunkbytes(struct decmpfs_cnode *dp, int64_t index)
+{
+	off_t start = index * DECMPFS_CHUNK_SIZE;
+
+	return (min(dp->dp_size - start, DECMPFS_CHUNK_SIZE));
+}
+
+static struct decmpfs_chunk *
+hfs_decmpfs_lookup(struct decmpfs_cnode *dp, int64_t index)
+{
+	int i;
+
+	for (i = 0; i < DECMPFS_CACHE_CHUNKS; i++) {
+		if (dp->dp_cache[i].dc_index == index) {
+			dp->dp_cache[i].dc_stamp = ++dp->dp_clock;
+			return (&dp->dp_cache[i]);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * Pick a cache slot to reuse: an empty one, else the least recently
+ * used slot that doesn't hold a chunk in [first, last].
+ */
+static struct decmpfs_chunk *
+hfs_decmpfs_slot(struct decmpfs_cnode *dp, int64_t first, int64_t last)
+{
+	struct decmpfs_chunk *dc, *victim = NULL;
+	int i;
+
+	for (i = 0; i < DECMPFS_CACHE_CHUNKS; i++) {
+		dc = &dp->dp_cache[i];
+		if (dc->dc_index == -1) {
+			victim = dc;
+			break;
+		}
+		if (dc->dc_index >= first && dc->dc_index <= last)
+			continue;
+		if (victim == NULL || (int32_t)(dc->dc_stamp - victim->dc_stamp) < 0)
+			victim = dc;
+	}
+	if (victim == NULL)
+		return (NULL);
+
+	if (victim->dc_data == NULL)
+		victim->dc_data = malloc(DECMPFS_CHUNK_SIZE, M_HFSDECMP, M_WAITOK);
+	victim->dc_index = -1;
+	victim->dc_stamp = ++dp->dp_clock;
+
+	return (victim);
+}
+
+static void
+hfs_decmpfs_task(void *arg, int pending)
+{
+	struct decmpfs_job *job = arg;
+	struct decmpfs_batch *batch = job->dj_batch;
+
+	job->dj_error = hfs_decmpfs_decode(job->dj_type, job->dj_src, job->dj_srclen, job->dj_chunk->dc_data, job->dj_dstlen);
+
+	mtx_lock(&batch->db_lock);
+	if (--batch->db_pending == 0)
+		wakeup(batch);
+	mtx_unlock(&batch->db_lock);
+}
+
+/*
+ * Make sure chunks first..last are in the cache.  The compressed data
+ * is read sequentially; when more than one chunk is missing the
+ * decoding is fanned out to the taskqueue.
+ *
+ * Caller holds dp_lock exclusive and guarantees that the range fits
+ * in the cache.
+ */
+static int
+hfs_decmpfs_fill(struct hfsmount *hfsmp, struct decmpfs_cnode *dp, int64_t first, int64_t last)
+{
+	struct decmpfs_job jobs[DECMPFS_CACHE_CHUNKS];
+	struct decmpfs_batch batch;
+	struct decmpfs_chunk *dc;
+	int64_t index;
+	int i, njobs = 0, error = 0;
+
+	for (index = first; index <= last; index++) {
+		if (hfs_decmpfs_lookup(dp, index) != NULL)
+			continue;
+		if ((dc = hfs_decmpfs_slot(dp, first, last)) == NULL) {
+			error = EIO;
+			break;
+		}
+		jobs[njobs].dj_chunk = dc;
+		jobs[njobs].dj_type = dp->dp_type;
+		jobs[njobs].dj_srclen = dp->dp_chunklen[index];
+		jobs[njobs].dj_dstlen = hfs_decmpfs_chunkbytes(dp, index);
+		jobs[njobs].dj_src = malloc(jobs[njobs].dj_srclen, M_HFSDECMP, M_WAITOK);
+		jobs[njobs].dj_error = 0;
+		error = hfs_decmpfs_readrsrc(hfsmp, dp, dp->dp_chunkoff[index], jobs[njobs].dj_srclen, jobs[njobs].dj_src);
+		njobs++;
+		if (error)
+			break;
+		/* Claim the slot now so later iterations don't evict it */
+		dc->dc_index = index;
+	}
+
+	if (error == 0 && njobs > 1 && hfs_decmpfs_parallel && hfs_decmpfs_tq != NULL) {
+		mtx_init(&batch.db_lock, "hfs decmpfs batch", NULL, MTX_DEF);
+		batch.db_pending = njobs;
+		for (i = 0; i < njobs; i++) {
+			jobs[i].dj_batch = &batch;
+			TASK_INIT(&jobs[i].dj_task, 0, hfs_decmpfs_task, &jobs[i]);
+			taskqueue_enqueue(hfs_decmpfs_tq, &jobs[i].dj_task);
+		}
+		mtx_lock(&batch.db_lock);
+		while (batch.db_pending > 0)
+			msleep(&batch, &batch.db_lock, PRIBIO, "hfsdcmp", 0);
+		mtx_unlock(&batch.db_lock);
+		mtx_destroy(&batch.db_lock);
+	} else if (error == 0) {
+		for (i = 0; i < njobs; i++)
+			jobs[i].dj_error = hfs_decmpfs_decode(jobs[i].dj_type, jobs[i].dj_src, jobs[i].dj_srclen, jobs[i].dj_chunk->dc_data,
+			    jobs[i].dj_dstlen);
+	}
+
+	for (i = 0; i < njobs; i++) {
+		if (error == 0)
+			error = jobs[i].dj_error;
+		if (error)
+			jobs[i].dj_chunk->dc_index = -1;
+		else
+			jobs[i].dj_chunk->dc_len = jobs[i].dj_dstlen;
+		free(jobs[i].dj_src, M_HFSDECMP);
+	}
+
+	return (error);
+}
+
+/*
+ * Read from a compressed file.
+ */
+int
+hfs_decmpfs_read(struct vnode *vp, struct uio *uio)
+{
+	struct hfsmount *hfsmp = VTOHFS(vp);
+	struct decmpfs_cnode *dp;
+	struct decmpfs_chunk *dc;
+	int64_t index, first, last;
+	off_t end;
+	size_t skip, n;
+	int error;
+
+	if ((dp = hfs_decmpfs_get(vp, &error)) == NULL)
+		return (error);
+	if (uio->uio_offset >= dp->dp_size)
+		return (0);
+	if ((error = hfs_decmpfs_load(vp, dp)))
+		return (error);
+
+	/* Attribute-resident files are decoded whole by the first read */
+	if (dp->dp_xdata != NULL) {
+		n = min(uio->uio_resid, dp->dp_size - uio->uio_offset);
+		return (uiomove(dp->dp_xdata + uio->uio_offset, n, uio));
+	}
+
+	sx_xlock(&dp->dp_lock);
+	error = 0;
+	while (uio->uio_resid > 0 && uio->uio_offset < dp->dp_size) {
+		end = min(uio->uio_offset + uio->uio_resid, dp->dp_size);
+		first = uio->uio_offset / DECMPFS_CHUNK_SIZE;
+		last = (end - 1) / DECMPFS_CHUNK_SIZE;
+		/* Keep half of the cache for chunks from earlier reads */
+		if (last - first >= DECMPFS_CACHE_CHUNKS / 2)
+			last = first + DECMPFS_CACHE_CHUNKS / 2 - 1;
+
+		if ((error = hfs_decmpfs_fill(hfsmp, dp, first, last)))
+			break;
+
+		for (index = first; index <= last && uio->uio_resid > 0; index++) {
+			if ((dc = hfs_decmpfs_lookup(dp, index)) == NULL) {
+				error = EIO;
+				break;
+			}
+			skip = uio->uio_offset - index * DECMPFS_CHUNK_SIZE;
+			n = min(uio->uio_resid, dc->dc_len - skip);
+			if ((error = uiomove(dc->dc_data + skip, n, uio)))
+				break;
+		}
+		if (error)
+			break;
+	}
+	sx_xunlock(&dp->dp_lock);
+
+	return (error);
+}
+#endif /* !HFS_DECMPFS_TEST */
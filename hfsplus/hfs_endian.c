@@ -355,6 +355,74 @@ hfs_swap_HFSPlusBTInternalNode(BlockDescriptor *src, HFSCatalogNodeID fileID, in
 				srcPtr[0] = SWAP_BE16(srcPtr[0]);
 		}
 
+	} else if (fileID == kHFSAttributesFileID) {
+		HFSPlusAttrKey *srcKey;
+		HFSPlusAttrRecord *srcRec;
+
+		for (i = 0; i < srcDesc->numRecords; i++) {
+			srcKey = (HFSPlusAttrKey *)((char *)src->buffer + srcOffs[i]);
+
+			if (!unswap)
+				srcKey->keyLength = SWAP_BE16(srcKey->keyLength);
+			srcRec = (HFSPlusAttrRecord *)((char *)srcKey + srcKey->keyLength + 2);
+			if (unswap)
+				srcKey->keyLength = SWAP_BE16(srcKey->keyLength);
+
+			/* Don't swap srcKey->pad */
+
+			srcKey->fileID = SWAP_BE32(srcKey->fileID);
+			srcKey->startBlock = SWAP_BE32(srcKey->startBlock);
+
+			if (!unswap)
+				srcKey->attrNameLen = SWAP_BE16(srcKey->attrNameLen);
+			if (srcKey->attrNameLen > kHFSMaxAttrNameLen) {
+				panic("%s attribute name too long", "hfs_swap_BTNode:");
+			}
+			for (j = 0; j < srcKey->attrNameLen; j++) {
+				srcKey->attrName[j] = SWAP_BE16(srcKey->attrName[j]);
+			}
+			if (unswap)
+				srcKey->attrNameLen = SWAP_BE16(srcKey->attrNameLen);
+
+			/* Stop if this is just an index node */
+			if (srcDesc->kind == kBTIndexNode) {
+				*((UInt32 *)srcRec) = SWAP_BE32(*((UInt32 *)srcRec));
+				continue;
+			}
+
+			/* Swap the record type now if we're doing a swap */
+			if (!unswap)
+				srcRec->recordType = SWAP_BE32(srcRec->recordType);
+
+			switch (srcRec->recordType) {
+			case kHFSPlusAttrInlineData:
+				/* Don't swap srcRec->attrData.reserved */
+				/* Don't swap srcRec->attrData.attrData */
+				srcRec->attrData.attrSize = SWAP_BE32(srcRec->attrData.attrSize);
+				break;
+
+			case kHFSPlusAttrForkData:
+				/* Don't swap srcRec->forkData.reserved */
+				hfs_swap_HFSPlusForkData(&srcRec->forkData.theFork);
+				break;
+
+			case kHFSPlusAttrExtents:
+				/* Don't swap srcRec->overflowExtents.reserved */
+				for (j = 0; j < kHFSPlusExtentDensity; j++) {
+					srcRec->overflowExtents.extents[j].startBlock = SWAP_BE32(srcRec->overflowExtents.extents[j].startBlock);
+					srcRec->overflowExtents.extents[j].blockCount = SWAP_BE32(srcRec->overflowExtents.extents[j].blockCount);
+				}
+				break;
+
+			default:
+				panic("%s unrecognized attribute record type", "hfs_swap_BTNode:");
+			}
+
+			/* If unswapping, we can safely unswap type field now */
+			if (unswap)
+				srcRec->recordType = SWAP_BE32(srcRec->recordType);
+		}
+
 	} else {
 		panic("%s unrecognized B-Tree type", "hfs_swap_BTNode:");
 	}
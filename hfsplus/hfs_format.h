@@ -252,7 +252,9 @@ enum {
 	kHFSFileLockedBit = 0x0000, /* file is locked and cannot be written to */
 	kHFSFileLockedMask = 0x0001,
 	kHFSThreadExistsBit = 0x0001, /* a file thread record exists for this file */
-	kHFSThreadExistsMask = 0x0002
+	kHFSThreadExistsMask = 0x0002,
+	kHFSHasAttributesBit = 0x0002, /* object has extended attributes */
+	kHFSHasAttributesMask = 0x0004
 };
 
 /* HFS catalog folder record - 70 bytes */
@@ -360,17 +362,29 @@ typedef struct HFSPlusCatalogThread HFSPlusCatalogThread;
 	chosen so that they wouldn't conflict with the catalog record types.
 */
 enum {
-	kHFSPlusAttrInlineData = 0x10, /* if size <  kAttrOverflowSize */
+	kHFSPlusAttrInlineData = 0x10, /* attributes whose data fits in a b-tree node */
 	kHFSPlusAttrForkData = 0x20,   /* if size >= kAttrOverflowSize */
 	kHFSPlusAttrExtents = 0x30     /* overflow extents for large attributes */
 };
 
 /*
-	HFSPlusAttrInlineData
+	HFSPlusAttrData
 	For small attributes, whose entire value is stored within this one
-	B-tree record.
+	B-tree record.  This is the layout written by Mac OS X 10.4 and later.
 	There would not be any other records for this attribute.
 */
+struct HFSPlusAttrData {
+	u_int32_t recordType; /* == kHFSPlusAttrInlineData*/
+	u_int32_t reserved[2];
+	u_int32_t attrSize;  /* size of attribute data in bytes */
+	u_int8_t attrData[2]; /* variable length */
+};
+typedef struct HFSPlusAttrData HFSPlusAttrData;
+
+/*
+	HFSPlusAttrInlineData
+	Obsolete inline record layout, kept for source compatibility.
+*/
 struct HFSPlusAttrInlineData {
 	u_int32_t recordType; /* == kHFSPlusAttrInlineData*/
 	u_int32_t reserved;
@@ -407,12 +421,25 @@ typedef struct HFSPlusAttrExtents HFSPlusAttrExtents;
 /*	A generic Attribute Record*/
 union HFSPlusAttrRecord {
 	u_int32_t recordType;
+	HFSPlusAttrData attrData;
 	HFSPlusAttrInlineData inlineData;
 	HFSPlusAttrForkData forkData;
 	HFSPlusAttrExtents overflowExtents;
 };
 typedef union HFSPlusAttrRecord HFSPlusAttrRecord;
 
+/* Attribute key */
+enum { kHFSMaxAttrNameLen = 127 };
+struct HFSPlusAttrKey {
+	u_int16_t keyLength;  /* key length (in bytes) */
+	u_int16_t pad;	      /* set to zero */
+	u_int32_t fileID;     /* file associated with attribute */
+	u_int32_t startBlock; /* first allocation block number for extents */
+	u_int16_t attrNameLen; /* number of unicode characters */
+	u_int16_t attrName[kHFSMaxAttrNameLen]; /* attribute name (Unicode) */
+};
+typedef struct HFSPlusAttrKey HFSPlusAttrKey;
+
 /* Key and node lengths */
 enum {
 	kHFSPlusExtentKeyMaximumLength = sizeof(HFSPlusExtentKey) - sizeof(u_int16_t),
@@ -421,6 +448,8 @@ enum {
 	kHFSPlusCatalogKeyMinimumLength = kHFSPlusCatalogKeyMaximumLength - sizeof(HFSUniStr255) + sizeof(u_int16_t),
 	kHFSCatalogKeyMaximumLength = sizeof(HFSCatalogKey) - sizeof(u_int8_t),
 	kHFSCatalogKeyMinimumLength = kHFSCatalogKeyMaximumLength - (kHFSMaxFileNameChars + 1) + sizeof(u_int8_t),
+	kHFSPlusAttrKeyMaximumLength = sizeof(HFSPlusAttrKey) - sizeof(u_int16_t),
+	kHFSPlusAttrKeyMinimumLength = kHFSPlusAttrKeyMaximumLength - (kHFSMaxAttrNameLen * sizeof(u_int16_t)),
 	kHFSPlusCatalogMinNodeSize = 4096,
 	kHFSPlusExtentMinNodeSize = 512,
 	kHFSPlusAttrMinNodeSize = 4096
@@ -0,0 +1,178 @@
+/*
+ * hfs_fsctl.h
+ *
+ * ioctl(2) interface to the HFS Plus file system.  Issue these on any
+ * open file or directory of the mounted volume.
+ */
+#ifndef _HFS_FSCTL_H_
+#define _HFS_FSCTL_H_
+
+#include <sys/types.h>
+#include <sys/ioccom.h>
+
+/*
+ * HFSIOC_SEARCHFS - scan the catalog for matching files and folders.
+ *
+ * The catalog is read sequentially, many nodes per I/O, and each
+ * record is tested against the criteria in the kernel.  Matches are
+ * packed into sa_buf as struct hfs_search_entry records.
+ *
+ * Start with HFS_SRCH_START set in sa_options, then call again with
+ * the returned cursor until HFS_SRCH_DONE is set.  A call may also
+ * return early because it hit sa_maxmatches, filled the buffer or
+ * used up its time slice.  If the catalog changes between calls the
+ * call fails with EBUSY; the caller should restart the search.
+ *
+ * Names are compared as UTF-8 in the volume's decomposed form, with
+ * ASCII letters matched case-insensitively.
+ */
+#define HFS_SRCH_START	 0x0001 /* in: begin a new search */
+#define HFS_SRCH_FILES	 0x0002 /* in: return files */
+#define HFS_SRCH_DIRS	 0x0004 /* in: return folders */
+#define HFS_SRCH_NAME	 0x0008 /* in: name contains sc_name */
+#define HFS_SRCH_EXACT	 0x0010 /* in: name equals sc_name */
+#define HFS_SRCH_PARENT	 0x0020 /* in: parent folder is sc_parentid */
+#define HFS_SRCH_SIZE	 0x0040 /* in: sc_minsize <= data size <= sc_maxsize (files) */
+#define HFS_SRCH_MTIME	 0x0080 /* in: sc_mintime <= modification time <= sc_maxtime */
+#define HFS_SRCH_DONE	 0x8000 /* out: the whole catalog has been searched */
+
+#define HFS_SRCH_MAXNAME 255
+
+struct hfs_search_criteria {
+	char sc_name[HFS_SRCH_MAXNAME + 1]; /* NUL terminated UTF-8 */
+	u_int32_t sc_parentid;
+	u_int64_t sc_minsize;
+	u_int64_t sc_maxsize;
+	int64_t sc_mintime;
+	int64_t sc_maxtime;
+};
+
+/* Opaque to the caller; hand back what the previous call returned. */
+struct hfs_search_cursor {
+	u_int32_t hc_writecount;
+	u_int32_t hc_nextnode;
+	u_int32_t hc_nextrecord;
+	u_int32_t hc_recordsfound;
+};
+
+struct hfs_search_args {
+	u_int32_t sa_options;			/* in/out: HFS_SRCH_* */
+	u_int32_t sa_maxmatches;		/* in: 0 means no limit */
+	u_int32_t sa_timelimit;			/* in: microseconds, 0 for default */
+	u_int32_t sa_nummatches;		/* out: entries placed in sa_buf */
+	struct hfs_search_criteria sa_criteria; /* in */
+	struct hfs_search_cursor sa_cursor;	/* in/out */
+	void *sa_buf;				/* in: result buffer */
+	size_t sa_buflen;			/* in: size of sa_buf; out: bytes used */
+};
+
+struct hfs_search_entry {
+	u_int32_t se_reclen;   /* length of this entry, a multiple of 8 */
+	u_int32_t se_fileid;   /* catalog node ID */
+	u_int32_t se_parentid; /* parent folder ID */
+	u_int16_t se_type;     /* DT_REG or DT_DIR */
+	u_int16_t se_namlen;   /* strlen(se_name) */
+	u_int64_t se_size;     /* data fork size (files) or valence (folders) */
+	int64_t se_mtime;      /* content modification time */
+	char se_name[];	       /* NUL terminated UTF-8 */
+};
+
+#define HFSIOC_SEARCHFS _IOWR('h', 1, struct hfs_search_args)
+
+/*
+ * HFSIOC_GETPATHS - resolve catalog node IDs to paths.
+ *
+ * gp_cnids holds gp_count file or folder IDs (at most
+ * HFS_GETPATHS_MAX).  One struct hfs_path_entry per ID is written to
+ * gp_buf, in request order, until either all IDs are done or the
+ * buffer is full; gp_resolved says how many entries were written.
+ * Paths are relative to the mount point and start with '/'.  An ID
+ * that can't be resolved gets an entry with pe_error set and an
+ * empty path.
+ *
+ * Hard links resolve to the path of the underlying inode file.
+ */
+#define HFS_GETPATHS_MAX 65536
+
+struct hfs_getpaths_args {
+	const u_int32_t *gp_cnids; /* in: IDs to resolve */
+	u_int32_t gp_count;	   /* in: number of IDs */
+	u_int32_t gp_resolved;	   /* out: entries placed in gp_buf */
+	void *gp_buf;		   /* in: result buffer */
+	size_t gp_buflen;	   /* in: size of gp_buf; out: bytes used */
+};
+
+struct hfs_path_entry {
+	u_int32_t pe_reclen;  /* length of this entry, a multiple of 8 */
+	u_int32_t pe_cnid;    /* ID from the request */
+	int32_t pe_error;     /* 0, or an errno such as ENOENT */
+	u_int32_t pe_pathlen; /* strlen(pe_path) */
+	char pe_path[];	      /* NUL terminated */
+};
+
+#define HFSIOC_GETPATHS _IOWR('h', 2, struct hfs_getpaths_args)
+
+/*
+ * HFSIOC_BTCOMPACT - compact a metadata B-tree while mounted.
+ *
+ * bc_fileid selects the catalog (4), extents (3) or attributes (8)
+ * B-tree.  Compaction runs in three phases: adjacent leaves are
+ * repacked to bc_fillpct percent full, nodes are renumbered so the
+ * index levels come first and the leaves follow in key order, and
+ * the free nodes left at the end are cut off the file.
+ *
+ * Each call writes about bc_budget nodes and returns; bc_written says
+ * how many it wrote.  Start with HFS_BTC_START set in bc_options, then
+ * call again with the returned cursor until HFS_BTC_DONE is set.
+ * Other activity on the volume may continue between calls.  The tree
+ * is consistent after every call, so compaction may be abandoned at
+ * any point.
+ *
+ * bc_before is filled in by the first call and bc_after by the last.
+ * Occupancy is the share of node space used by records, in
+ * hundredths of a percent.
+ */
+#define HFS_BTC_START	   0x0001 /* in: begin a new compaction */
+#define HFS_BTC_DONE	   0x8000 /* out: compaction is complete */
+
+#define HFS_BTC_DEFFILL	   90	  /* bc_fillpct used when 0 */
+#define HFS_BTC_DEFBUDGET  1024	  /* bc_budget used when 0 */
+#define HFS_BTC_MAXBUDGET  65536
+
+struct hfs_btstats {
+	u_int32_t bs_nodesize;
+	u_int32_t bs_depth;
+	u_int32_t bs_totalnodes;
+	u_int32_t bs_freenodes;
+	u_int32_t bs_indexnodes;
+	u_int32_t bs_leafnodes;
+	u_int32_t bs_leafrecords;
+	u_int32_t bs_outoforder; /* leaves not followed by the next node */
+	u_int32_t bs_indexocc;	 /* index node occupancy */
+	u_int32_t bs_leafocc;	 /* leaf node occupancy */
+	u_int64_t bs_filesize;	 /* bytes */
+};
+
+/* Opaque to the caller; hand back what the previous call returned. */
+struct hfs_btcompact_cursor {
+	u_int32_t cc_phase;
+	u_int32_t cc_writecount;
+	u_int32_t cc_height;
+	u_int32_t cc_node;
+	u_int32_t cc_slot;
+};
+
+struct hfs_btcompact_args {
+	u_int32_t bc_fileid;			/* in: B-tree file ID */
+	u_int32_t bc_options;			/* in/out: HFS_BTC_* */
+	u_int32_t bc_fillpct;			/* in: leaf fill target, 50 to 100 */
+	u_int32_t bc_budget;			/* in: node writes per call */
+	u_int32_t bc_written;			/* out: node writes this call */
+	struct hfs_btcompact_cursor bc_cursor;	/* in/out */
+	struct hfs_btstats bc_before;		/* out: when HFS_BTC_START */
+	struct hfs_btstats bc_after;		/* out: when HFS_BTC_DONE */
+};
+
+#define HFSIOC_BTCOMPACT _IOWR('h', 3, struct hfs_btcompact_args)
+
+#endif /* !_HFS_FSCTL_H_ */
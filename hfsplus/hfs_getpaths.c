@@ -0,0 +1,362 @@
+/*
+ * hfs_getpaths.c
+ *
+ * Bulk catalog node ID to path resolution (HFSIOC_GETPATHS).
+ *
+ * Paths are built from catalog thread records alone; no cnodes or
+ * vnodes are created.  Requests are looked up in ID order (thread
+ * records are keyed by ID, so this walks the catalog forwards), then
+ * grouped by parent so that each directory's path is resolved once.
+ * Directory paths are kept in a small LRU for the duration of the call
+ * so siblings and cousins share their ancestors' lookups.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/libkern.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mount.h>
+#include <sys/priv.h>
+#include <sys/proc.h>
+#include <sys/queue.h>
+#include <sys/vnode.h>
+
+#include <hfsplus/hfs.h>
+#include <hfsplus/hfs_catalog.h>
+#include <hfsplus/hfs_cnode.h>
+#include <hfsplus/hfs_fsctl.h>
+
+static MALLOC_DEFINE(M_HFSPATH, "hfs_getpaths", "HFS bulk path lookup");
+
+#define HFS_DIRCACHE_BUCKETS 256
+#define HFS_DIRCACHE_MAX     1024 /* directory paths kept per call */
+#define HFS_GETPATHS_MAXOUT  (1024 * 1024)
+#define HFS_NAMEBYTES	     (3 * kHFSPlusMaxFileNameChars + 1)
+
+struct hfs_pathreq {
+	u_int32_t pr_index; /* position in the request */
+	cnid_t pr_cnid;
+	cnid_t pr_parent;
+	int pr_error;
+	char *pr_path; /* name, then full path once resolved */
+	size_t pr_len;
+};
+
+struct hfs_dirpath {
+	LIST_ENTRY(hfs_dirpath) dp_hash;
+	TAILQ_ENTRY(hfs_dirpath) dp_lru;
+	cnid_t dp_cnid;
+	size_t dp_len;
+	char dp_path[]; /* "" for the root folder */
+};
+
+struct hfs_dircache {
+	LIST_HEAD(, hfs_dirpath) dc_hash[HFS_DIRCACHE_BUCKETS];
+	TAILQ_HEAD(hfs_dirpath_lru, hfs_dirpath) dc_lru;
+	int dc_count;
+	char dc_name[HFS_NAMEBYTES];
+	char dc_buf[MAXPATHLEN];	  /* path under construction, filled from the end */
+	cnid_t dc_chain[MAXPATHLEN / 2];  /* folders being resolved, deepest first */
+	size_t dc_start[MAXPATHLEN / 2];  /* where each one's "/name" starts in dc_buf */
+};
+
+static int hfs_pathreq_bycnid(const void *a, const void *b);
+static int hfs_pathreq_byparent(const void *a, const void *b);
+static int hfs_pathreq_byindex(const void *a, const void *b);
+static struct hfs_dirpath *hfs_dircache_get(struct hfs_dircache *dc, cnid_t cnid);
+static struct hfs_dirpath *hfs_dircache_add(struct hfs_dircache *dc, cnid_t cnid, const char *prefix, size_t prefixlen, const char *suffix,
+    size_t suffixlen);
+static int hfs_dirpath_resolve(struct hfsmount *hfsmp, struct hfs_dircache *dc, cnid_t dirid, struct hfs_dirpath **dpp);
+
+int
+hfs_getpaths(struct vnode *vp, struct hfs_getpaths_args *args, struct ucred *cred)
+{
+	struct hfsmount *hfsmp = VTOHFS(vp);
+	struct hfs_dircache *dc = NULL;
+	struct hfs_pathreq *reqs = NULL, *rp;
+	struct hfs_dirpath *dp = NULL;
+	struct hfs_path_entry *ep;
+	u_int32_t *cnids = NULL;
+	proc_t *p = curthread;
+	char *kbuf = NULL, *path;
+	size_t kbuflen, used, reclen, len;
+	cnid_t parent;
+	u_int32_t i, count = args->gp_count;
+	int error;
+
+	args->gp_resolved = 0;
+
+	if (HFSTOVCB(hfsmp)->vcbSigWord != kHFSPlusSigWord)
+		return (EOPNOTSUPP);
+	/* Paths reveal names in directories the caller may not be able to search. */
+	if ((error = priv_check_cred(cred, PRIV_VFS_ADMIN)))
+		return (error);
+	if (count == 0 || count > HFS_GETPATHS_MAX || args->gp_buf == NULL || args->gp_buflen < sizeof(struct hfs_path_entry))
+		return (EINVAL);
+
+	cnids = malloc(count * sizeof(u_int32_t), M_HFSPATH, M_WAITOK);
+	if ((error = copyin(args->gp_cnids, cnids, count * sizeof(u_int32_t))))
+		goto out;
+
+	reqs = malloc(count * sizeof(*reqs), M_HFSPATH, M_WAITOK | M_ZERO);
+	for (i = 0; i < count; i++) {
+		reqs[i].pr_index = i;
+		reqs[i].pr_cnid = cnids[i];
+	}
+	dc = malloc(sizeof(*dc), M_HFSPATH, M_WAITOK | M_ZERO);
+	for (i = 0; i < HFS_DIRCACHE_BUCKETS; i++)
+		LIST_INIT(&dc->dc_hash[i]);
+	TAILQ_INIT(&dc->dc_lru);
+
+	if ((error = hfs_metafilelocking(hfsmp, kHFSCatalogFileID, LK_SHARED, p)))
+		goto out;
+
+	/* Pass 1: thread record of each request, in ID order */
+	qsort(reqs, count, sizeof(*reqs), hfs_pathreq_bycnid);
+	for (i = 0; i < count; i++) {
+		rp = &reqs[i];
+		if (rp->pr_cnid == kHFSRootFolderID) {
+			rp->pr_parent = kHFSRootParentID;
+			continue;
+		}
+		if (rp->pr_cnid < kHFSFirstUserCatalogNodeID) {
+			rp->pr_error = ENOENT;
+			continue;
+		}
+		if (i > 0 && reqs[i - 1].pr_cnid == rp->pr_cnid) {
+			rp->pr_parent = reqs[i - 1].pr_parent;
+			rp->pr_error = reqs[i - 1].pr_error;
+			if (reqs[i - 1].pr_path != NULL) {
+				rp->pr_path = malloc(reqs[i - 1].pr_len + 1, M_HFSPATH, M_WAITOK);
+				bcopy(reqs[i - 1].pr_path, rp->pr_path, reqs[i - 1].pr_len + 1);
+				rp->pr_len = reqs[i - 1].pr_len;
+			}
+			continue;
+		}
+		rp->pr_error = cat_threadlookup(hfsmp, rp->pr_cnid, &rp->pr_parent, dc->dc_name, sizeof(dc->dc_name), &len);
+		if (rp->pr_error == 0) {
+			rp->pr_path = malloc(len + 1, M_HFSPATH, M_WAITOK);
+			bcopy(dc->dc_name, rp->pr_path, len + 1);
+			rp->pr_len = len;
+		}
+	}
+
+	/* Pass 2: grouped by parent, prepend each parent's path once */
+	qsort(reqs, count, sizeof(*reqs), hfs_pathreq_byparent);
+	parent = 0;
+	for (i = 0; i < count; i++) {
+		rp = &reqs[i];
+		if (rp->pr_error != 0)
+			continue;
+		if (rp->pr_cnid == kHFSRootFolderID) {
+			rp->pr_path = malloc(2, M_HFSPATH, M_WAITOK);
+			strlcpy(rp->pr_path, "/", 2);
+			rp->pr_len = 1;
+			continue;
+		}
+		if (dp == NULL || rp->pr_parent != parent) {
+			parent = rp->pr_parent;
+			if ((rp->pr_error = hfs_dirpath_resolve(hfsmp, dc, parent, &dp)) != 0) {
+				dp = NULL;
+				continue;
+			}
+		}
+		if (dp->dp_len + 1 + rp->pr_len >= MAXPATHLEN) {
+			rp->pr_error = ENAMETOOLONG;
+			continue;
+		}
+		path = malloc(dp->dp_len + 1 + rp->pr_len + 1, M_HFSPATH, M_WAITOK);
+		bcopy(dp->dp_path, path, dp->dp_len);
+		path[dp->dp_len] = '/';
+		bcopy(rp->pr_path, path + dp->dp_len + 1, rp->pr_len + 1);
+		free(rp->pr_path, M_HFSPATH);
+		rp->pr_path = path;
+		rp->pr_len += dp->dp_len + 1;
+	}
+
+	(void)hfs_metafilelocking(hfsmp, kHFSCatalogFileID, LK_RELEASE, p);
+
+	/* Pass 3: pack the results in request order */
+	qsort(reqs, count, sizeof(*reqs), hfs_pathreq_byindex);
+	kbuflen = min(args->gp_buflen, HFS_GETPATHS_MAXOUT);
+	kbuf = malloc(kbuflen, M_HFSPATH, M_WAITOK | M_ZERO);
+	used = 0;
+	for (i = 0; i < count; i++) {
+		rp = &reqs[i];
+		len = (rp->pr_error == 0) ? rp->pr_len : 0;
+		reclen = roundup2(offsetof(struct hfs_path_entry, pe_path) + len + 1, 8);
+		if (used + reclen > kbuflen)
+			break;
+		ep = (struct hfs_path_entry *)(kbuf + used);
+		ep->pe_reclen = reclen;
+		ep->pe_cnid = rp->pr_cnid;
+		ep->pe_error = rp->pr_error;
+		ep->pe_pathlen = len;
+		if (len > 0)
+			bcopy(rp->pr_path, ep->pe_path, len);
+		used += reclen;
+	}
+	if (i == 0) {
+		error = ENOBUFS;
+		goto out;
+	}
+	if ((error = copyout(kbuf, args->gp_buf, used)) == 0) {
+		args->gp_resolved = i;
+		args->gp_buflen = used;
+	}
+out:
+	if (dc != NULL) {
+		while ((dp = TAILQ_FIRST(&dc->dc_lru)) != NULL) {
+			TAILQ_REMOVE(&dc->dc_lru, dp, dp_lru);
+			free(dp, M_HFSPATH);
+		}
+		free(dc, M_HFSPATH);
+	}
+	if (reqs != NULL) {
+		for (i = 0; i < count; i++) {
+			if (reqs[i].pr_path != NULL)
+				free(reqs[i].pr_path, M_HFSPATH);
+		}
+		free(reqs, M_HFSPATH);
+	}
+	if (kbuf != NULL)
+		free(kbuf, M_HFSPATH);
+	if (cnids != NULL)
+		free(cnids, M_HFSPATH);
+
+	return (error);
+}
+
+/*
+ * Path of a folder, from the cache or by walking thread records up to
+ * the root (or the nearest cached ancestor).  Every folder passed on
+ * the way is cached too.
+ */
+static int
+hfs_dirpath_resolve(struct hfsmount *hfsmp, struct hfs_dircache *dc, cnid_t dirid, struct hfs_dirpath **dpp)
+{
+	struct hfs_dirpath *dp, *ancestor = NULL;
+	size_t start = sizeof(dc->dc_buf), len, prefixlen;
+	const char *prefix;
+	cnid_t cur = dirid, parent;
+	int depth = 0, error, k;
+
+	if ((dp = hfs_dircache_get(dc, dirid)) != NULL) {
+		*dpp = dp;
+		return (0);
+	}
+
+	while (cur != kHFSRootFolderID) {
+		if ((ancestor = hfs_dircache_get(dc, cur)) != NULL)
+			break;
+		if (depth == nitems(dc->dc_chain))
+			return (ENAMETOOLONG);
+		if ((error = cat_threadlookup(hfsmp, cur, &parent, dc->dc_name, sizeof(dc->dc_name), &len)))
+			return (error);
+		if (len + 1 > start)
+			return (ENAMETOOLONG);
+		start -= len;
+		bcopy(dc->dc_name, dc->dc_buf + start, len);
+		dc->dc_buf[--start] = '/';
+		dc->dc_chain[depth] = cur;
+		dc->dc_start[depth] = start;
+		depth++;
+		cur = parent;
+	}
+
+	if (ancestor != NULL) {
+		prefix = ancestor->dp_path;
+		prefixlen = ancestor->dp_len;
+	} else {
+		prefix = "";
+		prefixlen = 0;
+	}
+	if (prefixlen + (sizeof(dc->dc_buf) - start) >= MAXPATHLEN)
+		return (ENAMETOOLONG);
+
+	/* Cache from the top down; the requested folder is added last */
+	dp = ancestor;
+	if (dp == NULL && dirid == kHFSRootFolderID)
+		dp = hfs_dircache_add(dc, kHFSRootFolderID, "", 0, "", 0);
+	for (k = depth - 1; k >= 0; k--) {
+		dp = hfs_dircache_add(dc, dc->dc_chain[k], prefix, prefixlen, dc->dc_buf + start,
+		    (k > 0 ? dc->dc_start[k - 1] : sizeof(dc->dc_buf)) - start);
+		/* The ancestor may just have been evicted; use the new entry as the prefix. */
+		prefix = dp->dp_path;
+		prefixlen = dp->dp_len;
+		start = (k > 0) ? dc->dc_start[k - 1] : sizeof(dc->dc_buf);
+	}
+	*dpp = dp;
+
+	return (0);
+}
+
+static struct hfs_dirpath *
+hfs_dircache_get(struct hfs_dircache *dc, cnid_t cnid)
+{
+	struct hfs_dirpath *dp;
+
+	LIST_FOREACH(dp, &dc->dc_hash[cnid % HFS_DIRCACHE_BUCKETS], dp_hash) {
+		if (dp->dp_cnid == cnid) {
+			TAILQ_REMOVE(&dc->dc_lru, dp, dp_lru);
+			TAILQ_INSERT_HEAD(&dc->dc_lru, dp, dp_lru);
+			return (dp);
+		}
+	}
+
+	return (NULL);
+}
+
+static struct hfs_dirpath *
+hfs_dircache_add(struct hfs_dircache *dc, cnid_t cnid, const char *prefix, size_t prefixlen, const char *suffix, size_t suffixlen)
+{
+	struct hfs_dirpath *dp;
+
+	dp = malloc(sizeof(*dp) + prefixlen + suffixlen + 1, M_HFSPATH, M_WAITOK);
+	dp->dp_cnid = cnid;
+	dp->dp_len = prefixlen + suffixlen;
+	bcopy(prefix, dp->dp_path, prefixlen);
+	bcopy(suffix, dp->dp_path + prefixlen, suffixlen);
+	dp->dp_path[dp->dp_len] = '\0';
+
+	if (dc->dc_count == HFS_DIRCACHE_MAX) {
+		struct hfs_dirpath *old = TAILQ_LAST(&dc->dc_lru, hfs_dirpath_lru);
+
+		TAILQ_REMOVE(&dc->dc_lru, old, dp_lru);
+		LIST_REMOVE(old, dp_hash);
+		free(old, M_HFSPATH);
+		dc->dc_count--;
+	}
+	LIST_INSERT_HEAD(&dc->dc_hash[cnid % HFS_DIRCACHE_BUCKETS], dp, dp_hash);
+	TAILQ_INSERT_HEAD(&dc->dc_lru, dp, dp_lru);
+	dc->dc_count++;
+
+	return (dp);
+}
+
+static int
+hfs_pathreq_bycnid(const void *a, const void *b)
+{
+	const struct hfs_pathreq *ra = a, *rb = b;
+
+	return ((ra->pr_cnid > rb->pr_cnid) - (ra->pr_cnid < rb->pr_cnid));
+}
+
+static int
+hfs_pathreq_byparent(const void *a, const void *b)
+{
+	const struct hfs_pathreq *ra = a, *rb = b;
+
+	return ((ra->pr_parent > rb->pr_parent) - (ra->pr_parent < rb->pr_parent));
+}
+
+static int
+hfs_pathreq_byindex(const void *a, const void *b)
+{
+	const struct hfs_pathreq *ra = a, *rb = b;
+
+	return ((ra->pr_index > rb->pr_index) - (ra->pr_index < rb->pr_index));
+}
@@ -68,6 +68,7 @@
 #include <hfsplus/hfs_cnode.h>
 #include <hfsplus/hfs_dbg.h>
 #include <hfsplus/hfs_endian.h>
+#include <hfsplus/hfs_fsctl.h>
 #include <hfsplus/hfs_quota.h>
 
 #include "hfscommon/headers/BTreesInternal.h"
@@ -129,6 +130,10 @@ hfs_read(struct vop_read_args *ap)
 	if (uio->uio_offset < 0)
 		return (EINVAL); /* cant read from a negative offset */
 
+	/* Compressed files keep their data in an xattr or the resource fork */
+	if (hfs_decmpfs_iscompressed(vp))
+		return (hfs_decmpfs_read(vp, uio));
+
 	filesize = fp->ff_size;
 	// filebytes = (off_t)fp->ff_blocks * (off_t)VTOVCB(vp)->blockSize;
 	if (uio->uio_offset > filesize) {
@@ -398,6 +403,8 @@ hfs_write(struct vop_write_args *ap)
 		return (E_NONE);
 	if (vp->v_type != VREG && vp->v_type != VLNK)
 		return (EISDIR); /* Can only write files */
+	if (hfs_decmpfs_iscompressed(vp))
+		return (EPERM); /* Compressed files are read-only */
 
 	cp = VTOC(vp);
 	fp = VTOF(vp);
@@ -806,13 +813,22 @@ hfs_ioctl(struct vop_ioctl_args *ap)
 {
 	/* {
 	       struct vnode *a_vp;
-	       int  a_command;
+	       u_long  a_command;
 	       caddr_t  a_data;
 	       int  a_fflag;
 	       struct ucred *a_cred;
-	       struct proc *a_p;
+	       struct thread *a_td;
        } */
-	return EOPNOTSUPP;
+	switch (ap->a_command) {
+	case HFSIOC_SEARCHFS:
+		return (hfs_searchfs(ap->a_vp, (struct hfs_search_args *)ap->a_data, ap->a_cred));
+	case HFSIOC_GETPATHS:
+		return (hfs_getpaths(ap->a_vp, (struct hfs_getpaths_args *)ap->a_data, ap->a_cred));
+	case HFSIOC_BTCOMPACT:
+		return (hfs_btcompact(ap->a_vp, (struct hfs_btcompact_args *)ap->a_data, ap->a_cred));
+	default:
+		return (ENOTTY);
+	}
 }
 
 /*
@@ -1396,7 +1412,7 @@ hfs_bwrite(struct buf *bp)
 	BlockDescriptor block;
 
 	/* Trap B-Tree writes */
-	if ((VTOC(vp)->c_fileid == kHFSExtentsFileID) || (VTOC(vp)->c_fileid == kHFSCatalogFileID)) {
+	if ((VTOC(vp)->c_fileid == kHFSExtentsFileID) || (VTOC(vp)->c_fileid == kHFSCatalogFileID) || (VTOC(vp)->c_fileid == kHFSAttributesFileID)) {
 		/* Swap if the B-Tree node is in native byte order */
 		if (((UInt16 *)((char *)bp->b_data + bp->b_bcount - 2))[0] == 0x000e) {
 			/* Prepare the block pointer */
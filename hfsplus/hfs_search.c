@@ -0,0 +1,338 @@
+/*
+ * hfs_search.c
+ *
+ * Catalog search (HFSIOC_SEARCHFS).
+ *
+ * Modeled on xnu's hfs_vnop_search: rather than walking the directory
+ * tree, the catalog B-tree's leaf nodes are read straight off the disk
+ * in large multi-node reads (see BTreeScanner.c) and each file and
+ * folder record is filtered in the kernel.  The scan position is
+ * handed back to the caller so a search can be resumed across calls.
+ */
+
+#ifndef HFS_SEARCH_TEST
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/dirent.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mount.h>
+#include <sys/priv.h>
+#include <sys/proc.h>
+#include <sys/time.h>
+#include <sys/utfconv.h>
+#include <sys/vnode.h>
+
+#include <hfsplus/hfs.h>
+#include <hfsplus/hfs_catalog.h>
+#include <hfsplus/hfs_cnode.h>
+#include <hfsplus/hfs_dbg.h>
+#include <hfsplus/hfs_fsctl.h>
+
+#include "hfscommon/headers/BTreeScanner.h"
+#include "hfscommon/headers/BTreesPrivate.h"
+#include "hfscommon/headers/FileMgrInternal.h"
+#endif
+
+#define HFS_SEARCH_READSIZE   MAXBSIZE	       /* catalog bytes per device read */
+#define HFS_SEARCH_MAXRESULTS (1024 * 1024)    /* largest result buffer staged in the kernel */
+#define HFS_SEARCH_NAMEBYTES  (3 * kHFSPlusMaxFileNameChars + 1)
+
+#define errSearchBufferFull 101 /* internal: the last match didn't fit */
+
+struct hfs_searchstate {
+	u_int32_t ss_options;
+	struct hfs_search_criteria *ss_criteria;
+	char ss_name[HFS_SEARCH_NAMEBYTES]; /* criteria name, decomposed */
+	size_t ss_namelen;
+	char ss_recname[HFS_SEARCH_NAMEBYTES]; /* scratch: current record's name */
+	size_t ss_recnamelen;
+	u_int16_t ss_ucs[kHFSPlusMaxFileNameChars];
+	cnid_t ss_privdir;
+};
+
+static int hfs_search_setup(struct hfsmount *hfsmp, struct hfs_search_args *args, struct hfs_searchstate *ss);
+static int hfs_search_recname(struct hfs_searchstate *ss, const HFSPlusCatalogKey *key);
+static int hfs_search_match(struct hfs_searchstate *ss, const HFSPlusCatalogKey *key, const CatalogRecord *rec);
+static int hfs_search_insert(struct hfs_searchstate *ss, const HFSPlusCatalogKey *key, const CatalogRecord *rec, char *buf, size_t buflen,
+    size_t *usedp);
+static int hfs_search_substr(const char *str, size_t len, const char *pat, size_t patlen);
+
+int
+hfs_searchfs(struct vnode *vp, struct hfs_search_args *args, struct ucred *cred)
+{
+	struct hfsmount *hfsmp = VTOHFS(vp);
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	struct hfs_searchstate *ss = NULL;
+	struct hfs_search_cursor *pos = &args->sa_cursor;
+	BTScanState scan;
+	HFSPlusCatalogKey *key;
+	CatalogRecord *rec;
+	struct timeval now, elapsed;
+	proc_t *p = curthread;
+	char *kbuf = NULL;
+	size_t kbuflen, used = 0;
+	u_int32_t searchtime;
+	Boolean timerexpired = false;
+	int error;
+
+	args->sa_nummatches = 0;
+	args->sa_options &= ~HFS_SRCH_DONE;
+
+	if (vcb->vcbSigWord != kHFSPlusSigWord)
+		return (EOPNOTSUPP);
+	/* Results bypass per-directory search permission checks. */
+	if ((error = priv_check_cred(cred, PRIV_VFS_ADMIN)))
+		return (error);
+	if (args->sa_buf == NULL || args->sa_buflen < sizeof(struct hfs_search_entry))
+		return (EINVAL);
+
+	searchtime = kMaxMicroSecsInKernel;
+	if (args->sa_timelimit > 0 && args->sa_timelimit < kMaxMicroSecsInKernel)
+		searchtime = args->sa_timelimit;
+
+	ss = malloc(sizeof(*ss), M_TEMP, M_WAITOK | M_ZERO);
+	if ((error = hfs_search_setup(hfsmp, args, ss)))
+		goto out;
+
+	kbuflen = min(args->sa_buflen, HFS_SEARCH_MAXRESULTS);
+	kbuf = malloc(kbuflen, M_TEMP, M_WAITOK);
+
+	if (args->sa_options & HFS_SRCH_START) {
+		/* Make sure the on-disk catalog is current; the scan bypasses the buffer cache. */
+		if ((error = hfs_metafilelocking(hfsmp, kHFSCatalogFileID, LK_EXCLUSIVE, p)))
+			goto out;
+		error = VOP_FSYNC(vcb->catalogRefNum, MNT_WAIT, p);
+		(void)hfs_metafilelocking(hfsmp, kHFSCatalogFileID, LK_RELEASE, p);
+		if (error)
+			goto out;
+		args->sa_options &= ~HFS_SRCH_START;
+		bzero(pos, sizeof(*pos));
+	}
+
+	if ((error = hfs_metafilelocking(hfsmp, kHFSCatalogFileID, LK_SHARED, p)))
+		goto out;
+
+	error = BTScanInitialize(VTOF(vcb->catalogRefNum), pos->hc_nextnode, pos->hc_nextrecord, pos->hc_recordsfound, HFS_SEARCH_READSIZE,
+	    &scan);
+	if (error) {
+		(void)hfs_metafilelocking(hfsmp, kHFSCatalogFileID, LK_RELEASE, p);
+		error = MacToVFSError(error);
+		goto out;
+	}
+	/* Make sure the catalog hasn't changed since the last call. */
+	if (pos->hc_writecount != 0 && pos->hc_writecount != scan.btcb->writeCount) {
+		pos->hc_writecount = scan.btcb->writeCount;
+		(void)BTScanTerminate(&scan, &pos->hc_nextnode, &pos->hc_nextrecord, &pos->hc_recordsfound);
+		(void)hfs_metafilelocking(hfsmp, kHFSCatalogFileID, LK_RELEASE, p);
+		error = EBUSY;
+		goto out;
+	}
+
+	for (;;) {
+		error = BTScanNextRecord(&scan, timerexpired, (void **)&key, (void **)&rec, NULL);
+		if (error)
+			break;
+
+		if (hfs_search_match(ss, key, rec)) {
+			error = hfs_search_insert(ss, key, rec, kbuf, kbuflen, &used);
+			if (error) {
+				/* The last match didn't fit; come back to it on the next call. */
+				--scan.recordsFound;
+				--scan.recordNum;
+				break;
+			}
+			if (++args->sa_nummatches == args->sa_maxmatches)
+				break;
+		}
+
+		if (!timerexpired) {
+			/*
+			 * Bound the time spent in the kernel; once expired we
+			 * finish the nodes already in memory but don't read more.
+			 */
+			microuptime(&now);
+			timersub(&now, &scan.startTime, &elapsed);
+			if (elapsed.tv_sec > 0 || elapsed.tv_usec >= searchtime)
+				timerexpired = true;
+		}
+	}
+
+	pos->hc_writecount = scan.btcb->writeCount;
+	(void)BTScanTerminate(&scan, &pos->hc_nextnode, &pos->hc_nextrecord, &pos->hc_recordsfound);
+	(void)hfs_metafilelocking(hfsmp, kHFSCatalogFileID, LK_RELEASE, p);
+
+	if (error == btNotFound) {
+		args->sa_options |= HFS_SRCH_DONE; /* the entire catalog has been searched */
+		error = 0;
+	} else if (error == errSearchBufferFull) {
+		error = (args->sa_nummatches > 0) ? 0 : ENOBUFS;
+	} else if (error == fsBTTimeOutErr) {
+		error = 0;
+	} else {
+		error = MacToVFSError(error);
+	}
+
+	if (error == 0 && used > 0)
+		error = copyout(kbuf, args->sa_buf, used);
+	args->sa_buflen = used;
+out:
+	if (kbuf != NULL)
+		free(kbuf, M_TEMP);
+	free(ss, M_TEMP);
+
+	return (error);
+}
+
+/*
+ * Validate the criteria and convert the name to the form used on disk.
+ */
+static int
+hfs_search_setup(struct hfsmount *hfsmp, struct hfs_search_args *args, struct hfs_searchstate *ss)
+{
+	struct hfs_search_criteria *sc = &args->sa_criteria;
+	size_t len, ucslen;
+	int error;
+
+	ss->ss_options = args->sa_options;
+	ss->ss_criteria = sc;
+	ss->ss_privdir = hfsmp->hfs_private_metadata_dir;
+	if ((ss->ss_options & (HFS_SRCH_FILES | HFS_SRCH_DIRS)) == 0)
+		ss->ss_options |= HFS_SRCH_FILES | HFS_SRCH_DIRS;
+
+	if ((ss->ss_options & (HFS_SRCH_NAME | HFS_SRCH_EXACT)) == 0)
+		return (0);
+
+	len = strnlen(sc->sc_name, sizeof(sc->sc_name));
+	if (len == 0 || len == sizeof(sc->sc_name))
+		return (EINVAL);
+
+	/* Round trip through UCS-2 so composed input matches decomposed names */
+	error = utf8_decodestr((u_int8_t *)sc->sc_name, len, ss->ss_ucs, &ucslen, sizeof(ss->ss_ucs), ':', UTF_DECOMPOSED);
+	if (error == 0)
+		error = utf8_encodestr(ss->ss_ucs, ucslen, (u_int8_t *)ss->ss_name, &ss->ss_namelen, sizeof(ss->ss_name), ':', 0);
+
+	return (error ? EINVAL : 0);
+}
+
+static int
+hfs_search_recname(struct hfs_searchstate *ss, const HFSPlusCatalogKey *key)
+{
+	return (utf8_encodestr(key->nodeName.unicode, key->nodeName.length * sizeof(UniChar), (u_int8_t *)ss->ss_recname, &ss->ss_recnamelen,
+	    sizeof(ss->ss_recname), ':', 0));
+}
+
+/*
+ * ASCII case-insensitive search for pat in the first len bytes of str.
+ */
+static int
+hfs_search_substr(const char *str, size_t len, const char *pat, size_t patlen)
+{
+	size_t i;
+
+	for (i = 0; i + patlen <= len; i++) {
+		if (strncasecmp(str + i, pat, patlen) == 0)
+			return (1);
+	}
+
+	return (0);
+}
+
+static int
+hfs_search_match(struct hfs_searchstate *ss, const HFSPlusCatalogKey *key, const CatalogRecord *rec)
+{
+	struct hfs_search_criteria *sc = ss->ss_criteria;
+	u_int32_t cnid, mtime;
+	int isdir;
+
+	switch (rec->recordType) {
+	case kHFSPlusFolderRecord:
+		isdir = 1;
+		cnid = rec->hfsPlusFolder.folderID;
+		mtime = rec->hfsPlusFolder.contentModDate;
+		break;
+	case kHFSPlusFileRecord:
+		isdir = 0;
+		cnid = rec->hfsPlusFile.fileID;
+		mtime = rec->hfsPlusFile.contentModDate;
+		break;
+	default:
+		return (0); /* thread records */
+	}
+
+	if (isdir ? !(ss->ss_options & HFS_SRCH_DIRS) : !(ss->ss_options & HFS_SRCH_FILES))
+		return (0);
+
+	/* Never report the root's parent or the hidden metadata folder */
+	if (cnid < kHFSFirstUserCatalogNodeID && cnid != kHFSRootFolderID)
+		return (0);
+	if (ss->ss_privdir != 0 && (cnid == ss->ss_privdir || key->parentID == ss->ss_privdir))
+		return (0);
+
+	if ((ss->ss_options & HFS_SRCH_PARENT) && key->parentID != sc->sc_parentid)
+		return (0);
+
+	if (ss->ss_options & HFS_SRCH_SIZE) {
+		if (isdir || rec->hfsPlusFile.dataFork.logicalSize < sc->sc_minsize ||
+		    rec->hfsPlusFile.dataFork.logicalSize > sc->sc_maxsize)
+			return (0);
+	}
+
+	if (ss->ss_options & HFS_SRCH_MTIME) {
+		if ((int64_t)to_bsd_time(mtime) < sc->sc_mintime || (int64_t)to_bsd_time(mtime) > sc->sc_maxtime)
+			return (0);
+	}
+
+	/* Names last: they have to be converted */
+	if (ss->ss_options & (HFS_SRCH_NAME | HFS_SRCH_EXACT)) {
+		if (hfs_search_recname(ss, key) != 0)
+			return (0);
+		if (ss->ss_options & HFS_SRCH_EXACT) {
+			if (ss->ss_recnamelen != ss->ss_namelen || strncasecmp(ss->ss_recname, ss->ss_name, ss->ss_namelen) != 0)
+				return (0);
+		} else if (!hfs_search_substr(ss->ss_recname, ss->ss_recnamelen, ss->ss_name, ss->ss_namelen)) {
+			return (0);
+		}
+	}
+
+	return (1);
+}
+
+static int
+hfs_search_insert(struct hfs_searchstate *ss, const HFSPlusCatalogKey *key, const CatalogRecord *rec, char *buf, size_t buflen,
+    size_t *usedp)
+{
+	struct hfs_search_entry *ep;
+	size_t reclen;
+
+	/* The name may already have been converted by the name filter */
+	if ((ss->ss_options & (HFS_SRCH_NAME | HFS_SRCH_EXACT)) == 0 && hfs_search_recname(ss, key) != 0)
+		ss->ss_recnamelen = 0;
+
+	reclen = roundup2(offsetof(struct hfs_search_entry, se_name) + ss->ss_recnamelen + 1, 8);
+	if (*usedp + reclen > buflen)
+		return (errSearchBufferFull);
+
+	ep = (struct hfs_search_entry *)(buf + *usedp);
+	ep->se_reclen = reclen;
+	ep->se_parentid = key->parentID;
+	ep->se_namlen = ss->ss_recnamelen;
+	if (rec->recordType == kHFSPlusFolderRecord) {
+		ep->se_type = DT_DIR;
+		ep->se_fileid = rec->hfsPlusFolder.folderID;
+		ep->se_size = rec->hfsPlusFolder.valence;
+		ep->se_mtime = to_bsd_time(rec->hfsPlusFolder.contentModDate);
+	} else {
+		ep->se_type = DT_REG;
+		ep->se_fileid = rec->hfsPlusFile.fileID;
+		ep->se_size = rec->hfsPlusFile.dataFork.logicalSize;
+		ep->se_mtime = to_bsd_time(rec->hfsPlusFile.contentModDate);
+	}
+	bcopy(ss->ss_recname, ep->se_name, ss->ss_recnamelen);
+	bzero(ep->se_name + ss->ss_recnamelen, reclen - offsetof(struct hfs_search_entry, se_name) - ss->ss_recnamelen);
+	*usedp += reclen;
+
+	return (0);
+}
@@ -22,6 +22,8 @@
 
 static MALLOC_DEFINE(M_HFSMNT, "HFS mount", "HFS mount data");
 
+SYSCTL_NODE(_vfs, OID_AUTO, hfs, CTLFLAG_RW | CTLFLAG_MPSAFE, 0, "HFS filesystem");
+
 static int
 hfs_mountfs(struct vnode *devvp, struct mount *mp)
 {
@@ -296,6 +298,8 @@ hfs_mountfs(struct vnode *devvp, struct mount *mp)
 		goto error_exit;
 	}
 
+	hfs_trim_init(hfsmp);
+
 	vfs_getnewfsid(mp);
 	mp->mnt_flag |= MNT_LOCAL;
 	devvp->v_rdev->si_mountpt = mp; /* used by vfs_mountedon() */
@@ -475,7 +479,7 @@ hfs_sync(struct mount*mp, int waitfor)
 	struct cnode *cp;
 	struct hfsmount *hfsmp = VFSTOHFS(mp);
 	ExtendedVCB *vcb;
-	struct vnode *meta_vp[3];
+	struct vnode *meta_vp[4];
 	int i;
 	int error, allerror = 0;
 	proc_t *p = curthread;
@@ -532,10 +536,11 @@ loop:
 	meta_vp[0] = vcb->extentsRefNum;
 	meta_vp[1] = vcb->catalogRefNum;
 	meta_vp[2] = vcb->allocationsRefNum; /* This is NULL for standard HFS */
+	meta_vp[3] = vcb->attributesRefNum;  /* This is NULL without an attributes file */
 	// MNT_IUNLOCK(mp);
 
-	/* Now sync our three metadata files */
-	for (i = 0; i < 3; ++i) {
+	/* Now sync our metadata files */
+	for (i = 0; i < 4; ++i) {
 		struct vnode *btvp;
 
 		btvp = meta_vp[i];
@@ -588,6 +593,9 @@ loop:
 	}
 #endif
 
+	/* The freed extents are no longer referenced on disk; trim them */
+	hfs_trim_flush(hfsmp);
+
 //err_exit:
 	return (allerror);
 }
@@ -640,6 +648,14 @@ hfs_unmount(struct mount *mp, int mntflags)
 		if (retval && !force)
 			goto err_exit;
 
+		if (HFSTOVCB(hfsmp)->attributesRefNum) {
+			vn_lock(HFSTOVCB(hfsmp)->attributesRefNum, LK_EXCLUSIVE | LK_RETRY);
+			retval = VOP_FSYNC(HFSTOVCB(hfsmp)->attributesRefNum, MNT_WAIT, p);
+			VOP_UNLOCK(HFSTOVCB(hfsmp)->attributesRefNum);
+			if (retval && !force)
+				goto err_exit;
+		}
+
 		// if we have an allocation file, sync it too so we don't leave dirty
 		// blocks around
 		if (HFSTOVCB(hfsmp)->allocationsRefNum) {
@@ -688,6 +704,12 @@ hfs_unmount(struct mount *mp, int mntflags)
 		journal_flush(hfsmp->jnl);
 	}
 #endif
+
+	/*
+	 *	Stop the free space scan and drain outstanding trims
+	 */
+	hfs_trim_destroy(hfsmp);
+
 	/*
 	 *	Invalidate our caches and release metadata vnodes
 	 */
@@ -1063,6 +1085,19 @@ hfs_flushvolumeheader(struct hfsmount *hfsmp, int waitfor, int altflush)
 	volumeHeader->allocationFile.totalBlocks = SWAP_BE32(fp->ff_blocks);
 	volumeHeader->allocationFile.clumpSize = SWAP_BE32(fp->ff_clumpsize);
 
+	/* Sync Attributes file meta data */
+	if (vcb->attributesRefNum) {
+		fp = VTOF(vcb->attributesRefNum);
+		for (i = 0; i < kHFSPlusExtentDensity; i++) {
+			volumeHeader->attributesFile.extents[i].startBlock = SWAP_BE32(fp->ff_extents[i].startBlock);
+			volumeHeader->attributesFile.extents[i].blockCount = SWAP_BE32(fp->ff_extents[i].blockCount);
+		}
+		FTOC(fp)->c_flag &= ~C_MODIFIED;
+		volumeHeader->attributesFile.logicalSize = SWAP_BE64(fp->ff_size);
+		volumeHeader->attributesFile.totalBlocks = SWAP_BE32(fp->ff_blocks);
+		volumeHeader->attributesFile.clumpSize = SWAP_BE32(fp->ff_clumpsize);
+	}
+
 	/* If requested, flush out the alternate volume header */
 	if (altflush) {
 		struct buf *alt_bp = NULL;
@@ -1208,6 +1243,7 @@ hfs_init(struct vfsconf *vfsp)
 	//	dqinit();
 	// #endif
 	(void)InitCatalogCache();
+	hfs_decmpfs_init();
 
 	return (0);
 }
@@ -1215,6 +1251,7 @@ hfs_init(struct vfsconf *vfsp)
 static int
 hfs_uninit(struct vfsconf *vfsp)
 {
+	hfs_decmpfs_uninit();
 	DestroyCatalogCache();
 	hfs_converterdestroy();
 	hfs_chashdestroy();
@@ -86,6 +86,7 @@ extern OSStatus ReleaseBTreeBlock(FileReference vp, BlockDescPtr blockPtr, Relea
 char hfs_catname[] = "Catalog B-tree";
 char hfs_extname[] = "Extents B-tree";
 char hfs_vbmname[] = "Volume Bitmap";
+char hfs_attrname[] = "Attribute B-tree";
 
 char hfs_privdirname[] = "\xE2\x90\x80\xE2\x90\x80\xE2\x90\x80\xE2\x90\x80HFS+ Private Data";
 
@@ -450,6 +451,32 @@ hfs_MountHFSPlusVolume(struct hfsmount *hfsmp, HFSPlusVolumeHeader *vhp, off_t e
 	VOP_UNLOCK(vcb->catalogRefNum);
 	VOP_UNLOCK(vcb->extentsRefNum);
 
+	/*
+	 * Set up Attributes B-tree vnode (optional)
+	 */
+	if (vhp->attributesFile.totalBlocks != 0) {
+		cndesc.cd_nameptr = hfs_attrname;
+		cndesc.cd_namelen = strlen(hfs_attrname);
+		cndesc.cd_cnid = cnattr.ca_fileid = kHFSAttributesFileID;
+		cnattr.ca_nlink = 1;
+		cnattr.ca_mode = S_IFREG;
+
+		SWAP_HFS_PLUS_FORK_DATA(&vhp->attributesFile);
+		cnattr.ca_blocks = vhp->attributesFile.totalBlocks;
+
+		retval = hfs_getnewvnode(hfsmp, NULL, &cndesc, 0, &cnattr, (struct cat_fork *)&vhp->attributesFile, &vcb->attributesRefNum);
+		SWAP_HFS_PLUS_FORK_DATA(&vhp->attributesFile);
+		if (retval)
+			goto ErrorExit;
+
+		retval = MacToVFSError(BTOpenPath(VTOF(vcb->attributesRefNum), (KeyCompareProcPtr)hfs_attrkeycompare, GetBTreeBlock, ReleaseBTreeBlock,
+		    ExtendBTreeFile, SetBTreeBlockSize));
+		VOP_UNLOCK(vcb->attributesRefNum);
+		if (retval)
+			goto ErrorExit;
+	}
+	hfs_xattr_init(hfsmp);
+
 	/* setup private/hidden directory for unlinked files */
 	hfsmp->hfs_private_metadata_dir = FindMetaDataDirectory(vcb);
 
@@ -471,6 +498,7 @@ ErrorExit:
 	 * release any resources that we aquired...
 	 */
 	InvalidateCatalogCache(vcb);
+	ReleaseMetaFileVNode(vcb->attributesRefNum);
 	ReleaseMetaFileVNode(vcb->allocationsRefNum);
 	ReleaseMetaFileVNode(vcb->catalogRefNum);
 	ReleaseMetaFileVNode(vcb->extentsRefNum);
@@ -517,6 +545,7 @@ hfsUnmount(register struct hfsmount *hfsmp, proc_t *p)
 	InvalidateCatalogCache(vcb);
 
 	if (vcb->vcbSigWord == kHFSPlusSigWord) {
+		ReleaseMetaFileVNode(vcb->attributesRefNum);
 		ReleaseMetaFileVNode(vcb->allocationsRefNum);
 	}
 
@@ -581,6 +610,10 @@ hfs_metafilelocking(struct hfsmount *hfsmp, u_long fileID, u_int flags, proc_t *
 		vp = vcb->catalogRefNum;
 		break;
 
+	case kHFSAttributesFileID:
+		vp = vcb->attributesRefNum;
+		break;
+
 	case kHFSAllocationFileID:
 		/* bitmap is covered by Extents B-tree locking */
 		/* FALL THROUGH */
@@ -1027,7 +1060,11 @@ hfs_remove_orphans(struct hfsmount *hfsmp)
 				}
 			}
 
-			/* Remove the file record from the Catalog */
+			/* Remove its extended attributes, then the file record from the Catalog */
+			if ((filerec.flags & kHFSHasAttributesMask) && hfs_removeallattr(hfsmp, filerec.fileID, curthread) != 0) {
+				printf("error removing attributes!\n");
+				break;
+			}
 			if (cat_delete(hfsmp, &cnode.c_desc, &cnode.c_attr) != 0) {
 				printf("error deleting cat rec!\n");
 				break;
@@ -410,8 +410,8 @@ hfs_fsync(struct vop_fsync_args *ap)
 		was_nocache = ISSET(vp->v_flag, VNOCACHE_DATA);
 		SET(vp->v_flag, VNOCACHE_DATA);	/* Don't cache zeros */
 
-		while (!TAILQ_EMPTY(&fp->ff_invalidranges)) {
-			struct rl_entry *invalid_range = TAILQ_FIRST(&fp->ff_invalidranges);
+		while (!RL_EMPTY(&fp->ff_invalidranges)) {
+			struct rl_entry *invalid_range = RL_FIRST(&fp->ff_invalidranges);
 			off_t start = invalid_range->rl_start;
 			off_t end = invalid_range->rl_end;
     		
@@ -703,9 +703,9 @@ hfs_update(struct vnode *vp, struct timeval *access, struct timeval *modify, int
 	 * field representing the size of the file (cf_size)
 	 * must be no larger than the start of the first hole.
 	 */
-	if (dataforkp && !TAILQ_EMPTY(&cp->c_datafork->ff_invalidranges)) {
+	if (dataforkp && !RL_EMPTY(&cp->c_datafork->ff_invalidranges)) {
 		bcopy(dataforkp, &datafork, sizeof(datafork));
-		datafork.cf_size = TAILQ_FIRST(&cp->c_datafork->ff_invalidranges)->rl_start;
+		datafork.cf_size = RL_FIRST(&cp->c_datafork->ff_invalidranges)->rl_start;
 		dataforkp = &datafork;
 	}
 
@@ -1097,17 +1097,17 @@ struct vop_vector hfs_vnodeops = {
 	.vop_close = hfs_close,
 	.vop_closeextattr = ((void *)(uintptr_t)log_notsupp),
 	.vop_create = hfs_create,
-	.vop_deleteextattr = ((void *)(uintptr_t)log_notsupp),
+	.vop_deleteextattr = hfs_deleteextattr,
 	.vop_fsync = hfs_fsync,
 	.vop_getacl = ((void *)(uintptr_t)log_notsupp),
 	.vop_getattr = hfs_getattr,
-	.vop_getextattr = ((void *)(uintptr_t)log_notsupp),
+	.vop_getextattr = hfs_getextattr,
 	.vop_inactive = hfs_inactive,
 	.vop_islocked = hfs_islocked,
 	.vop_lock1 = hfs_lock1,
 	.vop_ioctl = hfs_ioctl,
 	.vop_link = ((void *)(uintptr_t)log_notsupp),
-	.vop_listextattr = ((void *)(uintptr_t)log_notsupp),
+	.vop_listextattr = hfs_listextattr,
 	.vop_lookup = hfs_lookup,
 	.vop_mkdir = hfs_mkdir,
 	.vop_mknod = ((void *)(uintptr_t)log_notsupp),
@@ -1125,7 +1125,7 @@ struct vop_vector hfs_vnodeops = {
 	.vop_rmdir = ((void *)(uintptr_t)log_notsupp),
 	.vop_setacl = ((void *)(uintptr_t)log_notsupp),
 	.vop_setattr = hfs_setattr,
-	.vop_setextattr = ((void *)(uintptr_t)log_notsupp),
+	.vop_setextattr = hfs_setextattr,
 	.vop_setlabel = ((void *)(uintptr_t)log_notsupp),
 	.vop_strategy = hfs_strategy,
 	.vop_symlink = ((void *)(uintptr_t)log_notsupp),
@@ -0,0 +1,1005 @@
+/*
+ * hfs_xattr.c
+ *
+ * Extended attribute support for HFS Plus.
+ *
+ * Attributes live in the attributes b-tree, keyed by (fileID, name,
+ * startBlock).  Small values are stored inline in the leaf record
+ * (kHFSPlusAttrInlineData); larger values are stored in allocation
+ * blocks described by a kHFSPlusAttrForkData record, with any extents
+ * beyond the first eight in kHFSPlusAttrExtents records.
+ *
+ * The catalog record's kHFSHasAttributesMask flag is kept in sync with
+ * the b-tree so that the common case of a file without attributes can
+ * be answered without touching the attributes b-tree at all.
+ *
+ * Only the user namespace is exported; attribute names are stored as
+ * given (no "user." prefix).
+ */
+
+/*
+ * xnu/tests/hfs_xattr_test.c builds this file against the fsck_hfs
+ * B-tree code, with HFS_XATTR_TEST defined.
+ */
+#ifndef HFS_XATTR_TEST
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/bio.h>
+#include <sys/buf.h>
+#include <sys/extattr.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/mount.h>
+#include <sys/priv.h>
+#include <sys/proc.h>
+#include <sys/uio.h>
+#include <sys/utfconv.h>
+#include <sys/vnode.h>
+
+#include <hfsplus/hfs.h>
+#include <hfsplus/hfs_catalog.h>
+#include <hfsplus/hfs_cnode.h>
+#include <hfsplus/hfs_dbg.h>
+#include <hfsplus/hfs_format.h>
+
+#include "hfscommon/headers/BTreesInternal.h"
+#include "hfscommon/headers/FileMgrInternal.h"
+#endif
+
+/* Largest attribute value we are willing to store. */
+#define HFS_XATTR_MAXSIZE (128 * 1024)
+
+/* Holds the data of a compressed file; see hfs_decmpfs.c */
+#define HFS_DECMPFS_XATTR_NAME "com.apple.decmpfs"
+
+static MALLOC_DEFINE(M_HFSXATTR, "hfs_xattr", "HFS extended attributes");
+
+static int hfs_buildattrkey(u_int32_t fileID, const char *attrname, HFSPlusAttrKey *key);
+static size_t hfs_attrrecsize(struct hfsmount *hfsmp);
+static int hfs_attrextents(struct hfsmount *hfsmp, FCB *btfile, const HFSPlusAttrKey *key, const HFSPlusForkData *fork,
+    HFSPlusExtentDescriptor **extentsp, u_int32_t *countp);
+static int hfs_readattrblocks(struct hfsmount *hfsmp, const HFSPlusExtentDescriptor *extents, u_int32_t count, size_t size,
+    struct uio *uio);
+static int hfs_writeattrblocks(struct hfsmount *hfsmp, const HFSPlusExtentDescriptor *extents, u_int32_t count, const void *data,
+    size_t size);
+static int hfs_allocattrblocks(struct hfsmount *hfsmp, size_t size, HFSPlusExtentRecord extents, proc_t *p);
+static void hfs_freeattrblocks(struct hfsmount *hfsmp, const HFSPlusExtentDescriptor *extents, u_int32_t count, proc_t *p);
+static int hfs_releaseattrblocks(struct hfsmount *hfsmp, FCB *btfile, BTreeIterator *iterator, const HFSPlusAttrRecord *recp,
+    proc_t *p);
+static int hfs_removeattr(struct hfsmount *hfsmp, FCB *btfile, BTreeIterator *iterator, void *recbuf, proc_t *p);
+static int hfs_hasattributes(FCB *btfile, u_int32_t fileID, BTreeIterator *iterator);
+static void hfs_setattrflag(struct vnode *vp, int hasattrs);
+static int hfs_xattr_check(struct vnode *vp, int attrnamespace, struct ucred *cred, struct thread *td, accmode_t accmode);
+static int hfs_xattr_protected(const char *name, struct ucred *cred);
+static int hfs_getxattr_internal(struct vnode *vp, const char *name, struct uio *uio, size_t *sizep);
+
+/*
+ * Compare two attribute b-tree keys.
+ *
+ * Keys are ordered by file ID, then by name (binary compare of the
+ * UTF-16 characters, shorter name first), then by starting block.
+ */
+int
+hfs_attrkeycompare(HFSPlusAttrKey *searchKey, HFSPlusAttrKey *trialKey)
+{
+	u_int16_t *str1, *str2;
+	int length1, length2, length;
+	int result = 0;
+
+	if (searchKey->fileID != trialKey->fileID)
+		return (searchKey->fileID < trialKey->fileID ? -1 : 1);
+
+	str1 = &searchKey->attrName[0];
+	str2 = &trialKey->attrName[0];
+	length1 = searchKey->attrNameLen;
+	length2 = trialKey->attrNameLen;
+
+	if (length1 < length2) {
+		length = length1;
+		--result;
+	} else if (length1 > length2) {
+		length = length2;
+		++result;
+	} else {
+		length = length1;
+	}
+
+	while (length--) {
+		if (*str1 != *str2) {
+			result = (*str1 < *str2) ? -1 : 1;
+			break;
+		}
+		++str1;
+		++str2;
+	}
+	if (result)
+		return (result);
+
+	/* Names are equal; compare startBlock */
+	if (searchKey->startBlock == trialKey->startBlock)
+		return (0);
+	return (searchKey->startBlock < trialKey->startBlock ? -1 : 1);
+}
+
+/*
+ * Compute the largest attribute that can be stored inline for this
+ * volume.  Two maximum-sized records must fit in one b-tree node.
+ */
+void
+hfs_xattr_init(struct hfsmount *hfsmp)
+{
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	BTreeInfoRec btinfo;
+	u_int32_t maxsize;
+
+	hfsmp->hfs_max_inline_attrsize = 0;
+	if (vcb->attributesRefNum == NULL)
+		return;
+	if (BTGetInformation(VTOF(vcb->attributesRefNum), 0, &btinfo) != 0)
+		return;
+
+	maxsize = btinfo.nodeSize;
+	maxsize -= sizeof(BTNodeDescriptor);	 /* minus node descriptor */
+	maxsize -= 3 * sizeof(u_int16_t);	 /* minus 3 index slots */
+	maxsize /= 2;				 /* 2 key/rec pairs minimum */
+	maxsize -= sizeof(HFSPlusAttrKey);	 /* minus maximum key size */
+	maxsize -= sizeof(HFSPlusAttrData) - 2; /* minus data header */
+	maxsize &= 0xFFFFFFFE;			 /* multiple of 2 bytes */
+
+	hfsmp->hfs_max_inline_attrsize = maxsize;
+}
+
+/*
+ * Build an attribute b-tree key from a UTF-8 name.
+ */
+static int
+hfs_buildattrkey(u_int32_t fileID, const char *attrname, HFSPlusAttrKey *key)
+{
+	size_t unicodeBytes = 0;
+	int result;
+
+	bzero(key, sizeof(*key));
+	if (attrname != NULL) {
+		result = utf8_decodestr((const u_int8_t *)attrname, strlen(attrname), key->attrName, &unicodeBytes, sizeof(key->attrName), 0,
+		    0);
+		if (result) {
+			if (result != ENAMETOOLONG)
+				result = EINVAL;
+			return (result);
+		}
+	}
+	key->attrNameLen = unicodeBytes / sizeof(u_int16_t);
+	key->keyLength = kHFSPlusAttrKeyMinimumLength + unicodeBytes;
+	key->fileID = fileID;
+	key->startBlock = 0;
+
+	return (0);
+}
+
+/*
+ * Size of a buffer large enough for any attribute leaf record.
+ */
+static size_t
+hfs_attrrecsize(struct hfsmount *hfsmp)
+{
+	return (max(sizeof(HFSPlusAttrRecord), sizeof(HFSPlusAttrData) - 2 + hfsmp->hfs_max_inline_attrsize));
+}
+
+/*
+ * Gather the complete extent list of a fork-data attribute, including
+ * any kHFSPlusAttrExtents overflow records.
+ *
+ * Caller holds the attributes b-tree lock.
+ */
+static int
+hfs_attrextents(struct hfsmount *hfsmp, FCB *btfile, const HFSPlusAttrKey *key, const HFSPlusForkData *fork,
+    HFSPlusExtentDescriptor **extentsp, u_int32_t *countp)
+{
+	HFSPlusExtentDescriptor *extents;
+	HFSPlusAttrRecord overflow;
+	BTreeIterator *iterator;
+	FSBufferDescriptor btdata;
+	u_int32_t blocks, count, maxcount;
+	u_int16_t datasize;
+	int i, result = 0;
+
+	maxcount = kHFSPlusExtentDensity;
+	extents = malloc(maxcount * sizeof(*extents), M_HFSXATTR, M_WAITOK);
+
+	count = 0;
+	blocks = 0;
+	for (i = 0; i < kHFSPlusExtentDensity && fork->extents[i].blockCount != 0; i++) {
+		extents[count++] = fork->extents[i];
+		blocks += fork->extents[i].blockCount;
+	}
+
+	iterator = NULL;
+	while (blocks < fork->totalBlocks) {
+		if (iterator == NULL)
+			iterator = malloc(sizeof(*iterator), M_TEMP, M_WAITOK | M_ZERO);
+		bcopy(key, &iterator->key, sizeof(HFSPlusAttrKey));
+		((HFSPlusAttrKey *)&iterator->key)->startBlock = blocks;
+
+		btdata.bufferAddress = &overflow;
+		btdata.itemSize = sizeof(overflow);
+		btdata.itemCount = 1;
+		result = BTSearchRecord(btfile, iterator, &btdata, &datasize, NULL);
+		if (result || overflow.recordType != kHFSPlusAttrExtents) {
+			result = EIO;
+			break;
+		}
+
+		extents = reallocf(extents, (maxcount + kHFSPlusExtentDensity) * sizeof(*extents), M_HFSXATTR, M_WAITOK);
+		maxcount += kHFSPlusExtentDensity;
+		for (i = 0; i < kHFSPlusExtentDensity && overflow.overflowExtents.extents[i].blockCount != 0; i++) {
+			extents[count++] = overflow.overflowExtents.extents[i];
+			blocks += overflow.overflowExtents.extents[i].blockCount;
+		}
+		if (i == 0) {
+			result = EIO;
+			break;
+		}
+	}
+	if (iterator != NULL)
+		free(iterator, M_TEMP);
+
+	if (result) {
+		free(extents, M_HFSXATTR);
+		return (result);
+	}
+	*extentsp = extents;
+	*countp = count;
+
+	return (0);
+}
+
+/*
+ * Copy the first size bytes of an extent list out to uio.
+ */
+static int
+hfs_readattrblocks(struct hfsmount *hfsmp, const HFSPlusExtentDescriptor *extents, u_int32_t count, size_t size,
+    struct uio *uio)
+{
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	struct buf *bp;
+	daddr_t blkno;
+	u_int32_t i, j;
+	size_t iosize;
+	int result = 0;
+
+	for (i = 0; i < count && size > 0 && uio->uio_resid > 0; i++) {
+		for (j = 0; j < extents[i].blockCount && size > 0 && uio->uio_resid > 0; j++) {
+			blkno = (vcb->hfsPlusIOPosOffset + (off_t)(extents[i].startBlock + j) * vcb->blockSize) / DEV_BSIZE;
+			result = bread(hfsmp->hfs_devvp, blkno, vcb->blockSize, NOCRED, &bp);
+			if (result) {
+				if (bp)
+					brelse(bp);
+				return (result);
+			}
+			iosize = min(size, vcb->blockSize);
+			result = uiomove(bp->b_data, iosize, uio);
+			brelse(bp);
+			if (result)
+				return (result);
+			size -= iosize;
+		}
+	}
+
+	return (result);
+}
+
+/*
+ * Write size bytes of data into the blocks of an extent list.
+ */
+static int
+hfs_writeattrblocks(struct hfsmount *hfsmp, const HFSPlusExtentDescriptor *extents, u_int32_t count, const void *data,
+    size_t size)
+{
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	const char *src = data;
+	struct buf *bp;
+	daddr_t blkno;
+	u_int32_t i, j;
+	size_t iosize;
+	int result;
+
+	for (i = 0; i < count && size > 0; i++) {
+		for (j = 0; j < extents[i].blockCount && size > 0; j++) {
+			blkno = (vcb->hfsPlusIOPosOffset + (off_t)(extents[i].startBlock + j) * vcb->blockSize) / DEV_BSIZE;
+			bp = getblk(hfsmp->hfs_devvp, blkno, vcb->blockSize, 0, 0, 0);
+			iosize = min(size, vcb->blockSize);
+			bcopy(src, bp->b_data, iosize);
+			if (iosize < vcb->blockSize)
+				bzero((char *)bp->b_data + iosize, vcb->blockSize - iosize);
+			if ((result = bwrite(bp)))
+				return (result);
+			src += iosize;
+			size -= iosize;
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Allocate blocks for a fork-data attribute.  The value must fit in
+ * a single extent record; we never create overflow records.
+ */
+static int
+hfs_allocattrblocks(struct hfsmount *hfsmp, size_t size, HFSPlusExtentRecord extents, proc_t *p)
+{
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	u_int32_t startBlock, blockCount;
+	SInt64 remaining;
+	int i, result;
+
+	bzero(extents, sizeof(HFSPlusExtentRecord));
+
+	result = hfs_metafilelocking(hfsmp, kHFSExtentsFileID, LK_EXCLUSIVE, p);
+	if (result)
+		return (result);
+
+	remaining = roundup(size, vcb->blockSize);
+	for (i = 0; i < kHFSPlusExtentDensity && remaining > 0; i++) {
+		result = MacToVFSError(BlockAllocate(vcb, 0, remaining, remaining, false, &startBlock, &blockCount));
+		if (result)
+			break;
+		extents[i].startBlock = startBlock;
+		extents[i].blockCount = blockCount;
+		remaining -= (SInt64)blockCount * vcb->blockSize;
+	}
+	if (result == 0 && remaining > 0)
+		result = ENOSPC;
+
+	if (result) {
+		for (i = 0; i < kHFSPlusExtentDensity && extents[i].blockCount != 0; i++)
+			(void)BlockDeallocate(vcb, extents[i].startBlock, extents[i].blockCount);
+		bzero(extents, sizeof(HFSPlusExtentRecord));
+	}
+
+	(void)hfs_metafilelocking(hfsmp, kHFSExtentsFileID, LK_RELEASE, p);
+
+	return (result);
+}
+
+static void
+hfs_freeattrblocks(struct hfsmount *hfsmp, const HFSPlusExtentDescriptor *extents, u_int32_t count, proc_t *p)
+{
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	u_int32_t i;
+
+	if (hfs_metafilelocking(hfsmp, kHFSExtentsFileID, LK_EXCLUSIVE, p) != 0)
+		return;
+	for (i = 0; i < count; i++) {
+		if (extents[i].blockCount != 0)
+			(void)BlockDeallocate(vcb, extents[i].startBlock, extents[i].blockCount);
+	}
+	(void)hfs_metafilelocking(hfsmp, kHFSExtentsFileID, LK_RELEASE, p);
+}
+
+/*
+ * Free the blocks of the fork-data attribute record recp, named by
+ * iterator->key, and delete its overflow extent records.  The leaf
+ * record itself is left alone.
+ *
+ * Caller holds the attributes b-tree lock exclusive.
+ */
+static int
+hfs_releaseattrblocks(struct hfsmount *hfsmp, FCB *btfile, BTreeIterator *iterator, const HFSPlusAttrRecord *recp,
+    proc_t *p)
+{
+	HFSPlusAttrKey *key = (HFSPlusAttrKey *)&iterator->key;
+	HFSPlusAttrRecord overflow;
+	HFSPlusExtentDescriptor *extents;
+	FSBufferDescriptor btdata;
+	u_int32_t count, blocks, i;
+	u_int16_t datasize;
+	int result;
+
+	result = hfs_attrextents(hfsmp, btfile, key, &recp->forkData.theFork, &extents, &count);
+	if (result)
+		return (result);
+
+	blocks = 0;
+	for (i = 0; i < kHFSPlusExtentDensity; i++)
+		blocks += recp->forkData.theFork.extents[i].blockCount;
+	btdata.bufferAddress = &overflow;
+	btdata.itemSize = sizeof(overflow);
+	btdata.itemCount = 1;
+	while (blocks < recp->forkData.theFork.totalBlocks) {
+		key->startBlock = blocks;
+		if (BTSearchRecord(btfile, iterator, &btdata, &datasize, NULL) != 0)
+			break;
+		(void)BTDeleteRecord(btfile, iterator);
+		if (overflow.overflowExtents.extents[0].blockCount == 0)
+			break;
+		for (i = 0; i < kHFSPlusExtentDensity; i++)
+			blocks += overflow.overflowExtents.extents[i].blockCount;
+	}
+	key->startBlock = 0;
+
+	hfs_freeattrblocks(hfsmp, extents, count, p);
+	free(extents, M_HFSXATTR);
+
+	return (0);
+}
+
+/*
+ * Remove the attribute named by iterator->key, freeing any blocks
+ * and overflow extent records it owns.
+ *
+ * Caller holds the attributes b-tree lock exclusive.
+ */
+static int
+hfs_removeattr(struct hfsmount *hfsmp, FCB *btfile, BTreeIterator *iterator, void *recbuf, proc_t *p)
+{
+	HFSPlusAttrRecord *recp = recbuf;
+	HFSPlusAttrKey *key = (HFSPlusAttrKey *)&iterator->key;
+	FSBufferDescriptor btdata;
+	u_int16_t datasize;
+	int result;
+
+	btdata.bufferAddress = recbuf;
+	btdata.itemSize = hfs_attrrecsize(hfsmp);
+	btdata.itemCount = 1;
+
+	key->startBlock = 0;
+	result = BTSearchRecord(btfile, iterator, &btdata, &datasize, NULL);
+	if (result == btNotFound)
+		return (ENOATTR);
+	if (result)
+		return (MacToVFSError(result));
+
+	if (recp->recordType == kHFSPlusAttrForkData) {
+		/* Delete the overflow extent records first */
+		result = hfs_releaseattrblocks(hfsmp, btfile, iterator, recp, p);
+		if (result)
+			return (result);
+	} else if (recp->recordType != kHFSPlusAttrInlineData) {
+		return (EIO);
+	}
+
+	return (MacToVFSError(BTDeleteRecord(btfile, iterator)));
+}
+
+/*
+ * Remove every attribute of fileID, with the blocks and overflow extent
+ * records they own.  Called when a file's catalog record is deleted.
+ *
+ * Caller holds the catalog b-tree lock exclusive, and is in the same
+ * transaction as the catalog delete.
+ */
+int
+hfs_removeallattr(struct hfsmount *hfsmp, u_int32_t fileID, proc_t *p)
+{
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	HFSPlusAttrKey *key;
+	BTreeIterator *iterator;
+	FCB *btfile;
+	void *recbuf;
+	int result;
+
+	if (vcb->attributesRefNum == NULL)
+		return (0);
+
+	iterator = malloc(sizeof(*iterator), M_TEMP, M_WAITOK | M_ZERO);
+	key = (HFSPlusAttrKey *)&iterator->key;
+	recbuf = malloc(hfs_attrrecsize(hfsmp), M_HFSXATTR, M_WAITOK);
+	btfile = VTOF(vcb->attributesRefNum);
+
+	result = hfs_metafilelocking(hfsmp, kHFSAttributesFileID, LK_EXCLUSIVE, p);
+	if (result)
+		goto exit;
+
+	for (;;) {
+		/* An empty name sorts before every real attribute of this file */
+		bzero(iterator, sizeof(*iterator));
+		(void)hfs_buildattrkey(fileID, NULL, key);
+		if (BTIterateRecord(btfile, kBTreeNextRecord, iterator, NULL, NULL) != 0 || key->fileID != fileID)
+			break;
+		if (key->startBlock != 0) {
+			/* An overflow extent record with no attribute in front of it */
+			result = MacToVFSError(BTDeleteRecord(btfile, iterator));
+		} else {
+			result = hfs_removeattr(hfsmp, btfile, iterator, recbuf, p);
+		}
+		if (result)
+			break;
+	}
+	(void)BTFlushPath(btfile);
+
+	(void)hfs_metafilelocking(hfsmp, kHFSAttributesFileID, LK_RELEASE, p);
+exit:
+	free(recbuf, M_HFSXATTR);
+	free(iterator, M_TEMP);
+
+	return (result);
+}
+
+/*
+ * Check whether any attribute records remain for fileID.
+ *
+ * Caller holds the attributes b-tree lock.
+ */
+static int
+hfs_hasattributes(FCB *btfile, u_int32_t fileID, BTreeIterator *iterator)
+{
+	bzero(iterator, sizeof(*iterator));
+	(void)hfs_buildattrkey(fileID, NULL, (HFSPlusAttrKey *)&iterator->key);
+
+	/* An empty name sorts before every real attribute of this file */
+	if (BTIterateRecord(btfile, kBTreeNextRecord, iterator, NULL, NULL) != 0)
+		return (0);
+
+	return (((HFSPlusAttrKey *)&iterator->key)->fileID == fileID);
+}
+
+/*
+ * Keep the catalog's kHFSHasAttributesMask hint in sync.
+ */
+static void
+hfs_setattrflag(struct vnode *vp, int hasattrs)
+{
+	struct cnode *cp = VTOC(vp);
+	struct timeval tv;
+
+	if (hasattrs)
+		cp->c_recflags |= kHFSHasAttributesMask;
+	else
+		cp->c_recflags &= ~kHFSHasAttributesMask;
+	cp->c_flag |= C_CHANGE;
+
+	getmicrotime(&tv);
+	(void)hfs_update(vp, &tv, &tv, 0);
+}
+
+static int
+hfs_xattr_check(struct vnode *vp, int attrnamespace, struct ucred *cred, struct thread *td, accmode_t accmode)
+{
+	if (VTOVCB(vp)->vcbSigWord != kHFSPlusSigWord)
+		return (EOPNOTSUPP);
+	if (attrnamespace != EXTATTR_NAMESPACE_USER)
+		return (EOPNOTSUPP);
+	if (vp->v_vflag & VV_SYSTEM)
+		return (EPERM);
+
+	return (extattr_check_cred(vp, attrnamespace, cred, td, accmode));
+}
+
+/*
+ * The decmpfs attribute is the data of a compressed file, so only the
+ * kernel (NOCRED) and privileged callers may see or change it; anyone
+ * else could corrupt a compressed file or turn a file into one.
+ */
+static int
+hfs_xattr_protected(const char *name, struct ucred *cred)
+{
+	if (name == NULL || strcmp(name, HFS_DECMPFS_XATTR_NAME) != 0)
+		return (0);
+
+	return (cred != NOCRED && priv_check_cred(cred, PRIV_VFS_EXTATTR_SYSTEM) != 0);
+}
+
+/*
+ * Retrieve the data of an extended attribute.
+ */
+int
+hfs_getextattr(struct vop_getextattr_args /* {
+	struct vnode *a_vp;
+	int a_attrnamespace;
+	const char *a_name;
+	struct uio *a_uio;
+	size_t *a_size;
+	struct ucred *a_cred;
+	struct thread *a_td;
+} */ *ap)
+{
+	int result;
+
+	if ((result = hfs_xattr_check(ap->a_vp, ap->a_attrnamespace, ap->a_cred, ap->a_td, VREAD)))
+		return (result);
+	if (hfs_xattr_protected(ap->a_name, ap->a_cred))
+		return (ENOATTR);
+
+	return (hfs_getxattr_internal(ap->a_vp, ap->a_name, ap->a_uio, ap->a_size));
+}
+
+/*
+ * Read an attribute into a kernel buffer, bypassing the namespace and
+ * permission checks.  On entry *sizep is the size of buf; on return it
+ * is the size of the attribute.  buf may be NULL to just get the size.
+ */
+int
+hfs_getxattr_kernel(struct vnode *vp, const char *name, void *buf, size_t *sizep)
+{
+	struct uio auio;
+	struct iovec aiov;
+
+	if (buf == NULL)
+		return (hfs_getxattr_internal(vp, name, NULL, sizep));
+
+	aiov.iov_base = buf;
+	aiov.iov_len = *sizep;
+	auio.uio_iov = &aiov;
+	auio.uio_iovcnt = 1;
+	auio.uio_offset = 0;
+	auio.uio_resid = *sizep;
+	auio.uio_segflg = UIO_SYSSPACE;
+	auio.uio_rw = UIO_READ;
+	auio.uio_td = curthread;
+
+	return (hfs_getxattr_internal(vp, name, &auio, sizep));
+}
+
+static int
+hfs_getxattr_internal(struct vnode *vp, const char *name, struct uio *uio, size_t *sizep)
+{
+	struct cnode *cp = VTOC(vp);
+	struct hfsmount *hfsmp = VTOHFS(vp);
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	HFSPlusAttrRecord *recp;
+	HFSPlusExtentDescriptor *extents;
+	BTreeIterator *iterator;
+	FSBufferDescriptor btdata;
+	proc_t *p = curthread;
+	u_int32_t count;
+	u_int16_t datasize;
+	size_t attrsize, recsize;
+	int result;
+
+	/* Fast path: the catalog says there's nothing to look for. */
+	if ((cp->c_recflags & kHFSHasAttributesMask) == 0 || vcb->attributesRefNum == NULL)
+		return (ENOATTR);
+
+	iterator = malloc(sizeof(*iterator), M_TEMP, M_WAITOK | M_ZERO);
+	result = hfs_buildattrkey(cp->c_fileid, name, (HFSPlusAttrKey *)&iterator->key);
+	if (result) {
+		free(iterator, M_TEMP);
+		return (result);
+	}
+
+	recp = malloc(hfs_attrrecsize(hfsmp), M_HFSXATTR, M_WAITOK);
+	btdata.bufferAddress = recp;
+	btdata.itemSize = hfs_attrrecsize(hfsmp);
+	btdata.itemCount = 1;
+
+	result = hfs_metafilelocking(hfsmp, kHFSAttributesFileID, LK_SHARED, p);
+	if (result)
+		goto exit;
+
+	result = BTSearchRecord(VTOF(vcb->attributesRefNum), iterator, &btdata, &datasize, NULL);
+	if (result) {
+		result = (result == btNotFound) ? ENOATTR : MacToVFSError(result);
+		goto unlock;
+	}
+
+	switch (recp->recordType) {
+	case kHFSPlusAttrInlineData:
+		/*
+		 * Inline data is served straight from the leaf record.  datasize
+		 * is the on-disk record length; only hfs_attrrecsize() bytes of
+		 * it were copied into recp.
+		 */
+		attrsize = recp->attrData.attrSize;
+		recsize = min(datasize, hfs_attrrecsize(hfsmp));
+		if (recsize < sizeof(HFSPlusAttrData) - 2 || attrsize > recsize - (sizeof(HFSPlusAttrData) - 2) ||
+		    attrsize > hfsmp->hfs_max_inline_attrsize) {
+			result = EIO;
+			break;
+		}
+		if (sizep != NULL)
+			*sizep = attrsize;
+		if (uio != NULL)
+			result = uiomove(recp->attrData.attrData, attrsize, uio);
+		break;
+
+	case kHFSPlusAttrForkData:
+		attrsize = recp->forkData.theFork.logicalSize;
+		if (sizep != NULL)
+			*sizep = attrsize;
+		if (uio == NULL)
+			break;
+		result = hfs_attrextents(hfsmp, VTOF(vcb->attributesRefNum), (HFSPlusAttrKey *)&iterator->key,
+		    &recp->forkData.theFork, &extents, &count);
+		if (result)
+			break;
+		result = hfs_readattrblocks(hfsmp, extents, count, attrsize, uio);
+		free(extents, M_HFSXATTR);
+		break;
+
+	default:
+		result = EIO;
+		break;
+	}
+
+unlock:
+	(void)hfs_metafilelocking(hfsmp, kHFSAttributesFileID, LK_RELEASE, p);
+exit:
+	free(recp, M_HFSXATTR);
+	free(iterator, M_TEMP);
+
+	return (result);
+}
+
+/*
+ * Set the data of an extended attribute, replacing any existing value.
+ */
+int
+hfs_setextattr(struct vop_setextattr_args /* {
+	struct vnode *a_vp;
+	int a_attrnamespace;
+	const char *a_name;
+	struct uio *a_uio;
+	struct ucred *a_cred;
+	struct thread *a_td;
+} */ *ap)
+{
+	struct vnode *vp = ap->a_vp;
+	struct cnode *cp = VTOC(vp);
+	struct hfsmount *hfsmp = VTOHFS(vp);
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	HFSPlusAttrRecord *recp, *oldrecp;
+	HFSPlusExtentRecord extents;
+	BTreeIterator *iterator;
+	FSBufferDescriptor btdata, olddata;
+	FCB *btfile;
+	proc_t *p = curthread;
+	void *data;
+	size_t attrsize;
+	u_int16_t datasize;
+	int replaced = 0;
+	int result;
+
+	if ((result = hfs_xattr_check(vp, ap->a_attrnamespace, ap->a_cred, ap->a_td, VWRITE)))
+		return (result);
+	if (hfs_xattr_protected(ap->a_name, ap->a_cred))
+		return (EPERM);
+	if (vp->v_mount->mnt_flag & MNT_RDONLY)
+		return (EROFS);
+	if (vcb->attributesRefNum == NULL)
+		return (EOPNOTSUPP);
+	if (ap->a_name == NULL || ap->a_name[0] == '\0')
+		return (EINVAL);
+	if (ap->a_uio->uio_resid < 0 || ap->a_uio->uio_resid > HFS_XATTR_MAXSIZE)
+		return (E2BIG);
+
+	attrsize = ap->a_uio->uio_resid;
+	data = malloc(max(attrsize, 1), M_HFSXATTR, M_WAITOK);
+	if ((result = uiomove(data, attrsize, ap->a_uio))) {
+		free(data, M_HFSXATTR);
+		return (result);
+	}
+
+	iterator = malloc(sizeof(*iterator), M_TEMP, M_WAITOK | M_ZERO);
+	result = hfs_buildattrkey(cp->c_fileid, ap->a_name, (HFSPlusAttrKey *)&iterator->key);
+	if (result) {
+		free(iterator, M_TEMP);
+		free(data, M_HFSXATTR);
+		return (result);
+	}
+	recp = malloc(hfs_attrrecsize(hfsmp), M_HFSXATTR, M_WAITOK | M_ZERO);
+	oldrecp = malloc(hfs_attrrecsize(hfsmp), M_HFSXATTR, M_WAITOK);
+	btfile = VTOF(vcb->attributesRefNum);
+
+	result = hfs_metafilelocking(hfsmp, kHFSAttributesFileID, LK_EXCLUSIVE, p);
+	if (result)
+		goto exit;
+
+	/*
+	 * Build the new record, and write out its data, before touching any
+	 * previous value, so that a failure leaves the old value in place.
+	 */
+	btdata.bufferAddress = recp;
+	btdata.itemCount = 1;
+
+	if (attrsize <= hfsmp->hfs_max_inline_attrsize) {
+		recp->recordType = kHFSPlusAttrInlineData;
+		recp->attrData.attrSize = attrsize;
+		bcopy(data, recp->attrData.attrData, attrsize);
+		/* Record length is padded to an even number of bytes */
+		btdata.itemSize = sizeof(HFSPlusAttrData) - 2 + roundup2(attrsize, 2);
+	} else {
+		result = hfs_allocattrblocks(hfsmp, attrsize, extents, p);
+		if (result)
+			goto unlock;
+		result = hfs_writeattrblocks(hfsmp, extents, kHFSPlusExtentDensity, data, attrsize);
+		if (result) {
+			hfs_freeattrblocks(hfsmp, extents, kHFSPlusExtentDensity, p);
+			goto unlock;
+		}
+		recp->recordType = kHFSPlusAttrForkData;
+		recp->forkData.theFork.logicalSize = attrsize;
+		recp->forkData.theFork.totalBlocks = howmany(attrsize, vcb->blockSize);
+		bcopy(extents, recp->forkData.theFork.extents, sizeof(HFSPlusExtentRecord));
+		btdata.itemSize = sizeof(HFSPlusAttrForkData);
+	}
+
+	/* Replace any previous value; only look if the catalog says there may be one. */
+	result = btNotFound;
+	if (cp->c_recflags & kHFSHasAttributesMask) {
+		olddata.bufferAddress = oldrecp;
+		olddata.itemSize = hfs_attrrecsize(hfsmp);
+		olddata.itemCount = 1;
+		result = BTSearchRecord(btfile, iterator, &olddata, &datasize, NULL);
+		if (result == 0) {
+			replaced = 1;
+			result = BTReplaceRecord(btfile, iterator, &btdata, btdata.itemSize);
+		}
+	}
+	if (result == btNotFound)
+		result = BTInsertRecord(btfile, iterator, &btdata, btdata.itemSize);
+	result = MacToVFSError(result);
+
+	if (result) {
+		if (recp->recordType == kHFSPlusAttrForkData)
+			hfs_freeattrblocks(hfsmp, extents, kHFSPlusExtentDensity, p);
+	} else if (replaced && oldrecp->recordType == kHFSPlusAttrForkData) {
+		/* The new value is in; the old one's blocks can go. */
+		(void)hfs_releaseattrblocks(hfsmp, btfile, iterator, oldrecp, p);
+	}
+	(void)BTFlushPath(btfile);
+
+unlock:
+	(void)hfs_metafilelocking(hfsmp, kHFSAttributesFileID, LK_RELEASE, p);
+
+	if (result == 0) {
+		hfs_setattrflag(vp, 1);
+		if (strcmp(ap->a_name, HFS_DECMPFS_XATTR_NAME) == 0)
+			hfs_decmpfs_cnode_destroy(cp);
+	}
+exit:
+	free(oldrecp, M_HFSXATTR);
+	free(recp, M_HFSXATTR);
+	free(iterator, M_TEMP);
+	free(data, M_HFSXATTR);
+
+	return (result);
+}
+
+/*
+ * Remove an extended attribute.
+ */
+int
+hfs_deleteextattr(struct vop_deleteextattr_args /* {
+	struct vnode *a_vp;
+	int a_attrnamespace;
+	const char *a_name;
+	struct ucred *a_cred;
+	struct thread *a_td;
+} */ *ap)
+{
+	struct vnode *vp = ap->a_vp;
+	struct cnode *cp = VTOC(vp);
+	struct hfsmount *hfsmp = VTOHFS(vp);
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	BTreeIterator *iterator;
+	FCB *btfile;
+	proc_t *p = curthread;
+	void *recbuf;
+	int hasattrs = 1;
+	int result;
+
+	if ((result = hfs_xattr_check(vp, ap->a_attrnamespace, ap->a_cred, ap->a_td, VWRITE)))
+		return (result);
+	if (hfs_xattr_protected(ap->a_name, ap->a_cred))
+		return (EPERM);
+	if (vp->v_mount->mnt_flag & MNT_RDONLY)
+		return (EROFS);
+	if ((cp->c_recflags & kHFSHasAttributesMask) == 0 || vcb->attributesRefNum == NULL)
+		return (ENOATTR);
+
+	iterator = malloc(sizeof(*iterator), M_TEMP, M_WAITOK | M_ZERO);
+	result = hfs_buildattrkey(cp->c_fileid, ap->a_name, (HFSPlusAttrKey *)&iterator->key);
+	if (result) {
+		free(iterator, M_TEMP);
+		return (result);
+	}
+	recbuf = malloc(hfs_attrrecsize(hfsmp), M_HFSXATTR, M_WAITOK);
+	btfile = VTOF(vcb->attributesRefNum);
+
+	result = hfs_metafilelocking(hfsmp, kHFSAttributesFileID, LK_EXCLUSIVE, p);
+	if (result)
+		goto exit;
+
+	result = hfs_removeattr(hfsmp, btfile, iterator, recbuf, p);
+	if (result == 0) {
+		(void)BTFlushPath(btfile);
+		hasattrs = hfs_hasattributes(btfile, cp->c_fileid, iterator);
+	}
+
+	(void)hfs_metafilelocking(hfsmp, kHFSAttributesFileID, LK_RELEASE, p);
+
+	if (result == 0) {
+		hfs_setattrflag(vp, hasattrs);
+		if (strcmp(ap->a_name, HFS_DECMPFS_XATTR_NAME) == 0)
+			hfs_decmpfs_cnode_destroy(cp);
+	}
+exit:
+	free(recbuf, M_HFSXATTR);
+	free(iterator, M_TEMP);
+
+	return (result);
+}
+
+/*
+ * List the names of a file's extended attributes.
+ *
+ * Names are returned in the extattr(2) format: a length byte followed
+ * by the name, without a terminating NUL.
+ */
+int
+hfs_listextattr(struct vop_listextattr_args /* {
+	struct vnode *a_vp;
+	int a_attrnamespace;
+	struct uio *a_uio;
+	size_t *a_size;
+	struct ucred *a_cred;
+	struct thread *a_td;
+} */ *ap)
+{
+	struct vnode *vp = ap->a_vp;
+	struct cnode *cp = VTOC(vp);
+	struct hfsmount *hfsmp = VTOHFS(vp);
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	HFSPlusAttrKey *key;
+	BTreeIterator *iterator;
+	FCB *btfile;
+	proc_t *p = curthread;
+	u_int8_t name[kHFSMaxAttrNameLen * 3 + 1];
+	size_t namelen, total = 0;
+	u_int8_t len;
+	int result;
+
+	if ((result = hfs_xattr_check(vp, ap->a_attrnamespace, ap->a_cred, ap->a_td, VREAD)))
+		return (result);
+
+	/* Fast path: an empty list without touching the attributes b-tree. */
+	if ((cp->c_recflags & kHFSHasAttributesMask) == 0 || vcb->attributesRefNum == NULL) {
+		if (ap->a_size != NULL)
+			*ap->a_size = 0;
+		return (0);
+	}
+
+	iterator = malloc(sizeof(*iterator), M_TEMP, M_WAITOK | M_ZERO);
+	key = (HFSPlusAttrKey *)&iterator->key;
+	(void)hfs_buildattrkey(cp->c_fileid, NULL, key);
+	btfile = VTOF(vcb->attributesRefNum);
+
+	result = hfs_metafilelocking(hfsmp, kHFSAttributesFileID, LK_SHARED, p);
+	if (result)
+		goto exit;
+
+	/* An empty name sorts before every real attribute of this file. */
+	while (BTIterateRecord(btfile, kBTreeNextRecord, iterator, NULL, NULL) == 0) {
+		if (key->fileID != cp->c_fileid)
+			break;
+		/* Skip overflow extent records */
+		if (key->startBlock != 0)
+			continue;
+		if (utf8_encodestr(key->attrName, key->attrNameLen * sizeof(u_int16_t), name, &namelen, sizeof(name), 0, UTF_NO_NULL_TERM) != 0)
+			continue;
+		if (namelen > 255)
+			continue;
+		name[namelen] = '\0';
+		if (hfs_xattr_protected((const char *)name, ap->a_cred))
+			continue;
+
+		total += namelen + 1;
+		if (ap->a_uio != NULL) {
+			len = namelen;
+			if ((result = uiomove(&len, 1, ap->a_uio)))
+				break;
+			if ((result = uiomove(name, namelen, ap->a_uio)))
+				break;
+		}
+	}
+	if (ap->a_size != NULL)
+		*ap->a_size = total;
+
+	(void)hfs_metafilelocking(hfsmp, kHFSAttributesFileID, LK_RELEASE, p);
+exit:
+	free(iterator, M_TEMP);
+
+	return (result);
+}
@@ -113,6 +113,33 @@ Result:		noErr			- success
 
 OSStatus
 AllocateNode(BTreeControlBlockPtr btreePtr, UInt32 *nodeNum)
+{
+	return AllocateNodeFrom(btreePtr, 0, nodeNum);
+}
+
+/*-------------------------------------------------------------------------------
+
+Routine:	AllocateNodeFrom	-	Find Free Node at or after a Hint.
+
+Function:	Same as AllocateNode, but the search starts at the map word holding
+			startNode instead of at the beginning of the map.  Callers that
+			want a node at or past a given slot (BTRenumberNodes) pass that slot,
+			so the map is not rescanned from node 0 every time.  A free node
+			earlier in the same map word may still be returned.
+
+Input:		btreePtr	- pointer to control block for BTree file
+			startNode	- node number to start searching from
+
+Output:		nodeNum		- number of node allocated
+
+
+Result:		noErr			- success
+			fsBTNoMoreMapNodesErr	- no free blocks were found
+			!= noErr		- failure
+-------------------------------------------------------------------------------*/
+
+OSStatus
+AllocateNodeFrom(BTreeControlBlockPtr btreePtr, UInt32 startNode, UInt32 *nodeNum)
 {
 	OSStatus err;
 	BlockDescriptor node;
@@ -122,6 +149,7 @@ AllocateNode(BTreeControlBlockPtr btreePtr, UInt32 *nodeNum)
 	UInt16 mask;
 	UInt16 bitOffset;
 	UInt32 nodeNumber;
+	UInt32 skip;
 
 	nodeNumber = 0;	   // first node number of header map record
 	node.buffer = nil; // clear node.buffer to get header node
@@ -132,16 +160,26 @@ AllocateNode(BTreeControlBlockPtr btreePtr, UInt32 *nodeNum)
 		err = GetMapNode(btreePtr, &node, &mapPtr, &mapSize);
 		M_ExitOnError(err);
 
-		// XXXdbg
-		ModifyBlockStart(btreePtr->fileRefNum, &node);
-
-		//////////////////////// Find Word with Free Bit ////////////////////////////
-
 		pos = mapPtr;
 		size = mapSize;
 		size >>= 1; // convert to number of words
 			    //  assumes mapRecords contain an integral number of words
 
+		if (startNode >= nodeNumber) { // skip the words before the hint
+			skip = (startNode - nodeNumber) >> 4;
+			if (skip >= size) {
+				nodeNumber += mapSize << 3;
+				continue;
+			}
+			pos += skip;
+			size -= skip;
+		}
+
+		// XXXdbg
+		ModifyBlockStart(btreePtr->fileRefNum, &node);
+
+		//////////////////////// Find Word with Free Bit ////////////////////////////
+
 		while (size--) {
 			if (*pos++ != 0xFFFF) // assume test fails, and increment pos
 				break;
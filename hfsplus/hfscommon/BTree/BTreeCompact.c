@@ -0,0 +1,1045 @@
+/*
+	File:		BTreeCompact.c
+
+	Contains:	Online compaction of a B*Tree: occupancy statistics, leaf
+				repacking, node renumbering and trimming of free nodes at the
+				end of the file.
+
+	Each pass works on a live tree under the caller's exclusive file lock and
+	leaves the tree consistent after every step, so a pass can stop at any
+	node (when its write budget runs out) and be resumed on a later call.
+	Every step that moves records or nodes bumps writeCount, which invalidates
+	hints and scanner positions (BTreeScanner, hfs_search) held by others.
+*/
+
+/*
+ * xnu/tests/hfs_btcompact_test.c builds this file against the fsck_hfs
+ * B-tree code, with HFS_BTCOMPACT_TEST defined.
+ */
+#ifndef HFS_BTCOMPACT_TEST
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/malloc.h>
+
+#include "../headers/BTreesPrivate.h"
+#endif
+
+static OSStatus GetLeftmostNode(BTreeControlBlockPtr btreePtr, UInt16 height, UInt32 *nodeNum);
+static OSStatus IsNodeAllocated(BTreeControlBlockPtr btreePtr, UInt32 nodeNum, Boolean *allocated);
+static OSStatus GetLastAllocatedNode(BTreeControlBlockPtr btreePtr, UInt32 limit, UInt32 *nodeNum);
+static OSStatus EnsureFreeNodes(BTreeControlBlockPtr btreePtr, UInt32 count);
+static OSStatus MergeIntoLeftLeaf(BTreeControlBlockPtr btreePtr, UInt32 leftNum, UInt32 rightNum, BTreeKeyPtr rightKey, UInt16 count,
+    Boolean *rightEmptied);
+static OSStatus MoveNode(BTreeControlBlockPtr btreePtr, UInt32 srcNum, UInt32 dstNum);
+
+// bytes of a node available to records and their offsets
+#define M_NodeCapacity(btreePtr) ((btreePtr)->nodeSize - sizeof(BTNodeDescriptor) - kOffsetSize)
+
+//////////////////////////////// BTGetOccupancy /////////////////////////////////
+
+/*-------------------------------------------------------------------------------
+Routine:	BTGetOccupancy	-	Count nodes and used bytes on every level.
+
+Function:	Walks each level of the tree along its sibling links and adds up the
+			space used by records (and their offsets) in index and leaf nodes.
+			Also counts the leaves whose right sibling is not the next node in
+			the file, which is what makes a sequential walk of the leaves seek.
+
+Input:		filePtr		- B*Tree file
+
+Output:		occupancy	- node counts and byte totals
+
+Result:		noErr		- success
+			!= noErr	- failure
+-------------------------------------------------------------------------------*/
+
+OSStatus
+BTGetOccupancy(FCB *filePtr, BTreeOccupancy *occupancy)
+{
+	OSStatus err;
+	BTreeControlBlockPtr btreePtr;
+	BlockDescriptor node;
+	NodeDescPtr nodeDesc;
+	UInt32 nodeNum;
+	UInt32 visited;
+	UInt16 height;
+	UInt16 usedSize;
+
+	M_ReturnErrorIf(filePtr == nil, paramErr);
+
+	btreePtr = (BTreeControlBlockPtr)filePtr->fcbBTCBPtr;
+
+	M_ReturnErrorIf(btreePtr == nil, fsBTInvalidFileErr);
+
+	REQUIRE_FILE_LOCK(btreePtr->fileRefNum, true);
+
+	node.buffer = nil;
+	node.blockHeader = nil;
+
+	bzero(occupancy, sizeof(*occupancy));
+	occupancy->nodeSize = btreePtr->nodeSize;
+	occupancy->nodeCapacity = M_NodeCapacity(btreePtr);
+	occupancy->treeDepth = btreePtr->treeDepth;
+	occupancy->totalNodes = btreePtr->totalNodes;
+	occupancy->freeNodes = btreePtr->freeNodes;
+	occupancy->leafRecords = btreePtr->leafRecords;
+
+	visited = 0;
+
+	for (height = btreePtr->treeDepth; height > 0; --height) {
+		err = GetLeftmostNode(btreePtr, height, &nodeNum);
+		M_ExitOnError(err);
+
+		while (nodeNum != 0) {
+			// a sibling chain that loops would keep us here forever
+			if (++visited > btreePtr->totalNodes) {
+				err = fsBTInvalidNodeErr;
+				goto ErrorExit;
+			}
+
+			err = GetNode(btreePtr, nodeNum, &node);
+			M_ExitOnError(err);
+
+			nodeDesc = node.buffer;
+			usedSize = M_NodeCapacity(btreePtr) - GetNodeFreeSize(btreePtr, nodeDesc);
+
+			if (height == 1) {
+				++occupancy->leafNodes;
+				occupancy->leafBytes += usedSize;
+				if (nodeDesc->fLink != 0 && nodeDesc->fLink != nodeNum + 1)
+					++occupancy->leavesOutOfOrder;
+			} else {
+				++occupancy->indexNodes;
+				occupancy->indexBytes += usedSize;
+			}
+
+			nodeNum = nodeDesc->fLink;
+
+			err = ReleaseNode(btreePtr, &node);
+			M_ExitOnError(err);
+		}
+	}
+
+	return noErr;
+
+ErrorExit:
+
+	(void)ReleaseNode(btreePtr, &node);
+
+	return err;
+}
+
+//////////////////////////////// BTRepackLeaves /////////////////////////////////
+
+/*-------------------------------------------------------------------------------
+Routine:	BTRepackLeaves	-	Merge records of adjacent leaves to a fill target.
+
+Function:	Walks the leaves left to right.  While a leaf has less than
+			fillPercent of its space used, records are moved into it from the
+			front of its right sibling.  A sibling left empty is unlinked and
+			freed by DeleteTree; otherwise the parent's key for it is updated.
+
+			The walk stops once writeBudget nodes have been written (counting
+			the index nodes DeleteTree updates), or that many leaves have been
+			looked at, and can be resumed by passing back nextLeaf.  A nextLeaf that is no longer a leaf (the tree changed
+			under the caller) restarts the walk from the first leaf.
+
+Input:		filePtr		- B*Tree file
+			fillPercent	- target fill of each leaf, 1 to 100
+			writeBudget	- approximate number of node writes allowed
+			nextLeaf	- leaf to resume from, or 0 to start at the first one
+
+Output:		nextLeaf	- leaf to resume from
+			done		- true once the last leaf has been reached
+
+Result:		noErr		- success
+			!= noErr	- failure
+-------------------------------------------------------------------------------*/
+
+OSStatus
+BTRepackLeaves(FCB *filePtr, UInt32 fillPercent, UInt32 writeBudget, UInt32 *nextLeaf, Boolean *done)
+{
+	OSStatus err;
+	BTreeControlBlockPtr btreePtr;
+	BlockDescriptor node;
+	NodeDescPtr nodeDesc;
+	BTreeKey rightKey;
+	KeyPtr keyPtr;
+	UInt8 *dataPtr;
+	UInt16 dataSize;
+	UInt32 leftNum;
+	UInt32 rightNum;
+	UInt32 startWrites;
+	UInt32 visited;
+	UInt32 fillLimit;
+	UInt32 usedSize;
+	UInt32 moveSize;
+	UInt32 recSize;
+	UInt16 count;
+	Boolean allocated;
+	Boolean emptied;
+
+	M_ReturnErrorIf(filePtr == nil, paramErr);
+
+	btreePtr = (BTreeControlBlockPtr)filePtr->fcbBTCBPtr;
+
+	M_ReturnErrorIf(btreePtr == nil, fsBTInvalidFileErr);
+
+	REQUIRE_FILE_LOCK(btreePtr->fileRefNum, false);
+
+	if (fillPercent == 0 || fillPercent > 100)
+		fillPercent = 100;
+
+	node.buffer = nil;
+	node.blockHeader = nil;
+
+	*done = false;
+	fillLimit = M_NodeCapacity(btreePtr) * fillPercent / 100;
+	startWrites = btreePtr->numUpdateNodes;
+	visited = 0;
+
+	////////////////////////// Validate The Resume Point ////////////////////////
+
+	leftNum = *nextLeaf;
+	if (leftNum != 0) {
+		allocated = false;
+		if (leftNum < btreePtr->totalNodes) {
+			err = IsNodeAllocated(btreePtr, leftNum, &allocated);
+			M_ExitOnError(err);
+		}
+		if (allocated) {
+			err = GetNode(btreePtr, leftNum, &node);
+			M_ExitOnError(err);
+
+			nodeDesc = node.buffer;
+			if (nodeDesc->kind != kBTLeafNode || nodeDesc->height != 1)
+				allocated = false;
+
+			err = ReleaseNode(btreePtr, &node);
+			M_ExitOnError(err);
+		}
+		if (!allocated)
+			leftNum = 0;
+	}
+	if (leftNum == 0)
+		leftNum = btreePtr->firstLeafNode;
+
+	//////////////////////////////// Walk Leaves ////////////////////////////////
+
+	while (leftNum != 0 && (btreePtr->numUpdateNodes - startWrites) < writeBudget && visited++ < writeBudget) {
+		err = GetNode(btreePtr, leftNum, &node);
+		M_ExitOnError(err);
+
+		usedSize = M_NodeCapacity(btreePtr) - GetNodeFreeSize(btreePtr, node.buffer);
+		rightNum = ((NodeDescPtr)node.buffer)->fLink;
+
+		err = ReleaseNode(btreePtr, &node);
+		M_ExitOnError(err);
+
+		if (rightNum == 0) {
+			leftNum = 0; // that was the last leaf
+			break;
+		}
+		if (usedSize >= fillLimit) {
+			leftNum = rightNum;
+			continue;
+		}
+
+		// how many records from the front of the right sibling fit?
+		err = GetNode(btreePtr, rightNum, &node);
+		M_ExitOnError(err);
+
+		nodeDesc = node.buffer;
+		count = 0;
+		moveSize = 0;
+		while (count < nodeDesc->numRecords) {
+			recSize = GetRecordSize(btreePtr, nodeDesc, count) + kOffsetSize;
+			if (usedSize + moveSize + recSize > fillLimit)
+				break;
+			moveSize += recSize;
+			++count;
+		}
+
+		if (count > 0) {
+			err = GetRecordByIndex(btreePtr, nodeDesc, 0, &keyPtr, &dataPtr, &dataSize);
+			M_ExitOnError(err);
+
+			bcopy(keyPtr, &rightKey, CalcKeySize(btreePtr, keyPtr));
+		}
+
+		err = ReleaseNode(btreePtr, &node);
+		M_ExitOnError(err);
+
+		if (count == 0) {
+			leftNum = rightNum;
+			continue;
+		}
+
+		err = MergeIntoLeftLeaf(btreePtr, leftNum, rightNum, &rightKey, count, &emptied);
+		M_ExitOnError(err);
+
+		// an emptied sibling was unlinked, so the left leaf may take more
+		if (!emptied)
+			leftNum = rightNum;
+	}
+
+	*nextLeaf = leftNum;
+	*done = (leftNum == 0);
+
+	return noErr;
+
+ErrorExit:
+
+	(void)ReleaseNode(btreePtr, &node);
+
+	return err;
+}
+
+/*-------------------------------------------------------------------------------
+Routine:	MergeIntoLeftLeaf	-	Move the first records of a leaf to its left sibling.
+
+Function:	Appends the first count records of rightNum to leftNum, then deletes
+			them from rightNum.  The last deletion (of record 0) goes through
+			DeleteTree so the parent key is updated, or the node is freed and
+			unlinked if nothing is left in it.  The caller has checked that the
+			records fit.
+-------------------------------------------------------------------------------*/
+
+static OSStatus
+MergeIntoLeftLeaf(BTreeControlBlockPtr btreePtr, UInt32 leftNum, UInt32 rightNum, BTreeKeyPtr rightKey, UInt16 count, Boolean *rightEmptied)
+{
+	OSStatus err;
+	TreePathTable treePathTable;
+	BlockDescriptor leftNode;
+	BlockDescriptor rightNode;
+	NodeDescPtr leftDesc;
+	NodeDescPtr rightDesc;
+	KeyPtr keyPtr;
+	UInt8 *dataPtr;
+	UInt16 dataSize;
+	UInt32 nodeNum;
+	UInt32 moveSize;
+	UInt16 index;
+	UInt16 i;
+
+	leftNode.buffer = nil;
+	leftNode.blockHeader = nil;
+	rightNode.buffer = nil;
+	rightNode.blockHeader = nil;
+
+	// updating the parent key can split index nodes all the way up
+	err = EnsureFreeNodes(btreePtr, btreePtr->treeDepth + 1);
+	M_ExitOnError(err);
+
+	err = SearchTree(btreePtr, rightKey, treePathTable, &nodeNum, &rightNode, &index);
+	M_ExitOnError(err);
+
+	if (nodeNum != rightNum || index != 0) {
+		err = fsBTInvalidNodeErr;
+		goto ErrorExit;
+	}
+
+	rightDesc = rightNode.buffer;
+	if (rightDesc->bLink != leftNum || count > rightDesc->numRecords) {
+		err = fsBTInvalidNodeErr;
+		goto ErrorExit;
+	}
+
+	err = GetNode(btreePtr, leftNum, &leftNode);
+	M_ExitOnError(err);
+
+	leftDesc = leftNode.buffer;
+
+	// check before touching anything, a partial copy would duplicate records
+	moveSize = 0;
+	for (i = 0; i < count; ++i)
+		moveSize += GetRecordSize(btreePtr, rightDesc, i) + kOffsetSize;
+	if (moveSize > GetNodeFreeSize(btreePtr, leftDesc)) {
+		err = fsBTRecordTooLargeErr;
+		goto ErrorExit;
+	}
+
+	/////////////////////////// Append To Left Leaf /////////////////////////////
+
+	// XXXdbg
+	ModifyBlockStart(btreePtr->fileRefNum, &leftNode);
+
+	for (i = 0; i < count; ++i) {
+		err = GetRecordByIndex(btreePtr, rightDesc, i, &keyPtr, &dataPtr, &dataSize);
+		M_ExitOnError(err);
+
+		if (InsertKeyRecord(btreePtr, leftDesc, leftDesc->numRecords, keyPtr, KeyLength(btreePtr, keyPtr), dataPtr, dataSize) != true) {
+			Panic("MergeIntoLeftLeaf: InsertKeyRecord failed after size check!");
+			err = fsBTRecordTooLargeErr;
+			goto ErrorExit;
+		}
+	}
+
+	err = UpdateNode(btreePtr, &leftNode, 0, kLockTransaction);
+	M_ExitOnError(err);
+
+	///////////////////////// Remove From Right Leaf /////////////////////////////
+
+	*rightEmptied = (count == rightDesc->numRecords);
+
+	if (count > 1) {
+		// XXXdbg
+		ModifyBlockStart(btreePtr->fileRefNum, &rightNode);
+
+		for (i = count - 1; i > 0; --i)
+			DeleteRecord(btreePtr, rightDesc, i);
+	}
+
+	// record 0 last: fixes the parent key, or frees and unlinks the node
+	err = DeleteTree(btreePtr, treePathTable, &rightNode, 0, 1);
+	M_ExitOnError(err);
+
+	++btreePtr->writeCount;
+	M_BTreeHeaderDirty(btreePtr);
+
+	return noErr;
+
+ErrorExit:
+
+	(void)ReleaseNode(btreePtr, &leftNode);
+	(void)ReleaseNode(btreePtr, &rightNode);
+
+	return err;
+}
+
+//////////////////////////////// BTRenumberNodes ////////////////////////////////
+
+/*-------------------------------------------------------------------------------
+Routine:	BTRenumberNodes	-	Make node numbers follow the logical order.
+
+Function:	Gives the tree's nodes ascending node numbers starting right after
+			the header: the root, then every index level top down, then the
+			leaves in key order, each level left to right.  Map nodes stay where
+			they are and are stepped over.
+
+			For each node in that order, whatever node occupies its target slot
+			is first moved out of the way to a free node (the file is extended
+			if none is left past the slot), then the node is moved into the
+			slot.  Moving a node copies it, repoints its siblings and its parent
+			(or the root) at the copy, and frees the original.
+
+			The pass stops once writeBudget nodes have been written and resumes
+			from state.  If the tree was changed by anyone else between calls
+			(the caller compares writeCount) it must restart with a zeroed state;
+			nodes already in place are then just stepped over.
+
+Input:		filePtr		- B*Tree file
+			writeBudget	- approximate number of node writes allowed
+			state		- zeroed to start a pass, else from the previous call
+
+Output:		state		- where to resume
+			done		- true once every node is in place
+
+Result:		noErr		- success
+			!= noErr	- failure
+-------------------------------------------------------------------------------*/
+
+OSStatus
+BTRenumberNodes(FCB *filePtr, UInt32 writeBudget, BTreeRenumberState *state, Boolean *done)
+{
+	OSStatus err;
+	BTreeControlBlockPtr btreePtr;
+	BlockDescriptor node;
+	NodeDescPtr nodeDesc;
+	UInt32 startWrites;
+	UInt32 nodeNum;
+	UInt32 freeNum;
+	Boolean allocated;
+	SInt8 kind;
+
+	M_ReturnErrorIf(filePtr == nil, paramErr);
+
+	btreePtr = (BTreeControlBlockPtr)filePtr->fcbBTCBPtr;
+
+	M_ReturnErrorIf(btreePtr == nil, fsBTInvalidFileErr);
+
+	REQUIRE_FILE_LOCK(btreePtr->fileRefNum, false);
+
+	node.buffer = nil;
+	node.blockHeader = nil;
+
+	*done = false;
+	startWrites = btreePtr->numUpdateNodes;
+
+	if (state->nextSlot == 0) // starting a pass
+	{
+		state->height = btreePtr->treeDepth;
+		state->nodeNum = 0;
+		state->nextSlot = kHeaderNodeNum + 1;
+	}
+
+	while (state->height > 0 && (btreePtr->numUpdateNodes - startWrites) < writeBudget) {
+		if (state->nodeNum == 0) {
+			err = GetLeftmostNode(btreePtr, state->height, &state->nodeNum);
+			M_ExitOnError(err);
+		}
+		nodeNum = state->nodeNum;
+
+		if (nodeNum != state->nextSlot && state->nextSlot < btreePtr->totalNodes) {
+			/////////////////////// Clear The Target Slot ///////////////////////
+
+			err = IsNodeAllocated(btreePtr, state->nextSlot, &allocated);
+			M_ExitOnError(err);
+
+			if (allocated) {
+				err = GetNode(btreePtr, state->nextSlot, &node);
+				M_ExitOnError(err);
+
+				kind = ((NodeDescPtr)node.buffer)->kind;
+
+				err = ReleaseNode(btreePtr, &node);
+				M_ExitOnError(err);
+
+				if (kind == kBTMapNode) {
+					++state->nextSlot; // map nodes stay put
+					continue;
+				}
+
+				err = EnsureFreeNodes(btreePtr, 1);
+				M_ExitOnError(err);
+
+				err = AllocateNodeFrom(btreePtr, state->nextSlot + 1, &freeNum);
+				if (err == fsBTFullErr || err == fsBTNoMoreMapNodesErr) {
+					// every free node is below the slot; grow the file past it
+					err = EnsureFreeNodes(btreePtr, btreePtr->freeNodes + 1);
+					M_ExitOnError(err);
+
+					err = AllocateNodeFrom(btreePtr, state->nextSlot + 1, &freeNum);
+				}
+				M_ExitOnError(err);
+
+				err = MoveNode(btreePtr, state->nextSlot, freeNum);
+				if (err == fsBTInvalidNodeErr || err == fsBTBadNodeType) {
+					// can't find what points at it; leave it and use the next slot
+					err = FreeNode(btreePtr, freeNum);
+					M_ExitOnError(err);
+					++state->nextSlot;
+					continue;
+				}
+				M_ExitOnError(err);
+			}
+
+			//////////////////////// Move Node Into Slot ////////////////////////
+
+			err = AllocateNodeFrom(btreePtr, state->nextSlot, &freeNum);
+			M_ExitOnError(err);
+
+			err = MoveNode(btreePtr, nodeNum, freeNum);
+			if (err == fsBTInvalidNodeErr) {
+				// not reachable by its first key; leave it where it is
+				err = FreeNode(btreePtr, freeNum);
+			} else if (err == noErr) {
+				nodeNum = freeNum;
+			}
+			M_ExitOnError(err);
+		}
+
+		err = GetNode(btreePtr, nodeNum, &node);
+		M_ExitOnError(err);
+
+		nodeDesc = node.buffer;
+		state->nodeNum = nodeDesc->fLink;
+
+		err = ReleaseNode(btreePtr, &node);
+		M_ExitOnError(err);
+
+		if (nodeNum >= state->nextSlot)
+			state->nextSlot = nodeNum + 1;
+
+		if (state->nodeNum == 0)
+			--state->height; // on to the next level down
+	}
+
+	*done = (state->height == 0);
+
+	return noErr;
+
+ErrorExit:
+
+	(void)ReleaseNode(btreePtr, &node);
+
+	return err;
+}
+
+/*-------------------------------------------------------------------------------
+Routine:	MoveNode	-	Copy a node to a free node and free the original.
+
+Function:	The path to srcNum is found by searching for its first key, which
+			gives the parent record that points at it.  dstNum must already be
+			allocated (and is usually still empty).
+-------------------------------------------------------------------------------*/
+
+static OSStatus
+MoveNode(BTreeControlBlockPtr btreePtr, UInt32 srcNum, UInt32 dstNum)
+{
+	OSStatus err;
+	TreePathTable treePathTable;
+	BlockDescriptor srcNode;
+	BlockDescriptor dstNode;
+	BlockDescriptor node;
+	NodeDescPtr srcDesc;
+	BTreeKey firstKey;
+	KeyPtr keyPtr;
+	UInt8 *dataPtr;
+	UInt16 dataSize;
+	UInt32 foundNum;
+	UInt32 bLink;
+	UInt32 fLink;
+	UInt16 index;
+	UInt16 height;
+	SInt8 kind;
+
+	srcNode.buffer = nil;
+	srcNode.blockHeader = nil;
+	dstNode.buffer = nil;
+	dstNode.blockHeader = nil;
+	node.buffer = nil;
+	node.blockHeader = nil;
+
+	////////////////////////////// Find The Parent //////////////////////////////
+
+	err = GetNode(btreePtr, srcNum, &srcNode);
+	M_ExitOnError(err);
+
+	srcDesc = srcNode.buffer;
+	kind = srcDesc->kind;
+	height = srcDesc->height;
+	bLink = srcDesc->bLink;
+	fLink = srcDesc->fLink;
+
+	if ((kind != kBTLeafNode && kind != kBTIndexNode) || height == 0 || height > btreePtr->treeDepth || srcDesc->numRecords == 0) {
+		err = fsBTBadNodeType;
+		goto ErrorExit;
+	}
+
+	err = GetRecordByIndex(btreePtr, srcDesc, 0, &keyPtr, &dataPtr, &dataSize);
+	M_ExitOnError(err);
+
+	bcopy(keyPtr, &firstKey, CalcKeySize(btreePtr, keyPtr));
+
+	err = ReleaseNode(btreePtr, &srcNode);
+	M_ExitOnError(err);
+
+	err = SearchTree(btreePtr, &firstKey, treePathTable, &foundNum, &node, &index);
+	if (err != noErr && err != fsBTRecordNotFoundErr)
+		goto ErrorExit;
+
+	err = ReleaseNode(btreePtr, &node);
+	M_ExitOnError(err);
+
+	if (treePathTable[height].node != srcNum) {
+		err = fsBTInvalidNodeErr;
+		goto ErrorExit;
+	}
+
+	if (height < btreePtr->treeDepth) {
+		err = GetNode(btreePtr, treePathTable[height + 1].node, &node);
+		M_ExitOnError(err);
+
+		err = GetRecordByIndex(btreePtr, node.buffer, treePathTable[height + 1].index, &keyPtr, &dataPtr, &dataSize);
+		M_ExitOnError(err);
+
+		if (*(UInt32 *)dataPtr != srcNum) {
+			err = fsBTInvalidNodeErr;
+			goto ErrorExit;
+		}
+
+		err = ReleaseNode(btreePtr, &node);
+		M_ExitOnError(err);
+	}
+
+	////////////////////////////// Copy The Node ////////////////////////////////
+
+	err = GetNode(btreePtr, srcNum, &srcNode);
+	M_ExitOnError(err);
+
+	err = GetNewNode(btreePtr, dstNum, &dstNode);
+	M_ExitOnError(err);
+
+	// XXXdbg
+	ModifyBlockStart(btreePtr->fileRefNum, &dstNode);
+
+	bcopy(srcNode.buffer, dstNode.buffer, btreePtr->nodeSize);
+
+	err = UpdateNode(btreePtr, &dstNode, 0, kLockTransaction);
+	M_ExitOnError(err);
+
+	/////////////////////////// Repoint The Neighbors ///////////////////////////
+
+	if (bLink != 0) {
+		err = GetNode(btreePtr, bLink, &node);
+		M_ExitOnError(err);
+
+		// XXXdbg
+		ModifyBlockStart(btreePtr->fileRefNum, &node);
+
+		((NodeDescPtr)node.buffer)->fLink = dstNum;
+
+		err = UpdateNode(btreePtr, &node, 0, kLockTransaction);
+		M_ExitOnError(err);
+	} else if (kind == kBTLeafNode) {
+		btreePtr->firstLeafNode = dstNum;
+	}
+
+	if (fLink != 0) {
+		err = GetNode(btreePtr, fLink, &node);
+		M_ExitOnError(err);
+
+		// XXXdbg
+		ModifyBlockStart(btreePtr->fileRefNum, &node);
+
+		((NodeDescPtr)node.buffer)->bLink = dstNum;
+
+		err = UpdateNode(btreePtr, &node, 0, kLockTransaction);
+		M_ExitOnError(err);
+	} else if (kind == kBTLeafNode) {
+		btreePtr->lastLeafNode = dstNum;
+	}
+
+	if (height == btreePtr->treeDepth) {
+		btreePtr->rootNode = dstNum;
+	} else {
+		err = GetNode(btreePtr, treePathTable[height + 1].node, &node);
+		M_ExitOnError(err);
+
+		// XXXdbg
+		ModifyBlockStart(btreePtr->fileRefNum, &node);
+
+		err = GetRecordByIndex(btreePtr, node.buffer, treePathTable[height + 1].index, &keyPtr, &dataPtr, &dataSize);
+		M_ExitOnError(err);
+
+		*(UInt32 *)dataPtr = dstNum;
+
+		err = UpdateNode(btreePtr, &node, 0, kLockTransaction);
+		M_ExitOnError(err);
+	}
+
+	///////////////////////////// Free The Original /////////////////////////////
+
+	// XXXdbg
+	ModifyBlockStart(btreePtr->fileRefNum, &srcNode);
+
+	ClearNode(btreePtr, srcNode.buffer);
+
+	err = UpdateNode(btreePtr, &srcNode, 0, kLockTransaction);
+	M_ExitOnError(err);
+
+	err = FreeNode(btreePtr, srcNum);
+	M_ExitOnError(err);
+
+	++btreePtr->writeCount;
+	M_BTreeHeaderDirty(btreePtr);
+
+	return noErr;
+
+ErrorExit:
+
+	(void)ReleaseNode(btreePtr, &node);
+	(void)ReleaseNode(btreePtr, &dstNode);
+	(void)ReleaseNode(btreePtr, &srcNode);
+
+	return err;
+}
+
+//////////////////////////////// BTTrimFreeNodes ////////////////////////////////
+
+/*-------------------------------------------------------------------------------
+Routine:	BTTrimFreeNodes	-	Drop the free nodes at the end of the file.
+
+Function:	Lowers totalNodes to just past the last node in use, rounded up to
+			nodeMultiple (the nodes per allocation block, so the file can be
+			truncated on a block boundary).  Map nodes that are no longer needed
+			to cover the smaller file are freed and unlinked; one that is still
+			needed but lies past the new end keeps the file that long.
+
+			Only the header is changed; the caller truncates the fork to
+			newTotalNodes * nodeSize and flushes the header.  Nothing is done if
+			the file can't be made smaller (newTotalNodes == totalNodes).
+
+Input:		filePtr			- B*Tree file
+			nodeMultiple	- node count granularity (0 or 1 for none)
+
+Output:		newTotalNodes	- node count the file must be kept at
+
+Result:		noErr		- success
+			!= noErr	- failure
+-------------------------------------------------------------------------------*/
+
+OSStatus
+BTTrimFreeNodes(FCB *filePtr, UInt32 nodeMultiple, UInt32 *newTotalNodes)
+{
+	OSStatus err;
+	BTreeControlBlockPtr btreePtr;
+	BlockDescriptor node;
+	UInt16 *mapPtr;
+	UInt16 mapSize;
+	UInt32 *mapNodes;
+	UInt32 *mapBits;
+	UInt32 mapCount;
+	UInt32 keepCount;
+	UInt32 covered;
+	UInt32 lastNode;
+	UInt32 newTotal;
+	UInt32 nodeNum;
+	UInt32 i;
+	Boolean isMapNode;
+
+	M_ReturnErrorIf(filePtr == nil, paramErr);
+
+	btreePtr = (BTreeControlBlockPtr)filePtr->fcbBTCBPtr;
+
+	M_ReturnErrorIf(btreePtr == nil, fsBTInvalidFileErr);
+
+	REQUIRE_FILE_LOCK(btreePtr->fileRefNum, false);
+
+	if (nodeMultiple == 0)
+		nodeMultiple = 1;
+
+	node.buffer = nil;
+	node.blockHeader = nil;
+	mapNodes = nil;
+
+	*newTotalNodes = btreePtr->totalNodes;
+
+	//////////////////////////// List The Map Records ///////////////////////////
+
+	// the header's map record is entry 0 (node kHeaderNodeNum)
+	mapCount = 0;
+	while ((err = GetMapNode(btreePtr, &node, &mapPtr, &mapSize)) == noErr)
+		++mapCount;
+	if (err != fsBTNoMoreMapNodesErr)
+		goto ErrorExit;
+
+	mapNodes = (UInt32 *)malloc(2 * mapCount * sizeof(UInt32), M_TEMP, M_WAITOK);
+	mapBits = mapNodes + mapCount;
+
+	nodeNum = kHeaderNodeNum;
+	for (i = 0; i < mapCount; ++i) {
+		err = GetMapNode(btreePtr, &node, &mapPtr, &mapSize);
+		M_ExitOnError(err);
+
+		mapNodes[i] = nodeNum;
+		mapBits[i] = mapSize << 3;
+		nodeNum = ((NodeDescPtr)node.buffer)->fLink;
+	}
+	err = ReleaseNode(btreePtr, &node);
+	M_ExitOnError(err);
+
+	/////////////////////////// Find The Last Node In Use ///////////////////////
+
+	lastNode = btreePtr->totalNodes;
+	do {
+		err = GetLastAllocatedNode(btreePtr, lastNode, &lastNode);
+		M_ExitOnError(err);
+
+		isMapNode = false;
+		for (i = 1; i < mapCount; ++i)
+			if (mapNodes[i] == lastNode)
+				isMapNode = true;
+	} while (isMapNode);
+
+	//////////////////////// Pick The Map Nodes To Keep /////////////////////////
+
+	newTotal = lastNode + 1;
+	for (;;) {
+		newTotal = ((newTotal + nodeMultiple - 1) / nodeMultiple) * nodeMultiple;
+		if (newTotal >= btreePtr->totalNodes)
+			goto Exit; // nothing to give back
+
+		keepCount = 0;
+		covered = 0;
+		while (covered < newTotal && keepCount < mapCount)
+			covered += mapBits[keepCount++];
+
+		// a map node we keep must itself be inside the file
+		nodeNum = newTotal;
+		for (i = 1; i < keepCount; ++i)
+			if (mapNodes[i] >= nodeNum)
+				nodeNum = mapNodes[i] + 1;
+		if (nodeNum == newTotal)
+			break;
+		newTotal = nodeNum;
+	}
+
+	////////////////////////// Drop The Unneeded Ones ///////////////////////////
+
+	// free them while the chain still reaches their map bits
+	for (i = keepCount; i < mapCount; ++i) {
+		err = FreeNode(btreePtr, mapNodes[i]);
+		M_ExitOnError(err);
+	}
+
+	if (keepCount < mapCount) {
+		err = GetNode(btreePtr, mapNodes[keepCount - 1], &node);
+		M_ExitOnError(err);
+
+		// XXXdbg
+		ModifyBlockStart(btreePtr->fileRefNum, &node);
+
+		((NodeDescPtr)node.buffer)->fLink = 0;
+
+		err = UpdateNode(btreePtr, &node, 0, kLockTransaction);
+		M_ExitOnError(err);
+	}
+
+	btreePtr->freeNodes -= btreePtr->totalNodes - newTotal;
+	btreePtr->totalNodes = newTotal;
+	++btreePtr->writeCount;
+	M_BTreeHeaderDirty(btreePtr);
+
+	*newTotalNodes = newTotal;
+
+Exit:
+
+	free(mapNodes, M_TEMP);
+
+	return noErr;
+
+ErrorExit:
+
+	(void)ReleaseNode(btreePtr, &node);
+	if (mapNodes != nil)
+		free(mapNodes, M_TEMP);
+
+	return err;
+}
+
+//////////////////////////////// Local Routines /////////////////////////////////
+
+/*-------------------------------------------------------------------------------
+Routine:	GetLeftmostNode	-	Return the first node of a level of the tree.
+-------------------------------------------------------------------------------*/
+
+static OSStatus
+GetLeftmostNode(BTreeControlBlockPtr btreePtr, UInt16 height, UInt32 *nodeNum)
+{
+	OSStatus err;
+	BlockDescriptor node;
+	NodeDescPtr nodeDesc;
+	KeyPtr keyPtr;
+	UInt8 *dataPtr;
+	UInt16 dataSize;
+	UInt16 curHeight;
+
+	*nodeNum = btreePtr->rootNode;
+
+	for (curHeight = btreePtr->treeDepth; curHeight > height; --curHeight) {
+		err = GetNode(btreePtr, *nodeNum, &node);
+		M_ReturnErrorIf(err != noErr, err);
+
+		nodeDesc = node.buffer;
+		if (nodeDesc->kind != kBTIndexNode || nodeDesc->height != curHeight || nodeDesc->numRecords == 0)
+			err = fsBTInvalidNodeErr;
+		else
+			err = GetRecordByIndex(btreePtr, nodeDesc, 0, &keyPtr, &dataPtr, &dataSize);
+		if (err == noErr)
+			*nodeNum = *(UInt32 *)dataPtr;
+
+		(void)ReleaseNode(btreePtr, &node);
+		M_ReturnErrorIf(err != noErr, err);
+	}
+
+	return noErr;
+}
+
+/*-------------------------------------------------------------------------------
+Routine:	IsNodeAllocated	-	Test a node's bit in the allocation map.
+-------------------------------------------------------------------------------*/
+
+static OSStatus
+IsNodeAllocated(BTreeControlBlockPtr btreePtr, UInt32 nodeNum, Boolean *allocated)
+{
+	OSStatus err;
+	BlockDescriptor node;
+	UInt32 nodeIndex;
+	UInt16 mapSize;
+	UInt16 *mapPos;
+
+	nodeIndex = 0; // first node number of header map record
+	node.buffer = nil;
+	node.blockHeader = nil;
+
+	while (nodeNum >= nodeIndex) {
+		err = GetMapNode(btreePtr, &node, &mapPos, &mapSize);
+		M_ReturnErrorIf(err != noErr, err);
+
+		nodeIndex += mapSize << 3;
+	}
+
+	nodeNum -= nodeIndex - (mapSize << 3); // relative to this map record
+	*allocated = (((UInt8 *)mapPos)[nodeNum >> 3] & (0x80 >> (nodeNum & 7))) != 0;
+
+	return ReleaseNode(btreePtr, &node);
+}
+
+/*-------------------------------------------------------------------------------
+Routine:	GetLastAllocatedNode	-	Highest node in use below limit.
+
+Function:	The header node is always in use, so there is always one.
+-------------------------------------------------------------------------------*/
+
+static OSStatus
+GetLastAllocatedNode(BTreeControlBlockPtr btreePtr, UInt32 limit, UInt32 *nodeNum)
+{
+	OSStatus err;
+	BlockDescriptor node;
+	UInt8 *mapBytes;
+	UInt32 nodeIndex;
+	UInt32 byteNum;
+	UInt32 bitNum;
+	UInt32 lastNode;
+	UInt16 mapSize;
+	UInt16 *mapPos;
+
+	nodeIndex = 0;
+	lastNode = kHeaderNodeNum;
+	node.buffer = nil;
+	node.blockHeader = nil;
+
+	while (nodeIndex < limit) {
+		err = GetMapNode(btreePtr, &node, &mapPos, &mapSize);
+		if (err == fsBTNoMoreMapNodesErr)
+			break;
+		M_ReturnErrorIf(err != noErr, err);
+
+		mapBytes = (UInt8 *)mapPos;
+		for (byteNum = 0; byteNum < mapSize && nodeIndex + (byteNum << 3) < limit; ++byteNum) {
+			if (mapBytes[byteNum] == 0)
+				continue;
+			for (bitNum = 0; bitNum < 8 && nodeIndex + (byteNum << 3) + bitNum < limit; ++bitNum)
+				if (mapBytes[byteNum] & (0x80 >> bitNum))
+					lastNode = nodeIndex + (byteNum << 3) + bitNum;
+		}
+
+		nodeIndex += mapSize << 3;
+	}
+
+	*nodeNum = lastNode;
+
+	return ReleaseNode(btreePtr, &node);
+}
+
+/*-------------------------------------------------------------------------------
+Routine:	EnsureFreeNodes	-	Extend the file so count nodes are free.
+-------------------------------------------------------------------------------*/
+
+static OSStatus
+EnsureFreeNodes(BTreeControlBlockPtr btreePtr, UInt32 count)
+{
+	SInt32 nodesNeeded;
+
+	nodesNeeded = count - btreePtr->freeNodes;
+	if (nodesNeeded <= 0)
+		return noErr;
+
+	nodesNeeded += btreePtr->totalNodes;
+	if (nodesNeeded > CalcMapBits(btreePtr)) // we'll need to add a map node too!
+		++nodesNeeded;
+
+	return ExtendBTree(btreePtr, nodesNeeded);
+}
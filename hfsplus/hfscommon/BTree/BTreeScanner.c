@@ -21,9 +21,22 @@
  *
  *	@(#)BTreeScanner.c
  */
+#ifndef HFS_SEARCH_TEST
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/bio.h>
+#include <sys/buf.h>
 #include <sys/kernel.h>
+#include <sys/time.h>
+
+#include <hfsplus/hfs.h>
+#include <hfsplus/hfs_cnode.h>
+#include <hfsplus/hfs_endian.h>
 
 #include "../headers/BTreeScanner.h"
+#endif
+
+static Boolean LeafNodeLooksValid(BTreeControlBlock *btcb, const BTNodeDescriptor *node);
 
 static int FindNextLeafNode(BTScanState *scanState, Boolean avoidIO);
 static int ReadMultipleNodes(BTScanState *scanState);
@@ -156,8 +169,29 @@ FindNextLeafNode(BTScanState *scanState, Boolean avoidIO)
 				continue;
 			}
 
-			(u_int8_t *)scanState->currentNodePtr += scanState->btcb->nodeSize;
+			scanState->currentNodePtr = (BTNodeDescriptor *)((u_int8_t *)scanState->currentNodePtr + scanState->btcb->nodeSize);
+		}
+
+		//	Nodes come straight off the device, so they are still big-endian.
+		//	Only leaf nodes are swapped; free nodes may hold stale data, so
+		//	sanity check the descriptor before handing it to the swapper.
+		if (!LeafNodeLooksValid(scanState->btcb, scanState->currentNodePtr))
+			continue;
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+		{
+			BlockDescriptor block;
+			struct vnode *vp = scanState->btcb->fileRefNum;
+
+			block.blockHeader = NULL;
+			block.buffer = scanState->currentNodePtr;
+			block.blockSize = scanState->btcb->nodeSize;
+			block.blockReadFromDisk = 1;
+			block.isModified = 0;
+			if (hfs_swap_BTNode(&block, ISHFSPLUS(VTOVCB(vp)), VTOC(vp)->c_fileid, 0) != 0)
+				continue;
 		}
+#endif
 
 		// Make sure this is a valid node
 		if (CheckNode(scanState->btcb, scanState->currentNodePtr) != noErr) {
@@ -172,6 +206,42 @@ FindNextLeafNode(BTScanState *scanState, Boolean avoidIO)
 
 } /* FindNextLeafNode */
 
+//_________________________________________________________________________________
+//
+//	Routine:	LeafNodeLooksValid
+//
+//	Purpose:	Check that an unswapped (big-endian) node is a leaf node whose
+//				record offsets are in range, so it is safe to swap.
+//_________________________________________________________________________________
+
+static Boolean
+LeafNodeLooksValid(BTreeControlBlock *btcb, const BTNodeDescriptor *node)
+{
+	const u_int16_t *offsets;
+	u_int16_t numRecords, offset, prev;
+	u_int32_t i;
+
+	if (node->kind != kBTLeafNode || node->height != 1)
+		return false;
+
+	numRecords = be16toh(node->numRecords);
+	if (numRecords == 0 || (numRecords + 1) * sizeof(u_int16_t) + sizeof(BTNodeDescriptor) > btcb->nodeSize)
+		return false;
+
+	//	Offsets are stored backwards from the end of the node
+	offsets = (const u_int16_t *)((const u_int8_t *)node + btcb->nodeSize);
+	prev = sizeof(BTNodeDescriptor) - 1;
+	for (i = 1; i <= (u_int32_t)numRecords + 1; i++) {
+		offset = be16toh(offsets[-(int)i]);
+		if (offset <= prev || offset >= btcb->nodeSize - (numRecords + 1) * sizeof(u_int16_t) + 1)
+			return false;
+		prev = offset;
+	}
+
+	return true;
+
+} /* LeafNodeLooksValid */
+
 //_________________________________________________________________________________
 //
 //	Routine:	ReadMultipleNodes
@@ -193,9 +263,10 @@ ReadMultipleNodes(BTScanState *theScanStatePtr)
 	BTreeControlBlockPtr myBTreeCBPtr;
 	daddr_t myPhyBlockNum;
 	u_int32_t myBufferSize;
-	struct vnode *myDevPtr;
-	int myBlockRun;
-	u_int32_t myBlocksInBufferCount;
+	struct vnode *myFileVp;
+	struct hfsmount *myHfsmp;
+	size_t myBytesAvail;
+	int myLockExtents;
 
 	// release old buffer if we have one
 	if (theScanStatePtr->bufferPtr != NULL) {
@@ -207,24 +278,40 @@ ReadMultipleNodes(BTScanState *theScanStatePtr)
 
 	myBTreeCBPtr = theScanStatePtr->btcb;
 
-	// map logical block in catalog btree file to physical block on volume
-	myErr = VOP_BMAP(myBTreeCBPtr->fileRefNum, theScanStatePtr->nodeNum, &myDevPtr, &myPhyBlockNum, &myBlockRun);
+	myFileVp = myBTreeCBPtr->fileRefNum;
+	myHfsmp = VTOHFS(myFileVp);
+
+	// map the node number in the btree file to a physical block on the volume,
+	// and find out how many bytes are contiguous from there
+	myLockExtents = overflow_extents(VTOF(myFileVp));
+	if (myLockExtents) {
+		myErr = hfs_metafilelocking(myHfsmp, kHFSExtentsFileID, LK_EXCLUSIVE | LK_CANRECURSE, curthread);
+		if (myErr != E_NONE)
+			goto ExitThisRoutine;
+	}
+	myErr = MacToVFSError(MapFileBlockC(HFSTOVCB(myHfsmp), VTOF(myFileVp), theScanStatePtr->bufferSize,
+	    (off_t)theScanStatePtr->nodeNum * myBTreeCBPtr->nodeSize, &myPhyBlockNum, &myBytesAvail));
+	if (myLockExtents)
+		(void)hfs_metafilelocking(myHfsmp, kHFSExtentsFileID, LK_RELEASE, curthread);
 	if (myErr != E_NONE) {
 		goto ExitThisRoutine;
 	}
 
-	// bmap block run gives us the remaining number of valid blocks (number of blocks
-	// minus the first).  so if there are 10 valid blocks our run number will be 9.
-	// blocks, in our case is the same as nodes (both are 4K)
-	myBlocksInBufferCount = (theScanStatePtr->bufferSize / myBTreeCBPtr->nodeSize);
+	// read as many whole nodes as are contiguous on disk, up to the buffer size
 	myBufferSize = theScanStatePtr->bufferSize;
-	if ((myBlockRun + 1) < myBlocksInBufferCount) {
-		myBufferSize = (myBlockRun + 1) * myBTreeCBPtr->nodeSize;
+	if (myBytesAvail < myBufferSize) {
+		myBufferSize = (myBytesAvail / myBTreeCBPtr->nodeSize) * myBTreeCBPtr->nodeSize;
+		if (myBufferSize == 0)
+			myBufferSize = myBTreeCBPtr->nodeSize;
 	}
 
 	// now read blocks from the device
-	myErr = bread(myDevPtr, myPhyBlockNum, myBufferSize, NOCRED, &theScanStatePtr->bufferPtr);
+	myErr = bread(myHfsmp->hfs_devvp, myPhyBlockNum, myBufferSize, NOCRED, &theScanStatePtr->bufferPtr);
 	if (myErr != E_NONE) {
+		if (theScanStatePtr->bufferPtr != NULL) {
+			brelse(theScanStatePtr->bufferPtr);
+			theScanStatePtr->bufferPtr = NULL;
+		}
 		goto ExitThisRoutine;
 	}
 
@@ -290,6 +377,8 @@ BTScanInitialize(const FCB *btreeFile, u_int32_t startingNode, u_int32_t startin
 	//
 	if (bufferSize < btcb->nodeSize)
 		return paramErr;
+	if (bufferSize > MAXBSIZE)
+		bufferSize = MAXBSIZE;
 	bufferSize = (bufferSize / btcb->nodeSize) * btcb->nodeSize;
 
 	//
@@ -303,7 +392,7 @@ BTScanInitialize(const FCB *btreeFile, u_int32_t startingNode, u_int32_t startin
 	scanState->currentNodePtr = NULL;
 	scanState->nodesLeftInBuffer = 0; // no nodes currently in buffer
 	scanState->recordsFound = recordsFound;
-	scanState->startTime = time; // initialize our throttle
+	microuptime(&scanState->startTime); // initialize our throttle
 
 	return noErr;
 
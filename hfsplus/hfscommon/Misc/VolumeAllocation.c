@@ -40,6 +40,14 @@ Public routines:
 	BlockDeallocate
 					Deallocate a contiguous run of allocation blocks.
 
+	hfs_trim_init
+					Set up the per-mount list of freed extents to be trimmed,
+					and start the mount-time scan of free space.
+	hfs_trim_flush
+					Issue every pending freed extent to the device as BIO_DELETE.
+	hfs_trim_destroy
+					Stop the free space scan, flush and wait for all trims.
+
 
 Internal routines:
 	BlockMarkFree
@@ -73,6 +81,16 @@ Internal routines:
 
 	ReleaseBitmapBlock
 					Release a bitmap block back into the buffer cache.
+
+	hfs_unmap_free_extent
+					Add a freed range of allocation blocks to the pending trim list.
+	hfs_unmap_alloc_extent
+					Remove a newly allocated range from the pending trim list, and
+					wait for any in-flight trim that still covers it.
+	hfs_issue_unmap
+					Send a list of device byte ranges down as BIO_DELETE.
+	ScanUnmapBlocks
+					Walk the whole bitmap and trim every free range (mount time).
 */
 
 #ifndef NULL
@@ -80,12 +98,26 @@ Internal routines:
 #define nil NULL
 #endif
 
+/*
+ * xnu/tests/hfs_alloc_test.c builds only the TRIM/UNMAP routines at the end
+ * of this file, against its own stubs for the bitmap and GEOM.
+ */
+#ifndef HFS_TRIM_TEST
+
 #include <sys/types.h>
 
+#include <sys/bio.h>
 #include <sys/buf.h>
+#include <sys/kernel.h>
+#include <sys/kthread.h>
+#include <sys/malloc.h>
 #include <sys/param.h>
+#include <sys/proc.h>
+#include <sys/sysctl.h>
 #include <sys/systm.h>
 
+#include <geom/geom.h>
+
 #include <hfsplus/hfs_macos_defs.h>
 
 #include <hfsplus/hfs.h>
@@ -161,6 +193,29 @@ static OSErr BlockAllocateKnown(
 	UInt32			*actualStartBlock,
 	UInt32			*actualNumBlocks);
 
+static void hfs_unmap_free_extent(
+	ExtendedVCB		*vcb,
+	UInt32			startingBlock,
+	UInt32			numBlocks);
+
+static void hfs_unmap_alloc_extent(
+	ExtendedVCB		*vcb,
+	UInt32			startingBlock,
+	UInt32			numBlocks);
+
+static void hfs_track_unmap_blocks(
+	struct hfsmount	*hfsmp,
+	struct hfs_trim_batch **batch,
+	UInt32			startingBlock,
+	UInt32			numBlocks);
+
+static void hfs_issue_unmap(
+	struct hfsmount	*hfsmp,
+	struct hfs_trim_batch *batch);
+
+static void ScanUnmapBlocks(
+	void			*arg);
+
 
 /*
 ;________________________________________________________________________________
@@ -305,6 +360,11 @@ OSErr BlockAllocate (
 		VCB_UNLOCK(vcb);
 
 		MarkVCBDirty(vcb);
+
+		//
+		//	Make sure no pending or in-flight trim covers the blocks we hand out.
+		//
+		hfs_unmap_alloc_extent(vcb, *actualStartBlock, *actualNumBlocks);
 	}
 	
 Exit:
@@ -365,6 +425,8 @@ OSErr BlockDeallocate (
 	VCB_UNLOCK(vcb);
 	MarkVCBDirty(vcb);
 
+	hfs_unmap_free_extent(vcb, firstBlock, numBlocks);
+
 Exit:
 
 	return err;
@@ -1480,4 +1542,581 @@ ErrorExit:
 	return err;
 }
 
+#endif /* !HFS_TRIM_TEST */
+
+
+/*
+ * TRIM/UNMAP support.
+ *
+ * Freed extents are collected on hfsmp->hfs_trim (see hfs.h) and sent to the
+ * device as BIO_DELETE.  There is no journal transaction to hang them off, so
+ * the pending list is flushed from hfs_sync() after the B-trees and volume
+ * header have been written, and again at unmount.
+ */
+static MALLOC_DEFINE(M_HFSTRIM, "HFS trim", "HFS pending TRIM extents");
+
+static int hfs_trim_enable = 1;
+SYSCTL_INT(_vfs_hfs, OID_AUTO, trim, CTLFLAG_RWTUN, &hfs_trim_enable, 0,
+    "Send freed space to the device as BIO_DELETE");
+
+static int hfs_trim_on_mount = 1;
+SYSCTL_INT(_vfs_hfs, OID_AUTO, trim_on_mount, CTLFLAG_RWTUN, &hfs_trim_on_mount, 0,
+    "Trim all free space in the background after a read-write mount");
+
+static int hfs_trim_scan_rate = 4096;
+SYSCTL_INT(_vfs_hfs, OID_AUTO, trim_scan_rate, CTLFLAG_RWTUN, &hfs_trim_scan_rate, 0,
+    "Maximum MB/s of free space trimmed by the mount-time scan (0 = unlimited)");
+
+/* Bitmap blocks examined per extents B-tree lock hold during the scan */
+#define HFS_TRIM_SCAN_CHUNK	256
+
+#define HFS_TRIM_OFFSET(vcb, blk) \
+	((off_t)(blk) * (vcb)->blockSize + (off_t)(vcb)->hfsPlusIOPosOffset)
+
+#define HFS_TRIM_END(ext)	((ext)->te_offset + (ext)->te_length)
+
+
+/*
+ * Return the index of the first extent in a sorted list that ends at or
+ * after the given device offset.
+ */
+static UInt32
+hfs_trim_lookup(struct hfs_trim_extent *ext, UInt32 count, off_t offset)
+{
+	UInt32 lo = 0, hi = count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (HFS_TRIM_END(&ext[mid]) < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+
+static struct hfs_trim_batch *
+hfs_trim_batch_alloc(UInt32 count)
+{
+	struct hfs_trim_batch *tb;
+
+	tb = malloc(sizeof(*tb) + count * sizeof(struct hfs_trim_extent), M_HFSTRIM, M_WAITOK);
+	tb->tb_count = 0;
+	tb->tb_pending = 0;
+	return (tb);
+}
+
+
+/*
+;________________________________________________________________________________
+;
+; Routine:		hfs_unmap_free_extent
+;
+; Function:		Make note of a range of allocation blocks that should be
+;				unmapped (trimmed).  The range is merged into the sorted
+;				pending list, coalescing with any extent it touches, and
+;				is issued at the next hfs_trim_flush.
+;
+;				If the list is full the range is dropped; it will be
+;				picked up by the free space scan at the next mount.
+;
+; Input Arguments:
+;	vcb				- The volume containing the allocation blocks.
+;	startingBlock	- The first allocation block of the extent being freed.
+;	numBlocks		- The number of allocation blocks of the extent being freed.
+;________________________________________________________________________________
+*/
+static void
+hfs_unmap_free_extent(ExtendedVCB *vcb, UInt32 startingBlock, UInt32 numBlocks)
+{
+	struct hfs_trim_list *tl = &VCBTOHFS(vcb)->hfs_trim;
+	struct hfs_trim_extent *ext;
+	off_t offset, end;
+	UInt32 first, i;
+
+	if (!tl->tl_enabled || !hfs_trim_enable)
+		return;
+
+	offset = HFS_TRIM_OFFSET(vcb, startingBlock);
+	end = offset + (off_t)numBlocks * vcb->blockSize;
+
+	mtx_lock(&tl->tl_lock);
+	ext = tl->tl_extents;
+
+	/* Absorb every pending extent that overlaps or abuts [offset, end) */
+	first = hfs_trim_lookup(ext, tl->tl_count, offset);
+	for (i = first; i < tl->tl_count && ext[i].te_offset <= end; ++i) {
+		offset = MIN(offset, ext[i].te_offset);
+		end = MAX(end, HFS_TRIM_END(&ext[i]));
+	}
+
+	if (i > first) {
+		if (i > first + 1) {
+			bcopy(&ext[i], &ext[first + 1], (tl->tl_count - i) * sizeof(*ext));
+			tl->tl_count -= i - first - 1;
+		}
+	} else if (tl->tl_count < HFS_TRIM_MAXEXTENTS) {
+		bcopy(&ext[first], &ext[first + 1], (tl->tl_count - first) * sizeof(*ext));
+		++tl->tl_count;
+	} else {
+		mtx_unlock(&tl->tl_lock);
+		return;
+	}
+	ext[first].te_offset = offset;
+	ext[first].te_length = end - offset;
+
+	mtx_unlock(&tl->tl_lock);
+}
+
+
+/*
+;________________________________________________________________________________
+;
+; Routine:		hfs_unmap_alloc_extent
+;
+; Function:		Make note of a range of allocation blocks, some of which
+;				may have previously been passed to hfs_unmap_free_extent,
+;				that is now in use on the volume.  The range is carved out
+;				of the pending list, and if an issued BIO_DELETE still
+;				covers any of it we wait for that batch to complete so the
+;				new owner's writes cannot be discarded.
+;
+; Input Arguments:
+;	vcb				- The volume containing the allocation blocks.
+;	startingBlock	- The first allocation block of the extent being allocated.
+;	numBlocks		- The number of allocation blocks being allocated.
+;________________________________________________________________________________
+*/
+static void
+hfs_unmap_alloc_extent(ExtendedVCB *vcb, UInt32 startingBlock, UInt32 numBlocks)
+{
+	struct hfs_trim_list *tl = &VCBTOHFS(vcb)->hfs_trim;
+	struct hfs_trim_extent *ext;
+	struct hfs_trim_batch *tb;
+	off_t offset, end, extEnd;
+	UInt32 i;
+
+	if (tl->tl_extents == NULL)
+		return;
+
+	offset = HFS_TRIM_OFFSET(vcb, startingBlock);
+	end = offset + (off_t)numBlocks * vcb->blockSize;
+
+	mtx_lock(&tl->tl_lock);
+	ext = tl->tl_extents;
+
+	i = hfs_trim_lookup(ext, tl->tl_count, offset + 1);
+	while (i < tl->tl_count && ext[i].te_offset < end) {
+		extEnd = HFS_TRIM_END(&ext[i]);
+		if (ext[i].te_offset < offset && extEnd > end) {
+			/* Split around the allocation; drop the tail if there is no room */
+			ext[i].te_length = offset - ext[i].te_offset;
+			if (tl->tl_count < HFS_TRIM_MAXEXTENTS) {
+				bcopy(&ext[i + 1], &ext[i + 2], (tl->tl_count - i - 1) * sizeof(*ext));
+				ext[i + 1].te_offset = end;
+				ext[i + 1].te_length = extEnd - end;
+				++tl->tl_count;
+			}
+			break;
+		} else if (ext[i].te_offset < offset) {
+			ext[i].te_length = offset - ext[i].te_offset;
+			++i;
+		} else if (extEnd > end) {
+			ext[i].te_offset = end;
+			ext[i].te_length = extEnd - end;
+			break;
+		} else {
+			bcopy(&ext[i + 1], &ext[i], (tl->tl_count - i - 1) * sizeof(*ext));
+			--tl->tl_count;
+		}
+	}
+
+restart:
+	TAILQ_FOREACH(tb, &tl->tl_inflight, tb_link) {
+		i = hfs_trim_lookup(tb->tb_extents, tb->tb_count, offset + 1);
+		if (i < tb->tb_count && tb->tb_extents[i].te_offset < end) {
+			msleep(tb, &tl->tl_lock, PRIBIO, "hfstrim", 0);
+			goto restart;
+		}
+	}
+
+	mtx_unlock(&tl->tl_lock);
+}
+
+
+/*
+ * BIO_DELETE completion, called from the GEOM up thread.  The last bio of a
+ * batch takes it off the in-flight list and wakes anyone waiting to reuse its
+ * blocks.
+ */
+static void
+hfs_unmap_done(struct bio *bip)
+{
+	struct hfsmount *hfsmp = bip->bio_caller1;
+	struct hfs_trim_batch *tb = bip->bio_caller2;
+	struct hfs_trim_list *tl = &hfsmp->hfs_trim;
+	int done = 0;
+
+	mtx_lock(&tl->tl_lock);
+	if (bip->bio_error == EOPNOTSUPP) {
+		/* The provider stopped accepting deletes; don't try again */
+		tl->tl_enabled = 0;
+	}
+	if (--tb->tb_pending == 0) {
+		TAILQ_REMOVE(&tl->tl_inflight, tb, tb_link);
+		wakeup(tb);
+		done = 1;
+	}
+	mtx_unlock(&tl->tl_lock);
+	g_destroy_bio(bip);
+
+	if (done)
+		free(tb, M_HFSTRIM);
+}
+
+
+/*
+;________________________________________________________________________________
+;
+; Routine:		hfs_issue_unmap
+;
+; Function:		Issue one asynchronous BIO_DELETE per extent of a batch.
+;				The caller must already have put the batch on tl_inflight
+;				(with tb_pending == tb_count) while holding whatever lock
+;				kept the blocks from being reallocated.
+;
+; Input Arguments:
+;	hfsmp			- The volume containing the allocation blocks.
+;	tb				- The batch of device byte ranges to trim.
+;________________________________________________________________________________
+*/
+static void
+hfs_issue_unmap(struct hfsmount *hfsmp, struct hfs_trim_batch *tb)
+{
+	struct bio *bip;
+	UInt32 i, count;
+
+	/* tb may be freed by the completion of its last bio */
+	count = tb->tb_count;
+	for (i = 0; i < count; ++i) {
+		bip = g_alloc_bio();
+		bip->bio_cmd = BIO_DELETE;
+		bip->bio_offset = tb->tb_extents[i].te_offset;
+		bip->bio_length = tb->tb_extents[i].te_length;
+		bip->bio_done = hfs_unmap_done;
+		bip->bio_caller1 = hfsmp;
+		bip->bio_caller2 = tb;
+		g_io_request(bip, hfsmp->hfs_cp);
+	}
+}
+
+
+/*
+ * Queue the scan's batch on the in-flight list and issue it.  Must be called
+ * with the extents B-tree (and so the bitmap) locked.
+ */
+static void
+hfs_queue_scan_unmap(struct hfsmount *hfsmp, struct hfs_trim_batch **batch)
+{
+	struct hfs_trim_list *tl = &hfsmp->hfs_trim;
+	struct hfs_trim_batch *tb = *batch;
+
+	if (tb == NULL || tb->tb_count == 0)
+		return;
+
+	mtx_lock(&tl->tl_lock);
+	tb->tb_pending = tb->tb_count;
+	TAILQ_INSERT_TAIL(&tl->tl_inflight, tb, tb_link);
+	mtx_unlock(&tl->tl_lock);
+
+	*batch = NULL;
+	hfs_issue_unmap(hfsmp, tb);
+}
+
+
+/*
+;________________________________________________________________________________
+;
+; Routine:		hfs_track_unmap_blocks
+;
+; Function:		Append a free range found by ScanUnmapBlocks to the scan's
+;				batch, merging it with the previous range when they abut.
+;				A full batch is issued and a new one started.
+;
+; Input Arguments:
+;	hfsmp			- The volume containing the allocation blocks.
+;	batch			- The scan's current batch (allocated on demand).
+;	startingBlock	- The first free allocation block.
+;	numBlocks		- The number of free allocation blocks.
+;________________________________________________________________________________
+*/
+static void
+hfs_track_unmap_blocks(struct hfsmount *hfsmp, struct hfs_trim_batch **batch,
+    UInt32 startingBlock, UInt32 numBlocks)
+{
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	struct hfs_trim_batch *tb = *batch;
+	struct hfs_trim_extent *last;
+	off_t offset = HFS_TRIM_OFFSET(vcb, startingBlock);
+	off_t length = (off_t)numBlocks * vcb->blockSize;
+
+	if (tb != NULL && tb->tb_count > 0) {
+		last = &tb->tb_extents[tb->tb_count - 1];
+		if (HFS_TRIM_END(last) == offset) {
+			last->te_length += length;
+			return;
+		}
+		if (tb->tb_count == HFS_TRIM_MAXEXTENTS)
+			hfs_queue_scan_unmap(hfsmp, batch);
+	}
+	if (*batch == NULL)
+		*batch = hfs_trim_batch_alloc(HFS_TRIM_MAXEXTENTS);
+
+	tb = *batch;
+	tb->tb_extents[tb->tb_count].te_offset = offset;
+	tb->tb_extents[tb->tb_count].te_length = length;
+	++tb->tb_count;
+}
+
+
+/*
+;________________________________________________________________________________
+;
+; Routine:		ScanUnmapBlocks
+;
+; Function:		Traverse the bitmap and trim every free range, so that the
+;				device learns about space freed while the volume was not
+;				mounted here.  Runs in its own kernel thread after a
+;				read-write mount.
+;
+;				The bitmap is examined HFS_TRIM_SCAN_CHUNK bitmap blocks at
+;				a time with the extents B-tree locked, and the ranges found
+;				are issued before the lock is dropped so that concurrent
+;				allocations wait for them in hfs_unmap_alloc_extent.  Between
+;				chunks the scan sleeps as needed to stay under
+;				vfs.hfs.trim_scan_rate.
+;
+; Input Arguments:
+;	arg				- The hfsmount of the volume to scan.
+;________________________________________________________________________________
+*/
+static void
+ScanUnmapBlocks(void *arg)
+{
+	struct hfsmount *hfsmp = arg;
+	ExtendedVCB *vcb = HFSTOVCB(hfsmp);
+	struct hfs_trim_list *tl = &hfsmp->hfs_trim;
+	struct hfs_trim_batch *tb = NULL;
+	UInt32 *buffer;
+	uintptr_t blockRef;
+	UInt32 bitsPerBlock, word, i;
+	UInt32 runStart = 0;
+	Boolean inRun;
+	u_int64_t chunkStart, chunkEnd, bit, nextBit, b;
+	off_t trimmed = 0;
+	int64_t target;
+	int start = ticks;
+	int delay;
+	OSErr err = noErr;
+
+	bitsPerBlock = vcb->vcbVBMIOSize * kBitsPerByte;
+
+	for (chunkStart = 0; chunkStart < vcb->totalBlocks; chunkStart = chunkEnd) {
+		if (tl->tl_scanstop || !tl->tl_enabled)
+			break;
+
+		chunkEnd = MIN(chunkStart + (u_int64_t)HFS_TRIM_SCAN_CHUNK * bitsPerBlock, vcb->totalBlocks);
+		inRun = false;
+
+		(void) hfs_metafilelocking(hfsmp, kHFSExtentsFileID, LK_EXCLUSIVE, curthread);
+
+		for (bit = chunkStart; bit < chunkEnd; bit = nextBit) {
+			err = ReadBitmapBlock(vcb, (UInt32)bit, &buffer, &blockRef);
+			if (err != noErr)
+				break;
+			nextBit = MIN((bit / bitsPerBlock + 1) * bitsPerBlock, chunkEnd);
+
+			for (b = bit; b < nextBit; b += kBitsPerWord) {
+				word = SWAP_BE32(buffer[(b % bitsPerBlock) / kBitsPerWord]);
+				if ((word == 0 && inRun) || (word == kAllBitsSetInWord && !inRun))
+					continue;
+				for (i = 0; i < kBitsPerWord && b + i < nextBit; ++i) {
+					if (word & (kHighBitInWordMask >> i)) {
+						if (inRun) {
+							hfs_track_unmap_blocks(hfsmp, &tb, runStart, (UInt32)(b + i) - runStart);
+							inRun = false;
+						}
+					} else if (!inRun) {
+						runStart = (UInt32)(b + i);
+						inRun = true;
+					}
+				}
+			}
 
+			(void) ReleaseBitmapBlock(vcb, blockRef, false);
+		}
+		if (inRun && err == noErr)
+			hfs_track_unmap_blocks(hfsmp, &tb, runStart, (UInt32)chunkEnd - runStart);
+
+		if (tb != NULL) {
+			for (i = 0; i < tb->tb_count; ++i)
+				trimmed += tb->tb_extents[i].te_length;
+			hfs_queue_scan_unmap(hfsmp, &tb);
+		}
+
+		(void) hfs_metafilelocking(hfsmp, kHFSExtentsFileID, LK_RELEASE, curthread);
+
+		if (err != noErr) {
+			printf("hfs: free space trim scan stopped, error %d on %s\n", err, (char *)vcb->vcbVN);
+			break;
+		}
+
+		if (hfs_trim_scan_rate > 0) {
+			target = trimmed * hz / ((int64_t)hfs_trim_scan_rate * 1024 * 1024);
+			delay = (int)MIN(target - (ticks - start), INT_MAX);
+			mtx_lock(&tl->tl_lock);
+			if (delay > 0 && !tl->tl_scanstop)
+				msleep(&tl->tl_scanstop, &tl->tl_lock, PRIBIO, "hfstrms", delay);
+			mtx_unlock(&tl->tl_lock);
+		}
+	}
+
+	if (tb != NULL)
+		free(tb, M_HFSTRIM);
+
+	mtx_lock(&tl->tl_lock);
+	tl->tl_scanning = 0;
+	wakeup(&tl->tl_scanning);
+	mtx_unlock(&tl->tl_lock);
+
+	kthread_exit();
+}
+
+
+/*
+;________________________________________________________________________________
+;
+; Routine:		hfs_trim_init
+;
+; Function:		Set up the volume's trim list.  Trimming is only enabled
+;				for read-write HFS Plus mounts on providers that accept
+;				BIO_DELETE; the free space scan is started if
+;				vfs.hfs.trim_on_mount is set.
+;________________________________________________________________________________
+*/
+void
+hfs_trim_init(struct hfsmount *hfsmp)
+{
+	struct hfs_trim_list *tl = &hfsmp->hfs_trim;
+	int candelete = 0;
+	int error;
+
+	mtx_init(&tl->tl_lock, "hfs trim lock", NULL, MTX_DEF);
+	TAILQ_INIT(&tl->tl_inflight);
+
+	if (hfsmp->hfs_fs_ronly || !ISHFSPLUS(HFSTOVCB(hfsmp)))
+		return;
+
+	error = g_getattr("GEOM::candelete", hfsmp->hfs_cp, &candelete);
+	if (error != 0 || candelete == 0)
+		return;
+
+	tl->tl_extents = malloc(HFS_TRIM_MAXEXTENTS * sizeof(struct hfs_trim_extent), M_HFSTRIM, M_WAITOK);
+	tl->tl_enabled = 1;
+
+	if (hfs_trim_enable && hfs_trim_on_mount) {
+		tl->tl_scanning = 1;
+		error = kthread_add(ScanUnmapBlocks, hfsmp, NULL, NULL, 0, 0, "hfstrim");
+		if (error)
+			tl->tl_scanning = 0;
+	}
+}
+
+
+/*
+;________________________________________________________________________________
+;
+; Routine:		hfs_trim_flush
+;
+; Function:		Move everything on the pending list into a new in-flight
+;				batch and issue it.  Called from hfs_sync once the metadata
+;				that freed these extents has been written.
+;________________________________________________________________________________
+*/
+void
+hfs_trim_flush(struct hfsmount *hfsmp)
+{
+	struct hfs_trim_list *tl = &hfsmp->hfs_trim;
+	struct hfs_trim_batch *tb;
+	UInt32 count;
+
+	if (tl->tl_extents == NULL)
+		return;
+
+	mtx_lock(&tl->tl_lock);
+	count = tl->tl_count;
+	if (!tl->tl_enabled)
+		tl->tl_count = 0;
+	mtx_unlock(&tl->tl_lock);
+	if (count == 0 || !tl->tl_enabled)
+		return;
+
+	tb = hfs_trim_batch_alloc(count);
+
+	/* Allocations may have shrunk the list while we slept in malloc */
+	mtx_lock(&tl->tl_lock);
+	count = MIN(count, tl->tl_count);
+	bcopy(tl->tl_extents, tb->tb_extents, count * sizeof(struct hfs_trim_extent));
+	bcopy(&tl->tl_extents[count], tl->tl_extents, (tl->tl_count - count) * sizeof(struct hfs_trim_extent));
+	tl->tl_count -= count;
+	tb->tb_count = count;
+	tb->tb_pending = count;
+	if (count > 0)
+		TAILQ_INSERT_TAIL(&tl->tl_inflight, tb, tb_link);
+	mtx_unlock(&tl->tl_lock);
+
+	if (count > 0)
+		hfs_issue_unmap(hfsmp, tb);
+	else
+		free(tb, M_HFSTRIM);
+}
+
+
+/*
+;________________________________________________________________________________
+;
+; Routine:		hfs_trim_destroy
+;
+; Function:		Stop the free space scan, issue whatever is still pending
+;				and wait for every in-flight BIO_DELETE before the GEOM
+;				consumer is closed.
+;________________________________________________________________________________
+*/
+void
+hfs_trim_destroy(struct hfsmount *hfsmp)
+{
+	struct hfs_trim_list *tl = &hfsmp->hfs_trim;
+	struct hfs_trim_batch *tb;
+
+	mtx_lock(&tl->tl_lock);
+	tl->tl_scanstop = 1;
+	wakeup(&tl->tl_scanstop);
+	while (tl->tl_scanning)
+		msleep(&tl->tl_scanning, &tl->tl_lock, PRIBIO, "hfstrmx", 0);
+	mtx_unlock(&tl->tl_lock);
+
+	hfs_trim_flush(hfsmp);
+
+	mtx_lock(&tl->tl_lock);
+	while ((tb = TAILQ_FIRST(&tl->tl_inflight)) != NULL)
+		msleep(tb, &tl->tl_lock, PRIBIO, "hfstrmw", 0);
+	mtx_unlock(&tl->tl_lock);
+
+	if (tl->tl_extents != NULL) {
+		free(tl->tl_extents, M_HFSTRIM);
+		tl->tl_extents = NULL;
+	}
+	tl->tl_enabled = 0;
+	mtx_destroy(&tl->tl_lock);
+}
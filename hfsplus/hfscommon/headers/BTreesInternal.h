@@ -208,6 +208,35 @@ struct BTreeInfoRec {
 typedef struct BTreeInfoRec BTreeInfoRec;
 typedef BTreeInfoRec *BTreeInfoPtr;
 
+/*
+	BTreeOccupancy Structure - for BTGetOccupancy
+*/
+struct BTreeOccupancy {
+	UInt16 nodeSize;
+	UInt16 nodeCapacity; // bytes per node usable by records and offsets
+	UInt16 treeDepth;
+	UInt16 reserved;
+	UInt32 totalNodes;
+	UInt32 freeNodes;
+	UInt32 indexNodes;
+	UInt32 leafNodes;
+	UInt32 leafRecords;
+	UInt32 leavesOutOfOrder; // leaves whose right sibling isn't the next node
+	UInt64 indexBytes;	 // bytes used in index nodes
+	UInt64 leafBytes;	 // bytes used in leaf nodes
+};
+typedef struct BTreeOccupancy BTreeOccupancy;
+
+/*
+	BTreeRenumberState Structure - for BTRenumberNodes, zero to start a pass
+*/
+struct BTreeRenumberState {
+	UInt32 height;	 // level being placed, 0 when done
+	UInt32 nodeNum;	 // next node of that level, 0 for its leftmost
+	UInt32 nextSlot; // node number the next node should get
+};
+typedef struct BTreeRenumberState BTreeRenumberState;
+
 /*
 	BTreeHint can never be exported to the outside. Use UInt32 BTreeHint[4],
 	UInt8 BTreeHint[16], etc.
@@ -269,6 +298,14 @@ extern OSStatus BTDeleteRecord(FCB *filePtr, BTreeIterator *iterator);
 
 extern OSStatus BTGetInformation(FCB *filePtr, UInt16 version, BTreeInfoRec *info);
 
+extern OSStatus BTGetOccupancy(FCB *filePtr, BTreeOccupancy *occupancy);
+
+extern OSStatus BTRepackLeaves(FCB *filePtr, UInt32 fillPercent, UInt32 writeBudget, UInt32 *nextLeaf, Boolean *done);
+
+extern OSStatus BTRenumberNodes(FCB *filePtr, UInt32 writeBudget, BTreeRenumberState *state, Boolean *done);
+
+extern OSStatus BTTrimFreeNodes(FCB *filePtr, UInt32 nodeMultiple, UInt32 *newTotalNodes);
+
 extern OSStatus BTFlushPath(FCB *filePtr);
 
 extern OSStatus BTReloadData(FCB *filePtr);
@@ -284,6 +284,8 @@ SInt32 CompareKeys(BTreeControlBlockPtr btreePtr, KeyPtr searchKey, KeyPtr trial
 
 OSStatus AllocateNode(BTreeControlBlockPtr btreePtr, UInt32 *nodeNum);
 
+OSStatus AllocateNodeFrom(BTreeControlBlockPtr btreePtr, UInt32 startNode, UInt32 *nodeNum);
+
 OSStatus FreeNode(BTreeControlBlockPtr btreePtr, UInt32 nodeNum);
 
 OSStatus ExtendBTree(BTreeControlBlockPtr btreePtr, UInt32 nodes);
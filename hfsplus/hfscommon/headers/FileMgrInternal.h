@@ -295,6 +295,10 @@ ExtendFileC(ExtendedVCB *vcb, FCB *fcb, SInt64 bytesToAdd, UInt32 blockHint, UIn
 EXTERN_API_C(OSErr)
 MapFileBlockC(ExtendedVCB *vcb, FCB *fcb, size_t numberOfBytes, off_t offset, daddr_t *startBlock, size_t *availableBytes);
 
+EXTERN_API_C(OSErr)
+FindExtentRecord(const ExtendedVCB *vcb, UInt8 forkType, UInt32 fileID, UInt32 startBlock, Boolean allowPrevious, HFSPlusExtentKey *foundKey,
+    HFSPlusExtentRecord foundData, UInt32 *foundHint);
+
 #if TARGET_API_MACOS_X
 EXTERN_API_C(Boolean)
 NodesAreContiguous(ExtendedVCB *vcb, FCB *fcb, UInt32 nodeSize);
@@ -19,39 +19,77 @@
  *
  * @APPLE_LICENSE_HEADER_END@
  */
+#ifdef RANGELIST_TEST
+#include "rangelist.h"
+#else
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/malloc.h>
 #include <sys/time.h>
+#include <machine/atomic.h>
 
 #include <hfsplus/hfs.h>
 #include <hfsplus/rangelist.h>
+#endif
 
-static enum rl_overlaptype rl_scan_from(struct rl_head *rangelist, off_t start, off_t end, struct rl_entry **overlap, struct rl_entry *range);
+static struct rl_entry *rl_find(struct rl_head *rangelist, off_t start);
+static void rl_link(struct rl_head *rangelist, struct rl_entry *range, struct rl_entry *next);
+static void rl_unlink(struct rl_head *rangelist, struct rl_entry *range);
+static void rl_rebalance(struct rl_head *rangelist, struct rl_entry *node);
 static void rl_collapse_forwards(struct rl_head *rangelist, struct rl_entry *range);
 static void rl_collapse_backwards(struct rl_head *rangelist, struct rl_entry *range);
 static void rl_collapse_neighbors(struct rl_head *rangelist, struct rl_entry *range);
 
+#define RL_HEIGHT(node) ((node) != NULL ? (node)->rl_height : 0)
+
 #ifdef RL_DIAGNOSTIC
+static int
+rl_verify_tree(struct rl_entry *node, struct rl_entry *parent, struct rl_entry **next)
+{
+	int hl, hr;
+
+	if (node == NULL)
+		return (0);
+	if (node->rl_parent != parent)
+		panic("rl_verify: bad tree parent?!");
+	hl = rl_verify_tree(node->rl_left, node, next);
+	if (node != *next)
+		panic("rl_verify: tree and list out of step?!");
+	*next = TAILQ_NEXT(node, rl_link);
+	hr = rl_verify_tree(node->rl_right, node, next);
+	if (hl > hr + 1 || hr > hl + 1)
+		panic("rl_verify: tree out of balance?!");
+	if (node->rl_height != 1 + (hl > hr ? hl : hr))
+		panic("rl_verify: bad tree height?!");
+	return (node->rl_height);
+}
+
 static void
 rl_verify(struct rl_head *rangelist)
 {
 	struct rl_entry *entry;
 	off_t limit = 0;
 
-	if (TAILQ_EMPTY(rangelist))
+	entry = RL_FIRST(rangelist);
+	rl_verify_tree(rangelist->rl_root, NULL, &entry);
+	if (entry != NULL)
+		panic("rl_verify: range missing from tree?!");
+
+	if (RL_EMPTY(rangelist))
 		return;
-	entry = TAILQ_FIRST(rangelist);
+	entry = RL_FIRST(rangelist);
 	while (1) {
 		if (TAILQ_NEXT(entry, rl_link) == entry)
 			panic("rl_verify: circular rangelist?!");
 		if ((limit > 0) && (entry->rl_start <= limit))
 			panic("rl_verify: bad entry start?!");
-		if (entry->rl_end < entry->rl_start)
+		if ((entry->rl_end != RL_INFINITY) && (entry->rl_end < entry->rl_start))
 			panic("rl_verify: bad entry end?!");
 		limit = entry->rl_end;
-		if (entry == TAILQ_LAST(rangelist, rl_head))
+		if (entry == TAILQ_LAST(&rangelist->rl_list, rl_tailq))
 			return;
+		if (limit == RL_INFINITY)
+			panic("rl_verify: range after an infinite range?!");
 		entry = TAILQ_NEXT(entry, rl_link);
 	};
 }
@@ -63,7 +101,9 @@ rl_verify(struct rl_head *rangelist)
 void
 rl_init(struct rl_head *rangelist)
 {
-	TAILQ_INIT(rangelist);
+	TAILQ_INIT(&rangelist->rl_list);
+	rangelist->rl_root = NULL;
+	rangelist->rl_hint = NULL;
 }
 
 /*
@@ -77,7 +117,7 @@ rl_add(off_t start, off_t end, struct rl_head *rangelist)
 	enum rl_overlaptype ovcase;
 
 #ifdef RL_DIAGNOSTIC
-	if (end < start)
+	if ((end != RL_INFINITY) && (end < start))
 		panic("rl_add: end < start?!");
 #endif
 
@@ -95,21 +135,15 @@ rl_add(off_t start, off_t end, struct rl_head *rangelist)
 	switch (ovcase) {
 	case RL_NOOVERLAP: /* 0: no overlap */
 		/*
-		 * If the list was empty 'prev' is undisturbed and 'overlap' == NULL;
-		 * if the search hit a non-overlapping entry PAST the start of the
-		 * new range, 'prev' points to ITS predecessor, and 'overlap' points
-		 * to that entry:
+		 * 'overlap' is the first range past the new one, or NULL
+		 * if the new range goes at the end of the list:
 		 */
 		range = (struct rl_entry *)malloc(sizeof(*range), M_TEMP, M_WAITOK);
 		range->rl_start = start;
 		range->rl_end = end;
 
 		/* Link in the new range: */
-		if (overlap) {
-			TAILQ_INSERT_AFTER(rangelist, overlap, range, rl_link);
-		} else {
-			TAILQ_INSERT_HEAD(rangelist, range, rl_link);
-		}
+		rl_link(rangelist, range, overlap);
 
 		/* Check to see if any ranges can be combined (possibly including the immediately
 		   preceding range entry)
@@ -165,34 +199,36 @@ rl_add(off_t start, off_t end, struct rl_head *rangelist)
 void
 rl_remove(off_t start, off_t end, struct rl_head *rangelist)
 {
-	struct rl_entry *range, *next_range, *overlap, *splitrange;
-	int ovcase, moretotest;
+	struct rl_entry *range, *next_range, *splitrange;
 
 #ifdef RL_DIAGNOSTIC
-	if (end < start)
+	if ((end != RL_INFINITY) && (end < start))
 		panic("rl_remove: end < start?!");
 #endif
 
-	if (TAILQ_EMPTY(rangelist)) {
-		return;
-	};
+	/* Every range that overlaps this one follows the first. */
+	for (range = rl_find(rangelist, start); range != NULL; range = next_range) {
+		next_range = TAILQ_NEXT(range, rl_link);
+
+		switch (rl_overlap(range, start, end)) {
+		case RL_NOOVERLAP: /* 0: past the end of the range */
+			next_range = NULL;
+			break;
 
-	range = TAILQ_FIRST(rangelist);
-	while ((ovcase = rl_scan_from(rangelist, start, end, &overlap, range))) {
-		switch (ovcase) {
 		case RL_MATCHINGOVERLAP: /* 1: overlap == range */
-			TAILQ_REMOVE(rangelist, overlap, rl_link);
-			free(overlap, M_TEMP);
+			rl_unlink(rangelist, range);
+			next_range = NULL;
 			break;
 
 		case RL_OVERLAPCONTAINSRANGE: /* 2: overlap contains range: split it */
-			if (overlap->rl_start == start) {
-				overlap->rl_start = end + 1;
+			next_range = NULL;
+			if (range->rl_start == start) {
+				range->rl_start = end + 1;
 				break;
 			};
 
-			if (overlap->rl_end == end) {
-				overlap->rl_end = start - 1;
+			if (range->rl_end == end) {
+				range->rl_end = start - 1;
 				break;
 			};
 
@@ -201,48 +237,28 @@ rl_remove(off_t start, off_t end, struct rl_head *rangelist)
 			 */
 			splitrange = (struct rl_entry *)malloc(sizeof *splitrange, M_TEMP, M_WAITOK);
 			splitrange->rl_start = end + 1;
-			splitrange->rl_end = overlap->rl_end;
-			overlap->rl_end = start - 1;
+			splitrange->rl_end = range->rl_end;
+			range->rl_end = start - 1;
 
 			/*
 			 * Now link the new entry into the range list after the range from which it was split:
 			 */
-			TAILQ_INSERT_AFTER(rangelist, overlap, splitrange, rl_link);
+			rl_link(rangelist, splitrange, TAILQ_NEXT(range, rl_link));
 			break;
 
 		case RL_OVERLAPISCONTAINED: /* 3: range contains overlap */
-			moretotest = (overlap != TAILQ_LAST(rangelist, rl_head));
-#ifdef RL_DIAGNOSTIC
-			if (TAILQ_NEXT(overlap, rl_link) == overlap)
-				panic("rl_remove: circular range list?!");
-#endif
-			next_range = TAILQ_NEXT(overlap, rl_link); /* Check before discarding overlap entry */
-			TAILQ_REMOVE(rangelist, overlap, rl_link);
-			free(overlap, M_TEMP);
-			if (moretotest) {
-				range = next_range;
-				continue;
-			};
+			rl_unlink(rangelist, range);
 			break;
 
 		case RL_OVERLAPSTARTSBEFORE: /* 4: overlap starts before range */
-			moretotest = (overlap != TAILQ_LAST(rangelist, rl_head));
-			overlap->rl_end = start - 1;
-			if (moretotest) {
-#ifdef RL_DIAGNOSTIC
-				if (TAILQ_NEXT(overlap, rl_link) == overlap)
-					panic("rl_remove: circular range list?!");
-#endif
-				range = TAILQ_NEXT(overlap, rl_link);
-				continue;
-			};
+			range->rl_end = start - 1;
 			break;
 
 		case RL_OVERLAPENDSAFTER: /* 5: overlap ends after range */
-			overlap->rl_start = (end == RL_INFINITY ? RL_INFINITY : end + 1);
+			range->rl_start = (end == RL_INFINITY ? RL_INFINITY : end + 1);
+			next_range = NULL;
 			break;
 		}
-		break;
 	}
 
 #ifdef RL_DIAGNOSTIC
@@ -254,103 +270,287 @@ rl_remove(off_t start, off_t end, struct rl_head *rangelist)
  * Scan a range list for an entry in a specified range (if any):
  *
  * NOTE: this returns only the FIRST overlapping range.
- *	     There may be more than one.
+ *	     There may be more than one.  When nothing overlaps,
+ *	     'overlap' is left pointing at the first range past
+ *	     the one given, or NULL if there is none.
  */
 
 enum rl_overlaptype
 rl_scan(struct rl_head *rangelist, off_t start, off_t end, struct rl_entry **overlap)
 {
-	if (TAILQ_EMPTY(rangelist)) {
-		*overlap = NULL;
+	struct rl_entry *range;
+
+#ifdef RL_DIAGNOSTIC
+	rl_verify(rangelist);
+#endif
+
+	*overlap = range = rl_find(rangelist, start);
+	if (range == NULL)
 		return RL_NOOVERLAP;
-	};
 
-	return rl_scan_from(rangelist, start, end, overlap, TAILQ_FIRST(rangelist));
+	return rl_overlap(range, start, end);
 }
 
 /*
- * Walk the list of ranges for an entry to
- * find an overlapping range (if any).
- *
- * NOTE: this returns only the FIRST overlapping range.
- *	     There may be more than one.
+ * Classify how a range list entry overlaps a specified range.
  */
-static enum rl_overlaptype
-rl_scan_from(struct rl_head *rangelist, off_t start, off_t end, struct rl_entry **overlap, struct rl_entry *range)
+enum rl_overlaptype
+rl_overlap(const struct rl_entry *range, off_t start, off_t end)
 {
-	if (TAILQ_EMPTY(rangelist)) {
-		*overlap = NULL;
+	/*
+	 * OK, check for overlap
+	 *
+	 * Six cases:
+	 *	0) no overlap (RL_NOOVERLAP)
+	 *	1) overlap == range (RL_MATCHINGOVERLAP)
+	 *	2) overlap contains range (RL_OVERLAPCONTAINSRANGE)
+	 *	3) range contains overlap (RL_OVERLAPISCONTAINED)
+	 *	4) overlap starts before range (RL_OVERLAPSTARTSBEFORE)
+	 *	5) overlap ends after range (RL_OVERLAPENDSAFTER)
+	 */
+	if (((range->rl_end != RL_INFINITY) && (start > range->rl_end)) || ((end != RL_INFINITY) && (range->rl_start > end))) {
+		/* Case 0 (RL_NOOVERLAP) */
 		return RL_NOOVERLAP;
-	};
+	}
 
-#ifdef RL_DIAGNOSTIC
-	rl_verify(rangelist);
-#endif
+	if ((range->rl_start == start) && (range->rl_end == end)) {
+		/* Case 1 (RL_MATCHINGOVERLAP) */
+		return RL_MATCHINGOVERLAP;
+	}
 
-	*overlap = range;
+	if ((range->rl_start <= start) && (end != RL_INFINITY) && ((range->rl_end >= end) || (range->rl_end == RL_INFINITY))) {
+		/* Case 2 (RL_OVERLAPCONTAINSRANGE) */
+		return RL_OVERLAPCONTAINSRANGE;
+	}
 
-	while (1) {
-		/*
-		 * OK, check for overlap
-		 *
-		 * Six cases:
-		 *	0) no overlap (RL_NOOVERLAP)
-		 *	1) overlap == range (RL_MATCHINGOVERLAP)
-		 *	2) overlap contains range (RL_OVERLAPCONTAINSRANGE)
-		 *	3) range contains overlap (RL_OVERLAPISCONTAINED)
-		 *	4) overlap starts before range (RL_OVERLAPSTARTSBEFORE)
-		 *	5) overlap ends after range (RL_OVERLAPENDSAFTER)
-		 */
-		if (((range->rl_end != RL_INFINITY) && (start > range->rl_end)) || ((end != RL_INFINITY) && (range->rl_start > end))) {
-			/* Case 0 (RL_NOOVERLAP), at least with the current entry: */
-			if ((end != RL_INFINITY) && (range->rl_start > end)) {
-				return RL_NOOVERLAP;
-			};
+	if ((start <= range->rl_start) && ((end == RL_INFINITY) || ((range->rl_end != RL_INFINITY) && (end >= range->rl_end)))) {
+		/* Case 3 (RL_OVERLAPISCONTAINED) */
+		return RL_OVERLAPISCONTAINED;
+	}
 
-			/* Check the other entries in the list: */
-			if (range == TAILQ_LAST(rangelist, rl_head)) {
-				return RL_NOOVERLAP;
-			};
+	if ((range->rl_start < start) && ((range->rl_end >= start) || (range->rl_end == RL_INFINITY))) {
+		/* Case 4 (RL_OVERLAPSTARTSBEFORE) */
+		return RL_OVERLAPSTARTSBEFORE;
+	}
+
+	if ((range->rl_start > start) && (end != RL_INFINITY) && ((range->rl_end > end) || (range->rl_end == RL_INFINITY))) {
+		/* Case 5 (RL_OVERLAPENDSAFTER) */
+		return RL_OVERLAPENDSAFTER;
+	}
+
+	/* Control should never reach here... */
 #ifdef RL_DIAGNOSTIC
-			if (TAILQ_NEXT(range, rl_link) == range)
-				panic("rl_scan_from: circular range list?!");
+	panic("rl_overlap: unhandled overlap condition?!");
 #endif
-			*overlap = range = TAILQ_NEXT(range, rl_link);
-			continue;
-		}
+	return RL_NOOVERLAP;
+}
 
-		if ((range->rl_start == start) && (range->rl_end == end)) {
-			/* Case 1 (RL_MATCHINGOVERLAP) */
-			return RL_MATCHINGOVERLAP;
+/*
+ * Find the first range that ends at or after 'start': the first one
+ * that can overlap a range starting there.  hfs_bmap asks about the
+ * file in order, so try the last answer and the range after it before
+ * searching the tree.
+ *
+ * rl_scan runs under a shared vnode lock, so several lookups can race
+ * on rl_hint; it is only ever loaded and stored whole.  Ranges are
+ * freed only under the exclusive lock, by rl_unlink, which clears it,
+ * so any hint a lookup sees is still on the list.
+ */
+static struct rl_entry *
+rl_find(struct rl_head *rangelist, off_t start)
+{
+	struct rl_entry *node, *found;
+
+	found = atomic_load_ptr(&rangelist->rl_hint);
+	if (found != NULL && found->rl_start <= start) {
+		/* Everything before the hint ends before it starts. */
+		if ((found->rl_end == RL_INFINITY) || (found->rl_end >= start))
+			return (found);
+		node = TAILQ_NEXT(found, rl_link);
+		if (node == NULL)
+			return (NULL);
+		if ((node->rl_end == RL_INFINITY) || (node->rl_end >= start)) {
+			atomic_store_ptr(&rangelist->rl_hint, node);
+			return (node);
 		}
+	}
 
-		if ((range->rl_start <= start) && (end != RL_INFINITY) && ((range->rl_end >= end) || (range->rl_end == RL_INFINITY))) {
-			/* Case 2 (RL_OVERLAPCONTAINSRANGE) */
-			return RL_OVERLAPCONTAINSRANGE;
+	found = NULL;
+	for (node = rangelist->rl_root; node != NULL;) {
+		if ((node->rl_end == RL_INFINITY) || (node->rl_end >= start)) {
+			found = node;
+			node = node->rl_left;
+		} else {
+			node = node->rl_right;
 		}
+	}
 
-		if ((start <= range->rl_start) && ((end == RL_INFINITY) || ((range->rl_end != RL_INFINITY) && (end >= range->rl_end)))) {
-			/* Case 3 (RL_OVERLAPISCONTAINED) */
-			return RL_OVERLAPISCONTAINED;
-		}
+	atomic_store_ptr(&rangelist->rl_hint, (found != NULL) ? found : TAILQ_LAST(&rangelist->rl_list, rl_tailq));
+	return (found);
+}
 
-		if ((range->rl_start < start) && ((range->rl_end >= start) || (range->rl_end == RL_INFINITY))) {
-			/* Case 4 (RL_OVERLAPSTARTSBEFORE) */
-			return RL_OVERLAPSTARTSBEFORE;
-		}
+/*
+ * Link a new range into the list and tree ahead of 'next' (at the end
+ * if 'next' is NULL).  It goes in as a leaf, under whichever of 'next'
+ * and its predecessor has a free slot on the facing side.
+ */
+static void
+rl_link(struct rl_head *rangelist, struct rl_entry *range, struct rl_entry *next)
+{
+	struct rl_entry *prev;
+
+	range->rl_left = range->rl_right = NULL;
+	range->rl_height = 1;
 
-		if ((range->rl_start > start) && (end != RL_INFINITY) && ((range->rl_end > end) || (range->rl_end == RL_INFINITY))) {
-			/* Case 5 (RL_OVERLAPENDSAFTER) */
-			return RL_OVERLAPENDSAFTER;
+	if (next != NULL) {
+		prev = TAILQ_PREV(next, rl_tailq, rl_link);
+		TAILQ_INSERT_BEFORE(next, range, rl_link);
+	} else {
+		prev = TAILQ_LAST(&rangelist->rl_list, rl_tailq);
+		TAILQ_INSERT_TAIL(&rangelist->rl_list, range, rl_link);
+	}
+
+	if (next != NULL && next->rl_left == NULL) {
+		next->rl_left = range;
+		range->rl_parent = next;
+	} else if (prev != NULL) {
+		prev->rl_right = range;
+		range->rl_parent = prev;
+	} else {
+		rangelist->rl_root = range;
+		range->rl_parent = NULL;
+		return;
+	}
+	rl_rebalance(rangelist, range->rl_parent);
+}
+
+/*
+ * Take a range out of the list and tree and free it.
+ */
+static void
+rl_unlink(struct rl_head *rangelist, struct rl_entry *range)
+{
+	struct rl_entry *parent, *child, *next, *start;
+
+	if (rangelist->rl_hint == range)
+		rangelist->rl_hint = NULL;
+
+	parent = range->rl_parent;
+	if (range->rl_left != NULL && range->rl_right != NULL) {
+		/*
+		 * Put the successor, which has no left child, in the
+		 * range's place in the tree.
+		 */
+		next = TAILQ_NEXT(range, rl_link);
+		if (next->rl_parent == range) {
+			start = next;
+		} else {
+			start = next->rl_parent;
+			start->rl_left = next->rl_right;
+			if (next->rl_right != NULL)
+				next->rl_right->rl_parent = start;
+			next->rl_right = range->rl_right;
+			next->rl_right->rl_parent = next;
 		}
+		next->rl_left = range->rl_left;
+		next->rl_left->rl_parent = next;
+		next->rl_height = range->rl_height;
+		child = next;
+	} else {
+		child = (range->rl_left != NULL) ? range->rl_left : range->rl_right;
+		start = parent;
+	}
 
-		/* Control should never reach here... */
-#ifdef RL_DIAGNOSTIC
-		panic("rl_scan_from: unhandled overlap condition?!");
-#endif
+	if (child != NULL)
+		child->rl_parent = parent;
+	if (parent == NULL)
+		rangelist->rl_root = child;
+	else if (parent->rl_left == range)
+		parent->rl_left = child;
+	else
+		parent->rl_right = child;
+
+	TAILQ_REMOVE(&rangelist->rl_list, range, rl_link);
+	free(range, M_TEMP);
+
+	rl_rebalance(rangelist, start);
+}
+
+/*
+ * Rotate 'node' down to the left or right, returning the child that
+ * took its place.
+ */
+static struct rl_entry *
+rl_rotate(struct rl_head *rangelist, struct rl_entry *node, int left)
+{
+	struct rl_entry *pivot, *inner;
+	int hl, hr;
+
+	if (left) {
+		pivot = node->rl_right;
+		inner = pivot->rl_left;
+		node->rl_right = inner;
+		pivot->rl_left = node;
+	} else {
+		pivot = node->rl_left;
+		inner = pivot->rl_right;
+		node->rl_left = inner;
+		pivot->rl_right = node;
 	}
+	if (inner != NULL)
+		inner->rl_parent = node;
+
+	pivot->rl_parent = node->rl_parent;
+	if (node->rl_parent == NULL)
+		rangelist->rl_root = pivot;
+	else if (node->rl_parent->rl_left == node)
+		node->rl_parent->rl_left = pivot;
+	else
+		node->rl_parent->rl_right = pivot;
+	node->rl_parent = pivot;
+
+	hl = RL_HEIGHT(node->rl_left);
+	hr = RL_HEIGHT(node->rl_right);
+	node->rl_height = 1 + (hl > hr ? hl : hr);
+	hl = RL_HEIGHT(pivot->rl_left);
+	hr = RL_HEIGHT(pivot->rl_right);
+	pivot->rl_height = 1 + (hl > hr ? hl : hr);
+
+	return (pivot);
+}
 
-	return RL_NOOVERLAP;
+/*
+ * Restore the AVL balance from 'node' up to the root after a range was
+ * linked in under it or unlinked from under it.
+ */
+static void
+rl_rebalance(struct rl_head *rangelist, struct rl_entry *node)
+{
+	struct rl_entry *child;
+	int hl, hr, height;
+
+	while (node != NULL) {
+		hl = RL_HEIGHT(node->rl_left);
+		hr = RL_HEIGHT(node->rl_right);
+
+		if (hl > hr + 1) {
+			child = node->rl_left;
+			if (RL_HEIGHT(child->rl_left) < RL_HEIGHT(child->rl_right))
+				(void)rl_rotate(rangelist, child, 1);
+			node = rl_rotate(rangelist, node, 0);
+		} else if (hr > hl + 1) {
+			child = node->rl_right;
+			if (RL_HEIGHT(child->rl_right) < RL_HEIGHT(child->rl_left))
+				(void)rl_rotate(rangelist, child, 0);
+			node = rl_rotate(rangelist, node, 1);
+		} else {
+			height = 1 + (hl > hr ? hl : hr);
+			if (height == node->rl_height)
+				return;
+			node->rl_height = height;
+		}
+		node = node->rl_parent;
+	}
 }
 
 static void
@@ -359,27 +559,23 @@ rl_collapse_forwards(struct rl_head *rangelist, struct rl_entry *range)
 	struct rl_entry *next_range;
 
 	while (1) {
-		if (range == TAILQ_LAST(rangelist, rl_head))
+		next_range = TAILQ_NEXT(range, rl_link);
+		if (next_range == NULL)
 			return;
 
 #ifdef RL_DIAGNOSTIC
-		if (TAILQ_NEXT(range, rl_link) == range)
+		if (next_range == range)
 			panic("rl_collapse_forwards: circular range list?!");
 #endif
-		next_range = TAILQ_NEXT(range, rl_link);
 		if ((range->rl_end != RL_INFINITY) && (range->rl_end < next_range->rl_start - 1))
 			return;
 
-		/* Expand this range to include the next range: */
-		range->rl_end = next_range->rl_end;
+		/* Expand this range to include the next range (which it may already cover): */
+		if ((range->rl_end != RL_INFINITY) && ((next_range->rl_end == RL_INFINITY) || (next_range->rl_end > range->rl_end)))
+			range->rl_end = next_range->rl_end;
 
 		/* Remove the now covered range from the list: */
-		TAILQ_REMOVE(rangelist, next_range, rl_link);
-		free(next_range, M_TEMP);
-
-#ifdef RL_DIAGNOSTIC
-		rl_verify(rangelist);
-#endif
+		rl_unlink(rangelist, next_range);
 	};
 }
 
@@ -389,27 +585,22 @@ rl_collapse_backwards(struct rl_head *rangelist, struct rl_entry *range)
 	struct rl_entry *prev_range;
 
 	while (1) {
-		if (range == TAILQ_FIRST(rangelist))
+		prev_range = TAILQ_PREV(range, rl_tailq, rl_link);
+		if (prev_range == NULL)
 			return;
 
 #ifdef RL_DIAGNOSTIC
-		if (TAILQ_PREV(range, rl_head, rl_link) == range)
+		if (prev_range == range)
 			panic("rl_collapse_backwards: circular range list?!");
 #endif
-		prev_range = TAILQ_PREV(range, rl_head, rl_link);
-		if (prev_range->rl_end < range->rl_start - 1) {
-#ifdef RL_DIAGNOSTIC
-			rl_verify(rangelist);
-#endif
+		if (prev_range->rl_end < range->rl_start - 1)
 			return;
-		};
 
 		/* Expand this range to include the previous range: */
 		range->rl_start = prev_range->rl_start;
 
 		/* Remove the now covered range from the list: */
-		TAILQ_REMOVE(rangelist, prev_range, rl_link);
-		free(prev_range, M_TEMP);
+		rl_unlink(rangelist, prev_range);
 	};
 }
 
@@ -40,19 +40,38 @@ enum rl_overlaptype {
 
 #define RL_INFINITY ((off_t) - 1)
 
-TAILQ_HEAD(rl_head, rl_entry);
-
+/*
+ * The ranges in a list never overlap or touch, so ordering them by
+ * rl_start orders them by rl_end as well.  They are kept twice: on a
+ * TAILQ in ascending order, for walking and for the neighbours that
+ * rl_add merges with, and in an AVL tree, so that finding the range at
+ * an offset does not mean walking past every range before it.
+ */
 struct rl_entry {
 	TAILQ_ENTRY(rl_entry) rl_link;
+	struct rl_entry *rl_parent; /* AVL tree linkage */
+	struct rl_entry *rl_left;
+	struct rl_entry *rl_right;
+	int rl_height;
 	off_t rl_start;
 	off_t rl_end;
 };
 
+struct rl_head {
+	TAILQ_HEAD(rl_tailq, rl_entry) rl_list;
+	struct rl_entry *rl_root;
+	struct rl_entry *rl_hint; /* where the last lookup ended up; see rl_find */
+};
+
+#define RL_EMPTY(rangelist) TAILQ_EMPTY(&(rangelist)->rl_list)
+#define RL_FIRST(rangelist) TAILQ_FIRST(&(rangelist)->rl_list)
+
 __BEGIN_DECLS
 void rl_init(struct rl_head *rangelist);
 void rl_add(off_t start, off_t end, struct rl_head *rangelist);
 void rl_remove(off_t start, off_t end, struct rl_head *rangelist);
 enum rl_overlaptype rl_scan(struct rl_head *rangelist, off_t start, off_t end, struct rl_entry **overlap);
+enum rl_overlaptype rl_overlap(const struct rl_entry *range, off_t start, off_t end);
 __END_DECLS
 
 #endif /* __APPLE_API_PRIVATE */
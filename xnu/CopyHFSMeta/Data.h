@@ -73,10 +73,11 @@ typedef int (^extent_handler_t)(int fid, off_t start, off_t len);
 extern VolumeObjects_t *InitVolumeObject(struct DeviceInfo *devp, struct VolumeDescriptor *vdp);
 extern int AddExtent(VolumeObjects_t *vop, off_t start, off_t length);
 extern int AddExtentForFile(VolumeObjects_t *vop, off_t start, off_t length, unsigned int fid);
+extern int NormalizeVolumeObject(VolumeObjects_t *vop);
 extern void PrintVolumeObject(VolumeObjects_t*);
 extern int CopyObjectsToDest(VolumeObjects_t*, struct IOWrapper *wrapper, off_t skip);
 
-extern void WriteGatheredData(const char *, VolumeObjects_t*);
+extern void WriteGatheredData(const char *, VolumeObjects_t*, int);
 
 extern struct DeviceInfo *OpenDevice(const char *, int);
 extern struct VolumeDescriptor *VolumeInfo(struct DeviceInfo *);
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <err.h>
@@ -7,6 +8,7 @@
 #include <zlib.h>
 #include <limits.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "hfsmeta.h"
 #include "Data.h"
@@ -66,8 +68,456 @@ WriteExtent(gzFile outf, DeviceInfo_t *devp, off_t start, off_t len)
 	return 0;
 }
 
+/*
+ * Parallel gather.
+ *
+ * The gather stream (the header, the object table, and then the data
+ * of each extent in turn) is cut into kGatherChunkSize pieces, and each
+ * piece is compressed as its own gzip member.  Concatenated members are
+ * still a valid gzip file, so the output reads the same as the serial
+ * one; but every member starts a new deflate stream, so any chunk can
+ * be decompressed by itself.  Where each member is, and where each
+ * extent is in the stream, goes into a "<gather file>.index" file.
+ *
+ * The calling thread reads the device into a ring of chunk slots;
+ * the worker threads compress filled slots; and a writer thread writes
+ * the compressed slots out in order and hands them back to the reader.
+ * The size of the ring bounds how far ahead of the writer we read.
+ */
+enum {
+	kGatherChunkSize = 1024 * 1024,
+	kGatherIndexMagic = 0x48474958,	// 'HGIX'
+	kGatherIndexVersion = 1,
+};
+
+/*
+ * The index file.  All fields are big-endian.  The header is followed
+ * by chunkCount GatherIndexChunk entries, and then by objectCount
+ * GatherIndexObject entries, in the same order as the object table.
+ * Chunk n holds the stream bytes starting at n * chunkSize, so to
+ * extract an extent, gunzip the chunks covering
+ * <streamOffset, streamOffset + size>, each from its fileOffset.
+ */
+struct GatherIndexHeader {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	chunkSize;
+	uint32_t	chunkCount;
+	uint32_t	objectCount;
+	uint32_t	reserved;
+};
+
+struct GatherIndexChunk {
+	int64_t	fileOffset;	// Offset of the gzip member in the gather file
+	uint32_t	compressedSize;
+	uint32_t	uncompressedSize;
+};
+
+struct GatherIndexObject {
+	int64_t	offset;		// As in HFSDataObject
+	int64_t	size;
+	int64_t	streamOffset;	// Offset of the data in the uncompressed stream
+};
+
+enum {
+	kSlotEmpty,
+	kSlotFilled,
+	kSlotCompressing,
+	kSlotCompressed,
+};
+
+struct GatherSlot {
+	int	state;
+	size_t	inSize;
+	size_t	outSize;
+	uint8_t	*inBuf;
+	uint8_t	*outBuf;
+};
+
+struct GatherQueue {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;	// Signalled whenever any slot changes state
+	struct GatherSlot	*slots;
+	size_t	slotCount;
+	size_t	outBufSize;
+	size_t	filled;		// Chunks handed over by the reader
+	size_t	nextCompress;	// Next chunk for a worker
+	size_t	nextWrite;	// Next chunk for the writer
+	int	done;		// The reader has no more chunks
+	int	error;		// errno of the first failure
+	int	fd;
+	off_t	fileOffset;
+	struct GatherIndexChunk	*chunks;
+};
+
+static int
+CompressChunk(struct GatherSlot *sp, size_t outBufSize)
+{
+	z_stream zs = { 0 };
+	int rv;
+
+	/* 16 + MAX_WBITS asks for a gzip wrapper, so each chunk is a complete member */
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return ENOMEM;
+	zs.next_in = sp->inBuf;
+	zs.avail_in = (uInt)sp->inSize;
+	zs.next_out = sp->outBuf;
+	zs.avail_out = (uInt)outBufSize;
+	rv = deflate(&zs, Z_FINISH);
+	sp->outSize = zs.total_out;
+	deflateEnd(&zs);
+	if (rv != Z_STREAM_END) {
+		warnx("deflate returned %d", rv);
+		return EIO;
+	}
+	return 0;
+}
+
+static void *
+GatherCompressThread(void *arg)
+{
+	struct GatherQueue *qp = arg;
+
+	pthread_mutex_lock(&qp->lock);
+	for (;;) {
+		struct GatherSlot *sp;
+		int error;
+
+		while (qp->error == 0 && qp->nextCompress == qp->filled && !qp->done)
+			pthread_cond_wait(&qp->cond, &qp->lock);
+		if (qp->error || qp->nextCompress == qp->filled)
+			break;
+
+		sp = &qp->slots[qp->nextCompress % qp->slotCount];
+		qp->nextCompress++;
+		sp->state = kSlotCompressing;
+		pthread_mutex_unlock(&qp->lock);
+
+		error = CompressChunk(sp, qp->outBufSize);
+
+		pthread_mutex_lock(&qp->lock);
+		if (error) {
+			if (qp->error == 0)
+				qp->error = error;
+		} else {
+			sp->state = kSlotCompressed;
+		}
+		pthread_cond_broadcast(&qp->cond);
+	}
+	pthread_mutex_unlock(&qp->lock);
+	return NULL;
+}
+
+static void *
+GatherWriteThread(void *arg)
+{
+	struct GatherQueue *qp = arg;
+
+	pthread_mutex_lock(&qp->lock);
+	for (;;) {
+		struct GatherSlot *sp;
+		size_t total = 0;
+		int error = 0;
+
+		for (;;) {
+			if (qp->error)
+				break;
+			if (qp->nextWrite == qp->filled) {
+				if (qp->done)
+					break;
+			} else if (qp->slots[qp->nextWrite % qp->slotCount].state == kSlotCompressed) {
+				break;
+			}
+			pthread_cond_wait(&qp->cond, &qp->lock);
+		}
+		if (qp->error || qp->nextWrite == qp->filled)
+			break;
+
+		sp = &qp->slots[qp->nextWrite % qp->slotCount];
+		pthread_mutex_unlock(&qp->lock);
+
+		while (total < sp->outSize) {
+			ssize_t nwritten = write(qp->fd, sp->outBuf + total, sp->outSize - total);
+			if (nwritten == -1) {
+				if (errno == EINTR)
+					continue;
+				error = errno;
+				warn("Cannot write %zu bytes to gather file", sp->outSize - total);
+				break;
+			}
+			total += nwritten;
+		}
+
+		pthread_mutex_lock(&qp->lock);
+		if (error) {
+			if (qp->error == 0)
+				qp->error = error;
+		} else {
+			struct GatherIndexChunk *cp = &qp->chunks[qp->nextWrite];
+
+			cp->fileOffset = S64(qp->fileOffset);
+			cp->compressedSize = S32((uint32_t)sp->outSize);
+			cp->uncompressedSize = S32((uint32_t)sp->inSize);
+			qp->fileOffset += sp->outSize;
+			sp->state = kSlotEmpty;
+			qp->nextWrite++;
+		}
+		pthread_cond_broadcast(&qp->cond);
+	}
+	pthread_mutex_unlock(&qp->lock);
+	return NULL;
+}
+
+/*
+ * Wait for the next slot in the ring to be free.  Returns NULL if
+ * a worker or the writer has failed.
+ */
+static struct GatherSlot *
+GetGatherSlot(struct GatherQueue *qp)
+{
+	struct GatherSlot *sp;
+
+	pthread_mutex_lock(&qp->lock);
+	sp = &qp->slots[qp->filled % qp->slotCount];
+	while (qp->error == 0 && sp->state != kSlotEmpty)
+		pthread_cond_wait(&qp->cond, &qp->lock);
+	if (qp->error)
+		sp = NULL;
+	pthread_mutex_unlock(&qp->lock);
+
+	if (sp)
+		sp->inSize = 0;
+	return sp;
+}
+
+static void
+PutGatherSlot(struct GatherQueue *qp, struct GatherSlot *sp)
+{
+	pthread_mutex_lock(&qp->lock);
+	sp->state = kSlotFilled;
+	qp->filled++;
+	pthread_cond_broadcast(&qp->cond);
+	pthread_mutex_unlock(&qp->lock);
+}
+
+/*
+ * Append len bytes to the stream, either from buffer or, if buffer
+ * is NULL, from the device at offset start.  Full slots are handed
+ * to the workers.  Returns -1 on a read error or if the queue failed.
+ */
+static int
+GatherAppend(struct GatherQueue *qp, struct GatherSlot **spp, DeviceInfo_t *devp, const void *buffer, off_t start, off_t len)
+{
+	off_t total = 0;
+
+	while (total < len) {
+		struct GatherSlot *sp = *spp;
+		size_t amt = MIN(kGatherChunkSize - sp->inSize, len - total);
+
+		if (buffer) {
+			memcpy(sp->inBuf + sp->inSize, (const uint8_t *)buffer + total, amt);
+		} else {
+			ssize_t nread = pread(devp->fd, sp->inBuf + sp->inSize, amt, start + total);
+			if (nread == -1) {
+				warn("Cannot read from device at offset %lld", start + total);
+				return -1;
+			}
+			if (nread != amt) {
+				warnx("Tried to read %zu bytes, only read %zd", amt, nread);
+				/* Keep the stream offsets in the object table correct */
+				memset(sp->inBuf + sp->inSize + nread, 0, amt - nread);
+			}
+		}
+		sp->inSize += amt;
+		total += amt;
+
+		if (sp->inSize == kGatherChunkSize) {
+			PutGatherSlot(qp, sp);
+			*spp = GetGatherSlot(qp);
+			if (*spp == NULL)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+WriteGatherIndex(const char *pathname, struct GatherQueue *qp, size_t chunkCount, struct GatherIndexObject *iobjs, size_t objectCount)
+{
+	struct GatherIndexHeader ihdr = { 0 };
+	char *indexName = NULL;
+	FILE *fp;
+	int retval = -1;
+
+	if (asprintf(&indexName, "%s.index", pathname) == -1) {
+		warn("Cannot allocate index file name");
+		return -1;
+	}
+	fp = fopen(indexName, "w");
+	if (fp == NULL) {
+		warn("cannot create gather index file %s", indexName);
+		goto done;
+	}
+
+	ihdr.magic = S32(kGatherIndexMagic);
+	ihdr.version = S32(kGatherIndexVersion);
+	ihdr.chunkSize = S32(kGatherChunkSize);
+	ihdr.chunkCount = S32((uint32_t)chunkCount);
+	ihdr.objectCount = S32((uint32_t)objectCount);
+
+	if (fwrite(&ihdr, sizeof(ihdr), 1, fp) != 1 ||
+	    fwrite(qp->chunks, sizeof(*qp->chunks), chunkCount, fp) != chunkCount ||
+	    fwrite(iobjs, sizeof(*iobjs), objectCount, fp) != objectCount) {
+		warn("cannot write gather index file %s", indexName);
+		fclose(fp);
+		goto done;
+	}
+	if (fclose(fp) == EOF) {
+		warn("cannot write gather index file %s", indexName);
+		goto done;
+	}
+	retval = 0;
+done:
+	free(indexName);
+	return retval;
+}
+
+static void
+WriteParallelGather(const char *pathname, VolumeObjects_t *vop, const struct HFSInfoHeader *hdr, const HFSDataObject *objs, int threads)
+{
+	struct GatherQueue q = { 0 };
+	struct GatherIndexObject *iobjs = NULL;
+	struct GatherSlot *sp;
+	pthread_t *workers = NULL;
+	pthread_t writer;
+	int nworkers = 0;
+	int writerStarted = 0;
+	off_t streamSize, streamOffset;
+	size_t chunkCount;
+	size_t i;
+	ExtentList_t *ep;
+	int count = 0;
+
+	q.fd = -1;
+	streamSize = sizeof(*hdr) + sizeof(HFSDataObject) * vop->count;
+	for (ep = vop->list; ep; ep = ep->next) {
+		for (i = 0; i < ep->count; i++)
+			streamSize += ep->extents[i].length;
+	}
+	chunkCount = (streamSize + kGatherChunkSize - 1) / kGatherChunkSize;
+
+	q.slotCount = 2 * threads + 2;
+	q.outBufSize = compressBound(kGatherChunkSize) + 32;	// Room for the gzip header and trailer
+	q.slots = calloc(q.slotCount, sizeof(*q.slots));
+	q.chunks = calloc(chunkCount ? chunkCount : 1, sizeof(*q.chunks));
+	iobjs = calloc(vop->count ? vop->count : 1, sizeof(*iobjs));
+	workers = calloc(threads, sizeof(*workers));
+	if (q.slots == NULL || q.chunks == NULL || iobjs == NULL || workers == NULL) {
+		warn("Unable to allocate space for parallel gather");
+		goto done;
+	}
+	for (i = 0; i < q.slotCount; i++) {
+		q.slots[i].inBuf = malloc(kGatherChunkSize);
+		q.slots[i].outBuf = malloc(q.outBufSize);
+		if (q.slots[i].inBuf == NULL || q.slots[i].outBuf == NULL) {
+			warn("Unable to allocate gather buffers");
+			goto done;
+		}
+	}
+
+	q.fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (q.fd == -1) {
+		warn("cannot create gather file %s", pathname);
+		goto done;
+	}
+
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.cond, NULL);
+	for (nworkers = 0; nworkers < threads; nworkers++) {
+		if (pthread_create(&workers[nworkers], NULL, GatherCompressThread, &q) != 0) {
+			warnx("Cannot create gather compression thread");
+			break;
+		}
+	}
+	if (nworkers > 0 && pthread_create(&writer, NULL, GatherWriteThread, &q) == 0)
+		writerStarted = 1;
+	else
+		warnx("Cannot create gather writer thread");
+
+	sp = writerStarted ? GetGatherSlot(&q) : NULL;
+	if (sp &&
+	    GatherAppend(&q, &sp, NULL, hdr, 0, sizeof(*hdr)) == 0 &&
+	    GatherAppend(&q, &sp, NULL, objs, 0, sizeof(HFSDataObject) * vop->count) == 0) {
+		streamOffset = sizeof(*hdr) + sizeof(HFSDataObject) * vop->count;
+		for (ep = vop->list;
+		     ep;
+		     ep = ep->next) {
+			for (i = 0; i < ep->count; i++) {
+				if (verbose)
+					fprintf(stderr, "Writing extent <%lld, %lld>\n", ep->extents[i].base, ep->extents[i].length);
+				if (GatherAppend(&q, &sp, vop->devp, NULL, ep->extents[i].base, ep->extents[i].length) == -1) {
+					if (verbose)
+						fprintf(stderr, "\tWrite failed\n");
+					goto finish;
+				}
+				iobjs[count].offset = S64(ep->extents[i].base);
+				iobjs[count].size = S64(ep->extents[i].length);
+				iobjs[count].streamOffset = S64(streamOffset);
+				streamOffset += ep->extents[i].length;
+				count++;
+			}
+		}
+		/* The last chunk is usually short */
+		if (sp->inSize > 0) {
+			PutGatherSlot(&q, sp);
+		}
+	}
+
+finish:
+	pthread_mutex_lock(&q.lock);
+	if (count != vop->count && q.error == 0)
+		q.error = EIO;	// Stop the workers; the file is incomplete anyway
+	q.done = 1;
+	pthread_cond_broadcast(&q.cond);
+	pthread_mutex_unlock(&q.lock);
+
+	for (i = 0; i < (size_t)nworkers; i++)
+		pthread_join(workers[i], NULL);
+	if (writerStarted)
+		pthread_join(writer, NULL);
+	pthread_cond_destroy(&q.cond);
+	pthread_mutex_destroy(&q.lock);
+
+	if (count != vop->count)
+		fprintf(stderr, "WHOAH!  we're short by %zd objects!\n", vop->count - count);
+	else if (q.error == 0 && q.nextWrite == chunkCount)
+		(void)WriteGatherIndex(pathname, &q, chunkCount, iobjs, vop->count);
+	else
+		warnx("gather file %s is incomplete, no index written", pathname);
+
+done:
+	if (q.fd != -1)
+		close(q.fd);
+	if (q.slots) {
+		for (i = 0; i < q.slotCount; i++) {
+			free(q.slots[i].inBuf);
+			free(q.slots[i].outBuf);
+		}
+		free(q.slots);
+	}
+	free(q.chunks);
+	free(iobjs);
+	free(workers);
+	return;
+}
+
+/*
+ * Write the gatherHFS file.  If threads is non-zero, the data is
+ * compressed in parallel, in independently decompressable chunks,
+ * and an index file is written next to it; see WriteParallelGather.
+ */
 void
-WriteGatheredData(const char *pathname, VolumeObjects_t *vop)
+WriteGatheredData(const char *pathname, VolumeObjects_t *vop, int threads)
 {
 	int fd;
 	gzFile outf;
@@ -101,6 +551,11 @@ WriteGatheredData(const char *pathname, VolumeObjects_t *vop)
 		}
 	}
 
+	if (threads > 0) {
+		WriteParallelGather(pathname, vop, &hdr, objs, threads);
+		goto done;
+	}
+
 	fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
 	if (fd == -1) {
 		warn("cannot create gather file %s", pathname);
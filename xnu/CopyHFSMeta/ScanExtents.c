@@ -8,157 +8,100 @@
 #include "hfsmeta.h"
 #include "Data.h"
 
-#ifndef MAX
-# define MAX(a, b) \
-	({ __typeof(a) __a = (a); __typeof(b) __b = (b); __a > __b ? __a : __b; })
-#endif
-
 /*
  * Functions to scan through the extents overflow file, grabbing
  * overflow extents for the special files.
  */
 
 /*
- * Given an extent record, return the logical block address (in the volume)
- * for the requested block offset into the file.  It returns 0 if it can't
- * find it.
+ * Turn an extent record into a list of <start, length> pairs, in bytes,
+ * appending to *mapp.  Returns the number of allocation blocks added, or
+ * -1 if it can't allocate memory.
  */
-static unsigned int
-FindBlock(HFSPlusExtentRecord *erp, unsigned int blockNum)
+static off_t
+AppendExtentRecord(Extents_t **mapp, size_t *countp, const HFSPlusExtentDescriptor *extents, off_t blockSize)
 {
-	unsigned int lba = 0;
-	unsigned int base = 0;
-	HFSPlusExtentDescriptor *ep = &(*erp)[0];
+	off_t blocks = 0;
 	int i;
 
 	for (i = 0; i < kHFSPlusExtentDensity; i++) {
-		if (ep->startBlock == 0 || ep->blockCount == 0)
-			break;
-		if ((base + S32(ep->blockCount)) > blockNum) {
-			lba = S32(ep->startBlock) + (blockNum - base);
+		Extents_t *tmp;
+
+		if (extents[i].startBlock == 0 || extents[i].blockCount == 0)
 			break;
+		tmp = realloc(*mapp, sizeof(Extents_t) * (*countp + 1));
+		if (tmp == NULL) {
+			warn("Cannot allocate extent map");
+			return -1;
 		}
-		base += S32(ep->blockCount);
-		ep++;
+		*mapp = tmp;
+		tmp[*countp].base = S32(extents[i].startBlock) * blockSize;
+		tmp[*countp].length = S32(extents[i].blockCount) * blockSize;
+		tmp[*countp].fid = 0;
+		(*countp)++;
+		blocks += S32(extents[i].blockCount);
 	}
-	return lba;
+	return blocks;
 }
 
 /*
- * Get the given node from the extents-overflow file.  Returns -1 on error, and
- * 0 on success.
+ * Read the header record of a B-tree, given the file's extent map.
  */
 static int
-GetNode(DeviceInfo_t *devp, HFSPlusVolumeHeader *hp, int nodeNum, size_t nodeSize, void *nodePtr)
+ReadBTreeHeader(DeviceInfo_t *devp, const Extents_t *map, BTHeaderRec *hdrp)
 {
-	int retval = 0;
-	unsigned char *ptr, *endPtr;
-	unsigned int offset;
-	HFSPlusExtentRecord *erp = &hp->extentsFile.extents;
-	size_t bufferSize = MAX(nodeSize, S32(hp->blockSize));
-
-	ptr = nodePtr;
-	endPtr = ptr + bufferSize;
-	/*
-	 * The block number for HFS Plus is guaranteed to be 32 bits.
-	 * But the multiplication could over-flow, so we cast one
-	 * of the variables to off_t, and cast the whole thing back
-	 * to uint32_t.
-	 */
-	offset = (uint32_t)(((off_t)nodeNum * nodeSize) / S32(hp->blockSize));
-
-	/*
-	 * We have two sizes to consider here:  the device blocksize, and the
-	 * buffer size.  The buffer size is the larger of the btree node size
-	 * and the volume allocation block size.
-	 *
-	 * This loop is the case where the device block size is smaller than
-	 * the amount we want to read (in a common case, 8kbyte node size, and
-	 * 512 byte block size).  It reads in a device block, and adds it to
-	 * the buffer; it continues until an error, or until it has gotten
-	 * the amount it needs.
-	 *
-	 * The variable "offset" is in *allocation blocks*, not *bytes*.
-	 */
-	while (ptr < endPtr) {
-		ssize_t rv;
-		off_t lba;
-		unsigned int i;
-
+	uint8_t buffer[devp->blockSize];
+	BTNodeDescriptor *descp = (BTNodeDescriptor *)buffer;
 
-		lba = FindBlock(erp, offset);
-		if (lba == 0) {
-			warnx("Cannot find block %u in extents overflow file", offset);
-			return -1;
-		}
-		lba = lba * S32(hp->blockSize);
-		for (i = 0; i < S32(hp->blockSize) / devp->blockSize; i++) {
-//			printf("Trying to get block %lld\n", lba + i);
-			rv = GetBlock(devp, lba + (i * devp->blockSize), ptr);
-			if (rv == -1) {
-				warnx("Cannot read block %llu in extents overflow file", lba + i);
-				return -1;
-			}
-			ptr += devp->blockSize;
-		}
-		offset++;
+	if (GetBlock(devp, map[0].base, buffer) == -1)
+		return -1;
+	if (descp->kind != kBTHeaderNode) {
+		warnx("Root node is not a header node (%x)", descp->kind);
+		return -1;
 	}
-
-	/*
-	 * Per 13080856:  if the node size is less than the allocation block size, we
-	 * have to deal with having multiple nodes per block.  The code above to read it
-	 * has read in either an allocation block, or a node block, depending on which
-	 * is larger.  If the allocation block is larger, then we have to move the node
-	 * we want to the beginning of the buffer.
-	 */
-	if (nodeSize < bufferSize) {
-		size_t indx = nodeNum % (S32(hp->blockSize) / nodeSize);
-		ptr = nodePtr;
-		memmove(ptr, ptr + (indx * nodeSize), nodeSize);
-	}
-	return retval;
+	memcpy(hdrp, buffer + sizeof(BTNodeDescriptor), sizeof(*hdrp));
+	return 0;
 }
 
 /*
  * Scan through an extentes overflow node, looking for File ID's less than
  * the first user file ID.  For each one it finds, it adds the extents to
- * the volume structure list.  It returns the number of the next node
- * (which will be 0 when we've hit the end of the list); it also returns 0
- * when it encounters a CNID larger than the system files'.
+ * the volume structure list.  It returns 1 when it encounters a CNID
+ * larger than the system files', -1 if the node is corrupt, and 0 to
+ * go on to the next node.
  */
-static unsigned int
-ScanNode(VolumeObjects_t *vop, uint8_t *nodePtr, size_t nodeSize, off_t blockSize)
+static int
+ScanNode(VolumeObjects_t *vop, const uint8_t *nodePtr, size_t nodeSize, off_t blockSize)
 {
-	u_int16_t *offsetPtr;
-	BTNodeDescriptor *descp;
+	const u_int16_t *offsetPtr;
+	const BTNodeDescriptor *descp;
 	int indx;
 	int numRecords;
-	HFSPlusExtentKey *keyp;
-	HFSPlusExtentRecord *datap;
-	uint8_t *recp;
-	unsigned int retval;
+	const HFSPlusExtentKey *keyp;
+	const HFSPlusExtentRecord *datap;
+	const uint8_t *recp;
+	int retval = 0;
 
-	descp = (BTNodeDescriptor*)nodePtr;
+	descp = (const BTNodeDescriptor*)nodePtr;
 
 	if (descp->kind != kBTLeafNode)
 		return 0;
 
 	numRecords = S16(descp->numRecords);
-	offsetPtr = (u_int16_t*)((uint8_t*)nodePtr + nodeSize);
+	offsetPtr = (const u_int16_t*)(nodePtr + nodeSize);
 
-	retval = S32(descp->fLink);
 	for (indx = 1; indx <= numRecords; indx++) {
 		int recOffset = S16(offsetPtr[-indx]);
 		recp = nodePtr + recOffset;
 		if (recp > (nodePtr + nodeSize)) {
 			return -1;	// Corrupt node
 		}
-		keyp = (HFSPlusExtentKey*)recp;
-		datap = (HFSPlusExtentRecord*)(recp + sizeof(HFSPlusExtentKey));
+		keyp = (const HFSPlusExtentKey*)recp;
+		datap = (const HFSPlusExtentRecord*)(recp + sizeof(HFSPlusExtentKey));
 		if (debug > 1) printf("Node index #%d:  fileID = %u\n", indx, S32(keyp->fileID));
 		if (S32(keyp->fileID) >= kHFSFirstUserCatalogNodeID) {
 			if (debug) printf("Done scanning extents overflow file\n");
-			retval = 0;
+			retval = 1;
 			break;
 		} else {
 			int i;
@@ -174,6 +117,106 @@ ScanNode(VolumeObjects_t *vop, uint8_t *nodePtr, size_t nodeSize, off_t blockSiz
 	return retval;
 }
 
+/*
+ * Build the extent map -- the list of <start, length> pairs, in bytes,
+ * in file order -- for the data fork of a system file, from the volume
+ * header and, if that isn't the whole fork, the extents overflow file.
+ * The caller frees *mapp.
+ */
+__private_extern__
+int
+GetForkExtentMap(VolumeObjects_t *vop, int useAltHdr, unsigned int fileID, Extents_t **mapp, size_t *countp)
+{
+	HFSPlusVolumeHeader *hp = useAltHdr ? &vop->vdp->altHeader : &vop->vdp->priHeader;
+	off_t blockSize = S32(hp->blockSize);
+	const HFSPlusForkData *fork;
+	__block Extents_t *map = NULL;
+	__block size_t count = 0;
+	Extents_t *extMap = NULL;
+	size_t extCount = 0;
+	__block off_t blocks;
+	__block int failed = 0;
+	BTHeaderRec header;
+	size_t nodeSize;
+	int retval = -1;
+
+	switch (fileID) {
+	case kHFSExtentsFileID:		fork = &hp->extentsFile; break;
+	case kHFSCatalogFileID:		fork = &hp->catalogFile; break;
+	case kHFSAllocationFileID:	fork = &hp->allocationFile; break;
+	case kHFSStartupFileID:		fork = &hp->startupFile; break;
+	case kHFSAttributesFileID:	fork = &hp->attributesFile; break;
+	default:
+		warnx("File %u is not a system file", fileID);
+		goto done;
+	}
+
+	blocks = AppendExtentRecord(&map, &count, fork->extents, blockSize);
+	if (blocks == -1)
+		goto done;
+	if (count == 0) {
+		warnx("File %u has no extents", fileID);
+		goto done;
+	}
+	/* The extents overflow file can't have overflow extents itself */
+	if (blocks >= S32(fork->totalBlocks) || fileID == kHFSExtentsFileID) {
+		retval = 0;
+		goto done;
+	}
+
+	if (AppendExtentRecord(&extMap, &extCount, hp->extentsFile.extents, blockSize) <= 0 ||
+	    ReadBTreeHeader(vop->devp, extMap, &header) == -1) {
+		warnx("Cannot read the extents overflow file header");
+		goto done;
+	}
+	nodeSize = S16(header.nodeSize);
+	if (StreamBTreeLeaves(vop->devp, extMap, extCount, &header, kBTreeStreamInFlight,
+			      ^(const uint8_t *nodePtr) {
+		const BTNodeDescriptor *descp = (const BTNodeDescriptor *)nodePtr;
+		const u_int16_t *offsetPtr = (const u_int16_t *)(nodePtr + nodeSize);
+		int indx;
+
+		for (indx = 1; indx <= S16(descp->numRecords); indx++) {
+			int recOffset = S16(offsetPtr[-indx]);
+			const HFSPlusExtentKey *keyp = (const HFSPlusExtentKey *)(nodePtr + recOffset);
+			off_t added;
+
+			if (recOffset + sizeof(HFSPlusExtentKey) + sizeof(HFSPlusExtentRecord) > nodeSize) {
+				failed = 1;	// Corrupt node
+				return 1;
+			}
+			if (S32(keyp->fileID) > fileID)
+				return 1;	// Records are sorted, so we're done
+			if (S32(keyp->fileID) < fileID || keyp->forkType != 0)
+				continue;
+			added = AppendExtentRecord(&map, &count,
+						   *(const HFSPlusExtentRecord *)(nodePtr + recOffset + sizeof(HFSPlusExtentKey)),
+						   blockSize);
+			if (added == -1) {
+				failed = 1;
+				return 1;
+			}
+			blocks += added;
+		}
+		return 0;
+	}) == -1 || failed) {
+		goto done;
+	}
+	if (blocks < S32(fork->totalBlocks))
+		warnx("Found only %lld of %u blocks of file %u", blocks, S32(fork->totalBlocks), fileID);
+	retval = 0;
+
+done:
+	free(extMap);
+	if (retval == 0) {
+		*mapp = map;
+		*countp = count;
+	} else {
+		free(map);
+	}
+	return retval;
+}
+
 /*
  * Given a volme structure list, scan through the extents overflow file
  * looking for system-file extents (those with a CNID < 16).  If useAltHdr
@@ -184,87 +227,44 @@ int
 ScanExtents(VolumeObjects_t *vop, int useAltHdr)
 {
 	int retval = -1;
-	ssize_t rv;
-	uint8_t buffer[vop->devp->blockSize];
-	struct RootNode {
-		BTNodeDescriptor desc;
-		BTHeaderRec header;
-	} *headerNode;
+	BTHeaderRec header;
 	HFSPlusVolumeHeader *hp;
 	off_t vBlockSize;
 	size_t nodeSize;
-	size_t bufferSize;
-	void *nodePtr = NULL;
-	unsigned int nodeNum = 0;
+	Extents_t *map = NULL;
+	size_t mapCount = 0;
+	__block int corrupt = 0;
 
 	hp = useAltHdr ? &vop->vdp->altHeader : & vop->vdp->priHeader;
 	vBlockSize = S32(hp->blockSize);
 
-	rv = GetBlock(vop->devp, S32(hp->extentsFile.extents[0].startBlock) * vBlockSize, buffer);
-	if (rv == -1) {
+	if (GetForkExtentMap(vop, useAltHdr, kHFSExtentsFileID, &map, &mapCount) == -1 ||
+	    ReadBTreeHeader(vop->devp, map, &header) == -1) {
 		warnx("Cannot get btree header node for extents file for %s header", useAltHdr ? "alternate" : "primary");
-		retval = -1;
 		goto done;
 	}
-	headerNode = (struct RootNode*)buffer;
 
-	if (headerNode->desc.kind != kBTHeaderNode) {
-		warnx("Root node is not a header node (%x)", headerNode->desc.kind);
-		goto done;
-	}
+	nodeSize = S16(header.nodeSize);
+	if (debug) printf("first leaf nodenum = %u\n", S32(header.firstLeafNode));
 
-	nodeSize = S16(headerNode->header.nodeSize);
 	/*
-	 * There are three cases here:
-	 * nodeSize == vBlockSize;
-	 * nodeSize > vBlockSize;
-	 * nodeSize < vBlockSize.
-	 * For the first two, everything is easy:  we just need to read in a nodeSize, and that
-	 * contains everything we care about.  For the third case, however, we will
-	 * need to read in an allocation block size, but then have GetNode move memory
-	 * around so the node we want is at the beginning of the buffer.  Note that this
-	 * does mean it is less efficient than it should be.
+	 * Stream through the leaf nodes, until ScanNode() finds the
+	 * first user file.
 	 */
-	if (nodeSize < vBlockSize) {
-		bufferSize = vBlockSize;
-	} else {
-		bufferSize = nodeSize;
-	}
-
-	nodePtr = malloc(bufferSize);
-	if (nodePtr == NULL) {
-		warn("cannot allocate buffer for node");
+	if (StreamBTreeLeaves(vop->devp, map, mapCount, &header, kBTreeStreamInFlight,
+			      ^(const uint8_t *nodePtr) {
+		int rv = ScanNode(vop, nodePtr, nodeSize, vBlockSize);
+		if (rv == -1)
+			corrupt = 1;
+		return rv;
+	}) == -1 || corrupt) {
+		warnx("Cannot scan the extents overflow file for %s header", useAltHdr ? "alternate" : "primary");
 		goto done;
 	}
-	nodeNum = S32(headerNode->header.firstLeafNode);
-
-	if (debug) printf("first leaf nodenum = %u\n", nodeNum);
-
-	/*
-	 * Iterate through the leaf nodes.
-	 */
-	while (nodeNum != 0) {
-		if (debug) printf("Getting node %u\n", nodeNum);
-
-		/*
-		 * GetNode() puts the node we want into nodePtr;
-		 * we have ensured that the buffer is large enough
-		 * to contain at least one node, or one allocation block,
-		 * whichever is larger.
-		 */
-		rv = GetNode(vop->devp, hp, nodeNum, nodeSize, nodePtr);
-		if (rv == -1) {
-			warnx("Cannot get node %u", nodeNum);
-			retval = -1;
-			goto done;
-		}
-		nodeNum = ScanNode(vop, nodePtr, nodeSize, vBlockSize);
-	}
 	retval = 0;
 
 done:
-	if (nodePtr)
-		free(nodePtr);
+	free(map);
 	return retval;
 
 }
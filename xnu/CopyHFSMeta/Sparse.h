@@ -3,6 +3,6 @@
 
 struct IOWrapper;
 
-extern struct IOWrapper *InitSparseBundle(const char *, DeviceInfo_t*);
+extern struct IOWrapper *InitSparseBundle(const char *, DeviceInfo_t*, int);
 
 #endif /* _SPARSE_H */
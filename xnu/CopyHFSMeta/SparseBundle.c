@@ -9,6 +9,7 @@
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <removefile.h>
+#include <CommonCrypto/CommonDigest.h>
 
 #include <CoreFoundation/CoreFoundation.h>
 #include <System/sys/fsctl.h> 
@@ -28,6 +29,11 @@
 	({ __typeof(a) __a = (a); __typeof(b) __b = (b); \
 		__a < __b ? __a : __b; })
 #endif
+#ifndef MAX
+# define MAX(a, b) \
+	({ __typeof(a) __a = (a); __typeof(b) __b = (b); \
+		__a > __b ? __a : __b; })
+#endif
 
 /*
  * Context for the sparse bundle routines.  The path name,
@@ -40,6 +46,16 @@ struct SparseBundleContext {
 	size_t bandSize;
 	int cfd;	// Cached file descriptor
 	int cBandNum;	// cached bandfile number
+	int incremental;	// Only write what changed since the last copy
+	off_t devSize;
+	struct ManifestEntry *oldManifest;	// From the last copy, if any
+	size_t oldCount;
+	struct ManifestEntry *newManifest;	// Built up by this copy
+	size_t newCount;
+	size_t newSize;
+	off_t bytesWritten;
+	off_t bytesUnchanged;
+	off_t bytesZeroed;
 };
 
 static const int kBandSize = 8388608;
@@ -113,11 +129,11 @@ doSparseRead(struct IOWrapper *context, off_t offset, void *buffer, off_t len)
 			goto done;
 		}
 		if (n < amount) {	// hit EOF, pad out with zeroes
-			memset(buffer + nread + amount, 0, amount - n);
+			memset(buffer + nread + n, 0, amount - n);
 		}
 		free(bandName);
 		close(fd);
-		nread += n;
+		nread += amount;
 	}
 	retval = nread;
 done:
@@ -199,6 +215,308 @@ done:
 	
 }
 
+/*
+ * Incremental copies.
+ *
+ * With an incremental bundle, every piece of metadata written to it
+ * (cut at kManifestChunkSize boundaries of the device) is recorded in
+ * a manifest, along with a SHA-256 digest of its contents.  The next
+ * incremental copy into the same bundle reads the metadata from the
+ * device as usual, but only writes the pieces whose digest changed;
+ * and, when it's done, it zeroes any piece that is no longer metadata.
+ *
+ * The manifest is removed as soon as it is loaded, and the new one is
+ * written to a temporary file and renamed into place only once the copy
+ * is complete -- so an interrupted copy just means the next one copies
+ * everything again.  A copy that is not incremental removes any manifest
+ * before it writes anything, since the bundle will no longer match it.
+ */
+#define kManifestName	"HC.manifest"
+#define kManifestTmpName	"HC.manifest.tmp"
+
+enum {
+	kManifestChunkSize = 64 * 1024,
+	kManifestMagic = 0x484d4d46,	// 'HMMF'
+	kManifestVersion = 1,
+};
+
+// On-disk; all fields are big-endian.
+struct ManifestHeader {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	chunkSize;
+	uint32_t	reserved;
+	int64_t	deviceSize;
+	int64_t	count;		// Number of ManifestEntry records that follow
+};
+
+struct ManifestEntry {
+	int64_t	offset;		// Device offset
+	uint32_t	length;		// At most chunkSize
+	uint32_t	reserved;
+	uint8_t	digest[CC_SHA256_DIGEST_LENGTH];
+};
+
+/*
+ * Entries are kept in host byte order in memory, and sorted by offset.
+ */
+static int
+CompareManifestEntries(const void *left, const void *right)
+{
+	const struct ManifestEntry *l = left, *r = right;
+
+	return (l->offset < r->offset) ? -1 : (l->offset > r->offset);
+}
+
+static struct ManifestEntry *
+FindManifestEntry(struct SparseBundleContext *ctx, off_t offset)
+{
+	struct ManifestEntry key = { .offset = offset };
+
+	if (ctx->oldManifest == NULL)
+		return NULL;
+	return bsearch(&key, ctx->oldManifest, ctx->oldCount, sizeof(key), CompareManifestEntries);
+}
+
+/*
+ * Load the manifest from the last incremental copy, if there is one
+ * and it matches this bundle, and then remove it.
+ */
+static void
+LoadManifest(struct SparseBundleContext *ctx, off_t devSize)
+{
+	struct ManifestHeader hdr;
+	struct ManifestEntry *entries = NULL;
+	char *name = NULL;
+	FILE *fp = NULL;
+	int64_t count, i;
+
+	if (asprintf(&name, "%s/%s", ctx->pathname, kManifestName) == -1)
+		return;
+	fp = fopen(name, "r");
+	if (fp == NULL)
+		goto done;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    S32(hdr.magic) != kManifestMagic ||
+	    S32(hdr.version) != kManifestVersion ||
+	    S32(hdr.chunkSize) != kManifestChunkSize ||
+	    S64(hdr.deviceSize) != devSize) {
+		warnx("Ignoring manifest %s, it does not match this device", name);
+		goto done;
+	}
+	count = S64(hdr.count);
+	if (count < 0 || count > devSize / 512) {
+		warnx("Ignoring manifest %s, it is corrupt", name);
+		goto done;
+	}
+	entries = malloc(sizeof(*entries) * (count ? count : 1));
+	if (entries == NULL) {
+		warn("Cannot allocate memory for manifest %s", name);
+		goto done;
+	}
+	if (fread(entries, sizeof(*entries), count, fp) != count) {
+		warnx("Ignoring manifest %s, it is truncated", name);
+		goto done;
+	}
+	for (i = 0; i < count; i++) {
+		entries[i].offset = S64(entries[i].offset);
+		entries[i].length = S32(entries[i].length);
+	}
+	qsort(entries, count, sizeof(*entries), CompareManifestEntries);
+
+	ctx->oldManifest = entries;
+	ctx->oldCount = count;
+	entries = NULL;
+	if (debug)
+		fprintf(stderr, "Loaded %lld manifest entries from %s\n", count, name);
+
+done:
+	if (fp)
+		fclose(fp);
+	/* From here on, the bundle no longer matches it */
+	unlink(name);
+	free(entries);
+	free(name);
+}
+
+/*
+ * Remove the manifest, and any partial one, without loading it.
+ */
+static void
+RemoveManifest(struct SparseBundleContext *ctx)
+{
+	char *name = NULL;
+
+	if (asprintf(&name, "%s/%s", ctx->pathname, kManifestName) != -1) {
+		unlink(name);
+		free(name);
+	}
+	if (asprintf(&name, "%s/%s", ctx->pathname, kManifestTmpName) != -1) {
+		unlink(name);
+		free(name);
+	}
+}
+
+static int
+AddManifestEntry(struct SparseBundleContext *ctx, off_t offset, size_t length, const uint8_t *digest)
+{
+	struct ManifestEntry *ep;
+
+	if (ctx->newCount == ctx->newSize) {
+		size_t newSize = ctx->newSize ? ctx->newSize * 2 : 1024;
+		struct ManifestEntry *tmp = realloc(ctx->newManifest, sizeof(*tmp) * newSize);
+		if (tmp == NULL) {
+			warn("Cannot allocate memory for manifest");
+			return -1;
+		}
+		ctx->newManifest = tmp;
+		ctx->newSize = newSize;
+	}
+	ep = &ctx->newManifest[ctx->newCount++];
+	memset(ep, 0, sizeof(*ep));
+	ep->offset = offset;
+	ep->length = (uint32_t)length;
+	memcpy(ep->digest, digest, sizeof(ep->digest));
+	return 0;
+}
+
+/*
+ * Write a chunk of data read from the device at offset, skipping the
+ * pieces whose contents are the same as in the last copy.
+ */
+static ssize_t
+doIncrementalWrite(IOWrapper_t *context, off_t offset, void *buffer, off_t len)
+{
+	struct SparseBundleContext *ctx = context->context;
+	off_t done = 0;
+
+	while (done < len) {
+		size_t amt = MIN(kManifestChunkSize - ((offset + done) % kManifestChunkSize), len - done);
+		uint8_t *data = (uint8_t *)buffer + done;
+		uint8_t digest[CC_SHA256_DIGEST_LENGTH];
+		struct ManifestEntry *old;
+
+		CC_SHA256(data, (CC_LONG)amt, digest);
+		old = FindManifestEntry(ctx, offset + done);
+		if (old && old->length == amt && memcmp(old->digest, digest, sizeof(digest)) == 0) {
+			ctx->bytesUnchanged += amt;
+		} else {
+			if (doSparseWrite(context, offset + done, data, amt) == -1)
+				return -1;
+			ctx->bytesWritten += amt;
+		}
+		if (AddManifestEntry(ctx, offset + done, amt, digest) == -1)
+			return -1;
+		done += amt;
+	}
+	return done;
+}
+
+/*
+ * Zero whatever the last copy wrote that this one didn't; both lists
+ * are sorted, and the entries in each don't overlap.
+ */
+static int
+ZeroStaleRanges(IOWrapper_t *context)
+{
+	struct SparseBundleContext *ctx = context->context;
+	static uint8_t zeroes[kManifestChunkSize];
+	size_t i, j = 0;
+
+	for (i = 0; i < ctx->oldCount; i++) {
+		off_t pos = ctx->oldManifest[i].offset;
+		off_t end = pos + ctx->oldManifest[i].length;
+		size_t k;
+
+		while (j < ctx->newCount && ctx->newManifest[j].offset + ctx->newManifest[j].length <= pos)
+			j++;
+		for (k = j; pos < end; k++) {
+			off_t gapEnd = end;
+
+			if (k < ctx->newCount && ctx->newManifest[k].offset < end)
+				gapEnd = MIN(gapEnd, ctx->newManifest[k].offset);
+			if (gapEnd > pos) {
+				if (doSparseWrite(context, pos, zeroes, gapEnd - pos) == -1)
+					return -1;
+				ctx->bytesZeroed += gapEnd - pos;
+			}
+			if (k >= ctx->newCount || ctx->newManifest[k].offset >= end)
+				break;
+			pos = MAX(pos, ctx->newManifest[k].offset + ctx->newManifest[k].length);
+		}
+	}
+	return 0;
+}
+
+/*
+ * The copy is complete:  clear out stale metadata, and then put the
+ * new manifest in place.
+ */
+static void
+CommitManifest(IOWrapper_t *context)
+{
+	struct SparseBundleContext *ctx = context->context;
+	struct ManifestHeader hdr = { 0 };
+	char *tmpName = NULL, *name = NULL;
+	FILE *fp = NULL;
+	size_t i;
+
+	qsort(ctx->newManifest, ctx->newCount, sizeof(*ctx->newManifest), CompareManifestEntries);
+	if (ZeroStaleRanges(context) == -1) {
+		warnx("Cannot clear stale metadata, no manifest written");
+		goto done;
+	}
+
+	if (asprintf(&tmpName, "%s/%s", ctx->pathname, kManifestTmpName) == -1 ||
+	    asprintf(&name, "%s/%s", ctx->pathname, kManifestName) == -1) {
+		warn("Cannot allocate manifest file name");
+		goto done;
+	}
+	fp = fopen(tmpName, "w");
+	if (fp == NULL) {
+		warn("Cannot create manifest %s", tmpName);
+		goto done;
+	}
+	hdr.magic = S32(kManifestMagic);
+	hdr.version = S32(kManifestVersion);
+	hdr.chunkSize = S32(kManifestChunkSize);
+	hdr.deviceSize = S64(ctx->devSize);
+	hdr.count = S64((int64_t)ctx->newCount);
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto fail;
+	for (i = 0; i < ctx->newCount; i++) {
+		struct ManifestEntry entry = ctx->newManifest[i];
+
+		entry.offset = S64(entry.offset);
+		entry.length = S32(entry.length);
+		if (fwrite(&entry, sizeof(entry), 1, fp) != 1)
+			goto fail;
+	}
+	if (fflush(fp) == EOF || fsync(fileno(fp)) == -1)
+		goto fail;
+	if (fclose(fp) == EOF) {
+		fp = NULL;
+		goto fail;
+	}
+	fp = NULL;
+	if (rename(tmpName, name) == -1)
+		goto fail;
+
+	if (verbose)
+		fprintf(stderr, "Incremental copy:  %lld bytes written, %lld unchanged, %lld zeroed\n", ctx->bytesWritten, ctx->bytesUnchanged, ctx->bytesZeroed);
+	goto done;
+
+fail:
+	warn("Cannot write manifest %s", tmpName);
+	if (fp)
+		fclose(fp);
+	unlink(tmpName);
+done:
+	free(tmpName);
+	free(name);
+}
+
 /*
  * Write a given extent (<start, length> pair) from an input device to the
  * sparse bundle.  We also use a block to update progress.
@@ -206,6 +524,7 @@ done:
 static ssize_t
 WriteExtentToSparse(struct IOWrapper * context, DeviceInfo_t *devp, off_t start, off_t len, void (^bp)(off_t))
 {
+	struct SparseBundleContext *ctx = context->context;
 	const ssize_t bufSize = 1024 * 1024;
 	uint8_t *buffer = NULL;
 	ssize_t retval = 0;
@@ -222,7 +541,12 @@ WriteExtentToSparse(struct IOWrapper * context, DeviceInfo_t *devp, off_t start,
 	while (total < len) {
 		ssize_t nread;
 		ssize_t nwritten;
-		ssize_t amt = MIN(bufSize, len - total);
+		/*
+		 * Keep the reads on bufSize boundaries of the device, so a long
+		 * (merged) extent is read in whole, aligned chunks that don't
+		 * straddle band files.
+		 */
+		ssize_t amt = MIN(bufSize - (ssize_t)((start + total) % bufSize), len - total);
 		nread = UnalignedRead(devp, buffer, amt, start + total);
 		if (nread == -1) {
 			warn("Cannot read from device at offset %lld", start + total);
@@ -232,7 +556,10 @@ WriteExtentToSparse(struct IOWrapper * context, DeviceInfo_t *devp, off_t start,
 		if (nread < amt) {
 			warnx("Short read from source device -- got %zd, expected %zd", nread, amt);
 		}
-		nwritten = doSparseWrite(context, start + total, buffer, nread);
+		if (ctx->incremental)
+			nwritten = doIncrementalWrite(context, start + total, buffer, nread);
+		else
+			nwritten = doSparseWrite(context, start + total, buffer, nread);
 		if (nwritten == -1) {
 			retval = -1;
 			break;
@@ -371,6 +698,9 @@ SetProgress(struct IOWrapper *context, off_t prog)
 	sprintf(progFile, "%s/%s", ctx->pathname, kProgressName);
 	if (prog == 0) {
 		remove(progFile);
+		// The copy is done
+		if (ctx->incremental)
+			CommitManifest(context);
 	} else {
 		fp = fopen(progFile, "w");
 		if (fp) {
@@ -394,6 +724,10 @@ doCleanup(struct IOWrapper *ctx)
 	int rv = 0;
 	char bandsDir[strlen(context->pathname) + sizeof("/bands") + 1];	// 1 for NUL
 
+	// An incremental copy needs the old band files
+	if (context->oldManifest)
+		return 0;
+
 	sprintf(bandsDir, "%s/bands", context->pathname);
 
 	if (debug)
@@ -410,10 +744,12 @@ doCleanup(struct IOWrapper *ctx)
  * create the bundle directory (but not its parents!) if needed, and
  * will populate it out.  It checks to see if there is an existing bundle
  * of the same name, and, if so, ensures that the izes are correct.  Then
- * it sets up all the function pointers.
+ * it sets up all the function pointers.  If incremental is set, only the
+ * parts of the metadata that changed since the last incremental copy into
+ * this bundle will be written.
  */
 struct IOWrapper *
-InitSparseBundle(const char *path, DeviceInfo_t *devp)
+InitSparseBundle(const char *path, DeviceInfo_t *devp, int incremental)
 {
 	struct SparseBundleContext ctx = { 0 };
 	IOWrapper_t *wrapper = NULL;
@@ -506,6 +842,13 @@ InitSparseBundle(const char *path, DeviceInfo_t *devp)
 		}
 	}
 
+	ctx.incremental = incremental;
+	ctx.devSize = devp->size;
+	if (incremental)
+		LoadManifest(&ctx, devp->size);
+	else
+		RemoveManifest(&ctx);
+
 	wrapper = malloc(sizeof(*wrapper));
 	if (wrapper) {
 		struct SparseBundleContext *wrapped_ctx;
@@ -530,6 +873,7 @@ done:
 	if (wrapper == NULL) {
 		if (ctx.pathname)
 			free(ctx.pathname);
+		free(ctx.oldManifest);
 	}
 
 	free(tmpname);
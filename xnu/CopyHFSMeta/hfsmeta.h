@@ -43,6 +43,17 @@ typedef struct DeviceInfo DeviceInfo_t;
 
 ssize_t GetBlock(DeviceInfo_t*, off_t, uint8_t*);
 int ScanExtents(VolumeObjects_t *, int);
+int GetForkExtentMap(VolumeObjects_t *, int, unsigned int, Extents_t **, size_t *);
+
+/*
+ * Walk the leaf nodes of a B-tree file, given its extent map and header
+ * record; the handler returns non-zero to stop.  See util.c.
+ */
+enum {
+	kBTreeStreamInFlight = 4,	// Default number of batches read ahead
+};
+typedef int (^btree_leaf_handler_t)(const uint8_t *node);
+int StreamBTreeLeaves(DeviceInfo_t *, const Extents_t *, size_t, const BTHeaderRec *, unsigned int, btree_leaf_handler_t);
 
 /*
  * The IOWrapper structure is used to do input and output on
@@ -55,7 +55,7 @@ static void
 usage(const char *progname)
 {
 
-	errx(kBadExit, "usage: %s [-vdpS] [-g gatherFile] [-C] [-r <bytes>] <src device> <destination>", progname);
+	errx(kBadExit, "usage: %s [-vdpSI] [-g gatherFile] [-j threads] [-C] [-r <bytes>] <src device> <destination>", progname);
 }
 
 int
@@ -74,16 +74,20 @@ main(int ac, char **av)
 	int force = 0;
 	int retval = kGoodExit;
 	int find_all_metadata = 0;
+	int gatherThreads = 0;
+	int incremental = 0;
 
-	while ((ch = getopt(ac, av, "fvdg:Spr:CA")) != -1) {
+	while ((ch = getopt(ac, av, "fvdg:j:Spr:CAI")) != -1) {
 		switch (ch) {
 		case 'A':	find_all_metadata = 1; break;
+		case 'I':	incremental = 1; break;
 		case 'v':	verbose++; break;
 		case 'd':	debug++; verbose++; break;
 		case 'S':	printEstimate = 1; break;
 		case 'p':	printProgress = 1; break;
 		case 'r':	restart = strtoull(optarg, NULL, 0); break;
 		case 'g':	gather = strdup(optarg); break;
+		case 'j':	gatherThreads = (int)strtol(optarg, NULL, 0); break;
 		case 'f':	force = 1; break;
 		default:	usage(progname);
 		}
@@ -131,6 +135,9 @@ main(int ac, char **av)
 				return 0;
 			});
 
+	// Copy in ascending device order, with overlapping and adjacent extents merged.
+	(void)NormalizeVolumeObject(vop);
+
 	if (debug)
 		PrintVolumeObject(vop);
 
@@ -139,22 +146,33 @@ main(int ac, char **av)
 	}
 
 	// Create a gatherHFS-compatible file, if requested.
+	// With -j, it is compressed by that many threads, and indexed.
 	if (gather) {
-		WriteGatheredData(gather, vop);
+		WriteGatheredData(gather, vop, gatherThreads);
 	}
 
 	/*
 	 * If we're given a destination, initialize it.
  	 */
 	if (dst) {
-		IOWrapper_t *wrapper = InitSparseBundle(dst, devp);
+		IOWrapper_t *wrapper = InitSparseBundle(dst, devp, incremental);
 
 		if (wrapper == NULL) {
 			err(kBadExit, "cannot initialize destination container %s", dst);
 		}
 
+		/*
+		 * An incremental copy always goes over all of the metadata (but
+		 * only writes what changed), so there is nothing to pick up from.
+		 */
+		if (incremental && restart) {
+			if (verbose)
+				warnx("Ignoring restart offset for an incremental copy");
+			restart = 0;
+		}
+
 		// See if we're picking up from a previous copy
-		if (restart == 0) {
+		if (restart == 0 && !incremental) {
 			restart = wrapper->getprog(wrapper);
 			if (debug) {
 				fprintf(stderr, "auto-restarting at offset %lld\n", restart);
@@ -115,6 +115,115 @@ done:
 	return retval;
 }
 
+static int
+CompareExtents(const void *left, const void *right)
+{
+	const Extents_t *l = left, *r = right;
+
+	if (l->base != r->base)
+		return (l->base < r->base) ? -1 : 1;
+	/* Longer first, so a duplicate is dropped rather than trimmed */
+	if (l->length != r->length)
+		return (l->length > r->length) ? -1 : 1;
+	return (l->fid < r->fid) ? -1 : (l->fid > r->fid);
+}
+
+/*
+ * Sort the extents in a volume list by device offset, and merge the
+ * ones that overlap or abut, so that copying reads the device in one
+ * ascending pass, with fewer and larger reads.  Extents of different
+ * files are only combined where they overlap:  the later one is trimmed
+ * to start where the earlier one ends, so each byte keeps the file ID
+ * it was added with (FindOtherMetadata depends on it).  This should
+ * be called once all the extents have been added.
+ */
+__private_extern__
+int
+NormalizeVolumeObject(VolumeObjects_t *vop)
+{
+	Extents_t *all = NULL, *cur;
+	ExtentList_t *exts, *newList = NULL, **tail = &newList;
+	size_t oldCount = vop->count;
+	off_t oldBytes = vop->byteCount;
+	size_t count = 0, merged = 0;
+	off_t byteCount = 0;
+	size_t indx;
+
+	if (vop->count < 2)
+		return 0;
+
+	all = malloc(sizeof(*all) * vop->count);
+	if (all == NULL) {
+		warn("Cannot allocate %zu bytes to sort extents", sizeof(*all) * vop->count);
+		return -1;
+	}
+	for (exts = vop->list;
+	     exts;
+	     exts = exts->next) {
+		for (indx = 0; indx < exts->count; indx++) {
+			all[count++] = exts->extents[indx];
+		}
+	}
+	qsort(all, count, sizeof(*all), CompareExtents);
+
+	for (indx = 0; indx < count; indx++) {
+		Extents_t *prev = merged ? &all[merged - 1] : NULL;
+		off_t prevEnd;
+
+		cur = &all[indx];
+		if (cur->length <= 0)
+			continue;
+		if (prev == NULL) {
+			all[merged++] = *cur;
+			continue;
+		}
+		prevEnd = prev->base + prev->length;
+		if (cur->fid == prev->fid && cur->base <= prevEnd) {
+			if (cur->base + cur->length > prevEnd)
+				prev->length = cur->base + cur->length - prev->base;
+		} else if (cur->base < prevEnd) {
+			if (cur->base + cur->length > prevEnd) {
+				cur->length -= prevEnd - cur->base;
+				cur->base = prevEnd;
+				all[merged++] = *cur;
+			}
+		} else {
+			all[merged++] = *cur;
+		}
+	}
+
+	for (indx = 0; indx < merged; indx++) {
+		if ((indx % kExtentCount) == 0) {
+			*tail = malloc(sizeof(ExtentList_t));
+			if (*tail == NULL) {
+				err(1, "cannot allocate a new ExtentList object");
+			}
+			(*tail)->count = 0;
+			(*tail)->next = NULL;
+		}
+		(*tail)->extents[(*tail)->count++] = all[indx];
+		byteCount += all[indx].length;
+		if ((*tail)->count == kExtentCount)
+			tail = &(*tail)->next;
+	}
+	free(all);
+
+	for (exts = vop->list;
+	     exts;
+	    ) {
+		ExtentList_t *next = exts->next;
+		free(exts);
+		exts = next;
+	}
+	vop->list = newList;
+	vop->count = merged;
+	vop->byteCount = byteCount;
+
+	if (verbose)
+		fprintf(stderr, "Merged %zu extents (%lld bytes) into %zu extents (%lld bytes)\n", oldCount, oldBytes, merged, byteCount);
+	return 0;
+}
+
 // Debugging function
 __private_extern__
 void
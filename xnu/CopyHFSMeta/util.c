@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <err.h>
 #include <errno.h>
+#include <aio.h>
 #include <sys/stat.h>
 #include <sys/disk.h>
 #include <sys/sysctl.h>
@@ -425,6 +426,34 @@ ScanAttrNode(VolumeObjects_t *vop, uint8_t *buffer, size_t nodeSize, extent_hand
 	return retval;
 }
 
+/*
+ * Stream the leaf nodes of a B-tree, calling func on each.  Returns -1
+ * if the leaf chain couldn't be followed, or missed leaves the header
+ * counts; otherwise *resultp is set to the last value returned by func
+ * (non-zero stops the walk).
+ */
+static int
+StreamOtherMetadata(VolumeObjects_t *vop, unsigned int fileID, const BTHeaderRec *header,
+		    int (*func)(VolumeObjects_t *, uint8_t *, size_t, extent_handler_t),
+		    extent_handler_t handler, int *resultp)
+{
+	Extents_t *map = NULL;
+	size_t mapCount = 0;
+	size_t nodeSize = S16(header->nodeSize);
+	__block int result = 0;
+	int rv;
+
+	if (GetForkExtentMap(vop, 0, fileID, &map, &mapCount) == -1)
+		return -1;
+	rv = StreamBTreeLeaves(vop->devp, map, mapCount, header, kBTreeStreamInFlight,
+			       ^(const uint8_t *nodePtr) {
+		result = (*func)(vop, (uint8_t *)nodePtr, nodeSize, handler);
+		return result;
+	});
+	free(map);
+	*resultp = result;
+	return (rv != 0 && result == 0) ? -1 : 0;
+}
 
 /*
  * Given a VolumeObject_t, search for the other metadata that
@@ -435,12 +464,21 @@ ScanAttrNode(VolumeObjects_t *vop, uint8_t *buffer, size_t nodeSize, extent_hand
  * former is going to be more efficient, but the latter will
  * mean the estimates and continuation will be less likely to
  * be wrong as we add extents to the list.
+ *
+ * The catalog and attributes B-trees are read by following their leaf
+ * chains with StreamBTreeLeaves().  If a chain can't be followed, or
+ * doesn't hold every leaf record the header counts (the B-tree is
+ * damaged, and some leaves may be orphaned), we fall back to looking at
+ * every node in that file's extents; the handler may then see some
+ * extents twice.
  */
 __private_extern__
 int
 FindOtherMetadata(VolumeObjects_t *vop, extent_handler_t handler)
 {
 	size_t catNodeSize = 0, attrNodeSize = 0;
+	BTHeaderRec catHeader = { 0 }, attrHeader = { 0 };
+	int catStreamed = 0, attrStreamed = 0;
 	off_t node0_location = 0;
 	uint8_t *tBuffer;
 	BTHeaderRec *hdp;
@@ -468,6 +506,7 @@ FindOtherMetadata(VolumeObjects_t *vop, extent_handler_t handler)
 			if (ndp->kind != kBTHeaderNode) {
 				warnx("Did not read header node for catalog as expected");
 			} else {
+				catHeader = *hdp;
 				catNodeSize = S16(hdp->nodeSize);
 			}
 		}
@@ -488,6 +527,7 @@ FindOtherMetadata(VolumeObjects_t *vop, extent_handler_t handler)
 			if (ndp->kind != kBTHeaderNode) {
 				warnx("Did not read header node for attributes file as expected");
 			} else {
+				attrHeader = *hdp;
 				attrNodeSize = S16(hdp->nodeSize);
 			}
 		}
@@ -495,8 +535,25 @@ FindOtherMetadata(VolumeObjects_t *vop, extent_handler_t handler)
 	if (debug)
 		fprintf(stderr, "Catalog node size = %zu, attributes node size = %zu\n", catNodeSize, attrNodeSize);
 
+	if (catNodeSize) {
+		if (StreamOtherMetadata(vop, kHFSCatalogFileID, &catHeader, ScanCatalogNode, handler, &retval) == 0)
+			catStreamed = 1;
+		else if (verbose)
+			warnx("Cannot stream the catalog leaf chain, scanning every node");
+		if (retval != 0)
+			goto done;
+	}
+	if (attrNodeSize) {
+		if (StreamOtherMetadata(vop, kHFSAttributesFileID, &attrHeader, ScanAttrNode, handler, &retval) == 0)
+			attrStreamed = 1;
+		else if (verbose)
+			warnx("Cannot stream the attributes leaf chain, scanning every node");
+		if (retval != 0)
+			goto done;
+	}
+
 	/*
-	 * We start reading the extents now.
+	 * Anything that couldn't be streamed, we read extent by extent now.
 	 *
 	 * This is a lot of duplicated code, unfortunately.
 	 */
@@ -512,6 +569,11 @@ FindOtherMetadata(VolumeObjects_t *vop, extent_handler_t handler)
 			off_t nread = 0;
 			if (exts->extents[indx].fid == 0) {
 				continue;	// Unknown file, skip
+			} else if ((exts->extents[indx].fid == kHFSCatalogFileID && catStreamed) ||
+				   (exts->extents[indx].fid == kHFSAttributesFileID && attrStreamed) ||
+				   (exts->extents[indx].fid != kHFSCatalogFileID &&
+				    exts->extents[indx].fid != kHFSAttributesFileID)) {
+				continue;	// Already done, or not a B-tree we look in
 			} else {
 				if (debug) fprintf(stderr, "%s:  fid = %u, start = %llu, len = %llu\n", __FUNCTION__, exts->extents[indx].fid, start, len);
 				while (nread < len) {
@@ -600,6 +662,332 @@ done:
 	return nread;
 }
 
+/*
+ * B-tree leaf streamer.
+ *
+ * StreamBTreeLeaves() walks the leaf chain of a B-tree file, calling
+ * the handler for each leaf node, until the handler returns non-zero or
+ * the chain ends.  The caller resolves the file's extent map up front
+ * (see GetForkExtentMap()), so a node number is mapped to a device
+ * offset without going back to the extent records.
+ *
+ * Following fLink misses any leaf that a damaged B-tree no longer links
+ * in.  So when the whole chain is walked, its record count and last node
+ * are checked against the header; if they differ, we warn and return 1,
+ * and the caller can fall back to reading every node.
+ *
+ * Nodes are read kBTreeStreamBatchSize bytes at a time:  a read covers
+ * the node wanted and the nodes after it, up to the end of the extent,
+ * since leaf nodes are mostly allocated in ascending order.  Up to
+ * inFlight further batches are read ahead with aio.  When the chain
+ * jumps outside the batches we have, we read the batch starting at the
+ * new node, and read ahead from there.
+ */
+enum {
+	kBTreeStreamBatchSize = 1024 * 1024,
+};
+
+struct BTreeBatch {
+	struct aiocb cb;
+	uint8_t *buffer;
+	size_t skew;		// Bytes in the buffer before the first node
+	size_t needed;		// Bytes the read must return
+	uint32_t firstNode;
+	uint32_t nodeCount;	// 0 if the slot is unused
+	int pending;		// The aio is still outstanding
+	int error;
+};
+
+struct BTreeStream {
+	DeviceInfo_t *devp;
+	const Extents_t *map;
+	size_t mapCount;
+	size_t nodeSize;
+	uint32_t totalNodes;
+	uint32_t batchNodes;
+	uint32_t nextAhead;	// First node not yet read or scheduled
+	size_t batchCount;
+	struct BTreeBatch *batches;
+	uint8_t *straddle;	// For a node that spans two extents
+};
+
+/*
+ * Find where a byte of the file is on the device, and how many bytes
+ * of the file follow it contiguously.  Returns -1 if it's past the end.
+ */
+static int
+BTreeFileLocation(struct BTreeStream *sp, off_t fileOffset, off_t *offsetp, off_t *contigp)
+{
+	off_t base = 0;
+	size_t i;
+
+	for (i = 0; i < sp->mapCount; i++) {
+		if (fileOffset < base + sp->map[i].length) {
+			*offsetp = sp->map[i].base + (fileOffset - base);
+			*contigp = base + sp->map[i].length - fileOffset;
+			return 0;
+		}
+		base += sp->map[i].length;
+	}
+	return -1;
+}
+
+static void
+BTreeBatchWait(struct BTreeBatch *bp)
+{
+	const struct aiocb *list[1] = { &bp->cb };
+	ssize_t rv;
+
+	if (!bp->pending)
+		return;
+	while (aio_error(&bp->cb) == EINPROGRESS)
+		(void)aio_suspend(list, 1, NULL);
+	rv = aio_return(&bp->cb);
+	bp->pending = 0;
+	if (rv < (ssize_t)bp->needed) {
+		if (rv == -1)
+			warn("Cannot read B-tree nodes at offset %lld", (long long)bp->cb.aio_offset);
+		else
+			warnx("Short read of B-tree nodes at offset %lld", (long long)bp->cb.aio_offset);
+		bp->error = 1;
+	}
+}
+
+/*
+ * Start reading the batch of nodes at node into bp.  If async is 0, or
+ * aio isn't available, the read is done before returning.  Returns the
+ * number of nodes in the batch, or 0 if node can't start a batch (it
+ * spans extents, or is past the end of the file).
+ */
+static uint32_t
+BTreeBatchStart(struct BTreeStream *sp, struct BTreeBatch *bp, uint32_t node, int async)
+{
+	size_t devBlockSize = sp->devp->blockSize;
+	off_t offset, contig, aligned;
+	uint32_t count;
+
+	BTreeBatchWait(bp);
+	bp->nodeCount = 0;
+	bp->error = 0;
+
+	if (BTreeFileLocation(sp, (off_t)node * sp->nodeSize, &offset, &contig) == -1)
+		return 0;
+	count = (uint32_t)MIN((off_t)sp->batchNodes, contig / (off_t)sp->nodeSize);
+	count = MIN(count, sp->totalNodes - node);
+	if (count == 0)
+		return 0;
+
+	aligned = (offset / devBlockSize) * devBlockSize;
+	bp->skew = offset - aligned;
+	bp->needed = bp->skew + count * sp->nodeSize;
+	bp->firstNode = node;
+	bp->nodeCount = count;
+
+	memset(&bp->cb, 0, sizeof(bp->cb));
+	bp->cb.aio_fildes = sp->devp->fd;
+	bp->cb.aio_offset = aligned;
+	bp->cb.aio_buf = bp->buffer;
+	bp->cb.aio_nbytes = ((bp->needed + devBlockSize - 1) / devBlockSize) * devBlockSize;
+
+	if (async && aio_read(&bp->cb) == 0) {
+		bp->pending = 1;
+	} else {
+		ssize_t rv = pread(sp->devp->fd, bp->buffer, bp->cb.aio_nbytes, aligned);
+		if (rv < (ssize_t)bp->needed) {
+			if (rv == -1)
+				warn("Cannot read B-tree nodes at offset %lld", (long long)aligned);
+			else
+				warnx("Short read of B-tree nodes at offset %lld", (long long)aligned);
+			bp->error = 1;
+		}
+	}
+	return count;
+}
+
+/*
+ * Keep the free slots busy reading ahead of current.  A slot is free
+ * if it is unused, or if its nodes are all behind current.
+ */
+static void
+BTreeStreamReadAhead(struct BTreeStream *sp, uint32_t current)
+{
+	size_t i;
+
+	for (i = 0; i < sp->batchCount && sp->nextAhead < sp->totalNodes; i++) {
+		struct BTreeBatch *bp = &sp->batches[i];
+		uint32_t count;
+
+		if (bp->nodeCount != 0 && bp->firstNode + bp->nodeCount > current)
+			continue;
+		count = BTreeBatchStart(sp, bp, sp->nextAhead, 1);
+		sp->nextAhead += count ? count : 1;	// Skip a node that spans extents
+	}
+}
+
+/*
+ * Read a node that spans two (or more) extents, a piece at a time.
+ */
+static const uint8_t *
+BTreeReadStraddle(struct BTreeStream *sp, uint32_t node)
+{
+	off_t fileOffset = (off_t)node * sp->nodeSize;
+	size_t done = 0;
+
+	while (done < sp->nodeSize) {
+		off_t offset, contig;
+		size_t amt;
+
+		if (BTreeFileLocation(sp, fileOffset + done, &offset, &contig) == -1)
+			return NULL;
+		amt = (size_t)MIN((off_t)(sp->nodeSize - done), contig);
+		if (UnalignedRead(sp->devp, sp->straddle + done, amt, offset) != (ssize_t)amt) {
+			warn("Cannot read B-tree node %u", node);
+			return NULL;
+		}
+		done += amt;
+	}
+	return sp->straddle;
+}
+
+static const uint8_t *
+BTreeStreamGetNode(struct BTreeStream *sp, uint32_t node)
+{
+	struct BTreeBatch *bp = NULL;
+	size_t i;
+
+	for (i = 0; i < sp->batchCount; i++) {
+		if (sp->batches[i].nodeCount != 0 &&
+		    node >= sp->batches[i].firstNode &&
+		    node < sp->batches[i].firstNode + sp->batches[i].nodeCount) {
+			bp = &sp->batches[i];
+			break;
+		}
+	}
+
+	if (bp == NULL) {
+		uint32_t count;
+
+		/* Out of sequence; what we read ahead is no use now */
+		for (i = 0; i < sp->batchCount; i++) {
+			BTreeBatchWait(&sp->batches[i]);
+			sp->batches[i].nodeCount = 0;
+		}
+		bp = &sp->batches[0];
+		count = BTreeBatchStart(sp, bp, node, 0);
+		if (count == 0) {
+			sp->nextAhead = node + 1;
+			BTreeStreamReadAhead(sp, node);
+			return BTreeReadStraddle(sp, node);
+		}
+		sp->nextAhead = node + count;
+	} else {
+		BTreeBatchWait(bp);
+	}
+	BTreeStreamReadAhead(sp, node);
+
+	if (bp->error)
+		return NULL;
+	return bp->buffer + bp->skew + (size_t)(node - bp->firstNode) * sp->nodeSize;
+}
+
+__private_extern__
+int
+StreamBTreeLeaves(DeviceInfo_t *devp, const Extents_t *map, size_t mapCount, const BTHeaderRec *header, unsigned int inFlight, btree_leaf_handler_t handler)
+{
+	struct BTreeStream stream = { 0 };
+	size_t nodeSize = S16(header->nodeSize);
+	off_t fileSize = 0;
+	uint32_t node = S32(header->firstLeafNode);
+	uint32_t visited = 0;
+	uint32_t lastLeaf = 0;
+	uint32_t records = 0;
+	int stopped = 0;
+	size_t bufSize;
+	size_t i;
+	int retval = 0;
+
+	if (nodeSize < sizeof(BTNodeDescriptor)) {
+		warnx("Invalid B-tree node size %zu", nodeSize);
+		return -1;
+	}
+	for (i = 0; i < mapCount; i++)
+		fileSize += map[i].length;
+
+	stream.devp = devp;
+	stream.map = map;
+	stream.mapCount = mapCount;
+	stream.nodeSize = nodeSize;
+	stream.totalNodes = (uint32_t)(fileSize / nodeSize);
+	stream.batchNodes = (uint32_t)MAX((size_t)1, kBTreeStreamBatchSize / nodeSize);
+	stream.batchCount = inFlight + 1;
+	stream.batches = calloc(stream.batchCount, sizeof(*stream.batches));
+	stream.straddle = malloc(nodeSize);
+	if (stream.batches == NULL || stream.straddle == NULL) {
+		warn("Cannot allocate B-tree stream");
+		retval = -1;
+		goto done;
+	}
+	// Room for rounding the read out to device blocks at both ends
+	bufSize = stream.batchNodes * nodeSize + 2 * devp->blockSize;
+	for (i = 0; i < stream.batchCount; i++) {
+		stream.batches[i].buffer = malloc(bufSize);
+		if (stream.batches[i].buffer == NULL) {
+			warn("Cannot allocate %zu bytes for B-tree stream", bufSize);
+			retval = -1;
+			goto done;
+		}
+	}
+
+	while (node != 0) {
+		const uint8_t *nodePtr;
+		const BTNodeDescriptor *descp;
+		uint32_t next;
+
+		if (node >= stream.totalNodes || ++visited > stream.totalNodes) {
+			warnx("B-tree leaf chain is damaged at node %u", node);
+			retval = -1;
+			break;
+		}
+		nodePtr = BTreeStreamGetNode(&stream, node);
+		if (nodePtr == NULL) {
+			retval = -1;
+			break;
+		}
+		descp = (const BTNodeDescriptor *)nodePtr;
+		if (descp->kind != kBTLeafNode) {
+			warnx("B-tree node %u in the leaf chain is not a leaf node (%d)", node, descp->kind);
+			retval = -1;
+			break;
+		}
+		next = S32(descp->fLink);
+		lastLeaf = node;
+		records += S16(descp->numRecords);
+		if (handler(nodePtr) != 0) {
+			stopped = 1;
+			break;
+		}
+		node = next;
+	}
+
+	if (retval == 0 && !stopped &&
+	    (records != S32(header->leafRecords) || lastLeaf != S32(header->lastLeafNode))) {
+		warnx("B-tree leaf chain has %u records ending at node %u, but the header has %u ending at node %u",
+		      records, lastLeaf, S32(header->leafRecords), S32(header->lastLeafNode));
+		retval = 1;
+	}
+
+done:
+	if (stream.batches) {
+		for (i = 0; i < stream.batchCount; i++) {
+			BTreeBatchWait(&stream.batches[i]);
+			free(stream.batches[i].buffer);
+		}
+		free(stream.batches);
+	}
+	free(stream.straddle);
+	return retval;
+}
+
 __private_extern__
 void
 ReleaseDeviceInfo(DeviceInfo_t *devp)
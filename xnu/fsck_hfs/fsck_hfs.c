@@ -170,7 +170,7 @@ int main(int argc, char *argv[])
         fsck_set_progname(*argv);
     }
     
-	while ((ch = getopt(argc, argv, "b:B:c:D:e:Edfglm:npqrR:SuyxJ")) != EOF) {
+	while ((ch = getopt(argc, argv, "b:B:c:D:e:Edfglm:npPqrR:SuyxJ")) != EOF) {
 		switch (ch) {
 		case 'b':
             blockSize = atoi(optarg);
@@ -270,6 +270,9 @@ int main(int argc, char *argv[])
         break;
 		case 'p':
             fsck_set_preen(1);
+            break;
+		case 'P':
+            fsck_set_parallel(1);
             break;
 		case 'q':
             fsck_set_quick(1);
@@ -586,7 +589,7 @@ cleanup_fs_fd(void)
 static void
 usage(void)
 {
-	fsck_print(LOG_TYPE_STDERR, "usage: %s [-b [size] B [path] c [size] e [mode] ESdfglx m [mode] npqruy] special-device\n", fsck_get_progname());
+	fsck_print(LOG_TYPE_STDERR, "usage: %s [-b [size] B [path] c [size] e [mode] ESdfglx m [mode] npPqruy] special-device\n", fsck_get_progname());
 	fsck_print(LOG_TYPE_STDERR, "  b size = size of physical blocks (in bytes) for -B option\n");
 	fsck_print(LOG_TYPE_STDERR, "  B path = file containing physical block numbers to map to paths\n");
 	fsck_print(LOG_TYPE_STDERR, "  c size = cache size (ex. 512m, 1g)\n");
@@ -600,6 +603,7 @@ usage(void)
 	fsck_print(LOG_TYPE_STDERR, "  m arg = octal mode used when creating lost+found directory \n");
 	fsck_print(LOG_TYPE_STDERR, "  n = assume a no response \n");
 	fsck_print(LOG_TYPE_STDERR, "  p = just fix normal inconsistencies \n");
+	fsck_print(LOG_TYPE_STDERR, "  P = check the attributes B-tree on a second thread\n");
 	fsck_print(LOG_TYPE_STDERR, "  q = quick check returns clean, dirty, or failure \n");
 	fsck_print(LOG_TYPE_STDERR, "  r = rebuild catalog btree \n");
 	fsck_print(LOG_TYPE_STDERR, "  S = Scan disk for bad blocks\n");
@@ -55,6 +55,27 @@ void *CacheAllocBlock (Cache_t *cache);
 static int 
 CacheFreeBlock( Cache_t *cache, Tag_t *tag );
 
+/*
+ * CacheReadLocked, CacheWriteLocked, CacheReleaseLocked, CacheFlushLocked
+ *
+ *  The bodies of the exported routines; called with cache->Lock held.
+ */
+static int CacheReadLocked (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp);
+static int CacheWriteLocked (Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions);
+static int CacheReleaseLocked (Cache_t *cache, Buf_t *buf, int age);
+static int CacheFlushLocked (Cache_t *cache);
+
+/*
+ * CacheHash
+ *
+ *  Hash bucket of the cache block at the given offset.  Consecutive blocks
+ *  go to consecutive buckets.
+ */
+static inline uint32_t CacheHash (Cache_t *cache, uint64_t off)
+{
+	return ((uint32_t)((off / cache->BlockSize) % cache->HashSize));
+}
+
 /*
  * CacheLookup
  *
@@ -63,6 +84,27 @@ CacheFreeBlock( Cache_t *cache, Tag_t *tag );
  */
 int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag);
 
+/*
+ * CachePrefetchThread
+ *
+ *  Services the ranges queued by CachePrefetch.
+ */
+static void *CachePrefetchThread (void *arg);
+
+/*
+ * CachePrefetchRange
+ *
+ *  Reads the pages of a range that are not in the cache.
+ */
+static void CachePrefetchRange (Cache_t *cache, uint64_t off, uint64_t len);
+
+/*
+ * CachePrefetchDrain
+ *
+ *  Drops the queued prefetch ranges and waits for the one in progress.
+ */
+static void CachePrefetchDrain (Cache_t *cache);
+
 /*
  * CacheRawRead
  *
@@ -202,12 +244,13 @@ int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
 	
 	memset (cache, 0x00, sizeof (Cache_t));
 
+	pthread_mutex_init (&cache->Lock, NULL);
+	pthread_cond_init (&cache->ReadDone, NULL);
+	pthread_cond_init (&cache->PrefetchWork, NULL);
+
 	cache->FD_R = fdRead;
 	cache->FD_W = fdWrite;
 	cache->DevBlockSize = devBlockSize;
-	/* CacheFlush requires cleared cache->Hash  */
-	cache->Hash = (Tag_t **) calloc( 1, (sizeof (Tag_t *) * hashSize) );
-	cache->HashSize = hashSize;
 	cache->BlockSize = cacheBlockSize;
 
 	/* Allocate the cache memory */
@@ -247,6 +290,23 @@ int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
 		return (ENOMEM);
 	}
 
+	/*
+	 * Size the hash table to the cache: with one bucket per cache block
+	 * the chains stay short however large the cache is.
+	 */
+	if (hashSize < cacheTotalBlocks)
+		hashSize = cacheTotalBlocks;
+
+	/* CacheFlush requires cleared cache->Hash  */
+	cache->Hash = (Tag_t **) calloc( 1, (sizeof (Tag_t *) * hashSize) );
+	if (cache->Hash == NULL) {
+#if CACHE_DEBUG
+		fsck_print(ctx, LOG_TYPE_INFO, "%s(%d):  calloc(%u buckets) failed\n", __FUNCTION__, __LINE__, hashSize);
+#endif
+		return (ENOMEM);
+	}
+	cache->HashSize = hashSize;
+
 
 	/* If necessary, touch a byte in each page */
 	if (preTouch) {
@@ -299,19 +359,19 @@ int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
  */
 int CacheDestroy (Cache_t *cache)
 {
+	CacheStopPrefetch (cache);
 	CacheFlush( cache );
 
 #if CACHE_DEBUG
 	/* Print cache report */
-	fsck_print(ctx, LOG_TYPE_INFO, "Cache Report:\n");
-	fsck_print(ctx, LOG_TYPE_INFO, "\tRead Requests:  %d\n", cache->ReqRead);
-	fsck_print(ctx, LOG_TYPE_INFO, "\tWrite Requests: %d\n", cache->ReqWrite);
-	fsck_print(ctx, LOG_TYPE_INFO, "\tDisk Reads:     %d\n", cache->DiskRead);
-	fsck_print(ctx, LOG_TYPE_INFO, "\tDisk Writes:    %d\n", cache->DiskWrite);
-	fsck_print(ctx, LOG_TYPE_INFO, "\tSpans:          %d\n", cache->Span);
+	CachePrintStats (cache);
 #endif	
 	/* Shutdown the LRU */
 	LRUDestroy (&cache->LRU);
+
+	pthread_cond_destroy (&cache->PrefetchWork);
+	pthread_cond_destroy (&cache->ReadDone);
+	pthread_mutex_destroy (&cache->Lock);
 	
 	/* I'm lazy, I'll come back to it :P */
 	return (EOK);
@@ -328,6 +388,17 @@ int CacheDestroy (Cache_t *cache)
  *        the returned buffer, except that it is contiguous.
  */
 int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
+{
+	int error;
+
+	pthread_mutex_lock (&cache->Lock);
+	error = CacheReadLocked (cache, off, len, bufp);
+	pthread_mutex_unlock (&cache->Lock);
+
+	return (error);
+}
+
+static int CacheReadLocked (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 {
 	Tag_t *		tag;
 	Buf_t *		searchBuf;
@@ -503,6 +574,17 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
  *  Writes a buffer through the cache.
  */
 int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
+{
+	int error;
+
+	pthread_mutex_lock (&cache->Lock);
+	error = CacheWriteLocked (cache, buf, age, writeOptions);
+	pthread_mutex_unlock (&cache->Lock);
+
+	return (error);
+}
+
+static int CacheWriteLocked ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 {
 	Tag_t *		tag;
 	uint32_t	coff = (buf->Offset % cache->BlockSize);
@@ -643,6 +725,17 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
  *  NOTE: We don't verify whether it's dirty or not.
  */
 int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
+{
+	int error;
+
+	pthread_mutex_lock (&cache->Lock);
+	error = CacheReleaseLocked (cache, buf, age);
+	pthread_mutex_unlock (&cache->Lock);
+
+	return (error);
+}
+
+static int CacheReleaseLocked (Cache_t *cache, Buf_t *buf, int age)
 {
 	Tag_t *		tag;
 	uint32_t	coff = (buf->Offset % cache->BlockSize);
@@ -741,11 +834,11 @@ int CacheRemove (Cache_t *cache, Tag_t *tag)
 	if (tag->Prev != NULL)
 		tag->Prev->Next = tag->Next;
 	else
-		cache->Hash[tag->Offset % cache->HashSize] = tag->Next;
+		cache->Hash[CacheHash (cache, tag->Offset)] = tag->Next;
 	
 	/* Make sure the head node doesn't have a back pointer */
-	if ((cache->Hash[tag->Offset % cache->HashSize] != NULL) &&
-	    (cache->Hash[tag->Offset % cache->HashSize]->Prev != NULL)) {
+	if ((cache->Hash[CacheHash (cache, tag->Offset)] != NULL) &&
+	    (cache->Hash[CacheHash (cache, tag->Offset)]->Prev != NULL)) {
 #if CACHE_DEBUG
 		fsck_print(ctx, LOG_TYPE_INFO, "ERROR: CacheRemove: Corrupt hash chain\n");
 #endif
@@ -754,6 +847,9 @@ int CacheRemove (Cache_t *cache, Tag_t *tag)
 	/* Release it's buffer (if it has one) */
 	if (tag->Buffer != NULL)
 	{
+		if (tag->Flags & kPrefetched)
+			cache->PrefetchWasted++;
+
 		error = CacheFreeBlock (cache, tag);
 		if ( EOK != error )
 			return( error );
@@ -788,6 +884,10 @@ int CacheEvict (Cache_t *cache, Tag_t *tag)
 			return( error );
 	}
 	tag->Buffer = NULL;
+	if (tag->Flags & kPrefetched) {
+		cache->PrefetchWasted++;
+		tag->Flags &= ~kPrefetched;
+	}
 
 	return (EOK);
 }
@@ -857,6 +957,18 @@ CacheFreeBlock( Cache_t *cache, Tag_t *tag )
  */
 int 
 CacheFlush( Cache_t *cache )
+{
+	int error;
+
+	pthread_mutex_lock (&cache->Lock);
+	error = CacheFlushLocked (cache);
+	pthread_mutex_unlock (&cache->Lock);
+
+	return (error);
+}
+
+static int
+CacheFlushLocked( Cache_t *cache )
 {
 	int			error;
 	int			i;
@@ -1005,6 +1117,9 @@ int CacheCopyDiskBlocks (Cache_t *cache, uint64_t from_offset, uint64_t to_offse
 	uint32_t ioReqCount;
 	uint32_t numberOfBuffersToWrite;
 
+	pthread_mutex_lock (&cache->Lock);
+	CachePrefetchDrain (cache);
+
 	/* Return error if length of data to be written on disk is
 	 * less than the length of the buffer to be written, or
 	 * disk offsets are not multiple of device block size
@@ -1063,6 +1178,7 @@ int CacheCopyDiskBlocks (Cache_t *cache, uint64_t from_offset, uint64_t to_offse
 	}
 
 out:
+	pthread_mutex_unlock (&cache->Lock);
 	if (tmpBuffer) {
 		free (tmpBuffer);
 	}
@@ -1115,6 +1231,9 @@ int CacheWriteBufferToDisk (Cache_t *cache, uint64_t offset, uint32_t write_len,
 	uint32_t bytes_remain;
 	uint8_t zero_fill = false;
 
+	pthread_mutex_lock (&cache->Lock);
+	CachePrefetchDrain (cache);
+
 	/* Check if buffer is provided */
 	if (buffer == NULL) {
 		buf_len = 0;
@@ -1206,6 +1325,7 @@ int CacheWriteBufferToDisk (Cache_t *cache, uint64_t offset, uint32_t write_len,
 	}
 
 out:
+	pthread_mutex_unlock (&cache->Lock);
 	/* If we allocated a temporary buffer, deallocate it */
 	if (write_buffer != NULL) {
 		free (write_buffer);
@@ -1218,15 +1338,19 @@ out:
  *
  *  Obtain a cache block. If one already exists, it is returned. Otherwise a
  *  new one is created and inserted into the cache.
+ *
+ *  Called with cache->Lock held.  The lock is dropped while a missing block
+ *  is read from disk.
  */
 int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
 {
 	Tag_t *		temp;
-	uint32_t	hash = off % cache->HashSize;
+	uint32_t	hash = CacheHash (cache, off);
 	int			error;
 
 	*tag = NULL;
 	
+again:
 	/* Search the hash table */
 	error = 0;
 	temp = cache->Hash[hash];
@@ -1235,7 +1359,23 @@ int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
 		temp = temp->Next;
 	}
 
+	/* Another thread is loading this block; wait for it and look again */
+	if (temp != NULL && (temp->Flags & kReadPending)) {
+		pthread_cond_wait (&cache->ReadDone, &cache->Lock);
+		goto again;
+	}
+
 	/* If it's a hit */
+	if (temp != NULL && temp->Buffer != NULL) {
+		cache->Hits++;
+		if (temp->Flags & kPrefetched) {
+			temp->Flags &= ~kPrefetched;
+			cache->PrefetchUsed++;
+		}
+	} else {
+		cache->Misses++;
+	}
+
 	if (temp != NULL) {
 		/* Perform MTF if necessary */
 		if (cache->Hash[hash] != temp) {
@@ -1284,9 +1424,25 @@ int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
 			}
 		}
 
-		/* Load the block from disk */
+		/*
+		 * Load the block from disk.  The tag is marked pending and
+		 * referenced so that it is neither evicted nor handed out
+		 * while the lock is dropped.
+		 */
+		temp->Flags |= kReadPending;
+		temp->Refs++;
+		pthread_mutex_unlock (&cache->Lock);
 		error = CacheRawRead (cache, off, cache->BlockSize, temp->Buffer);
-		if (error != EOK) return (error);
+		pthread_mutex_lock (&cache->Lock);
+		temp->Refs--;
+		temp->Flags &= ~kReadPending;
+		pthread_cond_broadcast (&cache->ReadDone);
+		if (error != EOK) {
+			/* Don't leave a block of garbage behind for the next lookup */
+			(void) CacheFreeBlock (cache, temp);
+			temp->Buffer = NULL;
+			return (error);
+		}
 	}
 
 #if 0
@@ -1306,29 +1462,25 @@ int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
  */
 int CacheRawRead (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
 {
-	uint64_t	result;
 	ssize_t		nread;
 		
 	/* Both offset and length must be multiples of the device block size */
 	if (off % cache->DevBlockSize) return (EINVAL);
 	if (len % cache->DevBlockSize) return (EINVAL);
 	
-	/* Seek to the position */
-	errno = 0;
-	result = lseek (cache->FD_R, off, SEEK_SET);
-	if (result == (off_t)-1 && errno != 0)
-		return errno;
-	if (result != off) return (ENXIO);
-	/* Read into the buffer */
+	/*
+	 * Read into the buffer.  pread() leaves the file offset alone, so
+	 * reads issued by CacheLookup with the cache lock dropped don't race.
+	 */
 #if CACHE_DEBUG
 	fsck_print(ctx, LOG_TYPE_INFO, "%s:  offset %llu, len %u\n", __FUNCTION__, off, len);
 #endif
-	nread = read (cache->FD_R, buf, len);
+	nread = pread (cache->FD_R, buf, len, off);
 	if (nread == -1) return (errno);
 	if (nread == 0) return (ENXIO);
 
 	/* Update counters */
-	cache->DiskRead++;
+	__atomic_add_fetch (&cache->DiskRead, 1, __ATOMIC_RELAXED);
 	
 	return (EOK);
 }
@@ -1365,6 +1517,261 @@ int CacheRawWrite (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
 }
 
 
+/*
+ * CachePrefetch
+ *
+ *  Queues a range for the prefetch thread, starting the thread on first use.
+ */
+int CachePrefetch (Cache_t *cache, uint64_t off, uint64_t len)
+{
+	uint32_t	slot;
+	int			error = EOK;
+
+	if (len == 0) return (EOK);
+
+	pthread_mutex_lock (&cache->Lock);
+
+	if (!cache->PrefetchRunning) {
+		cache->PrefetchStop = 0;
+		error = pthread_create (&cache->PrefetchThread, NULL, CachePrefetchThread, cache);
+		if (error != 0) {
+			pthread_mutex_unlock (&cache->Lock);
+			return (error);
+		}
+		cache->PrefetchRunning = 1;
+	}
+
+	/* It's only a hint; if the prefetcher is that far behind, drop it */
+	if (cache->PrefetchCount == CachePrefetchQueueSize) {
+		cache->PrefetchDropped++;
+	} else {
+		slot = (cache->PrefetchHead + cache->PrefetchCount) % CachePrefetchQueueSize;
+		cache->PrefetchQueue[slot].Offset = off;
+		cache->PrefetchQueue[slot].Length = len;
+		cache->PrefetchCount++;
+		pthread_cond_signal (&cache->PrefetchWork);
+	}
+
+	pthread_mutex_unlock (&cache->Lock);
+	return (EOK);
+}
+
+/*
+ * CacheStopPrefetch
+ *
+ *  Stops the prefetch thread, if it was started.  Queued ranges are dropped.
+ */
+void CacheStopPrefetch (Cache_t *cache)
+{
+	if (!cache->PrefetchRunning)
+		return;
+
+	pthread_mutex_lock (&cache->Lock);
+	cache->PrefetchStop = 1;
+	cache->PrefetchCount = 0;
+	pthread_cond_signal (&cache->PrefetchWork);
+	pthread_mutex_unlock (&cache->Lock);
+
+	pthread_join (cache->PrefetchThread, NULL);
+	cache->PrefetchRunning = 0;
+}
+
+/*
+ * CachePrefetchThread
+ *
+ *  Services the ranges queued by CachePrefetch.
+ */
+static void *CachePrefetchThread (void *arg)
+{
+	Cache_t *	cache = (Cache_t *)arg;
+	uint64_t	off;
+	uint64_t	len;
+
+	pthread_mutex_lock (&cache->Lock);
+	while (!cache->PrefetchStop) {
+		if (cache->PrefetchCount == 0) {
+			pthread_cond_wait (&cache->PrefetchWork, &cache->Lock);
+			continue;
+		}
+
+		off = cache->PrefetchQueue[cache->PrefetchHead].Offset;
+		len = cache->PrefetchQueue[cache->PrefetchHead].Length;
+		cache->PrefetchHead = (cache->PrefetchHead + 1) % CachePrefetchQueueSize;
+		cache->PrefetchCount--;
+
+		cache->PrefetchBusy = 1;
+		CachePrefetchRange (cache, off, len);
+		cache->PrefetchBusy = 0;
+		pthread_cond_broadcast (&cache->ReadDone);
+	}
+	pthread_mutex_unlock (&cache->Lock);
+
+	return (NULL);
+}
+
+/*
+ * CachePrefetchRange
+ *
+ *  Reads the pages of a range that are not in the cache.  Runs of missing
+ *  pages are read with one preadv() of up to CachePrefetchMaxBlocks pages.
+ *  The pages are marked kReadPending while the read is in flight, so a
+ *  CacheLookup of one of them waits for the data instead of reading it
+ *  again.  Prefetching stops, rather than evicting pages in use, once the
+ *  cache runs out of unreferenced pages.
+ *
+ *  Called with cache->Lock held.  The lock is dropped during the reads.
+ */
+static void CachePrefetchRange (Cache_t *cache, uint64_t off, uint64_t len)
+{
+	Tag_t *			tags[CachePrefetchMaxBlocks];
+	struct iovec	iov[CachePrefetchMaxBlocks];
+	Tag_t *			temp;
+	void *			buffer;
+	uint64_t		cur;
+	uint64_t		end;
+	uint64_t		start;
+	uint32_t		hash;
+	ssize_t			nread;
+	int				count;
+	int				full = 0;
+	int				i;
+
+	cur = off - (off % cache->BlockSize);
+	end = off + len;
+
+	while (cur < end && !full && !cache->PrefetchStop) {
+		/* Gather a run of pages that are not in the cache */
+		count = 0;
+		start = cur;
+		while (cur < end && count < CachePrefetchMaxBlocks) {
+			hash = CacheHash (cache, cur);
+			for (temp = cache->Hash[hash]; temp != NULL; temp = temp->Next)
+				if (temp->Offset == cur) break;
+
+			/* Cached or being read: end the run here */
+			if (temp != NULL && (temp->Buffer != NULL || (temp->Flags & kReadPending)))
+				break;
+
+			buffer = CacheAllocBlock (cache);
+			if (buffer == NULL) {
+				if (LRUEvict (&cache->LRU, NULL) == EOK)
+					buffer = CacheAllocBlock (cache);
+				if (buffer == NULL) {
+					full = 1;
+					break;
+				}
+
+				/* The eviction may have freed the tag we found */
+				for (temp = cache->Hash[hash]; temp != NULL; temp = temp->Next)
+					if (temp->Offset == cur) break;
+			}
+
+			if (temp == NULL) {
+				temp = (Tag_t *)calloc (sizeof (Tag_t), 1);
+				if (temp == NULL) {
+					*((void **)buffer) = cache->FreeHead;
+					cache->FreeHead = (void **)buffer;
+					cache->FreeSize++;
+					full = 1;
+					break;
+				}
+				temp->Offset = cur;
+				temp->Next = cache->Hash[hash];
+				if (temp->Next != NULL)
+					temp->Next->Prev = temp;
+				cache->Hash[hash] = temp;
+			}
+
+			temp->Buffer = buffer;
+			temp->Flags |= kReadPending | kPrefetched;
+			temp->Refs++;
+
+			tags[count] = temp;
+			iov[count].iov_base = buffer;
+			iov[count].iov_len = cache->BlockSize;
+			count++;
+			cur += cache->BlockSize;
+		}
+
+		if (count == 0) {
+			/* Skip the page that ended the run */
+			if (!full)
+				cur += cache->BlockSize;
+			continue;
+		}
+
+		pthread_mutex_unlock (&cache->Lock);
+#if CACHE_DEBUG
+		fsck_print(ctx, LOG_TYPE_INFO, "%s:  offset %llu, %d pages\n", __FUNCTION__, start, count);
+#endif
+		nread = preadv (cache->FD_R, iov, count, start);
+		pthread_mutex_lock (&cache->Lock);
+
+		cache->PrefetchReads++;
+		__atomic_add_fetch (&cache->DiskRead, 1, __ATOMIC_RELAXED);
+
+		for (i = 0; i < count; i++) {
+			temp = tags[i];
+			temp->Refs--;
+			temp->Flags &= ~kReadPending;
+
+			/* A short read leaves the page for CacheLookup to read itself */
+			if (nread < (ssize_t)((i + 1) * cache->BlockSize)) {
+				temp->Flags &= ~kPrefetched;
+				(void) CacheFreeBlock (cache, temp);
+				temp->Buffer = NULL;
+			} else {
+				cache->PrefetchBlocks++;
+			}
+			LRUHit (&cache->LRU, (LRUNode_t *)temp, 0);
+		}
+		pthread_cond_broadcast (&cache->ReadDone);
+	}
+}
+
+/*
+ * CachePrefetchDrain
+ *
+ *  Drops the queued prefetch ranges and waits for the one in progress, so
+ *  that a range written around the cache isn't read back stale.
+ *
+ *  Called with cache->Lock held.
+ */
+static void CachePrefetchDrain (Cache_t *cache)
+{
+	cache->PrefetchCount = 0;
+	while (cache->PrefetchBusy)
+		pthread_cond_wait (&cache->ReadDone, &cache->Lock);
+}
+
+/*
+ * CachePrintStats
+ *
+ *  Prints the request, hit/miss and prefetch counters.
+ */
+void CachePrintStats (Cache_t *cache)
+{
+	uint32_t	lookups;
+
+	pthread_mutex_lock (&cache->Lock);
+	lookups = cache->Hits + cache->Misses;
+
+	fsck_print(ctx, LOG_TYPE_INFO, "Cache Report:\n");
+	fsck_print(ctx, LOG_TYPE_INFO, "\tRead Requests:  %u\n", cache->ReqRead);
+	fsck_print(ctx, LOG_TYPE_INFO, "\tWrite Requests: %u\n", cache->ReqWrite);
+	fsck_print(ctx, LOG_TYPE_INFO, "\tHits:           %u (%u%%)\n", cache->Hits,
+	       lookups ? (uint32_t)((uint64_t)cache->Hits * 100 / lookups) : 0);
+	fsck_print(ctx, LOG_TYPE_INFO, "\tMisses:         %u\n", cache->Misses);
+	fsck_print(ctx, LOG_TYPE_INFO, "\tDisk Reads:     %u\n", cache->DiskRead);
+	fsck_print(ctx, LOG_TYPE_INFO, "\tDisk Writes:    %u\n", cache->DiskWrite);
+	fsck_print(ctx, LOG_TYPE_INFO, "\tSpans:          %u\n", cache->Span);
+	fsck_print(ctx, LOG_TYPE_INFO, "\tPrefetch Reads: %u (%u pages)\n", cache->PrefetchReads, cache->PrefetchBlocks);
+	fsck_print(ctx, LOG_TYPE_INFO, "\tPrefetch Used:  %u (%u%%)\n", cache->PrefetchUsed,
+	       cache->PrefetchBlocks ? (uint32_t)((uint64_t)cache->PrefetchUsed * 100 / cache->PrefetchBlocks) : 0);
+	fsck_print(ctx, LOG_TYPE_INFO, "\tPrefetch Wasted: %u\n", cache->PrefetchWasted);
+	fsck_print(ctx, LOG_TYPE_INFO, "\tPrefetch Dropped: %u\n", cache->PrefetchDropped);
+	pthread_mutex_unlock (&cache->Lock);
+}
 
 /*
  * LRUInit
@@ -29,6 +29,7 @@
 #ifndef _CACHE_H_
 #define _CACHE_H_
 #include <stdint.h>
+#include <pthread.h>
 
 /* Different values for initializing cache */
 enum {
@@ -51,7 +52,11 @@ enum {
 #endif
 	/* MaxCacheSize will be 3G for 64-bit, and 1G for 32-bit */
 	MaxCacheSize			=	((unsigned)MaxCacheBlockSize * MaxCacheBlocks),
-	CacheHashSize			=	257,		/* prime number */
+	CacheHashSize			=	257,		/* minimum; CacheInit grows the table to one bucket per block */
+
+	/* Read-ahead */
+	CachePrefetchQueueSize	=	64,			/* outstanding CachePrefetch requests */
+	CachePrefetchMaxBlocks	=	32,			/* cache blocks filled by one prefetch read (1MB) */
 };
 
 /*
@@ -123,6 +128,8 @@ typedef struct Tag_t
 enum {
 	kLazyWrite		 = 0x00000001, 	/* only write this page when evicting or forced */
 	kLockWrite		 = 0x00000002,  /* Never evict this page -- will not work with writing yet! */
+	kReadPending	 = 0x00000004,	/* page is being read from disk without the cache lock held */
+	kPrefetched		 = 0x00000008,	/* page was read ahead by the prefetcher and not looked up since */
 };
 
 /*
@@ -133,6 +140,16 @@ enum {
  *
  *  NOTE: The LRU field must be the first field, so we can easily cast between
  *        the two.
+ *
+ *  The cache may be used by more than one thread at a time (fsck_hfs -P).
+ *  CacheRead, CacheWrite, CacheRelease, CacheFlush and the other exported
+ *  routines that walk the cache take Lock.  Disk reads for cache misses are
+ *  done with the lock dropped; other threads looking up the same page wait
+ *  on ReadDone until the read completes.
+ *
+ *  CachePrefetch queues ranges that are about to be read; a background
+ *  thread reads the missing pages of each range with large vectored reads,
+ *  using the same kReadPending protocol.
  */
 typedef struct Cache_t
 {
@@ -159,6 +176,29 @@ typedef struct Cache_t
 	uint32_t	DiskWrite;	/* Number of actual disk writes */
 
 	uint32_t	Span;		/* Requests that spanned cache blocks */
+
+	uint32_t	Hits;		/* Page lookups found in the cache */
+	uint32_t	Misses;		/* Page lookups read from disk */
+	uint32_t	PrefetchReads;	/* Disk reads issued by the prefetcher */
+	uint32_t	PrefetchBlocks;	/* Pages read by the prefetcher */
+	uint32_t	PrefetchUsed;	/* Prefetched pages that were looked up later */
+	uint32_t	PrefetchWasted;	/* Prefetched pages evicted without being looked up */
+	uint32_t	PrefetchDropped;	/* Requests dropped because the queue was full */
+
+	struct {
+		uint64_t	Offset;
+		uint64_t	Length;
+	}		PrefetchQueue[CachePrefetchQueueSize];	/* Ranges waiting to be read ahead */
+	uint32_t	PrefetchHead;	/* Oldest queued range */
+	uint32_t	PrefetchCount;	/* Number of queued ranges */
+	int		PrefetchBusy;	/* The prefetcher is working on a range */
+	int		PrefetchRunning;	/* PrefetchThread has been started */
+	int		PrefetchStop;	/* Asks PrefetchThread to exit */
+	pthread_t	PrefetchThread;
+
+	pthread_mutex_t	Lock;		/* Protects everything above */
+	pthread_cond_t	ReadDone;	/* Signalled when a kReadPending page is loaded */
+	pthread_cond_t	PrefetchWork;	/* Signalled when a range is queued, or on shutdown */
 } Cache_t;
 
 extern Cache_t fscache;
@@ -215,6 +255,29 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions );
  */
 int CacheRelease (Cache_t *cache, Buf_t *buf, int age);
 
+/*
+ * CachePrefetch
+ *
+ *  Hints that a byte range will be read soon.  The pages of the range that
+ *  are not in the cache are read in the background.  Does not wait for the
+ *  reads; a later CacheRead of a page being prefetched waits for it.
+ */
+int CachePrefetch (Cache_t *cache, uint64_t off, uint64_t len);
+
+/*
+ * CacheStopPrefetch
+ *
+ *  Stops the prefetch thread and drops the ranges still queued.
+ */
+void CacheStopPrefetch (Cache_t *cache);
+
+/*
+ * CachePrintStats
+ *
+ *  Prints the request, hit/miss and prefetch counters.
+ */
+void CachePrintStats (Cache_t *cache);
+
 /* CacheRemove
  *
  *  Disposes of a particular tag and buffer.
@@ -581,15 +581,10 @@ end_progress(void)
  */
 void DestroyCache()
 {
+    CacheStopPrefetch(&fscache);
     CacheFlush(&fscache);
-    
-#if CACHE_DEBUG
+
     /* Print cache report */
-    fsck_print(ctx, LOG_TYPE_INFO, "Cache Report:\n");
-    fsck_print(ctx, LOG_TYPE_INFO, "\tRead Requests:  %d\n", cache->ReqRead);
-    fsck_print(ctx, LOG_TYPE_INFO, "\tWrite Requests: %d\n", cache->ReqWrite);
-    fsck_print(ctx, LOG_TYPE_INFO, "\tDisk Reads:     %d\n", cache->DiskRead);
-    fsck_print(ctx, LOG_TYPE_INFO, "\tDisk Writes:    %d\n", cache->DiskWrite);
-    fsck_print(ctx, LOG_TYPE_INFO, "\tSpans:          %d\n", cache->Span);
-#endif
+    if (state.debug)
+        CachePrintStats(&fscache);
 }
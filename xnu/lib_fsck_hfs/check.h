@@ -77,6 +77,7 @@ typedef struct fsck_state {
     char        debug;              /* output debugging info */
     char        disable_journal;    /* if debug, and set, do not simulate journal replay */
     char        scanflag;           /* scan entire disk for bad blocks */
+    char        parallel;           /* verify the attributes B-tree concurrently with the catalog */
     char        embedded;
     
     char        repLev;             /* repair level */
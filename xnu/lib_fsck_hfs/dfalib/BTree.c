@@ -35,7 +35,14 @@
 
 #include "BTree.h"
 #include "BTreePrivate.h"
+/*
+ * xnu/tests/fsck_bulkload_test.c and hfs_btcompact_test.c build the
+ * B-tree sources with FSCK_BTREE_TEST defined, and their own state and
+ * fsck_print.
+ */
+#ifndef FSCK_BTREE_TEST
 #include "check.h"
+#endif
 
 
 extern Boolean NodesAreContiguous(SFCB *fcb, UInt32 nodeSize);
@@ -1703,6 +1710,328 @@ ErrorExit:
 
 
 
+//////////////////////////////// BTBulkLoad /////////////////////////////////////
+
+/*-------------------------------------------------------------------------------
+Routine:	BTBulkLoad	-	Build a B*Tree bottom-up from a sorted record stream.
+
+Function:	Packs the records into leaf nodes in key order, starting a new leaf
+			once fillPercent of the current one is used, and builds each index
+			level from the first keys of the level below as it goes.  This avoids
+			the search, splits and rotations of BTInsertRecord, and leaves the
+			nodes full instead of about half full.
+
+			Nodes are allocated in ascending order as they are started, so a
+			tree loaded into an empty file has its leaves in key order with an
+			index node after every few dozen of them.  Only one node per level is
+			held at a time.  The file is extended if it runs out of free nodes.
+
+			The tree must be empty, and keys must come in strictly ascending
+			order.  After an error the tree is in an undefined state and should
+			be thrown away.  The header is only marked dirty; call BTFlushPath
+			to write it.
+
+Input:		filePtr		- B*Tree file to load
+			nextProc	- returns the next record, or fsBTEndOfIterationErr
+						  after the last one
+			state		- passed to nextProc
+			fillPercent	- how full to pack each node, 50 to 100 (0 means 100,
+						  and lower values mean 50)
+
+Result:		noErr					- success
+			fsBTDuplicateRecordErr	- two records have the same key
+			paramErr				- tree not empty, or keys out of order
+			!= noErr				- failure
+-------------------------------------------------------------------------------*/
+
+enum {
+	kBulkLoadMinFillPercent		= 50		// below this, index nodes could hold a single record
+};
+
+typedef struct BulkLoadLevel {
+	BlockDescriptor		node;			// node being filled (buffer is nil if none)
+	UInt32				nodeNum;
+	UInt32				nodeCount;		// nodes started on this level so far
+} BulkLoadLevel;
+
+typedef struct BulkLoadState {
+	BTreeControlBlockPtr	btreePtr;
+	UInt32					nextNode;		// allocation hint
+	UInt16					fillLimit;		// bytes of a node we may use
+	BulkLoadLevel			levels[kMaxTreeDepth];
+} BulkLoadState;
+
+static OSStatus	BulkLoadNewNode		(BulkLoadState			*bulk,
+									 UInt16					 height,
+									 UInt32					 prevNode );
+
+static OSStatus	BulkLoadAddRecord	(BulkLoadState			*bulk,
+									 UInt16					 height,
+									 KeyPtr					 keyPtr,
+									 RecordPtr				 recPtr,
+									 UInt16					 recSize );
+
+
+OSStatus	BTBulkLoad			(SFCB						*filePtr,
+								 BulkLoadNextProcPtr		 nextProc,
+								 void						*state,
+								 UInt32						 fillPercent )
+{
+	OSStatus				err;
+	BTreeControlBlockPtr	btreePtr;
+	BulkLoadState			bulk;
+	BulkLoadLevel			*level;
+	KeyPtr					keyPtr;
+	KeyPtr					prevKeyPtr;
+	RecordPtr				recPtr;
+	UInt8					*dataPtr;
+	UInt16					recSize;
+	UInt16					dataSize;
+	UInt16					height;
+	SInt32					result;
+	UInt32					leafRecords;
+
+
+	M_ReturnErrorIf (filePtr == nil, 	paramErr);
+	M_ReturnErrorIf (nextProc == nil,	paramErr);
+
+	btreePtr = (BTreeControlBlockPtr) filePtr->fcbBtree;
+
+	M_ReturnErrorIf (btreePtr == nil,	fsBTInvalidFileErr);
+	M_ReturnErrorIf (btreePtr->treeDepth != 0 || btreePtr->leafRecords != 0, paramErr);
+
+	if (fillPercent == 0 || fillPercent > 100)
+		fillPercent = 100;
+	else if (fillPercent < kBulkLoadMinFillPercent)
+		fillPercent = kBulkLoadMinFillPercent;
+
+	ClearMemory (&bulk, sizeof (bulk));
+	bulk.btreePtr	= btreePtr;
+	bulk.nextNode	= kHeaderNodeNum + 1;
+	bulk.fillLimit	= (btreePtr->nodeSize - sizeof (BTNodeDescriptor) - kOffsetSize) * fillPercent / 100;
+	leafRecords		= 0;
+
+	///////////////////////////// Fill The Leaves ///////////////////////////////
+
+	while (true)
+	{
+		err = nextProc (state, &keyPtr, &recPtr, &recSize);
+		if (err == fsBTEndOfIterationErr)
+			break;
+		M_ExitOnError (err);
+
+		// the previous record is always the last one in the current leaf
+		level = &bulk.levels[0];
+		if (level->node.buffer != nil)
+		{
+			err = GetRecordByIndex (btreePtr, level->node.buffer,
+									((NodeDescPtr)level->node.buffer)->numRecords - 1,
+									&prevKeyPtr, &dataPtr, &dataSize);
+			M_ExitOnError (err);
+
+			result = CompareKeys (btreePtr, keyPtr, prevKeyPtr);
+			if (result <= 0)
+			{
+				err = (result == 0) ? fsBTDuplicateRecordErr : paramErr;
+				goto ErrorExit;
+			}
+		}
+
+		err = BulkLoadAddRecord (&bulk, 1, keyPtr, recPtr, recSize);
+		M_ExitOnError (err);
+
+		++leafRecords;
+	}
+
+	if (leafRecords == 0)
+		return noErr;
+
+	////////////////////////// Close Open Nodes, Find Root //////////////////////
+
+	// Every node but the last one on a level has already been added to its
+	// parent.  Add the last ones, bottom up, until a level has only one node.
+
+	for (height = 1; ; ++height)
+	{
+		level = &bulk.levels[height - 1];
+
+		if (level->nodeCount == 1)
+			break;
+
+		err = GetRecordByIndex (btreePtr, level->node.buffer, 0, &keyPtr, &dataPtr, &dataSize);
+		M_ExitOnError (err);
+
+		err = BulkLoadAddRecord (&bulk, height + 1, keyPtr, (RecordPtr) &level->nodeNum, sizeof (UInt32));
+		M_ExitOnError (err);
+
+		err = UpdateNode (btreePtr, &level->node);
+		M_ExitOnError (err);
+	}
+
+	btreePtr->treeDepth		= height;
+	btreePtr->rootNode		= level->nodeNum;
+	btreePtr->lastLeafNode	= bulk.levels[0].nodeNum;
+
+	err = UpdateNode (btreePtr, &level->node);
+	M_ExitOnError (err);
+
+	++btreePtr->writeCount;
+	btreePtr->leafRecords = leafRecords;
+	M_BTreeHeaderDirty (btreePtr);
+
+	return noErr;
+
+	////////////////////////////// Error Exit ///////////////////////////////////
+
+ErrorExit:
+	for (height = 0; height < kMaxTreeDepth; ++height)
+		(void) ReleaseNode (btreePtr, &bulk.levels[height].node);
+
+	return	err;
+}
+
+
+
+/*-------------------------------------------------------------------------------
+Routine:	BulkLoadNewNode	-	Start the next node of a level for BTBulkLoad.
+
+Function:	Allocates a node, extending the file if needed, links it after
+			prevNode and makes it the level's current node.  The caller has
+			already released the previous node.
+-------------------------------------------------------------------------------*/
+
+static OSStatus	BulkLoadNewNode		(BulkLoadState			*bulk,
+									 UInt16					 height,
+									 UInt32					 prevNode )
+{
+	OSStatus				err;
+	BTreeControlBlockPtr	btreePtr = bulk->btreePtr;
+	BulkLoadLevel			*level = &bulk->levels[height - 1];
+	NodeDescPtr				node;
+	UInt32					nodesNeeded;
+
+	if (btreePtr->freeNodes == 0)
+	{
+		nodesNeeded = btreePtr->totalNodes + 1;
+		if (nodesNeeded > CalcMapBits (btreePtr))	// we'll need to add a map node too!
+			++nodesNeeded;
+
+		err = ExtendBTree (btreePtr, nodesNeeded);
+		M_ReturnErrorIf (err != noErr, err);
+	}
+
+	err = AllocateNodeFrom (btreePtr, bulk->nextNode, &level->nodeNum);
+	M_ReturnErrorIf (err != noErr, err);
+	bulk->nextNode = level->nodeNum + 1;
+
+	err = GetNewNode (btreePtr, level->nodeNum, &level->node);
+	M_ReturnErrorIf (err != noErr, err);
+
+	node = level->node.buffer;
+	node->kind		= (height == 1) ? kBTLeafNode : kBTIndexNode;
+	node->height	= height;
+	node->bLink		= prevNode;
+
+	if (height == 1 && level->nodeCount == 0)
+		btreePtr->firstLeafNode = level->nodeNum;
+	++level->nodeCount;
+
+	return noErr;
+}
+
+
+
+/*-------------------------------------------------------------------------------
+Routine:	BulkLoadAddRecord	-	Append a record to a level for BTBulkLoad.
+
+Function:	Appends a record to the current node at the given height.  If the
+			node has reached the fill limit, the next node is started first,
+			and the full node is added to its parent level and written out.
+			Index records (height > 1) hold a child node number.
+-------------------------------------------------------------------------------*/
+
+static OSStatus	BulkLoadAddRecord	(BulkLoadState			*bulk,
+									 UInt16					 height,
+									 KeyPtr					 keyPtr,
+									 RecordPtr				 recPtr,
+									 UInt16					 recSize )
+{
+	OSStatus				err;
+	BTreeControlBlockPtr	btreePtr = bulk->btreePtr;
+	BulkLoadLevel			*level;
+	BlockDescriptor			fullNode;
+	UInt32					fullNodeNum;
+	KeyPtr					firstKeyPtr;
+	UInt8					*dataPtr;
+	UInt16					dataSize;
+	UInt16					keyLength;
+	UInt16					keySize;
+	UInt16					freeSize;
+	UInt16					usedSize;
+
+	if (height > kMaxTreeDepth)
+		return fsBTTreeTooDeepErr;
+
+	level = &bulk->levels[height - 1];
+
+	if (height == 1 || (btreePtr->attributes & kBTVariableIndexKeysMask))
+		keyLength = KeyLength (btreePtr, keyPtr);
+	else
+		keyLength = btreePtr->maxKeyLength;		// fixed sized index key (i.e. HFS)
+
+	keySize = keyLength + ((btreePtr->attributes & kBTBigKeysMask) ? sizeof (UInt16) : sizeof (UInt8));
+	if (M_IsOdd (keySize))
+		++keySize;
+
+	if (level->node.buffer == nil)
+	{
+		err = BulkLoadNewNode (bulk, height, 0);
+		M_ReturnErrorIf (err != noErr, err);
+	}
+	else
+	{
+		freeSize = GetNodeFreeSize (btreePtr, level->node.buffer);
+		usedSize = btreePtr->nodeSize - sizeof (BTNodeDescriptor) - kOffsetSize - freeSize;
+
+		// a node always takes two records, so each level has fewer nodes than the one below
+		if (keySize + recSize + kOffsetSize > freeSize ||
+			(((NodeDescPtr)level->node.buffer)->numRecords >= 2 &&
+			 usedSize + keySize + recSize + kOffsetSize > bulk->fillLimit))
+		{
+			fullNode	= level->node;
+			fullNodeNum	= level->nodeNum;
+
+			err = BulkLoadNewNode (bulk, height, fullNodeNum);
+			if (err != noErr)
+			{
+				level->node = fullNode;		// so ErrorExit releases it
+				return err;
+			}
+			((NodeDescPtr)fullNode.buffer)->fLink = level->nodeNum;
+
+			err = GetRecordByIndex (btreePtr, fullNode.buffer, 0, &firstKeyPtr, &dataPtr, &dataSize);
+			if (err == noErr)
+				err = BulkLoadAddRecord (bulk, height + 1, firstKeyPtr, (RecordPtr) &fullNodeNum, sizeof (UInt32));
+			if (err != noErr)
+			{
+				(void) ReleaseNode (btreePtr, &fullNode);
+				return err;
+			}
+
+			err = UpdateNode (btreePtr, &fullNode);
+			M_ReturnErrorIf (err != noErr, err);
+		}
+	}
+
+	if (InsertKeyRecord (btreePtr, level->node.buffer, ((NodeDescPtr)level->node.buffer)->numRecords,
+						 keyPtr, keyLength, recPtr, recSize) != true)
+		return fsBTRecordTooLargeErr;
+
+	return noErr;
+}
+
+
+
 OSStatus	BTGetInformation	(SFCB					*filePtr,
 								 UInt16					 version,
 								 BTreeInfoRec			*info )
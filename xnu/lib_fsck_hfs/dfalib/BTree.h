@@ -330,6 +330,16 @@ typedef BTreeIterator *BTreeIteratorPtr;
 
 typedef SInt32		(* KeyCompareProcPtr)	(BTreeKeyPtr a, BTreeKeyPtr b);
 
+/*
+	Record source for BTBulkLoad - returns the next record in key order, or
+	fsBTEndOfIterationErr after the last one.  The key and record only need
+	to stay valid until the next call.
+*/
+typedef OSStatus	(* BulkLoadNextProcPtr)	(void						*state,
+											 BTreeKeyPtr				*key,
+											 UInt8						**record,
+											 UInt16						*recordLen );
+
 typedef	OSStatus	(* GetBlockProcPtr)		(SFCB	*filePtr,
 											 UInt32						 blockNum,
 											 GetBlockOptions			 options,
@@ -401,6 +411,11 @@ extern OSStatus	BTSetRecord			(SFCB		 				*filePtr,
 extern OSStatus	BTDeleteRecord		(SFCB		 				*filePtr,
 									 BTreeIterator				*iterator );
 
+extern OSStatus	BTBulkLoad			(SFCB		 				*filePtr,
+									 BulkLoadNextProcPtr		 nextProc,
+									 void						*state,
+									 UInt32						 fillPercent );
+
 extern OSStatus	BTGetInformation	(SFCB		 				*filePtr,
 									 UInt16						 version,
 									 BTreeInfoRec				*info );
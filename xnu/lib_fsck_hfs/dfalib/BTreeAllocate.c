@@ -71,6 +71,34 @@ Result:		noErr			- success
 
 OSStatus	AllocateNode (BTreeControlBlockPtr		btreePtr, UInt32	*nodeNum)
 {
+	return AllocateNodeFrom (btreePtr, 0, nodeNum);
+}
+
+
+
+/*-------------------------------------------------------------------------------
+
+Routine:	AllocateNodeFrom	-	Find Free Node at or after a Hint.
+
+Function:	Same as AllocateNode, but the search starts at the map word holding
+			startNode instead of at the beginning of the map.  Callers that
+			allocate many nodes in a row (BTBulkLoad) pass the last node they got
+			plus one, so the map is not rescanned from node 0 every time.  A free
+			node earlier in the same map word may still be returned.
+
+Input:		btreePtr	- pointer to control block for BTree file
+			startNode	- node number to start searching from
+
+Output:		nodeNum		- number of node allocated
+
+Result:		noErr			- success
+			fsBTNoMoreMapNodesErr	- no free blocks were found
+			!= noErr		- failure
+-------------------------------------------------------------------------------*/
+
+OSStatus	AllocateNodeFrom (BTreeControlBlockPtr	btreePtr, UInt32	startNode, UInt32	*nodeNum)
+{
+	UInt32			 skip;
 	OSStatus		 err;
 	BlockDescriptor	 node;
 	UInt16			*mapPtr, *pos;
@@ -97,6 +125,18 @@ OSStatus	AllocateNode (BTreeControlBlockPtr		btreePtr, UInt32	*nodeNum)
 		size  >>= 1;						// convert to number of words
 						// assumes mapRecords contain an integral number of words
 
+		if ( startNode >= nodeNumber )		// skip the words before the hint
+		{
+			skip = (startNode - nodeNumber) >> 4;
+			if ( skip >= size )
+			{
+				nodeNumber += mapSize << 3;
+				continue;
+			}
+			pos  += skip;
+			size -= skip;
+		}
+
 		while ( size-- )
 		{
 			if ( *pos++ != 0xFFFF )			// assume test fails, and increment pos
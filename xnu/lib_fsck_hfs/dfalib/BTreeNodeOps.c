@@ -34,7 +34,9 @@
 
 #include "BTreePrivate.h"
 #include "hfs_endian.h"
+#ifndef FSCK_BTREE_TEST
 #include "check.h"
+#endif
 
 
 ///////////////////////// BTree Module Node Operations //////////////////////////
@@ -130,6 +132,8 @@ OSStatus	GetNode		(BTreeControlBlockPtr	 btreePtr,
 		goto ErrorExit;
 	}
 	
+	M_LockNodes (btreePtr);						// released by ReleaseNode/TrashNode/UpdateNode
+
 	getNodeProc = btreePtr->getBlockProc;
 	err = getNodeProc (btreePtr->fcbPtr,
 					   nodeNum,
@@ -139,6 +143,7 @@ OSStatus	GetNode		(BTreeControlBlockPtr	 btreePtr,
 	if (err != noErr)
 	{
 		Panic ("\pGetNode: getNodeProc returned error.");
+		M_UnlockNodes (btreePtr);
 		nodePtr->buffer = nil;
 		goto ErrorExit;
 	}
@@ -194,6 +199,8 @@ OSStatus	GetNewNode	(BTreeControlBlockPtr	 btreePtr,
 
 	//////////////////////// get buffer for new node ////////////////////////////
 
+	M_LockNodes (btreePtr);
+
 	getNodeProc = btreePtr->getBlockProc;
 	err = getNodeProc (btreePtr->fcbPtr,
 					   nodeNum,
@@ -203,6 +210,7 @@ OSStatus	GetNewNode	(BTreeControlBlockPtr	 btreePtr,
 	if (err != noErr)
 	{
 		Panic ("\pGetNewNode: getNodeProc returned error.");
+		M_UnlockNodes (btreePtr);
 		returnNodePtr->buffer = nil;
 		return err;
 	}
@@ -265,6 +273,7 @@ OSStatus	ReleaseNode	(BTreeControlBlockPtr	 btreePtr,
 							   options );
 		PanicIf (err, "\pReleaseNode: releaseNodeProc returned error.");
 		++btreePtr->numReleaseNodes;
+		M_UnlockNodes (btreePtr);
 	}
 	
 	nodePtr->buffer = nil;
@@ -307,6 +316,7 @@ OSStatus	TrashNode	(BTreeControlBlockPtr	 btreePtr,
 							   kReleaseBlock | kTrashBlock );
 		PanicIf (err, "\pTrashNode: releaseNodeProc returned error.");
 		++btreePtr->numReleaseNodes;
+		M_UnlockNodes (btreePtr);
 	}
 
 	nodePtr->buffer			= nil;
@@ -355,6 +365,7 @@ OSStatus	UpdateNode	(BTreeControlBlockPtr	 btreePtr,
 							   
 	//	LogEndTime(kTraceReleaseNode, err);
 
+		M_UnlockNodes (btreePtr);
 		M_ExitOnError (err);
 		++btreePtr->numUpdateNodes;
 	}
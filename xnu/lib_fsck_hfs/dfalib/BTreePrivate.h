@@ -35,6 +35,8 @@
 #ifndef	__BTREEPRIVATE__
 #define __BTREEPRIVATE__
 
+#include <pthread.h>
+
 #include "BTree.h"
 
 /////////////////////////////////// Constants ///////////////////////////////////
@@ -87,6 +89,9 @@ typedef enum {
 #define		M_IsEven(integer) 					(((integer) & 1) == 0)
 #define		M_BTreeHeaderDirty(btreePtr)		btreePtr->flags |= kBTHeaderDirty
 
+#define		M_LockNodes(btreePtr)				do { if ((btreePtr)->nodeLock != NULL) pthread_mutex_lock((btreePtr)->nodeLock); } while (0)
+#define		M_UnlockNodes(btreePtr)				do { if ((btreePtr)->nodeLock != NULL) pthread_mutex_unlock((btreePtr)->nodeLock); } while (0)
+
 #define		M_MapRecordSize(nodeSize)			(nodeSize - sizeof (BTNodeDescriptor) - 6)
 #define		M_HeaderMapRecordSize(nodeSize)		(nodeSize - sizeof(BTNodeDescriptor) - sizeof(BTHeaderRec) - 128 - 8)
 
@@ -146,6 +151,12 @@ typedef struct BTreeControlBlock {					// fields specific to BTree CBs
 	
 	struct BTreeExtensionsRec	*refCon;			//	Used by DFA to point to private data.
 	SFCB						*fcbPtr;		// fcb of btree file
+
+	// Nodes are byte swapped in place in the block cache, so two threads
+	// must never hold nodes of the same tree at once.  While the tree is
+	// shared between threads (fsck_hfs -P) nodeLock points at a recursive
+	// mutex that is held from GetNode until the node is released.
+	pthread_mutex_t				*nodeLock;
 	
 } BTreeControlBlock, *BTreeControlBlockPtr;
 
@@ -245,6 +256,10 @@ OSStatus	CheckKey				(KeyPtr					 keyPtr,
 OSStatus	AllocateNode			(BTreeControlBlockPtr	 btreePtr,
 									 UInt32					*nodeNum);
 
+OSStatus	AllocateNodeFrom		(BTreeControlBlockPtr	 btreePtr,
+									 UInt32					 startNode,
+									 UInt32					*nodeNum);
+
 OSStatus	FreeNode				(BTreeControlBlockPtr	 btreePtr,
 									 UInt32					 nodeNum);
 
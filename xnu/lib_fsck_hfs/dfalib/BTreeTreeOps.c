@@ -33,8 +33,10 @@
 */
 
 #include "BTreePrivate.h"
+#ifndef FSCK_BTREE_TEST
 #include "fsck_debug.h"
 #include "check.h"
+#endif
 
 #define DEBUG_TREEOPS 0
 
@@ -394,6 +396,7 @@ OSStatus	InsertLevel (BTreeControlBlockPtr		 btreePtr,
 	Boolean				 insertParent;
 	Boolean				 updateParent;
 	Boolean				 newRoot;
+	InsertKey			 insertKey;		// secondaryKey may point here in the recursive call below
 
 #if defined(applec) && !defined(__SC__)
 	PanicIf ((level == 1) && (((NodeDescPtr)targetNode->buffer)->kind != kBTLeafNode), "\P InsertLevel: non-leaf at level 1! ");
@@ -503,7 +506,6 @@ OSStatus	InsertLevel (BTreeControlBlockPtr		 btreePtr,
 		if ( insertParent )
 		{
 			InsertKey	*insertKeyPtr;
-			InsertKey	insertKey;
 			
 			if ( updateParent )
 			{
@@ -36,6 +36,7 @@ static OSStatus  WriteFragmentedBlock( 	SFCB *file,
 										int age, 
 										uint32_t writeOptions );
 static OSStatus  ReleaseFragmentedBlock (SFCB *file, BlockDescriptor *block, int age);
+static int       CompareBlockNums (const void *a, const void *b);
 
 
 void
@@ -181,6 +182,57 @@ GetFileBlock (SFCB *file, UInt32 blockNum, GetBlockOptions options, BlockDescrip
 }
 
 
+/*
+ * PrefetchFileBlocks
+ *
+ * Hint that the given file blocks are about to be read.  The blocks are
+ * sorted, mapped to the disk and merged into runs of adjacent blocks, and
+ * each run is handed to the cache's read-ahead.  blockNums is reordered.
+ * Blocks that can't be mapped are skipped; GetFileBlock will report them.
+ */
+void
+PrefetchFileBlocks (SFCB *file, UInt32 *blockNums, UInt32 count)
+{
+	UInt64	diskBlock;
+	UInt32	contiguousBytes;
+	UInt64	runStart = 0;
+	UInt64	runLength = 0;
+	UInt64	offset;
+	UInt32	i;
+	Cache_t * cache;
+
+	if (count == 0)
+		return;
+
+	cache = (Cache_t *)file->fcbVolume->vcbBlockCache;
+	qsort(blockNums, count, sizeof(UInt32), CompareBlockNums);
+
+	for (i = 0; i < count; i++) {
+		if (i > 0 && blockNums[i] == blockNums[i - 1])
+			continue;
+
+		if (MapFileBlockC(file->fcbVolume, file, file->fcbBlockSize,
+				(((UInt64)blockNums[i] * (UInt64)file->fcbBlockSize) >> kSectorShift),
+				&diskBlock, &contiguousBytes) != noErr)
+			continue;
+
+		offset = ((UInt64) diskBlock) << kSectorShift;
+		if (runLength != 0 && runStart + runLength == offset) {
+			runLength += file->fcbBlockSize;
+			continue;
+		}
+
+		if (runLength != 0)
+			(void) CachePrefetch(cache, runStart, runLength);
+		runStart = offset;
+		runLength = file->fcbBlockSize;
+	}
+
+	if (runLength != 0)
+		(void) CachePrefetch(cache, runStart, runLength);
+}
+
+
 /*
  *  kReleaseBlock
  *  kForceWriteBlock
@@ -232,6 +284,16 @@ SetFileBlockSize (SFCB *file, ByteCount blockSize)
 }
 
 
+static int
+CompareBlockNums (const void *a, const void *b)
+{
+	UInt32 left = *(const UInt32 *)a;
+	UInt32 right = *(const UInt32 *)b;
+
+	return (left < right) ? -1 : (left > right);
+}
+
+
 /*
  * Read a block that is fragmented across 2 or more allocation blocks
  *
@@ -21,6 +21,11 @@
  * @APPLE_LICENSE_HEADER_END@
  */
 
+/*
+ * xnu/tests/fsck_foldercount_test.c builds only the folder count
+ * routines, with FSCK_FOLDERCOUNT_TEST defined.
+ */
+#ifndef FSCK_FOLDERCOUNT_TEST
 #include "Scavenger.h"
 #include "DecompDataEnums.h"
 #include "DecompData.h"
@@ -79,18 +84,37 @@ static 	OSErr	UniqueDotName( 	SGlobPtr GPtr,
                                 Boolean isSingleDotName,
                                 Boolean isHFSPlus );
 static Boolean 	FixDecomps(	u_int16_t charCount, const u_int16_t *inFilename, HFSUniStr255 *outFilename );
+#endif /* !FSCK_FOLDERCOUNT_TEST */
 
 /*
  * This structure is used to keep track of the folderCount field in
  * HFSPlusCatalogFolder records.  For now, this is only done on HFSX volumes.
+ *
+ * The entries are filled in by CheckCatalogRecord during the catalog
+ * B-tree walk, and kept in an open addressing hash table keyed by folder
+ * ID, which doubles whenever it gets half full.
  */
 struct folderCountInfo {
 	UInt32 folderID;
 	UInt32 recordedCount;
 	UInt32 computedCount;
-	struct folderCountInfo *next;
+	UInt16 flags;		/* flags of the folder record */
+	UInt16 isFolder;	/* a folder record was found for folderID */
+};
+
+struct folderCountTable {
+	struct folderCountInfo *entries;
+	UInt32 size;		/* number of slots, a power of two */
+	UInt32 count;		/* slots in use */
+	Boolean enabled;	/* counting during the catalog walk */
+	Boolean failed;		/* ran out of memory; CheckFolderCount walks the catalog itself */
 };
 
+#define kFolderCountInitialSize	4096
+
+static struct folderCountTable gFolderCounts;
+
+#ifndef FSCK_FOLDERCOUNT_TEST
 /*
  * Print a symbolic link name given the fileid
  */
@@ -106,6 +130,7 @@ printSymLinkName(SGlobPtr GPtr, UInt32 fid)
 	}
 	return;
 }
+#endif /* !FSCK_FOLDERCOUNT_TEST */
 
 /*
  * CountFolderRecords - Counts the number of folder records contained within a
@@ -179,152 +204,156 @@ CountFolderRecords(HFSPlusCatalogKey *myKey, HFSPlusCatalogFolder *folder, SGlob
 }
 
 static void
-releaseFolderCountInfo(struct folderCountInfo *fcip, int numFolders)
+releaseFolderCountInfo(void)
 {
-	int i;
-
-	for (i = 0; i < numFolders; i++) {
-		struct folderCountInfo *f = &fcip[i];
-
-		f = f->next;
-		while (f) {
-			struct folderCountInfo *t = f->next;
-			free(f);
-			f = t;
-		}
-	}
-	free(fcip);
+	free(gFolderCounts.entries);
+	ClearMemory(&gFolderCounts, sizeof(gFolderCounts));
 }
 
-static struct folderCountInfo *
-findFolderEntry(struct folderCountInfo *fcip, int numFolders, UInt32 fid)
+static inline UInt32
+folderCountSlot(UInt32 fid, UInt32 size)
 {
-	struct folderCountInfo *retval = NULL;
-	int indx;
-
-	indx = fid % numFolders;	// Slot index
-
-	retval = &fcip[indx];
-	if (retval->folderID == fid) {
-		goto done;
-	}
-	while (retval->next != NULL) {
-		retval = retval->next;
-		if (retval->folderID == fid)
-			goto done;
-	}
-	retval = NULL;
-done:
-	return retval;
+	/* Multiplicative hash; spreads the (mostly sequential) folder IDs */
+	return (fid * 2654435761u) & (size - 1);
 }
 
+/*
+ * findFolderEntry - Returns the entry for the given folder ID, adding it if
+ * needed, or NULL if the table can't grow.  Folder ID zero is never used
+ * by a folder, so it marks a free slot.
+ */
 static struct folderCountInfo *
-addFolderEntry(struct folderCountInfo *fcip, int numFolders, UInt32 fid)
+findFolderEntry(UInt32 fid)
 {
-	struct folderCountInfo *retval = NULL;
-	int indx;
-
-	indx = fid % numFolders;
-	retval = &fcip[indx];
-
-	if (retval->folderID == fid)
-		goto done;
-	while (retval->folderID != 0) {
-		if (retval->next == NULL) {
-			retval->next = calloc(1, sizeof(struct folderCountInfo));
-			if (retval->next == NULL) {
-				retval = NULL;
-				goto done;
-			} else
-				retval = retval->next;
-		} else if (retval->folderID == fid) {
-			goto done;
-		} else
-			retval = retval->next;
+	struct folderCountInfo *entries;
+	UInt32 slot;
+	UInt32 i;
+
+	if (gFolderCounts.count * 2 >= gFolderCounts.size) {
+		UInt32 newSize = gFolderCounts.size ? gFolderCounts.size * 2 : kFolderCountInitialSize;
+
+		entries = calloc(newSize, sizeof(struct folderCountInfo));
+		if (entries == NULL)
+			return NULL;
+		for (i = 0; i < gFolderCounts.size; i++) {
+			if (gFolderCounts.entries[i].folderID == 0)
+				continue;
+			slot = folderCountSlot(gFolderCounts.entries[i].folderID, newSize);
+			while (entries[slot].folderID != 0)
+				slot = (slot + 1) & (newSize - 1);
+			entries[slot] = gFolderCounts.entries[i];
+		}
+		free(gFolderCounts.entries);
+		gFolderCounts.entries = entries;
+		gFolderCounts.size = newSize;
 	}
 
-	retval->folderID = fid;
+	slot = folderCountSlot(fid, gFolderCounts.size);
+	while (gFolderCounts.entries[slot].folderID != 0) {
+		if (gFolderCounts.entries[slot].folderID == fid)
+			return &gFolderCounts.entries[slot];
+		slot = (slot + 1) & (gFolderCounts.size - 1);
+	}
 
-done:
-	return retval;
+	gFolderCounts.entries[slot].folderID = fid;
+	gFolderCounts.count++;
+	return &gFolderCounts.entries[slot];
 }
 
 /*
  * folderCountAdd - Accounts for given folder record or directory hard link  
  * for folder count of the given parent directory.  For directory hard links, 
- * the folder ID and count should be zero.  For a folder record, the values 
- * read from the catalog record are provided which are used to add the 
- * given folderID to the cache (folderCountInfo *ficp).
+ * the folder pointer should be NULL.  For a folder record, the values 
+ * read from the catalog record are saved with the folderID.
+ *
+ * If the table can't grow, counting stops and CheckFolderCount falls back
+ * to counting each folder's children with CountFolderRecords.
  */
-static int
-folderCountAdd(struct folderCountInfo *fcip, int numFolders, UInt32 parentID, UInt32 folderID, UInt32 count)
+static void
+folderCountAdd(UInt32 parentID, const HFSPlusCatalogFolder *folder)
 {
-	int retval = 0;
 	struct folderCountInfo *curp = NULL;
 
+	if (!gFolderCounts.enabled || gFolderCounts.failed)
+		return;
+	/* A zero ID is reported by CheckDirectory; it can't go in the table */
+	if (parentID == 0 || (folder != NULL && folder->folderID == 0))
+		return;
 
 	/* Only add directories represented by folder record to the cache */
-	if (folderID != 0) {
-		/*
-		 * We track two things here.
-		 * First, we need to find the entry matching this folderID.  If we don't find it,
-		 * we add it.  If we do find it, or if we add it, we set the recordedCount.
-		 */
-
-		curp = findFolderEntry(fcip, numFolders, folderID);
-		if (curp == NULL) {
-			curp = addFolderEntry(fcip, numFolders, folderID);
-			if (curp == NULL) {
-				retval = ENOMEM;
-				goto done;
-			}
-		}
-		curp->recordedCount = count;
-
+	if (folder != NULL) {
+		curp = findFolderEntry(folder->folderID);
+		if (curp == NULL)
+			goto nomem;
+		curp->recordedCount = folder->folderCount;
+		curp->flags = folder->flags;
+		curp->isFolder = 1;
 	}
 
 	/*
 	 * After that, we try to find the parent to this entry.  When we find it
-	 * (or if we add it to the list), we increment the computedCount.
+	 * (or if we add it to the table), we increment the computedCount.
 	 */
-	curp = findFolderEntry(fcip, numFolders, parentID);
-	if (curp == NULL) {
-		curp = addFolderEntry(fcip, numFolders, parentID);
-		if (curp == NULL) {
-			retval = ENOMEM;
-			goto done;
-		}
-	}
+	curp = findFolderEntry(parentID);
+	if (curp == NULL)
+		goto nomem;
 	curp->computedCount++;
+	return;
 
-done:
-	return retval;
+nomem:
+	/* Release the memory, which will hopefully let some later allocations succeed */
+	free(gFolderCounts.entries);
+	gFolderCounts.entries = NULL;
+	gFolderCounts.size = gFolderCounts.count = 0;
+	gFolderCounts.failed = true;
+}
+
+/*
+ * isDirHardLink - Returns true if the file record is a directory hard link,
+ * which is treated as a normal directory for calculation of folder count.
+ */
+static Boolean
+isDirHardLink(SGlobPtr GPtr, const HFSPlusCatalogKey *key, const HFSPlusCatalogFile *file)
+{
+	return ((file->flags & kHFSHasLinkChainMask) &&
+		(file->userInfo.fdType == kHFSAliasType) &&
+		(file->userInfo.fdCreator == kHFSAliasCreator) &&
+		(key->parentID != GPtr->filelink_priv_dir_id));
+}
+
+static int
+compareFolderCountInfo(const void *first, const void *second)
+{
+	UInt32 a = ((const struct folderCountInfo *)first)->folderID;
+	UInt32 b = ((const struct folderCountInfo *)second)->folderID;
+
+	return (a < b) ? -1 : (a > b);
 }
 
 /*
  * CheckFolderCount - Verify the folderCount fields of the HFSPlusCatalogFolder records
  * in the catalog BTree.  This is currently only done for HFSX.
  *
- * Conceptually, this is a fairly simple routine:  simply iterate through the catalog
- * BTree, and count the number of subfolders contained in each folder.  This value
- * is used for the stat.st_nlink field, on HFSX.
+ * Conceptually, this is a fairly simple routine:  count the number of subfolders
+ * contained in each folder.  This value is used for the stat.st_nlink field, on HFSX.
  *
- * However, since scanning the entire catalog can be a very costly operation, we dot
- * it one of two ways.  The first way is to simply iterate through the catalog once,
- * and keep track of each folder ID we come across.  This uses a fair bit of memory,
- * so we limit the cache to 5MBytes, which works out to some 400k folderCountInfo
- * entries (at the current size of three 4-byte entries per folderCountInfo entry).
- * If the filesystem has more than that, we instead use the slower (but significantly
- * less memory-intensive) method in CountFolderRecords:  for each folder ID we
- * come across, we call CountFolderRecords, which does its own iteration through the
- * catalog, looking for children of the given folder.
+ * The counting is done by CheckCatalogRecord, during the catalog B-tree check,
+ * so here we only compare the counts, in folder ID order.  We also check the
+ * kHFSHasFolderCountMask flag in the folder flags field; if it's not set, we set
+ * it.  (When migrating a volume from an older version, this will affect every
+ * folder entry; after that, it will only affect any corrupted areas.)
+ *
+ * If the count table could not be built, we instead use the slower (but
+ * significantly less memory-intensive) method in CountFolderRecords:  iterate
+ * through the catalog, and for each folder ID we come across, call
+ * CountFolderRecords, which does its own iteration through the catalog, looking
+ * for children of the given folder.
  */
 
 OSErr
 CheckFolderCount( SGlobPtr GPtr )
 {
 	OSErr err = 0;
-	int numFolders;
 	BTreeIterator iterator;
 	FSBufferDescriptor btRecord;
 	HFSPlusCatalogKey *key;
@@ -333,7 +362,6 @@ CheckFolderCount( SGlobPtr GPtr )
 		HFSPlusCatalogFile catFile;
 	} catRecord;
 	UInt16 recordSize = 0;
-	struct folderCountInfo *fcip = NULL;
 
 	ClearMemory(&iterator, sizeof(iterator));
 	if (!VolumeObjectIsHFSX(GPtr)) {
@@ -345,39 +373,50 @@ CheckFolderCount( SGlobPtr GPtr )
 		goto done;
 	}
 
-#if 0
-	/*
-	 * We add two so we can account for the root folder, and
-	 * the root folder's parent.  Neither of which is real,
-	 * but they show up as parent IDs in the catalog.
-	 */
-	numFolders = GPtr->calculatedVCB->vcbFolderCount + 2;
-#else
-	/*
-	 * Since we're using a slightly smarter hash method,
-	 * we don't care so much about the number of folders
-	 * allegedly on the volume; instead, we'll pick a nice
-	 * prime number to use as the number of buckets.
-	 * This bears some performance checking later.
-	 */
-	numFolders = 257;
-#endif
+	if (gFolderCounts.enabled && !gFolderCounts.failed) {
+		struct folderCountInfo *curp;
+		UInt32 count = 0;
+		UInt32 i;
 
-	/*
-	 * Limit the size of the folder count cache to 5Mbytes;
-	 * if the requested number of folders don't fit, then
-	 * we don't use the cache at all.
-	 */
-#define MAXCACHEMEM	(5 * 1024 * 1024)	/* 5Mbytes */
-#define LCALLOC(c, s, l)	\
-	({ __typeof(c) _count = (c); __typeof(s) _size = (s); __typeof(l) _lim = (l); \
-		((_count * _size) > _lim) ? NULL : calloc(_count, _size); })
+		/* Pack the entries at the front of the table and sort them */
+		for (i = 0; i < gFolderCounts.size; i++) {
+			if (gFolderCounts.entries[i].folderID != 0)
+				gFolderCounts.entries[count++] = gFolderCounts.entries[i];
+		}
+		qsort(gFolderCounts.entries, count, sizeof(struct folderCountInfo), compareFolderCountInfo);
 
-	fcip = LCALLOC(numFolders, sizeof(*fcip), MAXCACHEMEM);
-#undef MAXCACHEMEM
-#undef LCALLOC
+		for (i = 0; i < count; i++) {
+			curp = &gFolderCounts.entries[i];
+
+			if (curp->isFolder && !(curp->flags & kHFSHasFolderCountMask)) {
+				/* RcdHsFldCntErr requests a repair order to fix up the flags field */
+				err = RcdHsFldCntErr( GPtr,
+							E_HsFldCount,
+							curp->flags | kHFSHasFolderCountMask,
+							curp->flags,
+							curp->folderID );
+				if (err != 0)
+					goto done;
+			}
+
+			if (curp->folderID == kHFSRootParentID) {
+				// Root's parent doesn't really exist
+				continue;
+			}
+			if (curp->recordedCount != curp->computedCount) {
+				/* RcdFCntErr requests a repair order to correct the folder count */
+				err = RcdFCntErr( GPtr,
+							E_FldCount,
+							curp->computedCount,
+							curp->recordedCount,
+							curp->folderID );
+				if (err != 0)
+					goto done;
+			}
+		}
+		goto done;
+	}
 
-restart:
 	/* these objects are used by the BT* functions to iterate through the catalog */
 	key = (HFSPlusCatalogKey*)&iterator.key;
 	BuildCatalogKey(kHFSRootFolderID, NULL, true, (CatalogKey*)key);
@@ -386,12 +425,9 @@ restart:
 	btRecord.itemSize = sizeof(catRecord);
 
 	/*
-	 * Iterate through the catalog BTree until the end.
-	 * For each folder we either cache the value, or we call CheckFolderCount.
-	 * We also check the kHFSHasFolderCountMask flag in the folder flags field;
-	 * if it's not set, we set it.  (When migrating a volume from an older version.
-	 * this will affect every folder entry; after that, it will only affect any
-	 * corrupted areas.)
+	 * Iterate through the catalog BTree until the end, calling
+	 * CountFolderRecords for each folder.  Directory hard links are
+	 * accounted for in CountFolderRecords.
 	 */
 	for (err = BTIterateRecord(GPtr->calculatedCatalogFCB, kBTreeFirstRecord,
 			&iterator, &btRecord, &recordSize);
@@ -399,112 +435,32 @@ restart:
 		err = BTIterateRecord(GPtr->calculatedCatalogFCB, kBTreeNextRecord,
 			&iterator, &btRecord, &recordSize)) {
 
-		switch (catRecord.catRecord.recordType) {
-		case kHFSPlusFolderRecord:
-			if (!(catRecord.catRecord.flags & kHFSHasFolderCountMask)) {
-				/* RcdHsFldCntErr requests a repair order to fix up the flags field */
-				err = RcdHsFldCntErr( GPtr,
-							E_HsFldCount,
-							catRecord.catRecord.flags | kHFSHasFolderCountMask,
-							catRecord.catRecord.flags,
-							catRecord.catRecord.folderID );
-				if (err != 0)
-					goto done;
-			}
-			if (fcip) {
-				if (folderCountAdd(fcip, numFolders,
-					key->parentID,
-					catRecord.catRecord.folderID,
-					catRecord.catRecord.folderCount)) {
-					/*
-					 * We got an error -- this only happens if folderCountAdd()
-					 * cannot allocate memory for a new node.  In that case, we
-					 * need to bail on the whole cache, and use the slow method.
-					 * This also lets us release the memory, which will hopefully
-					 * let some later allocations succeed.  We restart just after
-					 * the cache was allocated, and start over as if we had never
-					 * allocated a cache in the first place.
-					 */
-					releaseFolderCountInfo(fcip, numFolders);
-					fcip = NULL;
-					goto restart;
-				}
-			} else {
-				err = CountFolderRecords(key, &catRecord.catRecord, GPtr);
-				if (err != 0)
-					goto done;
-			}
-			break;
-		case kHFSPlusFileRecord:
-			/* If this file record is a directory hard link, count
-			 * it towards our folder count calculations.
-			 */
-			if ((catRecord.catFile.flags & kHFSHasLinkChainMask) &&
-			    (catRecord.catFile.userInfo.fdType == kHFSAliasType) &&
-			    (catRecord.catFile.userInfo.fdCreator == kHFSAliasCreator) &&
-			    (key->parentID != GPtr->filelink_priv_dir_id)) {
-			    	/* If we are using folder count cache, account
-				 * for directory hard links by incrementing
-				 * associated parentID in the cache.  If an 
-				 * extensive search for catalog is being 
-				 * performed, account for directory hard links 
-				 * in CountFolderRecords()
-				 */
-			    	if (fcip) {
-					if (folderCountAdd(fcip, numFolders, 
-						key->parentID, 0, 0)) {
-						/* See above for why we release & restart */
-						releaseFolderCountInfo(fcip, numFolders);
-						fcip = NULL;
-						goto restart;
-					}
-				}
-			}
-			break;
+		if (catRecord.catRecord.recordType != kHFSPlusFolderRecord)
+			continue;
+
+		if (!(catRecord.catRecord.flags & kHFSHasFolderCountMask)) {
+			/* RcdHsFldCntErr requests a repair order to fix up the flags field */
+			err = RcdHsFldCntErr( GPtr,
+						E_HsFldCount,
+						catRecord.catRecord.flags | kHFSHasFolderCountMask,
+						catRecord.catRecord.flags,
+						catRecord.catRecord.folderID );
+			if (err != 0)
+				goto done;
 		}
+		err = CountFolderRecords(key, &catRecord.catRecord, GPtr);
+		if (err != 0)
+			goto done;
 	}
 
 	if (err == btNotFound)
 		err = 0;	// We hit the end of the file, which is okay
-	if (err == 0 && fcip != NULL) {
-		int i;
-
-		/*
-		 * At this point, we are itereating through the cache, looking for
-		 * mis-counts. (If we're not using the cache, then CountFolderRecords has
-		 * already dealt with any miscounts.)
-		 */
-		for (i = 0; i < numFolders; i++) {
-			struct folderCountInfo *curp;
-
-			for (curp = &fcip[i]; curp; curp = curp->next) {
-				if (curp->folderID == 0) {
-				} else if (curp->folderID == kHFSRootParentID) {
-					// Root's parent doesn't really exist
-					continue;
-				} else {
-					if (curp->recordedCount != curp->computedCount) {
-						/* RcdFCntErr requests a repair order to correct the folder count */
-						err = RcdFCntErr( GPtr,
-									E_FldCount,
-									curp->computedCount,
-									curp->recordedCount,
-									curp->folderID );
-						if (err != 0)
-							goto done;
-					}
-				}
-			}
-		}
-	}
 done:
-	if (fcip) {
-		releaseFolderCountInfo(fcip, numFolders);
-		fcip = NULL;
-	}
+	releaseFolderCountInfo();
 	return err;
 }
 
+#ifndef FSCK_FOLDERCOUNT_TEST
 /*
  * CheckCatalogBTree - Verifies the catalog B-tree structure
  *
@@ -523,6 +479,10 @@ CheckCatalogBTree( SGlobPtr GPtr )
 	gCIS.parentID = kHFSRootParentID;
 	gCIS.nextCNID = kHFSFirstUserCatalogNodeID;
 
+	/* Folder counts are gathered during the leaf walk, for CheckFolderCount */
+	releaseFolderCountInfo();
+	gFolderCounts.enabled = VolumeObjectIsHFSX(GPtr);
+
 	if (hfsplus) {
 		/* Initialize check for file hard links */
         	HardLinkCheckBegin(gScavGlobals, &gCIS.hardLinkRef);
@@ -569,7 +529,11 @@ CheckCatalogBTree( SGlobPtr GPtr )
 	 * Check out the BTree structure
 	 */
 	err = BTCheck(gScavGlobals, kCalculatedCatalogRefNum, (CheckLeafRecordProcPtr)CheckCatalogRecord);
-	if (err) goto exit;
+	if (err) {
+		/* The walk didn't see every record, so the folder counts are incomplete */
+		releaseFolderCountInfo();
+		goto exit;
+	}
 
 	if (gCIS.dirCount != gCIS.dirThreads) {
 		RcdError(gScavGlobals, E_IncorrectNumThdRcd);
@@ -680,6 +644,7 @@ CheckCatalogRecord(SGlobPtr GPtr, const HFSPlusCatalogKey *key, const CatalogRec
 			++gCIS.dirThreads;
 			gCIS.parentID = key->parentID;
 		}
+		folderCountAdd(key->parentID, (const HFSPlusCatalogFolder *)rec);
 		result = CheckDirectory(key, (HFSPlusCatalogFolder *)rec);
 		break;
 
@@ -697,6 +662,8 @@ CheckCatalogRecord(SGlobPtr GPtr, const HFSPlusCatalogKey *key, const CatalogRec
 			++gCIS.dirThreads;
 			gCIS.parentID = key->parentID;
 		}
+		if (gFolderCounts.enabled && isDirHardLink(gScavGlobals, key, (const HFSPlusCatalogFile *)rec))
+			folderCountAdd(key->parentID, NULL);
 		result = CheckFile(key, (HFSPlusCatalogFile *)rec);
 		break;
 
@@ -2113,3 +2080,4 @@ FixDecomps(	u_int16_t charCount, const u_int16_t *inFilename, HFSUniStr255 *outF
     
 } /* FixDecomps */
 
+#endif /* !FSCK_FOLDERCOUNT_TEST */
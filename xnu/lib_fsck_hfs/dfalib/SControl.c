@@ -32,17 +32,13 @@
 	Copyright:	 1985, 1986, 1992-1999 by Apple Computer, Inc., all rights reserved.
 */
 
-#define SHOW_ELAPSED_TIMES  0
-
-
-#if SHOW_ELAPSED_TIMES
-#include <sys/time.h>
-#endif
-
 #include "Scavenger.h"
 #include "fsck_journal.h"
 #include <setjmp.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #ifndef CONFIG_HFS_TRIM
 #define CONFIG_HFS_TRIM 1
@@ -540,6 +536,303 @@ termScav:
 }
 
 
+/*
+ * Wall clock and CPU time of one phase of the verify, printed with -d.
+ * The CPU time is that of the whole process, so it includes the
+ * attributes btree thread when -P is used.
+ */
+typedef struct PhaseTimer {
+	struct timeval	wallStart;
+	struct rusage	usageStart;
+} PhaseTimer;
+
+static void
+StartPhaseTimer( PhaseTimer *timer )
+{
+	if ( state.debug == 0 )
+		return;
+
+	gettimeofday( &timer->wallStart, NULL );
+	getrusage( RUSAGE_SELF, &timer->usageStart );
+}
+
+static void
+PrintPhaseTimer( PhaseTimer *timer, const char *phase )
+{
+	struct timeval	now, wall, user, sys;
+	struct rusage	usage;
+
+	if ( state.debug == 0 )
+		return;
+
+	gettimeofday( &now, NULL );
+	getrusage( RUSAGE_SELF, &usage );
+	timersub( &now, &timer->wallStart, &wall );
+	timersub( &usage.ru_utime, &timer->usageStart.ru_utime, &user );
+	timersub( &usage.ru_stime, &timer->usageStart.ru_stime, &sys );
+
+	fsck_print(ctx, LOG_TYPE_INFO, "\t%s: %ld.%06d secs elapsed, %ld.%06d user, %ld.%06d system\n", phase,
+		(long)wall.tv_sec, (int)wall.tv_usec, (long)user.tv_sec, (int)user.tv_usec,
+		(long)sys.tv_sec, (int)sys.tv_usec);
+}
+
+
+/*
+ * With -P, AttrBTRecordsChk runs on its own thread while the catalog
+ * btree is checked.  Only the attributes btree check is moved; the
+ * extents and catalog btree checks still run one after the other on the
+ * main thread, and the catalog walk is not split up by key range: the
+ * catalog check carries state from one record to the next (gCIS, the
+ * folder count table, the hard link and missing thread lists, the
+ * directory path table), and CatHChk and the hard link checks rely on
+ * the whole walk having been done in key order.
+ *
+ * The thread works on a copy of the scavenger globals.  Everything the
+ * attributes check can change in that copy is listed in
+ * MergeAttrBTWorkerGlobals, which copies it back before AttrBTFinishChk
+ * compares the results of the two checks.
+ *
+ * Both threads read the extents btree, and both may read the attributes
+ * btree, so nodes of those trees are taken under a per-tree lock for as
+ * long as the thread holds them (see GetNode).  The catalog btree is only
+ * used by the main thread.
+ */
+typedef struct AttrBTWorker {
+	pthread_t		thread;
+	SGlob			glob;
+	SBTPT			btreePath;
+	OSErr			result;
+	UInt64			startItems;
+	struct timeval	wallTime;
+} AttrBTWorker;
+
+static pthread_mutex_t	gExtentsNodeLock;
+static pthread_mutex_t	gAttributesNodeLock;
+static pthread_once_t	gNodeLocksOnce = PTHREAD_ONCE_INIT;
+
+static void
+InitNodeLocks( void )
+{
+	pthread_mutexattr_t	attr;
+
+	/* A thread holds several nodes of a tree at once while walking it */
+	pthread_mutexattr_init( &attr );
+	pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+	pthread_mutex_init( &gExtentsNodeLock, &attr );
+	pthread_mutex_init( &gAttributesNodeLock, &attr );
+	pthread_mutexattr_destroy( &attr );
+}
+
+static void *
+AttrBTChkThread( void *arg )
+{
+	AttrBTWorker	*worker = arg;
+	struct timeval	start, end;
+
+	gettimeofday( &start, NULL );
+	worker->result = AttrBTRecordsChk( &worker->glob );
+	gettimeofday( &end, NULL );
+	timersub( &end, &start, &worker->wallTime );
+
+	return NULL;
+}
+
+/*
+ * Start the attributes btree check on its own thread, if -P was given
+ * and the volume allows it.  Returns NULL if the check should be done
+ * by AttrBTChk as usual.
+ */
+static AttrBTWorker *
+StartAttrBTChk( SGlobPtr GPtr )
+{
+	AttrBTWorker	*worker;
+	SFCB			*fcb = GPtr->calculatedAttributesFCB;
+	UInt64			mappedBlocks = 0;
+	int				i;
+
+	if ( state.parallel == 0 || GPtr->chkLevel == kPartialCheck ||
+		 VolumeObjectIsHFSPlus() == false || GPtr->calculatedVCB->vcbAttributesFile == NULL )
+		return NULL;
+
+	/* CheckPhysicalMatch (-B) keeps its state in globals */
+	if ( gBlkListEntries != 0 )
+		return NULL;
+
+	/*
+	 * Mapping a block of the attributes file past its fork record searches
+	 * the extents btree with the lastIterator of the btree, which the
+	 * catalog check also relies on.  Only go parallel if every node of
+	 * the attributes file is in the fork record.
+	 */
+	for ( i = 0; i < kHFSPlusExtentDensity; i++ )
+		mappedBlocks += fcb->fcbExtents32[i].blockCount;
+	if ( mappedBlocks * GPtr->calculatedVCB->vcbBlockSize < fcb->fcbPhysicalSize )
+		return NULL;
+
+	worker = calloc( 1, sizeof(AttrBTWorker) );
+	if ( worker == NULL )
+		return NULL;
+
+	worker->glob = *GPtr;
+	worker->glob.BTPTPtr			= &worker->btreePath;
+	worker->glob.ErrCode			= 0;
+	worker->glob.RepLevel			= repairLevelNoProblemsFound;
+	worker->glob.MinorRepairsP		= nil;
+	worker->glob.overlappedExtents	= nil;
+	worker->glob.userCancelProc		= nil;		//	progress is reported by the main thread
+	worker->glob.deferAttrAllocs	= true;
+	worker->startItems = GPtr->itemsProcessed;
+
+	pthread_once( &gNodeLocksOnce, InitNodeLocks );
+	GPtr->calculatedExtentsBTCB->nodeLock = &gExtentsNodeLock;
+	GPtr->calculatedAttributesBTCB->nodeLock = &gAttributesNodeLock;
+
+	if ( pthread_create( &worker->thread, NULL, AttrBTChkThread, worker ) != 0 ) {
+		GPtr->calculatedExtentsBTCB->nodeLock = NULL;
+		GPtr->calculatedAttributesBTCB->nodeLock = NULL;
+		free( worker );
+		return NULL;
+	}
+
+	return worker;
+}
+
+static void
+WaitForAttrBTChk( SGlobPtr GPtr, AttrBTWorker *worker )
+{
+	pthread_join( worker->thread, NULL );
+
+	GPtr->calculatedExtentsBTCB->nodeLock = NULL;
+	GPtr->calculatedAttributesBTCB->nodeLock = NULL;
+
+	if ( state.debug )
+		fsck_print(ctx, LOG_TYPE_INFO, "\tAttrBTRecordsChk thread: %ld.%06d secs elapsed\n",
+			(long)worker->wallTime.tv_sec, (int)worker->wallTime.tv_usec);
+}
+
+/*
+ * Copy what AttrBTRecordsChk changed in the worker's copy of the scavenger
+ * globals back into the main thread's, the way it would be if the check
+ * had run on this thread.
+ *
+ *	- Status flags and error codes are or'ed in or kept if worse, since
+ *	  the catalog check may have set its own meanwhile.
+ *	- The attribute counts, prime buckets and lastAttrInfo are only
+ *	  computed by the attributes check, so they are taken as they are.
+ *	- The repair orders and overlapping extents found by the worker are
+ *	  appended to those of the main thread (the overlap list by
+ *	  JoinAttrBTChk, which can fail).
+ *	- TarID, TarBlock, BTLevel, CNType, CName and BTPTPtr describe where
+ *	  the worker was in its walk, and are not merged.
+ *
+ * The worker shares the control blocks, FCBs, directory path table and
+ * file lists with the main thread by pointer, and must not replace them.
+ */
+static void
+MergeAttrBTWorkerGlobals( SGlobPtr GPtr, AttrBTWorker *worker )
+{
+	SGlobPtr		wPtr = &worker->glob;
+	RepairOrderPtr	*linkP;
+
+	assert( wPtr->calculatedVCB == GPtr->calculatedVCB );
+	assert( wPtr->calculatedExtentsBTCB == GPtr->calculatedExtentsBTCB );
+	assert( wPtr->calculatedAttributesBTCB == GPtr->calculatedAttributesBTCB );
+	assert( wPtr->FCBAPtr == GPtr->FCBAPtr );
+	assert( wPtr->DirPTPtr == GPtr->DirPTPtr );
+	assert( wPtr->validFilesList == GPtr->validFilesList );
+	assert( wPtr->fileIdentifierTable == GPtr->fileIdentifierTable );
+	assert( wPtr->missingThreadList == GPtr->missingThreadList );
+
+	GPtr->VIStat				|= wPtr->VIStat;
+	GPtr->ABTStat				|= wPtr->ABTStat;
+	GPtr->EBTStat				|= wPtr->EBTStat;
+	GPtr->CBTStat				|= wPtr->CBTStat;
+	GPtr->CatStat				|= wPtr->CatStat;
+	GPtr->VeryMinorErrorsStat	|= wPtr->VeryMinorErrorsStat;
+	GPtr->JStat					|= wPtr->JStat;
+	GPtr->PrintStat				|= wPtr->PrintStat;
+	if ( wPtr->ErrCode != 0 ) {
+		GPtr->ErrCode	= wPtr->ErrCode;
+		GPtr->IntErr	= wPtr->IntErr;
+	}
+	if ( wPtr->RepLevel > GPtr->RepLevel )
+		GPtr->RepLevel = wPtr->RepLevel;
+	if ( wPtr->minorRepairErrors )
+		GPtr->minorRepairErrors = true;
+	GPtr->itemsProcessed += wPtr->itemsProcessed - worker->startItems;
+
+	GPtr->attr_ea_count		= wPtr->attr_ea_count;
+	GPtr->attr_acl_count	= wPtr->attr_acl_count;
+	GPtr->ABTAttrBucket		= wPtr->ABTAttrBucket;
+	GPtr->ABTSecurityBucket	= wPtr->ABTSecurityBucket;
+	GPtr->lastAttrInfo		= wPtr->lastAttrInfo;
+
+	for ( linkP = &GPtr->MinorRepairsP; *linkP != nil; linkP = &(*linkP)->link )
+		;
+	*linkP = wPtr->MinorRepairsP;
+	wPtr->MinorRepairsP = nil;
+}
+
+/*
+ * Wait for the attributes btree thread and merge what it found into
+ * the scavenger globals.
+ */
+static OSErr
+JoinAttrBTChk( SGlobPtr GPtr, AttrBTWorker *worker )
+{
+	SGlobPtr		wPtr = &worker->glob;
+	OSErr			err;
+
+	WaitForAttrBTChk( GPtr, worker );
+	MergeAttrBTWorkerGlobals( GPtr, worker );
+
+	err = MergeOverlapList( GPtr, wPtr->overlappedExtents );
+
+	//	Allocation errors come first, as they would have been found during the btree walk
+	if ( err == noErr )
+		err = CheckDeferredAttrAllocations( GPtr, wPtr->deferredAttrAllocs, wPtr->numDeferredAttrAllocs );
+	if ( err == noErr )
+		err = worker->result;
+
+	if ( wPtr->deferredAttrAllocs != NULL )
+		free( wPtr->deferredAttrAllocs );
+	free( worker );
+
+	return( err );
+}
+
+/*
+ * Wait for the attributes btree thread and throw away what it found,
+ * because the verify stopped before the attributes btree check.
+ */
+static void
+DiscardAttrBTChk( SGlobPtr GPtr, AttrBTWorker *worker )
+{
+	SGlobPtr		wPtr = &worker->glob;
+	RepairOrderPtr	rP;
+	UInt32			i;
+
+	WaitForAttrBTChk( GPtr, worker );
+
+	while ( (rP = wPtr->MinorRepairsP) != nil ) {
+		wPtr->MinorRepairsP = rP->link;
+		DisposeMemory( rP );
+	}
+
+	if ( wPtr->overlappedExtents != nil ) {
+		for ( i = 0; i < (**wPtr->overlappedExtents).count; i++ ) {
+			if ( (**wPtr->overlappedExtents).extentInfo[i].attrname )
+				free( (**wPtr->overlappedExtents).extentInfo[i].attrname );
+		}
+		DisposeHandle( (Handle) wPtr->overlappedExtents );
+	}
+
+	if ( wPtr->deferredAttrAllocs != NULL )
+		free( wPtr->deferredAttrAllocs );
+	free( worker );
+}
+
+
 /*------------------------------------------------------------------------------
 
 Function:	ScavCtrl - (Scavenger Control)
@@ -565,12 +858,7 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 {
 	OSErr			result;
 	unsigned int		stat;
-#if SHOW_ELAPSED_TIMES
-	struct timeval 	myStartTime;
-	struct timeval 	myEndTime;
-	struct timeval 	myElapsedTime;
-	struct timezone zone;
-#endif
+	AttrBTWorker		*attrWorker = NULL;
 
 	//
 	//	initialize some stuff
@@ -717,31 +1005,22 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 	
 		case scavVerify:								//	VERIFY
 		{
+			PhaseTimer	timer;
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myStartTime, &zone );
-#endif
+			StartPhaseTimer( &timer );
 
 			/* Initialize volume bitmap structure */
 			if ( BitMapCheckBegin(GPtr) != 0)
 				break;
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myEndTime, &zone );
-			timersub( &myEndTime, &myStartTime, &myElapsedTime );
-			fsck_print(ctx, LOG_TYPE_INFO, "\n%s - BitMapCheck elapsed time \n", __FUNCTION__ );
-			fsck_print(ctx, LOG_TYPE_INFO, "########## secs %d msecs %d \n\n",
-				myElapsedTime.tv_sec, myElapsedTime.tv_usec );
-#endif
+			PrintPhaseTimer( &timer, "BitMapCheckBegin" );
 
 			if ( IsBlueBoxSharedDrive( GPtr->DrvPtr ) )
 				break;
 			if ( ( result = CheckForStop( GPtr ) ) )
 				break;
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myStartTime, &zone );
-#endif
+			StartPhaseTimer( &timer );
 
 			/* Create calculated BTree structures */
 			if ( ( result = CreateExtentsBTreeControlBlock( GPtr ) ) )	
@@ -753,13 +1032,7 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			if ( ( result = CreateExtendedAllocationsFCB( GPtr ) ) )
 				break;
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myEndTime, &zone );
-			timersub( &myEndTime, &myStartTime, &myElapsedTime );
-			fsck_print(ctx, LOG_TYPE_INFO, "\n%s - create control blocks elapsed time \n", __FUNCTION__ );
-			fsck_print(ctx, LOG_TYPE_INFO, ">>>>>>>>>>>>> secs %d msecs %d \n\n",
-				myElapsedTime.tv_sec, myElapsedTime.tv_usec );
-#endif
+			PrintPhaseTimer( &timer, "create control blocks" );
 
 			//	Now that preflight of the BTree structures is calculated, compute the CheckDisk items
 			CalculateItemCount( GPtr, &GPtr->itemsToProcess, &GPtr->onePercent );
@@ -771,24 +1044,29 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			GPtr->itemsProcessed += GPtr->onePercent;	// We do this 4 times as set up in CalculateItemCount() to smooth the scroll
 			fsckPrintFormat(GPtr->context, hfsExtBTCheck);
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myStartTime, &zone );
-#endif
+			StartPhaseTimer( &timer );
 				
-			/* Verify extent btree structure */
+			/*
+			 * Verify extent btree structure.  This is not done in parallel
+			 * even with -P: the catalog and attributes checks map the
+			 * overflow extents of their files through the extents btree,
+			 * so it has to be known good before either of them starts.
+			 */
 			if ((result = ExtBTChk(GPtr)))
 				break;
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myEndTime, &zone );
-			timersub( &myEndTime, &myStartTime, &myElapsedTime );
-			fsck_print(ctx, LOG_TYPE_INFO, "\n%s - ExtBTChk elapsed time \n", __FUNCTION__ );
-			fsck_print(ctx, LOG_TYPE_INFO, ">>>>>>>>>>>>> secs %d msecs %d \n\n",
-				myElapsedTime.tv_sec, myElapsedTime.tv_usec );
-#endif
+			PrintPhaseTimer( &timer, "ExtBTChk" );
 				
 			if ((result = CheckForStop(GPtr)))
 				break;
+
+			/* 
+			 * The attributes btree check does not depend on the catalog
+			 * btree check until the very end, so with -P start it now on
+			 * its own thread.  The extents btree has been checked, so
+			 * from here on both threads only read it.
+			 */
+			attrWorker = StartAttrBTChk( GPtr );
 			
 			GPtr->itemsProcessed += GPtr->onePercent;	// We do this 4 times as set up in CalculateItemCount() to smooth the scroll
 
@@ -802,9 +1080,7 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			GPtr->itemsProcessed += GPtr->onePercent;
 			fsckPrintFormat(GPtr->context, hfsCatBTCheck);
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myStartTime, &zone );
-#endif
+			StartPhaseTimer( &timer );
 				
 			if ( GPtr->chkLevel == kPartialCheck )
 			{
@@ -832,12 +1108,8 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
                 break;
             }
             
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myEndTime, &zone );
-			timersub( &myEndTime, &myStartTime, &myElapsedTime );
-			fsck_print(ctx, LOG_TYPE_INFO, ">>>>>>>>>>>>> secs %d msecs %d \n\n",
-				myElapsedTime.tv_sec, myElapsedTime.tv_usec );
-#endif
+			PrintPhaseTimer( &timer, "CheckCatalogBTree" );
+
             result = CheckForStop(GPtr);
             if (result) {
                 break;
@@ -846,9 +1118,7 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 			if (state.scanflag == 0) {
 				fsckPrintFormat(GPtr->context, hfsCatHierCheck);
 
-#if SHOW_ELAPSED_TIMES
-				gettimeofday( &myStartTime, &zone );
-#endif
+				StartPhaseTimer( &timer );
 				
 				/* Check catalog hierarchy */
                 result = CatHChk(GPtr);
@@ -856,39 +1126,52 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
                     break;
                 }
 
-#if SHOW_ELAPSED_TIMES
-				gettimeofday( &myEndTime, &zone );
-				timersub( &myEndTime, &myStartTime, &myElapsedTime );
-				fsck_print(ctx, LOG_TYPE_INFO, "\n%s - CatHChk elapsed time \n", __FUNCTION__ );
-				fsck_print(ctx, LOG_TYPE_INFO, ">>>>>>>>>>>>> secs %d msecs %d \n\n",
-					myElapsedTime.tv_sec, myElapsedTime.tv_usec );
-#endif
+				PrintPhaseTimer( &timer, "CatHChk" );
+
                 result = CheckForStop(GPtr);
                 if (result) {
                     break;
                 }
                 
 				if (VolumeObjectIsHFSX(GPtr)) {
+					StartPhaseTimer( &timer );
+
 					result = CheckFolderCount(GPtr);
                     if (result) {
                         break;
                     }
                     
+					PrintPhaseTimer( &timer, "CheckFolderCount" );
+
                     result=CheckForStop(GPtr);
                     if (result) {
                         break;
                     }
 				}
 			}
+
+			StartPhaseTimer( &timer );
+
 			/* Check attribute btree.  The function accounts for all extents
 			 * for extended attributes whose values are stored in 
 			 * allocation blocks
 			 */
-            result = AttrBTChk(GPtr);
+			if (attrWorker != NULL) {
+				fsckPrintFormat(GPtr->context, hfsExtAttrBTCheck);
+				result = JoinAttrBTChk(GPtr, attrWorker);
+				attrWorker = NULL;
+				if (result == noErr) {
+					result = AttrBTFinishChk(GPtr);
+				}
+			} else {
+				result = AttrBTChk(GPtr);
+			}
             if (result) {
                 break;
             }
             
+			PrintPhaseTimer( &timer, "AttrBTChk" );
+
             result = CheckForStop(GPtr);
             if (result) {
                 break;
@@ -932,9 +1215,7 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 
 			fsckPrintFormat(GPtr->context, hfsVolBitmapCheck);
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myStartTime, &zone );
-#endif
+			StartPhaseTimer( &timer );
 				
 			/* Compare in-memory volume bitmap with on-disk bitmap */
             result = CheckVolumeBitMap(GPtr, false);
@@ -942,13 +1223,7 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
                 break;
             }
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myEndTime, &zone );
-			timersub( &myEndTime, &myStartTime, &myElapsedTime );
-			fsck_print(ctx, LOG_TYPE_INFO, "\n%s - CheckVolumeBitMap elapsed time \n", __FUNCTION__ );
-			fsck_print(ctx, LOG_TYPE_INFO, ">>>>>>>>>>>>> secs %d msecs %d \n\n",
-				myElapsedTime.tv_sec, myElapsedTime.tv_usec );
-#endif 
+			PrintPhaseTimer( &timer, "CheckVolumeBitMap" );
             
             result = CheckForStop(GPtr);
             if (result) {
@@ -957,9 +1232,7 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 
 			fsckPrintFormat(GPtr->context, hfsVolInfoCheck);
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myStartTime, &zone );
-#endif
+			StartPhaseTimer( &timer );
 
 			/* Verify volume level information */
             result = VInfoChk(GPtr);
@@ -967,13 +1240,7 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
                 break;
             }
 
-#if SHOW_ELAPSED_TIMES
-			gettimeofday( &myEndTime, &zone );
-			timersub( &myEndTime, &myStartTime, &myElapsedTime );
-			fsck_print(ctx, LOG_TYPE_INFO, "\n%s - VInfoChk elapsed time \n", __FUNCTION__ );
-			fsck_print(ctx, LOG_TYPE_INFO, ">>>>>>>>>>>>> secs %d msecs %d \n\n",
-				myElapsedTime.tv_sec, myElapsedTime.tv_usec );
-#endif
+			PrintPhaseTimer( &timer, "VInfoChk" );
 
 			stat =	GPtr->VIStat  | GPtr->ABTStat | GPtr->EBTStat | GPtr->CBTStat | 
 					GPtr->CatStat | GPtr->JStat;
@@ -1027,6 +1294,10 @@ void ScavCtrl( SGlobPtr GPtr, UInt32 ScavOp, short *ScavRes )
 		}
 	}													//	end ScavOp switch
 
+	//	The verify stopped before it needed the attributes btree results
+	if ( attrWorker != NULL )
+		DiscardAttrBTChk( GPtr, attrWorker );
+
 
 	//
 	//	Map internal error codes to scavenger result codes
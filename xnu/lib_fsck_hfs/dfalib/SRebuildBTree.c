@@ -74,6 +74,39 @@ void SETOFFSET ( void *buffer, UInt16 btNodeSize, SInt16 recOffset, SInt16 vecOf
 #define SETOFFSET( buf,ndsiz,offset,rec )		\
 	( *(SInt16 *)((UInt8 *)(buf) + (ndsiz) + (-2 * (rec))) = (offset) )
 
+/*
+ * Leaf records gathered for a bulk rebuild.  BTScanNextRecord returns them
+ * in physical node order, so they are copied out, sorted with the tree's
+ * key compare routine and handed to BTBulkLoad, which writes the nodes in
+ * one pass.  They are filled to kRebuildFillPercent, not packed, so that
+ * the first inserts after the volume is mounted don't split every leaf.
+ * Each record is a UInt16 data size followed by the key (padded to an even
+ * length) and the data.
+ */
+#define kRebuildFillPercent		90
+#define kRebuildChunkSize		(1024 * 1024)
+
+typedef struct RebuildChunk {
+	struct RebuildChunk *	next;
+	UInt32					used;
+	UInt8					data[kRebuildChunkSize];
+} RebuildChunk;
+
+typedef struct RebuildRecords {
+	BTreeControlBlock *		btcb;
+	RebuildChunk *			chunks;
+	UInt8 **				records;
+	UInt32					count;
+	UInt32					capacity;
+	UInt32					next;		/* next record for BTBulkLoad */
+} RebuildRecords;
+
+static OSErr	AddRebuildRecord( RebuildRecords * theRecords, BTreeKey * theKeyPtr,
+								  void * theDataPtr, UInt16 theDataSize );
+static OSErr	BulkLoadRebuildRecords( SFCB * theFCBPtr, RebuildRecords * theRecords );
+static OSErr	InsertRebuildRecords( SFCB * theFCBPtr, RebuildRecords * theRecords );
+static void		FreeRebuildRecords( RebuildRecords * theRecords );
+
 
 //_________________________________________________________________________________
 //
@@ -137,6 +170,8 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 	OSErr					myErr;
 	Boolean 				isHFSPlus;
 	UInt32					numRecords = 0;
+	Boolean					bulkLoad = true;
+	RebuildRecords			myRecords;
 	
 #if SHOW_ELAPSED_TIMES 
 	struct timeval 			myStartTime;
@@ -148,6 +183,7 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 	theSGlobPtr->TarID = FileID;
 	theSGlobPtr->TarBlock = 0;
 	myBlockDescriptor.buffer = NULL;
+	ClearMemory( &myRecords, sizeof(myRecords) );
 	myVCBPtr = theSGlobPtr->calculatedVCB;
 	if (kHFSCatalogFileID == FileID) {
 		oldFCBPtr = theSGlobPtr->calculatedCatalogFCB;
@@ -261,6 +297,7 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 		goto ExitThisRoutine;
 	}
 	myFCBPtr = theSGlobPtr->calculatedRepairFCB;
+	myRecords.btcb = theSGlobPtr->calculatedRepairBTCB;
 
 #if SHOW_ELAPSED_TIMES
 	gettimeofday( &myStartTime, &zone );
@@ -310,6 +347,35 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 			break;  // this implementation does not handle partial rebuilds (all or none)
 		}
 
+		if ( bulkLoad )
+		{
+			myErr = AddRebuildRecord( &myRecords, myCurrentKeyPtr, myCurrentDataPtr, myDataSize );
+			if ( noErr == myErr )
+			{
+				numRecords++;
+				continue;
+			}
+			if ( memFullErr != myErr )
+			{
+				myErr = R_RFail;
+				break;
+			}
+
+			/* out of memory, so insert what we have and go on one record at a time */
+			if (state.debug)
+				fsck_print(ctx, LOG_TYPE_INFO, "btree file %d:  no memory for a bulk rebuild after %u records\n", FileID, numRecords);
+			bulkLoad = false;
+			myErr = InsertRebuildRecords( myFCBPtr, &myRecords );
+			FreeRebuildRecords( &myRecords );
+			if ( noErr != myErr )
+			{
+				if (dskFulErr == myErr)
+					fsckPrintFormat(theSGlobPtr->context, E_DiskFull);
+				myErr = R_RFail;
+				break;
+			}
+		}
+
 		/* insert this record into the new btree file */
 		myErr = InsertBTreeRecord( myFCBPtr, myCurrentKeyPtr,
 								   myCurrentDataPtr, myDataSize, &myHint );
@@ -343,6 +409,25 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 #endif
 	}
 
+	if ( btNotFound == myErr )
+		myErr = noErr;
+
+	if ( noErr == myErr && bulkLoad )
+	{
+		myErr = BulkLoadRebuildRecords( myFCBPtr, &myRecords );
+		if ( noErr != myErr )
+		{
+#if DEBUG_REBUILD 
+			fsck_print(ctx, LOG_TYPE_INFO, "%s - BulkLoadRebuildRecords failed with err %d 0x%02X \n",
+				__FUNCTION__, myErr, myErr );
+#endif
+			if (dskFulErr == myErr)
+				fsckPrintFormat(theSGlobPtr->context, E_DiskFull);
+			myErr = R_RFail;
+		}
+		FreeRebuildRecords( &myRecords );
+	}
+
 #if SHOW_ELAPSED_TIMES
 	gettimeofday( &myEndTime, &zone );
 	timersub( &myEndTime, &myStartTime, &myElapsedTime );
@@ -350,8 +435,6 @@ OSErr	RebuildBTree( SGlobPtr theSGlobPtr, int FileID )
 	fsck_print(ctx, LOG_TYPE_INFO, ">>>>>>>>>>>>> secs %d msecs %d \n\n", myElapsedTime.tv_sec, myElapsedTime.tv_usec );
 #endif
 
-	if ( btNotFound == myErr )
-		myErr = noErr;
 	if ( noErr != myErr )
 		goto ExitThisRoutine;
 
@@ -428,6 +511,7 @@ ExitThisRoutine:
 	if ( myBlockDescriptor.buffer != NULL )
 		(void) ReleaseVolumeBlock( myVCBPtr, &myBlockDescriptor, kReleaseBlock );
 
+	FreeRebuildRecords( &myRecords );
 	if ( myErr != noErr && myFCBPtr != NULL ) 
 		(void) DeleteBTree( theSGlobPtr, myFCBPtr );
 	BTScanTerminate( &theSGlobPtr->scanState  );
@@ -436,6 +520,201 @@ ExitThisRoutine:
 	
 } /* RebuildBTree */
 
+
+/*
+ * AddRebuildRecord
+ *
+ * Copy one leaf record into the gathered set for a bulk rebuild.
+ * Returns memFullErr when the copy can't be made, so the caller can
+ * fall back to inserting records one at a time.
+ */
+
+static OSErr AddRebuildRecord( RebuildRecords * theRecords, BTreeKey * theKeyPtr,
+							   void * theDataPtr, UInt16 theDataSize )
+{
+	BTreeControlBlock *	myBTreeCBPtr = theRecords->btcb;
+	RebuildChunk *		myChunkPtr;
+	UInt8 *				myRecordPtr;
+	UInt32				myKeySize;
+	UInt32				myKeyLength;
+	UInt32				mySize;
+
+	myKeyLength = (myBTreeCBPtr->attributes & kBTBigKeysMask) ? theKeyPtr->length16 : theKeyPtr->length8;
+	if ( myKeyLength < 6 || myKeyLength > myBTreeCBPtr->maxKeyLength )
+		return( fsBTInvalidKeyLengthErr );
+
+	myKeySize = CalcKeySize( myBTreeCBPtr, theKeyPtr );
+	if ( myKeySize & 1 )
+		myKeySize++;
+	mySize = sizeof(UInt16) + myKeySize + theDataSize;
+	if ( mySize & 1 )
+		mySize++;
+
+	if ( theRecords->count == theRecords->capacity )
+	{
+		UInt32		myCapacity = theRecords->capacity ? theRecords->capacity * 2 : 4096;
+		UInt8 **	myArray;
+
+		myArray = realloc( theRecords->records, myCapacity * sizeof(UInt8 *) );
+		if ( myArray == NULL )
+			return( memFullErr );
+		theRecords->records = myArray;
+		theRecords->capacity = myCapacity;
+	}
+
+	myChunkPtr = theRecords->chunks;
+	if ( myChunkPtr == NULL || myChunkPtr->used + mySize > kRebuildChunkSize )
+	{
+		myChunkPtr = malloc( sizeof(RebuildChunk) );
+		if ( myChunkPtr == NULL )
+			return( memFullErr );
+		myChunkPtr->next = theRecords->chunks;
+		myChunkPtr->used = 0;
+		theRecords->chunks = myChunkPtr;
+	}
+
+	myRecordPtr = &myChunkPtr->data[ myChunkPtr->used ];
+	myChunkPtr->used += mySize;
+
+	*(UInt16 *) myRecordPtr = theDataSize;
+	CopyMemory( theKeyPtr, myRecordPtr + sizeof(UInt16), CalcKeySize( myBTreeCBPtr, theKeyPtr ) );
+	CopyMemory( theDataPtr, myRecordPtr + sizeof(UInt16) + myKeySize, theDataSize );
+
+	theRecords->records[ theRecords->count++ ] = myRecordPtr;
+
+	return( noErr );
+
+} /* AddRebuildRecord */
+
+
+/*
+ * CompareRebuildRecords
+ *
+ * qsort routine for gathered records; uses the key compare routine of
+ * the tree being rebuilt.
+ */
+
+static BTreeControlBlock *	gRebuildBTreeCBPtr;
+
+static int CompareRebuildRecords( const void * theLeft, const void * theRight )
+{
+	BTreeKey *	myLeftKeyPtr = (BTreeKey *)(*(UInt8 * const *) theLeft + sizeof(UInt16));
+	BTreeKey *	myRightKeyPtr = (BTreeKey *)(*(UInt8 * const *) theRight + sizeof(UInt16));
+	SInt32		myResult;
+
+	myResult = CompareKeys( gRebuildBTreeCBPtr, myLeftKeyPtr, myRightKeyPtr );
+
+	return( (myResult > 0) - (myResult < 0) );
+
+} /* CompareRebuildRecords */
+
+
+/*
+ * NextRebuildRecord
+ *
+ * BTBulkLoad callback; hands out the sorted records in order.
+ */
+
+static OSStatus NextRebuildRecord( void * theState, BTreeKeyPtr * theKeyPtr,
+								   UInt8 ** theDataPtr, UInt16 * theDataSize )
+{
+	RebuildRecords *	myRecords = theState;
+	UInt8 *				myRecordPtr;
+	UInt32				myKeySize;
+
+	if ( myRecords->next == myRecords->count )
+		return( fsBTEndOfIterationErr );
+
+	myRecordPtr = myRecords->records[ myRecords->next++ ];
+	*theKeyPtr = (BTreeKeyPtr)(myRecordPtr + sizeof(UInt16));
+	myKeySize = CalcKeySize( myRecords->btcb, *theKeyPtr );
+	if ( myKeySize & 1 )
+		myKeySize++;
+	*theDataPtr = myRecordPtr + sizeof(UInt16) + myKeySize;
+	*theDataSize = *(UInt16 *) myRecordPtr;
+
+	return( noErr );
+
+} /* NextRebuildRecord */
+
+
+/*
+ * BulkLoadRebuildRecords
+ *
+ * Sort the gathered records and load them into the new (empty) B-Tree.
+ * Duplicate keys make BTBulkLoad fail, which fails the rebuild just as
+ * a failed insert would.
+ */
+
+static OSErr BulkLoadRebuildRecords( SFCB * theFCBPtr, RebuildRecords * theRecords )
+{
+	OSErr		myErr;
+
+	gRebuildBTreeCBPtr = theRecords->btcb;
+	qsort( theRecords->records, theRecords->count, sizeof(UInt8 *), CompareRebuildRecords );
+	gRebuildBTreeCBPtr = NULL;
+
+	theRecords->next = 0;
+	myErr = BTBulkLoad( theFCBPtr, NextRebuildRecord, theRecords, kRebuildFillPercent );
+
+	if ( state.debug && noErr == myErr )
+		fsck_print(ctx, LOG_TYPE_INFO, "btree file %u:  bulk loaded %u records, depth %u, %u of %u nodes used\n",
+			theFCBPtr->fcbFileID, theRecords->count, theRecords->btcb->treeDepth,
+			theRecords->btcb->totalNodes - theRecords->btcb->freeNodes, theRecords->btcb->totalNodes);
+
+	return( myErr );
+
+} /* BulkLoadRebuildRecords */
+
+
+/*
+ * InsertRebuildRecords
+ *
+ * Insert the records gathered so far one at a time.  Used when we run
+ * out of memory part way through gathering.
+ */
+
+static OSErr InsertRebuildRecords( SFCB * theFCBPtr, RebuildRecords * theRecords )
+{
+	OSErr		myErr;
+	BTreeKeyPtr	myKeyPtr;
+	UInt8 *		myDataPtr;
+	UInt16		myDataSize;
+	UInt32		myHint;
+
+	theRecords->next = 0;
+	while ( NextRebuildRecord( theRecords, &myKeyPtr, &myDataPtr, &myDataSize ) == noErr )
+	{
+		myErr = InsertBTreeRecord( theFCBPtr, myKeyPtr, myDataPtr, myDataSize, &myHint );
+		if ( noErr != myErr )
+			return( myErr );
+	}
+
+	return( noErr );
+
+} /* InsertRebuildRecords */
+
+
+/*
+ * FreeRebuildRecords
+ */
+
+static void FreeRebuildRecords( RebuildRecords * theRecords )
+{
+	RebuildChunk *	myChunkPtr;
+
+	while ( (myChunkPtr = theRecords->chunks) != NULL )
+	{
+		theRecords->chunks = myChunkPtr->next;
+		free( myChunkPtr );
+	}
+	if ( theRecords->records != NULL )
+		free( theRecords->records );
+	theRecords->records = NULL;
+	theRecords->count = theRecords->capacity = theRecords->next = 0;
+
+} /* FreeRebuildRecords */
+
 //_________________________________________________________________________________
 //
 //	Routine:	CreateNewBTree
@@ -380,6 +380,8 @@ extern OSStatus  GetFileBlock (SFCB *file, UInt32 blockNum, GetBlockOptions opti
 extern OSStatus  ReleaseFileBlock (SFCB *file, BlockDescriptor *block,
 				ReleaseBlockOptions options);
 
+extern void      PrefetchFileBlocks (SFCB *file, UInt32 *blockNums, UInt32 count);
+
 extern OSStatus  SetFileBlockSize (SFCB *file, ByteCount blockSize);
 
 
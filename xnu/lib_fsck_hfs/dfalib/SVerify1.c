@@ -31,6 +31,11 @@
 
 */
 
+/*
+ * xnu/tests/fsck_overlap_test.c builds only the overlapping extent
+ * routines, with FSCK_OVERLAP_TEST defined.
+ */
+#ifndef FSCK_OVERLAP_TEST
 #include "Scavenger.h"
 #include "cache.h"
 #include <stdlib.h>
@@ -59,18 +64,42 @@ static	OSErr	CheckNodesFirstOffset( SGlobPtr GPtr, BTreeControlBlock *btcb );
 
 static OSErr	ScavengeVolumeType( SGlobPtr GPtr, HFSMasterDirectoryBlock *mdb, UInt32 *volumeType );
 static OSErr	SeekVolumeHeader( SGlobPtr GPtr, UInt64 startSector, UInt32 numSectors, UInt64 *vHSector );
+#endif /* !FSCK_OVERLAP_TEST */
+
+/*
+ * Index of the overlap list used by FindOrigOverlapFiles: the extents
+ * sorted by start block, each with the largest end block of it and the
+ * extents before it.  An extent overlaps some extent of the list iff the
+ * last entry that starts before its end has maxEndBlock past its start.
+ */
+typedef struct OverlapInterval {
+	UInt32	startBlock;
+	UInt64	maxEndBlock;
+} OverlapInterval;
+
+typedef struct OverlapIndex {
+	UInt32			count;
+	OverlapInterval	*intervals;
+} OverlapIndex;
 
 /* overlapping extents verification functions prototype */
 static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber, const char *attrName, UInt32 extentStartBlock, UInt32 extentBlockCount, UInt8 forkType );
 
-static	Boolean	ExtentInfoExists( ExtentsTable **extentsTableH, ExtentInfo *extentInfo);
+static void		UniqueOverlapList( SGlobPtr GPtr );
+
+static int		CompareExtentInfo( const void *first, const void *second );
 
-static void CheckHFSPlusExtentRecords(SGlobPtr GPtr, UInt32 fileID, const char *attrname, HFSPlusExtentRecord extent, UInt8 forkType); 
+static OSErr	BuildOverlapIndex( ExtentsTable **extentsTableH, OverlapIndex *index );
 
-static void CheckHFSExtentRecords(SGlobPtr GPtr, UInt32 fileID, HFSExtentRecord extent, UInt8 forkType);
+static int		CompareOverlapInterval( const void *first, const void *second );
 
-static Boolean DoesOverlap(SGlobPtr GPtr, UInt32 fileID, const char *attrname, UInt32 startBlock, UInt32 blockCount, UInt8 forkType); 
+static void CheckHFSPlusExtentRecords(SGlobPtr GPtr, const OverlapIndex *index, UInt32 fileID, const char *attrname, HFSPlusExtentRecord extent, UInt8 forkType); 
 
+static void CheckHFSExtentRecords(SGlobPtr GPtr, const OverlapIndex *index, UInt32 fileID, HFSExtentRecord extent, UInt8 forkType);
+
+static Boolean DoesOverlap(SGlobPtr GPtr, const OverlapIndex *index, UInt32 fileID, const char *attrname, UInt32 startBlock, UInt32 blockCount, UInt8 forkType); 
+
+#ifndef FSCK_OVERLAP_TEST
 static int CompareExtentFileID(const void *first, const void *second);
 
 /*
@@ -2285,26 +2314,52 @@ static void setLastAttrAllocInfo(SGlobPtr GPtr, u_int32_t totalBlocks,
  *				zero - no error
  *				non-zero - error
  */
-static int CheckLastAttrAllocation(SGlobPtr GPtr) 
+static int CheckAttrAllocation(SGlobPtr GPtr, attributeInfo *attrInfo) 
 {
 	int result = 0;
 	u_int64_t bytes;
 
+	if (attrInfo->totalBlocks != attrInfo->calculatedTotalBlocks) {
+		result = RecordBadAllocation(attrInfo->fileID, 
+					attrInfo->attrname, kEAData, 
+					attrInfo->totalBlocks, 
+					attrInfo->calculatedTotalBlocks);
+	} else {
+		bytes = (u_int64_t)attrInfo->calculatedTotalBlocks * 
+				(u_int64_t)GPtr->calculatedVCB->vcbBlockSize;
+		if (attrInfo->logicalSize > bytes) {
+			result = RecordTruncation(attrInfo->fileID,
+						attrInfo->attrname, kEAData, 
+						attrInfo->logicalSize, bytes);
+		}
+	}
+
+	return (result);
+}
+
+static int CheckLastAttrAllocation(SGlobPtr GPtr) 
+{
+	int result = 0;
+	attributeInfo *newList;
+
 	if (GPtr->lastAttrInfo.isValid == true) {
-		if (GPtr->lastAttrInfo.totalBlocks != 
-			GPtr->lastAttrInfo.calculatedTotalBlocks) {
-			result = RecordBadAllocation(GPtr->lastAttrInfo.fileID, 
-						GPtr->lastAttrInfo.attrname, kEAData, 
-						GPtr->lastAttrInfo.totalBlocks, 
-						GPtr->lastAttrInfo.calculatedTotalBlocks);
-		} else {
-			bytes = (u_int64_t)GPtr->lastAttrInfo.calculatedTotalBlocks * 
-					(u_int64_t)GPtr->calculatedVCB->vcbBlockSize;
-			if (GPtr->lastAttrInfo.logicalSize > bytes) {
-				result = RecordTruncation(GPtr->lastAttrInfo.fileID,
-							GPtr->lastAttrInfo.attrname, kEAData, 
-							GPtr->lastAttrInfo.logicalSize, bytes);
+		if (GPtr->deferAttrAllocs == true) {
+			/* 
+			 * RecordBadAllocation and RecordTruncation look up the
+			 * file's path in the catalog btree, which is being checked
+			 * on the other thread.  Save the information and let
+			 * CheckDeferredAttrAllocations do it later.
+			 */
+			newList = realloc(GPtr->deferredAttrAllocs, 
+					(GPtr->numDeferredAttrAllocs + 1) * sizeof(attributeInfo));
+			if (newList == NULL) {
+				result = memFullErr;
+			} else {
+				GPtr->deferredAttrAllocs = newList;
+				newList[GPtr->numDeferredAttrAllocs++] = GPtr->lastAttrInfo;
 			}
+		} else {
+			result = CheckAttrAllocation(GPtr, &GPtr->lastAttrInfo);
 		}
 
 		/* Invalidate information in the global structure */
@@ -2314,6 +2369,33 @@ static int CheckLastAttrAllocation(SGlobPtr GPtr)
 	return (result);
 }
 
+/* 
+ * Function: CheckDeferredAttrAllocations
+ *
+ * Description:
+ *	Checks the allocation block information saved by CheckLastAttrAllocation
+ *	while the attributes btree was being checked on its own thread.
+ *
+ * Input:	GPtr - pointer to scavenger global area
+ *		attrInfo - saved attribute information
+ *		count - number of entries in attrInfo
+ *
+ * Output:	int - function result:			
+ *				zero - no error
+ *				non-zero - error
+ */
+int CheckDeferredAttrAllocations(SGlobPtr GPtr, attributeInfo *attrInfo, UInt32 count)
+{
+	int result = 0;
+	UInt32 i;
+
+	for (i = 0; i < count && result == 0; i++) {
+		result = CheckAttrAllocation(GPtr, &attrInfo[i]);
+	}
+
+	return (result);
+}
+
 /*------------------------------------------------------------------------------
 Function:	CheckAttributeRecord
 
@@ -2756,6 +2838,33 @@ OSErr AttrBTChk( SGlobPtr GPtr )
 	//	Write the status message here to avoid potential confusion to user.
 	fsckPrintFormat(GPtr->context, hfsExtAttrBTCheck);
 
+	err = AttrBTRecordsChk( GPtr );
+	ReturnIfError( err );
+
+	return( AttrBTFinishChk( GPtr ) );
+}
+
+
+/*------------------------------------------------------------------------------
+
+Function:	AttrBTRecordsChk - (Attributes BTree Records Check)
+
+Function:	Verifies the attributes BTree structure, its records and its
+			allocation map.  Does not depend on the catalog BTree check,
+			so fsck_hfs -P runs it on a second thread while the catalog
+			is checked.
+			
+Input:		GPtr		-	pointer to scavenger global area
+
+Output:		AttrBTRecordsChk	-	function result:			
+								0	= no error
+								n 	= error code 
+------------------------------------------------------------------------------*/
+
+OSErr AttrBTRecordsChk( SGlobPtr GPtr )
+{
+	OSErr					err;
+
 	//	Set up
 	GPtr->TarID		= kHFSAttributesFileID;				//	target = attributes file
 	GetVolumeObjectBlockNum( &GPtr->TarBlock );			//	target block = VHB/MDB
@@ -2774,14 +2883,6 @@ OSErr AttrBTChk( SGlobPtr GPtr )
 	//  record the last fileID for Chinese Remainder Theorem comparison
 	RecordLastAttrBits(GPtr);
 
-	//	compare the attributes prime buckets calculated from catalog btree and attribute btree 
-	err = CompareXattrPrimeBuckets(GPtr, kHFSHasAttributesMask);
-	ReturnIfError( err );
-
-	//	compare the security prime buckets calculated from catalog btree and attribute btree 
-	err = CompareXattrPrimeBuckets(GPtr, kHFSHasSecurityMask);
-	ReturnIfError( err );
-
 	//
 	//	check out the allocation map structure
 	//
@@ -2793,8 +2894,43 @@ OSErr AttrBTChk( SGlobPtr GPtr )
 	// Make sure unused nodes in the B-tree are zero filled.
 	//
 	err = BTCheckUnusedNodes(GPtr, kCalculatedAttributesRefNum, &GPtr->ABTStat);
+
+	return( err );
+}
+
+
+/*------------------------------------------------------------------------------
+
+Function:	AttrBTFinishChk - (Attributes BTree Finish Check)
+
+Function:	Compares the extended attribute information gathered from the
+			catalog and attributes BTrees, and the attributes BTree header
+			and map with what is on disk.  Must run after both
+			CheckCatalogBTree and AttrBTRecordsChk.
+			
+Input:		GPtr		-	pointer to scavenger global area
+
+Output:		AttrBTFinishChk	-	function result:			
+								0	= no error
+								n 	= error code 
+------------------------------------------------------------------------------*/
+
+OSErr AttrBTFinishChk( SGlobPtr GPtr )
+{
+	OSErr					err;
+
+	//	Set up
+	GPtr->TarID		= kHFSAttributesFileID;				//	target = attributes file
+	GetVolumeObjectBlockNum( &GPtr->TarBlock );			//	target block = VHB/MDB
+
+	//	compare the attributes prime buckets calculated from catalog btree and attribute btree 
+	err = CompareXattrPrimeBuckets(GPtr, kHFSHasAttributesMask);
 	ReturnIfError( err );
-	
+
+	//	compare the security prime buckets calculated from catalog btree and attribute btree 
+	err = CompareXattrPrimeBuckets(GPtr, kHFSHasSecurityMask);
+	ReturnIfError( err );
+
 	//
 	//	compare BTree header record on disk with scavenger's BTree header record 
 	//
@@ -3618,10 +3754,24 @@ printpath(SGlobPtr GPtr, UInt32 fileID)
 	fsck_print(ctx, LOG_TYPE_INFO, "\"ROOT_OF_VOLUME%s\" (file id=%u)\n", path, fileID);
 }
 
+static int compare_blocks(const void *x1_arg, const void *x2_arg)
+{
+	u_int64_t x1 = *(const u_int64_t *)x1_arg;
+	u_int64_t x2 = *(const u_int64_t *)x2_arg;
+
+	return (x1 < x2) ? -1 : (x1 > x2);
+}
+
+/*
+ * gBlockList is sorted on the first call to CheckPhysicalMatch, so that
+ * each extent only looks at the blocks it covers.
+ */
+static Boolean gBlockListSorted = false;
+
 void
 CheckPhysicalMatch(SVCB *vcb, UInt32 startblk, UInt32 blkcount, UInt32 fileNumber, UInt8 forkType)
 {
-	int i;
+	int i, lo, hi, mid;
 	u_int64_t blk, blk1, blk2;
 	u_int64_t offset;
 
@@ -3635,25 +3785,39 @@ CheckPhysicalMatch(SVCB *vcb, UInt32 startblk, UInt32 blkcount, UInt32 fileNumbe
 	blk1 = offset / fsck_get_block_size();
 	blk2 = blk1 + ((blkcount * vcb->vcbBlockSize) / fsck_get_block_size());
 	
-	for (i = 0; i < gBlkListEntries; ++i) {
+	if (!gBlockListSorted) {
+		qsort(gBlockList, gBlkListEntries, sizeof(u_int64_t), compare_blocks);
+		gBlockListSorted = true;
+	}
+
+	/* Find the first listed block at or after blk1 */
+	lo = 0;
+	hi = gBlkListEntries;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (gBlockList[mid] < blk1)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = lo; i < gBlkListEntries && gBlockList[i] < blk2; ++i) {
 		blk = gBlockList[i];
 
-		if (blk >= blk1 && blk < blk2) {
-		//	fsck_print(ctx, LOG_TYPE_INFO, "block %d is in file %d\n", blk, fileNumber);
-			/* Do we need to grow the found blocks list? */
-			if (gFoundBlockEntries % FOUND_BLOCKS_QUANTUM == 0) {
-				struct found_blocks *new_blocks;
-				new_blocks = realloc(gFoundBlocksList, (gFoundBlockEntries + FOUND_BLOCKS_QUANTUM) * sizeof(struct found_blocks));
-				if (new_blocks == NULL) {
-					fsck_print(ctx, LOG_TYPE_STDERR, "CheckPhysicalMatch: Out of memory!\n");
-					return;
-				}
-				gFoundBlocksList = new_blocks;
+	//	fsck_print(ctx, LOG_TYPE_INFO, "block %d is in file %d\n", blk, fileNumber);
+		/* Do we need to grow the found blocks list? */
+		if (gFoundBlockEntries % FOUND_BLOCKS_QUANTUM == 0) {
+			struct found_blocks *new_blocks;
+			new_blocks = realloc(gFoundBlocksList, (gFoundBlockEntries + FOUND_BLOCKS_QUANTUM) * sizeof(struct found_blocks));
+			if (new_blocks == NULL) {
+				fsck_print(ctx, LOG_TYPE_STDERR, "CheckPhysicalMatch: Out of memory!\n");
+				return;
 			}
-			gFoundBlocksList[gFoundBlockEntries].block = blk;
-			gFoundBlocksList[gFoundBlockEntries].fileID = fileNumber;
-			++gFoundBlockEntries;
+			gFoundBlocksList = new_blocks;
 		}
+		gFoundBlocksList[gFoundBlockEntries].block = blk;
+		gFoundBlocksList[gFoundBlockEntries].fileID = fileNumber;
+		++gFoundBlockEntries;
 	}
 }
 
@@ -3679,7 +3843,7 @@ static int compare_found_blocks(const void *x1_arg, const void *x2_arg)
 void
 dumpblocklist(SGlobPtr GPtr)
 {
-	int i, j;
+	int i, j, lo, hi, mid;
 	u_int64_t block;
 
 	/* Sort the found blocks */
@@ -3696,19 +3860,26 @@ dumpblocklist(SGlobPtr GPtr)
 
 		fsck_print(ctx, LOG_TYPE_INFO, "block %llu:\t", (unsigned long long) block);
 		printpath(GPtr, gFoundBlocksList[i].fileID);
-		
-		/* Remove block from the gBlockList */
-		for (j = 0; j < gBlkListEntries; ++j) {
-			if (gBlockList[j] == block) {
-				gBlockList[j] = gBlockList[--gBlkListEntries];
-				break;
-			}
-		}
 	}
 	
 	/* Print out the blocks without matching files */
 	for (j = 0; j < gBlkListEntries; ++j) {
-		fsck_print(ctx, LOG_TYPE_INFO, "block %llu:\t*** NO MATCH ***\n", (unsigned long long) gBlockList[j]);
+		block = gBlockList[j];
+
+		/* Look the block up in the (sorted) found blocks */
+		lo = 0;
+		hi = gFoundBlockEntries;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (gFoundBlocksList[mid].block < block)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < gFoundBlockEntries && gFoundBlocksList[lo].block == block)
+			continue;
+
+		fsck_print(ctx, LOG_TYPE_INFO, "block %llu:\t*** NO MATCH ***\n", (unsigned long long) block);
 	}
 }
 
@@ -3942,15 +4113,18 @@ void	BuildExtentKey( Boolean isHFSPlus, UInt8 forkType, HFSCatalogNodeID fileNum
 		hfsKey->startBlock		= (UInt16) blockNumber;
 	}
 }
+#endif /* !FSCK_OVERLAP_TEST */
 
 
 
 //
 //	Adds this extent to our OverlappedExtentList for later repair.
+//	Duplicates are removed by UniqueOverlapList once the list is complete.
 //
 static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber, const char *attrname, UInt32 extentStartBlock, UInt32 extentBlockCount, UInt8 forkType )
 {
 	size_t			newHandleSize;
+	size_t			capacity;
 	ExtentInfo		extentInfo;
 	ExtentsTable	**extentsTableH;
 	size_t attrlen;
@@ -3976,18 +4150,31 @@ static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber,
 	if ( GPtr->overlappedExtents == nil )
 	{
 		GPtr->overlappedExtents	= (ExtentsTable **) NewHandleClear( sizeof(ExtentsTable) );
+		if ( GPtr->overlappedExtents == nil )
+		{
+			if ( extentInfo.attrname )
+				free( extentInfo.attrname );
+			return( memFullErr );
+		}
 		extentsTableH	= GPtr->overlappedExtents;
 	}
 	else
 	{
 		extentsTableH	= GPtr->overlappedExtents;
 
-		if ( ExtentInfoExists( extentsTableH, &extentInfo) == true )
-			return( noErr );
-
-		//	Grow the Extents table for a new entry.
-		newHandleSize = ( sizeof(ExtentInfo) ) + ( GetHandleSize( (Handle)extentsTableH ) );
-		SetHandleSize( (Handle)extentsTableH, newHandleSize );
+		//	Grow the Extents table, doubling it so that adding n entries is O(n).
+		capacity = ( GetHandleSize( (Handle)extentsTableH ) - offsetof(ExtentsTable, extentInfo) ) / sizeof(ExtentInfo);
+		if ( (**extentsTableH).count == capacity )
+		{
+			newHandleSize = offsetof(ExtentsTable, extentInfo) + ( 2 * capacity * sizeof(ExtentInfo) );
+			SetHandleSize( (Handle)extentsTableH, newHandleSize );
+			if ( GetHandleSize( (Handle)extentsTableH ) != newHandleSize )
+			{
+				if ( extentInfo.attrname )
+					free( extentInfo.attrname );
+				return( memFullErr );
+			}
+		}
 	}
 
 	//	Copy the new extents into the end of the table
@@ -4003,95 +4190,192 @@ static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber,
 }
 
 
-/* Compare if the given extentInfo exsists in the extents table */
-static	Boolean	ExtentInfoExists( ExtentsTable **extentsTableH, ExtentInfo *extentInfo)
+//
+//	Moves the overlapped extents found on another thread into our list,
+//	and frees the other list.
+//
+OSErr	MergeOverlapList( SGlobPtr GPtr, ExtentsTable **extentsTableH )
 {
+	OSErr		err = noErr;
+	ExtentInfo	*extentInfo;
 	UInt32		i;
-	ExtentInfo	*aryExtentInfo;
-	
 
-	for ( i = 0 ; i < (**extentsTableH).count ; i++ )
+	if ( extentsTableH == nil )
+		return( noErr );
+
+	for ( i = 0; i < (**extentsTableH).count; i++ )
 	{
-		aryExtentInfo	= &((**extentsTableH).extentInfo[i]);
-		
-		if ( extentInfo->fileID == aryExtentInfo->fileID )
-		{
-			if (	(extentInfo->startBlock == aryExtentInfo->startBlock)	&& 
-					(extentInfo->blockCount == aryExtentInfo->blockCount)	&&
-					(extentInfo->forkType	== aryExtentInfo->forkType)		)
-			{
-				/* startBlock, blockCount, forkType are same.  
-				 * Compare the extended attribute names, if they exist.
-				 */
+		extentInfo = &((**extentsTableH).extentInfo[i]);
+		if ( err == noErr )
+			err = AddExtentToOverlapList( GPtr, extentInfo->fileID, extentInfo->attrname, extentInfo->startBlock, extentInfo->blockCount, extentInfo->forkType );
+		if ( extentInfo->attrname )
+			free( extentInfo->attrname );
+	}
 
-				/* If no attribute name exists, the two extents are same */
-				if ((extentInfo->attrname == NULL) &&
-					(aryExtentInfo->attrname == NULL)) {
-					return(true);
-				}
+	DisposeHandle( (Handle) extentsTableH );
 
-				/* If only one attribute name exists, the two extents are not same */
-				if (((extentInfo->attrname != NULL) && (aryExtentInfo->attrname == NULL)) ||
-					((extentInfo->attrname == NULL) && (aryExtentInfo->attrname != NULL))) {
-					return(false);
-				}
+	return( err );
+}
 
-				/* Both attribute name exist.  Compare the names */
-				if (!strcmp(extentInfo->attrname, aryExtentInfo->attrname)) {
-					return (true);
-				} else {
-					return (false);
-				}
 
-			}
+/* Function: UniqueOverlapList
+ *
+ * Description: Sort the overlap list and drop duplicate entries, that is,
+ * entries with the same file ID, fork type, start block, block count and
+ * extended attribute name.  The verify stage and FindOrigOverlapFiles add
+ * an extent every time they see it overlap.
+ *
+ * Input:
+ *	GPtr - Global scavenger structure pointer.
+ *
+ * Output:
+ *	nothing (void)
+ */
+static void UniqueOverlapList( SGlobPtr GPtr )
+{
+	ExtentsTable	**extentsTableH = GPtr->overlappedExtents;
+	ExtentInfo		*extentInfo;
+	UInt32			i;
+	UInt32			count;
+
+	if ( extentsTableH == nil || (**extentsTableH).count < 2 )
+		return;
+
+	extentInfo = (**extentsTableH).extentInfo;
+	qsort( extentInfo, (**extentsTableH).count, sizeof(ExtentInfo), CompareExtentInfo );
+
+	count = 1;
+	for ( i = 1; i < (**extentsTableH).count; i++ )
+	{
+		if ( CompareExtentInfo( &extentInfo[count - 1], &extentInfo[i] ) == 0 )
+		{
+			if ( extentInfo[i].attrname )
+				free( extentInfo[i].attrname );
+			continue;
 		}
+		extentInfo[count++] = extentInfo[i];
 	}
-	
-	return( false );
+	(**extentsTableH).count = count;
+}
+
+/* Order ExtentInfo by file ID, fork, start block, block count, then attribute name */
+static int CompareExtentInfo( const void *first, const void *second )
+{
+	const ExtentInfo *a = (const ExtentInfo *)first;
+	const ExtentInfo *b = (const ExtentInfo *)second;
+
+	if ( a->fileID != b->fileID )
+		return ( a->fileID < b->fileID ) ? -1 : 1;
+	if ( a->forkType != b->forkType )
+		return ( a->forkType < b->forkType ) ? -1 : 1;
+	if ( a->startBlock != b->startBlock )
+		return ( a->startBlock < b->startBlock ) ? -1 : 1;
+	if ( a->blockCount != b->blockCount )
+		return ( a->blockCount < b->blockCount ) ? -1 : 1;
+	if ( a->attrname == NULL || b->attrname == NULL )
+		return ( a->attrname != NULL ) - ( b->attrname != NULL );
+	return strcmp( a->attrname, b->attrname );
+}
+
+/* Function: BuildOverlapIndex
+ *
+ * Description: Build the OverlapIndex of the extents currently in the
+ * overlap list.
+ *
+ * Input:
+ *	1. extentsTableH - the overlap list.
+ *	2. index - pointer to the index to fill in.  Free index->intervals
+ *	   when done.
+ *
+ * Output:
+ *	noErr, or memFullErr.
+ */
+static OSErr BuildOverlapIndex( ExtentsTable **extentsTableH, OverlapIndex *index )
+{
+	OverlapInterval	*intervals;
+	ExtentInfo		*extentInfo;
+	UInt32			count;
+	UInt32			i;
+
+	count = (**extentsTableH).count;
+	intervals = malloc( (count ? count : 1) * sizeof(OverlapInterval) );
+	if ( intervals == NULL )
+		return( memFullErr );
+
+	for ( i = 0; i < count; i++ )
+	{
+		extentInfo = &((**extentsTableH).extentInfo[i]);
+		intervals[i].startBlock = extentInfo->startBlock;
+		intervals[i].maxEndBlock = (UInt64)extentInfo->startBlock + extentInfo->blockCount;
+	}
+
+	qsort( intervals, count, sizeof(OverlapInterval), CompareOverlapInterval );
+
+	for ( i = 1; i < count; i++ )
+	{
+		if ( intervals[i].maxEndBlock < intervals[i - 1].maxEndBlock )
+			intervals[i].maxEndBlock = intervals[i - 1].maxEndBlock;
+	}
+
+	index->count = count;
+	index->intervals = intervals;
+	return( noErr );
+}
+
+static int CompareOverlapInterval( const void *first, const void *second )
+{
+	UInt32 a = ((const OverlapInterval *)first)->startBlock;
+	UInt32 b = ((const OverlapInterval *)second)->startBlock;
+
+	return ( a < b ) ? -1 : ( a > b );
 }
 
 /* Function :  DoesOverlap
  * 
  * Description: 
  * This function takes a start block and the count of blocks in a 
- * given extent and compares it against the list of overlapped 
- * extents in the global structure.   
+ * given extent and compares it against the index of the list of 
+ * overlapped extents found in the verify stage.
  * This is useful in finding the original files that overlap with
  * the files found in catalog btree check.  If a file is found
  * overlapping, it is added to the overlap list. 
+ *
+ * Every pair of overlapping extents has at least one member in the
+ * list built by the verify stage (the one captured second), so the
+ * index does not need the extents added here.
  * 
  * Input: 
  * 1. GPtr - global scavenger pointer.
- * 2. fileID - file ID being checked.
- * 3. attrname - name of extended attribute being checked, should be NULL for regular files
- * 4. startBlock - start block in extent.
- * 5. blockCount - total number of blocks in extent.
- * 6. forkType - type of fork being check (kDataFork, kRsrcFork, kEAData).
+ * 2. index - index of the overlap list.
+ * 3. fileID - file ID being checked.
+ * 4. attrname - name of extended attribute being checked, should be NULL for regular files
+ * 5. startBlock - start block in extent.
+ * 6. blockCount - total number of blocks in extent.
+ * 7. forkType - type of fork being check (kDataFork, kRsrcFork, kEAData).
  * 
  * Output: isOverlapped - Boolean value of true or false.
  */
-static Boolean DoesOverlap(SGlobPtr GPtr, UInt32 fileID, const char *attrname, UInt32 startBlock, UInt32 blockCount, UInt8 forkType) 
+static Boolean DoesOverlap(SGlobPtr GPtr, const OverlapIndex *index, UInt32 fileID, const char *attrname, UInt32 startBlock, UInt32 blockCount, UInt8 forkType) 
 {
-	int i;
 	Boolean isOverlapped = false;
-	ExtentInfo	*curExtentInfo;
-	ExtentsTable **extentsTableH = GPtr->overlappedExtents;
-
-	for (i = 0; i < (**extentsTableH).count; i++) {
-		curExtentInfo = &((**extentsTableH).extentInfo[i]);
-		/* Check extents */
-		if (curExtentInfo->startBlock < startBlock) {
-			if ((curExtentInfo->startBlock + curExtentInfo->blockCount) > startBlock) {
-				isOverlapped = true;
-				break;
-			}
-		} else {	/* curExtentInfo->startBlock >= startBlock */
-			if (curExtentInfo->startBlock < (startBlock + blockCount)) {
-				isOverlapped = true;
-				break;
-			}
-		}
-	} /* for loop Extents Table */	
+	UInt64 endBlock = (UInt64)startBlock + blockCount;
+	UInt32 lo, hi, mid;
+
+	/* Find the first indexed extent that starts at or after our end */
+	lo = 0;
+	hi = index->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index->intervals[mid].startBlock < endBlock)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Does any extent that starts before our end, end after our start? */
+	if (lo > 0 && index->intervals[lo - 1].maxEndBlock > startBlock) {
+		isOverlapped = true;
+	}
 
 	/* Add this extent to overlap list */
 	if (isOverlapped) {
@@ -4110,14 +4394,15 @@ static Boolean DoesOverlap(SGlobPtr GPtr, UInt32 fileID, const char *attrname, U
  * 
  * Input: 
  * 1. GPtr - global scavenger pointer.
- * 2. fileID - file ID being checked.
- * 3. attrname - name of extended attribute being checked, should be NULL for regular files
- * 4. extent - extent information to check.
- * 5. forkType - type of fork being check (kDataFork, kRsrcFork, kEAData).
+ * 2. index - index of the overlap list.
+ * 3. fileID - file ID being checked.
+ * 4. attrname - name of extended attribute being checked, should be NULL for regular files
+ * 5. extent - extent information to check.
+ * 6. forkType - type of fork being check (kDataFork, kRsrcFork, kEAData).
  * 
  * Output: None.
  */
-static void CheckHFSPlusExtentRecords(SGlobPtr GPtr, UInt32 fileID, const char *attrname, HFSPlusExtentRecord extent, UInt8 forkType) 
+static void CheckHFSPlusExtentRecords(SGlobPtr GPtr, const OverlapIndex *index, UInt32 fileID, const char *attrname, HFSPlusExtentRecord extent, UInt8 forkType) 
 {
 	int i;
 
@@ -4126,7 +4411,7 @@ static void CheckHFSPlusExtentRecords(SGlobPtr GPtr, UInt32 fileID, const char *
 		if (extent[i].startBlock == 0) {
 			break;
 		}
-		DoesOverlap(GPtr, fileID, attrname, extent[i].startBlock, extent[i].blockCount, forkType);
+		DoesOverlap(GPtr, index, fileID, attrname, extent[i].startBlock, extent[i].blockCount, forkType);
 	} 
 	return;
 } /* CheckHFSPlusExtentRecords */ 
@@ -4140,13 +4425,14 @@ static void CheckHFSPlusExtentRecords(SGlobPtr GPtr, UInt32 fileID, const char *
  * 
  * Input: 
  * 1. GPtr - global scavenger pointer.
- * 2. fileID - file ID being checked.
- * 3. extent - extent information to check.
- * 4. forkType - type of fork being check (kDataFork, kRsrcFork).
+ * 2. index - index of the overlap list.
+ * 3. fileID - file ID being checked.
+ * 4. extent - extent information to check.
+ * 5. forkType - type of fork being check (kDataFork, kRsrcFork).
  * 
  * Output: None.
  */
-static void CheckHFSExtentRecords(SGlobPtr GPtr, UInt32 fileID, HFSExtentRecord extent, UInt8 forkType) 
+static void CheckHFSExtentRecords(SGlobPtr GPtr, const OverlapIndex *index, UInt32 fileID, HFSExtentRecord extent, UInt8 forkType) 
 {
 	int i;
 
@@ -4155,7 +4441,7 @@ static void CheckHFSExtentRecords(SGlobPtr GPtr, UInt32 fileID, HFSExtentRecord
 		if (extent[i].startBlock == 0) {
 			break;
 		}
-		DoesOverlap(GPtr, fileID, NULL, extent[i].startBlock, extent[i].blockCount, forkType);
+		DoesOverlap(GPtr, index, fileID, NULL, extent[i].startBlock, extent[i].blockCount, forkType);
 	}
 	return;
 } /* CheckHFSExtentRecords */ 
@@ -4171,7 +4457,9 @@ static void CheckHFSExtentRecords(SGlobPtr GPtr, UInt32 fileID, HFSExtentRecord
  * 
  * This function relies on comparison of extents with Overlap list
  * created in verify stage.  The list is also updated with the 
- * overlapped extents found in this function. 
+ * overlapped extents found in this function.  Each extent is looked
+ * up in a sorted index of the list, so the whole pass is O(n log m)
+ * for n extents on the volume and m in the list.
  * 
  * 1. Compare extents for all the files located in volume header.
  * 2. Traverse catalog btree and compare extents of all files.
@@ -4203,51 +4491,63 @@ int FindOrigOverlapFiles(SGlobPtr GPtr)
 	char attrName[XATTR_MAXNAMELEN];
 	size_t len;
 
+	OverlapIndex index;
+
 	SVCB *calculatedVCB = GPtr->calculatedVCB;
 
 	isHFSPlus = VolumeObjectIsHFSPlus();
 
+	if (GPtr->overlappedExtents == nil) {
+		return noErr;
+	}
+
+	/* Index the extents found overlapping so far */
+	err = BuildOverlapIndex(GPtr->overlappedExtents, &index);
+	if (err != noErr) {
+		return err;
+	}
+
 	/* Check file extents from volume header */
 	if (isHFSPlus) {
 		/* allocation file */
 		if (calculatedVCB->vcbAllocationFile) {
-			CheckHFSPlusExtentRecords(GPtr, calculatedVCB->vcbAllocationFile->fcbFileID, NULL,
+			CheckHFSPlusExtentRecords(GPtr, &index, calculatedVCB->vcbAllocationFile->fcbFileID, NULL,
 		                              calculatedVCB->vcbAllocationFile->fcbExtents32, kDataFork);
 		}
 
 		/* extents file */
 		if (calculatedVCB->vcbExtentsFile) {
-			CheckHFSPlusExtentRecords(GPtr, calculatedVCB->vcbExtentsFile->fcbFileID, NULL,
+			CheckHFSPlusExtentRecords(GPtr, &index, calculatedVCB->vcbExtentsFile->fcbFileID, NULL,
 		                              calculatedVCB->vcbExtentsFile->fcbExtents32, kDataFork);
 		}
 
 		/* catalog file */
 		if (calculatedVCB->vcbCatalogFile) {
-			CheckHFSPlusExtentRecords(GPtr, calculatedVCB->vcbCatalogFile->fcbFileID, NULL,  
+			CheckHFSPlusExtentRecords(GPtr, &index, calculatedVCB->vcbCatalogFile->fcbFileID, NULL,  
 		                              calculatedVCB->vcbCatalogFile->fcbExtents32, kDataFork);
 		}
 
 		/* attributes file */
 		if (calculatedVCB->vcbAttributesFile) {
-			CheckHFSPlusExtentRecords(GPtr, calculatedVCB->vcbAttributesFile->fcbFileID, NULL, 
+			CheckHFSPlusExtentRecords(GPtr, &index, calculatedVCB->vcbAttributesFile->fcbFileID, NULL, 
 		                              calculatedVCB->vcbAttributesFile->fcbExtents32, kDataFork);	
 	   	}
 
 		/* startup file */
 		if (calculatedVCB->vcbStartupFile) {
-			CheckHFSPlusExtentRecords(GPtr, calculatedVCB->vcbStartupFile->fcbFileID, NULL, 
+			CheckHFSPlusExtentRecords(GPtr, &index, calculatedVCB->vcbStartupFile->fcbFileID, NULL, 
 		                              calculatedVCB->vcbStartupFile->fcbExtents32, kDataFork);
 		}
 	} else {
 		/* extents file */
 		if (calculatedVCB->vcbExtentsFile) {
-			CheckHFSExtentRecords(GPtr, calculatedVCB->vcbExtentsFile->fcbFileID, 
+			CheckHFSExtentRecords(GPtr, &index, calculatedVCB->vcbExtentsFile->fcbFileID, 
 		                          calculatedVCB->vcbExtentsFile->fcbExtents16, kDataFork);
 		}
 
 		/* catalog file */
 		if (calculatedVCB->vcbCatalogFile) {
-			CheckHFSExtentRecords(GPtr, calculatedVCB->vcbCatalogFile->fcbFileID, 
+			CheckHFSExtentRecords(GPtr, &index, calculatedVCB->vcbCatalogFile->fcbFileID, 
 		                          calculatedVCB->vcbCatalogFile->fcbExtents16, kDataFork);
 		}
 	}
@@ -4265,19 +4565,19 @@ int FindOrigOverlapFiles(SGlobPtr GPtr)
 			
 			if (isHFSPlus) {
 				/* HFSPlus data fork */
-				CheckHFSPlusExtentRecords(GPtr, catRecord.hfsPlusFile.fileID, NULL,
+				CheckHFSPlusExtentRecords(GPtr, &index, catRecord.hfsPlusFile.fileID, NULL,
 			    	                      catRecord.hfsPlusFile.dataFork.extents, kDataFork);
 
 				/* HFSPlus resource fork */
-				CheckHFSPlusExtentRecords(GPtr, catRecord.hfsPlusFile.fileID, NULL,
+				CheckHFSPlusExtentRecords(GPtr, &index, catRecord.hfsPlusFile.fileID, NULL,
 			    	                      catRecord.hfsPlusFile.resourceFork.extents, kRsrcFork);
 			} else {
 				/* HFS data extent */
-				CheckHFSExtentRecords(GPtr, catRecord.hfsFile.fileID, 
+				CheckHFSExtentRecords(GPtr, &index, catRecord.hfsFile.fileID, 
 			    	                  catRecord.hfsFile.dataExtents, kDataFork);
 
 				/* HFS resource extent */
-				CheckHFSExtentRecords(GPtr, catRecord.hfsFile.fileID,
+				CheckHFSExtentRecords(GPtr, &index, catRecord.hfsFile.fileID,
 				                      catRecord.hfsFile.rsrcExtents, kRsrcFork);
 			}
 		}
@@ -4296,10 +4596,10 @@ traverseExtents:
 	selCode = 1;	/* Get next record */
 	do {
 		if (isHFSPlus) {
-			CheckHFSPlusExtentRecords(GPtr, extentKey.hfsPlus.fileID, NULL, 
+			CheckHFSPlusExtentRecords(GPtr, &index, extentKey.hfsPlus.fileID, NULL, 
 			                          extentRecord.hfsPlus, extentKey.hfsPlus.forkType);
 		} else {
-			CheckHFSExtentRecords(GPtr, extentKey.hfs.fileID, extentRecord.hfs, 
+			CheckHFSExtentRecords(GPtr, &index, extentKey.hfs.fileID, extentRecord.hfs, 
 			                      extentKey.hfs.forkType);
 		}
 
@@ -4329,12 +4629,12 @@ traverseAttribute:
 			(void) utf_encodestr(attrKey.attrName, attrKey.attrNameLen * 2, (unsigned char *)attrName, &len, sizeof(attrName));
 			attrName[len] = '\0';
 
-			CheckHFSPlusExtentRecords(GPtr, attrKey.fileID, attrName, attrRecord.forkData.theFork.extents, kEAData);
+			CheckHFSPlusExtentRecords(GPtr, &index, attrKey.fileID, attrName, attrRecord.forkData.theFork.extents, kEAData);
 		} else if (attrRecord.recordType == kHFSPlusAttrExtents) {
 			(void) utf_encodestr(attrKey.attrName, attrKey.attrNameLen * 2, (unsigned char *)attrName, &len, sizeof(attrName));
 			attrName[len] = '\0';
 
-			CheckHFSPlusExtentRecords(GPtr, attrKey.fileID, attrName, attrRecord.overflowExtents.extents, kEAData);
+			CheckHFSPlusExtentRecords(GPtr, &index, attrKey.fileID, attrName, attrRecord.overflowExtents.extents, kEAData);
 		}
 
 		/* Access the next record
@@ -4349,9 +4649,16 @@ out:
 	if (err == btNotFound) {
 		err = noErr;
 	}
+	free(index.intervals);
+
+	/* Every extent was added once per extent it overlaps */
+	UniqueOverlapList(GPtr);
+
 	return err;
 } /* FindOrigOverlapFiles */
 
+#ifndef FSCK_OVERLAP_TEST
+
 /* Function: PrintOverlapFiles
  *
  * Description: Print the information about all unique overlapping files.  
@@ -4508,3 +4815,4 @@ out:
 	return retval;
 }
  
+#endif /* !FSCK_OVERLAP_TEST */
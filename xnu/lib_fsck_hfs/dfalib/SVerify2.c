@@ -42,6 +42,7 @@
 
 //	Prototypes for internal subroutines
 static int BTKeyChk( SGlobPtr GPtr, NodeDescPtr nodeP, BTreeControlBlock *btcb );
+static void PrefetchChildNodes( BTreeControlBlock *btcb, NodeDescPtr nodeP );
 
 
 /*------------------------------------------------------------------------------
@@ -627,6 +628,10 @@ BTCheck(SGlobPtr GPtr, short refNum, CheckLeafRecordProcPtr checkLeafRecord)
 		 */
 		if ( nodeDescP->kind == kBTIndexNode )
 		{
+			/* First visit: start reading all of the children from disk */
+			if ( index < 0 )
+				PrefetchChildNodes( calculatedBTCB, nodeDescP );
+
 			index++;	/* on to next index record */
 			if ( index >= numRecs )
 			{
@@ -1353,6 +1358,44 @@ static int BTKeyChk( SGlobPtr GPtr, NodeDescPtr nodeP, BTreeControlBlock *btcb )
 
 
 
+/*------------------------------------------------------------------------------
+
+Routine:	PrefetchChildNodes
+
+Function:	Asks the cache to read ahead the children of an index node,
+		which BTCheck is about to visit one by one.  Bad child
+		pointers are skipped here; BTCheck reports them.
+			
+Input:		btcb		-	pointer to BTreeControlBlock
+		nodeP		-	pointer to index node
+------------------------------------------------------------------------------*/
+
+static void PrefetchChildNodes( BTreeControlBlock *btcb, NodeDescPtr nodeP )
+{
+	UInt32		children[ 512 ];
+	UInt32		count = 0;
+	UInt32		nodeNum;
+	UInt16		recSize;
+	UInt8		*dataPtr;
+	KeyPtr		keyPtr;
+	UInt16		i;
+
+	for ( i = 0; i < nodeP->numRecords && count < 512; i++ )
+	{
+		if ( GetRecordByIndex( btcb, nodeP, i, &keyPtr, &dataPtr, &recSize ) != noErr )
+			break;
+		if ( recSize < sizeof(UInt32) )
+			continue;
+		nodeNum = *(UInt32*)dataPtr;
+		if ( (nodeNum == kHeaderNodeNum) || (nodeNum >= btcb->totalNodes) )
+			continue;
+		children[ count++ ] = nodeNum;
+	}
+
+	PrefetchFileBlocks( btcb->fcbPtr, children, count );
+}
+
+
 /*------------------------------------------------------------------------------
 
 Routine:	ChkCName (Check Catalog Name)
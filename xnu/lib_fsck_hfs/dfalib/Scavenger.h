@@ -773,6 +773,9 @@ typedef struct SGlob {
 	PrimeBuckets 	ABTAttrBucket;		/* prime number buckets for Attribute bit in Attribute btree */
 	PrimeBuckets 	ABTSecurityBucket;	/* prime number buckets for Security bit in Attribute btree */
 	attributeInfo 	lastAttrInfo; 		/* Record last attribute ID checked, used in CheckAttributeRecord, initialized in ScavSetup */
+	Boolean		deferAttrAllocs;	/* set while the attributes btree is checked on its own thread (fsck_hfs -P) */
+	attributeInfo	*deferredAttrAllocs;	/* attributes whose allocation is checked after that thread finishes */
+	UInt32		numDeferredAttrAllocs;
 	UInt16		securityAttrName[XATTR_MAXNAMELEN];	/* Store security attribute name in UTF16, to avoid frequent conversion */
 	size_t  	securityAttrLen;
 
@@ -1049,6 +1052,14 @@ extern	OSErr	BadBlockFileExtentCheck( SGlobPtr GPtr );	//	bad block file extent
 
 extern	OSErr	AttrBTChk( SGlobPtr GPtr );		//	attributes btree check
 
+extern	OSErr	AttrBTRecordsChk( SGlobPtr GPtr );	//	first part of AttrBTChk, safe to run on its own thread
+
+extern	OSErr	AttrBTFinishChk( SGlobPtr GPtr );	//	rest of AttrBTChk, after the catalog btree check
+
+extern	OSErr	MergeOverlapList( SGlobPtr GPtr, ExtentsTable **extentsTableH );
+
+extern	int		CheckDeferredAttrAllocations( SGlobPtr GPtr, attributeInfo *attrInfo, UInt32 count );
+
 extern	OSErr	IVChk( SGlobPtr GPtr );
 
 /* Operation type for CheckForClean */
@@ -27,13 +27,21 @@
  * can be assumed to be in the following state:
  *	1. Full if the coresponding segment map bit is set
  *	2. Empty (implied)
+ *
+ * Large volumes instead use a flat bitmap covering the whole volume,
+ * with two bits of summary per segment (full, and not empty).  See
+ * BitMapCheckBegin.
  */
 
+#ifndef FSCK_BITMAP_TEST
 #include "Scavenger.h"
 
 #include <sys/disk.h>
+#endif
+#include <sys/mman.h>
 
 #include <bitstring.h>
+#include <pthread.h>
 
 #define	bit_dealloc(p)	free(p)
 
@@ -50,7 +58,10 @@ enum {
 	kBitsWithinSegmentMask	= kBitsPerSegment-1,
 	
 	kBMS_NodesPerPool	= 450,
-	kBMS_PoolMax		= 2000
+	kBMS_PoolMax		= 2000,
+
+	/* Volumes with at least this many segments use the flat bitmap */
+	kFlatMinSegments	= 16 * 1024
 };
 
 
@@ -68,6 +79,16 @@ enum {
 
 int gBitMapInited = 0;
 
+/* Volumes with at least this many segments use the flat bitmap; tests may change it */
+UInt32 gFlatMinSegments = kFlatMinSegments;
+
+/*
+ * Serializes CaptureBitmapBits, which may be called from the
+ * attributes B-tree check thread (fsck_hfs -P) and the catalog
+ * check at the same time.
+ */
+static pthread_mutex_t gCaptureLock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Bitmap segments that are full are marked in
  * the gFullSegmentList (a bit string).
@@ -79,6 +100,19 @@ UInt32    gTotalSegments;
 UInt32*   gFullBitmapSegment;   /* points to a FULL bitmap segment*/
 UInt32*   gEmptyBitmapSegment;  /* points to an EMPTY bitmap segment*/
 
+/*
+ * Flat bitmap
+ * The whole in-memory bitmap, in on-disk (big endian) order, in an
+ * anonymous mapping; pages that are never written cost nothing.
+ * gFullSegmentList marks the full segments and gUsedSegmentList the
+ * segments with any bit set, so GetSegmentBitmap can still hand out
+ * gFullBitmapSegment and gEmptyBitmapSegment for kTestingBits.
+ * gFlatBitmap is NULL when the segment tree is in use.
+ */
+UInt32*   gFlatBitmap;
+size_t    gFlatBitmapSize;
+bitstr_t* gUsedSegmentList;
+
 /*
  * Bitmap Segment (BMS) Tree node
  * Bitmap segments that are partially full are
@@ -98,6 +132,11 @@ int gBMS_PoolCount;            /* count of pools allocated */
 
 /* Bitmap operations routines */
 static int FindContigClearedBitmapBits (SVCB *vcb, UInt32 numBlocks, UInt32 *actualStartBlock);
+static UInt32 CompareBitmapSegment (const UInt32 *memory, const UInt8 *disk, Boolean *underAlloc);
+
+/* Flat bitmap routines */
+static int        FlatBitmapInit(void);
+static void       FlatBitmapDispose(void);
 
 /* Segment Tree routines (binary search tree) */
 static int        BMS_InitTree(void);
@@ -138,7 +177,17 @@ int BitMapCheckBegin(SGlobPtr g)
 	gFullSegmentList = bit_alloc(gTotalSegments);
 	bit_nclear(gFullSegmentList, 0, gTotalSegments - 1);
 
-	BMS_InitTree();
+	/*
+	 * A partially full segment costs a 140 byte tree node, the tree is
+	 * unbalanced, and it can hold at most kBMS_PoolMax * kBMS_NodesPerPool
+	 * segments.  Large volumes use the flat bitmap instead, which costs
+	 * one bit per allocation block.  The tree is kept if the mapping
+	 * can't be made.
+	 */
+	if (gTotalSegments < gFlatMinSegments || FlatBitmapInit() != 0)
+		BMS_InitTree();
+	fsck_debug_print(ctx, d_info, "Volume bitmap: %u segments, %s\n", gTotalSegments,
+	    gFlatBitmap ? "flat" : "segment tree");
 	gBitMapInited = 1;
 	gBitsMarked = 0;
 
@@ -193,7 +242,10 @@ int BitMapCheckEnd(void)
 		bit_dealloc(gFullSegmentList);
 		gFullSegmentList = NULL;
 
-		BMS_DisposeTree();
+		if (gFlatBitmap)
+			FlatBitmapDispose();
+		else
+			BMS_DisposeTree();
 		gBitMapInited = 0;
 	}
 	return (0);
@@ -235,6 +287,26 @@ static int GetSegmentBitmap(UInt32 startBit, UInt32 **buffer, int bitOperation)
 	*buffer = NULL;
 	segment = startBit / kBitsPerSegment;
 
+	// flat bitmap: every segment has storage; the summary bits say which are full or empty
+	if (gFlatBitmap) {
+		if (bitOperation == kTestingBits) {
+			if (bit_test(gFullSegmentList, segment))
+				*buffer = gFullBitmapSegment;
+			else if (!bit_test(gUsedSegmentList, segment))
+				*buffer = gEmptyBitmapSegment;
+			else
+				*buffer = &gFlatBitmap[segment * kWordsPerSegment];
+		} else {
+			if (bitOperation == kClearingBits && bit_test(gFullSegmentList, segment)) {
+				bit_clear(gFullSegmentList, segment);
+				--gFullSegments;
+			}
+			bit_set(gUsedSegmentList, segment);
+			*buffer = &gFlatBitmap[segment * kWordsPerSegment];
+		}
+		return (0);
+	}
+
 	// for a full seqment...
 	if (bit_test(gFullSegmentList, segment)) {
 		if (bitOperation == kClearingBits) {
@@ -313,6 +385,34 @@ void TestSegmentBitmap(UInt32 startBit)
 
 	segment = startBit / kBitsPerSegment;
 
+	if (gFlatBitmap) {
+		UInt64 *words = (UInt64 *)&gFlatBitmap[segment * kWordsPerSegment];
+		UInt64 all = ~0ULL;
+		UInt64 any = 0;
+		int i;
+
+		for (i = 0; i < kBytesPerSegment / sizeof(UInt64); ++i) {
+			all &= words[i];
+			any |= words[i];
+		}
+
+		if (all == ~0ULL) {
+			if (!bit_test(gFullSegmentList, segment)) {
+				bit_set(gFullSegmentList, segment);
+				++gFullSegments;
+			}
+		} else if (bit_test(gFullSegmentList, segment)) {
+			bit_clear(gFullSegmentList, segment);
+			--gFullSegments;
+		}
+
+		if (any)
+			bit_set(gUsedSegmentList, segment);
+		else
+			bit_clear(gUsedSegmentList, segment);
+		return;
+	}
+
 	if (bit_test(gFullSegmentList, segment))
 		return;
 
@@ -371,7 +471,7 @@ void TestSegmentBitmap(UInt32 startBit)
  *	zero on success, non-zero on failure.
  *	This function also returns E_OvlExt if any overlapping extent is found.
  */
-int CaptureBitmapBits(UInt32 startBit, UInt32 bitCount)
+static int CaptureBitmapBitsLocked(UInt32 startBit, UInt32 bitCount)
 {
 	Boolean overlap;
 	OSErr   err;
@@ -497,6 +597,17 @@ Exit:
 	return (overlap ? E_OvlExt : err);
 }
 
+int CaptureBitmapBits(UInt32 startBit, UInt32 bitCount)
+{
+	int result;
+
+	pthread_mutex_lock(&gCaptureLock);
+	result = CaptureBitmapBitsLocked(startBit, bitCount);
+	pthread_mutex_unlock(&gCaptureLock);
+
+	return (result);
+}
+
 
 /* Function: ReleaseBitMapBits
  *
@@ -677,6 +788,9 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 	SVCB * vcb;
 	Boolean	 isHFSPlus;
 	Boolean foundOverAlloc = false;
+	Boolean underAlloc;
+	UInt32 diffBits;
+	UInt64 totalDiffBits = 0;
 	int err = 0;
 	
 	vcb = g->calculatedVCB;
@@ -728,15 +842,15 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 			g->TarBlock = fileBlk;
 			++fileBlk;
 		}
-		if (memcmp(buffer, vbmBlockP + (bit & bitsWithinFileBlkMask)/8, kBytesPerSegment) == 0)
+		diffBits = CompareBitmapSegment(buffer, vbmBlockP + (bit & bitsWithinFileBlkMask)/8, &underAlloc);
+		if (diffBits == 0)
 			continue;
+		totalDiffBits += diffBits;
 
 		if (repair) {
 			bcopy(buffer, vbmBlockP + (bit & bitsWithinFileBlkMask)/8, kBytesPerSegment);
 			relOpt = kForceWriteBlock;
 		} else {
-			int underalloc = 0;
-			int indx;
 #if _VBC_DEBUG_
 			int i, j;
 			UInt32 *disk_buffer;
@@ -792,17 +906,8 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 			 * Once we determine we have under-allocated, we can just stop and print out
 			 * the message.
 			 */
-			for (indx = 0; indx < kBytesPerSegment; indx++) {
-				uint8_t *bufp, *diskp;
-				bufp = (uint8_t *)buffer;
-				diskp = vbmBlockP + (bit & bitsWithinFileBlkMask)/8;
-				if (bufp[indx] & ~diskp[indx]) {
-					underalloc++;
-					break;
-				}
-			}
 			g->VIStat = g->VIStat | S_VBM;
-			if (underalloc) {
+			if (underAlloc) {
 				fsckPrintFormat(g->context, E_VBMDamaged);
 				break; /* stop checking after first miss */
 			} else if (!foundOverAlloc) {
@@ -821,9 +926,48 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 			(void) ReleaseVolumeBlock(vcb, &block, relOpt | kSkipEndianSwap);
 	}
 
+	if (totalDiffBits != 0)
+		fsck_debug_print(ctx, d_info, "CheckVolumeBitMap: %llu allocation blocks differ from the on-disk bitmap\n",
+		    (unsigned long long)totalDiffBits);
+
 	return (0);
 }
 
+/* Function: CompareBitmapSegment
+ *
+ * Description: Compare an in-memory bitmap segment with the same segment of
+ * the on-disk bitmap, 64 bits at a time.
+ *
+ * Input:
+ *	1. memory - in-memory segment
+ *	2. disk - on-disk segment
+ *	3. underAlloc - pointer to return whether a block that is in use is
+ *		marked free on disk
+ *
+ * Output:
+ *	Number of allocation blocks whose bits differ.
+ */
+static UInt32 CompareBitmapSegment(const UInt32 *memory, const UInt8 *disk, Boolean *underAlloc)
+{
+	const UInt64 *mem = (const UInt64 *)memory;
+	const UInt64 *dsk = (const UInt64 *)disk;
+	UInt64 diff;
+	UInt64 under = 0;
+	UInt32 diffBits = 0;
+	int i;
+
+	for (i = 0; i < kBytesPerSegment / sizeof(UInt64); ++i) {
+		diff = mem[i] ^ dsk[i];
+		if (diff) {
+			diffBits += __builtin_popcountll(diff);
+			under |= mem[i] & ~dsk[i];
+		}
+	}
+
+	*underAlloc = (under != 0);
+	return (diffBits);
+}
+
 /* Function: UpdateFreeBlockCount
  *
  * Description: Re-calculate the total bits marked in in-memory bitmap 
@@ -847,7 +991,6 @@ void UpdateFreeBlockCount(SGlobPtr g)
 	UInt32 newBitsMarked = 0;
 	UInt32 bit;
 	UInt32 *buffer;
-	UInt32 curWord;
 	SVCB * vcb = g->calculatedVCB;
 	
 	/* Loop through all the bitmap segments */
@@ -867,15 +1010,7 @@ void UpdateFreeBlockCount(SGlobPtr g)
 
 		/* Segment is partially full */
 		for (i = 0; i < kWordsPerSegment; i++) {
-			if (buffer[i] == kAllBitsSetInWord) {
-				newBitsMarked += kBitsPerWord;
-			} else {
-				curWord = SWAP_BE32(buffer[i]);
-				while (curWord) {
-					newBitsMarked += curWord & 1;
-					curWord >>= 1;
-				}
-			}
+			newBitsMarked += __builtin_popcount(buffer[i]);
 		} 
 	} 
 	
@@ -1261,6 +1396,50 @@ int IsTrimSupported(void)
 	return features & DK_FEATURE_UNMAP;
 }
 
+/*
+ * FLAT BITMAP
+ *
+ * One bit per allocation block in an anonymous mapping, plus a bit string
+ * of segments that have any bit set.  The mapping is zero filled on
+ * demand, so the regions of the volume that nothing is allocated in
+ * never get pages.
+ */
+
+static int
+FlatBitmapInit(void)
+{
+	size_t size;
+	void *map;
+
+	size = (size_t)gTotalSegments * kBytesPerSegment;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (map == MAP_FAILED)
+		return (errno);
+
+	gUsedSegmentList = bit_alloc(gTotalSegments);
+	if (gUsedSegmentList == NULL) {
+		(void) munmap(map, size);
+		return (ENOMEM);
+	}
+	bit_nclear(gUsedSegmentList, 0, gTotalSegments - 1);
+
+	gFlatBitmap = (UInt32 *)map;
+	gFlatBitmapSize = size;
+	return (0);
+}
+
+
+static void
+FlatBitmapDispose(void)
+{
+	(void) munmap(gFlatBitmap, gFlatBitmapSize);
+	gFlatBitmap = NULL;
+	gFlatBitmapSize = 0;
+
+	bit_dealloc(gUsedSegmentList);
+	gUsedSegmentList = NULL;
+}
+
 /*
  * BITMAP SEGMENT TREE
  *
@@ -297,6 +297,14 @@ char fsck_get_scanflag() {
     return state.scanflag;
 }
 
+void fsck_set_parallel(char val) {
+    state.parallel = val;
+}
+
+char fsck_get_parallel() {
+    return state.parallel;
+}
+
 void fsck_set_embedded(char val) {
     state.embedded = val;
 }
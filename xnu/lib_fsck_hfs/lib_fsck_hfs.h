@@ -169,6 +169,9 @@ char fsck_get_disable_journal();
 void fsck_set_scanflag(char val);
 char fsck_get_scanflag();
 
+void fsck_set_parallel(char val);
+char fsck_get_parallel();
+
 void fsck_set_embedded(char val);
 char fsck_get_embedded();
 
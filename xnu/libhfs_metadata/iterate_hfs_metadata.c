@@ -23,8 +23,8 @@ __private_extern__ int printProgress = 0;
  * with the start and length.
  *
  * It will go through and get the symlink and EA extents first, and
- * then go through the rest of the extents.  It does not attempt any
- * sorting past that.
+ * then go through the rest of the extents, sorted by device offset,
+ * with overlapping and adjacent extents merged.
  */
 int
 iterate_hfs_metadata(char *device, int (*handle_extent)(int fd, off_t start, off_t length, void *ctx), void *context_ptr)
@@ -83,6 +83,8 @@ iterate_hfs_metadata(char *device, int (*handle_extent)(int fd, off_t start, off
 	 * Now, we've handled all of the other metadata, so we need
 	 * to go through the rest of our metadata, which is in vop.
 	 */
+	(void)NormalizeVolumeObject(vop);
+
 	ExtentList_t *extList;
 	for (extList = vop->list;
 	     extList;
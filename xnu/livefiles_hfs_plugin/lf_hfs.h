@@ -99,6 +99,8 @@ typedef struct hfsmount {
     /* Access to VFS and devices */
     struct mount *   hfs_mp;                  /* filesystem vfs structure */
     struct vnode *   hfs_devvp;               /* block device mounted vnode */
+    const struct raw_io_backend *hfs_io_backend; /* how device I/O is issued, picked at mount */
+    u_int32_t        hfs_io_queue_depth;      /* max requests the backend keeps in flight */
     struct vnode *   hfs_extents_vp;
     struct vnode *   hfs_catalog_vp;
     struct vnode *   hfs_allocation_vp;
@@ -280,9 +282,12 @@ typedef struct hfsmount {
     uuid_t         hfs_full_uuid;
 
     /* Per mount cnode hash variables: */
-    pthread_mutex_t      hfs_chash_mutex;  /* protects access to cnode hash table */
     u_long               hfs_cnodehash;    /* size of cnode hash table - 1 */
-    LIST_HEAD(cnodehashhead, cnode) *hfs_cnodehashtbl;    /* base of cnode hash */
+    struct cnodehashbucket {
+        pthread_mutex_t  chb_mutex;        /* protects chb_head and c_hflag of its cnodes */
+        pthread_cond_t   chb_cond;         /* waiters for cnodes of this bucket in transition */
+        LIST_HEAD(cnodehashhead, cnode) chb_head;
+    } *hfs_cnodehashtbl;                   /* base of cnode hash */
 
     /* Per mount fileid hash variables  (protected by catalog lock!) */
     u_long hfs_idhash; /* size of cnid/fileid hash table -1 */
@@ -13,16 +13,33 @@
 #include "lf_hfs_logger.h"
 #include "lf_hfs_vfsutils.h"
 
-#define DESIRED_VNODES (128)        /* number of vnodes desired */
+/*
+ * The cnode hash is lock-striped: every bucket has its own mutex, which protects
+ * the bucket's chain and the c_hflag of the cnodes on it, and its own condition
+ * variable for threads waiting on a cnode in transition. Lookups of different
+ * files only meet when their IDs share a bucket, and a wakeup only reaches the
+ * threads waiting in that bucket.
+ */
+#define CHASH_NUM_OF_BUCKETS (256)  /* power of 2 */
 #define CNODEHASH(hfsmp, inum) (&hfsmp->hfs_cnodehashtbl[(inum) & hfsmp->hfs_cnodehash])
 
 static void
-hfs_chash_wait(struct hfsmount *hfsmp, struct cnode  *cp,  bool bUnlock)
+hfs_chash_wait(struct cnodehashbucket *bucket, struct cnode *cp, bool bUnlock)
 {
     SET(cp->c_hflag, H_WAITING);
-    pthread_cond_wait(&cp->c_cacsh_cond, &hfsmp->hfs_chash_mutex);
+    pthread_cond_wait(&bucket->chb_cond, &bucket->chb_mutex);
     if (bUnlock)
-        hfs_chash_unlock(hfsmp);
+        hfs_chash_unlock(bucket);
+}
+
+/* Wake the threads waiting on cnodes of the bucket, if cp had any. Bucket must be locked. */
+static void
+hfs_chash_wakeup_locked(struct cnodehashbucket *bucket, struct cnode *cp)
+{
+    if (ISSET(cp->c_hflag, H_WAITING)) {
+        CLR(cp->c_hflag, H_WAITING);
+        pthread_cond_broadcast(&bucket->chb_cond);
+    }
 }
 
 void
@@ -57,35 +74,35 @@ hfs_chashinit()
 {
 }
 
-void hfs_chash_lock(struct hfsmount *hfsmp)
+struct cnodehashbucket *hfs_chash_lock(struct hfsmount *hfsmp, ino_t inum)
 {
-    lf_lck_mtx_lock(&hfsmp->hfs_chash_mutex);
+    struct cnodehashbucket *bucket = CNODEHASH(hfsmp, inum);
+    lf_lck_mtx_lock(&bucket->chb_mutex);
+    return bucket;
 }
 
-void hfs_chash_lock_spin(struct hfsmount *hfsmp)
+struct cnodehashbucket *hfs_chash_lock_spin(struct hfsmount *hfsmp, ino_t inum)
 {
-    lf_lck_mtx_lock_spin(&hfsmp->hfs_chash_mutex);
+    struct cnodehashbucket *bucket = CNODEHASH(hfsmp, inum);
+    lf_lck_mtx_lock_spin(&bucket->chb_mutex);
+    return bucket;
 }
 
 
-void hfs_chash_unlock(struct hfsmount *hfsmp)
+void hfs_chash_unlock(struct cnodehashbucket *bucket)
 {
-    lf_lck_mtx_unlock(&hfsmp->hfs_chash_mutex);
+    lf_lck_mtx_unlock(&bucket->chb_mutex);
 }
 
 void
 hfs_chashwakeup(struct hfsmount *hfsmp, struct cnode *cp, int hflags)
 {
-    hfs_chash_lock_spin(hfsmp);
+    struct cnodehashbucket *bucket = hfs_chash_lock_spin(hfsmp, cp->c_fileid);
 
     CLR(cp->c_hflag, hflags);
+    hfs_chash_wakeup_locked(bucket, cp);
 
-    if (ISSET(cp->c_hflag, H_WAITING)) {
-        CLR(cp->c_hflag, H_WAITING);
-        pthread_cond_broadcast(&cp->c_cacsh_cond);
-    }
-    
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_unlock(bucket);
 }
 
 /*
@@ -94,19 +111,15 @@ hfs_chashwakeup(struct hfsmount *hfsmp, struct cnode *cp, int hflags)
 void
 hfs_chash_abort(struct hfsmount *hfsmp, struct cnode *cp)
 {
-    hfs_chash_lock_spin(hfsmp);
+    struct cnodehashbucket *bucket = hfs_chash_lock_spin(hfsmp, cp->c_fileid);
 
     LIST_REMOVE(cp, c_hash);
     cp->c_hash.le_next = NULL;
     cp->c_hash.le_prev = NULL;
 
     CLR(cp->c_hflag, H_ATTACH | H_ALLOC);
-    if (ISSET(cp->c_hflag, H_WAITING))
-    {
-        CLR(cp->c_hflag, H_WAITING);
-        pthread_cond_broadcast(&cp->c_cacsh_cond);
-    }
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_wakeup_locked(bucket, cp);
+    hfs_chash_unlock(bucket);
 }
 
 
@@ -114,27 +127,38 @@ hfs_chash_abort(struct hfsmount *hfsmp, struct cnode *cp)
 void
 hfs_chashinit_finish(struct hfsmount *hfsmp)
 {
-    lf_lck_mtx_init(&hfsmp->hfs_chash_mutex);
-    hfsmp->hfs_cnodehashtbl = hashinit(DESIRED_VNODES / 4, &hfsmp->hfs_cnodehash);
+    hfsmp->hfs_cnodehashtbl = hfs_malloc(CHASH_NUM_OF_BUCKETS * sizeof(struct cnodehashbucket));
+    if (hfsmp->hfs_cnodehashtbl == NULL) {
+        LFHFS_LOG(LEVEL_ERROR, "hfs_chashinit_finish: failed to allocate the cnode hash\n");
+        hfs_assert(0);
+    }
+    hfsmp->hfs_cnodehash = CHASH_NUM_OF_BUCKETS - 1;
+
+    for (u_long i = 0; i < CHASH_NUM_OF_BUCKETS; i++) {
+        lf_lck_mtx_init(&hfsmp->hfs_cnodehashtbl[i].chb_mutex);
+        lf_cond_init(&hfsmp->hfs_cnodehashtbl[i].chb_cond);
+        LIST_INIT(&hfsmp->hfs_cnodehashtbl[i].chb_head);
+    }
 }
 
 void
 hfs_delete_chash(struct hfsmount *hfsmp)
 {
     struct cnode  *cp;
-    hfs_chash_lock_spin(hfsmp);
-    
-    for (ino_t inum = 0;  inum < (DESIRED_VNODES/4); inum++)
+
+    for (ino_t inum = 0;  inum < CHASH_NUM_OF_BUCKETS; inum++)
     {
-        for (cp = CNODEHASH(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next) {
+        struct cnodehashbucket *bucket = hfs_chash_lock_spin(hfsmp, inum);
+        LIST_FOREACH(cp, &bucket->chb_head, c_hash) {
             LFHFS_LOG(LEVEL_ERROR, "hfs_delete_chash: Cnode for file [%s], cnid: [%d] with open count [%d] left in the cache \n", cp->c_desc.cd_nameptr, cp->c_desc.cd_cnid, cp->uOpenLookupRefCount);
         }
+        hfs_chash_unlock(bucket);
+        lf_lck_mtx_destroy(&bucket->chb_mutex);
+        lf_cond_destroy(&bucket->chb_cond);
     }
-    
-        
-    hfs_chash_unlock(hfsmp);
-    lf_lck_mtx_destroy(&hfsmp->hfs_chash_mutex);
+
     hfs_free(hfsmp->hfs_cnodehashtbl);
+    hfsmp->hfs_cnodehashtbl = NULL;
 }
 
 /*
@@ -158,6 +182,7 @@ hfs_chash_getcnode(struct hfsmount *hfsmp, ino_t inum, struct vnode **vpp, int w
     struct cnode  *cp;
     struct cnode  *ncp = NULL;
     vnode_t       vp;
+    struct cnodehashbucket *bucket;
 
     /*
      * Go through the hash list
@@ -165,9 +190,9 @@ hfs_chash_getcnode(struct hfsmount *hfsmp, ino_t inum, struct vnode **vpp, int w
      * allocated, wait for it to be finished and then try again.
      */
 loop:
-    hfs_chash_lock_spin(hfsmp);
+    bucket = hfs_chash_lock_spin(hfsmp, inum);
 loop_with_lock:
-    for (cp = CNODEHASH(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next)
+    LIST_FOREACH(cp, &bucket->chb_head, c_hash)
     {
         if (cp->c_fileid != inum)
         {
@@ -178,7 +203,7 @@ loop_with_lock:
          */
         if (ISSET(cp->c_hflag, H_ALLOC | H_ATTACH | H_TRANSIT))
         {
-            hfs_chash_wait(hfsmp, cp, false);
+            hfs_chash_wait(bucket, cp, false);
             goto loop_with_lock;
         }
         
@@ -222,13 +247,13 @@ loop_with_lock:
                  * vnode_getwithvid().
                  */
                 SET(cp->c_hflag, H_GETTING);
-                hfs_chash_unlock(hfsmp);
+                hfs_chash_unlock(bucket);
                 if (hfs_lock(cp, HFS_EXCLUSIVE_LOCK, HFS_LOCK_ALLOW_NOEXISTS)) {
-                    hfs_chash_lock(hfsmp);
+                    hfs_chash_lock(hfsmp, inum);
                     CLR(cp->c_hflag, H_GETTING);
                     goto loop_with_lock;
                 }
-                hfs_chash_lock(hfsmp);
+                hfs_chash_lock(hfsmp, inum);
                 CLR(cp->c_hflag, H_GETTING);
             }
         }
@@ -264,11 +289,12 @@ loop_with_lock:
             }
             else
             {
-                hfs_chashwakeup(hfsmp, cp, H_ATTACH);
+                /* The bucket is already locked, so don't go through hfs_chashwakeup */
+                CLR(cp->c_hflag, H_ATTACH);
                 *hflags &= ~H_ATTACH;
             }
             
-            pthread_cond_signal(&cp->c_cacsh_cond);
+            hfs_chash_wakeup_locked(bucket, cp);
             vp = NULL;
             cp = NULL;
             if (renamed)
@@ -278,7 +304,7 @@ loop_with_lock:
         }
         
         if (cp) hfs_chash_raise_OpenLookupCounter(cp);
-        hfs_chash_unlock(hfsmp);
+        hfs_chash_unlock(bucket);
         *vpp = vp;
         return (cp);
     }
@@ -294,7 +320,7 @@ loop_with_lock:
 
     if (ncp == NULL)
     {
-        hfs_chash_unlock(hfsmp);
+        hfs_chash_unlock(bucket);
         ncp = hfs_mallocz(sizeof(struct cnode));
         if (ncp == NULL)
         {
@@ -318,7 +344,6 @@ loop_with_lock:
     TAILQ_INIT(&ncp->c_originlist);
 
     lf_lck_rw_init(&ncp->c_rwlock);
-    lf_cond_init(&ncp->c_cacsh_cond);
 
     if (!skiplock)
     {
@@ -326,9 +351,9 @@ loop_with_lock:
     }
 
     /* Insert the new cnode with it's H_ALLOC flag set */
-    LIST_INSERT_HEAD(CNODEHASH(hfsmp, inum), ncp, c_hash);
+    LIST_INSERT_HEAD(&bucket->chb_head, ncp, c_hash);
     hfs_chash_raise_OpenLookupCounter(ncp);
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_unlock(bucket);
     *vpp = NULL;
     return (ncp);
 }
@@ -343,6 +368,7 @@ hfs_chash_getvnode(struct hfsmount *hfsmp, ino_t inum, int wantrsrc, int skiploc
 {
     struct cnode *cp = NULL;
     struct vnode *vp = NULL;
+    struct cnodehashbucket *bucket;
 
     /*
      * Go through the hash list
@@ -350,14 +376,14 @@ hfs_chash_getvnode(struct hfsmount *hfsmp, ino_t inum, int wantrsrc, int skiploc
      * allocated, wait for it to be finished and then try again.
      */
 loop:
-    hfs_chash_lock_spin(hfsmp);
+    bucket = hfs_chash_lock_spin(hfsmp, inum);
 loop_with_lock:
-    for (cp = CNODEHASH(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next) {
+    LIST_FOREACH(cp, &bucket->chb_head, c_hash) {
         if (cp->c_fileid != inum)
             continue;
         /* Wait if cnode is being created or reclaimed. */
         if (ISSET(cp->c_hflag, H_ALLOC | H_TRANSIT | H_ATTACH)) {
-            hfs_chash_wait(hfsmp, cp, true);
+            hfs_chash_wait(bucket, cp, true);
             goto loop;
         }
         /* Obtain the desired vnode. */
@@ -376,13 +402,13 @@ loop_with_lock:
                  * on here.
                  */
                 SET(cp->c_hflag, H_GETTING);
-                hfs_chash_unlock(hfsmp);
+                hfs_chash_unlock(bucket);
                 if (hfs_lock(cp, HFS_EXCLUSIVE_LOCK, HFS_LOCK_ALLOW_NOEXISTS)) {
-                    hfs_chash_lock(hfsmp);
+                    hfs_chash_lock(hfsmp, inum);
                     CLR(cp->c_hflag, H_GETTING);
                     goto loop_with_lock;
                 }
-                hfs_chash_lock(hfsmp);
+                hfs_chash_lock(hfsmp, inum);
                 CLR(cp->c_hflag, H_GETTING);
             }
         }
@@ -408,7 +434,7 @@ loop_with_lock:
     }
 
 exit:
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_unlock(bucket);
     return vp;
 }
 
@@ -424,9 +450,9 @@ hfs_chash_snoop(struct hfsmount *hfsmp, ino_t inum, int existence_only,
      * If a cnode is in the process of being cleaned out or being
      * allocated, wait for it to be finished and then try again.
      */
-    hfs_chash_lock(hfsmp);
+    struct cnodehashbucket *bucket = hfs_chash_lock(hfsmp, inum);
 
-    for (cp = CNODEHASH(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next) {
+    LIST_FOREACH(cp, &bucket->chb_head, c_hash) {
         if (cp->c_fileid != inum)
             continue;
 
@@ -461,23 +487,23 @@ hfs_chash_snoop(struct hfsmount *hfsmp, ino_t inum, int existence_only,
         }
         break;
     }
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_unlock(bucket);
 
     return (result);
 }
 
 /* Search a cnode in the hash.  This function does not return cnode which
  * are getting created, destroyed or in transition.  Note that this function
- * does not acquire the cnode hash mutex, and expects the caller to acquire it.
+ * does not acquire the bucket mutex, and expects the caller to acquire it.
  * On success, returns pointer to the cnode found.  On failure, returns NULL.
  */
 static
 struct cnode *
-hfs_chash_search_cnid(struct hfsmount *hfsmp, cnid_t cnid)
+hfs_chash_search_cnid(struct cnodehashbucket *bucket, cnid_t cnid)
 {
     struct cnode *cp;
 
-    for (cp = CNODEHASH(hfsmp, cnid)->lh_first; cp; cp = cp->c_hash.le_next) {
+    LIST_FOREACH(cp, &bucket->chb_head, c_hash) {
         if (cp->c_fileid == cnid) {
             break;
         }
@@ -507,9 +533,9 @@ hfs_chash_set_childlinkbit(struct hfsmount *hfsmp, cnid_t cnid)
     int retval = -1;
     struct cnode *cp;
 
-    hfs_chash_lock_spin(hfsmp);
+    struct cnodehashbucket *bucket = hfs_chash_lock_spin(hfsmp, cnid);
 
-    cp = hfs_chash_search_cnid(hfsmp, cnid);
+    cp = hfs_chash_search_cnid(bucket, cnid);
     if (cp) {
         if (cp->c_attr.ca_recflags & kHFSHasChildLinkMask) {
             retval = 0;
@@ -519,7 +545,7 @@ hfs_chash_set_childlinkbit(struct hfsmount *hfsmp, cnid_t cnid)
         }
     }
 
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_unlock(bucket);
     return retval;
 }
 
@@ -530,14 +556,14 @@ hfs_chash_set_childlinkbit(struct hfsmount *hfsmp, cnid_t cnid)
 int
 hfs_chashremove(struct hfsmount *hfsmp, struct cnode *cp)
 {
-    hfs_chash_lock_spin(hfsmp);
+    struct cnodehashbucket *bucket = hfs_chash_lock_spin(hfsmp, cp->c_fileid);
 
     /*
      * Check if a vnode is getting attached or if the cnode is in the middle
      * of a "get".
      */
     if (ISSET(cp->c_hflag, (H_ATTACH | H_GETTING))) {
-        hfs_chash_unlock(hfsmp);
+        hfs_chash_unlock(bucket);
         return (EBUSY);
     }
     if (cp->c_hash.le_next || cp->c_hash.le_prev) {
@@ -546,7 +572,7 @@ hfs_chashremove(struct hfsmount *hfsmp, struct cnode *cp)
         cp->c_hash.le_prev = NULL;
     }
 
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_unlock(bucket);
     return (0);
 }
 
@@ -556,7 +582,7 @@ hfs_chashremove(struct hfsmount *hfsmp, struct cnode *cp)
 void
 hfs_chash_mark_in_transit(struct hfsmount *hfsmp, struct cnode *cp)
 {
-    hfs_chash_lock_spin(hfsmp);
+    struct cnodehashbucket *bucket = hfs_chash_lock_spin(hfsmp, cp->c_fileid);
     SET(cp->c_hflag, H_TRANSIT);
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_unlock(bucket);
 }
@@ -45,7 +45,6 @@ hfs_reclaim_cnode(struct cnode *cp)
      */
 
     lf_lck_rw_destroy(&cp->c_rwlock);
-    lf_cond_destroy(&cp->c_cacsh_cond);
     lf_lck_rw_destroy(&cp->c_truncatelock);
 
     hfs_free(cp);
@@ -52,6 +52,9 @@ struct filefork {
         char        *ffu_symlinkptr;        /* symbolic link pathname */
     } ff_union;
     struct cat_fork ff_data;                /* fork data (size, extents) */
+    uint64_t        ff_ra_next_offset;      /* where a sequential reader would read next */
+    uint64_t        ff_ra_issued_end;       /* read-ahead was queued up to here */
+    uint32_t        ff_ra_window;           /* read-ahead window, in clusters */
 };
 typedef struct filefork filefork_t;
 
@@ -104,11 +107,10 @@ struct cnode {
     pthread_t                       c_lockowner;                /* cnode's lock owner (exclusive case only) */
     pthread_rwlock_t                c_truncatelock;             /* protects file from truncation during read/write */
     pthread_t                       c_truncatelockowner;        /* truncate lock owner (exclusive case only) */
-    pthread_cond_t                  c_cacsh_cond;               /* cond for cnode cacsh*/
     
     LIST_ENTRY(cnode)               c_hash;                     /* cnode's hash chain */
     u_int32_t                       c_flag;                     /* cnode's runtime flags */
-    u_int32_t                       c_hflag;                    /* cnode's flags for maintaining hash - protected by global hash lock */
+    u_int32_t                       c_hflag;                    /* cnode's flags for maintaining hash - protected by its hash bucket lock */
     struct vnode                    *c_vp;                      /* vnode for data fork or dir */
     struct vnode                    *c_rsrc_vp;                 /* vnode for resource fork */
     u_int32_t                       c_childhint;                /* catalog hint for children (small dirs only) */
@@ -177,7 +179,7 @@ typedef struct cnode cnode_t;
 #define c_dirhintcnt    c_union.cu_dirhintcnt
 #define c_syslockcount  c_union.cu_syslockcount
 
-/* hash maintenance flags kept in c_hflag and protected by hfs_chash_mutex */
+/* hash maintenance flags kept in c_hflag and protected by the cnode's hash bucket mutex */
 #define H_ALLOC      0x00001    /* CNode is being allocated */
 #define H_ATTACH     0x00002    /* CNode is being attached to by another vnode */
 #define H_TRANSIT    0x00004    /* CNode is getting recycled  */
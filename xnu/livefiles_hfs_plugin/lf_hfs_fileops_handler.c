@@ -70,6 +70,10 @@ int LFHFS_Read ( UVFSFileNode psNode, uint64_t uOffset, size_t iLength, void *pv
 
     uint64_t uReadStartCluster;
     retval = raw_readwrite_read( vp, uOffset, pvBuf, iLength, iActuallyRead, &uReadStartCluster );
+    if ( retval == 0 )
+    {
+        raw_readwrite_read_ahead( vp, uOffset, *iActuallyRead );
+    }
 
     cp->c_touch_acctime = TRUE;
 
@@ -230,18 +234,14 @@ sizeok:
             filesize = fp->ff_size;
 
 
-        // Fill last cluster with zeros.
-        if ( origFileSize < (off_t)uOffset )
-        {
-            raw_readwrite_zero_fill_last_block_suffix(vp);
-        }
-
         if (filesize > fp->ff_size) {
             fp->ff_new_size = filesize;
         }
 
+        // Fill the rest of the old last cluster with zeros, in the same pass as the data.
+        uint64_t uZeroFrom = ( origFileSize < (off_t)uOffset ) ? (uint64_t)origFileSize : uOffset;
         uint64_t uActuallyWritten;
-        retval = raw_readwrite_write(vp, uOffset, (void*)pvBuf, iActualLengthToWrite, &uActuallyWritten);
+        retval = raw_readwrite_write_zero_prefixed(vp, uZeroFrom, uOffset, (void*)pvBuf, iActualLengthToWrite, &uActuallyWritten);
         *iActuallyWrite = uActuallyWritten;
         if (retval) {
             fp->ff_new_size = 0;    /* no longer extending; use ff_size */
@@ -7,6 +7,7 @@
 */
 
 #include <sys/attr.h>
+#include <stdlib.h>
 #include "lf_hfs.h"
 #include "lf_hfs_fsops_handler.h"
 #include "lf_hfs_dirops_handler.h"
@@ -260,6 +261,27 @@ LFHFS_Init ( void )
     // Initializing Buffer cache
     lf_hfs_generic_buf_cache_init();
 
+    iErr = raw_readwrite_read_ahead_init();
+    if ( iErr != 0 )
+    {
+        goto exit;
+    }
+
+    const char* pcIOBackend = getenv( LFHFS_IO_BACKEND_ENV );
+    if ( pcIOBackend != NULL )
+    {
+        const RawIOBackend_S* psBackend;
+        uint32_t uQueueDepth;
+        if ( raw_readwrite_parse_io_backend( pcIOBackend, &psBackend, &uQueueDepth ) == 0 )
+        {
+            raw_readwrite_set_default_io_backend( psBackend->pcName, uQueueDepth );
+        }
+        else
+        {
+            LFHFS_LOG(LEVEL_ERROR, "LFHFS_Init: ignoring bad %s \"%s\"\n", LFHFS_IO_BACKEND_ENV, pcIOBackend);
+        }
+    }
+
     BTReserveSetup();
 
     journal_init();
@@ -275,6 +297,8 @@ LFHFS_Fini ( void )
 
     raw_readwrite_zero_fill_de_init();
 
+    raw_readwrite_read_ahead_de_init();
+
     // De-Initializing Buffer cache
     lf_hfs_generic_buf_cache_deinit();
 }
@@ -419,6 +443,25 @@ LFHFS_SetFSAttr ( UVFSFileNode psNode, const char *pcAttr, const UVFSFSAttribute
         return hfs_rename_volume(rootVnode, psAttrVal->fsa_string);
 //        (void) vnode_put(root_vp);
     }
+    else if (strcmp(pcAttr, LFHFS_FSATTR_IO_BACKEND) == 0)
+    {
+        struct hfsmount *hfsmp = VTOHFS(psVnode);
+        const RawIOBackend_S* psBackend;
+        uint32_t uQueueDepth;
+
+        if (uLen == 0 || strnlen(psAttrVal->fsa_string, uLen) == uLen)
+            return EINVAL;
+
+        int error = raw_readwrite_parse_io_backend(psAttrVal->fsa_string, &psBackend, &uQueueDepth);
+        if (error)
+            return error;
+
+        // No read-ahead job of this mount may straddle the switch.
+        raw_readwrite_read_ahead_drain(hfsmp->hfs_devvp);
+        hfsmp->hfs_io_queue_depth = uQueueDepth;
+        hfsmp->hfs_io_backend     = psBackend;
+        return 0;
+    }
 
     return ENOTSUP;
 }
@@ -658,6 +701,19 @@ LFHFS_GetFSAttr ( UVFSFileNode psNode, const char *pcAttr, UVFSFSAttributeValue
         goto end;
     }
 
+    if (strcmp(pcAttr, LFHFS_FSATTR_IO_BACKEND)==0)
+    {
+        char pcSpec[LFHFS_IO_BACKEND_SPEC_MAX];
+        snprintf(pcSpec, sizeof(pcSpec), "%s:%u", psMount->hfs_io_backend->pcName, psMount->hfs_io_queue_depth);
+        *puRetLen = strlen(pcSpec)+1; // Add 1 for the NULL terminator
+        if (uLen < *puRetLen)
+        {
+            return E2BIG;
+        }
+        strlcpy(psAttrVal->fsa_string, pcSpec, *puRetLen);
+        goto end;
+    }
+
     if (strcmp(pcAttr, UVFS_FSATTR_VOLUUID)==0)
     {
         *puRetLen = sizeof(uuid_t);
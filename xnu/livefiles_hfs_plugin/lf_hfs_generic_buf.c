@@ -8,48 +8,103 @@
 #include "lf_hfs_generic_buf.h"
 #include "lf_hfs_vfsutils.h"
 #include "lf_hfs_raw_read_write.h"
-#include "lf_hfs_rangelist.h"
 #include "lf_hfs_locks.h"
 #include "lf_hfs_logger.h"
 #include <sys/queue.h>
+#include <stddef.h>
 #include <assert.h>
 
 #define GEN_BUF_ALLOC_DEBUG 0
 
+// The buffer cache is split into shards, selected by hashing (fd, physical cluster).
+// Each shard has its own lock, its own hash buckets and its own CLOCK ring, so lookups
+// of unrelated blocks from different threads do not contend.
+// A second hash, keyed by vnode, links all the buffers of a vnode so that
+// lf_hfs_generic_buf_write_iterate and lf_hfs_generic_buf_cache_remove_vnode do not need
+// to walk the whole cache.
+#define BUF_CACHE_NUM_OF_SHARDS     (8)
+#define BUF_CACHE_SHARD_HASH_SIZE   (64)
+#define BUF_CACHE_VNODE_HASH_SIZE   (64)
+
 TAILQ_HEAD(buf_cache_head, buf_cache_entry);
+LIST_HEAD(buf_cache_hash, buf_cache_entry);
 
 struct buf_cache_entry {
-    TAILQ_ENTRY(buf_cache_entry) buf_cache_link;
-    GenericLFBuf sBuf;
+    LIST_ENTRY(buf_cache_entry)  buf_hash_link;    // (fd, phy cluster) hash chain
+    LIST_ENTRY(buf_cache_entry)  buf_vnode_link;   // vnode hash chain
+    TAILQ_ENTRY(buf_cache_entry) buf_clock_link;   // CLOCK ring of the shard
+    int                          iFD;
+    uint32_t                     uShard;
+    boolean_t                    bReferenced;      // CLOCK reference bit, set on every cache hit
+    GenericLFBuf                 sBuf;
+};
+
+struct buf_cache_shard {
+    pthread_mutex_t              sLock;            // protects everything in the shard
+    struct buf_cache_hash        sHash[BUF_CACHE_SHARD_HASH_SIZE];
+    struct buf_cache_head        sClock;
+    struct buf_cache_entry      *psHand;           // next entry the CLOCK hand looks at
+    uint32_t                     uNumOfEntries;
+    uint64_t                     uDataSize;
+};
+
+struct buf_cache_vnode_bucket {
+    pthread_mutex_t              sLock;            // protects sHead. Taken after a shard lock.
+    struct buf_cache_hash        sHead;
 };
 
+#define BUF_TO_CACHE_ENTRY(psBuf) ((struct buf_cache_entry *)((char *)(psBuf) - offsetof(struct buf_cache_entry, sBuf)))
+
 boolean_t buf_cache_state = false;
-struct buf_cache_head buf_cache_list;
-pthread_mutex_t buf_cache_mutex;      /* protects access to buffer cache data */
+static struct buf_cache_shard        gsBufCacheShards[BUF_CACHE_NUM_OF_SHARDS];
+static struct buf_cache_vnode_bucket gsBufCacheVnodeHash[BUF_CACHE_VNODE_HASH_SIZE];
 
+// Default memory budget of the whole cache. Can be changed at runtime with
+// lf_hfs_generic_buf_cache_set_limits(). Each shard gets an equal part of it.
+// Once a shard passes its part, unused buffers are evicted until it is back under 3/4 of it.
+#define BUF_CACHE_DEFAULT_MAX_ENTRIES   (140)
+#define BUF_CACHE_DEFAULT_MAX_DATA      (1536*1024)
 
-#define BUF_CACHE_MAX_ENTRIES_UPPER_LIMIT   (140)
-#define BUF_CACHE_MAX_ENTRIES_LOWER_LIMIT   (128)
-#define BUF_CACHE_MAX_DATA_UPPER_LIMIT (1536*1024)
-#define BUF_CACHE_MAX_DATA_LOWER_LIMIT (1024*1024)
+static uint32_t guBufCacheMaxEntries = BUF_CACHE_DEFAULT_MAX_ENTRIES;
+static uint64_t guBufCacheMaxData    = BUF_CACHE_DEFAULT_MAX_DATA;
 
 CacheStats_S gCacheStat = {0};
 
+// Cache statistics are updated from several shards concurrently
+#define BUF_CACHE_STAT_ADD(field, val)  __atomic_add_fetch(&gCacheStat.field, (val), __ATOMIC_RELAXED)
+#define BUF_CACHE_STAT_SUB(field, val)  __atomic_sub_fetch(&gCacheStat.field, (val), __ATOMIC_RELAXED)
+
 #define IGNORE_MOUNT_FD         (INT_MAX)
 
 void lf_hfs_generic_buf_cache_init( void );
 void lf_hfs_generic_buf_cache_deinit( void );
-struct buf_cache_entry *lf_hfs_generic_buf_cache_find( GenericLFBufPtr psBuf );
 struct buf_cache_entry *lf_hfs_generic_buf_cache_find_by_phy_cluster(int iFD, uint64_t uPhyCluster, uint64_t uBlockSize);
 struct buf_cache_entry *lf_hfs_generic_buf_cache_find_gen_buf(GenericLFBufPtr psBuf);
 GenericLFBuf           *lf_hfs_generic_buf_cache_add( GenericLFBuf *psBuf );
 void lf_hfs_generic_buf_cache_update( GenericLFBufPtr psBuf );
-void lf_hfs_generic_buf_cache_copy( struct buf_cache_entry *entry, GenericLFBufPtr psBuf );
 void lf_hfs_generic_buf_cache_remove( struct buf_cache_entry *entry );
 void lf_hfs_generic_buf_cache_remove_all( int iFD );
 void lf_hfs_generic_buf_ref(GenericLFBuf *psBuf);
 void lf_hfs_generic_buf_rele(GenericLFBuf *psBuf);
 
+static inline uint32_t lf_hfs_generic_buf_phy_hash(int iFD, uint64_t uPhyCluster) {
+    uint64_t uKey = (uPhyCluster ^ ((uint64_t)(uint32_t)iFD << 40)) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(uKey >> 32);
+}
+
+static inline struct buf_cache_shard *lf_hfs_generic_buf_cache_shard(int iFD, uint64_t uPhyCluster) {
+    return &gsBufCacheShards[lf_hfs_generic_buf_phy_hash(iFD, uPhyCluster) % BUF_CACHE_NUM_OF_SHARDS];
+}
+
+static inline struct buf_cache_hash *lf_hfs_generic_buf_cache_bucket(struct buf_cache_shard *psShard, int iFD, uint64_t uPhyCluster) {
+    return &psShard->sHash[(lf_hfs_generic_buf_phy_hash(iFD, uPhyCluster) / BUF_CACHE_NUM_OF_SHARDS) % BUF_CACHE_SHARD_HASH_SIZE];
+}
+
+static inline struct buf_cache_vnode_bucket *lf_hfs_generic_buf_cache_vnode_bucket(vnode_t psVnode) {
+    uintptr_t uKey = (uintptr_t)psVnode;
+    return &gsBufCacheVnodeHash[((uKey >> 4) ^ (uKey >> 12)) % BUF_CACHE_VNODE_HASH_SIZE];
+}
+
 // lf_hfs_generic_buf_take_ownership
 // Take ownership on this buff.
 // When the function returns zero, we own the buffer it is locked by our thread.
@@ -103,7 +158,7 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
     struct buf_cache_entry *psCacheEntry = NULL;
 
     assert(psVnode);
-    
+
     if (uFlags & GEN_BUF_PHY_BLOCK) {
         uPhyCluster   = uBlockN;
     } else {
@@ -117,10 +172,10 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
         if (iError != 0) {
             panic("Error calculating uPhyCluster");
         }
-        
+
         uint64_t uReadOffset = (HFSTOVCB(psVnode->sFSParams.vnfs_mp->psHfsmount)->hfsPlusIOPosOffset +
                                 uStartCluster * HFSTOVCB(psVnode->sFSParams.vnfs_mp->psHfsmount)->blockSize) + uInClusterOffset;
-        
+
         uPhyCluster = uReadOffset / HFSTOVCB(psVnode->sFSParams.vnfs_mp->psHfsmount)->hfs_physical_block_size;
     }
 
@@ -129,55 +184,60 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
                psVnode, uBlockN, uBlockSize, uFlags, uPhyCluster);
     #endif
 
+    sBuf.uBlockN       = uBlockN;
+    sBuf.uDataSize     = uBlockSize;
+    sBuf.psVnode       = psVnode;
+    sBuf.uPhyCluster   = uPhyCluster;
+    sBuf.uCacheFlags   = uFlags & ~GEN_BUF_NO_WAIT;
+    sBuf.uUseCnt       = 1;
+    sBuf.sOwnerThread = pthread_self();
+
     // Check buffer cache, if a memory buffer already allocated for this physical block
     if ( buf_cache_state && !(uFlags & GEN_BUF_NON_CACHED)) {
+        int iFD = VNODE_TO_IFD(psVnode);
+        struct buf_cache_shard *psShard = lf_hfs_generic_buf_cache_shard(iFD, uPhyCluster);
     retry:
-        lf_lck_mtx_lock(&buf_cache_mutex);
+        lf_lck_mtx_lock(&psShard->sLock);
 
-        psCacheEntry = lf_hfs_generic_buf_cache_find_by_phy_cluster(VNODE_TO_IFD(psVnode), uPhyCluster, uBlockSize);
+        psCacheEntry = lf_hfs_generic_buf_cache_find_by_phy_cluster(iFD, uPhyCluster, uBlockSize);
         if (psCacheEntry) {
             // buffer exists, share.
-            TAILQ_REMOVE(&buf_cache_list, psCacheEntry, buf_cache_link);
-            TAILQ_INSERT_HEAD(&buf_cache_list, psCacheEntry, buf_cache_link);
+            psCacheEntry->bReferenced = true;
 
             psBuf = &psCacheEntry->sBuf;
             #if GEN_BUF_ALLOC_DEBUG
                 printf("Already in cache: %p (UseCnt %u uCacheFlags 0x%llx)\n", psBuf, psBuf->uUseCnt, psBuf->uCacheFlags);
             #endif
-            int iRet = lf_hfs_generic_buf_take_ownership(psBuf, &buf_cache_mutex);
+            if (uFlags & GEN_BUF_NO_WAIT) {
+                // Don't wait for the owner; the caller can do without this buffer.
+                bool bBusy = (lf_lck_mtx_try_lock(&psBuf->sLock) != 0);
+                if (!bBusy) {
+                    bBusy = (psBuf->uUseCnt != 0) && (psBuf->sOwnerThread != pthread_self());
+                    lf_lck_mtx_unlock(&psBuf->sLock);
+                }
+                if (bBusy) {
+                    lf_lck_mtx_unlock(&psShard->sLock);
+                    return(NULL);
+                }
+            }
+            int iRet = lf_hfs_generic_buf_take_ownership(psBuf, &psShard->sLock);
             if (iRet == EAGAIN) {
                 goto retry;
             } else if (iRet) {
                 LFHFS_LOG(LEVEL_ERROR, "lf_hfs_generic_buf_allocate: lf_hfs_generic_buf_take_ownership returned %d.\n", iRet);
                 return(NULL);
-            } 
-            
+            }
+
+            BUF_CACHE_STAT_ADD(buf_cache_hit, 1);
             lf_hfs_generic_buf_unlock(psBuf);
-            lf_lck_mtx_unlock(&buf_cache_mutex);
+            lf_lck_mtx_unlock(&psShard->sLock);
             return(psBuf);
         }
 
-        lf_lck_mtx_unlock(&buf_cache_mutex);
-    }
-
-    // Not found in cache, need to create a GenBuf
-    sBuf.uBlockN       = uBlockN;
-    sBuf.uDataSize     = uBlockSize;
-    sBuf.psVnode       = psVnode;
-    sBuf.uPhyCluster   = uPhyCluster;
-    sBuf.uCacheFlags   = uFlags;
-    sBuf.uUseCnt       = 1;
-    sBuf.sOwnerThread = pthread_self();
-
-    if ( buf_cache_state && !(uFlags & GEN_BUF_NON_CACHED)) {
-        
-        // Add to cache
-        lf_lck_mtx_lock(&buf_cache_mutex);
-        
+        // Not found in cache. Add it while still holding the shard lock,
+        // so that threads racing on the same block end up sharing one buffer.
+        BUF_CACHE_STAT_ADD(buf_cache_miss, 1);
         GenericLFBufPtr psCachedBuf = lf_hfs_generic_buf_cache_add(&sBuf);
-        
-        lf_cond_init(&psCachedBuf->sOwnerCond);
-        lf_lck_mtx_init(&psCachedBuf->sLock);
 
         if (psCachedBuf) {
             if (uFlags & (GEN_BUF_IS_UPTODATE | GEN_BUF_LITTLE_ENDIAN)) {
@@ -186,13 +246,13 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
                 lf_hfs_generic_buf_unlock(psCachedBuf);
             }
         }
-        
-        lf_lck_mtx_unlock(&buf_cache_mutex);
+
+        lf_lck_mtx_unlock(&psShard->sLock);
         #if GEN_BUF_ALLOC_DEBUG
             printf("Added to cache %p\n", psCachedBuf);
         #endif
         return psCachedBuf;
-        
+
     } else {
         // Alloc memomry for a non-cached buffer
         psBuf  = hfs_mallocz(sizeof(GenericLFBuf));
@@ -221,7 +281,7 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
         #if GEN_BUF_ALLOC_DEBUG
             printf("Provided uncached %p\n", psBuf);
         #endif
-        
+
         return psBuf;
     }
 error:
@@ -251,9 +311,7 @@ errno_t lf_hfs_generic_buf_read( GenericLFBufPtr psBuf )
     
     if ( buf_cache_state && !(psBuf->uCacheFlags & GEN_BUF_NON_CACHED))
     {
-        lf_lck_mtx_lock(&buf_cache_mutex);
         lf_hfs_generic_buf_cache_update(psBuf);
-        lf_lck_mtx_unlock(&buf_cache_mutex);
     }
 
     lf_hfs_generic_buf_lock(psBuf);
@@ -325,6 +383,92 @@ errno_t lf_hfs_generic_buf_write( GenericLFBufPtr psBuf ) {
     return iErr;
 }
 
+// Read and write several buffers of the same mount as one batch, so the I/O
+// backend of the mount can keep them in flight together. The caller owns all
+// the buffers. Returns the first error; buffers that were read successfully
+// are marked up to date even if others failed.
+static errno_t lf_hfs_generic_buf_io_multi( GenericLFBufPtr *ppsBufs, uint32_t uNumOfBufs, bool bWrite ) {
+    errno_t iErr = 0;
+    uint32_t uNumOfReqs = 0;
+
+    if (uNumOfBufs == 0) {
+        return(0);
+    }
+
+    RawIORequest_S *psReqs = hfs_mallocz(uNumOfBufs * sizeof(RawIORequest_S));
+    if (!psReqs) {
+        return(ENOMEM);
+    }
+
+    vnode_t psVnode = ppsBufs[0]->psVnode;
+    uint32_t uPhyBlockSize = HFSTOVCB(psVnode->sFSParams.vnfs_mp->psHfsmount)->hfs_physical_block_size;
+
+    // The cache update takes the shard lock, which is taken before buffer locks elsewhere
+    if (!bWrite && buf_cache_state) {
+        for (uint32_t u = 0; u < uNumOfBufs; u++) {
+            if (!(ppsBufs[u]->uCacheFlags & GEN_BUF_NON_CACHED)) {
+                lf_hfs_generic_buf_cache_update(ppsBufs[u]);
+            }
+        }
+    }
+
+    // Every buffer is owned by this thread, so no one else can be holding two
+    // of them and taking the locks in array order is safe.
+    for (uint32_t u = 0; u < uNumOfBufs; u++) {
+        GenericLFBufPtr psBuf = ppsBufs[u];
+
+        lf_hfs_generic_buf_lock(psBuf);
+
+        assert(psBuf->uUseCnt != 0);
+        assert(psBuf->sOwnerThread == pthread_self());
+        assert(psBuf->psVnode->sFSParams.vnfs_mp == psVnode->sFSParams.vnfs_mp);
+
+        if (bWrite) {
+            assert(!(psBuf->uCacheFlags & GEN_BUF_WRITE_LOCK));
+        } else if (psBuf->uCacheFlags & GEN_BUF_IS_UPTODATE) {
+            continue;
+        }
+
+        psReqs[uNumOfReqs].pvBuf   = psBuf->pvData;
+        psReqs[uNumOfReqs].uOffset = psBuf->uPhyCluster * uPhyBlockSize;
+        psReqs[uNumOfReqs].uLength = psBuf->uDataSize;
+        psReqs[uNumOfReqs].bWrite  = bWrite;
+        uNumOfReqs++;
+    }
+
+    if (uNumOfReqs) {
+        iErr = raw_readwrite_submit(psVnode, psReqs, uNumOfReqs);
+        if (iErr) {
+            LFHFS_LOG(LEVEL_ERROR, "lf_hfs_generic_buf_io_multi: %s of %u buffers failed [%d]\n", bWrite ? "write" : "read", uNumOfReqs, iErr);
+        }
+    }
+
+    uint32_t uReq = 0;
+    for (uint32_t u = 0; u < uNumOfBufs; u++) {
+        GenericLFBufPtr psBuf = ppsBufs[u];
+
+        if (!bWrite && uReq < uNumOfReqs && psReqs[uReq].pvBuf == psBuf->pvData) {
+            if (psReqs[uReq].iErr == 0) {
+                psBuf->uValidBytes = psBuf->uDataSize;
+                lf_hfs_generic_buf_set_cache_flag(psBuf, GEN_BUF_IS_UPTODATE);
+            }
+            uReq++;
+        }
+        lf_hfs_generic_buf_unlock(psBuf);
+    }
+
+    hfs_free(psReqs);
+    return(iErr);
+}
+
+errno_t lf_hfs_generic_buf_read_multi( GenericLFBufPtr *ppsBufs, uint32_t uNumOfBufs ) {
+    return lf_hfs_generic_buf_io_multi(ppsBufs, uNumOfBufs, false);
+}
+
+errno_t lf_hfs_generic_buf_write_multi( GenericLFBufPtr *ppsBufs, uint32_t uNumOfBufs ) {
+    return lf_hfs_generic_buf_io_multi(ppsBufs, uNumOfBufs, true);
+}
+
 void lf_hfs_generic_buf_clear( GenericLFBufPtr psBuf ) {
     memset(psBuf->pvData,0,sizeof(psBuf->uDataSize));
 }
@@ -345,8 +489,9 @@ void lf_hfs_generic_buf_invalidate( GenericLFBuf *psBuf ) {
 
     // Check buffer cache, if a memory buffer already allocated for this physical block
     if ( buf_cache_state && !(psBuf->uCacheFlags & GEN_BUF_NON_CACHED)) {
-        
-        lf_lck_mtx_lock(&buf_cache_mutex);
+        struct buf_cache_shard *psShard = &gsBufCacheShards[BUF_TO_CACHE_ENTRY(psBuf)->uShard];
+
+        lf_lck_mtx_lock(&psShard->sLock);
         psCacheEntry = lf_hfs_generic_buf_cache_find_gen_buf(psBuf);
 
         if (psCacheEntry) {
@@ -355,7 +500,7 @@ void lf_hfs_generic_buf_invalidate( GenericLFBuf *psBuf ) {
             panic("A buffer is marked Cached, but was not found in Cache");
         }
         
-        lf_lck_mtx_unlock(&buf_cache_mutex);
+        lf_lck_mtx_unlock(&psShard->sLock);
 
     } else {
         // This is a non-cached buffer
@@ -436,31 +581,64 @@ void lf_hfs_generic_buf_clear_cache_flag(GenericLFBufPtr psBuf, uint64_t uCacheF
     lf_hfs_generic_buf_unlock(psBuf);
 }
 
-static void lf_hfs_buf_free_unused()
+// Like lf_hfs_generic_buf_lock, but never blocks and never recurses.
+static boolean_t lf_hfs_generic_buf_try_lock(GenericLFBufPtr psBuf) {
+    if (psBuf->pLockingThread == pthread_self()) {
+        return false;
+    }
+    if (lf_lck_mtx_try_lock(&psBuf->sLock)) {
+        return false;
+    }
+    assert(psBuf->uLockCnt == 0);
+    psBuf->uLockCnt = 1;
+    psBuf->pLockingThread = pthread_self();
+    return true;
+}
+
+static void lf_hfs_generic_buf_cache_shard_limits(uint32_t *puMaxEntries, uint64_t *puMaxData) {
+    uint32_t uMaxEntries = guBufCacheMaxEntries / BUF_CACHE_NUM_OF_SHARDS;
+    uint64_t uMaxData    = guBufCacheMaxData    / BUF_CACHE_NUM_OF_SHARDS;
+
+    *puMaxEntries = (uMaxEntries)? uMaxEntries : 1;
+    *puMaxData    = uMaxData;
+}
+
+// Evict unused buffers from the shard with the CLOCK algorithm, until it holds no more
+// than uMaxEntries buffers and uMaxData bytes.
+// A referenced buffer gets its bit cleared and a second chance. Buffers in use or held
+// by the journal are skipped. Caller holds the shard lock.
+static void lf_hfs_buf_free_unused(struct buf_cache_shard *psShard, uint32_t uMaxEntries, uint64_t uMaxData)
 {
-    //We want to free more then we actually need, so that we won't have to come here every new buf that we allocate
-    while ( gCacheStat.buf_cache_size > BUF_CACHE_MAX_ENTRIES_LOWER_LIMIT ||
-           gCacheStat.buf_total_allocated_size > BUF_CACHE_MAX_DATA_LOWER_LIMIT)
+    // Two sweeps over the ring are enough to clear every reference bit and evict whatever can be evicted
+    uint32_t uSteps = 2 * psShard->uNumOfEntries;
+
+    while ( (psShard->uNumOfEntries > uMaxEntries || psShard->uDataSize > uMaxData) && uSteps-- )
     {
-        struct buf_cache_entry *last;
-        
-        last = TAILQ_LAST(&buf_cache_list, buf_cache_head);
-        
-        if (!last) {
-            break;
+        struct buf_cache_entry *psVictim = psShard->psHand;
+        if (!psVictim) {
+            psVictim = TAILQ_FIRST(&psShard->sClock);
+            if (!psVictim) {
+                break;
+            }
         }
-        
-        lf_hfs_generic_buf_lock(&last->sBuf);
-        
-        if ((last->sBuf.uUseCnt) || (last->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
-            // Last buffer in buffer cache is in use.
-            // Nothing more to free
-            lf_hfs_generic_buf_unlock(&last->sBuf);
-            break;
+        psShard->psHand = TAILQ_NEXT(psVictim, buf_clock_link);
+
+        if (psVictim->bReferenced) {
+            psVictim->bReferenced = false;
+            continue;
         }
-        
-        ++gCacheStat.buf_cache_cleanup;
-        lf_hfs_generic_buf_cache_remove(last);
+
+        if (!lf_hfs_generic_buf_try_lock(&psVictim->sBuf)) {
+            continue;
+        }
+
+        if ((psVictim->sBuf.uUseCnt) || (psVictim->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
+            lf_hfs_generic_buf_unlock(&psVictim->sBuf);
+            continue;
+        }
+
+        BUF_CACHE_STAT_ADD(buf_cache_cleanup, 1);
+        lf_hfs_generic_buf_cache_remove(psVictim);
     }
 }
 
@@ -474,7 +652,13 @@ void lf_hfs_generic_buf_release( GenericLFBufPtr psBuf )
     if (!psBuf) {
         return;
     }
-    
+
+    // Once released, the buffer may get evicted by another thread. Note its shard first.
+    struct buf_cache_shard *psShard = NULL;
+    if (buf_cache_state && !(psBuf->uCacheFlags & GEN_BUF_NON_CACHED)) {
+        psShard = &gsBufCacheShards[BUF_TO_CACHE_ENTRY(psBuf)->uShard];
+    }
+
     lf_hfs_generic_buf_rele(psBuf);
 
     // If Unused and UnCached, free.
@@ -488,15 +672,25 @@ void lf_hfs_generic_buf_release( GenericLFBufPtr psBuf )
         return;
     }
 
-    // Cleanup unused entries in the cache
-    int iTry = lf_lck_mtx_try_lock(&buf_cache_mutex);
+    if (!psShard) {
+        return;
+    }
+
+    // Cleanup unused entries in the shard
+    int iTry = lf_lck_mtx_try_lock(&psShard->sLock);
     if (iTry) {
         return;
     }
 
+    uint32_t uMaxEntries;
+    uint64_t uMaxData;
+    lf_hfs_generic_buf_cache_shard_limits(&uMaxEntries, &uMaxData);
+
     //We want to free more then we actually need, so that we won't have to come here every new buf that we allocate
-    lf_hfs_buf_free_unused();
-    lf_lck_mtx_unlock(&buf_cache_mutex);
+    if (psShard->uNumOfEntries > uMaxEntries || psShard->uDataSize > uMaxData) {
+        lf_hfs_buf_free_unused(psShard, uMaxEntries - uMaxEntries/4, uMaxData - uMaxData/4);
+    }
+    lf_lck_mtx_unlock(&psShard->sLock);
 }
 
 //  Buffer Cache functions
@@ -505,8 +699,24 @@ void lf_hfs_generic_buf_cache_init( void ) {
     gCacheStat.buf_cache_size       = 0;
     gCacheStat.max_gen_buf_uncached = 0;
     gCacheStat.gen_buf_uncached     = 0;
-    lf_lck_mtx_init(&buf_cache_mutex);
-    TAILQ_INIT(&buf_cache_list);
+
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_NUM_OF_SHARDS; uShard++) {
+        struct buf_cache_shard *psShard = &gsBufCacheShards[uShard];
+        lf_lck_mtx_init(&psShard->sLock);
+        for (uint32_t uBucket = 0; uBucket < BUF_CACHE_SHARD_HASH_SIZE; uBucket++) {
+            LIST_INIT(&psShard->sHash[uBucket]);
+        }
+        TAILQ_INIT(&psShard->sClock);
+        psShard->psHand        = NULL;
+        psShard->uNumOfEntries = 0;
+        psShard->uDataSize     = 0;
+    }
+
+    for (uint32_t uBucket = 0; uBucket < BUF_CACHE_VNODE_HASH_SIZE; uBucket++) {
+        lf_lck_mtx_init(&gsBufCacheVnodeHash[uBucket].sLock);
+        LIST_INIT(&gsBufCacheVnodeHash[uBucket].sHead);
+    }
+
     buf_cache_state = true;
 }
 
@@ -518,7 +728,13 @@ void lf_hfs_generic_buf_cache_deinit( void )
     assert(gCacheStat.gen_buf_uncached == 0);
 
     buf_cache_state = false;
-    lf_lck_mtx_destroy(&buf_cache_mutex);
+
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_NUM_OF_SHARDS; uShard++) {
+        lf_lck_mtx_destroy(&gsBufCacheShards[uShard].sLock);
+    }
+    for (uint32_t uBucket = 0; uBucket < BUF_CACHE_VNODE_HASH_SIZE; uBucket++) {
+        lf_lck_mtx_destroy(&gsBufCacheVnodeHash[uBucket].sLock);
+    }
 }
 
 void lf_hfs_generic_buf_cache_clear_by_iFD( int iFD )
@@ -526,91 +742,91 @@ void lf_hfs_generic_buf_cache_clear_by_iFD( int iFD )
     lf_hfs_generic_buf_cache_remove_all(iFD);
 }
 
-boolean_t lf_hfs_generic_buf_match_range( struct buf_cache_entry *entry, GenericLFBufPtr psBuf )
+// Set the memory budget of the buffer cache. Zero restores the default.
+// Shrinking the budget evicts unused buffers right away.
+void lf_hfs_generic_buf_cache_set_limits( uint32_t uMaxEntries, uint64_t uMaxDataSize )
 {
-    if ( VTOF(entry->sBuf.psVnode) != VTOF(psBuf->psVnode) )
-    {
-        return false;
+    guBufCacheMaxEntries = (uMaxEntries)?  uMaxEntries  : BUF_CACHE_DEFAULT_MAX_ENTRIES;
+    guBufCacheMaxData    = (uMaxDataSize)? uMaxDataSize : BUF_CACHE_DEFAULT_MAX_DATA;
+
+    if (!buf_cache_state) {
+        return;
     }
 
-    uint64_t size_1     = entry->sBuf.uDataSize;
-    uint64_t start_1    = entry->sBuf.uBlockN * size_1;
-    uint64_t end_1      = start_1 + size_1 - 1;
-    uint64_t size_2     = psBuf->uDataSize;
-    uint64_t start_2    = psBuf->uBlockN * size_2;
-    uint64_t end_2      = start_2 + size_2 - 1;
+    uint32_t uShardMaxEntries;
+    uint64_t uShardMaxData;
+    lf_hfs_generic_buf_cache_shard_limits(&uShardMaxEntries, &uShardMaxData);
 
-    enum rl_overlaptype overlap;
-    struct rl_entry entry_range = {.rl_start = start_1, .rl_end = end_1};
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_NUM_OF_SHARDS; uShard++) {
+        struct buf_cache_shard *psShard = &gsBufCacheShards[uShard];
+        lf_lck_mtx_lock(&psShard->sLock);
+        lf_hfs_buf_free_unused(psShard, uShardMaxEntries, uShardMaxData);
+        lf_lck_mtx_unlock(&psShard->sLock);
+    }
+}
 
-    overlap = rl_overlap(&entry_range, start_2, end_2);
+// Run the function pfCallback on all buffers that belongs to node psVnode.
+// The matching buffers are collected first, so that pfCallback may release or invalidate them.
+int lf_hfs_generic_buf_write_iterate(vnode_t psVnode, IterateCallback pfCallback, uint32_t uFlags, void *pvArgs) {
 
-    switch (overlap)
-    {
-        case RL_MATCHINGOVERLAP:
-            return true;
-        case RL_OVERLAPCONTAINSRANGE:
-            // Make sure we have same start though
-            assert(start_1 == start_2);
-            return true;
-        case RL_NOOVERLAP:
-        case RL_OVERLAPISCONTAINED:
-            return false;
-        case RL_OVERLAPSTARTSBEFORE:
-        case RL_OVERLAPENDSAFTER:
-            LFHFS_LOG(LEVEL_ERROR, " lf_hfs_generic_buf_match_range : cache overlap [%d]", overlap);
-            assert(0);
+    struct buf_cache_vnode_bucket *psBucket = lf_hfs_generic_buf_cache_vnode_bucket(psVnode);
+    struct buf_cache_entry *psCacheEntry;
+    GenericLFBufPtr *ppsBufs = NULL;
+    uint32_t uNumOfBufs = 0;
+    uint32_t uMaxBufs   = 0;
+
+    lf_lck_mtx_lock(&psBucket->sLock);
+
+    LIST_FOREACH(psCacheEntry, &psBucket->sHead, buf_vnode_link) {
+        if (psCacheEntry->sBuf.psVnode == psVnode) {
+            uMaxBufs++;
+        }
     }
-}
 
-struct buf_cache_entry * lf_hfs_generic_buf_cache_find( GenericLFBufPtr psBuf )
-{
-    struct buf_cache_entry *entry, *entry_next;
+    if (uMaxBufs) {
+        ppsBufs = hfs_malloc(uMaxBufs * sizeof(*ppsBufs));
+        if (!ppsBufs) {
+            lf_lck_mtx_unlock(&psBucket->sLock);
+            return(ENOMEM);
+        }
+    }
 
-    TAILQ_FOREACH_SAFE(entry, &buf_cache_list, buf_cache_link, entry_next)
-    {
-        if ( lf_hfs_generic_buf_match_range(entry, psBuf) )
-        {
-            break;
+    LIST_FOREACH(psCacheEntry, &psBucket->sHead, buf_vnode_link) {
+        if (psCacheEntry->sBuf.psVnode != psVnode) {
+            continue;
+        }
+        if ((uFlags & BUF_SKIP_LOCKED) && (psCacheEntry->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
+            continue;
+        }
+        if ((uFlags & BUF_SKIP_NONLOCKED) && !(psCacheEntry->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
+            continue;
         }
+        ppsBufs[uNumOfBufs++] = &psCacheEntry->sBuf;
     }
 
-    return entry;
-}
+    lf_lck_mtx_unlock(&psBucket->sLock);
 
-// Run the function pfCallback on all buffers that belongs to node psVnode.
-int lf_hfs_generic_buf_write_iterate(vnode_t psVnode, IterateCallback pfCallback, uint32_t uFlags, void *pvArgs) {
-   
-    struct buf_cache_entry *psCacheEntry, *psNextCacheEntry;
-    int iFD = VNODE_TO_IFD(psVnode);
+    for (uint32_t u = 0; u < uNumOfBufs; u++) {
+        pfCallback(ppsBufs[u], pvArgs);
+    }
 
-    TAILQ_FOREACH_SAFE(psCacheEntry, &buf_cache_list, buf_cache_link, psNextCacheEntry) {
-        int iEntryFD = VNODE_TO_IFD(psCacheEntry->sBuf.psVnode);
-        
-        if ( (iFD == iEntryFD) && (psCacheEntry->sBuf.psVnode == psVnode)) {
-            if ((uFlags & BUF_SKIP_LOCKED) && (psCacheEntry->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
-                continue;
-            }
-            if ((uFlags & BUF_SKIP_NONLOCKED) && !(psCacheEntry->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
-                continue;
-            }
-            pfCallback(&psCacheEntry->sBuf, pvArgs);
-        }
+    if (ppsBufs) {
+        hfs_free(ppsBufs);
     }
     return(0);
 }
 
-
+// Caller holds the lock of the shard of (iFD, uPhyCluster)
 struct buf_cache_entry *lf_hfs_generic_buf_cache_find_by_phy_cluster(int iFD, uint64_t uPhyCluster, uint64_t uBlockSize) {
 
-    struct buf_cache_entry *psCacheEntry, *psNextCacheEntry;
-    
-    TAILQ_FOREACH_SAFE(psCacheEntry, &buf_cache_list, buf_cache_link, psNextCacheEntry) {
+    struct buf_cache_shard *psShard = lf_hfs_generic_buf_cache_shard(iFD, uPhyCluster);
+    struct buf_cache_entry *psCacheEntry;
+
+    LIST_FOREACH(psCacheEntry, lf_hfs_generic_buf_cache_bucket(psShard, iFD, uPhyCluster), buf_hash_link) {
         if (psCacheEntry->sBuf.psVnode)
         {
-            int iEntryFD = VNODE_TO_IFD(psCacheEntry->sBuf.psVnode);
             if ( (psCacheEntry->sBuf.uPhyCluster == uPhyCluster) &&
-                 (iEntryFD                       == iFD        ) &&
+                 (psCacheEntry->iFD              == iFD        ) &&
                  (psCacheEntry->sBuf.uDataSize   >= uBlockSize )  ) {
                 break;
             }
@@ -620,32 +836,43 @@ struct buf_cache_entry *lf_hfs_generic_buf_cache_find_by_phy_cluster(int iFD, ui
             LFHFS_LOG(LEVEL_ERROR, "lf_hfs_generic_buf_cache_find_by_phy_cluster: got buf with vnode == NULL, cache_flags: 0x%llx, uUseCnt %d", psCacheEntry->sBuf.uCacheFlags, psCacheEntry->sBuf.uUseCnt);
             assert(0);
         }
-
     }
     return psCacheEntry;
 }
 
+// Caller holds the lock of the buffer's shard
 struct buf_cache_entry *lf_hfs_generic_buf_cache_find_gen_buf(GenericLFBufPtr psBuf) {
-    
-    struct buf_cache_entry *psCacheEntry, *psNextCacheEntry;
-    
-    TAILQ_FOREACH_SAFE(psCacheEntry, &buf_cache_list, buf_cache_link, psNextCacheEntry) {
-        if ( &psCacheEntry->sBuf == psBuf ) {
+
+    struct buf_cache_entry *psEntry = BUF_TO_CACHE_ENTRY(psBuf);
+    struct buf_cache_shard *psShard = &gsBufCacheShards[psEntry->uShard];
+    struct buf_cache_entry *psCacheEntry;
+
+    LIST_FOREACH(psCacheEntry, lf_hfs_generic_buf_cache_bucket(psShard, psEntry->iFD, psBuf->uPhyCluster), buf_hash_link) {
+        if ( psCacheEntry == psEntry ) {
             break;
         }
     }
     return psCacheEntry;
 }
 
+// Caller holds the lock of the shard of the new buffer
 GenericLFBufPtr lf_hfs_generic_buf_cache_add( GenericLFBufPtr psBuf )
 {
     struct buf_cache_entry *entry;
+    int iFD = VNODE_TO_IFD(psBuf->psVnode);
+    struct buf_cache_shard *psShard = lf_hfs_generic_buf_cache_shard(iFD, psBuf->uPhyCluster);
+    struct buf_cache_vnode_bucket *psBucket = lf_hfs_generic_buf_cache_vnode_bucket(psBuf->psVnode);
 
     //Check if we have enough space to alloc this buffer, unless need to evict something
-    if (gCacheStat.buf_total_allocated_size + psBuf->uDataSize > BUF_CACHE_MAX_DATA_UPPER_LIMIT ||
-        gCacheStat.buf_cache_size + 1 == BUF_CACHE_MAX_ENTRIES_UPPER_LIMIT)
+    uint32_t uMaxEntries;
+    uint64_t uMaxData;
+    lf_hfs_generic_buf_cache_shard_limits(&uMaxEntries, &uMaxData);
+
+    if (psShard->uDataSize + psBuf->uDataSize > uMaxData ||
+        psShard->uNumOfEntries + 1 > uMaxEntries)
     {
-        lf_hfs_buf_free_unused();
+        //We want to free more then we actually need, so that we won't have to come here every new buf that we allocate
+        lf_hfs_buf_free_unused(psShard, uMaxEntries - uMaxEntries/4, uMaxData - uMaxData/4);
     }
 
     entry = hfs_mallocz(sizeof(*entry));
@@ -655,23 +882,42 @@ GenericLFBufPtr lf_hfs_generic_buf_cache_add( GenericLFBufPtr psBuf )
 
     memcpy(&entry->sBuf, (void*)psBuf, sizeof(*psBuf));
     entry->sBuf.uCacheFlags &= ~GEN_BUF_NON_CACHED;
-    
+    entry->iFD    = iFD;
+    entry->uShard = (uint32_t)(psShard - gsBufCacheShards);
+
     entry->sBuf.pvData = hfs_mallocz(psBuf->uDataSize);
     if (!entry->sBuf.pvData) {
         goto error;
     }
 
-    TAILQ_INSERT_HEAD(&buf_cache_list, entry, buf_cache_link);
+    lf_cond_init(&entry->sBuf.sOwnerCond);
+    lf_lck_mtx_init(&entry->sBuf.sLock);
 
-    gCacheStat.buf_cache_size++;
-    gCacheStat.buf_total_allocated_size+=psBuf->uDataSize;
-    
-    if (gCacheStat.buf_cache_size > gCacheStat.max_buf_cache_size) {
-        gCacheStat.max_buf_cache_size = gCacheStat.buf_cache_size;
+    LIST_INSERT_HEAD(lf_hfs_generic_buf_cache_bucket(psShard, iFD, psBuf->uPhyCluster), entry, buf_hash_link);
+
+    // New buffers go right behind the hand, so they get a full turn of the clock before they are considered
+    if (psShard->psHand) {
+        TAILQ_INSERT_BEFORE(psShard->psHand, entry, buf_clock_link);
+    } else {
+        TAILQ_INSERT_TAIL(&psShard->sClock, entry, buf_clock_link);
+    }
+
+    lf_lck_mtx_lock(&psBucket->sLock);
+    LIST_INSERT_HEAD(&psBucket->sHead, entry, buf_vnode_link);
+    lf_lck_mtx_unlock(&psBucket->sLock);
+
+    psShard->uNumOfEntries++;
+    psShard->uDataSize += psBuf->uDataSize;
+
+    uint32_t uCacheSize = BUF_CACHE_STAT_ADD(buf_cache_size, 1);
+    BUF_CACHE_STAT_ADD(buf_total_allocated_size, psBuf->uDataSize);
+
+    if (uCacheSize > gCacheStat.max_buf_cache_size) {
+        gCacheStat.max_buf_cache_size = uCacheSize;
     }
 
     return(&entry->sBuf);
-    
+
 error:
     if (entry) {
         if (entry->sBuf.pvData) {
@@ -684,34 +930,94 @@ error:
 
 void lf_hfs_generic_buf_cache_update( GenericLFBufPtr psBuf )
 {
-    struct buf_cache_entry *entry;
+    struct buf_cache_entry *entry = BUF_TO_CACHE_ENTRY(psBuf);
+    struct buf_cache_shard *psShard = &gsBufCacheShards[entry->uShard];
 
     #if GEN_BUF_ALLOC_DEBUG
         printf("lf_hfs_generic_buf_cache_update: psBuf %p\n", psBuf);
     #endif
 
-    // Check that cache entry still exists and hasn't thrown away
-    entry = lf_hfs_generic_buf_cache_find(psBuf);
-    if (!entry) {
+    lf_lck_mtx_lock(&psShard->sLock);
+    entry->bReferenced = true;
+    lf_lck_mtx_unlock(&psShard->sLock);
+}
+
+// The media under a cached buffer was written without going through the cache.
+// Make the next lf_hfs_generic_buf_read of it go to the media. Buffers held by
+// the journal are left alone, their content is newer than the media anyway.
+void lf_hfs_generic_buf_cache_invalidate_phy( int iFD, uint64_t uPhyCluster )
+{
+    struct buf_cache_shard *psShard;
+    struct buf_cache_entry *psCacheEntry;
+
+    if (!buf_cache_state) {
         return;
     }
 
-    TAILQ_REMOVE(&buf_cache_list, entry, buf_cache_link);
-    TAILQ_INSERT_HEAD(&buf_cache_list, entry, buf_cache_link);
+    psShard = lf_hfs_generic_buf_cache_shard(iFD, uPhyCluster);
+retry:
+    lf_lck_mtx_lock(&psShard->sLock);
+
+    LIST_FOREACH(psCacheEntry, lf_hfs_generic_buf_cache_bucket(psShard, iFD, uPhyCluster), buf_hash_link) {
+        if ( (psCacheEntry->sBuf.uPhyCluster != uPhyCluster) || (psCacheEntry->iFD != iFD) ) {
+            continue;
+        }
+
+        GenericLFBufPtr psBuf = &psCacheEntry->sBuf;
+        if (psBuf->pLockingThread == pthread_self()) {
+            lf_hfs_generic_buf_lock(psBuf);
+        } else if (!lf_hfs_generic_buf_try_lock(psBuf)) {
+            // Another thread is reading into it. As in lf_hfs_generic_buf_take_ownership,
+            // sleep until the owner releases the buffer, then look the block up again.
+            lf_lck_mtx_lock(&psBuf->sLock);
+            lf_lck_mtx_unlock(&psShard->sLock);
+            if (psBuf->uUseCnt) {
+                struct timespec sWaitTime = {.tv_sec = 3, .tv_nsec = 0};
+                if (lf_cond_wait_relative(&psBuf->sOwnerCond, &psBuf->sLock, &sWaitTime) == ETIMEDOUT) {
+                    LFHFS_LOG(LEVEL_ERROR, "lf_hfs_generic_buf_cache_invalidate_phy: ETIMEDOUT on %p", psBuf);
+                }
+            }
+            lf_lck_mtx_unlock(&psBuf->sLock);
+            goto retry;
+        }
+
+        if (!(psBuf->uCacheFlags & GEN_BUF_WRITE_LOCK)) {
+            psBuf->uCacheFlags &= ~GEN_BUF_IS_UPTODATE;
+        }
+        lf_hfs_generic_buf_unlock(psBuf);
+    }
+
+    lf_lck_mtx_unlock(&psShard->sLock);
 }
 
-void lf_hfs_generic_buf_cache_copy( struct buf_cache_entry *entry, __unused GenericLFBufPtr psBuf )
-{
-    #if GEN_BUF_ALLOC_DEBUG
-        printf("lf_hfs_generic_buf_cache_copy: psBuf %p\n", psBuf);
-    #endif
+// Unlink the entry from the cache. Caller holds the shard lock.
+static void lf_hfs_generic_buf_cache_unlink( struct buf_cache_entry *entry ) {
+
+    struct buf_cache_shard *psShard = &gsBufCacheShards[entry->uShard];
+    struct buf_cache_vnode_bucket *psBucket = lf_hfs_generic_buf_cache_vnode_bucket(entry->sBuf.psVnode);
+
+    LIST_REMOVE(entry, buf_hash_link);
+
+    if (psShard->psHand == entry) {
+        psShard->psHand = TAILQ_NEXT(entry, buf_clock_link);
+    }
+    TAILQ_REMOVE(&psShard->sClock, entry, buf_clock_link);
+
+    lf_lck_mtx_lock(&psBucket->sLock);
+    LIST_REMOVE(entry, buf_vnode_link);
+    lf_lck_mtx_unlock(&psBucket->sLock);
 
-    TAILQ_REMOVE(&buf_cache_list, entry, buf_cache_link);
-    TAILQ_INSERT_HEAD(&buf_cache_list, entry, buf_cache_link);
+    psShard->uNumOfEntries--;
+    psShard->uDataSize -= entry->sBuf.uDataSize;
+
+    BUF_CACHE_STAT_SUB(buf_cache_size, 1);
+    BUF_CACHE_STAT_ADD(buf_cache_remove, 1);
+    BUF_CACHE_STAT_SUB(buf_total_allocated_size, entry->sBuf.uDataSize);
 }
 
+// Remove the entry and free it. Caller holds the shard lock, and the buffer lock exactly once.
 void lf_hfs_generic_buf_cache_remove( struct buf_cache_entry *entry ) {
-    
+
     if (entry->sBuf.uUseCnt != 0) {
         LFHFS_LOG(LEVEL_ERROR, "lf_hfs_generic_buf_cache_remove: remove buffer %p with uUseCnt %u", &entry->sBuf, entry->sBuf.uUseCnt);
     }
@@ -721,18 +1027,15 @@ void lf_hfs_generic_buf_cache_remove( struct buf_cache_entry *entry ) {
         printf("lf_hfs_generic_buf_cache_remove: psBuf %p, psVnode %p, uBlockN %llu, uDataSize %u, uFlags 0x%llx, uPhyCluster %llu, uUseCnt %u\n",
                psBuf, psBuf->psVnode, psBuf->uBlockN, psBuf->uDataSize, psBuf->uCacheFlags, psBuf->uPhyCluster, psBuf->uUseCnt);
     #endif
-    
-    TAILQ_REMOVE(&buf_cache_list, entry, buf_cache_link);
-    --gCacheStat.buf_cache_size;
-    ++gCacheStat.buf_cache_remove;
-    gCacheStat.buf_total_allocated_size -= entry->sBuf.uDataSize;
+
+    lf_hfs_generic_buf_cache_unlink(entry);
 
     assert(entry->sBuf.uLockCnt == 1);
-    
+
     lf_lck_mtx_unlock(&entry->sBuf.sLock);
     lf_cond_destroy(&entry->sBuf.sOwnerCond);
     lf_lck_mtx_destroy(&entry->sBuf.sLock);
-    
+
     hfs_free(entry->sBuf.pvData);
     hfs_free(entry);
 }
@@ -740,61 +1043,76 @@ void lf_hfs_generic_buf_cache_remove( struct buf_cache_entry *entry ) {
 void lf_hfs_generic_buf_cache_remove_all( int iFD ) {
     struct buf_cache_entry *entry, *entry_next;
 
-    lf_lck_mtx_lock(&buf_cache_mutex);
+    lf_hfs_generic_buf_cache_LockBufCache();
 
-    TAILQ_FOREACH_SAFE(entry, &buf_cache_list, buf_cache_link, entry_next)
-    {
-        if ( (iFD == IGNORE_MOUNT_FD) || ( VNODE_TO_IFD(entry->sBuf.psVnode) == iFD ) )
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_NUM_OF_SHARDS; uShard++) {
+        TAILQ_FOREACH_SAFE(entry, &gsBufCacheShards[uShard].sClock, buf_clock_link, entry_next)
         {
-            if (iFD == IGNORE_MOUNT_FD) {
-                // Media no longer available, force remove all
-                TAILQ_REMOVE(&buf_cache_list, entry, buf_cache_link);
-                --gCacheStat.buf_cache_size;
-                ++gCacheStat.buf_cache_remove;
-                gCacheStat.buf_total_allocated_size -= entry->sBuf.uDataSize;
-            } else {
-                lf_hfs_generic_buf_lock(&entry->sBuf);
-                lf_hfs_generic_buf_cache_remove(entry);
+            if ( (iFD == IGNORE_MOUNT_FD) || ( entry->iFD == iFD ) )
+            {
+                if (iFD == IGNORE_MOUNT_FD) {
+                    // Media no longer available, force remove all
+                    lf_hfs_generic_buf_cache_unlink(entry);
+                } else {
+                    lf_hfs_generic_buf_lock(&entry->sBuf);
+                    lf_hfs_generic_buf_cache_remove(entry);
+                }
             }
         }
     }
 
-    lf_lck_mtx_unlock(&buf_cache_mutex);
+    lf_hfs_generic_buf_cache_UnLockBufCache();
 }
 
-/* buf_cache_mutex Should get locked from the caller using lf_hfs_generic_buf_cache_LockBufCache*/
+/* The buffer cache Should get locked from the caller using lf_hfs_generic_buf_cache_LockBufCache*/
 void lf_hfs_generic_buf_cache_remove_vnode(vnode_t vp) {
 
+    struct buf_cache_vnode_bucket *psBucket = lf_hfs_generic_buf_cache_vnode_bucket(vp);
+    struct buf_cache_hash sVnodeBufs = LIST_HEAD_INITIALIZER(sVnodeBufs);
     struct buf_cache_entry *entry, *entry_next;
 
     #if GEN_BUF_ALLOC_DEBUG
         printf("lf_hfs_generic_buf_cache_remove_vnode: vp %p: ", vp);
     #endif
-    
-    TAILQ_FOREACH_SAFE(entry, &buf_cache_list, buf_cache_link, entry_next) {
-        
+
+    // Move the vnode's buffers to a private list first; the buffers are locked
+    // without holding the bucket lock. lf_hfs_generic_buf_cache_unlink then
+    // removes them from the private list.
+    lf_lck_mtx_lock(&psBucket->sLock);
+    LIST_FOREACH_SAFE(entry, &psBucket->sHead, buf_vnode_link, entry_next) {
         if ( entry->sBuf.psVnode == vp ) {
-            
-            #if GEN_BUF_ALLOC_DEBUG
-                printf("&sBuf %p, ", &entry->sBuf);
-            #endif
-            
-            lf_hfs_generic_buf_lock(&entry->sBuf);
-            lf_hfs_generic_buf_cache_remove(entry);
+            LIST_REMOVE(entry, buf_vnode_link);
+            LIST_INSERT_HEAD(&sVnodeBufs, entry, buf_vnode_link);
         }
     }
+    lf_lck_mtx_unlock(&psBucket->sLock);
+
+    LIST_FOREACH_SAFE(entry, &sVnodeBufs, buf_vnode_link, entry_next) {
+
+        #if GEN_BUF_ALLOC_DEBUG
+            printf("&sBuf %p, ", &entry->sBuf);
+        #endif
+
+        lf_hfs_generic_buf_lock(&entry->sBuf);
+        lf_hfs_generic_buf_cache_remove(entry);
+    }
 
     #if GEN_BUF_ALLOC_DEBUG
         printf("Done.\n");
     #endif
 }
 
+// Lock every shard, in order, for operations that span the whole cache
 void lf_hfs_generic_buf_cache_LockBufCache(void)
 {
-    lf_lck_mtx_lock(&buf_cache_mutex);
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_NUM_OF_SHARDS; uShard++) {
+        lf_lck_mtx_lock(&gsBufCacheShards[uShard].sLock);
+    }
 }
 
 void lf_hfs_generic_buf_cache_UnLockBufCache(void)
 {
-    lf_lck_mtx_unlock(&buf_cache_mutex);
+    for (uint32_t uShard = BUF_CACHE_NUM_OF_SHARDS; uShard > 0; uShard--) {
+        lf_lck_mtx_unlock(&gsBufCacheShards[uShard - 1].sLock);
+    }
 }
@@ -22,6 +22,7 @@
 #define    GEN_BUF_IS_UPTODATE     0x00004000 // Set if memory content is equal or newer than media content
 #define    GEN_BUF_PHY_BLOCK       0x00008000 // Indicates that the uBlockN field contains a physical block number
 #define    GEN_BUF_LITTLE_ENDIAN   0x00010000 // When set, the data in the buffer contains small-endian data and should not be written to media
+#define    GEN_BUF_NO_WAIT         0x00020000 // Allocation only: return NULL instead of waiting when another thread owns the cached buffer
 
 typedef struct GenericBuffer {
     
@@ -50,6 +51,8 @@ typedef struct {
     uint32_t gen_buf_uncached;
     uint32_t buf_cache_remove;
     uint32_t buf_cache_cleanup;
+    uint32_t buf_cache_hit;
+    uint32_t buf_cache_miss;
 
     uint64_t buf_total_allocated_size;
 } CacheStats_S;
@@ -64,6 +67,8 @@ int                 lf_hfs_generic_buf_validate_owner(GenericLFBuf *psBuf);
 GenericLFBufPtr     lf_hfs_generic_buf_duplicate(GenericLFBufPtr pBuff, uint32_t uExtraCacheFlags);
 errno_t             lf_hfs_generic_buf_read( GenericLFBufPtr psBuf );
 errno_t             lf_hfs_generic_buf_write( GenericLFBufPtr psBuf );
+errno_t             lf_hfs_generic_buf_read_multi( GenericLFBufPtr *ppsBufs, uint32_t uNumOfBufs );
+errno_t             lf_hfs_generic_buf_write_multi( GenericLFBufPtr *ppsBufs, uint32_t uNumOfBufs );
 void                lf_hfs_generic_buf_invalidate( GenericLFBufPtr psBuf );
 void                lf_hfs_generic_buf_release( GenericLFBufPtr psBuf );
 void                lf_hfs_generic_buf_clear( GenericLFBufPtr psBuf );
@@ -75,7 +80,9 @@ void                lf_hfs_generic_buf_unlock(GenericLFBufPtr psBuf);
 void                lf_hfs_generic_buf_cache_init( void );
 void                lf_hfs_generic_buf_cache_deinit( void );
 void                lf_hfs_generic_buf_cache_clear_by_iFD( int iFD );
+void                lf_hfs_generic_buf_cache_set_limits( uint32_t uMaxEntries, uint64_t uMaxDataSize );
 void                lf_hfs_generic_buf_cache_update( GenericLFBufPtr psBuf );
+void                lf_hfs_generic_buf_cache_invalidate_phy( int iFD, uint64_t uPhyCluster );
 void                lf_hfs_generic_buf_cache_remove_vnode(vnode_t vp);
 void                lf_hfs_generic_buf_cache_UnLockBufCache(void);
 void                lf_hfs_generic_buf_cache_LockBufCache(void);
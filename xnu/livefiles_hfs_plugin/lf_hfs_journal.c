@@ -221,6 +221,9 @@ unsigned int jnl_trim_flush_limit = JOURNAL_FLUSH_TRIM_EXTENTS;
 // tbuffer
 #define DEFAULT_TRANSACTION_BUFFER_SIZE  (128*1024)
 #define MAX_TRANSACTION_BUFFER_SIZE      (3072*1024)
+
+// How many home-location writes finish_end_transaction hands to the I/O backend at once
+#define JOURNAL_FLUSH_BATCH_SIZE         (64)
 uint32_t def_tbuffer_size = 0; // XXXdbg - so I can change it in the debugger
 
 // ************************** Global Functions ***********************
@@ -2547,34 +2550,49 @@ static int finish_end_transaction(transaction *tr, errno_t (*callback)(void*), v
                 break;
             num_blocks--;
         }
+        //
+        // The blocks are written to their home location in batches, so the
+        // I/O backend of the mount can keep several of them in flight.
+        // The batch is collected before any buffer_written() call, as the
+        // last one may free blhdr.
+        //
+        GenericLFBuf *batch[JOURNAL_FLUSH_BATCH_SIZE];
+        int           batch_cnt = 0;
+
         for (i = 1; i < num_blocks; i++) {
             
             if ((bp = (void*)blhdr->binfo[i].u.bp)) {
 
-                errno_t ret_val = 0;
-
                 #if JOURNAL_DEBUG
                     printf("journal write physical: bp %p, psVnode %p, uBlockN %llu, uPhyCluster %llu uLockCnt %u\n",
                            bp, bp->psVnode, bp->uBlockN, bp->uPhyCluster, bp->uLockCnt);
                 #endif
                 
                 lf_hfs_generic_buf_clear_cache_flag(bp, GEN_BUF_WRITE_LOCK);
-                ret_val = lf_hfs_generic_buf_write(bp);
+                batch[batch_cnt++] = bp;
+            }
 
-                #if HFS_CRASH_TEST
-                    CRASH_ABORT(CRASH_ABORT_JOURNAL_IN_BLOCK_DATA, jnl->fsmount->psHfsmount, NULL);
-                #endif
+            if (batch_cnt == JOURNAL_FLUSH_BATCH_SIZE || (batch_cnt && i == num_blocks-1)) {
+                int j;
+                errno_t ret_val = lf_hfs_generic_buf_write_multi(batch, batch_cnt);
 
                 if (ret_val) {
-                    LFHFS_LOG(LEVEL_ERROR, "jnl: raw_readwrite_write_mount inside finish_end_transaction returned %d.\n", ret_val);
+                    LFHFS_LOG(LEVEL_ERROR, "jnl: lf_hfs_generic_buf_write_multi inside finish_end_transaction returned %d.\n", ret_val);
                 }
 
-                buffer_written(tr, bp);
-                
-                lf_hfs_generic_buf_unlock(bp);
-                lf_hfs_generic_buf_release(bp);
-                
-                bufs_written++;
+                for (j = 0; j < batch_cnt; j++) {
+                    #if HFS_CRASH_TEST
+                        CRASH_ABORT(CRASH_ABORT_JOURNAL_IN_BLOCK_DATA, jnl->fsmount->psHfsmount, NULL);
+                    #endif
+
+                    buffer_written(tr, batch[j]);
+
+                    lf_hfs_generic_buf_unlock(batch[j]);
+                    lf_hfs_generic_buf_release(batch[j]);
+
+                    bufs_written++;
+                }
+                batch_cnt = 0;
             }
         }
     }
@@ -12,7 +12,14 @@
 #include "lf_hfs_file_mgr_internal.h"
 #include "lf_hfs_file_extent_mapping.h"
 #include "lf_hfs_vfsutils.h"
+#include "lf_hfs_generic_buf.h"
+#include "lf_hfs_locks.h"
+#include "lf_hfs_logger.h"
 #include <UserFS/UserVFS.h>
+#include <sys/queue.h>
+#include <aio.h>
+#include <sys/uio.h>
+#include <stdlib.h>
 
 #define MAX_READ_WRITE_LENGTH (0x7ffff000)
 
@@ -20,6 +27,117 @@
 
 static void* gpvZeroBuf = NULL;
 
+// File data is cached one cluster per buffer, in the buffer cache of the device vnode,
+// keyed by physical block like the metadata. The two share the cache budget.
+// Reads up to this length go through the cache; longer reads of whole clusters go
+// straight to the caller's buffer, so that streaming a big file doesn't flush the metadata.
+#define RAW_READ_CACHED_MAX_LENGTH      (64*1024)
+
+// Read-ahead for sequential streams of cached reads, done by a small pool of worker threads.
+// The window starts at RAW_READ_AHEAD_MIN_CLUSTERS and doubles on every sequential read.
+#define RAW_READ_AHEAD_NUM_OF_WORKERS   (2)
+#define RAW_READ_AHEAD_MIN_CLUSTERS     (4)
+#define RAW_READ_AHEAD_MAX_CLUSTERS     (32)
+#define RAW_READ_AHEAD_QUEUE_DEPTH      (16)
+#define RAW_READ_AHEAD_BATCH_CLUSTERS   (8)     // Buffers a worker holds at once
+
+typedef struct ReadAheadJob {
+    TAILQ_ENTRY(ReadAheadJob)   sLink;
+    vnode_t                     psDevVnode;
+    uint32_t                    uClusterSize;
+    uint32_t                    uNumOfClusters;
+    uint64_t                    puPhyBlock[RAW_READ_AHEAD_MAX_CLUSTERS];
+} ReadAheadJob_S;
+
+static struct {
+    pthread_mutex_t             sLock;
+    pthread_cond_t              sWorkCond;      // A job was queued, or shutting down
+    pthread_cond_t              sDoneCond;      // A worker finished a job
+    TAILQ_HEAD(, ReadAheadJob)  sQueue;
+    uint32_t                    uQueued;
+    uint32_t                    uNumOfWorkers;
+    bool                        bShutdown;
+    pthread_t                   psWorker[RAW_READ_AHEAD_NUM_OF_WORKERS];
+    vnode_t                     psBusyDevVnode[RAW_READ_AHEAD_NUM_OF_WORKERS];  // Device of the job each worker runs
+} gsReadAhead;
+
+// Can file clusters of this mount be cached? The cluster has to start on a physical block.
+static bool
+raw_readwrite_clusters_cacheable( struct hfsmount *hfsmp )
+{
+    return ( ((hfsmp->hfsPlusIOPosOffset % hfsmp->hfs_physical_block_size) == 0) &&
+             ((hfsmp->blockSize          % hfsmp->hfs_physical_block_size) == 0) );
+}
+
+static uint64_t
+raw_readwrite_cluster_to_phy_block( struct hfsmount *hfsmp, uint64_t uCluster )
+{
+    return ( hfsmp->hfsPlusIOPosOffset + uCluster * hfsmp->blockSize ) / hfsmp->hfs_physical_block_size;
+}
+
+// Clusters were written behind the back of the buffer cache; drop what it has of them.
+static void
+raw_readwrite_invalidate_cached_clusters( struct hfsmount *hfsmp, uint64_t uCluster, uint64_t uNumOfClusters )
+{
+    if ( !raw_readwrite_clusters_cacheable(hfsmp) )
+    {
+        return;
+    }
+
+    int iFD = VNODE_TO_IFD(hfsmp->hfs_devvp);
+    for ( uint64_t u = 0; u < uNumOfClusters; u++ )
+    {
+        lf_hfs_generic_buf_cache_invalidate_phy( iFD, raw_readwrite_cluster_to_phy_block(hfsmp, uCluster + u) );
+    }
+}
+
+// Read (part of) one cluster through the buffer cache
+static errno_t
+raw_readwrite_read_cached( vnode_t psVnode, uint64_t uCluster, uint64_t uInClusterOffset, uint64_t uBytesToRead, void* pvBuf, uint64_t *piActuallyRead )
+{
+    errno_t iErr            = 0;
+    struct hfsmount *hfsmp  = VTOHFS(psVnode);
+    uint64_t uBytesToCopy   = MIN( hfsmp->blockSize - uInClusterOffset, uBytesToRead );
+
+    uint64_t uPhyBlock      = raw_readwrite_cluster_to_phy_block(hfsmp, uCluster);
+
+    GenericLFBufPtr psBuf = lf_hfs_generic_buf_allocate( hfsmp->hfs_devvp, uPhyBlock, hfsmp->blockSize, GEN_BUF_PHY_BLOCK );
+    if ( psBuf == NULL )
+    {
+        // The cached buffer is stuck with another owner (or there's no memory for one).
+        // File data is written around the cache, so the device is as new as any cached copy.
+        void* pvCluster = hfs_malloc( hfsmp->blockSize );
+        if ( pvCluster == NULL )
+        {
+            return ENOMEM;
+        }
+
+        iErr = raw_readwrite_read_mount( hfsmp->hfs_devvp, uPhyBlock, hfsmp->hfs_physical_block_size, pvCluster, hfsmp->blockSize, NULL, NULL );
+        if ( iErr == 0 )
+        {
+            memcpy( pvBuf, (uint8_t *)pvCluster + uInClusterOffset, uBytesToCopy );
+            *piActuallyRead = uBytesToCopy;
+        }
+
+        hfs_free( pvCluster );
+        return iErr;
+    }
+
+    iErr = lf_hfs_generic_buf_read( psBuf );
+    if ( iErr == 0 )
+    {
+        memcpy( pvBuf, (uint8_t *)psBuf->pvData + uInClusterOffset, uBytesToCopy );
+        *piActuallyRead = uBytesToCopy;
+    }
+    else
+    {
+        LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read_cached: lf_hfs_generic_buf_read failed [%d]\n", iErr );
+    }
+
+    lf_hfs_generic_buf_release( psBuf );
+    return iErr;
+}
+
 
 int
 raw_readwrite_get_cluster_from_offset( vnode_t psVnode, uint64_t uWantedOffset, uint64_t* puStartCluster, uint64_t* puInClusterOffset, uint64_t* puContigousClustersInBytes )
@@ -49,50 +167,239 @@ raw_readwrite_get_cluster_from_offset( vnode_t psVnode, uint64_t uWantedOffset,
     return iErr;
 }
 
+//  Device I/O backends
+
+static errno_t
+raw_readwrite_sync_do_one( int iFD, RawIORequest_S* psReq )
+{
+    ssize_t iBytes;
+
+    if ( psReq->bWrite )
+    {
+        iBytes = pwrite( iFD, psReq->pvBuf, (size_t)psReq->uLength, psReq->uOffset );
+    }
+    else
+    {
+        iBytes = pread( iFD, psReq->pvBuf, (size_t)psReq->uLength, psReq->uOffset );
+    }
+
+    psReq->iErr = ( iBytes == (ssize_t)psReq->uLength ) ? 0 : ( (iBytes < 0) ? errno : EIO );
+    return psReq->iErr;
+}
+
+static errno_t
+raw_readwrite_sync_submit( int iFD, RawIORequest_S* psReqs, uint32_t uNumOfReqs, __unused uint32_t uQueueDepth )
+{
+    errno_t iErr = 0;
+
+    for ( uint32_t u = 0; u < uNumOfReqs; u++ )
+    {
+        errno_t iReqErr = raw_readwrite_sync_do_one( iFD, &psReqs[u] );
+        if ( iErr == 0 )
+        {
+            iErr = iReqErr;
+        }
+    }
+
+    return iErr;
+}
+
+static errno_t
+raw_readwrite_aio_submit( int iFD, RawIORequest_S* psReqs, uint32_t uNumOfReqs, uint32_t uQueueDepth )
+{
+    errno_t iErr = 0;
+
+    // Nothing to overlap a single request with
+    if ( uNumOfReqs == 1 || uQueueDepth <= 1 )
+    {
+        return raw_readwrite_sync_submit( iFD, psReqs, uNumOfReqs, uQueueDepth );
+    }
+
+    uQueueDepth = MIN( uQueueDepth, uNumOfReqs );
+    struct aiocb*  psCBs   = hfs_mallocz( uQueueDepth * sizeof(struct aiocb) );
+    struct aiocb** ppsList = hfs_mallocz( uQueueDepth * sizeof(struct aiocb*) );
+    if ( psCBs == NULL || ppsList == NULL )
+    {
+        if ( psCBs )   hfs_free( psCBs );
+        if ( ppsList ) hfs_free( ppsList );
+        return raw_readwrite_sync_submit( iFD, psReqs, uNumOfReqs, uQueueDepth );
+    }
+
+    for ( uint32_t uBase = 0; uBase < uNumOfReqs; uBase += uQueueDepth )
+    {
+        uint32_t uBatch = MIN( uQueueDepth, uNumOfReqs - uBase );
+
+        memset( psCBs, 0, uBatch * sizeof(struct aiocb) );
+        for ( uint32_t u = 0; u < uBatch; u++ )
+        {
+            RawIORequest_S* psReq    = &psReqs[uBase + u];
+            psCBs[u].aio_fildes      = iFD;
+            psCBs[u].aio_buf         = psReq->pvBuf;
+            psCBs[u].aio_nbytes      = (size_t)psReq->uLength;
+            psCBs[u].aio_offset      = (off_t)psReq->uOffset;
+            psCBs[u].aio_lio_opcode  = psReq->bWrite ? LIO_WRITE : LIO_READ;
+            ppsList[u]               = &psCBs[u];
+        }
+
+        // With LIO_WAIT this returns once every queued request completed. On failure
+        // (EAGAIN, EINTR, EIO) each request is looked at on its own below.
+        (void) lio_listio( LIO_WAIT, ppsList, (int)uBatch, NULL );
+
+        for ( uint32_t u = 0; u < uBatch; u++ )
+        {
+            RawIORequest_S* psReq = &psReqs[uBase + u];
+            int iStatus;
+
+            while ( (iStatus = aio_error(&psCBs[u])) == EINPROGRESS )
+            {
+                const struct aiocb* psWaitFor = &psCBs[u];
+                aio_suspend( &psWaitFor, 1, NULL );
+            }
+
+            if ( iStatus == -1 )
+            {
+                // Never got queued, do it here
+                raw_readwrite_sync_do_one( iFD, psReq );
+            }
+            else
+            {
+                ssize_t iBytes = aio_return( &psCBs[u] );
+                psReq->iErr = ( iStatus != 0 ) ? iStatus : ( (iBytes == (ssize_t)psReq->uLength) ? 0 : EIO );
+            }
+
+            if ( iErr == 0 )
+            {
+                iErr = psReq->iErr;
+            }
+        }
+    }
+
+    hfs_free( ppsList );
+    hfs_free( psCBs );
+    return iErr;
+}
+
+static const RawIOBackend_S gsRawIOBackends[] = {
+    { .pcName = "sync", .pfSubmit = raw_readwrite_sync_submit },
+    { .pcName = "aio",  .pfSubmit = raw_readwrite_aio_submit  },
+};
+
+#define RAW_IO_DEFAULT_QUEUE_DEPTH  (16)
+
+static const RawIOBackend_S* gpsDefaultIOBackend   = &gsRawIOBackends[0];
+static uint32_t              guDefaultIOQueueDepth = RAW_IO_DEFAULT_QUEUE_DEPTH;
+
+// Pick the backend for the next mounts. Mounted volumes keep theirs.
+int
+raw_readwrite_set_default_io_backend( const char* pcName, uint32_t uQueueDepth )
+{
+    for ( uint32_t u = 0; u < sizeof(gsRawIOBackends)/sizeof(gsRawIOBackends[0]); u++ )
+    {
+        if ( strcmp(gsRawIOBackends[u].pcName, pcName) == 0 )
+        {
+            gpsDefaultIOBackend   = &gsRawIOBackends[u];
+            guDefaultIOQueueDepth = (uQueueDepth) ? uQueueDepth : RAW_IO_DEFAULT_QUEUE_DEPTH;
+            return 0;
+        }
+    }
+    return EINVAL;
+}
+
+// Parse a backend spec, "name" or "name:depth", as taken by LFHFS_IO_BACKEND_ENV
+// and LFHFS_FSATTR_IO_BACKEND.
+int
+raw_readwrite_parse_io_backend( const char* pcSpec, const RawIOBackend_S** ppsBackend, uint32_t* puQueueDepth )
+{
+    const char* pcColon = strchr( pcSpec, ':' );
+    size_t uNameLen     = (pcColon) ? (size_t)(pcColon - pcSpec) : strlen( pcSpec );
+    uint32_t uDepth     = RAW_IO_DEFAULT_QUEUE_DEPTH;
+
+    if ( pcColon )
+    {
+        char* pcEnd;
+        unsigned long ulDepth = strtoul( pcColon + 1, &pcEnd, 10 );
+        if ( (pcEnd == pcColon + 1) || (*pcEnd != '\0') || (ulDepth == 0) || (ulDepth > UINT32_MAX) )
+        {
+            return EINVAL;
+        }
+        uDepth = (uint32_t)ulDepth;
+    }
+
+    for ( uint32_t u = 0; u < sizeof(gsRawIOBackends)/sizeof(gsRawIOBackends[0]); u++ )
+    {
+        if ( (strlen(gsRawIOBackends[u].pcName) == uNameLen) && (strncmp(gsRawIOBackends[u].pcName, pcSpec, uNameLen) == 0) )
+        {
+            *ppsBackend   = &gsRawIOBackends[u];
+            *puQueueDepth = uDepth;
+            return 0;
+        }
+    }
+    return EINVAL;
+}
+
+const RawIOBackend_S*
+raw_readwrite_get_default_io_backend( uint32_t* puQueueDepth )
+{
+    *puQueueDepth = guDefaultIOQueueDepth;
+    return gpsDefaultIOBackend;
+}
+
+// Execute a batch of independent requests against the device of psMountVnode.
+// Returns the first error; each request has its own in iErr.
+errno_t
+raw_readwrite_submit( vnode_t psMountVnode, RawIORequest_S* psReqs, uint32_t uNumOfReqs )
+{
+    int iFD = VNODE_TO_IFD(psMountVnode);
+    struct hfsmount* hfsmp = psMountVnode->sFSParams.vnfs_mp ? psMountVnode->sFSParams.vnfs_mp->psHfsmount : NULL;
+
+    // Early in mount, before the hfsmount is set up, I/O is synchronous
+    if ( hfsmp == NULL || hfsmp->hfs_io_backend == NULL )
+    {
+        return raw_readwrite_sync_submit( iFD, psReqs, uNumOfReqs, 1 );
+    }
+
+    return hfsmp->hfs_io_backend->pfSubmit( iFD, psReqs, uNumOfReqs, hfsmp->hfs_io_queue_depth );
+}
+
 errno_t raw_readwrite_read_mount( vnode_t psMountVnode, uint64_t uBlockN, uint64_t uClusterSize, void* pvBuf, uint64_t uBufLen, uint64_t *puActuallyRead, uint64_t* puReadStartCluster ) {
     int iErr                    = 0;
-    int iFD                     = VNODE_TO_IFD(psMountVnode);
-    uint64_t uWantedOffset      = uBlockN * uClusterSize;
+    RawIORequest_S sReq         = { .pvBuf = pvBuf, .uOffset = uBlockN * uClusterSize, .uLength = uBufLen, .bWrite = false };
 
     if (puReadStartCluster) 
        *puReadStartCluster = uBlockN;
 
     hfs_assert( uBufLen >= uClusterSize );
 
-    ssize_t iReadBytes = pread(iFD, pvBuf, uBufLen, uWantedOffset);
-    if ( iReadBytes != (ssize_t)uBufLen )
+    iErr = raw_readwrite_submit( psMountVnode, &sReq, 1 );
+    if ( iErr )
     {
-        iErr = ( (iReadBytes < 0) ? errno : EIO );
         HFSLogLevel_e eLogLevel = (VNODE_TO_UNMOUNT_HINT(psMountVnode)==UVFSUnmountHintForce)?LEVEL_DEBUG:LEVEL_ERROR;
         LFHFS_LOG( eLogLevel, "raw_readwrite_read_mount failed [%d]\n", iErr );
     }
 
     if (puActuallyRead)
-       *puActuallyRead = iReadBytes;
+       *puActuallyRead = iErr ? 0 : uBufLen;
 
     return iErr;
 }
 
 errno_t raw_readwrite_write_mount( vnode_t psMountVnode, uint64_t uBlockN, uint64_t uClusterSize, void* pvBuf, uint64_t uBufLen, uint64_t *piActuallyWritten, uint64_t* puWriteStartCluster ) {
     int iErr                   = 0;
-    int iFD                    = VNODE_TO_IFD(psMountVnode);
-    uint64_t uWantedOffset     = uBlockN * uClusterSize;
-    ssize_t  uActuallyWritten  = 0;
+    RawIORequest_S sReq        = { .pvBuf = pvBuf, .uOffset = uBlockN * uClusterSize, .uLength = uBufLen, .bWrite = true };
 
     if (puWriteStartCluster)
         *puWriteStartCluster = uBlockN;
 
     hfs_assert( uBufLen >= uClusterSize );
 
-    uActuallyWritten = pwrite(iFD, pvBuf, (size_t)uBufLen, uWantedOffset);
-    if ( uActuallyWritten != (ssize_t)uBufLen ) {
-        iErr = ( (uActuallyWritten < 0) ? errno : EIO );
+    iErr = raw_readwrite_submit( psMountVnode, &sReq, 1 );
+    if ( iErr ) {
         HFSLogLevel_e eLogLevel = (VNODE_TO_UNMOUNT_HINT(psMountVnode)==UVFSUnmountHintForce)?LEVEL_DEBUG:LEVEL_ERROR;
         LFHFS_LOG( eLogLevel, "raw_readwrite_write_mount failed [%d]\n", iErr );
     }
 
     if (piActuallyWritten)
-        *piActuallyWritten = uActuallyWritten;
+        *piActuallyWritten = iErr ? 0 : uBufLen;
 
     return iErr;
 }
@@ -105,6 +412,7 @@ raw_readwrite_read( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLe
     uint64_t uFileSize              = ((struct filefork *)VTOF(psVnode))->ff_data.cf_blocks * uClusterSize;
     uint64_t uActuallyRead          = 0;
     bool bFirstLoop                 = true;
+    bool bCacheable                 = raw_readwrite_clusters_cacheable( VTOHFS(psVnode) );
 
     *piActuallyRead = 0;
     while ( *piActuallyRead < uLength )
@@ -135,9 +443,23 @@ raw_readwrite_read( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLe
         }
 
         uint64_t uBytesToRead = MIN(uFileSize - uOffset, uLength - *piActuallyRead);
+        uint64_t uOffsetInCluster = uOffset % uClusterSize;
 
-        // Read data
-        iErr = raw_readwrite_read_internal( psVnode, uCurrentCluster, uContigousClustersInBytes, uOffset, uBytesToRead, pvBuf, &uActuallyRead );
+        // Read data. Short reads and partial clusters come from the buffer cache,
+        // long runs of whole clusters are read directly.
+        if ( bCacheable && ((uLength <= RAW_READ_CACHED_MAX_LENGTH) || (uOffsetInCluster != 0) || (uBytesToRead < uClusterSize)) )
+        {
+            iErr = raw_readwrite_read_cached( psVnode, uCurrentCluster, uOffsetInCluster, uBytesToRead, pvBuf, &uActuallyRead );
+        }
+        else
+        {
+            if ( bCacheable )
+            {
+                // Leave the partial tail cluster to the cache
+                uBytesToRead = ROUND_DOWN(uBytesToRead, uClusterSize);
+            }
+            iErr = raw_readwrite_read_internal( psVnode, uCurrentCluster, uContigousClustersInBytes, uOffset, uBytesToRead, pvBuf, &uActuallyRead );
+        }
         if ( iErr != 0 )
         {
             LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read_internal: raw_readwrite_read_internal failed [%d]\n", iErr );
@@ -244,61 +566,317 @@ raw_readwrite_read_internal( vnode_t psVnode, uint64_t uCluster, uint64_t uConti
     return iErr;
 }
 
-errno_t
-raw_readwrite_write( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLength, uint64_t *piActuallyWritten )
+// Write planner.
+// A write is first mapped, as a whole, to the physical runs it covers (runs that
+// happen to be adjacent on the device are merged). Each run then goes out with as
+// few pwritev() calls as possible: whole sectors of data point straight into the
+// caller's buffer, whole sectors of zero-fill point into gpvZeroBuf, and only the
+// sectors that are partly written or mix zeros with data are assembled in a bounce
+// sector, read from the device first where they keep existing bytes.
+#define RAW_WRITE_MAX_IOVECS        (64)
+#define RAW_WRITE_MAX_RUNS          (32)
+#define RAW_WRITE_MAX_BOUNCE        (4)
+
+typedef struct {
+    uint64_t    uFileOffset;
+    uint64_t    uDevOffset;
+    uint64_t    uLength;
+} RawWriteRun_S;
+
+// File bytes in [uStart, uEnd) are written: [uDataStart, uDataEnd) from puData,
+// the rest with zeros. Bytes outside [uStart, uEnd) keep their content.
+typedef struct {
+    uint64_t        uStart;
+    uint64_t        uEnd;
+    uint64_t        uDataStart;
+    uint64_t        uDataEnd;
+    const uint8_t*  puData;
+    void*           ppvBounce[RAW_WRITE_MAX_BOUNCE];
+    uint32_t        uNumOfBounce;
+} RawWriteGroup_S;
+
+static RawWriteStats_S gsRawWriteStats = {0};
+
+#define RAW_WRITE_STAT_ADD(field, val)  __atomic_add_fetch(&gsRawWriteStats.field, (val), __ATOMIC_RELAXED)
+
+void
+raw_readwrite_get_write_stats( RawWriteStats_S* psStats )
 {
-    errno_t iErr                    = 0;
-    uint64_t uClusterSize           = psVnode->sFSParams.vnfs_mp->psHfsmount->blockSize;
-    uint64_t uFileSize              = ((struct filefork *)VTOF(psVnode))->ff_data.cf_blocks * uClusterSize;
-    uint64_t uActuallyWritten       = 0;
+    psStats->uSyscalls    = __atomic_load_n( &gsRawWriteStats.uSyscalls,    __ATOMIC_RELAXED );
+    psStats->uBytes       = __atomic_load_n( &gsRawWriteStats.uBytes,       __ATOMIC_RELAXED );
+    psStats->uBounceBytes = __atomic_load_n( &gsRawWriteStats.uBounceBytes, __ATOMIC_RELAXED );
+}
 
-    *piActuallyWritten = 0;
+// Map up to RAW_WRITE_MAX_RUNS physical runs of [uOffset, uEnd).
+static errno_t
+raw_readwrite_write_map_runs( vnode_t psVnode, uint64_t uOffset, uint64_t uEnd, RawWriteRun_S* psRuns, uint32_t* puNumOfRuns )
+{
+    uint64_t uClusterSize = VTOHFS(psVnode)->blockSize;
+    uint32_t uNumOfRuns   = 0;
 
-    // Fill the buffer until the buffer is full or till the end of the file
-    while ( *piActuallyWritten < uLength )
+    while ( uOffset < uEnd )
     {
-        uint64_t uCurrentCluster            = 0;
-        uint64_t uInClusterOffset           = 0;
-        uint64_t uContigousClustersInBytes  = 0;
+        uint64_t uCluster       = 0;
+        uint64_t uContigBytes   = 0;
 
-        iErr = raw_readwrite_get_cluster_from_offset(psVnode, uOffset, &uCurrentCluster, &uInClusterOffset, &uContigousClustersInBytes );
+        errno_t iErr = raw_readwrite_get_cluster_from_offset( psVnode, uOffset, &uCluster, NULL, &uContigBytes );
         if ( iErr != 0 )
         {
-            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_write: raw_readwrite_get_cluster_from_offset failed [%d]\n", iErr );
             return iErr;
         }
+        if ( uContigBytes == 0 )
+        {
+            return EIO;
+        }
 
-        // Stop writing if we've reached the end of the file
-        if ( (uContigousClustersInBytes == 0) || (uOffset >= uFileSize) )
+        uint64_t uDevOffset = FSOPS_GetOffsetFromClusterNum( psVnode, uCluster ) + ( uOffset % uClusterSize );
+        uint64_t uLength    = MIN( uContigBytes, uEnd - uOffset );
+
+        if ( uNumOfRuns && (psRuns[uNumOfRuns-1].uDevOffset + psRuns[uNumOfRuns-1].uLength == uDevOffset) )
+        {
+            psRuns[uNumOfRuns-1].uLength += uLength;
+        }
+        else if ( uNumOfRuns == RAW_WRITE_MAX_RUNS )
         {
             break;
         }
+        else
+        {
+            psRuns[uNumOfRuns].uFileOffset = uOffset;
+            psRuns[uNumOfRuns].uDevOffset  = uDevOffset;
+            psRuns[uNumOfRuns].uLength     = uLength;
+            uNumOfRuns++;
+        }
+
+        uOffset += uLength;
+    }
+
+    *puNumOfRuns = uNumOfRuns;
+    return 0;
+}
+
+// Describe the sectors starting at sector aligned file offset uPos, at most uMax bytes,
+// with one iovec.
+static errno_t
+raw_readwrite_write_next_iovec( int iFD, RawWriteGroup_S* psGroup, uint64_t uSectorSize,
+                                uint64_t uPos, uint64_t uDevOffset, uint64_t uMax, struct iovec* psIov )
+{
+    uint64_t uSectorEnd = uPos + uSectorSize;
+
+    // Whole sectors of data
+    if ( uPos >= psGroup->uDataStart && uSectorEnd <= psGroup->uDataEnd )
+    {
+        psIov->iov_base = (void*)( psGroup->puData + (uPos - psGroup->uDataStart) );
+        psIov->iov_len  = MIN( ROUND_DOWN(psGroup->uDataEnd - uPos, uSectorSize), uMax );
+        return 0;
+    }
+
+    // Whole sectors of zeros
+    if ( uPos >= psGroup->uStart && uSectorEnd <= psGroup->uEnd &&
+         (uSectorEnd <= psGroup->uDataStart || uPos >= psGroup->uDataEnd) )
+    {
+        uint64_t uZeroEnd = ( uSectorEnd <= psGroup->uDataStart ) ? MIN( psGroup->uDataStart, psGroup->uEnd ) : psGroup->uEnd;
+
+        psIov->iov_base = gpvZeroBuf;
+        psIov->iov_len  = MIN( MIN( ROUND_DOWN(uZeroEnd - uPos, uSectorSize), uMax ), ZERO_BUF_SIZE );
+        return 0;
+    }
+
+    // Anything else is assembled in a bounce sector
+    if ( psGroup->uNumOfBounce == RAW_WRITE_MAX_BOUNCE )
+    {
+        return EINVAL;
+    }
+    uint8_t* puBounce = hfs_malloc( uSectorSize );
+    if ( puBounce == NULL )
+    {
+        return ENOMEM;
+    }
+    psGroup->ppvBounce[psGroup->uNumOfBounce++] = puBounce;
+
+    if ( uPos < psGroup->uStart || uSectorEnd > psGroup->uEnd )
+    {
+        ssize_t iReadBytes = pread( iFD, puBounce, uSectorSize, uDevOffset );
+        RAW_WRITE_STAT_ADD( uSyscalls, 1 );
+        if ( iReadBytes != (ssize_t)uSectorSize )
+        {
+            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_write: pread failed to read wanted length\n" );
+            return (iReadBytes < 0) ? errno : EIO;
+        }
+    }
 
-        /* Calculate how many bytes are still missing to add to the device
-         * If offset near end of file need to set only (uFileSize - uOffset)
-         * else need to write as much as left (uLength - uAcctuallyRead)
-         */
-        uint64_t uBytesToWrite = MIN(uFileSize - uOffset, uLength - *piActuallyWritten);
+    uint64_t uFrom = MAX( uPos, psGroup->uStart );
+    uint64_t uTo   = MIN( uSectorEnd, psGroup->uEnd );
+    memset( puBounce + (uFrom - uPos), 0, uTo - uFrom );
 
-        // Write data
-        iErr = raw_readwrite_write_internal( psVnode, uCurrentCluster, uContigousClustersInBytes, uOffset, uBytesToWrite, pvBuf, &uActuallyWritten );
+    uFrom = MAX( uPos, psGroup->uDataStart );
+    uTo   = MIN( uSectorEnd, psGroup->uDataEnd );
+    if ( uFrom < uTo )
+    {
+        memcpy( puBounce + (uFrom - uPos), psGroup->puData + (uFrom - psGroup->uDataStart), uTo - uFrom );
+    }
+
+    RAW_WRITE_STAT_ADD( uBounceBytes, uSectorSize );
+    psIov->iov_base = puBounce;
+    psIov->iov_len  = uSectorSize;
+    return 0;
+}
+
+static errno_t
+raw_readwrite_write_group( vnode_t psVnode, RawWriteGroup_S* psGroup, uint64_t* puDataWritten )
+{
+    errno_t iErr                = 0;
+    int iFD                     = VNODE_TO_IFD(psVnode);
+    struct hfsmount *hfsmp      = VTOHFS(psVnode);
+    uint64_t uClusterSize       = hfsmp->blockSize;
+    uint64_t uSectorSize        = hfsmp->hfs_logical_block_size;
+    uint64_t uPos               = ROUND_DOWN( psGroup->uStart, uSectorSize );
+    uint64_t uEnd               = ROUND_UP( psGroup->uEnd, uSectorSize );
+    RawWriteRun_S psRuns[RAW_WRITE_MAX_RUNS];
+    struct iovec  psIov[RAW_WRITE_MAX_IOVECS];
+
+    psGroup->uNumOfBounce = 0;
+
+    while ( uPos < uEnd )
+    {
+        uint32_t uNumOfRuns = 0;
+
+        iErr = raw_readwrite_write_map_runs( psVnode, uPos, uEnd, psRuns, &uNumOfRuns );
         if ( iErr != 0 )
         {
-            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read_internal: raw_readwrite_read_internal failed [%d]\n", iErr );
-            return iErr;
+            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_write: raw_readwrite_get_cluster_from_offset failed [%d]\n", iErr );
+            goto exit;
         }
 
-        // Update the amount of bytes alreay written
-        *piActuallyWritten += uActuallyWritten;
-        // Update file offset
-        uOffset += uActuallyWritten;
-        // Update buffer offset
-        pvBuf = (uint8_t*)pvBuf + uActuallyWritten;
+        for ( uint32_t uRun = 0; uRun < uNumOfRuns; uRun++ )
+        {
+            RawWriteRun_S* psRun = &psRuns[uRun];
+            uint64_t uRunEnd     = psRun->uFileOffset + psRun->uLength;
+
+            assert( (psRun->uDevOffset % uSectorSize) == 0 );
+
+            while ( uPos < uRunEnd )
+            {
+                uint64_t uDevOffset = psRun->uDevOffset + (uPos - psRun->uFileOffset);
+                uint64_t uBytes     = 0;
+                int      iNumOfIov  = 0;
+
+                while ( uPos + uBytes < uRunEnd && iNumOfIov < RAW_WRITE_MAX_IOVECS && uBytes < MAX_READ_WRITE_LENGTH )
+                {
+                    uint64_t uMax = MIN( uRunEnd - (uPos + uBytes), MAX_READ_WRITE_LENGTH - uBytes );
+                    iErr = raw_readwrite_write_next_iovec( iFD, psGroup, uSectorSize, uPos + uBytes, uDevOffset + uBytes, uMax, &psIov[iNumOfIov] );
+                    if ( iErr != 0 )
+                    {
+                        goto exit;
+                    }
+                    uBytes += psIov[iNumOfIov].iov_len;
+                    iNumOfIov++;
+                }
+
+                ssize_t iWriteBytes = pwritev( iFD, psIov, iNumOfIov, uDevOffset );
+                RAW_WRITE_STAT_ADD( uSyscalls, 1 );
+                if ( iWriteBytes != (ssize_t)uBytes )
+                {
+                    iErr = (iWriteBytes < 0) ? errno : EIO;
+                    LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_write: pwritev failed to write wanted length\n" );
+                    goto exit;
+                }
+                RAW_WRITE_STAT_ADD( uBytes, uBytes );
+
+                uint64_t uFirstCluster = (uDevOffset - hfsmp->hfsPlusIOPosOffset) / uClusterSize;
+                uint64_t uLastCluster  = (uDevOffset + uBytes - 1 - hfsmp->hfsPlusIOPosOffset) / uClusterSize;
+                raw_readwrite_invalidate_cached_clusters( hfsmp, uFirstCluster, (uint32_t)(uLastCluster - uFirstCluster + 1) );
+
+                uPos += uBytes;
+                if ( uPos > psGroup->uDataStart )
+                {
+                    *puDataWritten = MIN( uPos, psGroup->uDataEnd ) - psGroup->uDataStart;
+                }
+            }
+        }
     }
 
+exit:
+    for ( uint32_t u = 0; u < psGroup->uNumOfBounce; u++ )
+    {
+        hfs_free( psGroup->ppvBounce[u] );
+    }
+    psGroup->uNumOfBounce = 0;
     return iErr;
 }
 
+// Write uLength bytes of pvBuf at uOffset. If uZeroFrom < uOffset, the rest of the
+// cluster holding file offset uZeroFrom (the old end of file) is zero filled in the
+// same pass, except where the data goes.
+errno_t
+raw_readwrite_write_zero_prefixed( vnode_t psVnode, uint64_t uZeroFrom, uint64_t uOffset, void* pvBuf, uint64_t uLength, uint64_t *piActuallyWritten )
+{
+    errno_t iErr                    = 0;
+    uint64_t uClusterSize           = psVnode->sFSParams.vnfs_mp->psHfsmount->blockSize;
+    uint64_t uFileSize              = ((struct filefork *)VTOF(psVnode))->ff_data.cf_blocks * uClusterSize;
+    uint64_t uDataWritten           = 0;
+
+    *piActuallyWritten = 0;
+
+    // Stop writing at the end of the file
+    if ( uOffset >= uFileSize )
+    {
+        return 0;
+    }
+    uLength = MIN( uLength, uFileSize - uOffset );
+
+    RawWriteGroup_S sGroup = {
+        .uStart     = uOffset,
+        .uEnd       = uOffset + uLength,
+        .uDataStart = uOffset,
+        .uDataEnd   = uOffset + uLength,
+        .puData     = pvBuf,
+    };
+
+    if ( uZeroFrom < uOffset )
+    {
+        uint64_t uZeroEnd = MIN( ROUND_DOWN(uZeroFrom, uClusterSize) + uClusterSize, uFileSize );
+
+        if ( uOffset <= uZeroEnd )
+        {
+            // The zeros and the data touch, one pass for both
+            sGroup.uStart = uZeroFrom;
+            sGroup.uEnd   = MAX( uZeroEnd, sGroup.uDataEnd );
+        }
+        else
+        {
+            RawWriteGroup_S sZeroGroup = {
+                .uStart     = uZeroFrom,
+                .uEnd       = uZeroEnd,
+                .uDataStart = uZeroEnd,
+                .uDataEnd   = uZeroEnd,
+                .puData     = NULL,
+            };
+            uint64_t uUnused = 0;
+
+            iErr = raw_readwrite_write_group( psVnode, &sZeroGroup, &uUnused );
+            if ( iErr != 0 )
+            {
+                return iErr;
+            }
+        }
+    }
+
+    if ( sGroup.uStart < sGroup.uEnd )
+    {
+        iErr = raw_readwrite_write_group( psVnode, &sGroup, &uDataWritten );
+        *piActuallyWritten = uDataWritten;
+    }
+
+    return iErr;
+}
+
+errno_t
+raw_readwrite_write( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLength, uint64_t *piActuallyWritten )
+{
+    return raw_readwrite_write_zero_prefixed( psVnode, uOffset, uOffset, pvBuf, uLength, piActuallyWritten );
+}
+
 errno_t
 raw_readwrite_write_internal( vnode_t psVnode, uint64_t uCluster, uint64_t uContigousClustersInBytes,
                               uint64_t uOffset, uint64_t uBytesToWrite, void* pvBuf, uint64_t *piActuallyWritten )
@@ -478,6 +1056,10 @@ raw_readwrite_zero_fill_fill( hfsmount_t* psMount, uint64_t uBlock, uint32_t uCo
     }
 
 exit:
+    if ( gpvZeroBuf != NULL )
+    {
+        raw_readwrite_invalidate_cached_clusters( psMount, uBlock, uContigBlocks );
+    }
     return iErr;
 }
 
@@ -522,6 +1104,7 @@ raw_readwrite_zero_fill_last_block_suffix( vnode_t psVnode )
 
     // Write the last cluster.
     size_t uBytesWrite = pwrite( iFD, puClusterData, uBlockSize, FSOPS_GetOffsetFromClusterNum( psVnode, uBlockN ) );
+    raw_readwrite_invalidate_cached_clusters( VTOHFS(psVnode), uBlockN, 1 );
     if ( uBytesWrite != uBlockSize )
     {
         iErr = errno;
@@ -535,3 +1118,267 @@ exit:
     return iErr;
 }
 
+
+static void*
+raw_readwrite_read_ahead_worker( void* pvArg )
+{
+    uint32_t uWorker = (uint32_t)(uintptr_t)pvArg;
+
+    lf_lck_mtx_lock( &gsReadAhead.sLock );
+    while ( true )
+    {
+        while ( !gsReadAhead.bShutdown && TAILQ_EMPTY(&gsReadAhead.sQueue) )
+        {
+            pthread_cond_wait( &gsReadAhead.sWorkCond, &gsReadAhead.sLock );
+        }
+        if ( gsReadAhead.bShutdown )
+        {
+            break;
+        }
+
+        ReadAheadJob_S* psJob = TAILQ_FIRST( &gsReadAhead.sQueue );
+        TAILQ_REMOVE( &gsReadAhead.sQueue, psJob, sLink );
+        gsReadAhead.uQueued--;
+        gsReadAhead.psBusyDevVnode[uWorker] = psJob->psDevVnode;
+        lf_lck_mtx_unlock( &gsReadAhead.sLock );
+
+        // Clusters owned by another thread are skipped rather than waited for; that thread
+        // is reading them anyway. Clusters that are already cached are let go right away.
+        // The rest are read in batches, so the I/O backend can overlap them, and each batch
+        // is released as soon as it completes so a foreground reader never waits on more
+        // than one batch.
+        GenericLFBufPtr psBufs[RAW_READ_AHEAD_BATCH_CLUSTERS];
+        uint32_t uNumOfBufs = 0;
+        for ( uint32_t u = 0; u < psJob->uNumOfClusters; u++ )
+        {
+            GenericLFBufPtr psBuf = lf_hfs_generic_buf_allocate( psJob->psDevVnode, psJob->puPhyBlock[u], psJob->uClusterSize, GEN_BUF_PHY_BLOCK | GEN_BUF_NO_WAIT );
+            if ( psBuf == NULL )
+            {
+                continue;
+            }
+            if ( psBuf->uCacheFlags & GEN_BUF_IS_UPTODATE )
+            {
+                lf_hfs_generic_buf_release( psBuf );
+                continue;
+            }
+
+            psBufs[uNumOfBufs++] = psBuf;
+            if ( uNumOfBufs == RAW_READ_AHEAD_BATCH_CLUSTERS )
+            {
+                lf_hfs_generic_buf_read_multi( psBufs, uNumOfBufs );
+                for ( uint32_t uBuf = 0; uBuf < uNumOfBufs; uBuf++ )
+                {
+                    lf_hfs_generic_buf_release( psBufs[uBuf] );
+                }
+                uNumOfBufs = 0;
+            }
+        }
+        if ( uNumOfBufs )
+        {
+            lf_hfs_generic_buf_read_multi( psBufs, uNumOfBufs );
+            for ( uint32_t uBuf = 0; uBuf < uNumOfBufs; uBuf++ )
+            {
+                lf_hfs_generic_buf_release( psBufs[uBuf] );
+            }
+        }
+        hfs_free( psJob );
+
+        lf_lck_mtx_lock( &gsReadAhead.sLock );
+        gsReadAhead.psBusyDevVnode[uWorker] = NULL;
+        pthread_cond_broadcast( &gsReadAhead.sDoneCond );
+    }
+    lf_lck_mtx_unlock( &gsReadAhead.sLock );
+
+    return NULL;
+}
+
+int
+raw_readwrite_read_ahead_init( void )
+{
+    lf_lck_mtx_init( &gsReadAhead.sLock );
+    lf_cond_init( &gsReadAhead.sWorkCond );
+    lf_cond_init( &gsReadAhead.sDoneCond );
+    TAILQ_INIT( &gsReadAhead.sQueue );
+    gsReadAhead.uQueued       = 0;
+    gsReadAhead.uNumOfWorkers = 0;
+    gsReadAhead.bShutdown     = false;
+
+    // Read-ahead is an optimization; run with whatever workers we manage to start
+    for ( uint32_t u = 0; u < RAW_READ_AHEAD_NUM_OF_WORKERS; u++ )
+    {
+        gsReadAhead.psBusyDevVnode[u] = NULL;
+        if ( pthread_create( &gsReadAhead.psWorker[u], NULL, raw_readwrite_read_ahead_worker, (void*)(uintptr_t)u ) != 0 )
+        {
+            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read_ahead_init: failed to start worker %u\n", u );
+            break;
+        }
+        gsReadAhead.uNumOfWorkers++;
+    }
+
+    return 0;
+}
+
+void
+raw_readwrite_read_ahead_de_init( void )
+{
+    lf_lck_mtx_lock( &gsReadAhead.sLock );
+    gsReadAhead.bShutdown = true;
+    pthread_cond_broadcast( &gsReadAhead.sWorkCond );
+    lf_lck_mtx_unlock( &gsReadAhead.sLock );
+
+    for ( uint32_t u = 0; u < gsReadAhead.uNumOfWorkers; u++ )
+    {
+        pthread_join( gsReadAhead.psWorker[u], NULL );
+    }
+    gsReadAhead.uNumOfWorkers = 0;
+
+    ReadAheadJob_S *psJob, *psNextJob;
+    TAILQ_FOREACH_SAFE( psJob, &gsReadAhead.sQueue, sLink, psNextJob )
+    {
+        TAILQ_REMOVE( &gsReadAhead.sQueue, psJob, sLink );
+        hfs_free( psJob );
+    }
+    gsReadAhead.uQueued = 0;
+
+    lf_cond_destroy( &gsReadAhead.sWorkCond );
+    lf_cond_destroy( &gsReadAhead.sDoneCond );
+    lf_lck_mtx_destroy( &gsReadAhead.sLock );
+}
+
+// Cancel the queued read-ahead of a device and wait for the running one to finish.
+// Called before the device goes away.
+void
+raw_readwrite_read_ahead_drain( vnode_t psDevVnode )
+{
+    ReadAheadJob_S *psJob, *psNextJob;
+
+    if ( gsReadAhead.uNumOfWorkers == 0 )
+    {
+        return;
+    }
+
+    lf_lck_mtx_lock( &gsReadAhead.sLock );
+
+    TAILQ_FOREACH_SAFE( psJob, &gsReadAhead.sQueue, sLink, psNextJob )
+    {
+        if ( psJob->psDevVnode == psDevVnode )
+        {
+            TAILQ_REMOVE( &gsReadAhead.sQueue, psJob, sLink );
+            gsReadAhead.uQueued--;
+            hfs_free( psJob );
+        }
+    }
+
+    bool bBusy;
+    do
+    {
+        bBusy = false;
+        for ( uint32_t u = 0; u < gsReadAhead.uNumOfWorkers; u++ )
+        {
+            if ( gsReadAhead.psBusyDevVnode[u] == psDevVnode )
+            {
+                bBusy = true;
+            }
+        }
+        if ( bBusy )
+        {
+            pthread_cond_wait( &gsReadAhead.sDoneCond, &gsReadAhead.sLock );
+        }
+    } while ( bBusy );
+
+    lf_lck_mtx_unlock( &gsReadAhead.sLock );
+}
+
+// Called after a read of [uOffset, uOffset + uLength) from a file, with the truncate lock held.
+// A read that starts where the previous one ended continues a sequential stream; queue
+// the clusters that follow it for reading into the buffer cache.
+// The stream state in the filefork is only a hint, it is not protected against concurrent readers.
+void
+raw_readwrite_read_ahead( vnode_t psVnode, uint64_t uOffset, uint64_t uLength )
+{
+    struct filefork *fp     = VTOF(psVnode);
+    struct hfsmount *hfsmp  = VTOHFS(psVnode);
+    uint64_t uClusterSize   = hfsmp->blockSize;
+    uint64_t uEnd           = uOffset + uLength;
+
+    if ( (uLength == 0) || (uOffset != fp->ff_ra_next_offset) )
+    {
+        // Random access, start over
+        fp->ff_ra_next_offset = uEnd;
+        fp->ff_ra_issued_end  = 0;
+        fp->ff_ra_window      = 0;
+        return;
+    }
+    fp->ff_ra_next_offset = uEnd;
+
+    // Long reads don't go through the cache, there is nothing to read ahead into
+    if ( (uLength > RAW_READ_CACHED_MAX_LENGTH) || (gsReadAhead.uNumOfWorkers == 0) || !raw_readwrite_clusters_cacheable(hfsmp) )
+    {
+        return;
+    }
+
+    fp->ff_ra_window = (fp->ff_ra_window) ? MIN(fp->ff_ra_window * 2, RAW_READ_AHEAD_MAX_CLUSTERS) : RAW_READ_AHEAD_MIN_CLUSTERS;
+
+    uint64_t uStart = MAX( ROUND_UP(uEnd, uClusterSize), fp->ff_ra_issued_end );
+    uint64_t uStop  = MIN( ROUND_UP(uEnd, uClusterSize) + fp->ff_ra_window * uClusterSize, ROUND_UP(fp->ff_size, uClusterSize) );
+
+    // Wait until at least half a window is missing, so that jobs are not too small
+    if ( (uStart >= uStop) || ((uStop - uStart) / uClusterSize < fp->ff_ra_window / 2) )
+    {
+        return;
+    }
+
+    ReadAheadJob_S* psJob = hfs_malloc( sizeof(ReadAheadJob_S) );
+    if ( psJob == NULL )
+    {
+        return;
+    }
+    psJob->psDevVnode     = hfsmp->hfs_devvp;
+    psJob->uClusterSize   = (uint32_t)uClusterSize;
+    psJob->uNumOfClusters = 0;
+
+    uint64_t uCurOffset = uStart;
+    while ( (uCurOffset < uStop) && (psJob->uNumOfClusters < RAW_READ_AHEAD_MAX_CLUSTERS) )
+    {
+        uint64_t uCluster           = 0;
+        uint64_t uContigousBytes    = 0;
+
+        if ( raw_readwrite_get_cluster_from_offset( psVnode, uCurOffset, &uCluster, NULL, &uContigousBytes ) != 0 )
+        {
+            break;
+        }
+
+        uint64_t uRun = MIN( uContigousBytes, uStop - uCurOffset ) / uClusterSize;
+        uRun = MIN( uRun, RAW_READ_AHEAD_MAX_CLUSTERS - psJob->uNumOfClusters );
+        if ( uRun == 0 )
+        {
+            break;
+        }
+
+        for ( uint64_t u = 0; u < uRun; u++ )
+        {
+            psJob->puPhyBlock[psJob->uNumOfClusters++] = raw_readwrite_cluster_to_phy_block( hfsmp, uCluster + u );
+        }
+        uCurOffset += uRun * uClusterSize;
+    }
+
+    if ( psJob->uNumOfClusters == 0 )
+    {
+        hfs_free( psJob );
+        return;
+    }
+    fp->ff_ra_issued_end = uStart + psJob->uNumOfClusters * uClusterSize;
+
+    lf_lck_mtx_lock( &gsReadAhead.sLock );
+    if ( gsReadAhead.uQueued >= RAW_READ_AHEAD_QUEUE_DEPTH )
+    {
+        // The workers are behind; drop it, the reader will fetch the clusters itself
+        lf_lck_mtx_unlock( &gsReadAhead.sLock );
+        hfs_free( psJob );
+        return;
+    }
+    TAILQ_INSERT_TAIL( &gsReadAhead.sQueue, psJob, sLink );
+    gsReadAhead.uQueued++;
+    pthread_cond_signal( &gsReadAhead.sWorkCond );
+    lf_lck_mtx_unlock( &gsReadAhead.sLock );
+}
@@ -12,11 +12,52 @@
 #include "lf_hfs_vnode.h"
 #include "lf_hfs.h"
 
+/*
+ * Device I/O backends.
+ * A backend executes a batch of independent requests against the device and returns
+ * once all of them completed. The backend of a mount is picked when it is mounted,
+ * from the default, which LFHFS_Init takes from the LFHFS_IO_BACKEND_ENV environment
+ * variable. A mounted volume can be switched with the LFHFS_FSATTR_IO_BACKEND fs attribute.
+ * Both take "name" or "name:queue-depth".
+ *   "sync" - one pread/pwrite after the other.
+ *   "aio"  - POSIX AIO, up to the queue depth requests in flight with lio_listio().
+ */
+#define LFHFS_IO_BACKEND_ENV        "LFHFS_IO_BACKEND"
+#define LFHFS_FSATTR_IO_BACKEND     "_N_lfhfs_io_backend"
+#define LFHFS_IO_BACKEND_SPEC_MAX   (32)
+typedef struct {
+    void*       pvBuf;
+    uint64_t    uOffset;        // Byte offset on the device
+    uint64_t    uLength;
+    bool        bWrite;
+    errno_t     iErr;           // Out: 0, or why this request failed
+} RawIORequest_S;
+
+typedef struct raw_io_backend {
+    const char* pcName;
+    errno_t     (*pfSubmit)( int iFD, RawIORequest_S* psReqs, uint32_t uNumOfReqs, uint32_t uQueueDepth );
+} RawIOBackend_S;
+
+int                     raw_readwrite_set_default_io_backend( const char* pcName, uint32_t uQueueDepth );
+const RawIOBackend_S*   raw_readwrite_get_default_io_backend( uint32_t* puQueueDepth );
+int                     raw_readwrite_parse_io_backend( const char* pcSpec, const RawIOBackend_S** ppsBackend, uint32_t* puQueueDepth );
+errno_t                 raw_readwrite_submit( vnode_t psMountVnode, RawIORequest_S* psReqs, uint32_t uNumOfReqs );
+
+// Device traffic of raw_readwrite_write, for benchmarks
+typedef struct {
+    uint64_t    uSyscalls;      // pwritev, plus pread of partly written sectors
+    uint64_t    uBytes;         // Written to the device, zero-fill included
+    uint64_t    uBounceBytes;   // Went through a bounce sector instead of the caller's buffer
+} RawWriteStats_S;
+
+void                    raw_readwrite_get_write_stats( RawWriteStats_S* psStats );
+
 errno_t  raw_readwrite_read_mount( vnode_t psMountVnode, uint64_t uBlockN, uint64_t uClusterSize, void* pvBuf, uint64_t uBufLen, uint64_t *piActuallyRead, uint64_t* puReadStartCluster );
 errno_t  raw_readwrite_write_mount( vnode_t psMountVnode, uint64_t uBlockN, uint64_t uClusterSize, void* pvBuf, uint64_t uBufLen, uint64_t *piActuallyWritten, uint64_t* puWrittenStartCluster );
 
 int      raw_readwrite_get_cluster_from_offset( vnode_t psVnode, uint64_t uWantedOffset, uint64_t* puStartCluster, uint64_t* puInClusterOffset, uint64_t* puContigousClustersInBytes );
 errno_t  raw_readwrite_write( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLength, uint64_t *piActuallyWritten );
+errno_t  raw_readwrite_write_zero_prefixed( vnode_t psVnode, uint64_t uZeroFrom, uint64_t uOffset, void* pvBuf, uint64_t uLength, uint64_t *piActuallyWritten );
 errno_t  raw_readwrite_write_internal( vnode_t psVnode, uint64_t uCluster, uint64_t uContigousClustersInBytes,
                                      uint64_t Offset, uint64_t uBytesToWrite, void* pvBuf, uint64_t *piActuallyWritten );
 errno_t  raw_readwrite_read( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLength, size_t *piActuallyRead, uint64_t* puReadStartCluster );
@@ -28,5 +69,10 @@ void        raw_readwrite_zero_fill_de_init( void );
 int         raw_readwrite_zero_fill_fill( hfsmount_t* psMount, uint64_t uOffset, uint32_t uLength );
 errno_t     raw_readwrite_zero_fill_last_block_suffix( vnode_t psVnode );
 
+int         raw_readwrite_read_ahead_init( void );
+void        raw_readwrite_read_ahead_de_init( void );
+void        raw_readwrite_read_ahead_drain( vnode_t psDevVnode );
+void        raw_readwrite_read_ahead( vnode_t psVnode, uint64_t uOffset, uint64_t uLength );
+
 
 #endif /* lf_hfs_raw_read_write_h */
@@ -477,6 +477,7 @@ static int hfs_InitialMount(struct vnode *devvp, struct mount *mp, struct hfs_mo
     (*hfsmp)->hfs_mp = mp;            /* Make VFSTOHFS work */
     (*hfsmp)->hfs_raw_dev = 0; //vnode_specrdev(devvp);
     (*hfsmp)->hfs_devvp = devvp;
+    (*hfsmp)->hfs_io_backend = raw_readwrite_get_default_io_backend(&(*hfsmp)->hfs_io_queue_depth);
     (*hfsmp)->hfs_logical_block_size = log_blksize;
     (*hfsmp)->hfs_logical_block_count = log_blkcnt;
     (*hfsmp)->hfs_logical_bytes = (uint64_t) log_blksize * (uint64_t) log_blkcnt;
@@ -1868,6 +1869,9 @@ int hfs_unmount(struct mount *mp)
         }
     }
 
+    // No read-ahead may touch the device from here on
+    raw_readwrite_read_ahead_drain(hfsmp->hfs_devvp);
+
     /*
      *    Invalidate our caches and release metadata vnodes
      */
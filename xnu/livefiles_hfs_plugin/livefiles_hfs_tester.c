@@ -123,6 +123,26 @@ typedef struct {
     int32_t      iRetVal;
 } RWThreadData_S;
 
+// Multi-thread lookup benchmark, exercises the buffer cache
+#define MTLU_NUM_OF_THREADS             8
+#define MTLU_NUM_OF_FILES             500
+#define MTLU_NUM_OF_LOOKUPS          5000
+
+// Cnode hash stress: a small hot set of files looked up by many threads at once,
+// while other threads create and remove files next to them
+#define CHS_NUM_OF_THREADS              8
+#define CHS_NUM_OF_HOT_FILES           16
+#define CHS_NUM_OF_OPS               4000
+
+typedef struct {
+    uint32_t     uThreadNum;
+    UVFSFileNode psDirNode;
+    int32_t      iRetVal;
+    uint32_t     uNumOfFiles;   // Names are picked from lookup_file_[0..uNumOfFiles)
+    uint32_t     uNumOfOps;
+    bool         bCreator;      // Create and remove private files instead of looking up
+} LookupThreadData_S;
+
 
 static int   SetAttrChangeSize(UVFSFileNode FileNode,uint64_t uNewSize);
 static int   SetAttrChangeMode(UVFSFileNode FileNode,uint32_t uNewMode);
@@ -210,11 +230,13 @@ unistr255ToLowerCase( struct unistr255* psUnistr255 )
 }
 
 void HFSTest_PrintCacheStats(void) {
-    printf("Cache Statistics: buf_cache_size %u, max_buf_cache_size %u, buf_cache_cleanup %u, buf_cache_remove %u, max_gen_buf_uncached %u, gen_buf_uncached %u.\n",
+    printf("Cache Statistics: buf_cache_size %u, max_buf_cache_size %u, buf_cache_cleanup %u, buf_cache_remove %u, buf_cache_hit %u, buf_cache_miss %u, max_gen_buf_uncached %u, gen_buf_uncached %u.\n",
            gCacheStat.buf_cache_size,
            gCacheStat.max_buf_cache_size,
            gCacheStat.buf_cache_cleanup,
            gCacheStat.buf_cache_remove,
+           gCacheStat.buf_cache_hit,
+           gCacheStat.buf_cache_miss,
            gCacheStat.max_gen_buf_uncached,
            gCacheStat.gen_buf_uncached);
 }
@@ -2157,6 +2179,155 @@ exit:
     return iErr;
 }
 
+static void *LookupThread(void *pvArgs) {
+    int iErr = 0;
+
+    LookupThreadData_S *psThrdData = pvArgs;
+    char pcName[100] = {0};
+    uint32_t uSeed = psThrdData->uThreadNum + 1;
+
+    for(uint32_t uLookup=0; uLookup<psThrdData->uNumOfOps; uLookup++) {
+        UVFSFileNode psNode = NULL;
+        UVFSFileAttributes sAttr = {0};
+
+        if (psThrdData->bCreator) {
+            sprintf(pcName, "private_%u_%u.txt", psThrdData->uThreadNum, uLookup % 8);
+            if (uLookup % 16 < 8) {
+                iErr = CreateNewFile(psThrdData->psDirNode, &psNode, pcName, 0);
+                if (!iErr) {
+                    HFS_fsOps.fsops_reclaim(psNode, 0);
+                }
+            } else {
+                iErr = RemoveFile(psThrdData->psDirNode, pcName);
+            }
+            if (iErr) {
+                printf("Thread %u failed on %s with iErr %d.\n", psThrdData->uThreadNum, pcName, iErr);
+                goto exit;
+            }
+            continue;
+        }
+
+        sprintf(pcName, "lookup_file_%u.txt", rand_r(&uSeed) % psThrdData->uNumOfFiles);
+        iErr = HFS_fsOps.fsops_lookup(psThrdData->psDirNode, pcName, &psNode);
+        if (iErr) {
+            printf("Thread %u failed to lookup %s with iErr %d.\n", psThrdData->uThreadNum, pcName, iErr);
+            goto exit;
+        }
+        iErr = HFS_fsOps.fsops_getattr(psNode, &sAttr);
+        HFS_fsOps.fsops_reclaim(psNode, 0);
+        if (iErr) {
+            printf("Thread %u failed to getattr %s with iErr %d.\n", psThrdData->uThreadNum, pcName, iErr);
+            goto exit;
+        }
+    }
+exit:
+    psThrdData->iRetVal = iErr;
+    return psThrdData;
+}
+
+static int HFSTest_RunLookupThreads(UVFSFileNode psDirNode, uint32_t uMaxEntries, uint64_t uMaxDataSize) {
+    int iErr = 0;
+
+    lf_hfs_generic_buf_cache_set_limits(uMaxEntries, uMaxDataSize);
+    uint32_t uHits   = gCacheStat.buf_cache_hit;
+    uint32_t uMisses = gCacheStat.buf_cache_miss;
+
+    pthread_attr_t sAttr;
+    pthread_attr_init(&sAttr);
+    pthread_attr_setdetachstate(&sAttr, PTHREAD_CREATE_JOINABLE);
+    pthread_t psExecThread[MTLU_NUM_OF_THREADS];
+    LookupThreadData_S pcThreadData[MTLU_NUM_OF_THREADS] = {{0}};
+    uint32_t uNumOfThreads = 0;
+
+    long long int llStart = timestamp();
+    for(uint32_t u = 0; u < MTLU_NUM_OF_THREADS; u++) {
+        pcThreadData[u].uThreadNum  = u;
+        pcThreadData[u].psDirNode   = psDirNode;
+        pcThreadData[u].uNumOfFiles = MTLU_NUM_OF_FILES;
+        pcThreadData[u].uNumOfOps   = MTLU_NUM_OF_LOOKUPS;
+
+        iErr = pthread_create(&psExecThread[u], &sAttr, LookupThread, &pcThreadData[u]);
+        if (iErr) {
+            printf("can't pthread_create\n");
+            break;
+        }
+        uNumOfThreads++;
+    }
+    pthread_attr_destroy(&sAttr);
+
+    for(uint32_t u = 0; u < uNumOfThreads; u++) {
+        int iJoinErr = pthread_join(psExecThread[u], NULL);
+        if (iJoinErr) {
+            printf("can't pthread_join\n");
+            iErr = iJoinErr;
+        } else if (pcThreadData[u].iRetVal) {
+            printf("Thread %u return error %d\n", u, pcThreadData[u].iRetVal);
+            iErr = pcThreadData[u].iRetVal;
+        }
+    }
+    long long int llElapsed = timestamp() - llStart;
+
+    printf("Buffer cache limits %u entries / %llu bytes: %u lookups in %lld uS (%lld lookups/S), %u hits, %u misses.\n",
+           uMaxEntries, uMaxDataSize,
+           uNumOfThreads * MTLU_NUM_OF_LOOKUPS, llElapsed,
+           (llElapsed > 0)? (uNumOfThreads * MTLU_NUM_OF_LOOKUPS * 1000000ll) / llElapsed : 0,
+           gCacheStat.buf_cache_hit - uHits, gCacheStat.buf_cache_miss - uMisses);
+
+    return iErr;
+}
+
+// Many threads doing lookups in one big folder, once with the default buffer cache budget
+// and once with a larger one.
+static int HFSTest_MultiThreadedLookup(UVFSFileNode psRootNode) {
+    int iErr = 0;
+    char pcName[100] = {0};
+    UVFSFileNode psDirNode = NULL;
+    UVFSFileNode psNode    = NULL;
+
+    iErr = CreateNewFolder(psRootNode, &psDirNode, "LookupFolder");
+    if (iErr) {
+        printf("Failed to create LookupFolder with iErr %d.\n", iErr);
+        return iErr;
+    }
+
+    for(uint32_t u = 0; u < MTLU_NUM_OF_FILES; u++) {
+        sprintf(pcName, "lookup_file_%u.txt", u);
+        iErr = CreateNewFile(psDirNode, &psNode, pcName, 0);
+        if (iErr) {
+            printf("Failed to create file %s with iErr %d.\n", pcName, iErr);
+            goto exit;
+        }
+        HFS_fsOps.fsops_reclaim(psNode, 0);
+    }
+
+    iErr = HFSTest_RunLookupThreads(psDirNode, 0, 0);
+    if (iErr) {
+        goto exit;
+    }
+
+    iErr = HFSTest_RunLookupThreads(psDirNode, 4096, 32*1024*1024);
+    lf_hfs_generic_buf_cache_set_limits(0, 0);
+    if (iErr) {
+        goto exit;
+    }
+
+    for(uint32_t u = 0; u < MTLU_NUM_OF_FILES; u++) {
+        sprintf(pcName, "lookup_file_%u.txt", u);
+        iErr = RemoveFile(psDirNode, pcName);
+        if (iErr) {
+            printf("Failed to remove file %s with iErr %d.\n", pcName, iErr);
+            goto exit;
+        }
+    }
+
+exit:
+    HFS_fsOps.fsops_reclaim(psDirNode, 0);
+    if (!iErr) {
+        iErr = RemoveFolder(psRootNode, "LookupFolder");
+    }
+    return iErr;
+}
+
 static int
 HFSTest_Create1000Files( UVFSFileNode RootNode )
 {
@@ -3654,6 +3825,419 @@ HFSTest_RandomIO( UVFSFileNode RootNode )
     return 0;
 }
 
+// Small reads of a big file: a sequential pass, a random pass, and a pass
+// interleaving one sequential stream with random reads. Exercises the file data
+// cache and the read-ahead.
+static int
+HFSTest_MixedReadBench( UVFSFileNode RootNode )
+{
+#define MRB_FILE_SIZE   (16*1024*1024)
+#define MRB_WRITE_SIZE  (1024*1024)
+#define MRB_READ_SIZE   (4*1024)
+#define MRB_NUM_OF_READS (MRB_FILE_SIZE/MRB_READ_SIZE)
+
+    int iErr = 0;
+    UVFSFileNode psFile = NULL;
+    size_t iActually;
+    uint32_t* puWriteBuf = malloc(MRB_WRITE_SIZE);
+    uint32_t* puReadBuf  = malloc(MRB_READ_SIZE);
+    char* ppcPassName[3] = { "sequential", "random", "mixed" };
+
+    iErr = CreateNewFile( RootNode, &psFile, "MixedReadFile", 0 );
+    if ( iErr ) {
+        printf("Failed to create MixedReadFile with iErr %d.\n", iErr);
+        goto exit;
+    }
+
+    // Every 32bit word holds its own offset in the file
+    for ( uint64_t uOffset = 0; uOffset < MRB_FILE_SIZE; uOffset += MRB_WRITE_SIZE ) {
+        for ( uint32_t uIdx = 0; uIdx < MRB_WRITE_SIZE/sizeof(uint32_t); uIdx++ ) {
+            puWriteBuf[uIdx] = (uint32_t)(uOffset + uIdx*sizeof(uint32_t));
+        }
+        iErr = HFS_fsOps.fsops_write( psFile, uOffset, MRB_WRITE_SIZE, puWriteBuf, &iActually );
+        if ( iErr || iActually != MRB_WRITE_SIZE ) {
+            printf("fsops_write at %llu failed with iErr %d.\n", uOffset, iErr);
+            iErr = iErr? iErr : EIO;
+            goto exit;
+        }
+    }
+
+    for ( uint32_t uPass = 0; uPass < 3; uPass++ ) {
+        uint32_t uHits    = gCacheStat.buf_cache_hit;
+        uint32_t uMisses  = gCacheStat.buf_cache_miss;
+        uint64_t uSeqOffset = 0;
+        long long int llStart = timestamp();
+
+        for ( uint32_t uRead = 0; uRead < MRB_NUM_OF_READS; uRead++ ) {
+            uint64_t uOffset;
+            bool bSequential = (uPass == 0) || ((uPass == 2) && (uRead % 2 == 0));
+            if ( bSequential ) {
+                uOffset = uSeqOffset;
+                uSeqOffset += MRB_READ_SIZE;
+            } else {
+                uOffset = ((uint64_t)rand() % (MRB_FILE_SIZE/sizeof(uint32_t))) * sizeof(uint32_t);
+                uOffset = MIN(uOffset, MRB_FILE_SIZE - MRB_READ_SIZE);
+            }
+
+            iErr = HFS_fsOps.fsops_read( psFile, uOffset, MRB_READ_SIZE, puReadBuf, &iActually );
+            if ( iErr || iActually != MRB_READ_SIZE ) {
+                printf("fsops_read at %llu failed with iErr %d.\n", uOffset, iErr);
+                iErr = iErr? iErr : EIO;
+                goto exit;
+            }
+            for ( uint32_t uIdx = 0; uIdx < MRB_READ_SIZE/sizeof(uint32_t); uIdx++ ) {
+                if ( puReadBuf[uIdx] != (uint32_t)(uOffset + uIdx*sizeof(uint32_t)) ) {
+                    printf("Bad data at offset %llu.\n", uOffset + uIdx*sizeof(uint32_t));
+                    iErr = EIO;
+                    goto exit;
+                }
+            }
+        }
+
+        long long int llElapsed = timestamp() - llStart;
+        printf("%s pass: %u reads of %u bytes in %lld uS, %u cache hits, %u cache misses.\n",
+               ppcPassName[uPass], MRB_NUM_OF_READS, MRB_READ_SIZE, llElapsed,
+               gCacheStat.buf_cache_hit - uHits, gCacheStat.buf_cache_miss - uMisses);
+    }
+
+exit:
+    free(puWriteBuf);
+    free(puReadBuf);
+    if ( psFile ) {
+        HFS_fsOps.fsops_reclaim(psFile, 0);
+        if ( !iErr ) {
+            iErr = RemoveFile(RootNode, "MixedReadFile");
+        }
+    }
+    return iErr;
+}
+
+// Switch the I/O backend of a mounted volume through its fs attribute
+static int
+SetIOBackend( UVFSFileNode RootNode, const char* pcSpec )
+{
+    size_t uLen = sizeof(UVFSFSAttributeValue) + LFHFS_IO_BACKEND_SPEC_MAX;
+    UVFSFSAttributeValue* psAttrVal = (UVFSFSAttributeValue*)calloc(1, uLen);
+    UVFSFSAttributeValue* psOutVal  = (UVFSFSAttributeValue*)calloc(1, uLen);
+    assert( psAttrVal && psOutVal );
+
+    strlcpy( psAttrVal->fsa_string, pcSpec, LFHFS_IO_BACKEND_SPEC_MAX );
+    int iErr = HFS_fsOps.fsops_setfsattr( RootNode, LFHFS_FSATTR_IO_BACKEND, psAttrVal, uLen, psOutVal, uLen );
+
+    free( psAttrVal );
+    free( psOutVal );
+    return iErr;
+}
+
+// Cold sequential reads (read-ahead) and journal flushes with each device I/O
+// backend and a few queue depths. The backend is switched on the mounted volume.
+static int
+HFSTest_IOBackendBench( UVFSFileNode RootNode )
+{
+#define IOB_FILE_SIZE       (8*1024*1024)
+#define IOB_WRITE_SIZE      (1024*1024)
+#define IOB_READ_SIZE       (4*1024)
+#define IOB_NUM_OF_FILES    (200)
+
+    int iErr = 0;
+    size_t iActually;
+    size_t uRetLen;
+    size_t uSpecLen = sizeof(UVFSFSAttributeValue) + LFHFS_IO_BACKEND_SPEC_MAX;
+    UVFSFSAttributeValue* psSavedSpec = (UVFSFSAttributeValue*)calloc(1, uSpecLen);
+    char* pcWriteBuf = malloc(IOB_WRITE_SIZE);
+    char* pcReadBuf  = malloc(IOB_READ_SIZE);
+    struct {
+        const char* pcName;
+        uint32_t    uDepth;
+    } sConfigs[] = { {"sync", 1}, {"aio", 1}, {"aio", 4}, {"aio", 16} };
+
+    memset( pcWriteBuf, 0x5A, IOB_WRITE_SIZE );
+
+    iErr = HFS_fsOps.fsops_getfsattr( RootNode, LFHFS_FSATTR_IO_BACKEND, psSavedSpec, uSpecLen, &uRetLen );
+    if ( iErr ) {
+        printf("Failed to get %s with iErr %d.\n", LFHFS_FSATTR_IO_BACKEND, iErr);
+        free(psSavedSpec);
+        free(pcWriteBuf);
+        free(pcReadBuf);
+        return iErr;
+    }
+
+    for ( uint32_t uConfig = 0; uConfig < sizeof(sConfigs)/sizeof(sConfigs[0]); uConfig++ ) {
+        UVFSFileNode psFile = NULL;
+        char pcName[64];
+
+        sprintf( pcName, "%s:%u", sConfigs[uConfig].pcName, sConfigs[uConfig].uDepth );
+        iErr = SetIOBackend( RootNode, pcName );
+        if ( iErr ) {
+            printf("Failed to set I/O backend %s with iErr %d.\n", pcName, iErr);
+            goto exit;
+        }
+
+        // Freshly written data is not in the cache, so the read pass is cold
+        iErr = CreateNewFile( RootNode, &psFile, "IOBackendFile", 0 );
+        if ( iErr ) {
+            printf("Failed to create IOBackendFile with iErr %d.\n", iErr);
+            goto exit;
+        }
+        for ( uint64_t uOffset = 0; uOffset < IOB_FILE_SIZE; uOffset += IOB_WRITE_SIZE ) {
+            iErr = HFS_fsOps.fsops_write( psFile, uOffset, IOB_WRITE_SIZE, pcWriteBuf, &iActually );
+            if ( iErr || iActually != IOB_WRITE_SIZE ) {
+                printf("fsops_write at %llu failed with iErr %d.\n", uOffset, iErr);
+                iErr = iErr? iErr : EIO;
+                HFS_fsOps.fsops_reclaim(psFile, 0);
+                goto exit;
+            }
+        }
+
+        long long int llStart = timestamp();
+        for ( uint64_t uOffset = 0; uOffset < IOB_FILE_SIZE; uOffset += IOB_READ_SIZE ) {
+            iErr = HFS_fsOps.fsops_read( psFile, uOffset, IOB_READ_SIZE, pcReadBuf, &iActually );
+            if ( iErr || iActually != IOB_READ_SIZE || pcReadBuf[0] != 0x5A ) {
+                printf("fsops_read at %llu failed with iErr %d.\n", uOffset, iErr);
+                iErr = iErr? iErr : EIO;
+                HFS_fsOps.fsops_reclaim(psFile, 0);
+                goto exit;
+            }
+        }
+        long long int llReadTime = timestamp() - llStart;
+        HFS_fsOps.fsops_reclaim(psFile, 0);
+
+        // Metadata heavy: every sync flushes a transaction to the home locations
+        llStart = timestamp();
+        for ( uint32_t uFile = 0; uFile < IOB_NUM_OF_FILES; uFile++ ) {
+            sprintf( pcName, "IOBackendMeta_%u", uFile );
+            iErr = CreateNewFile( RootNode, &psFile, pcName, 0 );
+            if ( iErr ) {
+                printf("Failed to create %s with iErr %d.\n", pcName, iErr);
+                goto exit;
+            }
+            HFS_fsOps.fsops_reclaim(psFile, 0);
+            if ( uFile % 20 == 19 ) {
+                HFS_fsOps.fsops_sync(RootNode);
+            }
+        }
+        for ( uint32_t uFile = 0; uFile < IOB_NUM_OF_FILES; uFile++ ) {
+            sprintf( pcName, "IOBackendMeta_%u", uFile );
+            iErr = RemoveFile( RootNode, pcName );
+            if ( iErr ) {
+                goto exit;
+            }
+        }
+        HFS_fsOps.fsops_sync(RootNode);
+        long long int llMetaTime = timestamp() - llStart;
+
+        iErr = RemoveFile( RootNode, "IOBackendFile" );
+        if ( iErr ) {
+            goto exit;
+        }
+
+        printf("backend %s depth %u: sequential read %lld uS, create/remove %u files %lld uS.\n",
+               sConfigs[uConfig].pcName, sConfigs[uConfig].uDepth, llReadTime, IOB_NUM_OF_FILES, llMetaTime);
+    }
+
+exit:
+    SetIOBackend( RootNode, psSavedSpec->fsa_string );
+    free(psSavedSpec);
+    free(pcWriteBuf);
+    free(pcReadBuf);
+    return iErr;
+}
+
+// Large writes to a fragmented file. Two files are grown in turns so their
+// extents interleave, then one of them is rewritten with big unaligned writes,
+// and extended past a gap. Prints the device syscalls per MB each pass needed.
+static int
+HFSTest_FragmentedWriteBench( UVFSFileNode RootNode )
+{
+#define FWB_CHUNK_SIZE      (64*1024)
+#define FWB_FILE_SIZE       (8*1024*1024)
+#define FWB_WRITE_SIZE      (1024*1024 + 1000)
+#define FWB_GAP_SIZE        (3*1024*1024 + 123)
+
+    int iErr = 0;
+    size_t iActually;
+    UVFSFileNode psFile  = NULL;
+    UVFSFileNode psOther = NULL;
+    uint8_t* puBuf = malloc(FWB_WRITE_SIZE);
+    uint8_t* puReadBuf = malloc(FWB_WRITE_SIZE);
+    RawWriteStats_S sBefore, sAfter;
+
+    iErr = CreateNewFile( RootNode, &psFile, "FragmentedFile", 0 );
+    if ( !iErr ) {
+        iErr = CreateNewFile( RootNode, &psOther, "FragmentedOther", 0 );
+    }
+    if ( iErr ) {
+        printf("Failed to create files with iErr %d.\n", iErr);
+        goto exit;
+    }
+
+    memset( puBuf, 0xEE, FWB_WRITE_SIZE );
+    raw_readwrite_get_write_stats( &sBefore );
+    for ( uint64_t uOffset = 0; uOffset < FWB_FILE_SIZE; uOffset += FWB_CHUNK_SIZE ) {
+        iErr = HFS_fsOps.fsops_write( psFile, uOffset, FWB_CHUNK_SIZE, puBuf, &iActually );
+        if ( !iErr ) {
+            iErr = HFS_fsOps.fsops_write( psOther, uOffset, FWB_CHUNK_SIZE, puBuf, &iActually );
+        }
+        if ( iErr ) {
+            printf("fsops_write at %llu failed with iErr %d.\n", uOffset, iErr);
+            goto exit;
+        }
+    }
+    raw_readwrite_get_write_stats( &sAfter );
+    printf("interleaved growth: %.1f syscalls/MB, %llu bounce bytes.\n",
+           (double)(sAfter.uSyscalls - sBefore.uSyscalls) * 1024 * 1024 / (sAfter.uBytes - sBefore.uBytes),
+           sAfter.uBounceBytes - sBefore.uBounceBytes);
+
+    // Unaligned rewrite across many extents
+    for ( uint32_t uIdx = 0; uIdx < FWB_WRITE_SIZE; uIdx++ ) {
+        puBuf[uIdx] = (uint8_t)(uIdx * 7);
+    }
+    raw_readwrite_get_write_stats( &sBefore );
+    for ( uint64_t uOffset = 333; uOffset + FWB_WRITE_SIZE <= FWB_FILE_SIZE; uOffset += FWB_WRITE_SIZE ) {
+        iErr = HFS_fsOps.fsops_write( psFile, uOffset, FWB_WRITE_SIZE, puBuf, &iActually );
+        if ( iErr || iActually != FWB_WRITE_SIZE ) {
+            printf("fsops_write at %llu failed with iErr %d.\n", uOffset, iErr);
+            iErr = iErr? iErr : EIO;
+            goto exit;
+        }
+    }
+    raw_readwrite_get_write_stats( &sAfter );
+    printf("fragmented rewrite: %.1f syscalls/MB, %llu bounce bytes.\n",
+           (double)(sAfter.uSyscalls - sBefore.uSyscalls) * 1024 * 1024 / (sAfter.uBytes - sBefore.uBytes),
+           sAfter.uBounceBytes - sBefore.uBounceBytes);
+
+    iErr = HFS_fsOps.fsops_read( psFile, 333, FWB_WRITE_SIZE, puReadBuf, &iActually );
+    if ( iErr || memcmp( puBuf, puReadBuf, FWB_WRITE_SIZE ) ) {
+        printf("Rewritten data does not match, iErr %d.\n", iErr);
+        iErr = iErr? iErr : EIO;
+        goto exit;
+    }
+
+    // Extend past a gap: the tail of the old last cluster is zero filled with the data
+    iErr = HFS_fsOps.fsops_write( psOther, FWB_FILE_SIZE - 17, 17, puBuf, &iActually );
+    if ( !iErr ) {
+        iErr = HFS_fsOps.fsops_write( psOther, FWB_FILE_SIZE + FWB_GAP_SIZE, FWB_WRITE_SIZE, puBuf, &iActually );
+    }
+    if ( !iErr ) {
+        iErr = HFS_fsOps.fsops_read( psOther, FWB_FILE_SIZE, FWB_WRITE_SIZE, puReadBuf, &iActually );
+    }
+    if ( iErr ) {
+        printf("Extending write failed with iErr %d.\n", iErr);
+        goto exit;
+    }
+    for ( uint32_t uIdx = 0; uIdx < FWB_WRITE_SIZE; uIdx++ ) {
+        if ( puReadBuf[uIdx] != 0 ) {
+            printf("Gap is not zero at offset %u.\n", FWB_FILE_SIZE + uIdx);
+            iErr = EIO;
+            goto exit;
+        }
+    }
+
+exit:
+    free(puBuf);
+    free(puReadBuf);
+    if ( psFile ) {
+        HFS_fsOps.fsops_reclaim(psFile, 0);
+    }
+    if ( psOther ) {
+        HFS_fsOps.fsops_reclaim(psOther, 0);
+    }
+    if ( !iErr ) {
+        iErr = RemoveFile(RootNode, "FragmentedFile");
+    }
+    if ( !iErr ) {
+        iErr = RemoveFile(RootNode, "FragmentedOther");
+    }
+    return iErr;
+}
+
+static long long int HFSTest_RunCnodeHashThreads(UVFSFileNode psDirNode, uint32_t uNumOfCreators, int *piErr) {
+    pthread_t psExecThread[CHS_NUM_OF_THREADS];
+    LookupThreadData_S pcThreadData[CHS_NUM_OF_THREADS] = {{0}};
+    uint32_t uNumOfThreads = 0;
+
+    *piErr = 0;
+    long long int llStart = timestamp();
+    for(uint32_t u = 0; u < CHS_NUM_OF_THREADS; u++) {
+        pcThreadData[u].uThreadNum  = u;
+        pcThreadData[u].psDirNode   = psDirNode;
+        pcThreadData[u].uNumOfFiles = CHS_NUM_OF_HOT_FILES;
+        pcThreadData[u].uNumOfOps   = CHS_NUM_OF_OPS;
+        pcThreadData[u].bCreator    = (u < uNumOfCreators);
+
+        if (pthread_create(&psExecThread[u], NULL, LookupThread, &pcThreadData[u])) {
+            printf("can't pthread_create\n");
+            *piErr = EAGAIN;
+            break;
+        }
+        uNumOfThreads++;
+    }
+
+    for(uint32_t u = 0; u < uNumOfThreads; u++) {
+        pthread_join(psExecThread[u], NULL);
+        if (pcThreadData[u].iRetVal && !*piErr) {
+            printf("Thread %u return error %d\n", u, pcThreadData[u].iRetVal);
+            *piErr = pcThreadData[u].iRetVal;
+        }
+    }
+
+    return timestamp() - llStart;
+}
+
+// Drives the cnode hash through the livefiles API: every lookup and reclaim of the
+// hot set goes through hfs_chash_getcnode and the in-transition waits, first with
+// lookups only and then with threads creating and removing files in the same folder.
+static int
+HFSTest_CnodeHashStress( UVFSFileNode psRootNode )
+{
+    int iErr = 0;
+    char pcName[100] = {0};
+    UVFSFileNode psDirNode = NULL;
+    UVFSFileNode psNode    = NULL;
+
+    iErr = CreateNewFolder(psRootNode, &psDirNode, "CnodeHashFolder");
+    if (iErr) {
+        printf("Failed to create CnodeHashFolder with iErr %d.\n", iErr);
+        return iErr;
+    }
+
+    for(uint32_t u = 0; u < CHS_NUM_OF_HOT_FILES; u++) {
+        sprintf(pcName, "lookup_file_%u.txt", u);
+        iErr = CreateNewFile(psDirNode, &psNode, pcName, 0);
+        if (iErr) {
+            printf("Failed to create file %s with iErr %d.\n", pcName, iErr);
+            goto exit;
+        }
+        HFS_fsOps.fsops_reclaim(psNode, 0);
+    }
+
+    for(uint32_t uNumOfCreators = 0; uNumOfCreators <= CHS_NUM_OF_THREADS/2; uNumOfCreators += CHS_NUM_OF_THREADS/2) {
+        long long int llElapsed = HFSTest_RunCnodeHashThreads(psDirNode, uNumOfCreators, &iErr);
+        if (iErr) {
+            goto exit;
+        }
+        printf("%u lookup threads, %u create/remove threads: %u ops in %lld uS (%lld ops/S).\n",
+               CHS_NUM_OF_THREADS - uNumOfCreators, uNumOfCreators, CHS_NUM_OF_THREADS * CHS_NUM_OF_OPS, llElapsed,
+               (llElapsed > 0)? (CHS_NUM_OF_THREADS * CHS_NUM_OF_OPS * 1000000ll) / llElapsed : 0);
+    }
+
+    for(uint32_t u = 0; u < CHS_NUM_OF_HOT_FILES; u++) {
+        sprintf(pcName, "lookup_file_%u.txt", u);
+        iErr = RemoveFile(psDirNode, pcName);
+        if (iErr) {
+            printf("Failed to remove file %s with iErr %d.\n", pcName, iErr);
+            goto exit;
+        }
+    }
+
+exit:
+    HFS_fsOps.fsops_reclaim(psDirNode, 0);
+    if (!iErr) {
+        iErr = RemoveFolder(psRootNode, "CnodeHashFolder");
+    }
+    return iErr;
+}
+
 static int
 HFSTest_HardLink( UVFSFileNode RootNode )
 {
@@ -4236,6 +4820,9 @@ TestData_S  gsTestsData[] = {
     ADD_TEST( "HFSTest_Rename",                  "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_Rename ),
     ADD_TEST( "HFSTest_WriteRead",               "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_WriteRead ),
     ADD_TEST( "HFSTest_RandomIO",                "/Volumes/SSD_Shared/FS_DMGs/HFS100MB.dmg",         &HFSTest_RandomIO ),
+    ADD_TEST( "HFSTest_MixedReadBench",          "/Volumes/SSD_Shared/FS_DMGs/HFS100MB.dmg",         &HFSTest_MixedReadBench ),
+    ADD_TEST( "HFSTest_IOBackendBench",          "/Volumes/SSD_Shared/FS_DMGs/HFS100MB.dmg",         &HFSTest_IOBackendBench ),
+    ADD_TEST( "HFSTest_FragmentedWriteBench",    "/Volumes/SSD_Shared/FS_DMGs/HFS100MB.dmg",         &HFSTest_FragmentedWriteBench ),
     ADD_TEST( "HFSTest_Create1000Files",         "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_Create1000Files ),
     ADD_TEST( "HFSTest_HardLink",                "/Volumes/SSD_Shared/FS_DMGs/HFSHardLink.dmg",      &HFSTest_HardLink ),
     ADD_TEST( "HFSTest_CreateHardLink",          "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_CreateHardLink ),
@@ -4272,6 +4859,8 @@ TestData_S  gsTestsData[] = {
     ADD_TEST( "HFSTest_CreateHardLink_wJournal",     "/Volumes/SSD_Shared/FS_DMGs/HFSJ-EmptyLarge.dmg",      &HFSTest_CreateHardLink ),
     ADD_TEST( "HFSTest_RootFillUp_wJournal",         "/Volumes/SSD_Shared/FS_DMGs/HFSJ-EmptyLarge.dmg",      &HFSTest_RootFillUp ),
     ADD_TEST( "HFSTest_MultiThreadedRW_wJournal",                "",                                         &HFSTest_MultiThreadedRW_wJournal ),
+    ADD_TEST( "HFSTest_MultiThreadedLookup_wJournal",            "/Volumes/SSD_Shared/FS_DMGs/HFSJ-EmptyLarge.dmg", &HFSTest_MultiThreadedLookup ),
+    ADD_TEST( "HFSTest_CnodeHashStress_wJournal",                "/Volumes/SSD_Shared/FS_DMGs/HFSJ-EmptyLarge.dmg", &HFSTest_CnodeHashStress ),
     ADD_TEST( "HFSTest_DeleteAHugeDefragmentedFile_wJournal",    "",                                         &HFSTest_DeleteAHugeDefragmentedFile_wJournal ),
     ADD_TEST( "HFSTest_CreateJournal_Sparse",                CREATE_SPARSE_VOLUME,                           &HFSTest_OpenJournal ),
     ADD_TEST( "HFSTest_MakeDirAndKeep_Sparse",               CREATE_SPARSE_VOLUME,                           &HFSTest_MakeDirAndKeep ),
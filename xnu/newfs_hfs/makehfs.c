@@ -37,10 +37,16 @@
 #include <sys/stat.h>
 #include <sys/sysctl.h>
 #include <sys/vmmeter.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#endif
 
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fts.h>
 #include <paths.h>
 #include <pwd.h>
 #include <stdlib.h>
@@ -106,6 +112,9 @@ extern Boolean _CFStringGetFileSystemRepresentation(CFStringRef string, UInt8 *b
 
 #include "newfs_hfs.h"
 
+/* gLowerCaseTable, for sorting catalog keys the way fsck_hfs does */
+#include "../lib_fsck_hfs/dfalib/CaseFolding.h"
+
 #ifndef NEWFS_HFS_DEBUG
 # ifdef DEBUG_BUILD
 #  define NEWFS_HFS_DEBUG 1
@@ -138,6 +147,83 @@ struct ExtentRecord {
 static size_t numOverflowExtents = 0;
 static struct ExtentRecord *overflowExtents = NULL;
 
+/*
+ * In-memory map of the writes make_hfsplus has staged: a list of
+ * non-overlapping regions sorted by device offset.  Each region holds
+ * either data or zeros (data == NULL).
+ */
+struct StagedRegion {
+	off_t	offset;
+	off_t	length;
+	UInt8	*data;
+};
+
+struct StagedRange {
+	off_t	offset;
+	off_t	end;
+};
+
+static struct {
+	int			active;
+	struct StagedRegion	*regions;
+	size_t			count;
+	void			**buffers;	/* data copies, freed when the map is flushed */
+	size_t			numBuffers;
+} gStaged;
+
+/*
+ * Populating a new volume from a directory tree (newfs_hfs -R).
+ *
+ * The tree is scanned once, before the volume header is laid out.
+ * Every catalog record is built in memory, the records are sorted by
+ * key, and the catalog B-tree is loaded bottom up: leaf nodes packed
+ * full in key order, then each index level built from the first keys
+ * of the level below, until a level fits in a single node.  File data
+ * is laid out back to back, in scan order, from the first free
+ * allocation block, so every fork is one extent and the extents B-tree
+ * stays empty.
+ */
+
+#define kCatalogArenaChunkSize	(1024 * 1024)
+#define kSourceCopyChunkSize	(4 * 1024 * 1024)
+
+struct SourceNode {
+	char		*path;
+	struct stat	st;
+	UInt32		cnid;
+	UInt32		parent;		/* index of the parent's SourceNode */
+	UInt32		valence;	/* folders: number of children */
+	UInt32		folderCount;	/* folders: number of subfolders */
+	UInt32		startBlock;	/* files: data fork */
+	UInt32		blockCount;
+	UInt8		*record;	/* the folder or file record, in the arena */
+};
+
+struct CatalogRecordRef {
+	UInt8		*key;		/* on-disk key, followed by the record */
+	UInt16		size;		/* key and record */
+};
+
+struct SourceTree {
+	struct SourceNode	*nodes;		/* nodes[0] is the root folder */
+	UInt32			numNodes;
+	UInt32			numFiles;
+	UInt32			numFolders;	/* not counting the root */
+	UInt32			nextCNID;
+	UInt64			dataBlocks;
+
+	struct CatalogRecordRef	*records;
+	UInt32			numRecords;
+	UInt8			**rootRecordKeys;	/* the records InitCatalogRoot_HFSPlus made */
+	UInt32			rootRecords;
+
+	UInt8			**arena;	/* record storage, kCatalogArenaChunkSize per chunk */
+	UInt32			arenaChunks;
+	UInt32			arenaUsed;	/* bytes used in the last chunk */
+
+	UInt32			usedNodes;	/* header, leaf and index nodes */
+};
+
 struct filefork	gDTDBFork, gSystemFork, gReadMeFork;
 
 static void WriteVH __P((const DriveInfo *driveInfo, HFSPlusVolumeHeader *hp));
@@ -161,13 +247,32 @@ static void WriteCatalogFile __P((const DriveInfo *dip, UInt64 startingSector,
 static int  WriteJournalInfo(const DriveInfo *driveInfo, UInt64 startingSector,
 			     const hfsparams_t *dp, HFSPlusVolumeHeader *header,
 			     void *buffer);
+static void InitCatalogHeaderNode __P((const hfsparams_t *dp, void *buffer, UInt16 treeDepth,
+		UInt32 rootNode, UInt32 firstLeafNode, UInt32 lastLeafNode,
+		UInt32 leafRecords, UInt32 usedNodes, UInt32 *mapNodes));
 static void InitCatalogRoot_HFSPlus __P((const hfsparams_t *dp, const HFSPlusVolumeHeader *header, void * buffer));
 
 static void WriteMapNodes __P((const DriveInfo *driveInfo, UInt64 diskStart,
 		UInt32 firstMapNode, UInt32 mapNodes, UInt16 btNodeSize, void *buffer));
 static void WriteBuffer __P((const DriveInfo *driveInfo, UInt64 startingSector,
 		UInt64 byteCount, const void *buffer));
+static void StageBegin __P((void));
+static void StageWrite __P((off_t offset, off_t length, const void *data));
+static void StageRead __P((const DriveInfo *driveInfo, off_t offset, off_t length, void *buffer));
+static void FlushStagedWrites __P((const DriveInfo *driveInfo));
+static void ReadDeviceRange __P((const DriveInfo *driveInfo, off_t offset, off_t length, void *buffer));
+static void ZeroDeviceRange __P((const DriveInfo *driveInfo, off_t offset, off_t length));
+static int PunchHole __P((int fd, off_t offset, off_t length));
+static void WriteZeros __P((const DriveInfo *driveInfo, off_t offset, off_t length));
 static UInt32 Largest __P((UInt32 a, UInt32 b, UInt32 c, UInt32 d ));
+static void PrepareSourceTree __P((hfsparams_t *dp, struct SourceTree *tree));
+static void FinishSourceTree __P((const DriveInfo *driveInfo, const hfsparams_t *dp,
+		HFSPlusVolumeHeader *header, struct SourceTree *tree));
+static void WriteCatalogTree __P((const DriveInfo *driveInfo, UInt64 startingSector,
+		const hfsparams_t *dp, struct SourceTree *tree));
+static void CopySourceData __P((const DriveInfo *driveInfo, const HFSPlusVolumeHeader *header,
+		struct SourceTree *tree));
+static void FreeSourceTree __P((struct SourceTree *tree));
 
 static UInt32 GetDefaultEncoding();
 
@@ -367,6 +472,7 @@ make_hfsplus(const DriveInfo *driveInfo, hfsparams_t *defaults)
 	void			*nodeBuffer = NULL;
 	HFSPlusVolumeHeader	*header = NULL;
 	UInt64			sector;
+	struct SourceTree	tree;
 
 	/* Use wipefs() API to clear old metadata from the device.
 	 * This should be done before we start writing anything on the 
@@ -375,12 +481,22 @@ make_hfsplus(const DriveInfo *driveInfo, hfsparams_t *defaults)
 	 */
 	(void) dowipefs(driveInfo->fd);
 
+	/*
+	 * Everything up to the volume header is assembled in memory and
+	 * written out in one pass by FlushStagedWrites (see StageBegin).
+	 */
+	StageBegin();
+
 	/* --- Create an HFS Plus header:  */
 
 	header = (HFSPlusVolumeHeader*)malloc((size_t)kBytesPerSector);
 	if (header == NULL)
 		err(1, NULL);
 
+	/* Size the catalog for the source tree before laying out the volume */
+	if (defaults->sourceDirectory)
+		PrepareSourceTree(defaults, &tree);
+
 	/* VH Initialized in native byte order */
 	InitVH(defaults, driveInfo->totalSectors, header);
 
@@ -528,6 +644,10 @@ make_hfsplus(const DriveInfo *driveInfo, hfsparams_t *defaults)
 	
 	}
 
+	/* Place the source tree's file data right after the metadata */
+	if (defaults->sourceDirectory)
+		FinishSourceTree(driveInfo, defaults, header, &tree);
+
 	/*--- WRITE FILE EXTENTS B-TREE TO DISK:  */
 
 	btNodeSize = defaults->extentsNodeSize;
@@ -563,11 +683,15 @@ make_hfsplus(const DriveInfo *driveInfo, hfsparams_t *defaults)
 	sectorsPerNode = btNodeSize/kBytesPerSector;
 
 	sector = header->catalogFile.extents[0].startBlock * sectorsPerBlock;
-	WriteCatalogFile(driveInfo, sector, defaults, header, nodeBuffer, &bytesUsed, &mapNodes);
+	if (defaults->sourceDirectory) {
+		WriteCatalogTree(driveInfo, sector, defaults, &tree);
+	} else {
+		WriteCatalogFile(driveInfo, sector, defaults, header, nodeBuffer, &bytesUsed, &mapNodes);
 
-	if (mapNodes > 0) {
-		WriteMapNodes(driveInfo, (sector + bytesUsed/kBytesPerSector),
-			bytesUsed/btNodeSize, mapNodes, btNodeSize, nodeBuffer);
+		if (mapNodes > 0) {
+			WriteMapNodes(driveInfo, (sector + bytesUsed/kBytesPerSector),
+				bytesUsed/btNodeSize, mapNodes, btNodeSize, nodeBuffer);
+		}
 	}
 
 	/*--- JOURNALING SETUP */
@@ -598,6 +722,12 @@ make_hfsplus(const DriveInfo *driveInfo, hfsparams_t *defaults)
 	/*--- WRITE VOLUME HEADER TO DISK:  */
 
 	/* write header last in case we fail along the way */
+	FlushStagedWrites(driveInfo);
+
+	if (defaults->sourceDirectory) {
+		CopySourceData(driveInfo, header, &tree);
+		FreeSourceTree(&tree);
+	}
 
 	/* Writes both copies of the volume header */
 	WriteVH (driveInfo, header);
@@ -955,9 +1085,10 @@ static int AllocateExtent(UInt8 *buffer, UInt32 startBlock, UInt32 blockCount)
  * where in the allocations file the extent starts, and how
  * long it runs.
  *
- * One downside to this implementation is that this does
- * more I/O than the old mechanism, a cost to the flexibility.
- * May have to consider doing caching of some sort.
+ * While make_hfsplus is staging its writes, the bitmap sectors are
+ * read from and written back to the in-memory map instead of the
+ * device, so only the sectors that end up with bits set are ever
+ * written.
  */
 
 static int
@@ -1014,7 +1145,12 @@ MarkExtentUsed(const DriveInfo *driveInfo,
 		offset = (header->allocationFile.extents[0].startBlock * header->blockSize) +
 			(secNum * bufSize);
 
-		nbytes = pread(driveInfo->fd, buf, bufSize, offset);
+		if (gStaged.active) {
+			StageRead(driveInfo, offset, bufSize, buf);
+			nbytes = bufSize;
+		} else {
+			nbytes = pread(driveInfo->fd, buf, bufSize, offset);
+		}
 
 		if (nbytes < (ssize_t)bufSize) {
 			if (nbytes == -1)
@@ -1026,7 +1162,12 @@ MarkExtentUsed(const DriveInfo *driveInfo,
 			warnx("In-use allocation block in <%u, %u>", blockOffset, numBlocks);
 			goto exit;
 		}
-		nwritten = pwrite(driveInfo->fd, buf, bufSize, offset);
+		if (gStaged.active) {
+			StageWrite(offset, bufSize, buf);
+			nwritten = bufSize;
+		} else {
+			nwritten = pwrite(driveInfo->fd, buf, bufSize, offset);
+		}
 		/*
 		 * Normally I'd check for nwritten to be less than bufSize, but since bufSize is
 		 * the physical sector size, we shouldn't be able to get less.  So that most likely
@@ -1519,6 +1660,35 @@ static void
 WriteCatalogFile(const DriveInfo *driveInfo, UInt64 startingSector,
         const hfsparams_t *dp, HFSPlusVolumeHeader *header, void *buffer,
         UInt32 *bytesUsed, UInt32 *mapNodes)
+{
+	UInt32			nodeSize;
+
+	nodeSize = dp->catalogNodeSize;
+
+	/* Header node, plus a single leaf node that is also the root */
+	InitCatalogHeaderNode(dp, buffer, 1, 1, 1, 1, dp->journaledHFS ? 6 : 2, 2, mapNodes);
+
+	InitCatalogRoot_HFSPlus(dp, header, buffer + nodeSize);
+
+	*bytesUsed = 2 * nodeSize;
+
+	WriteBuffer(driveInfo, startingSector, *bytesUsed, buffer);
+}
+
+
+/*
+ * InitCatalogHeaderNode
+ *
+ * Fill in the catalog B-tree header node.  The tree occupies nodes
+ * 0 (this node) through usedNodes - 1, and any map nodes follow right
+ * after it.  The header's map record marks as many of those nodes in
+ * use as it has bits for; the caller has to mark the rest in the map
+ * nodes.
+ */
+static void
+InitCatalogHeaderNode(const hfsparams_t *dp, void *buffer, UInt16 treeDepth,
+	UInt32 rootNode, UInt32 firstLeafNode, UInt32 lastLeafNode,
+	UInt32 leafRecords, UInt32 usedNodes, UInt32 *mapNodes)
 {
 	BTNodeDescriptor	*ndp;
 	BTHeaderRec		*bthp;
@@ -1547,14 +1717,14 @@ WriteCatalogFile(const DriveInfo *driveInfo, UInt64 startingSector,
 
 	/* FILL IN THE HEADER RECORD:  */
 	bthp = (BTHeaderRec *)((UInt8 *)buffer + offset);
-	bthp->treeDepth		= SWAP_BE16 (1);
-	bthp->rootNode		= SWAP_BE32 (1);
-	bthp->firstLeafNode	= SWAP_BE32 (1);
-	bthp->lastLeafNode	= SWAP_BE32 (1);
-	bthp->leafRecords	= SWAP_BE32 (dp->journaledHFS ? 6 : 2);
+	bthp->treeDepth		= SWAP_BE16 (treeDepth);
+	bthp->rootNode		= SWAP_BE32 (rootNode);
+	bthp->firstLeafNode	= SWAP_BE32 (firstLeafNode);
+	bthp->lastLeafNode	= SWAP_BE32 (lastLeafNode);
+	bthp->leafRecords	= SWAP_BE32 (leafRecords);
 	bthp->nodeSize		= SWAP_BE16 (nodeSize);
 	bthp->totalNodes	= SWAP_BE32 (fileSize / nodeSize);
-	bthp->freeNodes		= SWAP_BE32 (SWAP_BE32 (bthp->totalNodes) - 2);  /* header and root */
+	bthp->freeNodes		= SWAP_BE32 (SWAP_BE32 (bthp->totalNodes) - usedNodes);
 	bthp->clumpSize		= SWAP_BE32 (dp->catalogClumpSize);
 
 
@@ -1583,7 +1753,7 @@ WriteCatalogFile(const DriveInfo *driveInfo, UInt64 startingSector,
 	if (SWAP_BE32 (bthp->totalNodes) > nodeBitsInHeader) {
 		UInt32	nodeBitsInMapNode;
 		
-		ndp->fLink = SWAP_BE32 (SWAP_BE32 (bthp->lastLeafNode) + 1);
+		ndp->fLink = SWAP_BE32 (usedNodes);
 		nodeBitsInMapNode = 8 * (nodeSize
 						- sizeof(BTNodeDescriptor)
 						- (2 * sizeof(SInt16))
@@ -1599,19 +1769,16 @@ WriteCatalogFile(const DriveInfo *driveInfo, UInt64 startingSector,
 	 */
 	bmp = ((UInt8 *)buffer + offset);
 	temp = SWAP_BE32 (bthp->totalNodes) - SWAP_BE32 (bthp->freeNodes);
+	if (temp > nodeBitsInHeader)
+		temp = nodeBitsInHeader;
 
 	/* Working a byte at a time is endian safe */
 	while (temp >= 8) { *bmp = 0xFF; temp -= 8; bmp++; }
-	*bmp = ~(0xFF >> temp);
+	if (temp)
+		*bmp = ~(0xFF >> temp);
 	offset += nodeBitsInHeader/8;
 
 	SETOFFSET(buffer, nodeSize, offset, 4);
-
-	InitCatalogRoot_HFSPlus(dp, header, buffer + nodeSize);
-
-	*bytesUsed = (SWAP_BE32 (bthp->totalNodes) - SWAP_BE32 (bthp->freeNodes) - *mapNodes) * nodeSize;
-
-	WriteBuffer(driveInfo, startingSector, *bytesUsed, buffer);
 }
 
 
@@ -1824,6 +1991,763 @@ InitCatalogRoot_HFSPlus(const hfsparams_t *dp, const HFSPlusVolumeHeader *header
 	}
 }
 
+/* Key order of the volume being built; qsort() has no context argument */
+static int gCatalogCaseSensitive;
+
+static UInt32
+HFSDate(const hfsparams_t *dp, time_t t)
+{
+	if (dp->flags & kMakeExpandedTimes)
+		return (UInt32)t;
+	if (t < 0)
+		return 0;
+	return (UInt32)(t + MAC_GMT_FACTOR);
+}
+
+/*
+ * Append size bytes to the record arena and to the list of records.
+ * The first keySize bytes are the key.  Returns the record (after
+ * the key).
+ */
+static UInt8 *
+AddCatalogRecord(struct SourceTree *tree, const void *key, UInt16 keySize,
+	const void *data, UInt16 dataSize)
+{
+	UInt16 size = keySize + dataSize;
+	UInt8 *p;
+
+	if (tree->arenaChunks == 0 || tree->arenaUsed + size > kCatalogArenaChunkSize) {
+		tree->arena = realloc(tree->arena, (tree->arenaChunks + 1) * sizeof(*tree->arena));
+		if (tree->arena == NULL)
+			err(1, NULL);
+		tree->arena[tree->arenaChunks] = malloc(kCatalogArenaChunkSize);
+		if (tree->arena[tree->arenaChunks] == NULL)
+			err(1, NULL);
+		tree->arenaChunks++;
+		tree->arenaUsed = 0;
+	}
+	p = tree->arena[tree->arenaChunks - 1] + tree->arenaUsed;
+	tree->arenaUsed += size;
+
+	memcpy(p, key, keySize);
+	memcpy(p + keySize, data, dataSize);
+
+	if ((tree->numRecords & 1023) == 0) {
+		tree->records = realloc(tree->records, (tree->numRecords + 1024) * sizeof(*tree->records));
+		if (tree->records == NULL)
+			err(1, NULL);
+	}
+	tree->records[tree->numRecords].key = p;
+	tree->records[tree->numRecords].size = size;
+	tree->numRecords++;
+
+	return p + keySize;
+}
+
+/*
+ * Add the records for one file or folder: the record itself, keyed by
+ * (parent, name), and its thread record, keyed by (cnid, "").
+ */
+static void
+AddSourceNodeRecords(const hfsparams_t *dp, struct SourceTree *tree,
+	struct SourceNode *np, const char *name)
+{
+	struct SourceNode *parent = &tree->nodes[np->parent];
+	UInt8 canonicalName[kHFSPlusMaxFileNameBytes];
+	HFSPlusCatalogKey key;
+	HFSPlusCatalogThread thread;
+	HFSPlusCatalogFolder folder;
+	HFSPlusCatalogFile file;
+	CFStringRef cfstr;
+	Boolean cfOK;
+	size_t unicodeBytes;
+	UInt16 keySize;
+	UInt16 threadSize;
+	const struct stat *st = &np->st;
+
+	bzero(&key, sizeof(key));
+	cfstr = CFStringCreateWithCString(kCFAllocatorDefault, name, kCFStringEncodingUTF8);
+	cfOK = cfstr && _CFStringGetFileSystemRepresentation(cfstr, canonicalName, sizeof(canonicalName));
+	if (cfstr)
+		CFRelease(cfstr);
+	if (!cfOK || ConvertUTF8toUnicode(canonicalName, sizeof(key.nodeName.unicode),
+			key.nodeName.unicode, &key.nodeName.length))
+		errx(1, "%s: invalid HFS+ name", np->path);
+
+	unicodeBytes = sizeof(UniChar) * key.nodeName.length;
+	key.nodeName.length = SWAP_BE16 (key.nodeName.length);
+	key.keyLength = SWAP_BE16 (kHFSPlusCatalogKeyMinimumLength + unicodeBytes);
+	key.parentID = SWAP_BE32 (parent->cnid);
+	keySize = kHFSPlusCatalogKeyMinimumLength + unicodeBytes + sizeof(key.keyLength);
+
+	if (S_ISDIR(st->st_mode)) {
+		bzero(&folder, sizeof(folder));
+		folder.recordType	= SWAP_BE16 (kHFSPlusFolderRecord);
+		folder.folderID		= SWAP_BE32 (np->cnid);
+		folder.createDate	= SWAP_BE32 (HFSDate(dp, st->st_mtime));
+		folder.contentModDate	= SWAP_BE32 (HFSDate(dp, st->st_mtime));
+		folder.attributeModDate	= SWAP_BE32 (HFSDate(dp, st->st_ctime));
+		folder.accessDate	= SWAP_BE32 (HFSDate(dp, st->st_atime));
+		folder.bsdInfo.ownerID	= SWAP_BE32 (st->st_uid);
+		folder.bsdInfo.groupID	= SWAP_BE32 (st->st_gid);
+		folder.bsdInfo.fileMode	= SWAP_BE16 (st->st_mode);
+		/* valence and folderCount are filled in once the scan is done */
+		np->record = AddCatalogRecord(tree, &key, keySize, &folder, sizeof(folder));
+		thread.recordType = SWAP_BE16 (kHFSPlusFolderThreadRecord);
+	} else {
+		bzero(&file, sizeof(file));
+		file.recordType		= SWAP_BE16 (kHFSPlusFileRecord);
+		file.flags		= SWAP_BE16 (kHFSThreadExistsMask);
+		file.fileID		= SWAP_BE32 (np->cnid);
+		file.createDate		= SWAP_BE32 (HFSDate(dp, st->st_mtime));
+		file.contentModDate	= SWAP_BE32 (HFSDate(dp, st->st_mtime));
+		file.attributeModDate	= SWAP_BE32 (HFSDate(dp, st->st_ctime));
+		file.accessDate		= SWAP_BE32 (HFSDate(dp, st->st_atime));
+		file.bsdInfo.ownerID	= SWAP_BE32 (st->st_uid);
+		file.bsdInfo.groupID	= SWAP_BE32 (st->st_gid);
+		file.bsdInfo.fileMode	= SWAP_BE16 (st->st_mode);
+		if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode))
+			file.bsdInfo.special.rawDevice = SWAP_BE32 (st->st_rdev);
+		else
+			file.bsdInfo.special.linkCount = SWAP_BE32 (1);
+		if (S_ISLNK(st->st_mode)) {
+			file.userInfo.fdType	= SWAP_BE32 (kSymLinkFileType);
+			file.userInfo.fdCreator	= SWAP_BE32 (kSymLinkCreator);
+		}
+		/* the extent is filled in once the volume is laid out */
+		file.dataFork.logicalSize = SWAP_BE64 (st->st_size);
+		file.dataFork.totalBlocks = SWAP_BE32 (np->blockCount);
+		np->record = AddCatalogRecord(tree, &key, keySize, &file, sizeof(file));
+		thread.recordType = SWAP_BE16 (kHFSPlusFileThreadRecord);
+	}
+
+	thread.reserved = 0;
+	thread.parentID = key.parentID;
+	bcopy(&key.nodeName, &thread.nodeName, sizeof(UInt16) + unicodeBytes);
+	threadSize = sizeof(HFSPlusCatalogThread) - (sizeof(thread.nodeName.unicode) - unicodeBytes);
+
+	key.keyLength = SWAP_BE16 (kHFSPlusCatalogKeyMinimumLength);
+	key.parentID = SWAP_BE32 (np->cnid);
+	key.nodeName.length = 0;
+	(void) AddCatalogRecord(tree, &key, kHFSPlusCatalogKeyMinimumLength + sizeof(key.keyLength),
+				&thread, threadSize);
+}
+
+static int
+CompareSourceNames(const FTSENT **a, const FTSENT **b)
+{
+	return strcmp((*a)->fts_name, (*b)->fts_name);
+}
+
+/*
+ * ScanSourceTree
+ *
+ * Walk dp->sourceDirectory, assign catalog node IDs in walk order and
+ * build every catalog record except the ones InitCatalogRoot_HFSPlus
+ * makes.  The data fork sizes are known after this, the extents are
+ * not.
+ */
+static void
+ScanSourceTree(const hfsparams_t *dp, struct SourceTree *tree)
+{
+	char *paths[2] = { dp->sourceDirectory, NULL };
+	FTS *fts;
+	FTSENT *ent;
+	UInt32 i;
+
+	bzero(tree, sizeof(*tree));
+	tree->nextCNID = dp->nextFreeFileID + (dp->journaledHFS ? 2 : 0);
+
+	fts = fts_open(paths, FTS_PHYSICAL | FTS_COMFOLLOW | FTS_NOCHDIR, CompareSourceNames);
+	if (fts == NULL)
+		err(1, "%s", dp->sourceDirectory);
+
+	for (;;) {
+		struct SourceNode *np;
+
+		errno = 0;
+		if ((ent = fts_read(fts)) == NULL) {
+			if (errno != 0)
+				err(1, "%s", dp->sourceDirectory);
+			break;
+		}
+
+		switch (ent->fts_info) {
+		case FTS_DP:
+			continue;
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			errc(1, ent->fts_errno, "%s", ent->fts_path);
+		case FTS_D:
+			break;
+		default:
+			if (ent->fts_level == FTS_ROOTLEVEL)
+				errx(1, "%s: not a directory", ent->fts_path);
+			break;
+		}
+
+		if (S_ISSOCK(ent->fts_statp->st_mode)) {
+			warnx("%s: sockets can't be copied, skipping", ent->fts_path);
+			continue;
+		}
+
+		if ((tree->numNodes & 1023) == 0) {
+			tree->nodes = realloc(tree->nodes, (tree->numNodes + 1024) * sizeof(*tree->nodes));
+			if (tree->nodes == NULL)
+				err(1, NULL);
+		}
+		np = &tree->nodes[tree->numNodes];
+		bzero(np, sizeof(*np));
+		np->st = *ent->fts_statp;
+		ent->fts_number = tree->numNodes++;
+
+		if (ent->fts_level == FTS_ROOTLEVEL) {
+			np->cnid = kHFSRootFolderID;
+			continue;
+		}
+
+		if (tree->nextCNID == 0)
+			errx(1, "%s: too many files and folders", ent->fts_path);
+		np->cnid = tree->nextCNID++;
+		np->parent = (UInt32)ent->fts_parent->fts_number;
+		if ((np->path = strdup(ent->fts_path)) == NULL)
+			err(1, NULL);
+
+		tree->nodes[np->parent].valence++;
+		if (S_ISDIR(np->st.st_mode)) {
+			tree->nodes[np->parent].folderCount++;
+			tree->numFolders++;
+		} else {
+			if (S_ISREG(np->st.st_mode) || S_ISLNK(np->st.st_mode)) {
+				if ((UInt64)np->st.st_size / dp->blockSize >= UINT32_MAX)
+					errx(1, "%s: file is too large", np->path);
+				np->blockCount = (UInt32)howmany(np->st.st_size, dp->blockSize);
+			} else {
+				/* devices and fifos have no data */
+				np->st.st_size = 0;
+			}
+			tree->dataBlocks += np->blockCount;
+			tree->numFiles++;
+		}
+
+		AddSourceNodeRecords(dp, tree, np, ent->fts_name);
+	}
+	fts_close(fts);
+
+	/* Now that every child has been seen, fill in the folder counts */
+	for (i = 1; i < tree->numNodes; i++) {
+		struct SourceNode *np = &tree->nodes[i];
+		HFSPlusCatalogFolder *folder;
+
+		if (!S_ISDIR(np->st.st_mode))
+			continue;
+		folder = (HFSPlusCatalogFolder *)np->record;
+		folder->valence = SWAP_BE32 (np->valence);
+		if (dp->flags & kMakeCaseSensitive) {
+			folder->flags = SWAP_BE16 (kHFSHasFolderCountMask);
+			folder->folderCount = SWAP_BE32 (np->folderCount);
+		}
+	}
+}
+
+/*
+ * Compare two on-disk (big endian) catalog keys the way the volume
+ * will: by parent ID, then by name, case-folded (FastUnicodeCompare)
+ * on HFS+ and binary on HFSX.
+ */
+static int
+CompareCatalogRecords(const void *a, const void *b)
+{
+	const HFSPlusCatalogKey *k1 = (const HFSPlusCatalogKey *)((const struct CatalogRecordRef *)a)->key;
+	const HFSPlusCatalogKey *k2 = (const HFSPlusCatalogKey *)((const struct CatalogRecordRef *)b)->key;
+	UInt32 p1 = SWAP_BE32 (k1->parentID);
+	UInt32 p2 = SWAP_BE32 (k2->parentID);
+	const UniChar *str1 = k1->nodeName.unicode;
+	const UniChar *str2 = k2->nodeName.unicode;
+	UInt16 length1 = SWAP_BE16 (k1->nodeName.length);
+	UInt16 length2 = SWAP_BE16 (k2->nodeName.length);
+	UInt16 c1, c2, temp;
+
+	if (p1 != p2)
+		return (p1 < p2) ? -1 : 1;
+
+	if (gCatalogCaseSensitive) {
+		UInt16 length = MIN(length1, length2);
+
+		while (length--) {
+			c1 = SWAP_BE16 (*str1++);
+			c2 = SWAP_BE16 (*str2++);
+			if (c1 != c2)
+				return (c1 < c2) ? -1 : 1;
+		}
+		return (int)length1 - (int)length2;
+	}
+
+	if (length1 == 0 || length2 == 0)
+		return (int)length1 - (int)length2;
+
+	while (1) {
+		c1 = 0;
+		c2 = 0;
+		while (length1 && c1 == 0) {
+			c1 = SWAP_BE16 (*str1++);
+			--length1;
+			if ((temp = gLowerCaseTable[c1>>8]) != 0)
+				c1 = gLowerCaseTable[temp + (c1 & 0x00FF)];
+		}
+		while (length2 && c2 == 0) {
+			c2 = SWAP_BE16 (*str2++);
+			--length2;
+			if ((temp = gLowerCaseTable[c2>>8]) != 0)
+				c2 = gLowerCaseTable[temp + (c2 & 0x00FF)];
+		}
+		if (c1 != c2)
+			return (c1 < c2) ? -1 : 1;
+		if (c1 == 0)
+			return 0;
+	}
+}
+
+/*
+ * PackBTreeLevel
+ *
+ * Pack records, in order, into as few nodes as possible, starting at
+ * node number firstNode.  The nodes are linked to each other but not
+ * to any other level.  Returns the number of nodes; with nodes == NULL
+ * nothing is written and only the count is computed.
+ *
+ * firstKeys[i] is set to the key of the first record in the i-th node.
+ * Index records point their key at the first key of the child, so the
+ * first keys of every level are really leaf keys.
+ */
+static UInt32
+PackBTreeLevel(UInt8 *nodes, UInt32 firstNode, UInt16 nodeSize, SInt8 kind,
+	UInt8 height, const struct CatalogRecordRef *records, const UInt32 *childNodes,
+	UInt32 numRecords, UInt8 **firstKeys)
+{
+	BTNodeDescriptor *ndp = NULL;
+	UInt8 *node = NULL;
+	UInt32 numNodes = 0;
+	UInt32 used = 0;
+	UInt16 count = 0;
+	UInt32 i;
+
+	for (i = 0; i < numRecords; i++) {
+		const struct CatalogRecordRef *r = &records[i];
+		UInt16 keySize = SWAP_BE16 (*(UInt16 *)r->key) + sizeof(UInt16);
+		UInt16 size = childNodes ? keySize + sizeof(UInt32) : r->size;
+
+		/* The record, plus its offset and the free space offset */
+		if (numNodes == 0 || used + size + sizeof(SInt16) * (count + 2) > nodeSize) {
+			if (node) {
+				SETOFFSET(node, nodeSize, used, count + 1);
+				ndp->numRecords = SWAP_BE16 (count);
+				ndp->fLink = SWAP_BE32 (firstNode + numNodes);
+			}
+			if (nodes) {
+				node = nodes + (size_t)numNodes * nodeSize;
+				ndp = (BTNodeDescriptor *)node;
+				bzero(node, nodeSize);
+				ndp->kind = kind;
+				ndp->height = height;
+				if (numNodes > 0)
+					ndp->bLink = SWAP_BE32 (firstNode + numNodes - 1);
+			}
+			if (firstKeys)
+				firstKeys[numNodes] = r->key;
+			numNodes++;
+			used = sizeof(BTNodeDescriptor);
+			count = 0;
+		}
+
+		if (node) {
+			SETOFFSET(node, nodeSize, used, count + 1);
+			if (childNodes) {
+				UInt32 child = SWAP_BE32 (childNodes[i]);
+
+				memcpy(node + used, r->key, keySize);
+				memcpy(node + used + keySize, &child, sizeof(child));
+			} else {
+				memcpy(node + used, r->key, size);
+			}
+		}
+		used += size;
+		count++;
+	}
+	if (node) {
+		SETOFFSET(node, nodeSize, used, count + 1);
+		ndp->numRecords = SWAP_BE16 (count);
+	}
+
+	return numNodes;
+}
+
+/*
+ * BuildCatalogTree
+ *
+ * Bulk load the sorted catalog records: leaves from node 1 on, then
+ * the index levels above them, with the root last.  With nodes == NULL
+ * only the number of nodes is computed.  Returns the number of nodes
+ * including the header node.
+ */
+static UInt32
+BuildCatalogTree(const hfsparams_t *dp, struct SourceTree *tree, UInt8 *nodes,
+	UInt16 *treeDepth, UInt32 *rootNode, UInt32 *lastLeafNode)
+{
+	UInt16 nodeSize = dp->catalogNodeSize;
+	struct CatalogRecordRef *level;
+	UInt8 **firstKeys;
+	UInt32 *childNodes;
+	UInt32 levelStart = 1;
+	UInt32 levelNodes;
+	UInt8 height = 1;
+	UInt32 i;
+
+	firstKeys = malloc(tree->numRecords * sizeof(*firstKeys));
+	if (firstKeys == NULL)
+		err(1, NULL);
+	levelNodes = PackBTreeLevel(nodes ? nodes + nodeSize : NULL, levelStart, nodeSize,
+				    kBTLeafNode, height, tree->records, NULL, tree->numRecords, firstKeys);
+	*lastLeafNode = levelNodes;
+
+	level = malloc(levelNodes * sizeof(*level));
+	childNodes = malloc(levelNodes * sizeof(*childNodes));
+	if (level == NULL || childNodes == NULL)
+		err(1, NULL);
+
+	while (levelNodes > 1) {
+		UInt32 next = levelStart + levelNodes;
+
+		for (i = 0; i < levelNodes; i++) {
+			level[i].key = firstKeys[i];
+			level[i].size = 0;
+			childNodes[i] = levelStart + i;
+		}
+		levelNodes = PackBTreeLevel(nodes ? nodes + (size_t)next * nodeSize : NULL, next, nodeSize,
+					    kBTIndexNode, ++height, level, childNodes, levelNodes, firstKeys);
+		levelStart = next;
+	}
+
+	*treeDepth = height;
+	*rootNode = levelStart;
+
+	free(childNodes);
+	free(level);
+	free(firstKeys);
+
+	return levelStart + 1;
+}
+
+/*
+ * PrepareSourceTree
+ *
+ * Called before the volume header is laid out.  Scans the source
+ * tree, adds the root folder and journal records, sorts everything
+ * and grows the initial catalog file so the whole tree fits.
+ */
+static void
+PrepareSourceTree(hfsparams_t *dp, struct SourceTree *tree)
+{
+	HFSPlusVolumeHeader header;
+	UInt16 nodeSize = dp->catalogNodeSize;
+	UInt32 rootNode, lastLeafNode;
+	UInt16 depth;
+	UInt64 catalogSize;
+	UInt8 *node;
+	UInt16 numRecords;
+	UInt32 i;
+
+	ScanSourceTree(dp, tree);
+
+	/*
+	 * The root folder, its thread and the journal files are made by
+	 * InitCatalogRoot_HFSPlus.  Their contents depend on the layout,
+	 * so the records are copied in now only to be sorted and sized;
+	 * FinishSourceTree copies them again once the layout is known.
+	 */
+	node = valloc(nodeSize);
+	if (node == NULL)
+		err(1, NULL);
+	bzero(&header, sizeof(header));
+	InitCatalogRoot_HFSPlus(dp, &header, node);
+	numRecords = SWAP_BE16 (((BTNodeDescriptor *)node)->numRecords);
+	for (i = 0; i < numRecords; i++) {
+		UInt16 start = SWAP_BE16 (*(UInt16 *)(node + nodeSize - 2 * (i + 1)));
+		UInt16 end = SWAP_BE16 (*(UInt16 *)(node + nodeSize - 2 * (i + 2)));
+		UInt16 keySize = SWAP_BE16 (*(UInt16 *)(node + start)) + sizeof(UInt16);
+
+		(void) AddCatalogRecord(tree, node + start, keySize, node + start + keySize, end - start - keySize);
+	}
+	free(node);
+
+	/* Remember where they are; the sort below moves the references around */
+	tree->rootRecords = numRecords;
+	tree->rootRecordKeys = malloc(numRecords * sizeof(*tree->rootRecordKeys));
+	if (tree->rootRecordKeys == NULL)
+		err(1, NULL);
+	for (i = 0; i < numRecords; i++)
+		tree->rootRecordKeys[i] = tree->records[tree->numRecords - numRecords + i].key;
+
+	gCatalogCaseSensitive = (dp->flags & kMakeCaseSensitive) != 0;
+	qsort(tree->records, tree->numRecords, sizeof(*tree->records), CompareCatalogRecords);
+	for (i = 1; i < tree->numRecords; i++) {
+		if (CompareCatalogRecords(&tree->records[i - 1], &tree->records[i]) == 0)
+			errx(1, "%s: names in one folder differ only in case; "
+			     "use -s for a case-sensitive volume", dp->sourceDirectory);
+	}
+
+	tree->usedNodes = BuildCatalogTree(dp, tree, NULL, &depth, &rootNode, &lastLeafNode);
+
+	/*
+	 * Leave room for the map nodes (one per 8 * nodeSize nodes, well
+	 * under 1/64th) and let the catalog grow by a clump before the
+	 * first insert has to extend it.
+	 */
+	catalogSize = ((UInt64)tree->usedNodes + tree->usedNodes / 64 + 1) * nodeSize;
+	catalogSize = ROUNDUP(catalogSize, dp->catalogClumpSize) + dp->catalogClumpSize;
+	if (catalogSize > UINT32_MAX)
+		errx(1, "%s: catalog would be too large", dp->sourceDirectory);
+	if (catalogSize > dp->catalogInitialSize)
+		dp->catalogInitialSize = (UInt32)catalogSize;
+}
+
+/*
+ * FinishSourceTree
+ *
+ * Called once the volume header is laid out.  Places the file data
+ * right after the metadata, fills in the extents and the root records,
+ * and accounts for it all in the volume header and the bitmap.
+ */
+static void
+FinishSourceTree(const DriveInfo *driveInfo, const hfsparams_t *dp,
+	HFSPlusVolumeHeader *header, struct SourceTree *tree)
+{
+	UInt16 nodeSize = dp->catalogNodeSize;
+	UInt32 nextBlock = header->nextAllocation;
+	UInt32 lastBlock;
+	UInt8 *node;
+	UInt16 numRecords;
+	UInt32 i;
+
+	/* The alternate volume header takes the last block (two, for 512 byte blocks) */
+	lastBlock = header->totalBlocks - ((header->blockSize == 512) ? 2 : 1);
+	if (nextBlock > lastBlock || tree->dataBlocks > lastBlock - nextBlock)
+		errx(1, "%s: does not fit on the volume", dp->sourceDirectory);
+
+	for (i = 1; i < tree->numNodes; i++) {
+		struct SourceNode *np = &tree->nodes[i];
+		HFSPlusCatalogFile *file;
+
+		if (S_ISDIR(np->st.st_mode) || np->blockCount == 0)
+			continue;
+		file = (HFSPlusCatalogFile *)np->record;
+		np->startBlock = nextBlock;
+		file->dataFork.extents[0].startBlock = SWAP_BE32 (np->startBlock);
+		file->dataFork.extents[0].blockCount = SWAP_BE32 (np->blockCount);
+		nextBlock += np->blockCount;
+	}
+	if (tree->dataBlocks) {
+		if (MarkExtentUsed(driveInfo, header, header->nextAllocation, (UInt32)tree->dataBlocks) == -1) {
+			errx(1, "Overlapped extent for file data at <%u, %u>\n", header->nextAllocation, (UInt32)tree->dataBlocks);
+		}
+		header->freeBlocks -= (UInt32)tree->dataBlocks;
+		header->nextAllocation = nextBlock;
+	}
+	header->fileCount += tree->numFiles;
+	header->folderCount += tree->numFolders;
+	header->nextCatalogID = tree->nextCNID;
+
+	/* Now the root records can be made for real; they come out the same size */
+	node = valloc(nodeSize);
+	if (node == NULL)
+		err(1, NULL);
+	InitCatalogRoot_HFSPlus(dp, header, node);
+	numRecords = SWAP_BE16 (((BTNodeDescriptor *)node)->numRecords);
+	for (i = 0; i < numRecords && i < tree->rootRecords; i++) {
+		UInt16 start = SWAP_BE16 (*(UInt16 *)(node + nodeSize - 2 * (i + 1)));
+		UInt16 end = SWAP_BE16 (*(UInt16 *)(node + nodeSize - 2 * (i + 2)));
+		HFSPlusCatalogKey *key = (HFSPlusCatalogKey *)tree->rootRecordKeys[i];
+		HFSPlusCatalogFolder *folder;
+
+		memcpy(key, node + start, end - start);
+		if (SWAP_BE32 (key->parentID) != kHFSRootParentID)
+			continue;
+
+		folder = (HFSPlusCatalogFolder *)((UInt8 *)key + SWAP_BE16 (key->keyLength) + sizeof(UInt16));
+		folder->valence = SWAP_BE32 (SWAP_BE32 (folder->valence) + tree->nodes[0].valence);
+		if (dp->flags & kMakeCaseSensitive)
+			folder->folderCount = SWAP_BE32 (tree->nodes[0].folderCount);
+	}
+	free(node);
+}
+
+/*
+ * WriteCatalogTree
+ *
+ * The -R counterpart of WriteCatalogFile: builds the whole catalog,
+ * header, leaf, index and map nodes, and writes it in one go.
+ */
+static void
+WriteCatalogTree(const DriveInfo *driveInfo, UInt64 startingSector,
+	const hfsparams_t *dp, struct SourceTree *tree)
+{
+	UInt16 nodeSize = dp->catalogNodeSize;
+	UInt32 totalNodes = dp->catalogInitialSize / nodeSize;
+	UInt32 nodeBitsInHeader;
+	UInt32 mapRecordBytes;
+	UInt32 usedNodes, mapNodes, rootNode, lastLeafNode;
+	UInt16 treeDepth;
+	UInt32 i;
+	UInt8 *nodes;
+
+	nodeBitsInHeader = 8 * (nodeSize - sizeof(BTNodeDescriptor) - sizeof(BTHeaderRec)
+				- kBTreeHeaderUserBytes - (4 * sizeof(SInt16)));
+	mapRecordBytes = nodeSize - sizeof(BTNodeDescriptor) - 2 * sizeof(SInt16) - 2;
+
+	nodes = calloc((size_t)tree->usedNodes + totalNodes / (8 * mapRecordBytes) + 1, nodeSize);
+	if (nodes == NULL)
+		err(1, NULL);
+
+	usedNodes = BuildCatalogTree(dp, tree, nodes, &treeDepth, &rootNode, &lastLeafNode);
+	InitCatalogHeaderNode(dp, nodes, treeDepth, rootNode, 1, lastLeafNode,
+			      tree->numRecords, usedNodes, &mapNodes);
+	if (usedNodes + mapNodes > totalNodes)
+		errx(1, "catalog B-tree needs %u nodes, only %u allocated", usedNodes + mapNodes, totalNodes);
+
+	/* Map nodes, as WriteMapNodes makes them, with the rest of the in-use bits */
+	for (i = 0; i < mapNodes; i++) {
+		UInt8 *node = nodes + (size_t)(usedNodes + i) * nodeSize;
+		BTNodeDescriptor *nd = (BTNodeDescriptor *)node;
+
+		nd->kind = kBTMapNode;
+		nd->numRecords = SWAP_BE16 (1);
+		nd->fLink = (i + 1 < mapNodes) ? SWAP_BE32 (usedNodes + i + 1) : 0;
+		SETOFFSET(node, nodeSize, sizeof(BTNodeDescriptor), 1);
+		SETOFFSET(node, nodeSize, sizeof(BTNodeDescriptor) + mapRecordBytes, 2);
+	}
+	for (i = nodeBitsInHeader; i < usedNodes + mapNodes; i++) {
+		UInt32 bit = i - nodeBitsInHeader;
+		UInt8 *node = nodes + (size_t)(usedNodes + bit / (8 * mapRecordBytes)) * nodeSize;
+
+		bit %= 8 * mapRecordBytes;
+		node[sizeof(BTNodeDescriptor) + bit / 8] |= 0x80 >> (bit % 8);
+	}
+
+	WriteBuffer(driveInfo, startingSector, (UInt64)(usedNodes + mapNodes) * nodeSize, nodes);
+	free(nodes);
+}
+
+/*
+ * CopySourceData
+ *
+ * Copy the file data into the blocks FinishSourceTree gave it, and
+ * zero the rest of each file's last block.  This runs after the staged
+ * metadata has been flushed, so it goes straight to the device.
+ */
+static void
+CopySourceData(const DriveInfo *driveInfo, const HFSPlusVolumeHeader *header,
+	struct SourceTree *tree)
+{
+	UInt32 sectorsPerBlock = header->blockSize / kBytesPerSector;
+	size_t bufSize = ROUNDUP(kSourceCopyChunkSize, header->blockSize);
+	UInt8 *buf;
+	UInt32 i;
+
+	buf = valloc(bufSize);
+	if (buf == NULL)
+		err(1, NULL);
+
+	for (i = 1; i < tree->numNodes; i++) {
+		struct SourceNode *np = &tree->nodes[i];
+		UInt64 sector = (UInt64)np->startBlock * sectorsPerBlock;
+		off_t size = np->st.st_size;
+		off_t copied = 0;
+		int fd;
+
+		if (S_ISDIR(np->st.st_mode) || np->blockCount == 0)
+			continue;
+
+		if (S_ISLNK(np->st.st_mode)) {
+			size_t linkBytes = (size_t)np->blockCount * header->blockSize;
+
+			/* A link target is at most MAXPATHLEN, far below bufSize */
+			if (linkBytes > bufSize)
+				errx(1, "%s: symbolic link too long", np->path);
+			bzero(buf, linkBytes);
+			if (readlink(np->path, (char *)buf, linkBytes) != size)
+				err(1, "%s", np->path);
+			WriteBuffer(driveInfo, sector, linkBytes, buf);
+			continue;
+		}
+
+		if ((fd = open(np->path, O_RDONLY)) < 0)
+			err(1, "%s", np->path);
+
+#if defined(__linux__)
+		/* Let the kernel move the data (or share the extents) when it can */
+		{
+			loff_t dst = ((loff_t)driveInfo->sectorOffset + sector) * kBytesPerSector;
+			ssize_t n;
+
+			while (copied < size) {
+				n = copy_file_range(fd, NULL, driveInfo->fd, &dst, (size_t)(size - copied), 0);
+				if (n <= 0)
+					break;
+				copied += n;
+			}
+			if (copied == size) {
+				size_t tail = (size_t)((off_t)np->blockCount * header->blockSize - size);
+
+				bzero(buf, tail);
+				if (tail && pwrite(driveInfo->fd, buf, tail, dst) != (ssize_t)tail)
+					err(1, "write (offset %lld)", (long long)dst);
+			} else {
+				copied = 0;
+			}
+		}
+#endif
+		while (copied < size) {
+			size_t want = (size_t)MIN((off_t)bufSize, size - copied);
+			size_t got = 0;
+			size_t len;
+			ssize_t n;
+
+			while (got < want) {
+				n = pread(fd, buf + got, want - got, copied + got);
+				if (n < 0)
+					err(1, "%s", np->path);
+				if (n == 0)
+					errx(1, "%s: file shrank while being copied", np->path);
+				got += n;
+			}
+			/* The last chunk is padded out to the end of its block */
+			len = ROUNDUP(got, header->blockSize);
+			bzero(buf + got, len - got);
+			WriteBuffer(driveInfo, sector + copied / kBytesPerSector, len, buf);
+			copied += got;
+		}
+		close(fd);
+	}
+	free(buf);
+}
+
+static void
+FreeSourceTree(struct SourceTree *tree)
+{
+	UInt32 i;
+
+	for (i = 0; i < tree->numNodes; i++)
+		free(tree->nodes[i].path);
+	for (i = 0; i < tree->arenaChunks; i++)
+		free(tree->arena[i]);
+	free(tree->arena);
+	free(tree->records);
+	free(tree->rootRecordKeys);
+	free(tree->nodes);
+	bzero(tree, sizeof(*tree));
+}
+
 /*
  * WriteMapNodes
  *	
@@ -1868,6 +2792,381 @@ WriteMapNodes(const DriveInfo *driveInfo, UInt64 diskStart, UInt32 firstMapNode,
 	}
 }
 
+/*
+ * StageBegin
+ *
+ * Start staging writes.  From here until FlushStagedWrites, WriteBuffer
+ * and MarkExtentUsed don't do any I/O; they record what they would have
+ * written in gStaged, a later write replacing whatever part of an earlier
+ * one it overlaps.  This turns the dozens of small read-modify-write
+ * cycles of a format into a handful of large writes, and lets the big
+ * zero ranges (the bitmap, the journal, the unused B-tree nodes) be
+ * cleared without pushing zeros through the I/O path.
+ */
+static void
+StageBegin(void)
+{
+	bzero(&gStaged, sizeof(gStaged));
+	gStaged.active = 1;
+}
+
+/*
+ * StageWrite
+ *
+ * Record a write of length bytes at device byte offset.  If data is
+ * NULL the range is to be zeroed.  The data is copied.
+ */
+static void
+StageWrite(off_t offset, off_t length, const void *data)
+{
+	struct StagedRegion *regions;
+	void **buffers;
+	size_t i, n;
+	off_t end = offset + length;
+	UInt8 *copy = NULL;
+	int inserted = 0;
+
+	if (length <= 0)
+		return;
+
+	if (data != NULL) {
+		copy = malloc((size_t)length);
+		if (copy == NULL)
+			err(1, NULL);
+		memcpy(copy, data, (size_t)length);
+
+		buffers = realloc(gStaged.buffers, (gStaged.numBuffers + 1) * sizeof(*buffers));
+		if (buffers == NULL)
+			err(1, NULL);
+		gStaged.buffers = buffers;
+		gStaged.buffers[gStaged.numBuffers++] = copy;
+	}
+
+	/*
+	 * Rebuild the list: the new region, plus whatever is left of the
+	 * existing regions outside of it.  At most one region is split in
+	 * two, so the list grows by at most two entries.
+	 */
+	regions = malloc((gStaged.count + 2) * sizeof(*regions));
+	if (regions == NULL)
+		err(1, NULL);
+
+#define ADD_REGION(o, l, d)			\
+	do {					\
+		regions[n].offset = (o);	\
+		regions[n].length = (l);	\
+		regions[n].data = (d);		\
+		n++;				\
+	} while (0)
+
+	for (i = 0, n = 0; i < gStaged.count; i++) {
+		struct StagedRegion *r = &gStaged.regions[i];
+		off_t rend = r->offset + r->length;
+
+		if (rend <= offset) {
+			regions[n++] = *r;
+			continue;
+		}
+		if (r->offset < offset)
+			ADD_REGION(r->offset, offset - r->offset, r->data);
+		if (!inserted) {
+			ADD_REGION(offset, length, copy);
+			inserted = 1;
+		}
+		if (r->offset >= end)
+			regions[n++] = *r;
+		else if (rend > end)
+			ADD_REGION(end, rend - end, r->data ? r->data + (end - r->offset) : NULL);
+	}
+	if (!inserted)
+		ADD_REGION(offset, length, copy);
+#undef ADD_REGION
+
+	free(gStaged.regions);
+	gStaged.regions = regions;
+	gStaged.count = n;
+}
+
+/*
+ * StageRead
+ *
+ * Read length bytes at device byte offset as they will be once the
+ * staged writes are flushed.  Parts nobody has written come from the
+ * device.
+ */
+static void
+StageRead(const DriveInfo *driveInfo, off_t offset, off_t length, void *buffer)
+{
+	UInt8 *dst = buffer;
+	off_t pos = offset;
+	off_t end = offset + length;
+	off_t amt;
+	size_t i;
+
+	for (i = 0; i < gStaged.count && pos < end; i++) {
+		struct StagedRegion *r = &gStaged.regions[i];
+		off_t rend = r->offset + r->length;
+
+		if (rend <= pos)
+			continue;
+		if (r->offset >= end)
+			break;
+		if (r->offset > pos) {
+			amt = r->offset - pos;
+			ReadDeviceRange(driveInfo, pos, amt, dst);
+			dst += amt;
+			pos += amt;
+		}
+		amt = MIN(rend, end) - pos;
+		if (r->data)
+			memcpy(dst, r->data + (pos - r->offset), (size_t)amt);
+		else
+			bzero(dst, (size_t)amt);
+		dst += amt;
+		pos += amt;
+	}
+	if (pos < end)
+		ReadDeviceRange(driveInfo, pos, end - pos, dst);
+}
+
+/*
+ * FlushStagedWrites
+ *
+ * Write out everything staged since StageBegin and stop staging.
+ *
+ * Every data region is widened to physical sector boundaries, and
+ * overlapping or adjacent ones are merged into runs; each run is then
+ * assembled in one buffer and written with a single pwrite.  What is
+ * left of the zero regions (whole physical sectors only, since partial
+ * ones were folded into the runs) goes to ZeroDeviceRange.
+ */
+static void
+FlushStagedWrites(const DriveInfo *driveInfo)
+{
+	off_t phys = driveInfo->physSectorSize;
+	struct StagedRange *runs;
+	struct StagedRange *zeros;
+	size_t numRuns = 0;
+	size_t numZeros = 0;
+	size_t i, j, k;
+
+	runs = malloc((3 * gStaged.count + 1) * sizeof(*runs));
+	if (runs == NULL)
+		err(1, NULL);
+
+	/*
+	 * The regions are sorted, so the runs come out sorted by start
+	 * and only ever need to be merged with the previous one.
+	 */
+#define ADD_RANGE(a, n, s, e)					\
+	do {							\
+		if ((n) > 0 && (s) <= (a)[(n) - 1].end) {	\
+			(a)[(n) - 1].end = MAX((a)[(n) - 1].end, (e)); \
+		} else {					\
+			(a)[(n)].offset = (s);			\
+			(a)[(n)].end = (e);			\
+			(n)++;					\
+		}						\
+	} while (0)
+
+	for (i = 0; i < gStaged.count; i++) {
+		struct StagedRegion *r = &gStaged.regions[i];
+		off_t start = r->offset - (r->offset % phys);
+		off_t end = r->offset + r->length;
+		off_t endSector = end - (end % phys);
+
+		if (r->data) {
+			ADD_RANGE(runs, numRuns, start, roundup(end, phys));
+		} else {
+			if (start != r->offset)
+				ADD_RANGE(runs, numRuns, start, start + phys);
+			if (endSector != end)
+				ADD_RANGE(runs, numRuns, endSector, endSector + phys);
+		}
+	}
+
+	zeros = malloc((gStaged.count + numRuns + 1) * sizeof(*zeros));
+	if (zeros == NULL)
+		err(1, NULL);
+
+	for (i = 0, j = 0; i < gStaged.count; i++) {
+		struct StagedRegion *r = &gStaged.regions[i];
+		off_t start = roundup(r->offset, phys);
+		off_t end = r->offset + r->length;
+		off_t pos;
+
+		end -= end % phys;
+		if (r->data || start >= end)
+			continue;
+
+		while (j < numRuns && runs[j].end <= start)
+			j++;
+		for (k = j, pos = start; k < numRuns && runs[k].offset < end; k++) {
+			if (runs[k].offset > pos)
+				ADD_RANGE(zeros, numZeros, pos, runs[k].offset);
+			pos = MAX(pos, runs[k].end);
+		}
+		if (pos < end)
+			ADD_RANGE(zeros, numZeros, pos, end);
+	}
+#undef ADD_RANGE
+
+	for (i = 0; i < numZeros; i++)
+		ZeroDeviceRange(driveInfo, zeros[i].offset, zeros[i].end - zeros[i].offset);
+
+	for (i = 0; i < numRuns; i++) {
+		size_t len = (size_t)(runs[i].end - runs[i].offset);
+		size_t done = 0;
+		ssize_t nwritten;
+		UInt8 *buf;
+
+		buf = valloc(len);
+		if (buf == NULL)
+			err(1, NULL);
+		StageRead(driveInfo, runs[i].offset, (off_t)len, buf);
+
+		while (done < len) {
+			nwritten = pwrite(driveInfo->fd, buf + done, len - done, runs[i].offset + done);
+			if (nwritten <= 0)
+				err(1, "write (offset %lld)", (long long)(runs[i].offset + done));
+			done += nwritten;
+		}
+		free(buf);
+	}
+
+	for (i = 0; i < gStaged.numBuffers; i++)
+		free(gStaged.buffers[i]);
+	free(gStaged.buffers);
+	free(gStaged.regions);
+	free(zeros);
+	free(runs);
+	bzero(&gStaged, sizeof(gStaged));
+}
+
+/*
+ * ReadDeviceRange
+ *
+ * pread() that doesn't need to be sector aligned.  Anything past the end
+ * of the device (or image file) reads as zeros.
+ */
+static void
+ReadDeviceRange(const DriveInfo *driveInfo, off_t offset, off_t length, void *buffer)
+{
+	off_t phys = driveInfo->physSectorSize;
+	off_t start = offset - (offset % phys);
+	size_t len = (size_t)(roundup(offset + length, phys) - start);
+	ssize_t nbytes;
+	UInt8 *buf;
+
+	buf = valloc(len);
+	if (buf == NULL)
+		err(1, NULL);
+	nbytes = pread(driveInfo->fd, buf, len, start);
+	if (nbytes == -1)
+		err(1, "read (offset %lld)", (long long)start);
+	if ((size_t)nbytes < len)
+		bzero(buf + nbytes, len - nbytes);
+	memcpy(buffer, buf + (offset - start), (size_t)length);
+	free(buf);
+}
+
+/*
+ * ZeroDeviceRange
+ *
+ * Zero length bytes at device byte offset; both are multiples of the
+ * physical sector size.  Image files get a hole punched, block devices
+ * that can zero in place are asked to, and everything else falls back
+ * to writing zeros from one large buffer.
+ */
+static void
+ZeroDeviceRange(const DriveInfo *driveInfo, off_t offset, off_t length)
+{
+	struct stat st;
+	off_t holeStart, holeEnd;
+
+	if (fstat(driveInfo->fd, &st) == 0) {
+		if (S_ISREG(st.st_mode) && st.st_blksize > 0) {
+			/*
+			 * A hole has to be made of whole file system blocks;
+			 * the partial blocks at either end are written.
+			 */
+			holeStart = offset + (st.st_blksize - offset % st.st_blksize) % st.st_blksize;
+			holeEnd = (offset + length) - (offset + length) % st.st_blksize;
+			if (holeEnd > holeStart && PunchHole(driveInfo->fd, holeStart, holeEnd - holeStart) == 0) {
+				WriteZeros(driveInfo, offset, holeStart - offset);
+				WriteZeros(driveInfo, holeEnd, offset + length - holeEnd);
+				return;
+			}
+		}
+#if defined(BLKZEROOUT)
+		if (S_ISBLK(st.st_mode)) {
+			uint64_t range[2] = { (uint64_t)offset, (uint64_t)length };
+
+			if (ioctl(driveInfo->fd, BLKZEROOUT, range) == 0)
+				return;
+		}
+#endif
+	}
+
+	WriteZeros(driveInfo, offset, length);
+}
+
+/*
+ * PunchHole
+ *
+ * Deallocate length bytes at offset of an image file.  Returns -1 if
+ * the file system can't.
+ */
+static int
+PunchHole(int fd, off_t offset, off_t length)
+{
+#if defined(F_PUNCHHOLE)
+	fpunchhole_t punch = { 0 };
+
+	punch.fp_offset = offset;
+	punch.fp_length = length;
+	return fcntl(fd, F_PUNCHHOLE, &punch);
+#elif defined(FALLOC_FL_PUNCH_HOLE)
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+#else
+	return -1;
+#endif
+}
+
+/*
+ * WriteZeros
+ *
+ * Write length bytes of zeros at device byte offset.
+ */
+static void
+WriteZeros(const DriveInfo *driveInfo, off_t offset, off_t length)
+{
+	size_t bufSize;
+	ssize_t nwritten;
+	void *zeroes;
+
+	if (length <= 0)
+		return;
+
+	/* Same I/O size limits as WriteBuffer */
+	bufSize = (size_t)MIN(length, (off_t)driveInfo->physSectorsPerIO * driveInfo->physSectorSize);
+	bufSize = MIN(bufSize, 4 * 1024 * 1024);
+	bufSize = MAX(bufSize - (bufSize % driveInfo->physSectorSize), driveInfo->physSectorSize);
+	zeroes = valloc(bufSize);
+	if (zeroes == NULL)
+		err(1, NULL);
+	bzero(zeroes, bufSize);
+
+	while (length > 0) {
+		nwritten = pwrite(driveInfo->fd, zeroes, (size_t)MIN((off_t)bufSize, length), offset);
+		if (nwritten <= 0)
+			err(1, "write (offset %lld)", (long long)offset);
+		offset += nwritten;
+		length -= nwritten;
+	}
+	free(zeroes);
+}
+
 /*
  * @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
  * NOTE: IF buffer IS NULL, THIS FUNCTION WILL WRITE ZERO'S.
@@ -1896,6 +3195,12 @@ WriteBuffer(const DriveInfo *driveInfo, UInt64 startingSector, UInt64 byteCount,
 		goto exit;
 	}
 
+	if (gStaged.active) {
+		StageWrite((off_t)(driveInfo->sectorOffset + startingSector) * kBytesPerSector,
+			   (off_t)byteCount, buffer);
+		goto exit;
+	}
+
 	/*@@@@@@@@@@ buffer allocation @@@@@@@@@@*/
 	/* try a buffer size for optimal IO, __UP TO 4MB__. if that
 	   fails, then try with the minimum allowed buffer size, which
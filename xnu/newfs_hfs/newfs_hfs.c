@@ -124,6 +124,7 @@ uint16_t gProtectLevel = 0;
 #define JOURNAL_DEFAULT_SIZE (8*1024*1024)
 int     gJournaled = FALSE;
 char    *gJournalDevice = NULL;
+char    *gSourceDirectory = NULL;
 UInt64	gJournalSize = 0;
 
 uid_t	gUserID = (uid_t)NOVAL;
@@ -213,7 +214,7 @@ main(argc, argv)
 		progname = *argv;
 
 // No semicolon at end of line deliberately!
-	static const char *options = "BG:J:D:M:N:PU:hsb:c:i:I:n:v:"
+	static const char *options = "BG:J:D:M:N:PR:U:hsb:c:i:I:n:v:"
 #ifdef DEBUG_BUILD
 		"p:a:E:"
 #endif
@@ -261,6 +262,10 @@ main(argc, argv)
 			gContentProtect = TRUE;
 			break;
 
+		case 'R':
+			gSourceDirectory = (char *)optarg;
+			break;
+
 #ifdef DEBUG_BUILD
 		case 'p':
 			if (isdigit (optarg[0])) {
@@ -1033,6 +1038,7 @@ static void hfsplus_params (const DriveInfo* dip, hfsparams_t *defaults)
 	defaults->hfsAlignment = 0;
 	defaults->journaledHFS = gJournaled;
 	defaults->journalDevice = gJournalDevice;
+	defaults->sourceDirectory = gSourceDirectory;
 
 	/*
 	 * 8429818
@@ -1551,6 +1557,7 @@ void usage()
 	fprintf(stderr, "\t-G group-id (for root directory)\n");
 	fprintf(stderr, "\t-U user-id (for root directory)\n");
 	fprintf(stderr, "\t-M octal access-mask (for root directory)\n");
+	fprintf(stderr, "\t-R directory copy the contents of 'directory' onto the new volume\n");
 	fprintf(stderr, "\t-b allocation block size (4096 optimal)\n");
 	fprintf(stderr, "\t-c clump size list (comma separated)\n");
 	fprintf(stderr, "\t\ta=blocks (attributes file)\n");
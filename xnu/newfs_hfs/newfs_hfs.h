@@ -208,6 +208,7 @@ struct hfsparams {
 #endif
 	uint32_t	fsStartBlock;		/* allocation block offset where the btree allocaiton should start */
 	uint32_t	nextAllocBlock;		/* Set VH nextAllocationBlock */
+	char		*sourceDirectory;	/* populate the volume from this tree (-R) */
 };
 typedef struct hfsparams hfsparams_t;
 
@@ -0,0 +1,353 @@
+//
+//  test-fsck-parallel.c
+//  hfs
+//
+//  Damages a volume's catalog, attributes B-tree and allocation bitmap,
+//  then checks that fsck_hfs -n finds the same problems with and without
+//  -P (the attributes B-tree checked on a second thread).
+//
+
+#include <TargetConditionals.h>
+
+#if !TARGET_OS_IPHONE
+
+#include <stdio.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <libkern/OSByteOrder.h>
+
+#include "hfs-tests.h"
+#include "disk-image.h"
+#include "systemx.h"
+#include "../core/hfs_format.h"
+#include "test-utils.h"
+
+#define IMAGE			"/tmp/fsck-parallel.sparseimage"
+#define SERIAL_OUT		"/tmp/fsck-parallel.serial"
+#define PARALLEL_OUT	"/tmp/fsck-parallel.parallel"
+#define DEBUG_OUT		"/tmp/fsck-parallel.debug"
+
+#define DIRS			20
+#define FILES_PER_DIR	100
+#define BIG_XATTR_SIZE	(64 * 1024)
+
+TEST(fsck_parallel)
+
+static void
+populate(const char *mnt)
+{
+	char *path, *big;
+	int i, j, fd;
+
+	big = malloc(BIG_XATTR_SIZE);
+	assert(big);
+	memset(big, 'x', BIG_XATTR_SIZE);
+
+	for (i = 0; i < DIRS; i++) {
+		asprintf(&path, "%s/dir-%02d", mnt, i);
+		assert_no_err(mkdir(path, 0755));
+		free(path);
+
+		for (j = 0; j < FILES_PER_DIR; j++) {
+			asprintf(&path, "%s/dir-%02d/file-%03d", mnt, i, j);
+			fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+			assert_with_errno(fd >= 0);
+			check_io(write(fd, path, strlen(path)), strlen(path));
+			assert_no_err(fsetxattr(fd, "test.inline", path, strlen(path), 0, 0));
+			// Large values are kept in allocation blocks, as forks
+			if (j % 10 == 0)
+				assert_no_err(fsetxattr(fd, "test.big", big, BIG_XATTR_SIZE, 0, 0));
+			assert_no_err(close(fd));
+			free(path);
+		}
+	}
+
+	free(big);
+}
+
+/*
+ * Read B-tree node 'node' of a system file.  The volume is small and new,
+ * so the nodes used here are all in the first extent.
+ */
+static void
+read_node(int fd, const HFSPlusVolumeHeader *vh, const HFSPlusForkData *fork,
+		  uint32_t node, uint16_t nodeSize, void *buf)
+{
+	uint32_t blockSize = OSSwapBigToHostInt32(vh->blockSize);
+	uint64_t offset = (uint64_t)node * nodeSize;
+
+	assert(offset + nodeSize <= (uint64_t)OSSwapBigToHostInt32(fork->extents[0].blockCount) * blockSize);
+	offset += (uint64_t)OSSwapBigToHostInt32(fork->extents[0].startBlock) * blockSize;
+	check_io(pread(fd, buf, nodeSize, offset), nodeSize);
+}
+
+static void
+write_node(int fd, const HFSPlusVolumeHeader *vh, const HFSPlusForkData *fork,
+		   uint32_t node, uint16_t nodeSize, const void *buf)
+{
+	uint32_t blockSize = OSSwapBigToHostInt32(vh->blockSize);
+	uint64_t offset = (uint64_t)node * nodeSize;
+
+	offset += (uint64_t)OSSwapBigToHostInt32(fork->extents[0].startBlock) * blockSize;
+	check_io(pwrite(fd, buf, nodeSize, offset), nodeSize);
+}
+
+static void
+read_header_rec(int fd, const HFSPlusVolumeHeader *vh, const HFSPlusForkData *fork,
+				BTHeaderRec *header)
+{
+	uint8_t node[512];
+
+	// The header record is in the first 512 bytes whatever the node size
+	read_node(fd, vh, fork, 0, sizeof(node), node);
+	memcpy(header, node + sizeof(BTNodeDescriptor), sizeof(*header));
+}
+
+static uint8_t *
+node_record(uint8_t *node, uint16_t nodeSize, uint16_t index)
+{
+	uint16_t offset;
+
+	memcpy(&offset, node + nodeSize - 2 * (index + 1), sizeof(offset));
+	return node + OSSwapBigToHostInt16(offset);
+}
+
+/*
+ * Give the root folder a wrong valence.  Its record is the first record
+ * of the first catalog leaf, as the key has parent ID 1.
+ */
+static void
+damage_catalog(int fd, const HFSPlusVolumeHeader *vh)
+{
+	const HFSPlusForkData *fork = &vh->catalogFile;
+	BTHeaderRec header;
+	HFSPlusCatalogKey *key;
+	HFSPlusCatalogFolder *folder;
+	uint16_t nodeSize;
+	uint32_t leaf;
+	uint8_t *node;
+
+	read_header_rec(fd, vh, fork, &header);
+	nodeSize = OSSwapBigToHostInt16(header.nodeSize);
+	leaf = OSSwapBigToHostInt32(header.firstLeafNode);
+	node = malloc(nodeSize);
+	assert(node);
+	read_node(fd, vh, fork, leaf, nodeSize, node);
+
+	key = (HFSPlusCatalogKey *)node_record(node, nodeSize, 0);
+	assert_equal_int(OSSwapBigToHostInt32(key->parentID), kHFSRootParentID);
+	folder = (HFSPlusCatalogFolder *)((uint8_t *)key + sizeof(key->keyLength)
+									  + OSSwapBigToHostInt16(key->keyLength));
+	assert_equal_int(OSSwapBigToHostInt16(folder->recordType), kHFSPlusFolderRecord);
+	folder->valence = OSSwapHostToBigInt32(OSSwapBigToHostInt32(folder->valence) + 5);
+
+	write_node(fd, vh, fork, leaf, nodeSize, node);
+	free(node);
+}
+
+/*
+ * Move the last extended attribute to a file that doesn't exist.  It is
+ * the last record of the last leaf, so the keys stay in order.
+ */
+static void
+damage_attributes(int fd, const HFSPlusVolumeHeader *vh)
+{
+	const HFSPlusForkData *fork = &vh->attributesFile;
+	BTHeaderRec header;
+	BTNodeDescriptor *desc;
+	HFSPlusAttrKey *key;
+	uint16_t nodeSize;
+	uint32_t leaf;
+	uint8_t *node;
+
+	assert(OSSwapBigToHostInt64(fork->logicalSize) != 0);
+	read_header_rec(fd, vh, fork, &header);
+	nodeSize = OSSwapBigToHostInt16(header.nodeSize);
+	leaf = OSSwapBigToHostInt32(header.lastLeafNode);
+	node = malloc(nodeSize);
+	assert(node);
+	read_node(fd, vh, fork, leaf, nodeSize, node);
+
+	desc = (BTNodeDescriptor *)node;
+	assert_equal_int(desc->kind, kBTLeafNode);
+	key = (HFSPlusAttrKey *)node_record(node, nodeSize, OSSwapBigToHostInt16(desc->numRecords) - 1);
+	key->fileID = OSSwapHostToBigInt32(0x7fffffff);
+
+	write_node(fd, vh, fork, leaf, nodeSize, node);
+	free(node);
+}
+
+/* Mark a free block in the middle of the volume as in use */
+static void
+damage_bitmap(int fd, const HFSPlusVolumeHeader *vh)
+{
+	uint32_t blockSize = OSSwapBigToHostInt32(vh->blockSize);
+	uint32_t block = OSSwapBigToHostInt32(vh->totalBlocks) / 2;
+	uint64_t offset;
+	uint8_t byte;
+
+	assert((uint64_t)block / 8 < (uint64_t)OSSwapBigToHostInt32(vh->allocationFile.extents[0].blockCount) * blockSize);
+	offset = (uint64_t)OSSwapBigToHostInt32(vh->allocationFile.extents[0].startBlock) * blockSize + block / 8;
+	check_io(pread(fd, &byte, 1, offset), 1);
+	assert(!(byte & (0x80 >> (block % 8))));
+	byte |= 0x80 >> (block % 8);
+	check_io(pwrite(fd, &byte, 1, offset), 1);
+}
+
+/* Run fsck_hfs -n with its output, stdout and stderr, in 'out' */
+static int
+run_fsck(const char *disk, const char *out, const char *flag1, const char *flag2)
+{
+	const char *args[6], **parg = args;
+	posix_spawn_file_actions_t facts;
+	pid_t pid;
+	int status;
+
+	*parg++ = "fsck_hfs";
+	*parg++ = "-n";
+	if (flag1)
+		*parg++ = flag1;
+	if (flag2)
+		*parg++ = flag2;
+	*parg++ = disk;
+	*parg = NULL;
+
+	posix_spawn_file_actions_init(&facts);
+	posix_spawn_file_actions_addopen(&facts, STDOUT_FILENO, out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	posix_spawn_file_actions_adddup2(&facts, STDOUT_FILENO, STDERR_FILENO);
+	assert_no_err(posix_spawn(&pid, "/sbin/fsck_hfs", &facts, NULL, (char * const *)args, NULL));
+	posix_spawn_file_actions_destroy(&facts);
+
+	assert(ignore_eintr(waitpid(pid, &status, 0), -1) == pid);
+	assert(WIFEXITED(status));
+	return WEXITSTATUS(status);
+}
+
+static char *
+read_output(const char *path)
+{
+	struct stat sb;
+	char *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	assert_with_errno(fd >= 0);
+	assert_no_err(fstat(fd, &sb));
+	buf = malloc(sb.st_size + 1);
+	assert(buf);
+	check_io(read(fd, buf, sb.st_size), sb.st_size);
+	buf[sb.st_size] = 0;
+	assert_no_err(close(fd));
+
+	return buf;
+}
+
+static int
+compare_lines(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Split 'buf' into lines, in place, and sort them */
+static char **
+sorted_lines(char *buf, int *count)
+{
+	char **lines, *line;
+	int n = 0, max = 1;
+
+	for (char *p = buf; *p; p++)
+		max += (*p == '\n');
+	lines = malloc(max * sizeof(*lines));
+	assert(lines);
+	while ((line = strsep(&buf, "\n")) != NULL) {
+		if (*line)
+			lines[n++] = line;
+	}
+	qsort(lines, n, sizeof(*lines), compare_lines);
+	*count = n;
+
+	return lines;
+}
+
+/*
+ * Messages from the two threads may be interleaved differently, so the
+ * outputs must have the same lines, in any order.
+ */
+static void
+check_same_output(const char *serial_path, const char *parallel_path)
+{
+	char *serial = read_output(serial_path), *parallel = read_output(parallel_path);
+	char **serial_lines, **parallel_lines;
+	int serial_count, parallel_count, i;
+
+	serial_lines = sorted_lines(serial, &serial_count);
+	parallel_lines = sorted_lines(parallel, &parallel_count);
+	assert_equal_int(serial_count, parallel_count);
+	for (i = 0; i < serial_count; i++) {
+		if (strcmp(serial_lines[i], parallel_lines[i]))
+			assert_fail("fsck_hfs -P printed \"%s\" where fsck_hfs printed \"%s\"\n",
+						parallel_lines[i], serial_lines[i]);
+	}
+
+	free(serial_lines);
+	free(parallel_lines);
+	free(serial);
+	free(parallel);
+}
+
+int run_fsck_parallel(__unused test_ctx_t *ctx)
+{
+	HFSPlusVolumeHeader vh;
+	char *debug;
+	int fd, serial, parallel;
+
+	unlink(IMAGE);
+
+	disk_image_t *di = disk_image_create(IMAGE,
+						&(disk_image_opts_t){
+							.size = 256 * 1024 * 1024
+						});
+
+	populate(di->mount_point);
+	assert_no_err(unmount(di->mount_point, 0));
+
+	// Both runs find a clean volume clean
+	assert(!systemx("/sbin/fsck_hfs", SYSTEMX_QUIET, "-n", di->disk, NULL));
+	assert(!systemx("/sbin/fsck_hfs", SYSTEMX_QUIET, "-n", "-P", di->disk, NULL));
+
+	fd = open(di->disk, O_RDWR);
+	assert_with_errno(fd >= 0);
+	check_io(pread(fd, &vh, sizeof(vh), 1024), sizeof(vh));
+	assert_equal_int(OSSwapBigToHostInt16(vh.signature), kHFSPlusSigWord);
+	damage_catalog(fd, &vh);
+	damage_attributes(fd, &vh);
+	damage_bitmap(fd, &vh);
+	assert_no_err(close(fd));
+
+	serial = run_fsck(di->disk, SERIAL_OUT, NULL, NULL);
+	parallel = run_fsck(di->disk, PARALLEL_OUT, "-P", NULL);
+	assert(serial != 0);
+	assert_equal_int(serial, parallel);
+	check_same_output(SERIAL_OUT, PARALLEL_OUT);
+
+	// The attributes B-tree really was checked on its own thread
+	run_fsck(di->disk, DEBUG_OUT, "-P", "-d");
+	debug = read_output(DEBUG_OUT);
+	assert(strstr(debug, "AttrBTRecordsChk thread") != NULL);
+	free(debug);
+
+	unlink(SERIAL_OUT);
+	unlink(PARALLEL_OUT);
+	unlink(DEBUG_OUT);
+
+	return 0;
+}
+
+#endif // !TARGET_OS_IPHONE
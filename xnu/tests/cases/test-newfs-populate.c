@@ -0,0 +1,227 @@
+//
+//  test-newfs-populate.c
+//  hfs
+//
+//  Checks that newfs_hfs -R builds a volume that fsck_hfs finds clean
+//  and that holds a copy of the source directory.
+//
+
+#include <TargetConditionals.h>
+
+#if !TARGET_OS_IPHONE
+
+#include <stdio.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "hfs-tests.h"
+#include "disk-image.h"
+#include "systemx.h"
+#include "test-utils.h"
+
+#define IMAGE			"/tmp/newfs-populate.sparseimage"
+#define SOURCE			"/tmp/newfs-populate.src"
+
+#define MANY_FILES		3000
+#define BIG_FILE_SIZE	(5 * 1024 * 1024 + 123)
+#define DEPTH			24
+#define MTIME			1000000000
+
+TEST(newfs_populate)
+
+/* Names whose order in the catalog depends on case folding */
+static const char *names[] = {
+	"apple", "Banana", "cherry", "\xC3\x89" "clair", "ZEBRA", "zebra2", "a", "B",
+};
+
+static size_t
+file_size(int i)
+{
+	return (i * 37) % 5000;
+}
+
+static void
+fill(char *buf, size_t len, int seed)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (char)(seed + i * 7);
+}
+
+static void
+write_file(const char *path, size_t len, int seed)
+{
+	char *buf = malloc(len + 1);
+	int fd;
+
+	assert(buf);
+	fill(buf, len, seed);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	assert_with_errno(fd >= 0);
+	check_io(write(fd, buf, len), len);
+	assert_no_err(close(fd));
+	free(buf);
+}
+
+static void
+check_file(const char *path, size_t len, int seed)
+{
+	char *expect = malloc(len + 1), *buf = malloc(len + 1);
+	struct stat sb;
+	int fd;
+
+	assert(expect && buf);
+	fill(expect, len, seed);
+	fd = open(path, O_RDONLY);
+	assert_with_errno(fd >= 0);
+	assert_no_err(fstat(fd, &sb));
+	assert_equal_ll(sb.st_size, len);
+	check_io(read(fd, buf, len + 1), len);
+	assert(!memcmp(buf, expect, len));
+	assert_no_err(close(fd));
+	free(expect);
+	free(buf);
+}
+
+static void
+make_source(void)
+{
+	struct timeval times[2] = { { MTIME, 0 }, { MTIME, 0 } };
+	char *path, *dir;
+	int i;
+
+	systemx("/bin/rm", SYSTEMX_QUIET, "-rf", SOURCE, NULL);
+	assert_no_err(mkdir(SOURCE, 0755));
+
+	// Enough entries in one folder for a catalog with index nodes
+	assert_no_err(mkdir(SOURCE "/many", 0755));
+	for (i = 0; i < MANY_FILES; i++) {
+		asprintf(&path, SOURCE "/many/file-%04d", i);
+		write_file(path, file_size(i), i);
+		free(path);
+	}
+
+	for (i = 0; i < (int)lengthof(names); i++) {
+		asprintf(&path, SOURCE "/%s", names[i]);
+		write_file(path, i * 100, i);
+		free(path);
+	}
+
+	write_file(SOURCE "/big", BIG_FILE_SIZE, 1);
+	write_file(SOURCE "/empty", 0, 0);
+	assert_no_err(symlink("many/file-0001", SOURCE "/link"));
+
+	write_file(SOURCE "/private", 10, 2);
+	assert_no_err(chmod(SOURCE "/private", 0640));
+	assert_no_err(utimes(SOURCE "/private", times));
+
+	dir = strdup(SOURCE);
+	for (i = 0; i < DEPTH; i++) {
+		asprintf(&path, "%s/d%d", dir, i);
+		assert_no_err(mkdir(path, 0755));
+		free(dir);
+		dir = path;
+	}
+	asprintf(&path, "%s/leaf", dir);
+	write_file(path, 4096, 3);
+	free(path);
+	free(dir);
+}
+
+static void
+check_volume(const char *mnt)
+{
+	char *path, *dir, target[64];
+	struct stat sb;
+	ssize_t len;
+	int i;
+
+	for (i = 0; i < MANY_FILES; i++) {
+		asprintf(&path, "%s/many/file-%04d", mnt, i);
+		check_file(path, file_size(i), i);
+		free(path);
+	}
+
+	for (i = 0; i < (int)lengthof(names); i++) {
+		asprintf(&path, "%s/%s", mnt, names[i]);
+		check_file(path, i * 100, i);
+		free(path);
+	}
+
+	asprintf(&path, "%s/big", mnt);
+	check_file(path, BIG_FILE_SIZE, 1);
+	free(path);
+	asprintf(&path, "%s/empty", mnt);
+	check_file(path, 0, 0);
+	free(path);
+
+	asprintf(&path, "%s/link", mnt);
+	len = readlink(path, target, sizeof(target) - 1);
+	assert_with_errno(len >= 0);
+	target[len] = 0;
+	assert(!strcmp(target, "many/file-0001"));
+	free(path);
+
+	asprintf(&path, "%s/private", mnt);
+	assert_no_err(stat(path, &sb));
+	assert_equal_int(sb.st_mode & ALLPERMS, 0640);
+	assert_equal_ll(sb.st_mtime, MTIME);
+	free(path);
+
+	dir = strdup(mnt);
+	for (i = 0; i < DEPTH; i++) {
+		asprintf(&path, "%s/d%d", dir, i);
+		free(dir);
+		dir = path;
+	}
+	asprintf(&path, "%s/leaf", dir);
+	check_file(path, 4096, 3);
+	free(path);
+	free(dir);
+}
+
+int run_newfs_populate(__unused test_ctx_t *ctx)
+{
+	unlink(IMAGE);
+	make_source();
+
+	disk_image_t *di = disk_image_create(IMAGE,
+						&(disk_image_opts_t){
+							.size = 256 * 1024 * 1024
+						});
+
+	unmount(di->mount_point, 0);
+
+	assert(!systemx("/sbin/newfs_hfs", SYSTEMX_QUIET, "-J", "-R", SOURCE, di->disk, NULL));
+
+	// -n: report problems without repairing them; 0 means none were found
+	assert(!systemx("/sbin/fsck_hfs", SYSTEMX_QUIET, "-n", di->disk, NULL));
+
+	assert(!systemx("/usr/sbin/diskutil", SYSTEMX_QUIET, "mount", di->disk, NULL));
+
+	free((char *)di->mount_point);
+	di->mount_point = NULL;
+
+	struct statfs *mntbuf;
+	int i, n = getmntinfo(&mntbuf, 0);
+	for (i = 0; i < n; ++i) {
+		if (!strcmp(mntbuf[i].f_mntfromname, di->disk)) {
+			di->mount_point = strdup(mntbuf[i].f_mntonname);
+			break;
+		}
+	}
+
+	assert(i < n);
+
+	check_volume(di->mount_point);
+
+	systemx("/bin/rm", SYSTEMX_QUIET, "-rf", SOURCE, NULL);
+
+	return 0;
+}
+
+#endif // !TARGET_OS_IPHONE
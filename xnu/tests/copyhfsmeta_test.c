@@ -0,0 +1,610 @@
+/*
+ * Copyright (c) 2014-2015 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+/*
+ * Tests and times how CopyHFSMeta reads a volume's metadata, on an image
+ * file formatted and populated by newfs_hfs's make_hfsplus (see
+ * newfs_image.h).  The source directory has NENTRIES files, every
+ * LINK_EVERY-th of them a symbolic link, so the catalog has thousands of
+ * leaf nodes and FindOtherMetadata has link data to find in most of them.
+ *
+ * StreamBTreeLeaves must walk the whole catalog leaf chain, and
+ * FindOtherMetadata must report every link.  Then a leaf is unlinked from
+ * the chain in the image:  the stream must say so, and FindOtherMetadata
+ * must still find every link by scanning all of the catalog's nodes.
+ *
+ * The benchmark times streaming the catalog leaves, with and without
+ * read-ahead, against reading every node of the catalog 1 MB at a time
+ * as CopyHFSMeta used to.  newfs_image_create leaves the image with
+ * F_NOCACHE set, so the reads go to the disk.
+ *
+ * Then the metadata is copied to a sparse bundle (SparseBundle.c), in
+ * full and incrementally, and 1% of the catalog leaves are changed in
+ * the image before another incremental copy.  The bundle must match the
+ * image after each copy; the time and bytes written for each are
+ * printed.
+ *
+ * Last, a 1 TB image (the size of a spinning disk) is populated from
+ * the same directory, and its metadata is copied in the order it was
+ * found and again after NormalizeVolumeObject sorted and merged it.
+ *
+ * Pass the number of entries to change the size of the catalog, e.g.
+ * "copyhfsmeta_test 500000".
+ */
+
+#include <sys/stat.h>
+#include <time.h>
+
+#include "../CopyHFSMeta/util.c"
+#include "../CopyHFSMeta/ScanExtents.c"
+#undef MIN	/* misc.c has its own */
+#include "../CopyHFSMeta/misc.c"
+#include "../CopyHFSMeta/SparseBundle.c"
+
+#include "newfs_image.h"
+#include "test-utils.h"
+
+#define IMAGE		"/tmp/copyhfsmeta_test.img"
+#define SOURCE		"/tmp/copyhfsmeta_test.src"
+#define BUNDLE		"/tmp/copyhfsmeta_test.sparsebundle"
+#define DISK_IMAGE	"/tmp/copyhfsmeta_test_disk.img"
+#define DISK_BYTES	(1ULL << 40)
+#define IMAGE_BYTES	(1ULL << 30)	/* At least; 2 KB per entry */
+#define NENTRIES	50000
+#define LINK_EVERY	16
+#define CHANGE_EVERY	100	/* Leaves changed before an incremental copy */
+
+int debug, verbose, printProgress;
+
+struct catalog {
+	VolumeObjects_t *vop;
+	Extents_t *map;
+	size_t mapCount;
+	BTHeaderRec header;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	assert_no_err(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+remove_source(void)
+{
+	assert_no_err(system("/bin/rm -rf " SOURCE));
+}
+
+static void
+remove_bundle(void)
+{
+	assert_no_err(system("/bin/rm -rf " BUNDLE));
+}
+
+/* Returns the number of links */
+static unsigned
+make_source(unsigned entries)
+{
+	char path[PATH_MAX];
+	unsigned i, links = 0;
+	int fd;
+
+	remove_source();
+	assert_no_err(mkdir(SOURCE, 0755));
+	for (i = 0; i < entries; i++) {
+		snprintf(path, sizeof(path), SOURCE "/%07u", i);
+		if (i % LINK_EVERY == 0) {
+			assert_no_err(symlink("a/link/target", path));
+			links++;
+		} else {
+			fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+			assert_with_errno(fd >= 0);
+			assert_no_err(close(fd));
+		}
+	}
+	return links;
+}
+
+/* What OpenDevice would set up, if it took image files */
+static void
+catalog_open(struct catalog *cp, int imageFd)
+{
+	DeviceInfo_t *devp = calloc(1, sizeof(*devp));
+	struct stat st;
+
+	assert(devp != NULL);
+	assert_no_err(fstat(imageFd, &st));
+	devp->devname = strdup(IMAGE);
+	devp->fd = dup(imageFd);
+	assert_with_errno(devp->fd >= 0);
+	devp->size = st.st_size;
+	devp->blockSize = 512;
+	devp->blockCount = st.st_size / devp->blockSize;
+
+	cp->vop = InitVolumeObject(devp, VolumeInfo(devp));
+	assert(cp->vop != NULL);
+	assert(AddHeaders(cp->vop, 0) != 0);
+	AddJournal(cp->vop);
+	AddFileExtents(cp->vop);
+
+	assert_no_err(GetForkExtentMap(cp->vop, 0, kHFSCatalogFileID, &cp->map, &cp->mapCount));
+	assert_no_err(ReadBTreeHeader(devp, cp->map, &cp->header));
+}
+
+static void
+catalog_close(struct catalog *cp)
+{
+	free(cp->map);
+	ReleaseVolumeObjects(cp->vop);
+}
+
+static off_t
+node_offset(const struct catalog *cp, uint32_t node)
+{
+	off_t fileOffset = (off_t)node * S16(cp->header.nodeSize);
+	size_t i;
+
+	for (i = 0; i < cp->mapCount; i++) {
+		if (fileOffset < cp->map[i].length)
+			return cp->map[i].base + fileOffset;
+		fileOffset -= cp->map[i].length;
+	}
+	assert(false);
+	return -1;
+}
+
+/* The distinct file IDs the handler is given */
+struct fids {
+	uint8_t *seen;
+	uint32_t limit;
+	unsigned count;
+};
+
+static extent_handler_t
+fids_handler(struct fids *fp)
+{
+	return Block_copy(^(int fid, off_t start, off_t len) {
+		assert(fid > 0 && (uint32_t)fid < fp->limit);
+		assert(start > 0 && len > 0);
+		if (!fp->seen[fid]) {
+			fp->seen[fid] = 1;
+			fp->count++;
+		}
+		return 0;
+	});
+}
+
+static void
+fids_init(struct fids *fp, const struct catalog *cp)
+{
+	fp->limit = S32(cp->vop->vdp->priHeader.nextCatalogID);
+	fp->seen = calloc(fp->limit, 1);
+	fp->count = 0;
+	assert(fp->seen != NULL);
+}
+
+/* Walk the leaf chain, giving the links on it to fp */
+static int
+stream_links(struct catalog *cp, unsigned inFlight, struct fids *fp, uint32_t *leavesp, uint32_t *recordsp)
+{
+	extent_handler_t handler = fids_handler(fp);
+	size_t nodeSize = S16(cp->header.nodeSize);
+	__block uint32_t leaves = 0, records = 0;
+	int rv;
+
+	rv = StreamBTreeLeaves(cp->vop->devp, cp->map, cp->mapCount, &cp->header, inFlight,
+			       ^(const uint8_t *nodePtr) {
+		leaves++;
+		records += S16(((const BTNodeDescriptor *)nodePtr)->numRecords);
+		return ScanCatalogNode(cp->vop, (uint8_t *)nodePtr, nodeSize, handler);
+	});
+	Block_release(handler);
+	if (leavesp)
+		*leavesp = leaves;
+	if (recordsp)
+		*recordsp = records;
+	return rv;
+}
+
+static void
+find_links(struct catalog *cp, struct fids *fp)
+{
+	extent_handler_t handler = fids_handler(fp);
+
+	assert_no_err(FindOtherMetadata(cp->vop, handler));
+	Block_release(handler);
+}
+
+static void
+test_intact(struct catalog *cp, unsigned entries, unsigned links)
+{
+	uint32_t leaves, records;
+	struct fids fids;
+
+	/* A file (or link) record and a thread record for each entry */
+	assert(S32(cp->header.leafRecords) >= 2 * entries);
+	fids_init(&fids, cp);
+	assert_equal_int(stream_links(cp, kBTreeStreamInFlight, &fids, &leaves, &records), 0);
+	assert_equal_int(records, S32(cp->header.leafRecords));
+	assert(leaves > 1);
+	assert_equal_int(fids.count, links);
+	free(fids.seen);
+
+	fids_init(&fids, cp);
+	assert_equal_int(stream_links(cp, 0, &fids, NULL, NULL), 0);
+	assert_equal_int(fids.count, links);
+	free(fids.seen);
+
+	fids_init(&fids, cp);
+	find_links(cp, &fids);
+	assert_equal_int(fids.count, links);
+	free(fids.seen);
+}
+
+/*
+ * Point the first leaf past the second, leaving the second orphaned, as
+ * a lost write of the first leaf might.
+ */
+static void
+test_orphan(int imageFd, unsigned links)
+{
+	struct catalog cat;
+	size_t nodeSize;
+	uint8_t *first, *second;
+	BTNodeDescriptor *fdp, *sdp;
+	uint32_t firstNode, secondNode, leaves, records;
+	struct fids fids;
+
+	catalog_open(&cat, imageFd);
+	nodeSize = S16(cat.header.nodeSize);
+	first = malloc(nodeSize);
+	second = malloc(nodeSize);
+	assert(first != NULL && second != NULL);
+	fdp = (BTNodeDescriptor *)first;
+	sdp = (BTNodeDescriptor *)second;
+
+	firstNode = S32(cat.header.firstLeafNode);
+	check_io(pread(imageFd, first, nodeSize, node_offset(&cat, firstNode)), nodeSize);
+	secondNode = S32(fdp->fLink);
+	assert(secondNode != 0);
+	check_io(pread(imageFd, second, nodeSize, node_offset(&cat, secondNode)), nodeSize);
+	assert(sdp->kind == kBTLeafNode && sdp->fLink != 0);
+	fdp->fLink = sdp->fLink;
+	check_io(pwrite(imageFd, first, nodeSize, node_offset(&cat, firstNode)), nodeSize);
+
+	/* The chain misses some links now, and says it's short */
+	fids_init(&fids, &cat);
+	assert_equal_int(stream_links(&cat, kBTreeStreamInFlight, &fids, &leaves, &records), 1);
+	assert_equal_int(records, S32(cat.header.leafRecords) - S16(sdp->numRecords));
+	assert(fids.count < links);
+	free(fids.seen);
+
+	/* But they are found by reading every node */
+	fids_init(&fids, &cat);
+	find_links(&cat, &fids);
+	assert_equal_int(fids.count, links);
+	free(fids.seen);
+
+	/* Put it back for the benchmark */
+	fdp->fLink = OSSwapHostToBigInt32(secondNode);
+	check_io(pwrite(imageFd, first, nodeSize, node_offset(&cat, firstNode)), nodeSize);
+
+	free(first);
+	free(second);
+	catalog_close(&cat);
+}
+
+/*
+ * Read every node of the catalog, 1 MB at a time, and scan the leaves:
+ * what FindOtherMetadata does for a B-tree it can't stream.
+ */
+static void
+scan_links(struct catalog *cp, struct fids *fp)
+{
+	extent_handler_t handler = fids_handler(fp);
+	size_t nodeSize = S16(cp->header.nodeSize);
+	size_t bufSize = 1024 * 1024;
+	uint8_t *buffer = malloc(bufSize);
+	size_t i;
+
+	assert(buffer != NULL);
+	for (i = 0; i < cp->mapCount; i++) {
+		off_t nread, len = cp->map[i].length;
+		for (nread = 0; nread < len; nread += bufSize) {
+			size_t amt = (size_t)MIN(len - nread, (off_t)bufSize), off;
+			check_io(UnalignedRead(cp->vop->devp, buffer, amt, cp->map[i].base + nread), amt);
+			for (off = 0; off + nodeSize <= amt; off += nodeSize)
+				assert_no_err(ScanCatalogNode(cp->vop, buffer + off, nodeSize, handler));
+		}
+	}
+	Block_release(handler);
+	free(buffer);
+}
+
+static void
+benchmark(int imageFd, unsigned links)
+{
+	struct catalog cat;
+	struct fids fids;
+	uint32_t leaves;
+	double start;
+	off_t catalogBytes = 0;
+	size_t i;
+
+	catalog_open(&cat, imageFd);
+	for (i = 0; i < cat.mapCount; i++)
+		catalogBytes += cat.map[i].length;
+	printf("catalog: %lld KB in %zu extents, %u leaf records, %u-byte nodes\n",
+		   (long long)catalogBytes / 1024, cat.mapCount, S32(cat.header.leafRecords),
+		   S16(cat.header.nodeSize));
+
+	fids_init(&fids, &cat);
+	start = now();
+	scan_links(&cat, &fids);
+	printf("%-32s %8.3f s\n", "every node, 1 MB reads", now() - start);
+	assert_equal_int(fids.count, links);
+	free(fids.seen);
+
+	fids_init(&fids, &cat);
+	start = now();
+	assert_equal_int(stream_links(&cat, 0, &fids, &leaves, NULL), 0);
+	printf("%-32s %8.3f s, %u leaves\n", "leaf chain, no read-ahead", now() - start, leaves);
+	assert_equal_int(fids.count, links);
+	free(fids.seen);
+
+	fids_init(&fids, &cat);
+	start = now();
+	assert_equal_int(stream_links(&cat, kBTreeStreamInFlight, &fids, &leaves, NULL), 0);
+	printf("%-32s %8.3f s, %u leaves\n", "leaf chain, read-ahead", now() - start, leaves);
+	assert_equal_int(fids.count, links);
+	free(fids.seen);
+
+	catalog_close(&cat);
+}
+
+/* All of the metadata, gathered the way main.c does it (but unsorted) */
+static void
+gather_metadata(struct catalog *cp)
+{
+	VolumeObjects_t *vop = cp->vop;
+
+	assert_no_err(FindOtherMetadata(vop, ^(int fid, off_t start, off_t len) {
+		return AddExtentForFile(vop, start, len, fid);
+	}));
+}
+
+/* Every extent of metadata in the bundle is the same as in the image */
+static void
+check_bundle(struct catalog *cp, IOWrapper_t *wrapper)
+{
+	const size_t bufSize = 1024 * 1024;
+	uint8_t *expect = malloc(bufSize), *buffer = malloc(bufSize);
+	ExtentList_t *exts;
+	size_t indx;
+
+	assert(expect != NULL && buffer != NULL);
+	for (exts = cp->vop->list; exts; exts = exts->next) {
+		for (indx = 0; indx < exts->count; indx++) {
+			off_t base = exts->extents[indx].base, len = exts->extents[indx].length, done;
+
+			for (done = 0; done < len; done += bufSize) {
+				size_t amt = (size_t)MIN(len - done, (off_t)bufSize);
+
+				check_io(UnalignedRead(cp->vop->devp, expect, amt, base + done), amt);
+				check_io(wrapper->reader(wrapper, base + done, buffer, amt), amt);
+				assert(!memcmp(expect, buffer, amt));
+			}
+		}
+	}
+	free(expect);
+	free(buffer);
+}
+
+/*
+ * Copy the metadata to the bundle, and check it.  Returns the bytes
+ * written to the bundle.
+ */
+static off_t
+copy_to_bundle(struct catalog *cp, int incremental, double *secondsp)
+{
+	struct SparseBundleContext *ctx;
+	IOWrapper_t *wrapper;
+	off_t written;
+	double start;
+
+	start = now();
+	wrapper = InitSparseBundle(BUNDLE, cp->vop->devp, incremental);
+	assert(wrapper != NULL);
+	assert_no_err(CopyObjectsToDest(cp->vop, wrapper, 0));
+	*secondsp = now() - start;
+	check_bundle(cp, wrapper);
+
+	ctx = wrapper->context;
+	written = incremental ? ctx->bytesWritten + ctx->bytesZeroed : cp->vop->byteCount;
+	if (ctx->cfd != -1)
+		close(ctx->cfd);
+	free(ctx->pathname);
+	free(ctx->oldManifest);
+	free(ctx->newManifest);
+	free(ctx);
+	free(wrapper);
+	return written;
+}
+
+/*
+ * Bump the access date of the first file record in every CHANGE_EVERY-th
+ * catalog leaf, as reading the file would.  Returns the number of
+ * leaves changed.
+ */
+static unsigned
+change_leaves(struct catalog *cp, int imageFd)
+{
+	size_t nodeSize = S16(cp->header.nodeSize);
+	uint8_t *node = malloc(nodeSize);
+	const BTNodeDescriptor *ndp = (const BTNodeDescriptor *)node;
+	uint32_t n, leaf = 0, changed = 0;
+	unsigned r;
+
+	assert(node != NULL);
+	for (n = S32(cp->header.firstLeafNode); n != 0; n = S32(ndp->fLink), leaf++) {
+		check_io(pread(imageFd, node, nodeSize, node_offset(cp, n)), nodeSize);
+		assert(ndp->kind == kBTLeafNode);
+		if (leaf % CHANGE_EVERY != 0)
+			continue;
+		for (r = 1; r <= S16(ndp->numRecords); r++) {
+			uint16_t offset = S16(((uint16_t *)(node + nodeSize))[-(int)r]);
+			HFSPlusCatalogKey *keyp = (HFSPlusCatalogKey *)(node + offset);
+			size_t keyLength = S16(keyp->keyLength);
+			HFSPlusCatalogFile *fp = (HFSPlusCatalogFile *)((uint8_t *)keyp + 2 + keyLength + (keyLength & 1));
+
+			if (S16(fp->recordType) == kHFSPlusFileRecord) {
+				fp->accessDate = OSSwapHostToBigInt32(S32(fp->accessDate) + 1);
+				check_io(pwrite(imageFd, node, nodeSize, node_offset(cp, n)), nodeSize);
+				changed++;
+				break;
+			}
+		}
+	}
+	free(node);
+	return changed;
+}
+
+static void
+print_copy(const char *label, double seconds, off_t written)
+{
+	printf("%-32s %8.3f s, %10lld KB written\n", label, seconds, (long long)written / 1024);
+}
+
+static void
+benchmark_bundle(int imageFd)
+{
+	struct catalog cat;
+	off_t full, written;
+	double seconds;
+	unsigned changed;
+
+	catalog_open(&cat, imageFd);
+	gather_metadata(&cat);
+	assert_no_err(NormalizeVolumeObject(cat.vop));
+	printf("metadata: %lld KB in %zu extents\n", (long long)cat.vop->byteCount / 1024, cat.vop->count);
+
+	remove_bundle();
+	full = copy_to_bundle(&cat, 0, &seconds);
+	print_copy("full copy", seconds, full);
+
+	/* The first incremental copy has no manifest, and writes everything */
+	remove_bundle();
+	written = copy_to_bundle(&cat, 1, &seconds);
+	print_copy("incremental, first", seconds, written);
+	assert_equal_ll(written, full);
+
+	written = copy_to_bundle(&cat, 1, &seconds);
+	print_copy("incremental, nothing changed", seconds, written);
+	assert_equal_ll(written, 0);
+
+	changed = change_leaves(&cat, imageFd);
+	assert(changed > 0);
+	written = copy_to_bundle(&cat, 1, &seconds);
+	print_copy("incremental, 1% of leaves changed", seconds, written);
+	assert(written > 0 && written <= (off_t)changed * kManifestChunkSize);
+
+	catalog_close(&cat);
+	remove_bundle();
+}
+
+/*
+ * Copy the metadata of a disk-sized volume in the order it was found,
+ * then sorted and merged.
+ */
+static void
+benchmark_normalize(void)
+{
+	struct catalog cat;
+	size_t count;
+	off_t bytes;
+	double seconds, start;
+	int fd;
+
+	fd = newfs_image_create(DISK_IMAGE, DISK_BYTES, true, SOURCE, NULL);
+	catalog_open(&cat, fd);
+	gather_metadata(&cat);
+	count = cat.vop->count;
+	bytes = cat.vop->byteCount;
+
+	remove_bundle();
+	copy_to_bundle(&cat, 0, &seconds);
+	printf("%-32s %8.3f s, %10lld KB in %zu extents\n", "copy, in the order found",
+		   seconds, (long long)bytes / 1024, count);
+
+	start = now();
+	assert_no_err(NormalizeVolumeObject(cat.vop));
+	seconds = now() - start;
+	printf("%-32s %8.3f s, %10lld KB in %zu extents\n", "NormalizeVolumeObject",
+		   seconds, (long long)cat.vop->byteCount / 1024, cat.vop->count);
+	assert(cat.vop->count <= count);
+	assert(cat.vop->byteCount <= bytes);
+
+	remove_bundle();
+	copy_to_bundle(&cat, 0, &seconds);
+	printf("%-32s %8.3f s\n", "copy, sorted and merged", seconds);
+
+	catalog_close(&cat);
+	remove_bundle();
+	assert_no_err(close(fd));
+	unlink(DISK_IMAGE);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned entries = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 0) : NENTRIES;
+	struct catalog cat;
+	unsigned links;
+	int fd;
+
+	links = make_source(entries);
+	fd = newfs_image_create(IMAGE, MAX(IMAGE_BYTES, (uint64_t)entries << 11), false, SOURCE, NULL);
+
+	catalog_open(&cat, fd);
+	test_intact(&cat, entries, links);
+	catalog_close(&cat);
+	test_orphan(fd, links);
+	printf("[PASSED] copyhfsmeta_test\n");
+
+	benchmark(fd, links);
+	benchmark_bundle(fd);
+	assert_no_err(close(fd));
+	unlink(IMAGE);
+
+	benchmark_normalize();
+	remove_source();
+	return 0;
+}
@@ -0,0 +1,542 @@
+/*
+ * Copyright (c) 2014-2015 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Tests the in-memory volume bitmap of fsck_hfs (VolumeBitmapCheck.c)
+ * with both of its engines, the segment tree and the flat bitmap,
+ * against a plain reference bitmap, and benchmarks the two on a
+ * synthetic volume.
+ *
+ * The benchmark marks 10,000,000 extents by default; pass a count to
+ * change it, e.g. "fsck_bitmap_test 1000000".
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "test-utils.h"
+
+#define FSCK_BITMAP_TEST 1
+
+/*
+ * Enough of Scavenger.h for VolumeBitmapCheck.c.  The on-disk bitmap
+ * lives in 'disk', and the block routines hand out pointers into it.
+ */
+typedef uint8_t Boolean;
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef int16_t SInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int16_t OSErr;
+typedef int32_t OSStatus;
+typedef uint32_t GetBlockOptions;
+typedef uint32_t ReleaseBlockOptions;
+typedef void *lib_fsck_ctx_t;
+
+enum {
+	noErr = 0,
+	vcInvalidExtentErr = 60,
+	E_OvlExt = 511,
+	E_VBMDamaged = 556,
+	E_VBMDamagedOverAlloc = 609,
+};
+
+enum {
+	kGetBlock = 0x00000000,
+	kSkipEndianSwap = 0x00000010,
+	kReleaseBlock = 0x00000000,
+	kForceWriteBlock = 0x00000001,
+};
+
+enum {
+	d_info = 0x0001,
+	d_error = 0x0004,
+	d_trim = 0x0040,
+};
+
+#define S_VBM				0x2000
+#define kHFSBlockSize		512
+#define LOG_TYPE_INFO		0
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+#define SWAP_BE32(x)	__builtin_bswap32(x)
+#else
+#define SWAP_BE32(x)	(x)
+#endif
+
+#define ReturnIfError(result)	if ( (result) != noErr ) return (result); else ;
+#define MarkVCBDirty(vcb)		((void) (vcb->vcbFlags |= 0xFF00))
+
+typedef struct BlockDescriptor {
+	void *buffer;
+	void *blockHeader;
+	size_t blockSize;
+	Boolean blockReadFromDisk;
+	UInt8 isModified;
+	UInt8 reserved[2];
+} BlockDescriptor;
+
+typedef struct SVCB {
+	UInt32 vcbTotalBlocks;
+	UInt32 vcbFreeBlocks;
+	UInt32 vcbBlockSize;
+	UInt16 vcbVBMSt;
+	UInt16 vcbAlBlSt;
+	UInt64 vcbEmbeddedOffset;
+	UInt16 vcbFlags;
+} SVCB;
+
+typedef struct SFCB {
+	UInt32 fcbBlockSize;
+} SFCB;
+
+typedef struct SGlob {
+	SVCB *calculatedVCB;
+	SFCB *calculatedAllocationsFCB;
+	UInt16 VIStat;
+	UInt64 TarBlock;
+	UInt64 itemsProcessed;
+	lib_fsck_ctx_t context;
+} SGlob, *SGlobPtr;
+
+static struct {
+	int fsreadfd;
+} state;
+
+static lib_fsck_ctx_t ctx;
+
+static UInt8 *disk;				// on-disk volume bitmap
+static UInt32 diskBlockSize;
+static int lastMessage;			// last fsckPrintFormat message
+static UInt64 trimmedBlocks;	// by TrimFreeBlocks
+static UInt32 trimmedExtents;
+
+static Boolean
+VolumeObjectIsHFSPlus(void)
+{
+	return true;
+}
+
+static OSStatus
+GetFileBlock(SFCB *file, UInt32 blockNum, GetBlockOptions options, BlockDescriptor *block)
+{
+	(void)options;
+	block->buffer = disk + (size_t)blockNum * file->fcbBlockSize;
+	block->blockSize = file->fcbBlockSize;
+	return noErr;
+}
+
+static OSStatus
+ReleaseFileBlock(SFCB *file, BlockDescriptor *block, ReleaseBlockOptions options)
+{
+	(void)file; (void)options;
+	block->buffer = NULL;
+	return noErr;
+}
+
+static OSStatus
+GetVolumeBlock(SVCB *volume, UInt64 blockNum, GetBlockOptions options, BlockDescriptor *block)
+{
+	(void)volume; (void)blockNum; (void)options; (void)block;
+	assert_fail("GetVolumeBlock: plain HFS is not tested%s", "");
+	return noErr;
+}
+
+static OSStatus
+ReleaseVolumeBlock(SVCB *volume, BlockDescriptor *block, ReleaseBlockOptions options)
+{
+	(void)volume; (void)block; (void)options;
+	return noErr;
+}
+
+#define fsckPrintFormat(c, msg, ...)	(lastMessage = (msg))
+#define fsck_print(c, type, ...)		((void)(c))
+#define fsck_debug_print(c, type, ...)	((void)(c))
+
+int CaptureBitmapBits(UInt32 startBit, UInt32 bitCount);
+
+/* TrimFlush hands the extents to the device; count them instead */
+typedef struct {
+	uint64_t offset;
+	uint64_t length;
+} dk_extent_t;
+
+typedef struct {
+	dk_extent_t *extents;
+	uint32_t extentsCount;
+} dk_unmap_t;
+
+#define DKIOCUNMAP			1
+#define DKIOCGETFEATURES	2
+#define DK_FEATURE_UNMAP	0x10
+
+static int
+test_ioctl(int fd, unsigned long request, void *arg)
+{
+	dk_unmap_t *unmap = arg;
+	uint32_t i;
+
+	(void)fd;
+	if (request != DKIOCUNMAP)
+		return -1;
+	for (i = 0; i < unmap->extentsCount; i++)
+		trimmedBlocks += unmap->extents[i].length / 4096;
+	trimmedExtents += unmap->extentsCount;
+	return 0;
+}
+#define ioctl	test_ioctl
+
+#include "../lib_fsck_hfs/dfalib/VolumeBitmapCheck.c"
+
+#undef ioctl
+
+/*
+ * A volume of 'totalBlocks' 4K blocks, with a reference copy of the
+ * bitmap kept one byte per block.  'flat' picks the engine.
+ */
+static SVCB vcb;
+static SFCB fcb;
+static SGlob glob;
+static UInt8 *ref;
+
+static void
+volume_begin(UInt32 totalBlocks, bool flat)
+{
+	size_t bitmapBytes;
+
+	bzero(&vcb, sizeof(vcb));
+	bzero(&fcb, sizeof(fcb));
+	bzero(&glob, sizeof(glob));
+	vcb.vcbTotalBlocks = totalBlocks;
+	vcb.vcbBlockSize = 4096;
+	fcb.fcbBlockSize = diskBlockSize = 4096;
+	glob.calculatedVCB = &vcb;
+	glob.calculatedAllocationsFCB = &fcb;
+
+	/* Whole segments, so the last one compares cleanly */
+	bitmapBytes = roundup(((size_t)totalBlocks + 7) / 8, (size_t)diskBlockSize);
+	disk = calloc(1, bitmapBytes);
+	ref = calloc(totalBlocks, 1);
+	assert(disk != NULL && ref != NULL);
+
+	gFlatMinSegments = flat ? 0 : UINT32_MAX;
+	assert_no_err(BitMapCheckBegin(&glob));
+	assert((gFlatBitmap != NULL) == flat);
+
+	/* BitMapCheckBegin marks the volume header blocks */
+	ref[0] = ref[totalBlocks - 1] = 1;
+}
+
+static void
+volume_end(void)
+{
+	BitMapCheckEnd();
+	free(disk);
+	free(ref);
+	disk = NULL;
+	ref = NULL;
+}
+
+static void
+ref_to_disk(void)
+{
+	UInt32 b;
+
+	bzero(disk, roundup(((size_t)vcb.vcbTotalBlocks + 7) / 8, (size_t)diskBlockSize));
+	for (b = 0; b < vcb.vcbTotalBlocks; b++) {
+		if (ref[b])
+			disk[b / 8] |= 0x80 >> (b % 8);
+	}
+}
+
+static UInt32
+ref_count(void)
+{
+	UInt32 b, n = 0;
+
+	for (b = 0; b < vcb.vcbTotalBlocks; b++)
+		n += ref[b];
+	return n;
+}
+
+/*
+ * Mark and free random extents, some overlapping, on both the engine
+ * and the reference, then check that the engine's bitmap matches the
+ * reference bit for bit, the way CheckVolumeBitMap sees it.
+ */
+static void
+test_engine(UInt32 totalBlocks, bool flat)
+{
+	UInt32 i, b, start, count, overlaps = 0;
+	UInt32 *seg;
+	int err;
+	bool refOverlap;
+
+	srandom(totalBlocks);
+	volume_begin(totalBlocks, flat);
+
+	for (i = 0; i < 20000; i++) {
+		/* Mostly short extents, sometimes ones that span segments */
+		count = (random() % 8 == 0) ? 1 + random() % 5000 : 1 + random() % 40;
+		start = random() % (totalBlocks - count);
+
+		if (random() % 4 == 0) {
+			refOverlap = false;
+			for (b = start; b < start + count; b++) {
+				if (!ref[b])
+					refOverlap = true;
+				ref[b] = 0;
+			}
+			err = ReleaseBitmapBits(start, count);
+		} else {
+			refOverlap = false;
+			for (b = start; b < start + count; b++) {
+				if (ref[b])
+					refOverlap = true;
+				ref[b] = 1;
+			}
+			err = CaptureBitmapBits(start, count);
+		}
+		assert_equal_int(err, refOverlap ? E_OvlExt : noErr);
+		overlaps += refOverlap;
+	}
+	assert(overlaps > 0);
+
+	/* Out of range */
+	assert_equal_int(CaptureBitmapBits(totalBlocks - 1, 2), vcInvalidExtentErr);
+
+	/* Every segment, as the readers see it */
+	for (b = 0; b < totalBlocks; b += kBitsPerSegment) {
+		UInt32 n;
+
+		(void) GetSegmentBitmap(b, &seg, kTestingBits);
+		for (n = 0; n < kBitsPerSegment && b + n < totalBlocks; n++) {
+			UInt32 word = SWAP_BE32(seg[n / kBitsPerWord]);
+			int isSet = (word & (kMSBBitSetInWord >> (n & kBitsWithinWordMask))) != 0;
+			assert_equal_int(isSet, ref[b + n]);
+		}
+	}
+
+	/* Released bits can be counted twice; UpdateFreeBlockCount recounts */
+	UpdateFreeBlockCount(&glob);
+	assert_equal_int(gBitsMarked, ref_count());
+	assert_equal_int(vcb.vcbFreeBlocks, totalBlocks - ref_count());
+
+	/* A matching on-disk bitmap */
+	ref_to_disk();
+	lastMessage = 0;
+	glob.VIStat = 0;
+	assert_no_err(CheckVolumeBitMap(&glob, false));
+	assert_equal_int(glob.VIStat & S_VBM, 0);
+	assert_equal_int(lastMessage, 0);
+
+	/* A block marked used on disk that nothing owns */
+	for (b = totalBlocks / 2; ref[b]; b++)
+		;
+	disk[b / 8] |= 0x80 >> (b % 8);
+	assert_no_err(CheckVolumeBitMap(&glob, false));
+	assert(glob.VIStat & S_VBM);
+	assert_equal_int(lastMessage, E_VBMDamagedOverAlloc);
+
+	/* A block in use marked free on disk */
+	ref_to_disk();
+	for (b = totalBlocks / 3; !ref[b]; b++)
+		;
+	disk[b / 8] &= ~(0x80 >> (b % 8));
+	lastMessage = 0;
+	glob.VIStat = 0;
+	assert_no_err(CheckVolumeBitMap(&glob, false));
+	assert(glob.VIStat & S_VBM);
+	assert_equal_int(lastMessage, E_VBMDamaged);
+
+	/* Repair writes the in-memory bitmap back */
+	assert_no_err(CheckVolumeBitMap(&glob, true));
+	lastMessage = 0;
+	glob.VIStat = 0;
+	assert_no_err(CheckVolumeBitMap(&glob, false));
+	assert_equal_int(glob.VIStat & S_VBM, 0);
+
+	/* Trim covers exactly the free blocks */
+	trimmedBlocks = 0;
+	trimmedExtents = 0;
+	TrimFreeBlocks(&glob);
+	assert_equal_ll((long long)trimmedBlocks, (long long)(totalBlocks - ref_count()));
+
+	/* A contiguous allocation lands on free blocks */
+	assert_no_err(AllocateContigBitmapBits(&vcb, 100, &start));
+	for (b = start; b < start + 100; b++) {
+		assert_equal_int(ref[b], 0);
+		ref[b] = 1;
+	}
+	UpdateFreeBlockCount(&glob);
+	assert_equal_int(gBitsMarked, ref_count());
+
+	volume_end();
+}
+
+static void
+test_full_and_empty_segments(bool flat)
+{
+	UInt32 totalBlocks = 64 * kBitsPerSegment;
+	UInt32 *seg;
+
+	volume_begin(totalBlocks, flat);
+
+	/* Fill segment 3, then free one bit of it, then fill it again */
+	assert_no_err(CaptureBitmapBits(3 * kBitsPerSegment, kBitsPerSegment));
+	(void) GetSegmentBitmap(3 * kBitsPerSegment, &seg, kTestingBits);
+	assert(seg == gFullBitmapSegment);
+
+	assert_no_err(ReleaseBitmapBits(3 * kBitsPerSegment + 17, 1));
+	(void) GetSegmentBitmap(3 * kBitsPerSegment, &seg, kTestingBits);
+	assert(seg != gFullBitmapSegment && seg != gEmptyBitmapSegment);
+
+	assert_no_err(CaptureBitmapBits(3 * kBitsPerSegment + 17, 1));
+	(void) GetSegmentBitmap(3 * kBitsPerSegment, &seg, kTestingBits);
+	assert(seg == gFullBitmapSegment);
+
+	/* Empty it completely */
+	assert_no_err(ReleaseBitmapBits(3 * kBitsPerSegment, kBitsPerSegment));
+	(void) GetSegmentBitmap(3 * kBitsPerSegment, &seg, kTestingBits);
+	assert(seg == gEmptyBitmapSegment);
+
+	/* Untouched segments read as empty */
+	(void) GetSegmentBitmap(10 * kBitsPerSegment, &seg, kTestingBits);
+	assert(seg == gEmptyBitmapSegment);
+
+	volume_end();
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Mark 'count' extents spread over a volume, in random order as a
+ * catalog walk would find them, then compare with the on-disk bitmap.
+ * Best of three runs for each engine; the volume is large.
+ */
+static void
+benchmark(UInt32 count)
+{
+	static const char *names[] = { "segment tree", "flat" };
+	UInt32 *starts, *lengths;
+	UInt32 totalBlocks, i, b, marked[2] = { 0, 0 };
+	double best[2][2], t0, t1, t2;
+	int engine, run;
+
+	/* About 8 used and 9 free blocks per extent */
+	starts = malloc(count * sizeof(UInt32));
+	lengths = malloc(count * sizeof(UInt32));
+	assert(starts != NULL && lengths != NULL);
+
+	srandom(1);
+	for (i = 0, b = kBitsPerSegment; i < count; i++) {
+		lengths[i] = 1 + random() % 15;
+		starts[i] = b;
+		b += lengths[i] + 1 + random() % 15;
+	}
+	totalBlocks = b + kBitsPerSegment;
+	for (i = count - 1; i > 0; i--) {
+		UInt32 j = random() % (i + 1), t;
+
+		t = starts[i]; starts[i] = starts[j]; starts[j] = t;
+		t = lengths[i]; lengths[i] = lengths[j]; lengths[j] = t;
+	}
+
+	printf("%u extents on %u blocks\n", count, totalBlocks);
+	printf("%-14s %12s %12s %10s\n", "engine", "capture ms", "compare ms", "MB");
+	for (engine = 0; engine < 2; engine++) {
+		size_t heap = 0;
+
+		for (run = 0; run < 3; run++) {
+			volume_begin(totalBlocks, engine == 1);
+			free(ref);
+			ref = NULL;
+
+			t0 = now();
+			for (i = 0; i < count; i++)
+				assert_no_err(CaptureBitmapBits(starts[i], lengths[i]));
+			t1 = now();
+
+			/* The same bitmap on disk, so the compare reads all of it */
+			for (b = 0; b < totalBlocks; b += kBitsPerSegment) {
+				UInt32 *seg;
+
+				(void) GetSegmentBitmap(b, &seg, kTestingBits);
+				memcpy(disk + b / 8, seg, kBytesPerSegment);
+			}
+			glob.VIStat = 0;
+			t2 = now();
+			assert_no_err(CheckVolumeBitMap(&glob, false));
+			t2 = now() - t2;
+			assert_equal_int(glob.VIStat & S_VBM, 0);
+
+			if (run == 0 || t1 - t0 < best[engine][0])
+				best[engine][0] = t1 - t0;
+			if (run == 0 || t2 < best[engine][1])
+				best[engine][1] = t2;
+			marked[engine] = gBitsMarked;
+			heap = gFlatBitmap ? gFlatBitmapSize : (size_t)gBMS_PoolCount * kBMS_NodesPerPool * sizeof(BMS_Node);
+			volume_end();
+		}
+		printf("%-14s %12.1f %12.1f %10.1f\n", names[engine], best[engine][0] * 1e3, best[engine][1] * 1e3,
+		    heap / 1048576.0);
+	}
+	assert_equal_int(marked[0], marked[1]);
+
+	free(starts);
+	free(lengths);
+}
+
+int main(int argc, char *argv[])
+{
+	test_full_and_empty_segments(false);
+	test_full_and_empty_segments(true);
+	test_engine(3 * 1024 * 1024 + 123, false);
+	test_engine(3 * 1024 * 1024 + 123, true);
+	benchmark(argc > 1 ? (UInt32)strtoul(argv[1], NULL, 0) : 10000000);
+
+	printf("[PASSED] fsck_bitmap_test\n");
+
+	return 0;
+}
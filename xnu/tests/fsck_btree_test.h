@@ -0,0 +1,514 @@
+/*
+ * Copyright (c) 2014-2015 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef hfs_fsck_btree_test_h
+#define hfs_fsck_btree_test_h
+
+/*
+ * Builds the fsck_hfs B-tree library (dfalib) for tests that run it on
+ * a B-tree file kept in memory, with helpers to make trees of test
+ * records and to check them node by node.  Record i has a key and a
+ * size derived from i, and starts with i.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FSCK_BTREE_TEST 1
+
+#include "../lib_fsck_hfs/fsck_debug.h"
+
+/* What the B-tree sources use of check.h */
+enum {
+	LOG_TYPE_STDERR,
+	LOG_TYPE_INFO,
+};
+
+static struct {
+	int debug;
+	int cur_debug_level;
+} state;
+
+static void *ctx;
+
+#define fsck_print(c, type, ...)	((void)(c))
+
+void
+HexDump(const void *p_arg, unsigned length, int showOffsets)
+{
+	(void)p_arg; (void)length; (void)showOffsets;
+}
+
+#include "../lib_fsck_hfs/dfalib/BTree.c"
+#include "../lib_fsck_hfs/dfalib/BTreeAllocate.c"
+#include "../lib_fsck_hfs/dfalib/BTreeMiscOps.c"
+#include "../lib_fsck_hfs/dfalib/BTreeNodeOps.c"
+#include "../lib_fsck_hfs/dfalib/BTreeTreeOps.c"
+
+/* After SRuntime.h, which has its own true and false */
+#include <stdbool.h>
+
+#include "test-utils.h"
+
+/*
+ * The B-tree file: a large anonymous mapping that the node file grows
+ * into, so that node buffers never move.
+ */
+static UInt8 *fileData;
+static size_t fileMax;
+
+SInt32
+CompareKeys(BTreeControlBlockPtr btreePtr, KeyPtr searchKey, KeyPtr trialKey)
+{
+	return btreePtr->keyCompareProc((BTreeKeyPtr)searchKey, (BTreeKeyPtr)trialKey);
+}
+
+Boolean
+NodesAreContiguous(SFCB *fcb, UInt32 nodeSize)
+{
+	(void)fcb; (void)nodeSize;
+	return true;
+}
+
+/* Nodes stay in host byte order */
+int
+hfs_swap_BTNode(BlockDescriptor *src, SFCB *fcb, enum HFSBTSwapDirection direction)
+{
+	(void)src; (void)fcb; (void)direction;
+	return 0;
+}
+
+static OSStatus
+GetTestBlock(SFCB *fcb, UInt32 blockNum, GetBlockOptions options, BlockDescriptor *block)
+{
+	assert((UInt64)(blockNum + 1) * fcb->fcbBlockSize <= fcb->fcbLogicalSize);
+	block->buffer = fileData + (size_t)blockNum * fcb->fcbBlockSize;
+	block->blockNum = blockNum;
+	block->blockSize = fcb->fcbBlockSize;
+	block->blockHeader = NULL;
+	if (options & kGetEmptyBlock)
+		bzero(block->buffer, fcb->fcbBlockSize);
+	return noErr;
+}
+
+static OSStatus
+ReleaseTestBlock(SFCB *fcb, BlockDescPtr block, ReleaseBlockOptions options)
+{
+	(void)fcb; (void)block; (void)options;
+	return noErr;
+}
+
+static OSStatus
+SetTestEndOfFork(SFCB *fcb, FSSize minEOF, FSSize maxEOF)
+{
+	(void)maxEOF;
+	if (minEOF > fileMax)
+		return dskFulErr;
+	fcb->fcbLogicalSize = fcb->fcbPhysicalSize = minEOF;
+	return noErr;
+}
+
+/*
+ * Keys are a 2-byte length, a 4-byte parent ID and a name, as in the
+ * catalog, compared as parent ID then name.  In the HFS-style tree the
+ * name is always 6 bytes and index keys are padded to maxKeyLength.
+ */
+typedef struct {
+	UInt16 keyLength;
+	UInt32 parentID;
+	UInt8 name[64];
+} __attribute__((packed)) TestKey;
+
+static SInt32
+CompareTestKeys(BTreeKeyPtr a, BTreeKeyPtr b)
+{
+	const TestKey *ka = (const TestKey *)a, *kb = (const TestKey *)b;
+	int na = ka->keyLength - 4, nb = kb->keyLength - 4, r;
+
+	if (ka->parentID != kb->parentID)
+		return (ka->parentID < kb->parentID) ? -1 : 1;
+	r = memcmp(ka->name, kb->name, MIN(na, nb));
+	return r ? r : na - nb;
+}
+
+typedef enum {
+	kCatalogTree,		// 4K nodes, variable index keys, long names and records
+	kExtentsTree,		// 512-byte nodes, fixed index keys
+	kSmallRecordTree,	// 4K nodes, short keys and records (benchmarks)
+} TreeShape;
+
+static TreeShape treeShape;
+
+static inline void
+make_key(UInt32 i, TestKey *key)
+{
+	int len;
+
+	key->parentID = i / 50;
+	switch (treeShape) {
+	case kCatalogTree:
+		len = snprintf((char *)key->name, sizeof(key->name), "file-%09u-%.*s",
+					   i * 7, (int)(i % 23), "abcdefghijklmnopqrstuvwxyz");
+		if (len & 1)
+			key->name[len++] = '_';	// HFS Plus names are UTF-16, so keys have even lengths
+		break;
+	case kExtentsTree:
+		len = 6;
+		bzero(key->name, len);
+		key->name[2] = i >> 24;
+		key->name[3] = i >> 16;
+		key->name[4] = i >> 8;
+		key->name[5] = i;
+		break;
+	case kSmallRecordTree:
+	default:
+		len = snprintf((char *)key->name, sizeof(key->name), "%08x", i);
+		break;
+	}
+	key->keyLength = 4 + len;
+}
+
+static inline UInt16
+record_size(UInt32 i)
+{
+	switch (treeShape) {
+	case kCatalogTree:
+		return (8 + (i * 13) % 200) & ~1;
+	case kExtentsTree:
+		return 12;
+	case kSmallRecordTree:
+	default:
+		return 16;
+	}
+}
+
+static inline void
+make_record(UInt32 i, UInt8 *rec)
+{
+	UInt16 size = record_size(i);
+
+	memset(rec, (UInt8)i, size);
+	memcpy(rec, &i, sizeof(i));
+}
+
+/*
+ * Room for 'count' records of a shape, with a margin for the index
+ * nodes and for the half full (or, after deletes, emptier) nodes that
+ * BTInsertRecord leaves behind.
+ */
+static inline size_t
+file_bytes(TreeShape shape, UInt32 count)
+{
+	size_t recordBytes;
+
+	switch (shape) {
+	case kCatalogTree:
+		recordBytes = 2 + 4 + 38 + 208 + 2;
+		break;
+	case kExtentsTree:
+		recordBytes = 2 + 4 + 6 + 12 + 2;
+		break;
+	case kSmallRecordTree:
+	default:
+		recordBytes = 2 + 4 + 8 + 16 + 2;
+		break;
+	}
+	return (size_t)count * recordBytes * 4 + 1024 * 1024;
+}
+
+#define SET_OFFSET(node, nodeSize, rec, off)	\
+	(*(UInt16 *)((UInt8 *)(node) + (nodeSize) - 2 * ((rec) + 1)) = (off))
+
+/*
+ * An empty B-tree: a header node and nothing else.  'fileBytes' is the
+ * most the file may grow to.
+ */
+static inline SFCB *
+tree_create(TreeShape shape, size_t fileBytes)
+{
+	UInt16 nodeSize = (shape == kExtentsTree) ? 512 : 4096;
+	UInt16 maxKeyLength = (shape == kExtentsTree) ? 10 : 516;
+	UInt32 attributes = kBTBigKeysMask | ((shape == kExtentsTree) ? 0 : kBTVariableIndexKeysMask);
+	SFCB *fcb = calloc(1, sizeof(*fcb));
+	BTreeControlBlock *btcb = calloc(1, sizeof(*btcb));
+	BTNodeDescriptor *desc;
+	BTHeaderRec *header;
+	UInt16 offset;
+
+	assert(fcb != NULL && btcb != NULL);
+	treeShape = shape;
+	fileMax = roundup(fileBytes, nodeSize);
+	fileData = mmap(NULL, fileMax, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+	assert(fileData != MAP_FAILED);
+
+	fcb->fcbBtree = btcb;
+	fcb->fcbBlockSize = nodeSize;
+	fcb->fcbLogicalSize = fcb->fcbPhysicalSize = nodeSize;
+	btcb->fcbPtr = fcb;
+	btcb->nodeSize = nodeSize;
+	btcb->maxKeyLength = maxKeyLength;
+	btcb->attributes = attributes;
+	btcb->totalNodes = 1;
+	btcb->getBlockProc = GetTestBlock;
+	btcb->releaseBlockProc = ReleaseTestBlock;
+	btcb->setEndOfForkProc = SetTestEndOfFork;
+	btcb->keyCompareProc = CompareTestKeys;
+
+	/* Header record, user data record and map record, as newfs writes them */
+	desc = (BTNodeDescriptor *)fileData;
+	desc->kind = kBTHeaderNode;
+	desc->numRecords = 3;
+	offset = sizeof(BTNodeDescriptor);
+	SET_OFFSET(fileData, nodeSize, 0, offset);
+	header = (BTHeaderRec *)(fileData + offset);
+	header->nodeSize = nodeSize;
+	header->maxKeyLength = maxKeyLength;
+	header->totalNodes = 1;
+	header->attributes = attributes;
+	offset += sizeof(BTHeaderRec);
+	SET_OFFSET(fileData, nodeSize, 1, offset);
+	offset += 128;				// kBTreeHeaderUserBytes
+	SET_OFFSET(fileData, nodeSize, 2, offset);
+	fileData[offset] = 0x80;		// the header node
+	offset = nodeSize - 2 * 4;
+	SET_OFFSET(fileData, nodeSize, 3, offset);
+
+	return fcb;
+}
+
+static inline void
+tree_destroy(SFCB *fcb)
+{
+	munmap(fileData, fileMax);
+	fileData = NULL;
+	free(fcb->fcbBtree);
+	free(fcb);
+}
+
+static inline BTNodeDescriptor *
+node_at(BTreeControlBlock *btcb, UInt32 nodeNum)
+{
+	assert(nodeNum < btcb->totalNodes);
+	return (BTNodeDescriptor *)(fileData + (size_t)nodeNum * btcb->nodeSize);
+}
+
+static inline UInt8 *
+record_at(BTreeControlBlock *btcb, BTNodeDescriptor *node, UInt16 index)
+{
+	UInt16 *offsets = (UInt16 *)((UInt8 *)node + btcb->nodeSize);
+
+	return (UInt8 *)node + offsets[-1 - index];
+}
+
+/* The child pointer of an index record */
+static inline UInt32
+child_of(BTreeControlBlock *btcb, UInt8 *rec)
+{
+	UInt16 keySize;
+	UInt32 child;
+
+	if (btcb->attributes & kBTVariableIndexKeysMask)
+		keySize = ((TestKey *)rec)->keyLength + 2;
+	else
+		keySize = btcb->maxKeyLength + 2;
+	keySize = (keySize + 1) & ~1;
+	memcpy(&child, rec + keySize, sizeof(child));
+	return child;
+}
+
+static inline bool
+node_in_use(BTreeControlBlock *btcb, UInt32 nodeNum)
+{
+	UInt32 mapNode = kHeaderNodeNum, base = 0, bits;
+	BTNodeDescriptor *node;
+	UInt8 *map;
+	UInt16 index;
+
+	for (;;) {
+		node = node_at(btcb, mapNode);
+		index = (mapNode == kHeaderNodeNum) ? 2 : 0;
+		map = record_at(btcb, node, index);
+		bits = (record_at(btcb, node, index + 1) - map) * 8;
+		if (nodeNum < base + bits) {
+			nodeNum -= base;
+			return (map[nodeNum / 8] & (0x80 >> (nodeNum % 8))) != 0;
+		}
+		base += bits;
+		mapNode = node->fLink;
+		assert(mapNode != 0);
+	}
+}
+
+/*
+ * Walk every level of the tree left to right and check the links,
+ * heights, kinds and key order; that each index record has the first
+ * key of its child; that the map marks exactly the header, the map
+ * nodes and the nodes of the tree; and that records 0 .. count - 1
+ * can be found if they are in 'live', and not otherwise.
+ *
+ * A NULL 'live' means that every record is in a tree that has never
+ * had a delete, so only its root may hold a single index record; in
+ * large trees only every 7th record is searched for.
+ *
+ * Returns the number of leaf nodes.
+ */
+static inline UInt32
+tree_verify(SFCB *fcb, const UInt8 *live, UInt32 count)
+{
+	BTreeControlBlock *btcb = fcb->fcbBtree;
+	UInt32 nodeNum, leftmost, prev, records, liveCount = 0, leaves = 0, i;
+	UInt8 *seen, *rec, lastKey[sizeof(TestKey)];
+	BTNodeDescriptor *node, *child;
+	UInt16 height, index;
+	bool haveKey;
+
+	for (i = 0; i < count; i++)
+		liveCount += (live == NULL) ? 1 : live[i];
+	assert_equal_int(btcb->leafRecords, liveCount);
+	assert((UInt64)btcb->totalNodes * btcb->nodeSize <= fcb->fcbLogicalSize);
+	if (liveCount == 0) {
+		assert_equal_int(btcb->treeDepth, 0);
+		assert_equal_int(btcb->rootNode, 0);
+	}
+
+	seen = calloc(btcb->totalNodes, 1);
+	assert(seen != NULL);
+	leftmost = btcb->rootNode;
+	for (height = btcb->treeDepth; height > 0; height--) {
+		records = 0;
+		prev = 0;
+		haveKey = false;
+		for (nodeNum = leftmost; nodeNum != 0; nodeNum = node->fLink) {
+			node = node_at(btcb, nodeNum);
+			assert(!seen[nodeNum]);
+			seen[nodeNum] = 1;
+			assert_equal_int(node->height, height);
+			assert_equal_int(node->kind, height == 1 ? kBTLeafNode : kBTIndexNode);
+			assert_equal_int(node->bLink, prev);
+			assert(node_in_use(btcb, nodeNum));
+			assert(node->numRecords > 0);
+
+			for (index = 0; index < node->numRecords; index++) {
+				rec = record_at(btcb, node, index);
+				if (haveKey)
+					assert(CompareTestKeys((BTreeKeyPtr)lastKey, (BTreeKeyPtr)rec) < 0);
+				memcpy(lastKey, rec, ((TestKey *)rec)->keyLength + 2);
+				haveKey = true;
+				if (height > 1) {
+					child = node_at(btcb, child_of(btcb, rec));
+					assert_equal_int(child->height, height - 1);
+					assert_equal_int(CompareTestKeys((BTreeKeyPtr)rec, (BTreeKeyPtr)record_at(btcb, child, 0)), 0);
+				}
+			}
+			if (live == NULL && height > 1 && nodeNum != btcb->rootNode)
+				assert(node->numRecords >= 2);
+			records += node->numRecords;
+			prev = nodeNum;
+			if (height == 1)
+				leaves++;
+		}
+		if (height == 1) {
+			assert_equal_int(records, liveCount);
+			assert_equal_int(leftmost, btcb->firstLeafNode);
+			assert_equal_int(prev, btcb->lastLeafNode);
+		} else {
+			leftmost = child_of(btcb, record_at(btcb, node_at(btcb, leftmost), 0));
+		}
+	}
+
+	/* Nothing allocated is lost, and nothing in the tree is free */
+	records = 0;
+	for (i = 0; i < btcb->totalNodes; i++) {
+		if (!node_in_use(btcb, i))
+			continue;
+		records++;
+		if (i != kHeaderNodeNum && !seen[i])
+			assert_equal_int(node_at(btcb, i)->kind, kBTMapNode);
+	}
+	assert_equal_int(records, btcb->totalNodes - btcb->freeNodes);
+
+	for (i = 0; i < count; i += (live == NULL && count > 5000) ? 7 : 1) {
+		BTreeIterator iterator;
+		FSBufferDescriptor buffer;
+		UInt8 data[256];
+		UInt16 size;
+		UInt32 value;
+		OSStatus err;
+
+		bzero(&iterator, sizeof(iterator));
+		make_key(i, (TestKey *)&iterator.key);
+		buffer.bufferAddress = data;
+		buffer.itemSize = sizeof(data);
+		buffer.itemCount = 1;
+		err = BTSearchRecord(fcb, &iterator, kInvalidMRUCacheKey, &buffer, &size, &iterator);
+		if (live == NULL || live[i]) {
+			assert_no_err(err);
+			assert_equal_int(size, record_size(i));
+			memcpy(&value, data, sizeof(value));
+			assert_equal_int(value, i);
+		} else {
+			assert_equal_int(err, fsBTRecordNotFoundErr);
+		}
+	}
+
+	free(seen);
+	return leaves;
+}
+
+static inline void
+insert_record(SFCB *fcb, UInt32 i)
+{
+	BTreeIterator iterator;
+	FSBufferDescriptor buffer;
+	UInt8 rec[256];
+
+	bzero(&iterator, sizeof(iterator));
+	make_key(i, (TestKey *)&iterator.key);
+	make_record(i, rec);
+	buffer.bufferAddress = rec;
+	buffer.itemSize = record_size(i);
+	buffer.itemCount = 1;
+	assert_no_err(BTInsertRecord(fcb, &iterator, &buffer, record_size(i)));
+}
+
+static inline void
+delete_record(SFCB *fcb, UInt32 i)
+{
+	BTreeIterator iterator;
+
+	bzero(&iterator, sizeof(iterator));
+	make_key(i, (TestKey *)&iterator.key);
+	assert_no_err(BTDeleteRecord(fcb, &iterator));
+}
+
+#endif
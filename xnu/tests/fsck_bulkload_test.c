@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2014-2015 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Tests BTBulkLoad of the fsck_hfs B-tree library (dfalib) on a B-tree
+ * file kept in memory, checks the trees it builds node by node, and
+ * benchmarks it against BTInsertRecord.
+ *
+ * The benchmark loads 1,000,000 records by default; pass one or more
+ * counts to change it, e.g. "fsck_bulkload_test 1000000 10000000 50000000".
+ */
+
+#include <time.h>
+
+#include "fsck_btree_test.h"
+
+/* The record stream for BTBulkLoad: records first .. last - 1 */
+typedef struct {
+	UInt32 next;
+	UInt32 last;
+	bool repeat;			// hand out one record twice
+	UInt8 key[sizeof(TestKey)];
+	UInt8 rec[256];
+} RecordSource;
+
+static OSStatus
+next_record(void *state, BTreeKeyPtr *keyPtr, UInt8 **recPtr, UInt16 *recSize)
+{
+	RecordSource *src = state;
+
+	if (src->next >= src->last)
+		return fsBTEndOfIterationErr;
+	make_key(src->next, (TestKey *)src->key);
+	make_record(src->next, src->rec);
+	*keyPtr = (BTreeKeyPtr)src->key;
+	*recPtr = src->rec;
+	*recSize = record_size(src->next);
+	if (src->repeat && src->next == src->last / 2)
+		src->repeat = false;
+	else
+		src->next++;
+	return noErr;
+}
+
+static void
+insert_records(SFCB *fcb, UInt32 first, UInt32 last)
+{
+	UInt32 i;
+
+	for (i = first; i < last; i++)
+		insert_record(fcb, i);
+}
+
+static void
+test_load(TreeShape shape, UInt32 count, UInt32 fillPercent)
+{
+	RecordSource src = { .next = 0, .last = count };
+	SFCB *fcb = tree_create(shape, file_bytes(shape, count));
+
+	assert_no_err(BTBulkLoad(fcb, next_record, &src, fillPercent));
+	tree_verify(fcb, NULL, count);
+
+	/* The tree takes ordinary inserts afterwards, but no second load */
+	if (count >= 1000) {
+		insert_records(fcb, count, count + 2000);
+		tree_verify(fcb, NULL, count + 2000);
+
+		src.next = 0;
+		src.last = 1;
+		assert_equal_int(BTBulkLoad(fcb, next_record, &src, fillPercent), paramErr);
+	}
+	tree_destroy(fcb);
+}
+
+/* Fill targets below the minimum are raised to it */
+static void
+test_low_fill(TreeShape shape)
+{
+	static const UInt32 fills[] = { 1, 10, 49 };
+	RecordSource src;
+	SFCB *fcb;
+	UInt32 count = 50000, leaves, i;
+
+	fcb = tree_create(shape, file_bytes(shape, count));
+	src = (RecordSource){ .next = 0, .last = count };
+	assert_no_err(BTBulkLoad(fcb, next_record, &src, kBulkLoadMinFillPercent));
+	leaves = tree_verify(fcb, NULL, count);
+	tree_destroy(fcb);
+
+	for (i = 0; i < lengthof(fills); i++) {
+		fcb = tree_create(shape, file_bytes(shape, count));
+		src = (RecordSource){ .next = 0, .last = count };
+		assert_no_err(BTBulkLoad(fcb, next_record, &src, fills[i]));
+		assert_equal_int(tree_verify(fcb, NULL, count), leaves);
+		tree_destroy(fcb);
+	}
+}
+
+static void
+test_duplicate(void)
+{
+	RecordSource src = { .next = 0, .last = 1000, .repeat = true };
+	SFCB *fcb;
+
+	fcb = tree_create(kExtentsTree, file_bytes(kExtentsTree, 1000));
+	assert_equal_int(BTBulkLoad(fcb, next_record, &src, 100), fsBTDuplicateRecordErr);
+	tree_destroy(fcb);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Load 'count' short records with BTBulkLoad, then insert them in key
+ * order with BTInsertRecord, as RebuildBTree did before.  No I/O; only
+ * the tree code is timed.
+ */
+static void
+benchmark(UInt32 count)
+{
+	RecordSource src = { .next = 0, .last = count };
+	BTreeControlBlock *btcb;
+	UInt32 bulkNodes, insertNodes;
+	double bulk, insert;
+	SFCB *fcb;
+
+	fcb = tree_create(kSmallRecordTree, file_bytes(kSmallRecordTree, count));
+	btcb = fcb->fcbBtree;
+	bulk = now();
+	assert_no_err(BTBulkLoad(fcb, next_record, &src, 100));
+	bulk = now() - bulk;
+	bulkNodes = btcb->totalNodes - btcb->freeNodes;
+	tree_destroy(fcb);
+
+	fcb = tree_create(kSmallRecordTree, file_bytes(kSmallRecordTree, count));
+	btcb = fcb->fcbBtree;
+	insert = now();
+	insert_records(fcb, 0, count);
+	insert = now() - insert;
+	insertNodes = btcb->totalNodes - btcb->freeNodes;
+	tree_destroy(fcb);
+
+	printf("%10u records: BTBulkLoad %8.3f s %9u nodes, BTInsertRecord %8.3f s %9u nodes (%.1fx)\n",
+		   count, bulk, bulkNodes, insert, insertNodes, insert / bulk);
+}
+
+int main(int argc, char *argv[])
+{
+	static const UInt32 counts[] = { 0, 1, 2, 10, 100, 1000, 20000, 200000 };
+	unsigned i;
+	int arg;
+
+	for (i = 0; i < lengthof(counts); i++) {
+		test_load(kCatalogTree, counts[i], 100);
+		test_load(kCatalogTree, counts[i], 75);
+		test_load(kExtentsTree, counts[i], 100);
+		test_load(kExtentsTree, counts[i], 75);
+	}
+	test_low_fill(kCatalogTree);
+	test_low_fill(kExtentsTree);
+	test_duplicate();
+	printf("[PASSED] fsck_bulkload_test\n");
+
+	if (argc > 1) {
+		for (arg = 1; arg < argc; arg++)
+			benchmark((UInt32)strtoul(argv[arg], NULL, 0));
+	} else {
+		benchmark(1000000);
+	}
+
+	return 0;
+}
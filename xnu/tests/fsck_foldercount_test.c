@@ -0,0 +1,645 @@
+/*
+ * Copyright (c) 2014-2015 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Tests how fsck_hfs checks the folder counts of an HFSX catalog
+ * (CheckFolderCount in CatalogCheck.c) on synthetic catalogs with wrong
+ * counts, missing kHFSHasFolderCountMask flags and directory hard links.
+ * Each catalog is checked with the count table filled in during the
+ * catalog walk, with the table running out of memory part way, and with
+ * the CountFolderRecords fallback; all must report exactly the folders
+ * that were damaged.
+ *
+ * The benchmark times the table against the chained 257-bucket table
+ * CheckFolderCount used before, which is kept here for comparison.  It
+ * uses catalogs of 100,000, 200,000 and 4,000,000 folders; the old table
+ * only runs on the first two, as it takes time quadratic in the number
+ * of folders.  Pass folder counts to change them, e.g.
+ * "fsck_foldercount_test 10000000".
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <hfs/hfs_format.h>
+
+#include "test-utils.h"
+
+#define FSCK_FOLDERCOUNT_TEST 1
+
+/*
+ * Enough of Scavenger.h and BTree.h for the folder count routines.  The
+ * catalog is an array of records, sorted by key, that BTSearchRecord
+ * and BTIterateRecord look in.
+ */
+typedef uint8_t Boolean;
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef int16_t SInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int16_t OSErr;
+typedef int32_t OSStatus;
+typedef UInt32 HFSCatalogNodeID;
+
+enum {
+	noErr = 0,
+	btNotFound = -32767,
+};
+
+enum {
+	E_FldCount = 580,
+	E_HsFldCount = 581,
+};
+
+enum {
+	kHFSAliasType = 0x66647270,	/* 'fdrp' */
+	kHFSAliasCreator = 0x4D414353	/* 'MACS' */
+};
+
+enum {
+	kNoHint = 0,
+	kBTreeFirstRecord = -1,
+	kBTreeNextRecord = 1,
+};
+
+#define ClearMemory(start,len)		bzero((void*)(start),(size_t)(len))
+
+union CatalogKey {
+	HFSCatalogKey		hfs;
+	HFSPlusCatalogKey	hfsPlus;
+};
+typedef union CatalogKey CatalogKey;
+
+typedef struct SFCB {
+	UInt32 fcbFileID;
+} SFCB;
+
+typedef struct SVCB {
+	UInt32 vcbFolderCount;
+} SVCB;
+
+typedef struct SGlob {
+	SVCB		*calculatedVCB;
+	SFCB		*calculatedCatalogFCB;
+	uint32_t	filelink_priv_dir_id;
+} SGlob, *SGlobPtr;
+
+typedef struct BTreeIterator {
+	UInt32		index;		/* of the record in the catalog */
+	CatalogKey	key;
+} BTreeIterator;
+
+typedef struct FSBufferDescriptor {
+	void		*bufferAddress;
+	UInt32		itemSize;
+	UInt32		itemCount;
+} FSBufferDescriptor;
+
+/* One record of the synthetic catalog */
+typedef struct {
+	UInt32 parentID;
+	UInt32 order;		/* among the records of the parent; 0 for its thread */
+	UInt32 cnid;
+	UInt32 folderCount;	/* as recorded in a folder record */
+	UInt16 recordType;
+	UInt16 flags;
+	bool dirLink;		/* a file record for a directory hard link */
+} TestRecord;
+
+static TestRecord *records;
+static UInt32 recordCount;
+static SFCB catalogFCB;
+static SVCB vcb;
+static SGlob glob;
+
+static Boolean
+VolumeObjectIsHFSX(SGlobPtr GPtr)
+{
+	(void)GPtr;
+	return true;
+}
+
+static void
+BuildCatalogKey(HFSCatalogNodeID parentID, const void *name, Boolean isHFSPlus, CatalogKey *key)
+{
+	(void)isHFSPlus;
+	assert(name == NULL);
+	bzero(&key->hfsPlus, sizeof(key->hfsPlus));
+	key->hfsPlus.keyLength = kHFSPlusCatalogKeyMinimumLength;
+	key->hfsPlus.parentID = parentID;
+}
+
+static int
+compare_records(const void *left, const void *right)
+{
+	const TestRecord *l = left, *r = right;
+
+	if (l->parentID != r->parentID)
+		return (l->parentID < r->parentID) ? -1 : 1;
+	return (l->order < r->order) ? -1 : (l->order > r->order);
+}
+
+/* Fill in the key and the record the B-tree would return for records[i] */
+static void
+get_record(UInt32 i, BTreeIterator *iterator, FSBufferDescriptor *btRecord, UInt16 *recordLen)
+{
+	const TestRecord *r = &records[i];
+	HFSPlusCatalogKey *key = &iterator->key.hfsPlus;
+
+	iterator->index = i;
+	bzero(key, sizeof(*key));
+	key->parentID = r->parentID;
+	if (r->order != 0) {
+		key->nodeName.length = 2;
+		key->nodeName.unicode[0] = r->order >> 16;
+		key->nodeName.unicode[1] = r->order & 0xffff;
+	}
+	key->keyLength = kHFSPlusCatalogKeyMinimumLength + 2 * key->nodeName.length;
+
+	bzero(btRecord->bufferAddress, btRecord->itemSize);
+	if (r->recordType == kHFSPlusFolderRecord) {
+		HFSPlusCatalogFolder *folder = btRecord->bufferAddress;
+
+		folder->recordType = kHFSPlusFolderRecord;
+		folder->flags = r->flags;
+		folder->folderID = r->cnid;
+		folder->folderCount = r->folderCount;
+		*recordLen = sizeof(*folder);
+	} else if (r->recordType == kHFSPlusFileRecord) {
+		HFSPlusCatalogFile *file = btRecord->bufferAddress;
+
+		file->recordType = kHFSPlusFileRecord;
+		file->flags = r->flags;
+		file->fileID = r->cnid;
+		if (r->dirLink) {
+			file->flags |= kHFSHasLinkChainMask;
+			file->userInfo.fdType = kHFSAliasType;
+			file->userInfo.fdCreator = kHFSAliasCreator;
+		}
+		*recordLen = sizeof(*file);
+	} else {
+		/* The buffer is too small for a whole thread record */
+		*(SInt16 *)btRecord->bufferAddress = r->recordType;
+		*recordLen = sizeof(HFSPlusCatalogThread);
+	}
+}
+
+static OSStatus
+BTSearchRecord(SFCB *fcb, BTreeIterator *searchIterator, UInt32 hint, FSBufferDescriptor *record,
+			   UInt16 *recordLen, BTreeIterator *resultIterator)
+{
+	const HFSPlusCatalogKey *key = &searchIterator->key.hfsPlus;
+	TestRecord target = { .parentID = key->parentID };
+	TestRecord *found;
+
+	(void)hint;
+	assert(fcb == &catalogFCB);
+	if (key->nodeName.length == 2)
+		target.order = (key->nodeName.unicode[0] << 16) | key->nodeName.unicode[1];
+	found = bsearch(&target, records, recordCount, sizeof(*records), compare_records);
+	if (found == NULL)
+		return btNotFound;
+	get_record((UInt32)(found - records), resultIterator, record, recordLen);
+	return noErr;
+}
+
+static OSStatus
+BTIterateRecord(SFCB *fcb, SInt16 operation, BTreeIterator *iterator, FSBufferDescriptor *record,
+				UInt16 *recordLen)
+{
+	UInt32 i;
+
+	assert(fcb == &catalogFCB);
+	assert(operation == kBTreeFirstRecord || operation == kBTreeNextRecord);
+	i = (operation == kBTreeFirstRecord) ? 0 : iterator->index + 1;
+	if (i >= recordCount)
+		return btNotFound;
+	get_record(i, iterator, record, recordLen);
+	return noErr;
+}
+
+/* What CheckFolderCount reported */
+typedef struct {
+	UInt32 folderID;
+	UInt32 correct;
+	UInt32 incorrect;
+} Report;
+
+static Report *countReports, *flagReports;
+static UInt32 countReportCount, flagReportCount, reportMax;
+
+int
+RcdFCntErr(SGlobPtr GPtr, OSErr type, UInt32 correct, UInt32 incorrect, HFSCatalogNodeID fid)
+{
+	assert(GPtr == &glob && type == E_FldCount);
+	assert(countReportCount < reportMax);
+	countReports[countReportCount++] = (Report){ fid, correct, incorrect };
+	return 0;
+}
+
+int
+RcdHsFldCntErr(SGlobPtr GPtr, OSErr type, UInt32 correct, UInt32 incorrect, HFSCatalogNodeID fid)
+{
+	assert(GPtr == &glob && type == E_HsFldCount);
+	assert(flagReportCount < reportMax);
+	flagReports[flagReportCount++] = (Report){ fid, correct, incorrect };
+	return 0;
+}
+
+/* Make the count table's calloc fail after a number of calls */
+static int callocFailAfter;
+
+static void *
+test_calloc(size_t count, size_t size)
+{
+	if (callocFailAfter > 0 && --callocFailAfter == 0)
+		return NULL;
+	return calloc(count, size);
+}
+
+OSErr CheckFolderCount(SGlobPtr GPtr);
+
+#define calloc(count, size)	test_calloc((count), (size))
+#include "../lib_fsck_hfs/dfalib/CatalogCheck.c"
+#undef calloc
+
+static int
+compare_reports(const void *left, const void *right)
+{
+	const Report *l = left, *r = right;
+
+	return (l->folderID < r->folderID) ? -1 : (l->folderID > r->folderID);
+}
+
+/*
+ * The synthetic catalog: a tree of 'folders' folders under the root,
+ * plus half as many files and an eighth as many directory hard links,
+ * with sparse CNIDs.  Every 97th folder has a wrong count, and every
+ * 89th is missing kHFSHasFolderCountMask; the expected reports are
+ * returned in folder ID order.
+ */
+static void
+catalog_make(UInt32 folders, Report **countsp, UInt32 *countCountp, Report **flagsp, UInt32 *flagCountp)
+{
+	UInt32 files = folders / 2, dirLinks = folders / 8;
+	UInt32 maxRecords = 2 * (folders + 2) + files + dirLinks + 16;
+	UInt32 maxID = kHFSFirstUserCatalogNodeID + 4 * (folders + files + dirLinks + 16);
+	UInt32 *folderIDs, *subfolders, made = 0, nextID = kHFSFirstUserCatalogNodeID, order = 1;
+	UInt32 privDir, i, n;
+	Report *counts, *flags;
+	TestRecord *r;
+
+	records = calloc(maxRecords, sizeof(*records));
+	folderIDs = malloc((folders + 2) * sizeof(*folderIDs));
+	subfolders = calloc(maxID, sizeof(*subfolders));
+	assert(records != NULL && folderIDs != NULL && subfolders != NULL);
+	recordCount = 0;
+
+#define ADD_RECORD(parent, type, id) \
+	(r = &records[recordCount++], r->parentID = (parent), r->recordType = (type), \
+	 r->cnid = (id), r->order = (type) == kHFSPlusFolderThreadRecord ? 0 : order++, r)
+
+	ADD_RECORD(kHFSRootParentID, kHFSPlusFolderRecord, kHFSRootFolderID);
+	ADD_RECORD(kHFSRootFolderID, kHFSPlusFolderThreadRecord, kHFSRootFolderID);
+	folderIDs[made++] = kHFSRootFolderID;
+
+	/* File hard links live here; a directory link in it isn't counted */
+	privDir = nextID++;
+	ADD_RECORD(kHFSRootFolderID, kHFSPlusFolderRecord, privDir);
+	ADD_RECORD(privDir, kHFSPlusFolderThreadRecord, privDir);
+	subfolders[kHFSRootFolderID]++;
+	glob.filelink_priv_dir_id = privDir;
+	for (i = 0; i < 4; i++)
+		ADD_RECORD(privDir, kHFSPlusFileRecord, nextID++)->dirLink = true;
+
+	for (i = 0; i < folders; i++) {
+		UInt32 parent = folderIDs[random() % made], id = nextID;
+
+		nextID += 1 + random() % 3;
+		ADD_RECORD(parent, kHFSPlusFolderRecord, id);
+		ADD_RECORD(id, kHFSPlusFolderThreadRecord, id);
+		subfolders[parent]++;
+		folderIDs[made++] = id;
+	}
+	for (i = 0; i < files + dirLinks; i++) {
+		UInt32 parent = folderIDs[random() % made];
+
+		ADD_RECORD(parent, kHFSPlusFileRecord, nextID++);
+		if (i >= files) {
+			r->dirLink = true;
+			subfolders[parent]++;
+		}
+	}
+	assert(recordCount <= maxRecords && nextID < maxID);
+#undef ADD_RECORD
+
+	/* Record the counts, and damage some */
+	counts = calloc(made + 1, sizeof(*counts));
+	flags = calloc(made + 1, sizeof(*flags));
+	assert(counts != NULL && flags != NULL);
+	*countCountp = *flagCountp = 0;
+	for (i = 0, n = 0; i < recordCount; i++) {
+		r = &records[i];
+		if (r->recordType != kHFSPlusFolderRecord)
+			continue;
+		n++;
+		r->folderCount = subfolders[r->cnid];
+		r->flags = kHFSHasFolderCountMask;
+		if (n % 97 == 0) {
+			r->folderCount += 1 + random() % 3;
+			counts[(*countCountp)++] = (Report){ r->cnid, subfolders[r->cnid], r->folderCount };
+		}
+		if (n % 89 == 0) {
+			r->flags = 0;
+			flags[(*flagCountp)++] = (Report){ r->cnid, kHFSHasFolderCountMask, 0 };
+		}
+	}
+	/* One more folder whose count is wrong, because a child was lost */
+	r = &records[0];
+	r->folderCount = subfolders[kHFSRootFolderID] + 1;
+	counts[(*countCountp)++] = (Report){ kHFSRootFolderID, subfolders[kHFSRootFolderID], r->folderCount };
+
+	qsort(records, recordCount, sizeof(*records), compare_records);
+	qsort(counts, *countCountp, sizeof(*counts), compare_reports);
+	qsort(flags, *flagCountp, sizeof(*flags), compare_reports);
+	*countsp = counts;
+	*flagsp = flags;
+
+	free(folderIDs);
+	free(subfolders);
+
+	glob.calculatedVCB = &vcb;
+	glob.calculatedCatalogFCB = &catalogFCB;
+	glob.filelink_priv_dir_id = privDir;
+	reportMax = made + 1;
+	countReports = calloc(reportMax, sizeof(*countReports));
+	flagReports = calloc(reportMax, sizeof(*flagReports));
+	assert(countReports != NULL && flagReports != NULL);
+}
+
+static void
+catalog_free(Report *counts, Report *flags)
+{
+	free(records);
+	records = NULL;
+	recordCount = 0;
+	free(counts);
+	free(flags);
+	free(countReports);
+	free(flagReports);
+	countReports = flagReports = NULL;
+	countReportCount = flagReportCount = 0;
+}
+
+/* Feed the count table the way CheckCatalogRecord does */
+static void
+catalog_walk(void)
+{
+	union {
+		HFSPlusCatalogFolder folder;
+		HFSPlusCatalogFile file;
+	} rec;
+	FSBufferDescriptor btRecord = { &rec, sizeof(rec), 1 };
+	BTreeIterator iterator;
+	UInt16 recordLen;
+	UInt32 i;
+
+	releaseFolderCountInfo();
+	gFolderCounts.enabled = VolumeObjectIsHFSX(&glob);
+	for (i = 0; i < recordCount; i++) {
+		get_record(i, &iterator, &btRecord, &recordLen);
+		if (rec.folder.recordType == kHFSPlusFolderRecord)
+			folderCountAdd(iterator.key.hfsPlus.parentID, &rec.folder);
+		else if (rec.file.recordType == kHFSPlusFileRecord &&
+			 isDirHardLink(&glob, &iterator.key.hfsPlus, &rec.file))
+			folderCountAdd(iterator.key.hfsPlus.parentID, NULL);
+	}
+}
+
+static void
+check_reports(const Report *expect, UInt32 expectCount, Report *reports, UInt32 count)
+{
+	UInt32 i;
+
+	qsort(reports, count, sizeof(*reports), compare_reports);
+	assert_equal_int(count, expectCount);
+	for (i = 0; i < count; i++) {
+		assert_equal_int(reports[i].folderID, expect[i].folderID);
+		assert_equal_int(reports[i].correct, expect[i].correct);
+		assert_equal_int(reports[i].incorrect, expect[i].incorrect);
+	}
+}
+
+typedef enum {
+	kTablePath,		/* counted during the catalog walk */
+	kTableFailsPath,	/* the table can't grow part way through the walk */
+	kFallbackPath,		/* not counted during the walk; CountFolderRecords */
+} CountPath;
+
+static void
+test_folder_count(UInt32 folders, CountPath path)
+{
+	Report *counts, *flags;
+	UInt32 countCount, flagCount;
+
+	catalog_make(folders, &counts, &countCount, &flags, &flagCount);
+	assert(countCount > 0 && (folders < 89 || flagCount > 0));
+
+	switch (path) {
+	case kTablePath:
+		catalog_walk();
+		assert(!gFolderCounts.failed);
+		break;
+	case kTableFailsPath:
+		/* The table is allocated, and then grows twice before it fails */
+		callocFailAfter = 3;
+		catalog_walk();
+		callocFailAfter = 0;
+		assert(gFolderCounts.failed && gFolderCounts.entries == NULL);
+		break;
+	case kFallbackPath:
+		releaseFolderCountInfo();
+		break;
+	}
+
+	assert_no_err(CheckFolderCount(&glob));
+	assert(gFolderCounts.entries == NULL && !gFolderCounts.enabled);
+	check_reports(counts, countCount, countReports, countReportCount);
+	check_reports(flags, flagCount, flagReports, flagReportCount);
+
+	catalog_free(counts, flags);
+}
+
+/*
+ * The chained table CheckFolderCount used before:  257 buckets, each
+ * with a list of the folders that hash to it.
+ */
+struct oldFolderCountInfo {
+	UInt32 folderID;
+	UInt32 recordedCount;
+	UInt32 computedCount;
+	struct oldFolderCountInfo *next;
+};
+
+#define kOldBuckets	257
+
+static struct oldFolderCountInfo *
+old_find_or_add(struct oldFolderCountInfo *fcip, UInt32 fid)
+{
+	struct oldFolderCountInfo *curp = &fcip[fid % kOldBuckets];
+
+	while (curp->folderID != 0) {
+		if (curp->folderID == fid)
+			return curp;
+		if (curp->next == NULL) {
+			curp->next = calloc(1, sizeof(*curp));
+			assert(curp->next != NULL);
+		}
+		curp = curp->next;
+	}
+	curp->folderID = fid;
+	return curp;
+}
+
+/* The old counting and comparing; returns the number of wrong counts */
+static UInt32
+old_folder_count(void)
+{
+	struct oldFolderCountInfo *fcip = calloc(kOldBuckets, sizeof(*fcip)), *curp;
+	union {
+		HFSPlusCatalogFolder folder;
+		HFSPlusCatalogFile file;
+	} rec;
+	FSBufferDescriptor btRecord = { &rec, sizeof(rec), 1 };
+	BTreeIterator iterator;
+	UInt16 recordLen;
+	UInt32 i, wrong = 0;
+
+	assert(fcip != NULL);
+	for (i = 0; i < recordCount; i++) {
+		get_record(i, &iterator, &btRecord, &recordLen);
+		if (rec.folder.recordType == kHFSPlusFolderRecord) {
+			old_find_or_add(fcip, rec.folder.folderID)->recordedCount = rec.folder.folderCount;
+			old_find_or_add(fcip, iterator.key.hfsPlus.parentID)->computedCount++;
+		} else if (rec.file.recordType == kHFSPlusFileRecord &&
+			   isDirHardLink(&glob, &iterator.key.hfsPlus, &rec.file)) {
+			old_find_or_add(fcip, iterator.key.hfsPlus.parentID)->computedCount++;
+		}
+	}
+	for (i = 0; i < kOldBuckets; i++) {
+		for (curp = &fcip[i]; curp; curp = curp->next) {
+			if (curp->folderID != 0 && curp->folderID != kHFSRootParentID &&
+			    curp->recordedCount != curp->computedCount)
+				wrong++;
+		}
+	}
+	for (i = 0; i < kOldBuckets; i++) {
+		struct oldFolderCountInfo *next;
+
+		for (curp = fcip[i].next; curp; curp = next) {
+			next = curp->next;
+			free(curp);
+		}
+	}
+	free(fcip);
+	return wrong;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	assert_no_err(clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+benchmark(UInt32 folders)
+{
+	Report *counts, *flags;
+	UInt32 countCount, flagCount, wrong;
+	double start, table, old = 0;
+
+	catalog_make(folders, &counts, &countCount, &flags, &flagCount);
+
+	start = now();
+	catalog_walk();
+	assert_no_err(CheckFolderCount(&glob));
+	table = now() - start;
+	assert_equal_int(countReportCount, countCount);
+
+	if (folders <= 200000) {
+		start = now();
+		wrong = old_folder_count();
+		old = now() - start;
+		assert_equal_int(wrong, countCount);
+		printf("%8u folders: %8.3f s with the table, %8.3f s with the old chained table\n",
+			   folders, table, old);
+	} else {
+		printf("%8u folders: %8.3f s with the table\n", folders, table);
+	}
+
+	catalog_free(counts, flags);
+}
+
+int main(int argc, char *argv[])
+{
+	static const UInt32 sizes[] = { 0, 1, 50, 3000, 50000 };
+	static const UInt32 benchSizes[] = { 100000, 200000, 4000000 };
+	unsigned i;
+	int arg;
+
+	srandom(1);
+	for (i = 0; i < lengthof(sizes); i++) {
+		test_folder_count(sizes[i], kTablePath);
+		test_folder_count(sizes[i], kFallbackPath);
+	}
+	test_folder_count(50000, kTableFailsPath);
+	printf("[PASSED] fsck_foldercount_test\n");
+
+	if (argc > 1) {
+		for (arg = 1; arg < argc; arg++)
+			benchmark((UInt32)strtoul(argv[arg], NULL, 0));
+	} else {
+		for (i = 0; i < lengthof(benchSizes); i++)
+			benchmark(benchSizes[i]);
+	}
+
+	return 0;
+}
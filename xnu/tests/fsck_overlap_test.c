@@ -0,0 +1,588 @@
+/*
+ * Copyright (c) 2014-2015 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Tests how fsck_hfs finds the owners of overlapping extents
+ * (FindOrigOverlapFiles in SVerify1.c) on synthetic cross-linked
+ * volumes, checks the result against a brute force search, and
+ * benchmarks it.
+ *
+ * The benchmark volume has 1,000,000 extents by default; pass a count
+ * to change it, e.g. "fsck_overlap_test 100000".
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <hfs/hfs_format.h>
+
+#include "test-utils.h"
+
+#define FSCK_OVERLAP_TEST 1
+
+/*
+ * Enough of Scavenger.h for the overlap routines.  The catalog,
+ * extents and attributes B-trees are arrays of records that
+ * GetBTreeRecord walks in order.
+ */
+typedef uint8_t Boolean;
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef int16_t SInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int16_t OSErr;
+typedef UInt32 HFSCatalogNodeID;
+typedef char *Ptr;
+typedef Ptr *Handle;
+typedef long Size;
+
+#define nil		NULL
+
+enum {
+	noErr = 0,
+	btNotFound = 32,
+	memFullErr = -108,
+};
+
+#define S_OverlappingExtents	0x0800
+
+#define kDataFork	0
+#define kRsrcFork	(-1)
+#define kEAData		1
+
+#define CopyMemory(src,dst,len)		bcopy((void*)(src),(void*)(dst),(size_t)(len))
+#define ClearMemory(start,len)		bzero((void*)(start),(size_t)(len))
+
+#ifndef XATTR_MAXNAMELEN
+#define XATTR_MAXNAMELEN	127
+#endif
+
+struct ExtentInfo {
+	HFSCatalogNodeID fileID;
+	UInt32	startBlock;
+	UInt32	blockCount;
+	UInt32	newStartBlock;
+	char *	attrname;
+	UInt8	forkType;
+	Boolean didRepair;
+};
+typedef struct ExtentInfo ExtentInfo;
+
+struct ExtentsTable {
+	UInt32				count;
+	ExtentInfo			extentInfo[1];
+};
+typedef struct ExtentsTable ExtentsTable;
+
+union ExtentKey {
+	HFSExtentKey		hfs;
+	HFSPlusExtentKey	hfsPlus;
+};
+typedef union ExtentKey ExtentKey;
+
+union ExtentRecord {
+	HFSExtentRecord		hfs;
+	HFSPlusExtentRecord	hfsPlus;
+};
+typedef union ExtentRecord ExtentRecord;
+
+union CatalogKey {
+	HFSCatalogKey		hfs;
+	HFSPlusCatalogKey	hfsPlus;
+};
+typedef union CatalogKey CatalogKey;
+
+union CatalogRecord {
+	SInt16				recordType;
+	HFSCatalogFile		hfsFile;
+	HFSPlusCatalogFile	hfsPlusFile;
+};
+typedef union CatalogRecord CatalogRecord;
+
+typedef struct SFCB {
+	UInt32				fcbFileID;
+	HFSExtentRecord		fcbExtents16;
+	HFSPlusExtentRecord	fcbExtents32;
+} SFCB;
+
+typedef struct SVCB {
+	SFCB				*vcbExtentsFile;
+	SFCB				*vcbCatalogFile;
+	SFCB				*vcbAllocationFile;
+	SFCB				*vcbStartupFile;
+	SFCB				*vcbAttributesFile;
+} SVCB;
+
+typedef struct SGlob {
+	UInt16				VIStat;
+	SVCB				*calculatedVCB;
+	SFCB				*calculatedExtentsFCB;
+	SFCB				*calculatedCatalogFCB;
+	SFCB				*calculatedAttributesFCB;
+	ExtentsTable		**overlappedExtents;
+} SGlob, *SGlobPtr;
+
+/* The handle routines of SStubs.c */
+static Handle
+NewHandleClear(Size byteCount)
+{
+	Handle h;
+
+	if (!(h = malloc(sizeof(Ptr) + sizeof(Size))))
+		return NULL;
+	if (!(*h = calloc(1, byteCount))) {
+		free(h);
+		return NULL;
+	}
+	*((Size *)(h + 1)) = byteCount;
+	return h;
+}
+
+static void
+DisposeHandle(Handle h)
+{
+	if (h) {
+		free(*h);
+		free(h);
+	}
+}
+
+static Size
+GetHandleSize(Handle h)
+{
+	return h ? *((Size *)(h + 1)) : 0;
+}
+
+static void
+SetHandleSize(Handle h, Size newSize)
+{
+	Ptr p;
+
+	if (h && (p = realloc(*h, newSize))) {
+		*h = p;
+		*((Size *)(h + 1)) = newSize;
+	}
+}
+
+static Boolean
+VolumeObjectIsHFSPlus(void)
+{
+	return true;
+}
+
+/* Attribute names are plain ASCII here */
+static int
+utf_encodestr(const u_int16_t *ucsp, size_t ucslen, u_int8_t *utf8p, size_t *utf8len, size_t buflen)
+{
+	size_t i;
+
+	for (i = 0; i < ucslen / 2 && i < buflen - 1; i++)
+		utf8p[i] = (u_int8_t)ucsp[i];
+	*utf8len = i;
+	return 0;
+}
+
+/* One file, or one attribute, of the synthetic volume */
+typedef struct {
+	UInt32 fileID;
+	UInt8 forkType;
+	bool overflow;			// in the extents B-tree rather than the catalog
+	const char *attrname;
+	HFSPlusExtentRecord extents;
+} TestRecord;
+
+static TestRecord *records;
+static UInt32 recordCount;
+static SFCB catalogFCB, extentsFCB, attributesFCB;
+
+static OSErr
+GetBTreeRecord(SFCB *fcb, int selectionIndex, void *key, void *data, UInt16 *dataSize, UInt32 *newHint)
+{
+	static UInt32 next;
+	TestRecord *r;
+	size_t i;
+
+	(void)dataSize; (void)newHint;
+	if (selectionIndex == 0x8001)
+		next = 0;
+
+	for (; next < recordCount; next++) {
+		r = &records[next];
+		if (fcb == &catalogFCB && !r->overflow && r->forkType == kDataFork) {
+			CatalogRecord *rec = data;
+
+			/* The resource fork is the next record */
+			bzero(rec, sizeof(*rec));
+			rec->hfsPlusFile.recordType = kHFSPlusFileRecord;
+			rec->hfsPlusFile.fileID = r->fileID;
+			memcpy(rec->hfsPlusFile.dataFork.extents, r->extents, sizeof(r->extents));
+			memcpy(rec->hfsPlusFile.resourceFork.extents, r[1].extents, sizeof(r->extents));
+			next += 2;
+			return noErr;
+		}
+		if (fcb == &extentsFCB && r->overflow) {
+			ExtentKey *k = key;
+			ExtentRecord *rec = data;
+
+			k->hfsPlus.fileID = r->fileID;
+			k->hfsPlus.forkType = r->forkType;
+			memcpy(rec->hfsPlus, r->extents, sizeof(r->extents));
+			next++;
+			return noErr;
+		}
+		if (fcb == &attributesFCB && r->forkType == kEAData) {
+			HFSPlusAttrKey *k = key;
+			HFSPlusAttrRecord *rec = data;
+
+			k->fileID = r->fileID;
+			k->attrNameLen = strlen(r->attrname);
+			for (i = 0; i < k->attrNameLen; i++)
+				k->attrName[i] = r->attrname[i];
+			rec->recordType = kHFSPlusAttrForkData;
+			memcpy(rec->forkData.theFork.extents, r->extents, sizeof(r->extents));
+			next++;
+			return noErr;
+		}
+	}
+	return btNotFound;
+}
+
+static OSErr AddExtentToOverlapList(SGlobPtr GPtr, HFSCatalogNodeID fileNumber, const char *attrName, UInt32 extentStartBlock, UInt32 extentBlockCount, UInt8 forkType);
+OSErr MergeOverlapList(SGlobPtr GPtr, ExtentsTable **extentsTableH);
+int FindOrigOverlapFiles(SGlobPtr GPtr);
+
+#include "../lib_fsck_hfs/dfalib/SVerify1.c"
+
+static SVCB vcb;
+static SGlob glob;
+
+static void
+volume_begin(UInt32 count)
+{
+	bzero(&vcb, sizeof(vcb));
+	bzero(&glob, sizeof(glob));
+	glob.calculatedVCB = &vcb;
+	glob.calculatedCatalogFCB = &catalogFCB;
+	glob.calculatedExtentsFCB = &extentsFCB;
+	glob.calculatedAttributesFCB = &attributesFCB;
+	records = calloc(count, sizeof(TestRecord));
+	assert(records != NULL);
+	recordCount = 0;
+}
+
+static void
+volume_end(void)
+{
+	ExtentsTable **table = glob.overlappedExtents;
+	UInt32 i;
+
+	if (table != NULL) {
+		for (i = 0; i < (**table).count; i++)
+			free((**table).extentInfo[i].attrname);
+		DisposeHandle((Handle)table);
+	}
+	free(records);
+	records = NULL;
+}
+
+static TestRecord *
+add_record(UInt32 fileID, UInt8 forkType, bool overflow, const char *attrname)
+{
+	TestRecord *r = &records[recordCount++];
+
+	r->fileID = fileID;
+	r->forkType = forkType;
+	r->overflow = overflow;
+	r->attrname = attrname;
+	return r;
+}
+
+/* Visit every extent of the volume in catalog, extents, attributes order */
+#define FOREACH_EXTENT(r, e)											\
+	for (UInt32 pass_ = 0; pass_ < 3; pass_++)							\
+		for (r = records; r < records + recordCount; r++)				\
+			if ((pass_ == 0 && !r->overflow && r->forkType != kEAData) ||	\
+				(pass_ == 1 && r->overflow) ||							\
+				(pass_ == 2 && r->forkType == kEAData))					\
+				for (e = r->extents; e < r->extents + kHFSPlusExtentDensity && e->startBlock; e++)
+
+/*
+ * What the verify stage leaves in the overlap list: capturing the
+ * extents in order, every extent that lands on blocks already in use.
+ * It is added once for each check that finds it, so add it twice.
+ */
+static void
+verify_stage(void)
+{
+	UInt8 *used;
+	UInt32 maxBlock = 0, b;
+	TestRecord *r;
+	HFSPlusExtentDescriptor *e;
+	bool overlaps;
+
+	FOREACH_EXTENT(r, e)
+		maxBlock = MAX(maxBlock, e->startBlock + e->blockCount);
+	used = calloc(maxBlock, 1);
+	assert(used != NULL);
+
+	FOREACH_EXTENT(r, e) {
+		overlaps = false;
+		for (b = e->startBlock; b < e->startBlock + e->blockCount; b++) {
+			overlaps |= used[b];
+			used[b] = 1;
+		}
+		if (overlaps) {
+			assert_no_err(AddExtentToOverlapList(&glob, r->fileID, r->attrname, e->startBlock, e->blockCount, r->forkType));
+			assert_no_err(AddExtentToOverlapList(&glob, r->fileID, r->attrname, e->startBlock, e->blockCount, r->forkType));
+		}
+	}
+	free(used);
+}
+
+static bool
+list_contains(UInt32 fileID, UInt8 forkType, const char *attrname, const HFSPlusExtentDescriptor *e)
+{
+	ExtentsTable *table = *glob.overlappedExtents;
+	ExtentInfo *info;
+	UInt32 i;
+
+	for (i = 0; i < table->count; i++) {
+		info = &table->extentInfo[i];
+		if (info->fileID == fileID && info->forkType == forkType &&
+			info->startBlock == e->startBlock && info->blockCount == e->blockCount &&
+			(attrname == NULL ? info->attrname == NULL :
+			 info->attrname != NULL && strcmp(info->attrname, attrname) == 0))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * The list must hold exactly the extents that overlap some other
+ * extent of the volume, each one once.
+ */
+static void
+check_overlap_list(void)
+{
+	ExtentsTable *table = *glob.overlappedExtents;
+	TestRecord *r, *r2;
+	HFSPlusExtentDescriptor *e, *e2;
+	UInt32 expected = 0, i;
+
+	FOREACH_EXTENT(r, e) {
+		bool overlaps = false;
+
+		FOREACH_EXTENT(r2, e2) {
+			if (e2 != e && e2->startBlock < e->startBlock + e->blockCount &&
+				e->startBlock < e2->startBlock + e2->blockCount)
+				overlaps = true;
+		}
+		assert_equal_int(list_contains(r->fileID, r->forkType, r->attrname, e), overlaps);
+		expected += overlaps;
+	}
+	assert_equal_int(table->count, expected);
+
+	for (i = 1; i < table->count; i++)
+		assert(CompareExtentInfo(&table->extentInfo[i - 1], &table->extentInfo[i]) < 0);
+	assert(glob.VIStat & S_OverlappingExtents);
+}
+
+/*
+ * Files with a data and a resource fork, some overflow extents and
+ * some attributes, with 'crossLinks' extents pointed at blocks of
+ * other files.
+ */
+static void
+make_volume(UInt32 files, UInt32 crossLinks, unsigned seed)
+{
+	static const char *names[] = { "com.apple.ResourceFork", "com.apple.decmpfs", "user.tag" };
+	TestRecord *r;
+	HFSPlusExtentDescriptor *e;
+	UInt32 f, i, n, block = 16;
+
+	srandom(seed);
+	volume_begin(files * 4);
+	for (f = 0; f < files; f++) {
+		UInt32 fileID = kHFSFirstUserCatalogNodeID + f;
+
+		for (n = 0; n < 4; n++) {
+			if (n == 0)
+				r = add_record(fileID, kDataFork, false, NULL);
+			else if (n == 1)
+				r = add_record(fileID, kRsrcFork, false, NULL);
+			else if (n == 2 && random() % 8 == 0)
+				r = add_record(fileID, kDataFork, true, NULL);
+			else if (n == 3 && random() % 8 == 0)
+				r = add_record(fileID, kEAData, false, names[random() % 3]);
+			else
+				continue;
+
+			for (i = 0; i < (UInt32)(n == 1 ? random() % 2 : 1 + random() % 3); i++) {
+				r->extents[i].startBlock = block;
+				r->extents[i].blockCount = 1 + random() % 16;
+				block += r->extents[i].blockCount + random() % 4;
+			}
+		}
+	}
+
+	/* Point some extents at blocks that belong to other extents */
+	for (i = 0; i < crossLinks; i++) {
+		r = &records[random() % recordCount];
+		if (r->extents[0].startBlock == 0)
+			continue;
+		e = &r->extents[random() % kHFSPlusExtentDensity];
+		while (e->startBlock == 0)
+			e--;
+		e->startBlock = 16 + random() % (block - 16);
+		e->blockCount = 1 + random() % 16;
+	}
+}
+
+/* The same extent listed several times, and equal attribute names */
+static void
+test_duplicates(void)
+{
+	ExtentsTable **worker = NULL;
+	SGlob workerGlob;
+	char name1[] = "com.apple.decmpfs", name2[] = "com.apple.decmpfs";
+	HFSPlusExtentDescriptor e = { 100, 10 };
+	TestRecord *r;
+	int i;
+
+	volume_begin(4);
+	r = add_record(kHFSFirstUserCatalogNodeID, kDataFork, false, NULL);
+	r->extents[0] = e;
+	add_record(kHFSFirstUserCatalogNodeID, kRsrcFork, false, NULL);
+	r = add_record(kHFSFirstUserCatalogNodeID + 1, kEAData, false, name1);
+	r->extents[0] = e;
+
+	for (i = 0; i < 5; i++) {
+		assert_no_err(AddExtentToOverlapList(&glob, kHFSFirstUserCatalogNodeID, NULL, 100, 10, kDataFork));
+		assert_no_err(AddExtentToOverlapList(&glob, kHFSFirstUserCatalogNodeID + 1, i % 2 ? name1 : name2, 100, 10, kEAData));
+	}
+	/* Different fork, block count and name: not duplicates */
+	assert_no_err(AddExtentToOverlapList(&glob, kHFSFirstUserCatalogNodeID, NULL, 100, 10, kRsrcFork));
+	assert_no_err(AddExtentToOverlapList(&glob, kHFSFirstUserCatalogNodeID, NULL, 100, 9, kDataFork));
+	assert_no_err(AddExtentToOverlapList(&glob, kHFSFirstUserCatalogNodeID + 1, "user.tag", 100, 10, kEAData));
+
+	/* And the same ones again from the attributes thread */
+	bzero(&workerGlob, sizeof(workerGlob));
+	for (i = 0; i < 3; i++)
+		assert_no_err(AddExtentToOverlapList(&workerGlob, kHFSFirstUserCatalogNodeID + 1, name1, 100, 10, kEAData));
+	worker = workerGlob.overlappedExtents;
+	assert_no_err(MergeOverlapList(&glob, worker));
+	assert_equal_int((**glob.overlappedExtents).count, 16);
+
+	assert_no_err(FindOrigOverlapFiles(&glob));
+	assert_equal_int((**glob.overlappedExtents).count, 5);
+	assert(list_contains(kHFSFirstUserCatalogNodeID, kDataFork, NULL, &e));
+	assert(list_contains(kHFSFirstUserCatalogNodeID + 1, kEAData, "com.apple.decmpfs", &e));
+	assert(list_contains(kHFSFirstUserCatalogNodeID + 1, kEAData, "user.tag", &e));
+
+	volume_end();
+}
+
+static void
+test_cross_linked(UInt32 files, UInt32 crossLinks)
+{
+	make_volume(files, crossLinks, files + crossLinks);
+	verify_stage();
+	if (glob.overlappedExtents == NULL) {
+		assert_equal_int(crossLinks, 0);
+		assert_no_err(FindOrigOverlapFiles(&glob));
+		assert(glob.overlappedExtents == NULL);
+	} else {
+		assert_no_err(FindOrigOverlapFiles(&glob));
+		check_overlap_list();
+
+		/* A second pass finds nothing new */
+		assert_no_err(FindOrigOverlapFiles(&glob));
+		check_overlap_list();
+	}
+	volume_end();
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * A volume with about 'count' extents, one in a hundred of them cross
+ * linked.  Best of three runs.
+ */
+static void
+benchmark(UInt32 count)
+{
+	UInt32 files = count / 3, listed = 0, found = 0;
+	double best = 0, t;
+	int run;
+
+	for (run = 0; run < 3; run++) {
+		make_volume(files, count / 100, 1);
+		verify_stage();
+		listed = (**glob.overlappedExtents).count;
+
+		t = now();
+		assert_no_err(FindOrigOverlapFiles(&glob));
+		t = now() - t;
+		found = (**glob.overlappedExtents).count;
+		if (run == 0 || t < best)
+			best = t;
+		volume_end();
+	}
+	printf("%u files, %u listed by verify, %u overlapping extents: %.1f ms\n",
+		   files, listed, found, best * 1000);
+}
+
+int main(int argc, char *argv[])
+{
+	test_duplicates();
+	test_cross_linked(50, 0);
+	test_cross_linked(50, 1);
+	test_cross_linked(500, 20);
+	test_cross_linked(2000, 300);
+	printf("[PASSED] fsck_overlap_test\n");
+
+	benchmark(argc > 1 ? (UInt32)strtoul(argv[1], NULL, 0) : 1000000);
+
+	return 0;
+}
@@ -29,12 +29,15 @@
 //  Radar Component: HFS | X
 
 #include <sys/param.h>
+#include <sys/queue.h>
 
 #include <sys/disk.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <libkern/OSByteOrder.h>
 #include <hfs/hfs_format.h>
 
@@ -85,6 +88,40 @@ enum hfs_locktype {
 typedef struct vnode {
 } *vnode_t;
 
+/*
+ * The FreeBSD port's pending TRIM/UNMAP list, as declared in hfsplus/hfs.h,
+ * for hfs_trim_test() below.
+ */
+struct mtx {
+	int mtx_unused;
+};
+
+#define HFS_TRIM_MAXEXTENTS 4096
+
+struct hfs_trim_extent {
+	off_t te_offset;
+	off_t te_length;
+};
+
+struct hfs_trim_batch {
+	TAILQ_ENTRY(hfs_trim_batch) tb_link;
+	uint32_t tb_count;
+	uint32_t tb_pending;
+	struct hfs_trim_extent tb_extents[];
+};
+
+struct hfs_trim_list {
+	struct mtx tl_lock;
+	int tl_enabled;
+	uint32_t tl_count;
+	struct hfs_trim_extent *tl_extents;
+	TAILQ_HEAD(, hfs_trim_batch) tl_inflight;
+	int tl_scanning;
+	int tl_scanstop;
+};
+
+struct g_consumer;
+
 #define kMaxFreeExtents		10
 
 typedef struct hfsmount {
@@ -110,6 +147,9 @@ typedef struct hfsmount {
 	uint32_t	hfs_summary_size;
 	uint32_t	hfs_summary_bytes;	/* number of BYTES in summary table */
 	struct rl_head hfs_reserved_ranges[2];
+	struct hfs_trim_list hfs_trim;
+	struct g_consumer *hfs_cp;
+	int			hfs_fs_ronly;
 } hfsmount_t;
 
 typedef hfsmount_t ExtendedVCB;
@@ -602,6 +642,354 @@ hfs_find_free_extents_test(hfsmount_t *hfsmp)
 	return 0;
 }
 
+/*
+ * TRIM/UNMAP in the FreeBSD port.  Only the trim routines at the end of
+ * hfsplus/hfscommon/Misc/VolumeAllocation.c are built (HFS_TRIM_TEST), with
+ * the names that clash with the allocator above renamed.  BIO_DELETEs are
+ * queued by g_io_request() and completed by trim_complete(), or by msleep()
+ * when the code waits for an in-flight batch.
+ */
+#define HFS_TRIM_TEST 1
+
+typedef uint32_t UInt32;
+
+#define MALLOC_DEFINE(type, shortdesc, longdesc)	__unused int type
+#define malloc(size, type, flags)	calloc(1, size)
+#define free(ptr, type)				(free)(ptr)
+
+#define mtx_init(m, name, type, opts)	((void)0)
+#define mtx_destroy(m)					((void)0)
+#define mtx_lock(m)						((void)0)
+#define mtx_unlock(m)					((void)0)
+
+#define PRIBIO			0
+#define LK_EXCLUSIVE	1
+#define LK_RELEASE		2
+#define curthread		NULL
+
+#define HFSTOVCB(x)		(x)
+#define ISHFSPLUS(vcb)	((vcb)->vcbSigWord == kHFSPlusSigWord)
+
+#define BIO_DELETE		1
+
+struct bio {
+	int bio_cmd;
+	off_t bio_offset;
+	off_t bio_length;
+	int bio_error;
+	void (*bio_done)(struct bio *);
+	void *bio_caller1;
+	void *bio_caller2;
+	TAILQ_ENTRY(bio) bio_queue;
+};
+
+static TAILQ_HEAD(, bio) trim_queue = TAILQ_HEAD_INITIALIZER(trim_queue);
+static struct hfs_trim_extent trim_issued[HFS_TRIM_MAXEXTENTS + 1];
+static int trim_issued_count;
+static int trim_waits;
+static int trim_candelete = 1;
+static int trim_error;
+static uint8_t *trim_bitmap;
+static int ticks, hz = 100;
+
+static struct bio *g_alloc_bio(void)
+{
+	return calloc(1, sizeof(struct bio));
+}
+
+static void g_destroy_bio(struct bio *bip)
+{
+	(free)(bip);
+}
+
+static void g_io_request(struct bio *bip, __unused struct g_consumer *cp)
+{
+	assert(bip->bio_cmd == BIO_DELETE && bip->bio_length > 0);
+	assert(trim_issued_count <= HFS_TRIM_MAXEXTENTS);
+	trim_issued[trim_issued_count].te_offset = bip->bio_offset;
+	trim_issued[trim_issued_count].te_length = bip->bio_length;
+	++trim_issued_count;
+	TAILQ_INSERT_TAIL(&trim_queue, bip, bio_queue);
+}
+
+static int g_getattr(__unused const char *attr, __unused struct g_consumer *cp,
+					 void *val)
+{
+	*(int *)val = trim_candelete;
+	return 0;
+}
+
+static void trim_complete(void)
+{
+	struct bio *bip;
+
+	while ((bip = TAILQ_FIRST(&trim_queue)) != NULL) {
+		TAILQ_REMOVE(&trim_queue, bip, bio_queue);
+		bip->bio_error = trim_error;
+		bip->bio_done(bip);
+	}
+}
+
+static int msleep(__unused void *chan, __unused struct mtx *mtx,
+				  __unused int pri, __unused const char *wmesg,
+				  __unused int timo)
+{
+	++trim_waits;
+	trim_complete();
+	return 0;
+}
+
+static void wakeup(__unused void *chan)
+{
+}
+
+// The scan runs to completion inside hfs_trim_init
+static int kthread_add(void (*func)(void *), void *arg, __unused void *p,
+					   __unused void *td, __unused int flags,
+					   __unused int pages, __unused const char *fmt)
+{
+	func(arg);
+	return 0;
+}
+
+static void kthread_exit(void)
+{
+}
+
+static int hfs_metafilelocking(__unused struct hfsmount *hfsmp,
+							   __unused u_long fileID, __unused u_int flags,
+							   __unused void *p)
+{
+	return 0;
+}
+
+static OSErr bsd_ReadBitmapBlock(ExtendedVCB *vcb, UInt32 bit,
+								 UInt32 **buffer, uintptr_t *blockRef)
+{
+	UInt32 bitsPerBlock = vcb->vcbVBMIOSize * kBitsPerByte;
+
+	*buffer = (UInt32 *)(trim_bitmap + (bit / bitsPerBlock) * vcb->vcbVBMIOSize);
+	*blockRef = 1;
+	return 0;
+}
+
+static OSErr bsd_ReleaseBitmapBlock(__unused ExtendedVCB *vcb,
+									uintptr_t blockRef, __unused Boolean dirty)
+{
+	assert(blockRef == 1);
+	return 0;
+}
+
+void hfs_trim_init(struct hfsmount *hfsmp);
+void hfs_trim_flush(struct hfsmount *hfsmp);
+void hfs_trim_destroy(struct hfsmount *hfsmp);
+
+#define hfs_unmap_free_extent	bsd_unmap_free_extent
+#define hfs_unmap_alloc_extent	bsd_unmap_alloc_extent
+#define hfs_track_unmap_blocks	bsd_track_unmap_blocks
+#define hfs_issue_unmap			bsd_issue_unmap
+#define ScanUnmapBlocks			bsd_ScanUnmapBlocks
+#define ReadBitmapBlock			bsd_ReadBitmapBlock
+#define ReleaseBitmapBlock		bsd_ReleaseBitmapBlock
+
+#include "../../hfsplus/hfscommon/Misc/VolumeAllocation.c"
+
+#undef hfs_unmap_free_extent
+#undef hfs_unmap_alloc_extent
+#undef hfs_track_unmap_blocks
+#undef hfs_issue_unmap
+#undef ScanUnmapBlocks
+#undef ReadBitmapBlock
+#undef ReleaseBitmapBlock
+#undef malloc
+#undef free
+
+// Device offset of an allocation block, as the trim code computes it
+#define TRIM_BLK(mp, blk)	((off_t)(blk) * (mp)->blockSize + (mp)->hfsPlusIOPosOffset)
+
+static bool trim_is(hfsmount_t *mp, const struct hfs_trim_extent *ext,
+					uint32_t start, uint32_t count)
+{
+	return (ext->te_offset == TRIM_BLK(mp, start)
+			&& ext->te_length == (off_t)count * mp->blockSize);
+}
+
+static void trim_bitmap_clear(uint32_t start, uint32_t count)
+{
+	for (uint32_t b = start; b < start + count; ++b)
+		trim_bitmap[b / 8] &= ~(0x80 >> (b % 8));
+}
+
+int
+hfs_trim_test(void)
+{
+	struct hfsmount tm = {
+		.blockSize = 4096,
+		.hfsPlusIOPosOffset = 1024,
+		.totalBlocks = 2 * 8192 + 100,
+		// 32 bits per bitmap block, so a scan chunk is 8192 blocks
+		.vcbVBMIOSize = 4,
+		.vcbSigWord = kHFSPlusSigWord,
+	};
+	struct hfs_trim_list *tl = &tm.hfs_trim;
+	struct hfs_trim_extent *ext;
+	int i;
+
+	hfs_trim_scan_rate = 0;
+	hfs_trim_on_mount = 0;
+
+	hfs_trim_init(&tm);
+	assert(tl->tl_enabled && !tl->tl_scanning);
+	ext = tl->tl_extents;
+
+	// Freed ranges are kept sorted and coalesced with anything they touch
+	bsd_unmap_free_extent(&tm, 10, 5);
+	bsd_unmap_free_extent(&tm, 20, 5);
+	assert(tl->tl_count == 2);
+	bsd_unmap_free_extent(&tm, 15, 5);
+	assert(tl->tl_count == 1 && trim_is(&tm, &ext[0], 10, 15));
+	bsd_unmap_free_extent(&tm, 12, 3);
+	assert(tl->tl_count == 1 && trim_is(&tm, &ext[0], 10, 15));
+
+	bsd_unmap_free_extent(&tm, 40, 2);
+	bsd_unmap_free_extent(&tm, 30, 2);
+	bsd_unmap_free_extent(&tm, 26, 4);
+	assert(tl->tl_count == 3
+		   && trim_is(&tm, &ext[0], 10, 15)
+		   && trim_is(&tm, &ext[1], 26, 6)
+		   && trim_is(&tm, &ext[2], 40, 2));
+	bsd_unmap_free_extent(&tm, 25, 1);
+	assert(tl->tl_count == 2
+		   && trim_is(&tm, &ext[0], 10, 22)
+		   && trim_is(&tm, &ext[1], 40, 2));
+	bsd_unmap_free_extent(&tm, 5, 50);
+	assert(tl->tl_count == 1 && trim_is(&tm, &ext[0], 5, 50));
+
+	// Allocating carves the blocks back out
+	bsd_unmap_alloc_extent(&tm, 20, 5);
+	assert(tl->tl_count == 2
+		   && trim_is(&tm, &ext[0], 5, 15)
+		   && trim_is(&tm, &ext[1], 25, 30));
+	bsd_unmap_alloc_extent(&tm, 0, 6);
+	assert(tl->tl_count == 2 && trim_is(&tm, &ext[0], 6, 14));
+	bsd_unmap_alloc_extent(&tm, 50, 10);
+	assert(tl->tl_count == 2 && trim_is(&tm, &ext[1], 25, 25));
+	bsd_unmap_alloc_extent(&tm, 6, 14);
+	assert(tl->tl_count == 1 && trim_is(&tm, &ext[0], 25, 25));
+	bsd_unmap_free_extent(&tm, 60, 5);
+	bsd_unmap_free_extent(&tm, 70, 5);
+	bsd_unmap_alloc_extent(&tm, 30, 45);
+	assert(tl->tl_count == 1 && trim_is(&tm, &ext[0], 25, 5));
+	assert(trim_issued_count == 0 && !trim_waits);
+
+	// hfs_sync issues one BIO_DELETE per coalesced range
+	hfs_trim_flush(&tm);
+	assert(tl->tl_count == 0 && trim_issued_count == 1
+		   && trim_is(&tm, &trim_issued[0], 25, 5));
+	assert(!TAILQ_EMPTY(&tl->tl_inflight));
+	trim_complete();
+	assert(TAILQ_EMPTY(&tl->tl_inflight));
+
+	// Reusing blocks that are still being trimmed waits for the batch
+	trim_issued_count = 0;
+	bsd_unmap_free_extent(&tm, 100, 10);
+	bsd_unmap_free_extent(&tm, 300, 1);
+	hfs_trim_flush(&tm);
+	assert(trim_issued_count == 2);
+	bsd_unmap_alloc_extent(&tm, 400, 1);
+	assert(!trim_waits && !TAILQ_EMPTY(&tl->tl_inflight));
+	bsd_unmap_alloc_extent(&tm, 105, 1);
+	assert(trim_waits == 1 && TAILQ_EMPTY(&tl->tl_inflight));
+	bsd_unmap_alloc_extent(&tm, 106, 1);
+	assert(trim_waits == 1);
+
+	// A full list drops new ranges, but still merges into existing ones
+	for (i = 0; i < HFS_TRIM_MAXEXTENTS; ++i)
+		bsd_unmap_free_extent(&tm, 1000 + 2 * i, 1);
+	assert(tl->tl_count == HFS_TRIM_MAXEXTENTS);
+	bsd_unmap_free_extent(&tm, 1000 + 2 * HFS_TRIM_MAXEXTENTS, 1);
+	assert(tl->tl_count == HFS_TRIM_MAXEXTENTS);
+	assert(trim_is(&tm, &ext[HFS_TRIM_MAXEXTENTS - 1],
+				   1000 + 2 * (HFS_TRIM_MAXEXTENTS - 1), 1));
+	bsd_unmap_free_extent(&tm, 1001, 1);
+	assert(tl->tl_count == HFS_TRIM_MAXEXTENTS - 1
+		   && trim_is(&tm, &ext[0], 1000, 3));
+
+	trim_issued_count = 0;
+	hfs_trim_flush(&tm);
+	assert(tl->tl_count == 0 && trim_issued_count == HFS_TRIM_MAXEXTENTS - 1);
+	for (i = 1; i < trim_issued_count; ++i)
+		assert(trim_issued[i].te_offset > trim_issued[i - 1].te_offset
+			   + trim_issued[i - 1].te_length);
+	trim_complete();
+
+	// A provider that stops accepting deletes turns trimming off
+	trim_issued_count = 0;
+	trim_error = EOPNOTSUPP;
+	bsd_unmap_free_extent(&tm, 100, 10);
+	hfs_trim_flush(&tm);
+	trim_complete();
+	assert(!tl->tl_enabled && trim_issued_count == 1);
+	bsd_unmap_free_extent(&tm, 200, 10);
+	hfs_trim_flush(&tm);
+	assert(tl->tl_count == 0 && trim_issued_count == 1);
+	trim_error = 0;
+
+	hfs_trim_destroy(&tm);
+	assert(tl->tl_extents == NULL);
+
+	// Read-only mounts and devices without BIO_DELETE don't trim
+	memset(tl, 0, sizeof(*tl));
+	tm.hfs_fs_ronly = 1;
+	hfs_trim_init(&tm);
+	assert(!tl->tl_enabled && tl->tl_extents == NULL);
+	hfs_trim_destroy(&tm);
+
+	memset(tl, 0, sizeof(*tl));
+	tm.hfs_fs_ronly = 0;
+	trim_candelete = 0;
+	hfs_trim_init(&tm);
+	assert(!tl->tl_enabled && tl->tl_extents == NULL);
+	hfs_trim_destroy(&tm);
+	trim_candelete = 1;
+
+	/*
+	 * The mount-time scan trims every free run.  Runs are merged across
+	 * bitmap blocks but split at scan chunks, since each chunk is issued
+	 * before the extents B-tree lock is dropped.
+	 */
+	size_t bitmap_size = howmany(tm.totalBlocks, 32) * 4;
+
+	trim_bitmap = malloc(bitmap_size);
+	memset(trim_bitmap, 0xff, bitmap_size);
+	trim_bitmap_clear(3, 7);
+	trim_bitmap_clear(30, 10);
+	trim_bitmap_clear(8190, 10);
+	trim_bitmap_clear(tm.totalBlocks - 5, 5);
+
+	trim_issued_count = 0;
+	hfs_trim_on_mount = 1;
+	memset(tl, 0, sizeof(*tl));
+	hfs_trim_init(&tm);
+	assert(tl->tl_enabled && !tl->tl_scanning);
+	assert(trim_issued_count == 5
+		   && trim_is(&tm, &trim_issued[0], 3, 7)
+		   && trim_is(&tm, &trim_issued[1], 30, 10)
+		   && trim_is(&tm, &trim_issued[2], 8190, 2)
+		   && trim_is(&tm, &trim_issued[3], 8192, 8)
+		   && trim_is(&tm, &trim_issued[4], tm.totalBlocks - 5, 5));
+
+	// Allocating scanned blocks waits for their BIO_DELETE
+	trim_waits = 0;
+	bsd_unmap_alloc_extent(&tm, 35, 1);
+	assert(trim_waits == 1 && TAILQ_EMPTY(&tl->tl_inflight));
+
+	hfs_trim_destroy(&tm);
+	free(trim_bitmap);
+
+	return 0;
+}
+
 int main(void)
 {
 	const int blocks = 100000;
@@ -849,6 +1237,8 @@ int main(void)
 	
 	hfs_find_free_extents_test(&mnt);
 
+	hfs_trim_test();
+
 	printf("[PASSED] hfs_alloc_test\n");
 
 	return 0;
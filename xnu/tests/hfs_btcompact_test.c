@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2014-2015 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Tests the online B-tree compaction passes of hfscommon/BTree/BTreeCompact.c
+ * (BTRepackLeaves, BTRenumberNodes, BTTrimFreeNodes and BTGetOccupancy).
+ * The kernel B-tree code can't be built in user space, so the passes are
+ * built against the fsck_hfs B-tree library (dfalib), which has the same
+ * node and map routines, on a B-tree file kept in memory.
+ *
+ * Each tree is filled in random order and then two thirds of its records
+ * are deleted, to leave it fragmented.  The passes run with small write
+ * budgets while other records are inserted and deleted between calls, as
+ * they would be on a mounted volume, and the whole tree is checked after
+ * each pass.  Occupancy before and after is printed for the largest tree.
+ */
+
+#define HFS_BTCOMPACT_TEST 1
+
+#include "fsck_btree_test.h"
+
+/* What BTreeCompact.c uses of the kernel's BTreesPrivate.h and BTreesInternal.h */
+#define FCB				SFCB
+#define fcbBTCBPtr			fcbBtree
+#define REQUIRE_FILE_LOCK(vp, shareable)
+#define ModifyBlockStart(vp, block)
+#define kLockTransaction		0
+#define UpdateNode(btreePtr, node, transactionID, flags)	UpdateNode(btreePtr, node)
+#define M_TEMP				0
+#define M_WAITOK			0
+#define malloc(size, type, flags)	calloc(1, (size))
+#define free(addr, type)		(free)(addr)
+
+struct BTreeOccupancy {
+	UInt16 nodeSize;
+	UInt16 nodeCapacity;
+	UInt16 treeDepth;
+	UInt16 reserved;
+	UInt32 totalNodes;
+	UInt32 freeNodes;
+	UInt32 indexNodes;
+	UInt32 leafNodes;
+	UInt32 leafRecords;
+	UInt32 leavesOutOfOrder;
+	UInt64 indexBytes;
+	UInt64 leafBytes;
+};
+typedef struct BTreeOccupancy BTreeOccupancy;
+
+struct BTreeRenumberState {
+	UInt32 height;
+	UInt32 nodeNum;
+	UInt32 nextSlot;
+};
+typedef struct BTreeRenumberState BTreeRenumberState;
+
+#include "../../hfsplus/hfscommon/BTree/BTreeCompact.c"
+
+#undef UpdateNode
+#undef malloc
+#undef free
+
+/* Another writer: insert or delete one record between calls */
+static void
+change_record(SFCB *fcb, UInt8 *live, UInt32 count)
+{
+	UInt32 i = random() % count;
+
+	if (live[i])
+		delete_record(fcb, i);
+	else
+		insert_record(fcb, i);
+	live[i] = !live[i];
+}
+
+static void
+print_occupancy(const char *label, const BTreeOccupancy *occ)
+{
+	printf("%-10s %7u nodes, %7u free, %6u index, %7u leaves (%5.1f%% full), %7u leaves out of order\n",
+		   label, occ->totalNodes, occ->freeNodes, occ->indexNodes, occ->leafNodes,
+		   occ->leafNodes ? 100.0 * occ->leafBytes / ((double)occ->leafNodes * occ->nodeCapacity) : 0.0,
+		   occ->leavesOutOfOrder);
+}
+
+/*
+ * Fragment a tree of 'count' records, then repack, renumber and trim it
+ * 'budget' node writes at a time.
+ */
+static void
+test_compact(TreeShape shape, UInt32 count, UInt32 budget, bool print)
+{
+	SFCB *fcb = tree_create(shape, file_bytes(shape, count));
+	BTreeControlBlock *btcb = fcb->fcbBtree;
+	BTreeOccupancy before, after;
+	BTreeRenumberState renumber;
+	UInt32 *order, nextLeaf, writeCount, startWrites, oldTotal, newTotal, nodeMultiple, calls, i, j, t;
+	UInt8 *live;
+	Boolean done;
+
+	order = malloc(count * sizeof(*order));
+	live = calloc(count, 1);
+	assert(order != NULL && live != NULL);
+	for (i = 0; i < count; i++)
+		order[i] = i;
+	for (i = count - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	for (i = 0; i < count; i++) {
+		insert_record(fcb, order[i]);
+		live[order[i]] = 1;
+	}
+	for (i = 0; i < count * 2 / 3; i++) {
+		j = order[(i * 7919ULL) % count];
+		if (live[j]) {
+			delete_record(fcb, j);
+			live[j] = 0;
+		}
+	}
+	tree_verify(fcb, live, count);
+	assert_no_err(BTGetOccupancy(fcb, &before));
+
+	/* Repack, with other changes now and then */
+	nextLeaf = 0;
+	done = false;
+	for (calls = 1; !done; calls++) {
+		startWrites = btcb->numUpdateNodes;
+		assert_no_err(BTRepackLeaves(fcb, 90, budget, &nextLeaf, &done));
+		assert(btcb->numUpdateNodes - startWrites <= budget + 3 * btcb->treeDepth + 8);
+		if (calls % 5 == 0 && !done && count > 50)
+			change_record(fcb, live, count);
+	}
+	tree_verify(fcb, live, count);
+
+	/* Renumber, starting over whenever someone else changed the tree */
+	bzero(&renumber, sizeof(renumber));
+	writeCount = btcb->writeCount;
+	done = false;
+	for (calls = 1; !done; calls++) {
+		if (btcb->writeCount != writeCount)
+			bzero(&renumber, sizeof(renumber));
+		assert_no_err(BTRenumberNodes(fcb, budget, &renumber, &done));
+		writeCount = btcb->writeCount;
+		if (calls % 9 == 0 && !done && count > 50)
+			change_record(fcb, live, count);
+	}
+	tree_verify(fcb, live, count);
+
+	nodeMultiple = (shape == kExtentsTree) ? 8 : 1;
+	oldTotal = btcb->totalNodes;
+	assert_no_err(BTTrimFreeNodes(fcb, nodeMultiple, &newTotal));
+	assert_equal_int(newTotal, btcb->totalNodes);
+	assert(newTotal <= oldTotal);
+	assert(newTotal % nodeMultiple == 0 || newTotal == oldTotal);
+	/* hfs_btcompact truncates the fork to match */
+	fcb->fcbLogicalSize = fcb->fcbPhysicalSize = (UInt64)newTotal * btcb->nodeSize;
+	tree_verify(fcb, live, count);
+
+	assert_no_err(BTGetOccupancy(fcb, &after));
+	assert_equal_int(after.totalNodes, btcb->totalNodes);
+	assert_equal_int(after.leafRecords, btcb->leafRecords);
+	assert(after.leafNodes <= before.leafNodes);
+	assert(after.totalNodes <= before.totalNodes);
+	if (print) {
+		printf("%u records, %u left after deletes, %u writes per call:\n", count, after.leafRecords, budget);
+		print_occupancy("before", &before);
+		print_occupancy("compacted", &after);
+	}
+
+	/* The compacted tree takes ordinary inserts */
+	for (i = 0; i < count; i++) {
+		if (!live[i]) {
+			insert_record(fcb, i);
+			live[i] = 1;
+		}
+	}
+	tree_verify(fcb, live, count);
+
+	free(order);
+	free(live);
+	tree_destroy(fcb);
+}
+
+/*
+ * A renumber pass that has to move a node out of its slot when the only
+ * free nodes are below the slot: the file is extended for it.
+ */
+static void
+test_free_below_slot(void)
+{
+	const UInt32 count = 3000;
+	SFCB *fcb = tree_create(kExtentsTree, file_bytes(kExtentsTree, count));
+	BTreeControlBlock *btcb = fcb->fcbBtree;
+	BTreeRenumberState renumber;
+	BTreeOccupancy occ;
+	UInt32 firstLeaf, newTotal, records, i;
+	UInt8 *live;
+	Boolean done;
+
+	live = calloc(count, 1);
+	assert(live != NULL);
+	for (i = 0; i < count; i++) {
+		insert_record(fcb, (i * 7919) % count);
+		live[i] = 1;
+	}
+
+	/* Renumber and trim, so that every node is in use */
+	bzero(&renumber, sizeof(renumber));
+	do {
+		assert_no_err(BTRenumberNodes(fcb, 1000, &renumber, &done));
+	} while (!done);
+	assert_no_err(BTTrimFreeNodes(fcb, 1, &newTotal));
+	fcb->fcbLogicalSize = fcb->fcbPhysicalSize = (UInt64)newTotal * btcb->nodeSize;
+	assert_equal_int(btcb->freeNodes, 0);
+
+	/* Empty the first leaf, which frees the only free node */
+	firstLeaf = btcb->firstLeafNode;
+	records = node_at(btcb, firstLeaf)->numRecords;
+	for (i = 0; i < records; i++) {
+		delete_record(fcb, i);
+		live[i] = 0;
+	}
+	assert(!node_in_use(btcb, firstLeaf));
+	assert(btcb->firstLeafNode > firstLeaf);
+	for (i = firstLeaf + 1; i < btcb->totalNodes; i++)
+		assert(node_in_use(btcb, i));
+
+	/*
+	 * Resume with the last leaf due in a slot past the map word of the
+	 * free node, as AllocateNodeFrom may return nodes from the whole word
+	 */
+	renumber.height = 1;
+	renumber.nodeNum = btcb->lastLeafNode;
+	renumber.nextSlot = roundup(firstLeaf + 1, 16);
+	assert(renumber.nextSlot < btcb->lastLeafNode);
+	assert_equal_int(node_at(btcb, renumber.nextSlot)->kind, kBTLeafNode);
+	assert_no_err(BTRenumberNodes(fcb, 1000, &renumber, &done));
+	assert(done);
+	assert(btcb->totalNodes > newTotal);
+	tree_verify(fcb, live, count);
+
+	/* A full pass puts everything back in order */
+	bzero(&renumber, sizeof(renumber));
+	do {
+		assert_no_err(BTRenumberNodes(fcb, 1000, &renumber, &done));
+	} while (!done);
+	tree_verify(fcb, live, count);
+	assert_no_err(BTGetOccupancy(fcb, &occ));
+	assert_equal_int(occ.leavesOutOfOrder, 0);
+
+	free(live);
+	tree_destroy(fcb);
+}
+
+int main(void)
+{
+	static const UInt32 counts[] = { 1, 50, 3000, 60000 };
+	unsigned i;
+
+	srandom(1);
+	for (i = 0; i < lengthof(counts); i++) {
+		test_compact(kCatalogTree, counts[i], 7, false);
+		test_compact(kCatalogTree, counts[i], 300, false);
+		test_compact(kExtentsTree, counts[i], 7, false);
+		test_compact(kExtentsTree, counts[i], 300, false);
+	}
+	test_free_below_slot();
+	printf("[PASSED] hfs_btcompact_test\n");
+
+	test_compact(kCatalogTree, 250000, 1024, true);
+
+	return 0;
+}
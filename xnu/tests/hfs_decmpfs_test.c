@@ -0,0 +1,605 @@
+/*
+ * Copyright (c) 2014-2015 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "test-utils.h"
+
+/*
+ * Build the decoders from hfsplus/hfs_decmpfs.c (zlib, LZVN and the
+ * LZFSE container) and round-trip data through them: zlib streams come
+ * from libz, LZVN streams from the small encoder below.
+ */
+#define HFS_DECMPFS_TEST 1
+
+#define malloc(size, type, flags)	malloc(size)
+#define free(ptr, type)				(free)(ptr)
+#define min(a, b)					((a) < (b) ? (a) : (b))
+#define __DECONST(type, var)		((type)(uintptr_t)(const void *)(var))
+
+static inline uint32_t
+le32dec(const void *pp)
+{
+	const uint8_t *p = pp;
+
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+#include "../../hfsplus/hfs_decmpfs.c"
+
+#undef malloc
+#undef free
+
+static void
+le32enc(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/*
+ * A greedy LZVN encoder.  It is not meant to compress well, only to
+ * produce every opcode the decoder knows: literals with and without a
+ * match, small, medium and large distances, and matches that reuse the
+ * previous distance.
+ */
+struct lzvn_enc {
+	uint8_t *out;
+	size_t len;
+	size_t prev_d;
+};
+
+#define LZVN_HASH_BITS	14
+
+static void
+lzvn_put(struct lzvn_enc *e, uint8_t b)
+{
+	e->out[e->len++] = b;
+}
+
+// Literal-only opcodes for all of lits[0..n)
+static void
+lzvn_literals(struct lzvn_enc *e, const uint8_t *lits, size_t n)
+{
+	size_t L;
+
+	while (n > 0) {
+		if (n >= 16) {
+			L = min(n, 271);
+			lzvn_put(e, 0xE0);
+			lzvn_put(e, L - 16);
+		} else {
+			L = n;
+			lzvn_put(e, 0xE0 | L);
+		}
+		memcpy(e->out + e->len, lits, L);
+		e->len += L;
+		lits += L;
+		n -= L;
+	}
+}
+
+// Matches with the previous distance
+static void
+lzvn_prev_match(struct lzvn_enc *e, size_t M)
+{
+	size_t n;
+
+	while (M > 0) {
+		if (M >= 16) {
+			n = min(M, 271);
+			lzvn_put(e, 0xF0);
+			lzvn_put(e, n - 16);
+		} else {
+			n = M;
+			lzvn_put(e, 0xF0 | n);
+		}
+		M -= n;
+	}
+}
+
+// Is LLMMMxxx a defined sml_d / pre_d / lrg_d opcode?
+static bool
+lzvn_op_valid(size_t L, size_t M)
+{
+	uint8_t op = L << 6 | (M - 3) << 3;
+
+	return !((op >= 0x70 && op < 0x80) || (op >= 0xA0 && op < 0xC0) || op >= 0xD0);
+}
+
+static void
+lzvn_match(struct lzvn_enc *e, const uint8_t *lits, size_t L, size_t M, size_t D)
+{
+	size_t L1 = 0, M1;
+
+	// Up to three literals can ride along with the match opcode
+	if (L > 0 && L <= 3)
+		L1 = L;
+	else if (L > 3)
+		L1 = L % 4;
+	lzvn_literals(e, lits, L - L1);
+	lits += L - L1;
+
+	if (D == e->prev_d && L1 == 0) {
+		lzvn_prev_match(e, M);
+		return;
+	}
+
+	if (D != e->prev_d && D >= 0x600 && D < 16384) {
+		// med_d
+		M1 = min(M, 34);
+		lzvn_put(e, 0xA0 | L1 << 3 | (M1 - 3) >> 2);
+		lzvn_put(e, ((M1 - 3) & 3) | (D & 0x3F) << 2);
+		lzvn_put(e, D >> 6);
+	} else {
+		M1 = min(M, 10);
+		// M1 == 3 is always defined
+		while (!lzvn_op_valid(L1, M1))
+			--M1;
+		if (D == e->prev_d) {
+			lzvn_put(e, L1 << 6 | (M1 - 3) << 3 | 6);		// pre_d
+		} else if (D < 0x600) {
+			lzvn_put(e, L1 << 6 | (M1 - 3) << 3 | D >> 8);	// sml_d
+			lzvn_put(e, D);
+		} else {
+			lzvn_put(e, L1 << 6 | (M1 - 3) << 3 | 7);		// lrg_d
+			lzvn_put(e, D);
+			lzvn_put(e, D >> 8);
+		}
+	}
+	memcpy(e->out + e->len, lits, L1);
+	e->len += L1;
+	e->prev_d = D;
+
+	lzvn_prev_match(e, M - M1);
+}
+
+static size_t
+lzvn_encode(const uint8_t *src, size_t n, uint8_t *out)
+{
+	static uint32_t table[1 << LZVN_HASH_BITS];
+	struct lzvn_enc e = { .out = out };
+	size_t i = 0, lit = 0, M, D, cand;
+	uint32_t h;
+
+	memset(table, 0xff, sizeof(table));
+	while (i + 4 <= n) {
+		h = (le32dec(src + i) * 2654435761u) >> (32 - LZVN_HASH_BITS);
+		cand = table[h];
+		table[h] = i;
+		// Prefer the previous distance, as real encoders do
+		if (e.prev_d != 0 && i >= e.prev_d && !memcmp(src + i - e.prev_d, src + i, 3))
+			cand = i - e.prev_d;
+		if (cand != 0xffffffff && i - cand <= 0xffff
+			&& !memcmp(src + cand, src + i, 3)) {
+			D = i - cand;
+			for (M = 3; i + M < n && src[cand + M] == src[i + M]; M++)
+				;
+			lzvn_match(&e, src + lit, i - lit, M, D);
+			i += M;
+			lit = i;
+		} else {
+			i++;
+		}
+	}
+	lzvn_literals(&e, src + lit, n - lit);
+
+	// End of stream is 06 followed by seven zero bytes
+	lzvn_put(&e, 0x06);
+	memset(e.out + e.len, 0, 7);
+	e.len += 7;
+
+	return e.len;
+}
+
+static size_t
+lzvn_bound(size_t n)
+{
+	return n + n / 8 + 64;
+}
+
+/*
+ * Wrap data in an LZFSE container, alternating LZVN-compressed (bvxn)
+ * and raw (bvx-) blocks of at most blk bytes.
+ */
+static size_t
+lzfse_encode(const uint8_t *src, size_t n, size_t blk, uint8_t *out)
+{
+	size_t len = 0, done = 0, part, payload;
+	int raw = 0;
+
+	while (done < n) {
+		part = min(blk, n - done);
+		if (raw) {
+			le32enc(out + len, LZFSE_UNCOMPRESSED_MAGIC);
+			le32enc(out + len + 4, part);
+			memcpy(out + len + 8, src + done, part);
+			len += 8 + part;
+		} else {
+			payload = lzvn_encode(src + done, part, out + len + 12);
+			le32enc(out + len, LZFSE_COMPRESSEDLZVN_MAGIC);
+			le32enc(out + len + 4, part);
+			le32enc(out + len + 8, payload);
+			len += 12 + payload;
+		}
+		done += part;
+		raw = !raw;
+	}
+	le32enc(out + len, LZFSE_ENDOFSTREAM_MAGIC);
+
+	return len + 4;
+}
+
+static size_t
+lzfse_bound(size_t n, size_t blk)
+{
+	return lzvn_bound(n) + (n / blk + 1) * 12 + 4;
+}
+
+enum {
+	DATA_ZEROS,
+	DATA_RANDOM,
+	DATA_TEXT,
+	DATA_FAR,		// repeats at distances beyond the medium range
+	DATA_MIXED,
+	NDATA
+};
+
+static const char *data_names[NDATA] = { "zeros", "random", "text", "far", "mixed" };
+
+static void
+make_data(int kind, uint8_t *buf, size_t n)
+{
+	static const char *words[] = {
+		"catalog ", "extent ", "attribute ", "fork ", "node ", "b-tree ",
+		"volume ", "bitmap ", "journal ", "decmpfs ", "chunk ", "\n",
+	};
+	size_t i, w;
+
+	switch (kind) {
+	case DATA_ZEROS:
+		memset(buf, 0, n);
+		break;
+	case DATA_RANDOM:
+		for (i = 0; i < n; i++)
+			buf[i] = random();
+		break;
+	case DATA_TEXT:
+		for (i = 0; i < n; i += w) {
+			const char *s = words[random() % 12];
+			w = min(strlen(s), n - i);
+			memcpy(buf + i, s, w);
+		}
+		break;
+	case DATA_FAR:
+		for (i = 0; i < n; i++)
+			buf[i] = i < 20000 ? random() : buf[i - 20000 + (i / 20000) % 7];
+		break;
+	case DATA_MIXED:
+		for (i = 0; i < n; i++) {
+			switch ((i / 777) % 4) {
+			case 0:  buf[i] = random(); break;
+			case 1:  buf[i] = 'a' + i % 3; break;
+			case 2:  buf[i] = i >= 1500 ? buf[i - 1500] : 0; break;
+			default: buf[i] = i >= 9 ? buf[i - 9] ^ (i % 64 == 0) : 'x'; break;
+			}
+		}
+		break;
+	}
+}
+
+#define CANARY		0xA5
+#define CANARY_LEN	32
+
+/*
+ * Decode into a buffer with a canary after dstlen bytes; check the
+ * decoder never writes past what it was given.
+ */
+static int
+decode(uint32_t type, const uint8_t *src, size_t srclen, uint8_t *dst, size_t dstlen)
+{
+	int error;
+
+	memset(dst + dstlen, CANARY, CANARY_LEN);
+	error = hfs_decmpfs_decode(type, src, srclen, dst, dstlen);
+	for (int i = 0; i < CANARY_LEN; i++)
+		assert(dst[dstlen + i] == CANARY);
+	return error;
+}
+
+static void
+check_roundtrip(uint32_t type, const uint8_t *data, size_t n,
+				const uint8_t *enc, size_t enclen, bool strict_len)
+{
+	uint8_t *dst = malloc(n + 1 + CANARY_LEN);
+
+	assert(decode(type, enc, enclen, dst, n) == 0);
+	assert(!memcmp(dst, data, n));
+
+	// Expecting more than the stream holds is an error
+	assert(decode(type, enc, enclen, dst, n + 1) == EIO);
+
+	// Only raw chunks tolerate a stream longer than expected
+	if (strict_len && n > 0)
+		assert(decode(type, enc, enclen, dst, n - 1) == EIO);
+
+	free(dst);
+}
+
+static void
+test_roundtrip(void)
+{
+	static const size_t sizes[] = { 1, 3, 15, 16, 271, 272, 1000, 4096, 65536 };
+	uint8_t *data, *enc;
+	uLongf zlen;
+	size_t n, len;
+	int kind, s;
+
+	data = malloc(DECMPFS_CHUNK_SIZE);
+	enc = malloc(lzfse_bound(DECMPFS_CHUNK_SIZE, 1000) + compressBound(DECMPFS_CHUNK_SIZE));
+
+	for (kind = 0; kind < NDATA; kind++) {
+		for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+			n = sizes[s];
+			make_data(kind, data, n);
+
+			// zlib, attribute and resource fork
+			zlen = compressBound(n);
+			assert(compress2(enc, &zlen, data, n, Z_DEFAULT_COMPRESSION) == Z_OK);
+			check_roundtrip(CMP_Type3, data, n, enc, zlen, true);
+			check_roundtrip(CMP_Type4, data, n, enc, zlen, true);
+
+			// zlib chunk stored uncompressed
+			enc[0] = 0xFF;
+			memcpy(enc + 1, data, n);
+			check_roundtrip(CMP_Type4, data, n, enc, n + 1, false);
+
+			// LZVN
+			len = lzvn_encode(data, n, enc);
+			assert(len <= lzvn_bound(n));
+			check_roundtrip(CMP_Type7, data, n, enc, len, true);
+			check_roundtrip(CMP_Type8, data, n, enc, len, true);
+
+			// LZVN chunk stored uncompressed
+			enc[0] = 0x06;
+			memcpy(enc + 1, data, n);
+			check_roundtrip(CMP_Type8, data, n, enc, n + 1, false);
+
+			// LZFSE container with one LZVN block, then with several
+			len = lzfse_encode(data, n, n, enc);
+			check_roundtrip(CMP_Type11, data, n, enc, len, true);
+			len = lzfse_encode(data, n, 1000, enc);
+			assert(len <= lzfse_bound(n, 1000));
+			check_roundtrip(CMP_Type12, data, n, enc, len, true);
+		}
+	}
+
+	free(enc);
+	free(data);
+}
+
+static void
+test_errors(void)
+{
+	uint8_t dst[64 + CANARY_LEN];
+	uint8_t buf[64] = { 0 };
+
+	// Empty input, unknown type
+	assert(decode(CMP_Type8, buf, 0, dst, 16) == EIO);
+	buf[0] = 0xE1;
+	buf[1] = 'x';
+	assert(decode(CMP_Type1, buf, 2, dst, 1) == EOPNOTSUPP);
+	assert(decode(5, buf, 2, dst, 1) == EOPNOTSUPP);
+
+	// A match before any output, and one reaching back past the start
+	static const uint8_t no_history[] = { 0x00, 0x01, 0x06 };
+	assert(decode(CMP_Type8, no_history, sizeof(no_history), dst, 3) == EIO);
+	static const uint8_t too_far[] = { 0xE2, 'a', 'b', 0x00, 0x03, 0x06 };
+	assert(decode(CMP_Type8, too_far, sizeof(too_far), dst, 5) == EIO);
+	static const uint8_t no_distance[] = { 0xE1, 'a', 0xF3, 0x06 };
+	assert(decode(CMP_Type8, no_distance, sizeof(no_distance), dst, 4) == EIO);
+
+	// Undefined opcodes
+	static const uint8_t undefined[] = { 0x70, 0xD0, 0x1E };
+	for (size_t i = 0; i < sizeof(undefined); i++) {
+		uint8_t stream[] = { 0xE4, 'a', 'b', 'c', 'd', undefined[i], 0x01, 0x06 };
+		assert(decode(CMP_Type8, stream, sizeof(stream), dst, 8) == EIO);
+	}
+
+	// Overlapping copy: one literal repeated
+	static const uint8_t run[] = { 0x50, 0x01, 'z', 0x06 };	// L=1 M=5 D=1
+	assert(decode(CMP_Type8, run, sizeof(run), dst, 6) == 0);
+	assert(!memcmp(dst, "zzzzzz", 6));
+
+	// Truncated opcodes
+	static const uint8_t trunc_lrg_l[] = { 0xE0 };
+	assert(decode(CMP_Type8, trunc_lrg_l, 1, dst, 16) == EIO);
+	static const uint8_t trunc_med_d[] = { 0xE1, 'a', 0xA0, 0x04 };
+	assert(decode(CMP_Type8, trunc_med_d, sizeof(trunc_med_d), dst, 4) == EIO);
+
+	// FSE-coded LZFSE blocks are not supported; junk is an error
+	le32enc(buf, LZFSE_COMPRESSEDV2_MAGIC);
+	assert(decode(CMP_Type12, buf, 32, dst, 16) == EOPNOTSUPP);
+	le32enc(buf, LZFSE_COMPRESSEDV1_MAGIC);
+	assert(decode(CMP_Type12, buf, 32, dst, 16) == EOPNOTSUPP);
+	le32enc(buf, 0x12345678);
+	assert(decode(CMP_Type12, buf, 32, dst, 16) == EIO);
+
+	// A raw block claiming more than the output has room for
+	le32enc(buf, LZFSE_UNCOMPRESSED_MAGIC);
+	le32enc(buf + 4, 40);
+	assert(decode(CMP_Type12, buf, 64, dst, 16) == EIO);
+
+	// Missing end-of-stream block
+	le32enc(buf + 4, 8);
+	assert(decode(CMP_Type12, buf, 16, dst, 8) == EIO);
+
+	// A corrupt zlib stream
+	uLongf zlen = sizeof(buf);
+	assert(compress2(buf, &zlen, (const Bytef *)"hello, hello, hello", 19, 9) == Z_OK);
+	buf[zlen / 2] ^= 0x55;
+	buf[zlen - 1] ^= 0x55;
+	assert(decode(CMP_Type4, buf, zlen, dst, 19) == EIO);
+}
+
+/*
+ * Damage valid streams: truncate them and flip bytes.  The decoder
+ * must either fail or produce exactly the expected length, and never
+ * write outside the output buffer.
+ */
+static void
+test_corrupt(void)
+{
+	const size_t n = 8192;
+	uint8_t *data, *enc, *bad, *dst;
+	size_t len, cut, i;
+	int kind, iter, error;
+
+	data = malloc(n);
+	enc = malloc(lzfse_bound(n, 1000));
+	bad = malloc(lzfse_bound(n, 1000));
+	dst = malloc(n + CANARY_LEN);
+
+	for (kind = 0; kind < NDATA; kind++) {
+		make_data(kind, data, n);
+
+		len = lzvn_encode(data, n, enc);
+		for (cut = 0; cut < len; cut += 1 + cut / 16) {
+			error = decode(CMP_Type8, enc, cut, dst, n);
+			assert(error == EIO || (error == 0 && !memcmp(dst, data, n)));
+		}
+		for (iter = 0; iter < 2000; iter++) {
+			memcpy(bad, enc, len);
+			for (i = 0; i < 1 + (size_t)iter % 4; i++)
+				bad[random() % len] = random();
+			error = decode(CMP_Type8, bad, len, dst, n);
+			assert(error == 0 || error == EIO);
+		}
+
+		len = lzfse_encode(data, n, 1000, enc);
+		for (iter = 0; iter < 2000; iter++) {
+			memcpy(bad, enc, len);
+			bad[random() % len] = random();
+			error = decode(CMP_Type12, bad, len, dst, n);
+			assert(error == 0 || error == EIO || error == EOPNOTSUPP);
+		}
+	}
+
+	free(dst);
+	free(bad);
+	free(enc);
+	free(data);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Decode throughput for 64K chunks, in uncompressed MB/s, best of
+ * several runs.
+ */
+static void
+benchmark(void)
+{
+	const size_t n = DECMPFS_CHUNK_SIZE;
+	uint8_t *data, *enc, *dst;
+	uLongf zlen;
+	size_t len;
+	double t0, t, best_z, best_v;
+	int kind, run, rep, reps = 64;
+
+	data = malloc(n);
+	enc = malloc(lzvn_bound(n) + compressBound(n));
+	dst = malloc(n + CANARY_LEN);
+
+	printf("%-8s %10s %10s %10s %10s\n", "data", "zlib size", "zlib MB/s", "lzvn size", "lzvn MB/s");
+	for (kind = 0; kind < NDATA; kind++) {
+		make_data(kind, data, n);
+
+		zlen = compressBound(n);
+		assert(compress2(enc, &zlen, data, n, Z_DEFAULT_COMPRESSION) == Z_OK);
+		best_z = 0;
+		for (run = 0; run < 5; run++) {
+			t0 = now();
+			for (rep = 0; rep < reps; rep++)
+				assert(hfs_decmpfs_decode(CMP_Type4, enc, zlen, dst, n) == 0);
+			t = now() - t0;
+			if (run == 0 || t < best_z)
+				best_z = t;
+		}
+
+		len = lzvn_encode(data, n, enc);
+		best_v = 0;
+		for (run = 0; run < 5; run++) {
+			t0 = now();
+			for (rep = 0; rep < reps; rep++)
+				assert(hfs_decmpfs_decode(CMP_Type8, enc, len, dst, n) == 0);
+			t = now() - t0;
+			if (run == 0 || t < best_v)
+				best_v = t;
+		}
+
+		printf("%-8s %10lu %10.0f %10zu %10.0f\n", data_names[kind],
+			   (unsigned long)zlen, n * reps / best_z / 1e6, len, n * reps / best_v / 1e6);
+	}
+
+	free(dst);
+	free(enc);
+	free(data);
+}
+
+int main(void)
+{
+	srandom(28);
+
+	test_roundtrip();
+	test_errors();
+	test_corrupt();
+	benchmark();
+
+	printf("[PASSED] hfs_decmpfs_test\n");
+
+	return 0;
+}
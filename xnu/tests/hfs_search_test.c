@@ -0,0 +1,1301 @@
+/*
+ * Copyright (c) 2014-2015 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Tests HFSIOC_SEARCHFS (hfs_search.c and BTreeScanner.c) against a
+ * catalog B-tree built in memory, and benchmarks it against walking
+ * the same catalog the way find(1) does: readdir each folder, then
+ * look up every entry by name.
+ *
+ * The benchmark uses 200,000 files and folders by default; pass a
+ * count to use a bigger catalog, e.g. "hfs_search_test 10000000"
+ * (that needs about 8 GB of memory).
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "test-utils.h"
+
+#define __APPLE_API_PRIVATE 1
+#define __APPLE_API_UNSTABLE 1
+
+#include "../../hfsplus/hfs_format.h"
+#include "../../hfsplus/hfs_fsctl.h"
+
+#define HFS_SEARCH_TEST 1
+
+typedef uint8_t Byte;
+typedef uint8_t Boolean;
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef int16_t SInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int32_t OSStatus;
+typedef uint16_t UniChar;
+typedef unsigned long ByteCount;
+typedef UInt32 HFSCatalogNodeID;
+typedef u_int32_t cnid_t;
+
+typedef struct BlockDescriptor {
+	void *buffer;
+	void *blockHeader;
+	ByteCount blockSize;
+	Boolean blockReadFromDisk;
+	Byte isModified;
+	Byte reserved[2];
+} BlockDescriptor;
+
+#if BYTE_ORDER == LITTLE_ENDIAN
+#define SWAP_BE16(x)	__builtin_bswap16(x)
+#define SWAP_BE32(x)	__builtin_bswap32(x)
+#define SWAP_BE64(x)	__builtin_bswap64(x)
+#else
+#define SWAP_BE16(x)	(x)
+#define SWAP_BE32(x)	(x)
+#define SWAP_BE64(x)	(x)
+#endif
+#ifndef be16toh
+#define be16toh(x)	SWAP_BE16(x)
+#endif
+
+#define panic(fmt, ...)	assert_fail(fmt, __VA_ARGS__)
+
+/* Its kernel headers are the empty ones in tests/kernel-include */
+#include "../../hfsplus/hfs_endian.c"
+
+/*
+ * Enough of the kernel for hfs_search.c and BTreeScanner.c.  The
+ * catalog lives in 'dev', a device image, in two extents.
+ */
+enum {
+	noErr = 0,
+	E_NONE = 0,
+	paramErr = -50,
+	btNotFound = -32767,
+	fsBTRecordNotFoundErr = btNotFound,
+	fsBTInvalidFileErr = -32766,
+	fsEndOfIterationErr = -32765,
+	fsBTTimeOutErr = -32764,
+};
+
+enum { kMaxMicroSecsInKernel = (1000 * 100) };
+
+#undef MAXBSIZE
+#define MAXBSIZE	65536
+#define SECTOR_SIZE	512
+
+#define B_INVAL		0x01
+#define B_AGE		0x02
+#define NOCRED		NULL
+#define LK_SHARED	0x01
+#define LK_EXCLUSIVE	0x02
+#define LK_RELEASE	0x04
+#define LK_CANRECURSE	0x08
+#define MNT_WAIT	1
+#define PRIV_VFS_ADMIN	1
+#define M_TEMP		1
+#define M_WAITOK	0x01
+#define M_ZERO		0x02
+#define UTF_DECOMPOSED	0x04
+
+#define MAC_GMT_FACTOR	2082844800UL
+
+#define min(a, b)	((a) < (b) ? (a) : (b))
+#define roundup2(x, y)	(((x) + ((y) - 1)) & (~((y) - 1)))
+
+typedef BTreeKey *KeyPtr;
+
+typedef union CatalogRecord {
+	int16_t recordType;
+	HFSPlusCatalogFolder hfsPlusFolder;
+	HFSPlusCatalogFile hfsPlusFile;
+	HFSPlusCatalogThread hfsPlusThread;
+} CatalogRecord;
+
+struct vnode;
+
+typedef struct BTreeControlBlock {
+	struct vnode *fileRefNum;
+	u_int32_t leafRecords;
+	u_int16_t nodeSize;
+	u_int32_t totalNodes;
+	u_int32_t attributes;
+	u_int32_t writeCount;
+} BTreeControlBlock, *BTreeControlBlockPtr;
+
+typedef struct FCB {
+	void *fcbBTCBPtr;
+} FCB;
+
+typedef struct ExtendedVCB {
+	u_int16_t vcbSigWord;
+	struct vnode *catalogRefNum;
+} ExtendedVCB;
+
+struct hfsmount {
+	ExtendedVCB hfs_vcb;
+	struct vnode *hfs_devvp;
+	cnid_t hfs_private_metadata_dir;
+};
+
+struct cnode {
+	cnid_t c_fileid;
+};
+
+struct vnode {
+	struct hfsmount *v_hfsmp;
+	FCB v_fcb;
+	struct cnode v_cnode;
+};
+
+#define VTOHFS(vp)		((vp)->v_hfsmp)
+#define VTOF(vp)		(&(vp)->v_fcb)
+#define VTOC(vp)		(&(vp)->v_cnode)
+#define HFSTOVCB(hfsmp)		(&(hfsmp)->hfs_vcb)
+#define VTOVCB(vp)		HFSTOVCB(VTOHFS(vp))
+#define ISHFSPLUS(vcb)		((vcb)->vcbSigWord == kHFSPlusSigWord)
+
+struct buf {
+	int b_flags;
+	long b_bcount;
+	void *b_data;
+};
+
+struct BTScanState {
+	u_int32_t bufferSize;
+	struct buf *bufferPtr;
+	BTreeControlBlock *btcb;
+	u_int32_t nodeNum;
+	u_int32_t recordNum;
+	BTNodeDescriptor *currentNodePtr;
+	u_int32_t nodesLeftInBuffer;
+	u_int32_t recordsFound;
+	struct timeval startTime;
+};
+typedef struct BTScanState BTScanState;
+
+struct ucred;
+typedef struct thread proc_t;
+#define curthread	((proc_t *)NULL)
+
+#define hfs_metafilelocking(hfsmp, fileid, flags, p)	((void)(p), 0)
+#define overflow_extents(fp)				0
+#define VOP_FSYNC(vp, waitfor, p)			((void)(p), 0)
+
+struct catalog {
+	struct hfsmount hfsmp;
+	struct vnode catvp;
+	struct vnode devvp;
+	BTreeControlBlock btcb;
+	u_int8_t *dev;			/* device image */
+	size_t devsize;
+	u_int64_t extstart[2];		/* device offset of each catalog extent */
+	u_int32_t extnodes[2];		/* nodes in each extent */
+	u_int32_t rootnode;
+	u_int32_t firstleaf;
+	u_int32_t lastleaf;
+	u_int16_t depth;
+	struct item *items;		/* indexed by catalog node ID */
+	u_int32_t maxcnid;
+	u_int32_t nreads;		/* device reads so far */
+	u_int64_t nbytes;		/* bytes read so far */
+};
+
+static struct catalog cat;
+static int priv_error;
+
+static int
+priv_check_cred(struct ucred *cred, int priv)
+{
+	return priv_error;
+}
+
+static void
+microuptime(struct timeval *tv)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+static u_int32_t
+to_bsd_time(u_int32_t hfs_time)
+{
+	return (hfs_time > MAC_GMT_FACTOR) ? hfs_time - MAC_GMT_FACTOR : 0;
+}
+
+static int
+MacToVFSError(OSStatus err)
+{
+	if (err >= 0)
+		return err;
+	return (err == btNotFound) ? ENOENT : EIO;
+}
+
+static int
+copyout(const void *kaddr, void *uaddr, size_t len)
+{
+	memcpy(uaddr, kaddr, len);
+	return 0;
+}
+
+/* The test's names are all ASCII. */
+static int
+utf8_decodestr(const u_int8_t *utf8p, size_t utf8len, u_int16_t *ucsp, size_t *ucslen, size_t buflen, u_int16_t altslash, int flags)
+{
+	size_t i;
+
+	if (utf8len * 2 > buflen)
+		return ENAMETOOLONG;
+	for (i = 0; i < utf8len; i++)
+		ucsp[i] = utf8p[i];
+	*ucslen = utf8len * 2;
+	return 0;
+}
+
+static int
+utf8_encodestr(const u_int16_t *ucsp, size_t ucslen, u_int8_t *utf8p, size_t *utf8len, size_t buflen, u_int16_t altslash, int flags)
+{
+	size_t i, len = ucslen / 2;
+
+	if (len + 1 > buflen)
+		return ENAMETOOLONG;
+	for (i = 0; i < len; i++)
+		utf8p[i] = (u_int8_t)ucsp[i];
+	utf8p[len] = '\0';
+	*utf8len = len;
+	return 0;
+}
+
+#define CalcKeySize(btcb, key) (((btcb)->attributes & kBTBigKeysMask) ? ((key)->length16 + 2) : ((key)->length8 + 1))
+
+/* As in BTreeNodeOps.c */
+static OSStatus
+GetRecordByIndex(BTreeControlBlockPtr btreePtr, BTNodeDescriptor *node, UInt16 index, KeyPtr *keyPtr, UInt8 **dataPtr, UInt16 *dataSize)
+{
+	u_int16_t *offsets = (u_int16_t *)((u_int8_t *)node + btreePtr->nodeSize);
+	UInt16 offset, keySize;
+
+	if (index >= node->numRecords)
+		return fsBTRecordNotFoundErr;
+
+	offset = offsets[-1 - index];
+	*keyPtr = (KeyPtr)((u_int8_t *)node + offset);
+	keySize = CalcKeySize(btreePtr, *keyPtr);
+	if (keySize & 1)
+		++keySize;
+	offset += keySize;
+	*dataPtr = (UInt8 *)node + offset;
+	*dataSize = offsets[-2 - index] - offset;
+
+	return noErr;
+}
+
+static OSStatus
+CheckNode(BTreeControlBlockPtr btreePtr, BTNodeDescriptor *node)
+{
+	return noErr;
+}
+
+static OSStatus
+MapFileBlockC(ExtendedVCB *vcb, FCB *fcb, size_t numberOfBytes, off_t offset, daddr_t *startSector, size_t *availableBytes)
+{
+	u_int64_t extbytes = (u_int64_t)cat.extnodes[0] * cat.btcb.nodeSize;
+	u_int64_t start;
+	int ext = 0;
+
+	if (offset >= extbytes) {
+		offset -= extbytes;
+		extbytes = (u_int64_t)cat.extnodes[1] * cat.btcb.nodeSize;
+		ext = 1;
+		if (offset >= extbytes)
+			return fsEndOfIterationErr;
+	}
+	start = cat.extstart[ext] + offset;
+	*startSector = start / SECTOR_SIZE;
+	*availableBytes = min(numberOfBytes, extbytes - offset);
+
+	return noErr;
+}
+
+static int
+bread(struct vnode *vp, daddr_t blkno, int size, struct ucred *cred, struct buf **bpp)
+{
+	struct buf *bp;
+	u_int64_t start = (u_int64_t)blkno * SECTOR_SIZE;
+
+	assert(vp == &cat.devvp);
+	assert(start + size <= cat.devsize);
+	bp = (malloc)(sizeof(*bp));
+	bp->b_flags = 0;
+	bp->b_bcount = size;
+	bp->b_data = (malloc)(size);
+	memcpy(bp->b_data, cat.dev + start, size);
+	cat.nreads++;
+	cat.nbytes += size;
+	*bpp = bp;
+
+	return 0;
+}
+
+static void
+brelse(struct buf *bp)
+{
+	(free)(bp->b_data);
+	(free)(bp);
+}
+
+static void *
+kmalloc(size_t size, int flags)
+{
+	void *p = (flags & M_ZERO) ? calloc(1, size) : (malloc)(size);
+
+	assert(p != NULL);
+	return p;
+}
+
+#define malloc(size, type, flags)	kmalloc(size, flags)
+#define free(ptr, type)			(free)(ptr)
+
+#include "../../hfsplus/hfscommon/BTree/BTreeScanner.c"
+#include "../../hfsplus/hfs_search.c"
+
+#undef malloc
+#undef free
+
+/*
+ * The catalog: a root folder holding the private metadata folder and a
+ * breadth-first tree of folders, each with DIRS_PER_DIR folders and
+ * FILES_PER_DIR files.
+ */
+#define NODE_SIZE	8192
+#define DIRS_PER_DIR	8
+#define FILES_PER_DIR	56
+#define PRIV_FILES	3
+#define FREE_NODES	40
+
+struct item {
+	u_int32_t parent;
+	u_int32_t cnid;		/* 0 for an unused slot */
+	u_int32_t valence;
+	u_int16_t isdir;
+	u_int16_t namelen;
+	char name[24];
+};
+
+/* A leaf record: an item's file or folder record, or its thread. */
+struct catrec {
+	u_int32_t cnid;
+	u_int32_t isthread;
+};
+
+static u_int64_t
+item_size(const struct item *it)
+{
+	return ((u_int64_t)it->cnid * 2654435761u) % (1 << 20);
+}
+
+static u_int32_t
+item_mtime(const struct item *it)
+{
+	return MAC_GMT_FACTOR + 1400000000 + (it->cnid * 7919) % 100000;
+}
+
+static void
+add_item(u_int32_t parent, u_int32_t cnid, int isdir, const char *name)
+{
+	struct item *it = &cat.items[cnid];
+
+	it->parent = parent;
+	it->cnid = cnid;
+	it->isdir = isdir;
+	it->namelen = strlen(name);
+	assert(it->namelen < sizeof(it->name));
+	memcpy(it->name, name, it->namelen);
+	if (parent != kHFSRootParentID)
+		cat.items[parent].valence++;
+	cat.maxcnid = cnid;
+}
+
+static void
+make_items(u_int32_t count)
+{
+	u_int32_t privdir = kHFSFirstUserCatalogNodeID;
+	u_int32_t next = privdir, end, dir, i;
+	char name[24];
+
+	end = privdir + 1 + PRIV_FILES + count;
+	cat.items = calloc(end, sizeof(struct item));
+	add_item(kHFSRootParentID, kHFSRootFolderID, 1, "Macintosh HD");
+	add_item(kHFSRootFolderID, next++, 1, "HFS+ Private Data");
+	for (i = 0; i < PRIV_FILES; i++) {
+		snprintf(name, sizeof(name), "iNode%u", next);
+		add_item(privdir, next++, 0, name);
+	}
+	cat.hfsmp.hfs_private_metadata_dir = privdir;
+
+	for (dir = kHFSRootFolderID; next < end && dir < next; dir = (dir == kHFSRootFolderID) ? privdir + 1 : dir + 1) {
+		if (!cat.items[dir].isdir)
+			continue;
+		for (i = 0; i < DIRS_PER_DIR && next < end; i++) {
+			snprintf(name, sizeof(name), "Dir%u", next);
+			add_item(dir, next++, 1, name);
+		}
+		for (i = 0; i < FILES_PER_DIR && next < end; i++) {
+			snprintf(name, sizeof(name), "file%u.dat", next);
+			add_item(dir, next++, 0, name);
+		}
+	}
+}
+
+static u_int32_t
+catrec_parent(const struct catrec *r)
+{
+	return r->isthread ? r->cnid : cat.items[r->cnid].parent;
+}
+
+/* HFS Plus orders names case-insensitively; these are all ASCII. */
+static int
+name_cmp(const u_int16_t *a, u_int32_t alen, const u_int16_t *b, u_int32_t blen)
+{
+	u_int32_t i, ca, cb;
+
+	for (i = 0; i < alen && i < blen; i++) {
+		ca = (a[i] >= 'A' && a[i] <= 'Z') ? a[i] + 32 : a[i];
+		cb = (b[i] >= 'A' && b[i] <= 'Z') ? b[i] + 32 : b[i];
+		if (ca != cb)
+			return (ca < cb) ? -1 : 1;
+	}
+	return (alen < blen) ? -1 : (alen > blen);
+}
+
+static int
+key_cmp(const HFSPlusCatalogKey *a, const HFSPlusCatalogKey *b)
+{
+	if (a->parentID != b->parentID)
+		return (a->parentID < b->parentID) ? -1 : 1;
+	return name_cmp(a->nodeName.unicode, a->nodeName.length, b->nodeName.unicode, b->nodeName.length);
+}
+
+static int
+catrec_cmp(const void *va, const void *vb)
+{
+	const struct catrec *a = va, *b = vb;
+	const struct item *ia = &cat.items[a->cnid], *ib = &cat.items[b->cnid];
+	u_int32_t pa = catrec_parent(a), pb = catrec_parent(b);
+	u_int32_t i, ca, cb;
+
+	if (pa != pb)
+		return (pa < pb) ? -1 : 1;
+	if (a->isthread || b->isthread)
+		return (int)b->isthread - (int)a->isthread;
+	for (i = 0; i < ia->namelen && i < ib->namelen; i++) {
+		ca = (ia->name[i] >= 'A' && ia->name[i] <= 'Z') ? ia->name[i] + 32 : ia->name[i];
+		cb = (ib->name[i] >= 'A' && ib->name[i] <= 'Z') ? ib->name[i] + 32 : ib->name[i];
+		if (ca != cb)
+			return (ca < cb) ? -1 : 1;
+	}
+	return (int)ia->namelen - (int)ib->namelen;
+}
+
+static size_t
+catrec_keysize(const struct catrec *r)
+{
+	return r->isthread ? 8 : 8 + 2 * cat.items[r->cnid].namelen;
+}
+
+static size_t
+catrec_size(const struct catrec *r)
+{
+	const struct item *it = &cat.items[r->cnid];
+
+	if (r->isthread)
+		return catrec_keysize(r) + offsetof(HFSPlusCatalogThread, nodeName.unicode) + 2 * it->namelen;
+	return catrec_keysize(r) + (it->isdir ? sizeof(HFSPlusCatalogFolder) : sizeof(HFSPlusCatalogFile));
+}
+
+static void
+put_key(u_int8_t *p, u_int32_t parent, const struct item *it)
+{
+	HFSPlusCatalogKey *key = (HFSPlusCatalogKey *)p;
+	u_int32_t i, len = it ? it->namelen : 0;
+
+	key->keyLength = 6 + 2 * len;
+	key->parentID = parent;
+	key->nodeName.length = len;
+	for (i = 0; i < len; i++)
+		key->nodeName.unicode[i] = it->name[i];
+}
+
+static void
+put_record(u_int8_t *p, const struct catrec *r)
+{
+	const struct item *it = &cat.items[r->cnid];
+	CatalogRecord *rec = (CatalogRecord *)(p + catrec_keysize(r));
+	u_int32_t i;
+
+	if (r->isthread) {
+		put_key(p, r->cnid, NULL);
+		rec->hfsPlusThread.recordType = it->isdir ? kHFSPlusFolderThreadRecord : kHFSPlusFileThreadRecord;
+		rec->hfsPlusThread.reserved = 0;
+		rec->hfsPlusThread.parentID = it->parent;
+		rec->hfsPlusThread.nodeName.length = it->namelen;
+		for (i = 0; i < it->namelen; i++)
+			rec->hfsPlusThread.nodeName.unicode[i] = it->name[i];
+	} else if (it->isdir) {
+		put_key(p, it->parent, it);
+		bzero(rec, sizeof(HFSPlusCatalogFolder));
+		rec->hfsPlusFolder.recordType = kHFSPlusFolderRecord;
+		rec->hfsPlusFolder.folderID = it->cnid;
+		rec->hfsPlusFolder.valence = it->valence;
+		rec->hfsPlusFolder.contentModDate = item_mtime(it);
+	} else {
+		put_key(p, it->parent, it);
+		bzero(rec, sizeof(HFSPlusCatalogFile));
+		rec->hfsPlusFile.recordType = kHFSPlusFileRecord;
+		rec->hfsPlusFile.fileID = it->cnid;
+		rec->hfsPlusFile.contentModDate = item_mtime(it);
+		rec->hfsPlusFile.dataFork.logicalSize = item_size(it);
+	}
+}
+
+static BTNodeDescriptor *
+node_ptr(u_int32_t node)
+{
+	if (node < cat.extnodes[0])
+		return (BTNodeDescriptor *)(cat.dev + cat.extstart[0] + (u_int64_t)node * NODE_SIZE);
+	return (BTNodeDescriptor *)(cat.dev + cat.extstart[1] + (u_int64_t)(node - cat.extnodes[0]) * NODE_SIZE);
+}
+
+static u_int16_t *
+node_offsets(BTNodeDescriptor *nd)
+{
+	return (u_int16_t *)((u_int8_t *)nd + NODE_SIZE);
+}
+
+static void
+node_init(BTNodeDescriptor *nd, int8_t kind, u_int8_t height, u_int32_t blink)
+{
+	bzero(nd, NODE_SIZE);
+	nd->kind = kind;
+	nd->height = height;
+	nd->bLink = blink;
+	node_offsets(nd)[-1] = sizeof(BTNodeDescriptor);
+}
+
+/* Does a record of 'len' bytes fit after 'used' bytes of 'nrecs' records? */
+static int
+node_fits(size_t used, u_int32_t nrecs, size_t len)
+{
+	return sizeof(BTNodeDescriptor) + used + len + 2 * (nrecs + 2) <= NODE_SIZE;
+}
+
+static u_int8_t *
+node_append(BTNodeDescriptor *nd, size_t len)
+{
+	u_int16_t *offsets = node_offsets(nd);
+	u_int16_t start = offsets[-1 - nd->numRecords];
+
+	offsets[-2 - nd->numRecords] = start + len;
+	nd->numRecords++;
+	return (u_int8_t *)nd + start;
+}
+
+/*
+ * Pack 'count' records of the given sizes into full nodes; returns
+ * the number of nodes and the first record of each in *startp.
+ */
+static u_int32_t
+pack(u_int32_t count, size_t (*size)(u_int32_t), u_int32_t **startp)
+{
+	u_int32_t *start = (malloc)((count + 1) * sizeof(*start));
+	u_int32_t i, n = 0, nrecs = 0;
+	size_t used = 0, len;
+
+	for (i = 0; i < count; i++) {
+		len = size(i);
+		if (i == 0 || !node_fits(used, nrecs, len)) {
+			start[n++] = i;
+			used = 0;
+			nrecs = 0;
+		}
+		used += len;
+		nrecs++;
+	}
+	start[n] = count;
+	*startp = start;
+	return n;
+}
+
+static struct catrec *recs;
+static u_int32_t *childfirst;	/* first leaf record of each node of the level being indexed */
+
+static size_t
+leaf_size(u_int32_t i)
+{
+	return catrec_size(&recs[i]);
+}
+
+static size_t
+index_size(u_int32_t i)
+{
+	return catrec_keysize(&recs[childfirst[i]]) + sizeof(u_int32_t);
+}
+
+static void
+put_index_key(u_int8_t *p, const struct catrec *r)
+{
+	put_key(p, catrec_parent(r), r->isthread ? NULL : &cat.items[r->cnid]);
+}
+
+/*
+ * Build a catalog of 'count' files and folders in full nodes: the
+ * header, then the leaves, then each index level.  The file is split
+ * into two extents so the scanner's reads stop at an extent boundary.
+ */
+static void
+build_catalog(u_int32_t count)
+{
+	u_int32_t *levelstart[16], *firstrec[16], levelnodes[16], levelfirst[16];
+	u_int32_t nrecs = 0, totalnodes, level, nlevels, i, j, n, node, child;
+	size_t maplen;
+	BTNodeDescriptor *nd;
+	BTHeaderRec *hdr;
+	BlockDescriptor bd;
+	u_int8_t *p;
+
+	bzero(&cat, sizeof(cat));
+	make_items(count);
+
+	recs = (malloc)(2 * (cat.maxcnid + 1) * sizeof(*recs));
+	for (i = 0; i <= cat.maxcnid; i++) {
+		if (cat.items[i].cnid == 0)
+			continue;
+		recs[nrecs].cnid = i;
+		recs[nrecs++].isthread = 0;
+		recs[nrecs].cnid = i;
+		recs[nrecs++].isthread = 1;
+	}
+	qsort(recs, nrecs, sizeof(*recs), catrec_cmp);
+
+	/* Size every level first so the device can be allocated. */
+	levelnodes[0] = pack(nrecs, leaf_size, &levelstart[0]);
+	firstrec[0] = levelstart[0];
+	levelfirst[0] = 1;
+	totalnodes = 1 + levelnodes[0];
+	for (nlevels = 1; levelnodes[nlevels - 1] > 1; nlevels++) {
+		assert(nlevels < 16);
+		childfirst = firstrec[nlevels - 1];
+		levelnodes[nlevels] = pack(levelnodes[nlevels - 1], index_size, &levelstart[nlevels]);
+		firstrec[nlevels] = (malloc)(levelnodes[nlevels] * sizeof(u_int32_t));
+		for (n = 0; n < levelnodes[nlevels]; n++)
+			firstrec[nlevels][n] = childfirst[levelstart[nlevels][n]];
+		levelfirst[nlevels] = totalnodes;
+		totalnodes += levelnodes[nlevels];
+	}
+	totalnodes += FREE_NODES;
+
+	cat.extnodes[0] = totalnodes / 2;
+	cat.extnodes[1] = totalnodes - cat.extnodes[0];
+	cat.extstart[0] = 1 << 20;
+	cat.extstart[1] = cat.extstart[0] + (u_int64_t)cat.extnodes[0] * NODE_SIZE + 128 * 1024;
+	cat.devsize = cat.extstart[1] + (u_int64_t)cat.extnodes[1] * NODE_SIZE;
+	cat.dev = calloc(1, cat.devsize);
+	assert(cat.dev != NULL);
+
+	/* Leaves */
+	for (n = 0; n < levelnodes[0]; n++) {
+		node = levelfirst[0] + n;
+		nd = node_ptr(node);
+		node_init(nd, kBTLeafNode, 1, n ? node - 1 : 0);
+		nd->fLink = (n + 1 < levelnodes[0]) ? node + 1 : 0;
+		for (i = levelstart[0][n]; i < levelstart[0][n + 1]; i++)
+			put_record(node_append(nd, catrec_size(&recs[i])), &recs[i]);
+	}
+
+	/* Index levels: one entry per node of the level below, keyed by its first record. */
+	for (level = 1; level < nlevels; level++) {
+		for (n = 0; n < levelnodes[level]; n++) {
+			node = levelfirst[level] + n;
+			nd = node_ptr(node);
+			node_init(nd, kBTIndexNode, level + 1, n ? node - 1 : 0);
+			nd->fLink = (n + 1 < levelnodes[level]) ? node + 1 : 0;
+			for (j = levelstart[level][n]; j < levelstart[level][n + 1]; j++) {
+				const struct catrec *r = &recs[firstrec[level - 1][j]];
+
+				p = node_append(nd, catrec_keysize(r) + sizeof(u_int32_t));
+				put_index_key(p, r);
+				child = levelfirst[level - 1] + j;
+				memcpy(p + catrec_keysize(r), &child, sizeof(child));
+			}
+		}
+	}
+
+	cat.depth = nlevels;
+	cat.rootnode = levelfirst[nlevels - 1];
+	cat.firstleaf = levelfirst[0];
+	cat.lastleaf = levelfirst[0] + levelnodes[0] - 1;
+
+	/* Header node: header record, user data record, map record. */
+	nd = node_ptr(0);
+	node_init(nd, kBTHeaderNode, 0, 0);
+	hdr = (BTHeaderRec *)node_append(nd, sizeof(BTHeaderRec));
+	hdr->treeDepth = cat.depth;
+	hdr->rootNode = cat.rootnode;
+	hdr->leafRecords = nrecs;
+	hdr->firstLeafNode = cat.firstleaf;
+	hdr->lastLeafNode = cat.lastleaf;
+	hdr->nodeSize = NODE_SIZE;
+	hdr->maxKeyLength = kHFSPlusCatalogKeyMaximumLength;
+	hdr->totalNodes = totalnodes;
+	hdr->freeNodes = FREE_NODES;
+	hdr->attributes = kBTBigKeysMask | kBTVariableIndexKeysMask;
+	node_append(nd, 128);
+	maplen = NODE_SIZE - sizeof(BTNodeDescriptor) - sizeof(BTHeaderRec) - 128 - 4 * sizeof(u_int16_t);
+	p = node_append(nd, maplen);
+	/* Nothing here reads the map, so big trees just get the header's share (no map nodes). */
+	for (i = 0; i < totalnodes - FREE_NODES && i / 8 < maplen; i++)
+		p[i / 8] |= 0x80 >> (i % 8);
+
+	/* Everything goes to "disk" big-endian; the free nodes stay zeroed. */
+	for (node = 0; node < totalnodes - FREE_NODES; node++) {
+		bzero(&bd, sizeof(bd));
+		bd.buffer = node_ptr(node);
+		bd.blockSize = NODE_SIZE;
+		assert_equal_int(hfs_swap_BTNode(&bd, 1, kHFSCatalogFileID, 1), 0);
+	}
+
+	for (level = 0; level < nlevels; level++) {
+		(free)(levelstart[level]);
+		if (level > 0)
+			(free)(firstrec[level]);
+	}
+	(free)(recs);
+
+	cat.btcb.fileRefNum = &cat.catvp;
+	cat.btcb.leafRecords = nrecs;
+	cat.btcb.nodeSize = NODE_SIZE;
+	cat.btcb.totalNodes = totalnodes;
+	cat.btcb.attributes = kBTBigKeysMask | kBTVariableIndexKeysMask;
+	cat.btcb.writeCount = 1;
+	cat.catvp.v_hfsmp = &cat.hfsmp;
+	cat.catvp.v_fcb.fcbBTCBPtr = &cat.btcb;
+	cat.catvp.v_cnode.c_fileid = kHFSCatalogFileID;
+	cat.devvp.v_hfsmp = &cat.hfsmp;
+	cat.hfsmp.hfs_vcb.vcbSigWord = kHFSPlusSigWord;
+	cat.hfsmp.hfs_vcb.catalogRefNum = &cat.catvp;
+	cat.hfsmp.hfs_devvp = &cat.devvp;
+}
+
+static void
+free_catalog(void)
+{
+	(free)(cat.dev);
+	(free)(cat.items);
+}
+
+/* What the search should return, worked out from the item list. */
+static int
+expected_match(const struct item *it, u_int32_t options, const struct hfs_search_criteria *sc)
+{
+	int64_t mtime = item_mtime(it) - MAC_GMT_FACTOR;
+
+	if ((options & (HFS_SRCH_FILES | HFS_SRCH_DIRS)) == 0)
+		options |= HFS_SRCH_FILES | HFS_SRCH_DIRS;
+	if (it->cnid == 0 || !(options & (it->isdir ? HFS_SRCH_DIRS : HFS_SRCH_FILES)))
+		return 0;
+	if (it->cnid == cat.hfsmp.hfs_private_metadata_dir || it->parent == cat.hfsmp.hfs_private_metadata_dir)
+		return 0;
+	if ((options & HFS_SRCH_PARENT) && it->parent != sc->sc_parentid)
+		return 0;
+	if ((options & HFS_SRCH_SIZE) && (it->isdir || item_size(it) < sc->sc_minsize || item_size(it) > sc->sc_maxsize))
+		return 0;
+	if ((options & HFS_SRCH_MTIME) && (mtime < sc->sc_mintime || mtime > sc->sc_maxtime))
+		return 0;
+	if (options & HFS_SRCH_EXACT)
+		return strlen(sc->sc_name) == it->namelen && strncasecmp(it->name, sc->sc_name, it->namelen) == 0;
+	if (options & HFS_SRCH_NAME)
+		return strcasestr(it->name, sc->sc_name) != NULL;
+	return 1;
+}
+
+struct search {
+	u_int32_t options;
+	struct hfs_search_criteria criteria;
+	size_t buflen;
+	u_int32_t maxmatches;
+	u_int32_t timelimit;
+};
+
+/*
+ * Run a search to completion and check every entry it returns against
+ * the items; returns the number of matches.
+ */
+static u_int32_t
+run_search(const struct search *s, u_int32_t *ncallsp)
+{
+	struct hfs_search_args args;
+	struct hfs_search_entry *ep;
+	const struct item *it;
+	u_int8_t *seen = calloc(cat.maxcnid + 1, 1);
+	char *buf = (malloc)(s->buflen);
+	u_int32_t found = 0, ncalls = 0, cnid, count;
+	size_t off;
+
+	bzero(&args, sizeof(args));
+	args.sa_options = s->options | HFS_SRCH_START;
+	args.sa_criteria = s->criteria;
+	args.sa_maxmatches = s->maxmatches;
+	args.sa_timelimit = s->timelimit;
+	do {
+		args.sa_buf = buf;
+		args.sa_buflen = s->buflen;
+		assert_no_err(hfs_searchfs(&cat.catvp, &args, NULL));
+		assert(!(args.sa_options & HFS_SRCH_START));
+		assert(s->maxmatches == 0 || args.sa_nummatches <= s->maxmatches);
+		ncalls++;
+		count = 0;
+		for (off = 0; off < args.sa_buflen; off += ep->se_reclen) {
+			ep = (struct hfs_search_entry *)(buf + off);
+			assert(ep->se_reclen % 8 == 0 && off + ep->se_reclen <= args.sa_buflen);
+			cnid = ep->se_fileid;
+			assert(cnid <= cat.maxcnid && cat.items[cnid].cnid == cnid);
+			it = &cat.items[cnid];
+			assert(!seen[cnid]);
+			seen[cnid] = 1;
+			assert(expected_match(it, s->options, &s->criteria));
+			assert_equal_int(ep->se_parentid, it->parent);
+			assert_equal_int(ep->se_type, it->isdir ? DT_DIR : DT_REG);
+			assert_equal_int(ep->se_namlen, it->namelen);
+			assert(memcmp(ep->se_name, it->name, it->namelen) == 0 && ep->se_name[it->namelen] == '\0');
+			assert_equal_ll((long long)ep->se_size, (long long)(it->isdir ? it->valence : item_size(it)));
+			assert_equal_ll((long long)ep->se_mtime, (long long)(item_mtime(it) - MAC_GMT_FACTOR));
+			count++;
+		}
+		assert_equal_int(count, args.sa_nummatches);
+		found += count;
+	} while (!(args.sa_options & HFS_SRCH_DONE));
+
+	for (cnid = 0; cnid <= cat.maxcnid; cnid++)
+		assert_equal_int(seen[cnid], expected_match(&cat.items[cnid], s->options, &s->criteria));
+
+	(free)(seen);
+	(free)(buf);
+	if (ncallsp != NULL)
+		*ncallsp = ncalls;
+	return found;
+}
+
+static void
+test_criteria(void)
+{
+	struct search s;
+	u_int32_t all, n, ncalls, i;
+
+	build_catalog(20000);
+
+	bzero(&s, sizeof(s));
+	s.buflen = 1 << 20;
+	all = run_search(&s, NULL);
+	assert_equal_int(all, 20001); /* and the root */
+
+	s.options = HFS_SRCH_FILES;
+	n = run_search(&s, NULL);
+	s.options = HFS_SRCH_DIRS;
+	assert_equal_int(n + run_search(&s, NULL), all);
+
+	s.options = HFS_SRCH_NAME;
+	strcpy(s.criteria.sc_name, "LE12");
+	assert(run_search(&s, NULL) > 0);
+	strcpy(s.criteria.sc_name, "Private");
+	assert_equal_int(run_search(&s, NULL), 0);
+
+	s.options = HFS_SRCH_EXACT | HFS_SRCH_FILES | HFS_SRCH_DIRS;
+	strcpy(s.criteria.sc_name, "DIR20");
+	assert_equal_int(run_search(&s, NULL), 1);
+	strcpy(s.criteria.sc_name, "dir2");
+	assert_equal_int(run_search(&s, NULL), 0);
+	strcpy(s.criteria.sc_name, "Macintosh HD");
+	assert_equal_int(run_search(&s, NULL), 1);
+
+	s.options = HFS_SRCH_PARENT;
+	s.criteria.sc_parentid = 21;
+	assert_equal_int(run_search(&s, NULL), DIRS_PER_DIR + FILES_PER_DIR);
+
+	s.options = HFS_SRCH_SIZE;
+	s.criteria.sc_minsize = 1000;
+	s.criteria.sc_maxsize = 300000;
+	assert(run_search(&s, NULL) > 0);
+
+	s.options = HFS_SRCH_MTIME | HFS_SRCH_NAME | HFS_SRCH_FILES;
+	strcpy(s.criteria.sc_name, ".dat");
+	s.criteria.sc_mintime = 1400020000;
+	s.criteria.sc_maxtime = 1400030000;
+	assert(run_search(&s, NULL) > 0);
+
+	/* Resume after a full buffer, after maxmatches, and after the time slice. */
+	bzero(&s, sizeof(s));
+	s.buflen = 512;
+	assert_equal_int(run_search(&s, &ncalls), all);
+	assert(ncalls > all / 16);
+	s.buflen = 1 << 20;
+	for (i = 1; i < 12; i += 5) {
+		s.maxmatches = i;
+		assert_equal_int(run_search(&s, &ncalls), all);
+		assert(ncalls >= all / i);
+	}
+	s.maxmatches = 0;
+	s.timelimit = 1;
+	assert_equal_int(run_search(&s, &ncalls), all);
+	assert(ncalls > 1);
+
+	free_catalog();
+	printf("[PASSED] hfs_search_test criteria\n");
+}
+
+static void
+test_errors(void)
+{
+	struct hfs_search_args args;
+	char buf[4096];
+
+	build_catalog(1000);
+
+	bzero(&args, sizeof(args));
+	args.sa_options = HFS_SRCH_START;
+	args.sa_buflen = sizeof(buf);
+	assert_equal_int(hfs_searchfs(&cat.catvp, &args, NULL), EINVAL);
+
+	/* Too small for even one entry */
+	args.sa_buf = buf;
+	args.sa_buflen = sizeof(struct hfs_search_entry);
+	assert_equal_int(hfs_searchfs(&cat.catvp, &args, NULL), ENOBUFS);
+
+	args.sa_options = HFS_SRCH_START | HFS_SRCH_NAME;
+	args.sa_buflen = sizeof(buf);
+	assert_equal_int(hfs_searchfs(&cat.catvp, &args, NULL), EINVAL);
+	memset(args.sa_criteria.sc_name, 'a', sizeof(args.sa_criteria.sc_name));
+	assert_equal_int(hfs_searchfs(&cat.catvp, &args, NULL), EINVAL);
+	bzero(&args.sa_criteria, sizeof(args.sa_criteria));
+
+	priv_error = EPERM;
+	args.sa_options = HFS_SRCH_START;
+	assert_equal_int(hfs_searchfs(&cat.catvp, &args, NULL), EPERM);
+	priv_error = 0;
+
+	cat.hfsmp.hfs_vcb.vcbSigWord = kHFSSigWord;
+	assert_equal_int(hfs_searchfs(&cat.catvp, &args, NULL), EOPNOTSUPP);
+	cat.hfsmp.hfs_vcb.vcbSigWord = kHFSPlusSigWord;
+
+	/* A catalog change between calls */
+	args.sa_maxmatches = 10;
+	assert_no_err(hfs_searchfs(&cat.catvp, &args, NULL));
+	assert_equal_int(args.sa_nummatches, 10);
+	args.sa_buflen = sizeof(buf);
+	assert_no_err(hfs_searchfs(&cat.catvp, &args, NULL));
+	cat.btcb.writeCount++;
+	args.sa_buflen = sizeof(buf);
+	assert_equal_int(hfs_searchfs(&cat.catvp, &args, NULL), EBUSY);
+	args.sa_options |= HFS_SRCH_START;
+	args.sa_buflen = sizeof(buf);
+	assert_no_err(hfs_searchfs(&cat.catvp, &args, NULL));
+	assert_equal_int(args.sa_nummatches, 10);
+
+	free_catalog();
+	printf("[PASSED] hfs_search_test errors\n");
+}
+
+/*
+ * The baseline: what find(1) costs.  readdir walks a folder's records
+ * from its thread record (cat_getdirentries), then each entry is
+ * looked up by name (cat_lookup).  Nodes are read one per I/O, as
+ * GetBTreeBlock does, and kept once read; that is the best the
+ * buffer cache could do.
+ */
+struct walk {
+	BTNodeDescriptor **nodes;
+	struct hfs_searchstate *ss;
+	u_int32_t matches;
+	u_int64_t cnidsum;
+};
+
+static BTNodeDescriptor *
+walk_node(struct walk *w, u_int32_t node)
+{
+	BlockDescriptor bd;
+	struct buf *bp;
+	daddr_t blkno;
+	size_t avail;
+
+	if (w->nodes[node] == NULL) {
+		assert_no_err(MapFileBlockC(&cat.hfsmp.hfs_vcb, &cat.catvp.v_fcb, NODE_SIZE, (off_t)node * NODE_SIZE, &blkno, &avail));
+		assert_no_err(bread(&cat.devvp, blkno, NODE_SIZE, NOCRED, &bp));
+		w->nodes[node] = (malloc)(NODE_SIZE);
+		memcpy(w->nodes[node], bp->b_data, NODE_SIZE);
+		brelse(bp);
+		bzero(&bd, sizeof(bd));
+		bd.buffer = w->nodes[node];
+		bd.blockSize = NODE_SIZE;
+		assert_equal_int(hfs_swap_BTNode(&bd, 1, kHFSCatalogFileID, 0), 0);
+	}
+	return w->nodes[node];
+}
+
+/* Find the first record >= key, as BTSearchRecord would. */
+static void
+walk_search(struct walk *w, const HFSPlusCatalogKey *key, u_int32_t *nodep, u_int32_t *indexp)
+{
+	BTNodeDescriptor *nd;
+	KeyPtr k;
+	UInt8 *data;
+	UInt16 size;
+	u_int32_t node = cat.rootnode, lo, hi, mid;
+
+	for (;;) {
+		nd = walk_node(w, node);
+		lo = 0;
+		hi = nd->numRecords;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			GetRecordByIndex(&cat.btcb, nd, mid, &k, &data, &size);
+			if (key_cmp((HFSPlusCatalogKey *)k, key) < (nd->kind == kBTLeafNode ? 0 : 1))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (nd->kind == kBTLeafNode)
+			break;
+		GetRecordByIndex(&cat.btcb, nd, lo ? lo - 1 : 0, &k, &data, &size);
+		memcpy(&node, data, sizeof(node));
+	}
+	*nodep = node;
+	*indexp = lo;
+}
+
+static const CatalogRecord *
+walk_lookup(struct walk *w, const HFSPlusCatalogKey *key)
+{
+	BTNodeDescriptor *nd;
+	KeyPtr k;
+	UInt8 *data;
+	UInt16 size;
+	u_int32_t node, index;
+
+	walk_search(w, key, &node, &index);
+	nd = walk_node(w, node);
+	if (index == nd->numRecords)
+		nd = walk_node(w, nd->fLink);
+	assert_no_err(GetRecordByIndex(&cat.btcb, nd, index == nd->numRecords ? 0 : index, &k, &data, &size));
+	assert(key_cmp((HFSPlusCatalogKey *)k, key) == 0);
+	return (const CatalogRecord *)data;
+}
+
+static void
+walk_dir(struct walk *w, u_int32_t dirid)
+{
+	HFSPlusCatalogKey key, *names = NULL, *kp;
+	const CatalogRecord *rec;
+	BTNodeDescriptor *nd;
+	KeyPtr k;
+	UInt8 *data;
+	UInt16 size;
+	u_int32_t node, index, count = 0, room = 0, *subdirs, nsubdirs = 0, i;
+
+	/* readdir */
+	bzero(&key, sizeof(key));
+	key.keyLength = 6;
+	key.parentID = dirid;
+	walk_search(w, &key, &node, &index);
+	for (nd = walk_node(w, node);; index++) {
+		if (index >= nd->numRecords) {
+			if (nd->fLink == 0)
+				break;
+			nd = walk_node(w, nd->fLink);
+			index = 0;
+		}
+		GetRecordByIndex(&cat.btcb, nd, index, &k, &data, &size);
+		kp = (HFSPlusCatalogKey *)k;
+		if (kp->parentID != dirid)
+			break;
+		rec = (const CatalogRecord *)data;
+		if (rec->recordType != kHFSPlusFolderRecord && rec->recordType != kHFSPlusFileRecord)
+			continue;
+		if (count == room) {
+			room = room ? 2 * room : 64;
+			names = realloc(names, room * sizeof(*names));
+		}
+		memcpy(&names[count++], kp, kp->keyLength + 2);
+	}
+
+	/* stat */
+	subdirs = (malloc)((count + 1) * sizeof(*subdirs));
+	for (i = 0; i < count; i++) {
+		rec = walk_lookup(w, &names[i]);
+		if (hfs_search_match(w->ss, &names[i], rec)) {
+			w->matches++;
+			w->cnidsum += (rec->recordType == kHFSPlusFolderRecord) ? rec->hfsPlusFolder.folderID : rec->hfsPlusFile.fileID;
+		}
+		if (rec->recordType == kHFSPlusFolderRecord && rec->hfsPlusFolder.folderID != cat.hfsmp.hfs_private_metadata_dir)
+			subdirs[nsubdirs++] = rec->hfsPlusFolder.folderID;
+	}
+	(free)(names);
+
+	for (i = 0; i < nsubdirs; i++)
+		walk_dir(w, subdirs[i]);
+	(free)(subdirs);
+}
+
+static void
+walk(struct hfs_search_args *args, u_int32_t *matchesp, u_int64_t *cnidsump)
+{
+	struct walk w;
+	HFSPlusCatalogKey key;
+	const CatalogRecord *rec;
+	u_int32_t i;
+
+	bzero(&w, sizeof(w));
+	w.nodes = calloc(cat.btcb.totalNodes, sizeof(*w.nodes));
+	w.ss = calloc(1, sizeof(*w.ss));
+	assert_no_err(hfs_search_setup(&cat.hfsmp, args, w.ss));
+
+	/* stat("/") */
+	put_key((u_int8_t *)&key, kHFSRootParentID, &cat.items[kHFSRootFolderID]);
+	rec = walk_lookup(&w, &key);
+	if (hfs_search_match(w.ss, &key, rec)) {
+		w.matches++;
+		w.cnidsum += kHFSRootFolderID;
+	}
+	walk_dir(&w, kHFSRootFolderID);
+
+	for (i = 0; i < cat.btcb.totalNodes; i++)
+		(free)(w.nodes[i]);
+	(free)(w.nodes);
+	(free)(w.ss);
+	*matchesp = w.matches;
+	*cnidsump = w.cnidsum;
+}
+
+static void
+scan(struct hfs_search_args *args, u_int32_t *matchesp, u_int64_t *cnidsump)
+{
+	static char buf[64 * 1024];
+	struct hfs_search_entry *ep;
+	size_t off;
+
+	*matchesp = 0;
+	*cnidsump = 0;
+	args->sa_options |= HFS_SRCH_START;
+	do {
+		args->sa_buf = buf;
+		args->sa_buflen = sizeof(buf);
+		assert_no_err(hfs_searchfs(&cat.catvp, args, NULL));
+		for (off = 0; off < args->sa_buflen; off += ep->se_reclen) {
+			ep = (struct hfs_search_entry *)(buf + off);
+			*cnidsump += ep->se_fileid;
+		}
+		*matchesp += args->sa_nummatches;
+	} while (!(args->sa_options & HFS_SRCH_DONE));
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Search the whole catalog by name both ways, best of five runs each;
+ * reports the time and the device reads each took.
+ */
+static void
+benchmark(u_int32_t count)
+{
+	typedef void (*search_fn)(struct hfs_search_args *, u_int32_t *, u_int64_t *);
+	static const search_fn fns[] = { scan, walk };
+	static const char *names[] = { "searchfs", "readdir+lookup" };
+	struct hfs_search_args args;
+	u_int32_t matches[2], nreads[2];
+	u_int64_t cnidsum[2], nbytes[2];
+	double best[2], t0, t;
+	int f, run;
+
+	build_catalog(count);
+
+	printf("%u files and folders, %u leaf records, %u nodes, depth %u\n", count, cat.btcb.leafRecords, cat.btcb.totalNodes,
+	    cat.depth);
+	printf("%-15s %9s %9s %10s %9s\n", "method", "ms", "reads", "MB read", "matches");
+	for (f = 0; f < 2; f++) {
+		for (run = 0; run < 5; run++) {
+			bzero(&args, sizeof(args));
+			args.sa_options = HFS_SRCH_NAME;
+			strcpy(args.sa_criteria.sc_name, "123");
+			cat.nreads = 0;
+			cat.nbytes = 0;
+			t0 = now();
+			fns[f](&args, &matches[f], &cnidsum[f]);
+			t = now() - t0;
+			if (run == 0 || t < best[f])
+				best[f] = t;
+		}
+		nreads[f] = cat.nreads;
+		nbytes[f] = cat.nbytes;
+		printf("%-15s %9.1f %9u %10.1f %9u\n", names[f], best[f] * 1e3, nreads[f], nbytes[f] / 1048576.0, matches[f]);
+	}
+	assert_equal_int(matches[0], matches[1]);
+	assert_equal_ll((long long)cnidsum[0], (long long)cnidsum[1]);
+	printf("searchfs: %.1fx faster, %.1fx fewer reads\n", best[1] / best[0], (double)nreads[1] / nreads[0]);
+
+	free_catalog();
+}
+
+int main(int argc, char *argv[])
+{
+	test_criteria();
+	test_errors();
+	benchmark(argc > 1 ? (u_int32_t)strtoul(argv[1], NULL, 0) : 200000);
+
+	printf("[PASSED] hfs_search_test\n");
+
+	return 0;
+}
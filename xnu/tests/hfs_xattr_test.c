@@ -0,0 +1,813 @@
+/*
+ * Copyright (c) 2014-2015 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Tests the extended attribute operations of hfsplus/hfs_xattr.c and
+ * benchmarks listextattr and getextattr.  As for hfs_btcompact_test, the
+ * kernel B-tree code can't be built in user space, so hfs_xattr.c is
+ * built against the fsck_hfs B-tree library (dfalib), with the attributes
+ * B-tree and the attribute data blocks kept in memory.
+ *
+ * The benchmark uses 20,000 files by default; pass one or more counts to
+ * change it, e.g. "hfs_xattr_test 20000 200000".
+ */
+
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define HFS_XATTR_TEST 1
+
+#include "fsck_btree_test.h"
+
+#ifndef ENOATTR
+#define ENOATTR				ENODATA
+#endif
+
+/* What hfs_xattr.c uses of the kernel */
+#define FCB				SFCB
+#define BTSearchRecord(file, iterator, record, recordLen, resultIterator) \
+	BTSearchRecord(file, iterator, kInvalidMRUCacheKey, record, recordLen, resultIterator)
+#define M_TEMP				0
+#define M_WAITOK			0
+#define M_ZERO				0
+#define MALLOC_DEFINE(type, shortdesc, longdesc)	int type
+#define malloc(size, type, flags)	calloc(1, (size))
+#define free(addr, type)		(free)(addr)
+#define reallocf(addr, size, type, flags)	realloc((addr), (size))
+#define min(a, b)			((a) < (b) ? (a) : (b))
+#define max(a, b)			((a) > (b) ? (a) : (b))
+#ifndef roundup2
+#define roundup2(x, y)			(((x) + ((y) - 1)) & ~((y) - 1))
+#endif
+
+#define LK_SHARED			1
+#define LK_EXCLUSIVE			2
+#define LK_RELEASE			3
+#define EXTATTR_NAMESPACE_USER		1
+#define PRIV_VFS_EXTATTR_SYSTEM		1
+#define VREAD				1
+#define VWRITE				2
+#define VV_SYSTEM			1
+#define C_CHANGE			1
+#define UTF_NO_NULL_TERM		1
+#undef MNT_RDONLY
+#define MNT_RDONLY			1
+#define NOCRED				((struct ucred *)NULL)
+#define curthread			((struct thread *)NULL)
+
+typedef int accmode_t;
+typedef struct thread proc_t;
+
+struct ucred {
+	uid_t cr_uid;
+};
+
+struct buf {
+	void *b_data;
+};
+
+/* Not the <sys/uio.h> one */
+#define uio				test_uio
+#define UIO_SYSSPACE			1
+#define UIO_READ			0
+#define UIO_WRITE			1
+
+struct uio {
+	struct iovec *uio_iov;
+	int uio_iovcnt;
+	off_t uio_offset;
+	ssize_t uio_resid;
+	int uio_segflg;
+	int uio_rw;
+	struct thread *uio_td;
+};
+
+typedef struct {
+	u_int16_t vcbSigWord;
+	u_int32_t blockSize;
+	u_int32_t totalBlocks;
+	off_t hfsPlusIOPosOffset;
+	struct vnode *attributesRefNum;
+} ExtendedVCB;
+
+struct hfsmount {
+	ExtendedVCB hfs_vcb;
+	u_int32_t hfs_max_inline_attrsize;
+	struct vnode *hfs_devvp;
+};
+
+struct cnode {
+	u_int32_t c_fileid;
+	u_int32_t c_recflags;
+	u_int32_t c_flag;
+};
+
+struct mount {
+	int mnt_flag;
+	struct hfsmount *mnt_data;
+};
+
+struct vnode {
+	struct cnode *v_data;
+	SFCB *v_fcb;
+	int v_vflag;
+	struct mount *v_mount;
+};
+
+#define VTOC(vp)			((vp)->v_data)
+#define VTOF(vp)			((vp)->v_fcb)
+#define VTOHFS(vp)			((vp)->v_mount->mnt_data)
+#define HFSTOVCB(hfsmp)			(&(hfsmp)->hfs_vcb)
+#define VTOVCB(vp)			HFSTOVCB(VTOHFS(vp))
+
+struct vop_getextattr_args {
+	struct vnode *a_vp;
+	int a_attrnamespace;
+	const char *a_name;
+	struct uio *a_uio;
+	size_t *a_size;
+	struct ucred *a_cred;
+	struct thread *a_td;
+};
+
+struct vop_setextattr_args {
+	struct vnode *a_vp;
+	int a_attrnamespace;
+	const char *a_name;
+	struct uio *a_uio;
+	struct ucred *a_cred;
+	struct thread *a_td;
+};
+
+struct vop_deleteextattr_args {
+	struct vnode *a_vp;
+	int a_attrnamespace;
+	const char *a_name;
+	struct ucred *a_cred;
+	struct thread *a_td;
+};
+
+struct vop_listextattr_args {
+	struct vnode *a_vp;
+	int a_attrnamespace;
+	struct uio *a_uio;
+	size_t *a_size;
+	struct ucred *a_cred;
+	struct thread *a_td;
+};
+
+/* The attribute data blocks, and which of them are allocated */
+static UInt8 *devData;
+static UInt8 *devBitmap;
+static u_int32_t devBlocksUsed;
+
+/* Attributes B-tree lock calls, and decmpfs cache flushes */
+static u_int32_t lockCalls;
+static u_int32_t decmpfsDestroys;
+
+static int
+hfs_metafilelocking(struct hfsmount *hfsmp, u_int32_t fileID, int flags, proc_t *p)
+{
+	(void)hfsmp; (void)flags; (void)p;
+	if (fileID == kHFSAttributesFileID)
+		lockCalls++;
+	return 0;
+}
+
+static short
+MacToVFSError(OSErr err)
+{
+	switch (err) {
+	case noErr:
+		return 0;
+	case btNotFound:
+		return ENOENT;
+	case btExists:
+		return EEXIST;
+	case dskFulErr:
+	case fsBTFullErr:
+		return ENOSPC;
+	default:
+		return EIO;
+	}
+}
+
+static OSErr
+BlockAllocate(ExtendedVCB *vcb, UInt32 startingBlock, SInt64 bytesRequested, SInt64 bytesMaximum, Boolean forceContiguous,
+			  UInt32 *startBlock, UInt32 *actualBlocks)
+{
+	UInt32 want = howmany(bytesRequested, vcb->blockSize), run = 0, i;
+
+	(void)startingBlock; (void)bytesMaximum; (void)forceContiguous;
+	for (i = 0; i < vcb->totalBlocks; i++) {
+		run = devBitmap[i] ? 0 : run + 1;
+		if (run == want) {
+			*startBlock = i + 1 - want;
+			*actualBlocks = want;
+			memset(devBitmap + *startBlock, 1, want);
+			devBlocksUsed += want;
+			return noErr;
+		}
+	}
+	return dskFulErr;
+}
+
+static OSErr
+BlockDeallocate(ExtendedVCB *vcb, UInt32 firstBlock, UInt32 numBlocks)
+{
+	UInt32 i;
+
+	for (i = firstBlock; i < firstBlock + numBlocks; i++) {
+		assert(i < vcb->totalBlocks && devBitmap[i]);
+		devBitmap[i] = 0;
+	}
+	devBlocksUsed -= numBlocks;
+	return noErr;
+}
+
+static struct buf *
+getblk(struct vnode *vp, daddr_t blkno, int size, int slpflag, int slptimeo, int flags)
+{
+	struct buf *bp = (calloc)(1, sizeof(*bp));
+
+	(void)vp; (void)size; (void)slpflag; (void)slptimeo; (void)flags;
+	assert(bp != NULL);
+	bp->b_data = devData + blkno * DEV_BSIZE;
+	return bp;
+}
+
+static int
+bread(struct vnode *vp, daddr_t blkno, int size, struct ucred *cred, struct buf **bpp)
+{
+	(void)cred;
+	*bpp = getblk(vp, blkno, size, 0, 0, 0);
+	return 0;
+}
+
+static void
+brelse(struct buf *bp)
+{
+	(free)(bp);
+}
+
+static int
+bwrite(struct buf *bp)
+{
+	brelse(bp);
+	return 0;
+}
+
+static int
+uiomove(void *cp, int n, struct uio *uio)
+{
+	struct iovec *iov = uio->uio_iov;
+
+	assert(uio->uio_iovcnt == 1);
+	n = min(n, uio->uio_resid);
+	if (uio->uio_rw == UIO_READ)
+		memcpy(iov->iov_base, cp, n);
+	else
+		memcpy(cp, iov->iov_base, n);
+	iov->iov_base = (char *)iov->iov_base + n;
+	iov->iov_len -= n;
+	uio->uio_resid -= n;
+	uio->uio_offset += n;
+	return 0;
+}
+
+/* Names in the tests are ASCII */
+static int
+utf8_decodestr(const u_int8_t *utf8p, size_t utf8len, u_int16_t *ucsp, size_t *ucslen, size_t buflen, u_int16_t altslash,
+			   int flags)
+{
+	size_t i;
+
+	(void)altslash; (void)flags;
+	if (utf8len * sizeof(u_int16_t) > buflen)
+		return ENAMETOOLONG;
+	for (i = 0; i < utf8len; i++) {
+		if (utf8p[i] >= 0x80)
+			return EINVAL;
+		ucsp[i] = utf8p[i];
+	}
+	*ucslen = utf8len * sizeof(u_int16_t);
+	return 0;
+}
+
+static int
+utf8_encodestr(const u_int16_t *ucsp, size_t ucslen, u_int8_t *utf8p, size_t *utf8len, size_t buflen, u_int16_t altslash,
+			   int flags)
+{
+	size_t i, n = ucslen / sizeof(u_int16_t);
+
+	(void)altslash; (void)flags;
+	if (n > buflen)
+		return ENAMETOOLONG;
+	for (i = 0; i < n; i++) {
+		if (ucsp[i] >= 0x80)
+			return EINVAL;
+		utf8p[i] = ucsp[i];
+	}
+	*utf8len = n;
+	return 0;
+}
+
+static int
+extattr_check_cred(struct vnode *vp, int attrnamespace, struct ucred *cred, struct thread *td, accmode_t accmode)
+{
+	(void)vp; (void)attrnamespace; (void)cred; (void)td; (void)accmode;
+	return 0;
+}
+
+static int
+priv_check_cred(struct ucred *cred, int priv)
+{
+	(void)priv;
+	return cred->cr_uid == 0 ? 0 : EPERM;
+}
+
+static void
+getmicrotime(struct timeval *tv)
+{
+	gettimeofday(tv, NULL);
+}
+
+static int
+hfs_update(struct vnode *vp, struct timeval *access, struct timeval *modify, int waitfor)
+{
+	(void)vp; (void)access; (void)modify; (void)waitfor;
+	return 0;
+}
+
+static void
+hfs_decmpfs_cnode_destroy(struct cnode *cp)
+{
+	(void)cp;
+	decmpfsDestroys++;
+}
+
+#include "../../hfsplus/hfs_xattr.c"
+
+#undef malloc
+#undef free
+
+#define DEV_BLOCK_SIZE			4096
+#define DEV_BLOCKS			4096
+
+static struct ucred userCred = { .cr_uid = 501 };
+static struct ucred rootCred = { .cr_uid = 0 };
+
+static struct hfsmount testMount;
+static struct mount testVfsMount = { .mnt_data = &testMount };
+static struct vnode attrVnode;
+
+/*
+ * A volume with an empty attributes B-tree able to hold about
+ * 'records' short attributes.
+ */
+static void
+volume_create(UInt32 records)
+{
+	ExtendedVCB *vcb = HFSTOVCB(&testMount);
+	BTreeControlBlock *btcb;
+	SFCB *fcb;
+
+	fcb = tree_create(kCatalogTree, (size_t)records * 512 + 1024 * 1024);
+	btcb = fcb->fcbBtree;
+	btcb->keyCompareProc = (KeyCompareProcPtr)hfs_attrkeycompare;
+	btcb->maxKeyLength = kHFSPlusAttrKeyMaximumLength;
+	attrVnode.v_fcb = fcb;
+
+	vcb->vcbSigWord = kHFSPlusSigWord;
+	vcb->blockSize = DEV_BLOCK_SIZE;
+	vcb->totalBlocks = DEV_BLOCKS;
+	vcb->attributesRefNum = &attrVnode;
+	devData = calloc(DEV_BLOCKS, DEV_BLOCK_SIZE);
+	devBitmap = calloc(DEV_BLOCKS, 1);
+	assert(devData != NULL && devBitmap != NULL);
+	devBlocksUsed = 0;
+	hfs_xattr_init(&testMount);
+	assert(testMount.hfs_max_inline_attrsize > 1000 && testMount.hfs_max_inline_attrsize < DEV_BLOCK_SIZE);
+}
+
+static void
+volume_destroy(void)
+{
+	tree_destroy(attrVnode.v_fcb);
+	free(devData);
+	free(devBitmap);
+}
+
+static struct vnode *
+file_create(u_int32_t fileID)
+{
+	struct vnode *vp = calloc(1, sizeof(*vp));
+	struct cnode *cp = calloc(1, sizeof(*cp));
+
+	assert(vp != NULL && cp != NULL);
+	cp->c_fileid = fileID;
+	vp->v_data = cp;
+	vp->v_mount = &testVfsMount;
+	return vp;
+}
+
+static void
+file_destroy(struct vnode *vp)
+{
+	free(vp->v_data);
+	free(vp);
+}
+
+static void
+uio_init(struct uio *uio, struct iovec *iov, void *buf, size_t len, int rw)
+{
+	iov->iov_base = buf;
+	iov->iov_len = len;
+	bzero(uio, sizeof(*uio));
+	uio->uio_iov = iov;
+	uio->uio_iovcnt = 1;
+	uio->uio_resid = len;
+	uio->uio_segflg = UIO_SYSSPACE;
+	uio->uio_rw = rw;
+}
+
+static int
+xattr_set(struct vnode *vp, const char *name, const void *value, size_t len, struct ucred *cred)
+{
+	struct iovec iov;
+	struct uio uio;
+
+	uio_init(&uio, &iov, (void *)value, len, UIO_WRITE);
+	return hfs_setextattr(&(struct vop_setextattr_args){
+		.a_vp = vp, .a_attrnamespace = EXTATTR_NAMESPACE_USER, .a_name = name, .a_uio = &uio, .a_cred = cred });
+}
+
+/* Read into buf, or just get the size if buf is NULL */
+static int
+xattr_get(struct vnode *vp, const char *name, void *buf, size_t len, size_t *sizep, struct ucred *cred)
+{
+	struct iovec iov;
+	struct uio uio;
+
+	uio_init(&uio, &iov, buf, len, UIO_READ);
+	return hfs_getextattr(&(struct vop_getextattr_args){
+		.a_vp = vp, .a_attrnamespace = EXTATTR_NAMESPACE_USER, .a_name = name,
+		.a_uio = buf ? &uio : NULL, .a_size = sizep, .a_cred = cred });
+}
+
+static int
+xattr_delete(struct vnode *vp, const char *name, struct ucred *cred)
+{
+	return hfs_deleteextattr(&(struct vop_deleteextattr_args){
+		.a_vp = vp, .a_attrnamespace = EXTATTR_NAMESPACE_USER, .a_name = name, .a_cred = cred });
+}
+
+static int
+xattr_list(struct vnode *vp, void *buf, size_t len, size_t *sizep, struct ucred *cred)
+{
+	struct iovec iov;
+	struct uio uio;
+
+	uio_init(&uio, &iov, buf, len, UIO_READ);
+	return hfs_listextattr(&(struct vop_listextattr_args){
+		.a_vp = vp, .a_attrnamespace = EXTATTR_NAMESPACE_USER,
+		.a_uio = buf ? &uio : NULL, .a_size = sizep, .a_cred = cred });
+}
+
+/* Records of fileID left in the attributes B-tree */
+static UInt32
+attr_records(u_int32_t fileID)
+{
+	BTreeIterator iterator;
+	HFSPlusAttrKey *key = (HFSPlusAttrKey *)&iterator.key;
+	UInt32 count = 0;
+
+	bzero(&iterator, sizeof(iterator));
+	(void)hfs_buildattrkey(fileID, NULL, key);
+	while (BTIterateRecord(attrVnode.v_fcb, kBTreeNextRecord, &iterator, NULL, NULL) == noErr && key->fileID == fileID)
+		count++;
+	return count;
+}
+
+static void
+fill(UInt8 *buf, size_t len, UInt8 seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (UInt8)(seed + i * 7);
+}
+
+static void
+check_value(struct vnode *vp, const char *name, size_t len, UInt8 seed)
+{
+	UInt8 *expect = malloc(len + 1), *buf = malloc(len + 16);
+	size_t size = 0;
+
+	assert(expect != NULL && buf != NULL);
+	fill(expect, len, seed);
+	assert_no_err(xattr_get(vp, name, NULL, 0, &size, &userCred));
+	assert_equal_int(size, len);
+	memset(buf, 0xEE, len + 16);
+	size = 0;
+	assert_no_err(xattr_get(vp, name, buf, len + 16, &size, &userCred));
+	assert_equal_int(size, len);
+	assert(memcmp(buf, expect, len) == 0);
+	assert_equal_int(buf[len], 0xEE);
+	free(expect);
+	free(buf);
+}
+
+/* Inline and fork data values, replaced by each other and removed */
+static void
+test_set_get(void)
+{
+	static const size_t sizes[] = { 0, 1, 100, 1500, 4000, 20000, 3, 128 * 1024 };
+	UInt8 *value = malloc(128 * 1024);
+	struct vnode *vp;
+	size_t size, inlineMax;
+	unsigned i;
+
+	volume_create(1000);
+	inlineMax = testMount.hfs_max_inline_attrsize;
+	vp = file_create(100);
+	assert(value != NULL);
+
+	assert_equal_int(xattr_get(vp, "missing", NULL, 0, &size, &userCred), ENOATTR);
+	for (i = 0; i < lengthof(sizes); i++) {
+		fill(value, sizes[i], i);
+		assert_no_err(xattr_set(vp, "user.value", value, sizes[i], &userCred));
+		assert(VTOC(vp)->c_recflags & kHFSHasAttributesMask);
+		check_value(vp, "user.value", sizes[i], i);
+		assert_equal_int(attr_records(100), 1);
+		assert_equal_int(devBlocksUsed, sizes[i] > inlineMax ? howmany(sizes[i], DEV_BLOCK_SIZE) : 0);
+	}
+	/* Just above and below the largest inline value */
+	fill(value, inlineMax, 1);
+	assert_no_err(xattr_set(vp, "user.value", value, inlineMax, &userCred));
+	check_value(vp, "user.value", inlineMax, 1);
+	assert_equal_int(devBlocksUsed, 0);
+	fill(value, inlineMax + 1, 2);
+	assert_no_err(xattr_set(vp, "user.value", value, inlineMax + 1, &userCred));
+	check_value(vp, "user.value", inlineMax + 1, 2);
+	assert_equal_int(devBlocksUsed, 1);
+
+	assert_equal_int(xattr_set(vp, "user.value", value, 128 * 1024 + 1, &userCred), E2BIG);
+	assert_equal_int(xattr_set(vp, "", value, 1, &userCred), EINVAL);
+	check_value(vp, "user.value", inlineMax + 1, 2);
+
+	assert_no_err(xattr_delete(vp, "user.value", &userCred));
+	assert_equal_int(devBlocksUsed, 0);
+	assert_equal_int(attr_records(100), 0);
+	assert_equal_int(VTOC(vp)->c_recflags & kHFSHasAttributesMask, 0);
+	assert_equal_int(xattr_get(vp, "user.value", NULL, 0, &size, &userCred), ENOATTR);
+	assert_equal_int(xattr_delete(vp, "user.value", &userCred), ENOATTR);
+
+	file_destroy(vp);
+	volume_destroy();
+	free(value);
+}
+
+/* Names come back in key order; decmpfs only for privileged callers */
+static void
+test_list(void)
+{
+	static const char *names[] = { "b", "a", "com.apple.decmpfs", "cc", "aaa" };
+	static const char expect[] = "\1a\3aaa\1b\2cc";
+	static const char expectRoot[] = "\1a\3aaa\1b\2cc\21com.apple.decmpfs";
+	char buf[256];
+	struct vnode *vp, *other;
+	size_t size;
+	unsigned i, destroys;
+
+	volume_create(1000);
+	vp = file_create(200);
+	other = file_create(201);
+	assert_no_err(xattr_set(other, "z", "1", 1, &userCred));
+
+	size = 99;
+	assert_no_err(xattr_list(vp, NULL, 0, &size, &userCred));
+	assert_equal_int(size, 0);
+
+	for (i = 0; i < lengthof(names); i++) {
+		destroys = decmpfsDestroys;
+		if (strcmp(names[i], "com.apple.decmpfs") == 0) {
+			assert_equal_int(xattr_set(vp, names[i], "x", 1, &userCred), EPERM);
+			assert_no_err(xattr_set(vp, names[i], "x", 1, NOCRED));
+			assert_equal_int(decmpfsDestroys, destroys + 1);
+		} else {
+			assert_no_err(xattr_set(vp, names[i], names[i], strlen(names[i]), &userCred));
+			assert_equal_int(decmpfsDestroys, destroys);
+		}
+	}
+
+	assert_no_err(xattr_list(vp, NULL, 0, &size, &userCred));
+	assert_equal_int(size, sizeof(expect) - 1);
+	bzero(buf, sizeof(buf));
+	assert_no_err(xattr_list(vp, buf, sizeof(buf), &size, &userCred));
+	assert(memcmp(buf, expect, sizeof(expect) - 1) == 0);
+
+	bzero(buf, sizeof(buf));
+	assert_no_err(xattr_list(vp, buf, sizeof(buf), &size, &rootCred));
+	assert_equal_int(size, sizeof(expectRoot) - 1);
+	assert(memcmp(buf, expectRoot, sizeof(expectRoot) - 1) == 0);
+
+	assert_equal_int(xattr_get(vp, "com.apple.decmpfs", NULL, 0, &size, &userCred), ENOATTR);
+	assert_no_err(xattr_get(vp, "com.apple.decmpfs", NULL, 0, &size, &rootCred));
+	assert_equal_int(size, 1);
+	assert_equal_int(xattr_delete(vp, "com.apple.decmpfs", &userCred), EPERM);
+	destroys = decmpfsDestroys;
+	assert_no_err(xattr_delete(vp, "com.apple.decmpfs", &rootCred));
+	assert_equal_int(decmpfsDestroys, destroys + 1);
+
+	assert_no_err(xattr_get(other, "z", NULL, 0, &size, &userCred));
+	assert_equal_int(size, 1);
+	file_destroy(vp);
+	file_destroy(other);
+	volume_destroy();
+}
+
+/* hfs_removeallattr takes every record of the file and its blocks, and nothing else */
+static void
+test_remove_all(void)
+{
+	UInt8 value[3 * DEV_BLOCK_SIZE];
+	HFSPlusAttrRecord overflow;
+	FSBufferDescriptor btdata;
+	BTreeIterator iterator;
+	struct vnode *vp, *before, *after;
+	char name[32];
+	UInt32 usedByOthers;
+	int i;
+
+	volume_create(1000);
+	vp = file_create(300);
+	before = file_create(299);
+	after = file_create(301);
+	fill(value, sizeof(value), 3);
+	assert_no_err(xattr_set(before, "keep", value, sizeof(value), &userCred));
+	assert_no_err(xattr_set(after, "keep", value, 10, &userCred));
+	usedByOthers = devBlocksUsed;
+
+	for (i = 0; i < 50; i++) {
+		snprintf(name, sizeof(name), "attr-%d", i);
+		assert_no_err(xattr_set(vp, name, value, (i % 5 == 0) ? sizeof(value) : (size_t)i, &userCred));
+	}
+	assert_no_err(xattr_set(vp, "com.apple.decmpfs", value, 16, NOCRED));
+
+	/* An overflow extent record whose attribute is gone */
+	bzero(&iterator, sizeof(iterator));
+	(void)hfs_buildattrkey(300, "orphan", (HFSPlusAttrKey *)&iterator.key);
+	((HFSPlusAttrKey *)&iterator.key)->startBlock = 8;
+	bzero(&overflow, sizeof(overflow));
+	overflow.recordType = kHFSPlusAttrExtents;
+	btdata.bufferAddress = &overflow;
+	btdata.itemSize = sizeof(HFSPlusAttrExtents);
+	btdata.itemCount = 1;
+	assert_no_err(BTInsertRecord(attrVnode.v_fcb, &iterator, &btdata, btdata.itemSize));
+	assert_equal_int(attr_records(300), 52);
+	assert(devBlocksUsed > usedByOthers);
+
+	assert_no_err(hfs_removeallattr(&testMount, 300, curthread));
+	assert_equal_int(attr_records(300), 0);
+	assert_equal_int(devBlocksUsed, usedByOthers);
+	check_value(before, "keep", sizeof(value), 3);
+	check_value(after, "keep", 10, 3);
+
+	/* Nothing to remove is fine too */
+	assert_no_err(hfs_removeallattr(&testMount, 300, curthread));
+	assert_no_err(hfs_removeallattr(&testMount, 12345, curthread));
+	assert_equal_int(attr_records(299), 1);
+	assert_equal_int(attr_records(301), 1);
+
+	file_destroy(vp);
+	file_destroy(before);
+	file_destroy(after);
+	volume_destroy();
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define BENCH_ATTRS			4
+
+/*
+ * 'count' files, every other one with BENCH_ATTRS short attributes: time
+ * listextattr and getextattr over all of them, and check that files
+ * without attributes never take the attributes B-tree lock.
+ */
+static void
+benchmark(UInt32 count)
+{
+	static const char *names[BENCH_ATTRS] = {
+		"com.apple.FinderInfo", "com.apple.quarantine", "com.apple.metadata:kMDItemWhereFroms", "user.tag",
+	};
+	struct vnode **files;
+	char buf[256];
+	UInt32 i, j, locks;
+	size_t size;
+	double t, list, listMiss, get, getMiss;
+
+	volume_create(count * BENCH_ATTRS / 2);
+	files = calloc(count, sizeof(*files));
+	assert(files != NULL);
+	fill((UInt8 *)buf, 32, 4);
+	for (i = 0; i < count; i++) {
+		files[i] = file_create(1000 + i);
+		if (i % 2 == 0) {
+			for (j = 0; j < BENCH_ATTRS; j++)
+				assert_no_err(xattr_set(files[i], names[j], buf, 32, &userCred));
+		}
+	}
+
+	t = now();
+	for (i = 0; i < count; i += 2) {
+		assert_no_err(xattr_list(files[i], buf, sizeof(buf), &size, &userCred));
+		assert(size > 0);
+	}
+	list = now() - t;
+
+	t = now();
+	for (i = 0; i < count; i += 2) {
+		for (j = 0; j < BENCH_ATTRS; j++)
+			assert_no_err(xattr_get(files[i], names[j], buf, sizeof(buf), &size, &userCred));
+	}
+	get = now() - t;
+
+	locks = lockCalls;
+	t = now();
+	for (i = 1; i < count; i += 2) {
+		assert_no_err(xattr_list(files[i], buf, sizeof(buf), &size, &userCred));
+		assert_equal_int(size, 0);
+	}
+	listMiss = now() - t;
+
+	t = now();
+	for (i = 1; i < count; i += 2) {
+		for (j = 0; j < BENCH_ATTRS; j++)
+			assert_equal_int(xattr_get(files[i], names[j], buf, sizeof(buf), &size, &userCred), ENOATTR);
+	}
+	getMiss = now() - t;
+	assert_equal_int(lockCalls, locks);
+
+	printf("%8u files: listextattr %6.0f ns (%6.0f ns without attributes), getextattr %6.0f ns (%6.0f ns without attributes)\n",
+		   count, list * 1e9 / (count / 2), listMiss * 1e9 / (count / 2),
+		   get * 1e9 / (count / 2 * BENCH_ATTRS), getMiss * 1e9 / (count / 2 * BENCH_ATTRS));
+
+	for (i = 0; i < count; i++)
+		file_destroy(files[i]);
+	free(files);
+	volume_destroy();
+}
+
+int main(int argc, char *argv[])
+{
+	int arg;
+
+	test_set_get();
+	test_list();
+	test_remove_all();
+	printf("[PASSED] hfs_xattr_test\n");
+
+	if (argc > 1) {
+		for (arg = 1; arg < argc; arg++)
+			benchmark((UInt32)strtoul(argv[arg], NULL, 0));
+	} else {
+		benchmark(20000);
+	}
+
+	return 0;
+}
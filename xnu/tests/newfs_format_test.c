@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2014-2015 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Formats sparse image files with newfs_hfs's make_hfsplus (see
+ * newfs_image.h) and times it.
+ *
+ * A few small volumes are formatted first and checked: both volume
+ * headers, the allocation bitmap against the free block count, and that
+ * the journal and the rest of the bitmap were left as holes.  Then
+ * journaled volumes of 1 GB, 100 GB, 1 TB and 8 TB are formatted and
+ * the time and the bytes allocated in the image are printed; pass one or
+ * more sizes in GB to change them, e.g. "newfs_format_test 16 16384".
+ */
+
+#include <sys/stat.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libkern/OSByteOrder.h>
+#include <hfs/hfs_format.h>
+
+#include "newfs_image.h"
+#include "test-utils.h"
+
+#define IMAGE		"/tmp/newfs_format_test.img"
+
+static void
+read_header(int fd, off_t offset, HFSPlusVolumeHeader *vh)
+{
+	check_io(pread(fd, vh, sizeof(*vh), offset), sizeof(*vh));
+	assert_equal_int(OSSwapBigToHostInt16(vh->signature), kHFSPlusSigWord);
+}
+
+static uint64_t
+allocated_bytes(int fd)
+{
+	struct stat st;
+
+	assert_no_err(fstat(fd, &st));
+	return (uint64_t)st.st_blocks * 512;
+}
+
+/*
+ * Both volume headers agree, the bitmap has exactly the blocks in use
+ * set, and the zero ranges (the journal, the free part of the bitmap,
+ * the unused B-tree nodes) were punched out of the image.
+ */
+static void
+check_volume(int fd, uint64_t bytes, bool journaled)
+{
+	HFSPlusVolumeHeader vh, alt;
+	uint32_t blockSize, totalBlocks, freeBlocks, used, i;
+	uint64_t bitmapOffset, bitmapBytes;
+	uint8_t *bitmap;
+
+	read_header(fd, 1024, &vh);
+	read_header(fd, bytes - 1024, &alt);
+	assert(!memcmp(&vh, &alt, sizeof(vh)));
+
+	blockSize = OSSwapBigToHostInt32(vh.blockSize);
+	totalBlocks = OSSwapBigToHostInt32(vh.totalBlocks);
+	freeBlocks = OSSwapBigToHostInt32(vh.freeBlocks);
+	assert_equal_int(blockSize, newfs_image_block_size());
+	assert_equal_ll((uint64_t)totalBlocks, bytes / blockSize);
+	assert(freeBlocks < totalBlocks);
+	assert_equal_int(!!(OSSwapBigToHostInt32(vh.attributes) & kHFSVolumeJournaledMask), journaled);
+
+	bitmapOffset = (uint64_t)OSSwapBigToHostInt32(vh.allocationFile.extents[0].startBlock) * blockSize;
+	bitmapBytes = OSSwapBigToHostInt64(vh.allocationFile.logicalSize);
+	assert(bitmapBytes >= (totalBlocks + 7) / 8);
+	bitmap = malloc(bitmapBytes);
+	assert(bitmap != NULL);
+	check_io(pread(fd, bitmap, bitmapBytes, bitmapOffset), bitmapBytes);
+	for (used = 0, i = 0; i < totalBlocks; i++)
+		used += (bitmap[i / 8] >> (7 - i % 8)) & 1;
+	assert_equal_int(used, totalBlocks - freeBlocks);
+	free(bitmap);
+
+	/*
+	 * Only the headers, the B-tree nodes in use and the start of the
+	 * bitmap are written; a journal alone would be several megabytes
+	 */
+	assert(allocated_bytes(fd) < 2 * 1024 * 1024);
+}
+
+static void
+test_format(uint64_t bytes, bool journaled)
+{
+	int fd = newfs_image_create(IMAGE, bytes, journaled, NULL, NULL);
+
+	check_volume(fd, bytes, journaled);
+	assert_no_err(close(fd));
+	unlink(IMAGE);
+}
+
+static void
+benchmark(uint64_t gigabytes)
+{
+	uint64_t bytes = gigabytes << 30;
+	double seconds;
+	int fd;
+
+	fd = newfs_image_create(IMAGE, bytes, true, NULL, &seconds);
+	printf("%8llu GB: %8.3f s, %10llu KB allocated in the image\n",
+		   gigabytes, seconds, allocated_bytes(fd) / 1024);
+	assert_no_err(close(fd));
+	unlink(IMAGE);
+}
+
+int main(int argc, char *argv[])
+{
+	static const uint64_t sizes[] = { 1, 100, 1024, 8192 };
+	int arg;
+	unsigned i;
+
+	test_format(64ULL << 20, false);
+	test_format(64ULL << 20, true);
+	test_format(3ULL << 30, true);
+	printf("[PASSED] newfs_format_test\n");
+
+	if (argc > 1) {
+		for (arg = 1; arg < argc; arg++)
+			benchmark(strtoull(argv[arg], NULL, 0));
+	} else {
+		for (i = 0; i < lengthof(sizes); i++)
+			benchmark(sizes[i]);
+	}
+
+	return 0;
+}
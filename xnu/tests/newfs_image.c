@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2014-2015 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#include <time.h>
+
+#define main newfs_hfs_main
+#include "../newfs_hfs/newfs_hfs.c"
+#undef main
+#include "../newfs_hfs/makehfs.c"
+#include "../newfs_hfs/hfs_endian.c"
+#include "../lib_fsck_hfs/dfalib/CaseFolding.c"
+
+#include "newfs_image.h"
+#include "test-utils.h"
+
+int
+newfs_image_create(const char *path, uint64_t bytes, bool journaled,
+				   const char *sourceDirectory, double *seconds)
+{
+	DriveInfo dip = { 0 };
+	hfsparams_t defaults = { 0 };
+	struct timespec start, end;
+	int fd;
+
+	unlink(path);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	assert_with_errno(fd >= 0);
+	assert_no_err(ftruncate(fd, bytes));
+	fcntl(fd, F_NOCACHE, 1);
+
+	/* As hfs_newfs sets it up for a disk with 512-byte sectors */
+	dip.fd = fd;
+	dip.physSectorSize = kBytesPerSector;
+	dip.physTotalSectors = bytes / kBytesPerSector;
+	dip.physSectorsPerIO = (1024 * 1024) / dip.physSectorSize;
+	dip.sectorSize = kBytesPerSector;
+	dip.totalSectors = dip.physTotalSectors;
+
+	/* hfsplus_params and validate_hfsplus_block_size work on these */
+	progname = "newfs_hfs";
+	gBlockSize = 0;
+	catnodesiz = 8192;
+	gJournaled = journaled;
+	gJournalSize = 0;
+	gSourceDirectory = (char *)sourceDirectory;
+	time(&createtime);
+
+	validate_hfsplus_block_size(dip.totalSectors, dip.sectorSize);
+	hfsplus_params(&dip, &defaults);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	assert_no_err(make_hfsplus(&dip, &defaults));
+	assert_no_err(fsync(fd));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (seconds)
+		*seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	return fd;
+}
+
+uint32_t
+newfs_image_block_size(void)
+{
+	return gBlockSize;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2014-2015 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * HFS Plus image files for the tests, made by newfs_hfs's make_hfsplus.
+ * newfs_hfs itself only takes disks (it asks the device for its sector
+ * size and count), so newfs_image.c hands the image file to make_hfsplus
+ * the way hfs_newfs hands it a disk, with the parameters hfsplus_params
+ * picks.
+ */
+
+#ifndef newfs_image_h
+#define newfs_image_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+__BEGIN_DECLS
+
+/*
+ * Format a sparse image file of 'bytes' at path and return it, open for
+ * reading and writing.  If sourceDirectory isn't NULL the volume is
+ * populated from it, as with newfs_hfs -R.  If seconds isn't NULL it is
+ * set to the time make_hfsplus took, with an fsync of the image.
+ */
+int newfs_image_create(const char *path, uint64_t bytes, bool journaled,
+					   const char *sourceDirectory, double *seconds);
+
+/* The allocation block size of the last volume formatted */
+uint32_t newfs_image_block_size(void);
+
+__END_DECLS
+
+#endif /* newfs_image_h */
@@ -27,35 +27,366 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 
-#define KERNEL 1
-#define HFS 1
+#include "test-utils.h"
+
+#define _KERNEL 1
+#define __APPLE_API_PRIVATE 1
 #define RANGELIST_TEST	1
 
+#define M_TEMP	0
+#define M_WAITOK	0
 
-#define _hfs_malloc_zero(size)                                 \
-({                                                             \
-        void *_ptr = NULL;                                     \
-        typeof(size) _size = size;                             \
-        _ptr = calloc(1, _size);                               \
-        _ptr;                                                  \
-})
+#define malloc(size, type, flags)	calloc(1, size)
+#define free(ptr, type)	(free)(ptr)
+#define panic(...)	assert_fail(__VA_ARGS__)
+#define atomic_load_ptr(p)	__atomic_load_n((p), __ATOMIC_RELAXED)
+#define atomic_store_ptr(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
 
-#define _hfs_free(ptr, size)                                   \
-({                                                             \
-        __unused typeof(size) _size = size;                    \
-        typeof(ptr) _ptr = ptr;                                \
-        if (_ptr) {                                            \
-                free(_ptr);                                    \
-        }                                                      \
-})
+#include "../../hfsplus/rangelist.c"
 
-#define hfs_malloc_type(type) _hfs_malloc_zero(sizeof(type))
-#define hfs_free_type(ptr, type) _hfs_free(ptr, sizeof(type))
+#undef malloc
+#undef free
 
-#include "../core/rangelist.c"
+/*
+ * The differential test keeps a bitmap of DOMAIN offsets alongside the
+ * range list, plus a flag for "everything from DOMAIN on", which is
+ * what a range ending at RL_INFINITY covers.
+ */
+#define DOMAIN	1024
 
-#include "test-utils.h"
+static uint8_t model[DOMAIN];
+static int model_tail;
+
+static void
+model_set(off_t start, off_t end, int value)
+{
+	off_t last = (end == RL_INFINITY) ? DOMAIN - 1 : end;
+
+	for (off_t i = start; i <= last; i++)
+		model[i] = value;
+	if (end == RL_INFINITY)
+		model_tail = value;
+}
+
+/* Fill in the n'th maximal run of the model, as rl_add would merge it. */
+static int
+model_run(int n, struct rl_entry *run)
+{
+	off_t i = 0;
+
+	for (;;) {
+		while (i < DOMAIN && !model[i])
+			++i;
+		if (i == DOMAIN) {
+			if (!model_tail || n != 0)
+				return 0;
+			run->rl_start = DOMAIN;
+			run->rl_end = RL_INFINITY;
+			return 1;
+		}
+		run->rl_start = i;
+		while (i < DOMAIN && model[i])
+			++i;
+		run->rl_end = (i == DOMAIN && model_tail) ? RL_INFINITY : i - 1;
+		if (n-- == 0)
+			return 1;
+		if (run->rl_end == RL_INFINITY)
+			return 0;
+	}
+}
+
+/*
+ * Check the tree against the list: same order, parent links that match
+ * and AVL heights that are right and balanced.
+ */
+static int
+check_tree(struct rl_entry *node, struct rl_entry *parent, struct rl_entry **next)
+{
+	int hl, hr;
+
+	if (node == NULL)
+		return 0;
+	assert(node->rl_parent == parent);
+	hl = check_tree(node->rl_left, node, next);
+	assert(node == *next);
+	*next = TAILQ_NEXT(node, rl_link);
+	hr = check_tree(node->rl_right, node, next);
+	assert(hl <= hr + 1 && hr <= hl + 1);
+	assert_equal_int(node->rl_height, 1 + (hl > hr ? hl : hr));
+	return node->rl_height;
+}
+
+static void
+check_list(struct rl_head *rl)
+{
+	struct rl_entry *range, run;
+	int n = 0;
+
+	range = RL_FIRST(rl);
+	check_tree(rl->rl_root, NULL, &range);
+	assert(range == NULL);
+
+	TAILQ_FOREACH(range, &rl->rl_list, rl_link) {
+		assert(model_run(n++, &run));
+		assert_equal_ll(range->rl_start, run.rl_start);
+		assert_equal_ll(range->rl_end, run.rl_end);
+	}
+	assert(!model_run(n, &run));
+}
+
+/*
+ * The lookup rl_scan used to do: walk the list from the front until a
+ * range overlaps or lies past the one given.
+ */
+static enum rl_overlaptype
+list_scan(struct rl_head *rl, off_t start, off_t end, struct rl_entry **overlap)
+{
+	struct rl_entry *range;
+	enum rl_overlaptype ot;
+
+	TAILQ_FOREACH(range, &rl->rl_list, rl_link) {
+		ot = rl_overlap(range, start, end);
+		if (ot != RL_NOOVERLAP || (end != RL_INFINITY && range->rl_start > end)) {
+			*overlap = range;
+			return ot;
+		}
+	}
+	*overlap = NULL;
+	return RL_NOOVERLAP;
+}
+
+static void
+check_scan(struct rl_head *rl, off_t start, off_t end)
+{
+	struct rl_entry *overlap, *expected, run;
+	enum rl_overlaptype ot;
+	int n;
+
+	/* The tree finds the same range the list walk does... */
+	ot = rl_scan(rl, start, end, &overlap);
+	assert_equal_int(ot, list_scan(rl, start, end, &expected));
+	assert(overlap == expected);
+
+	/* ...and that is the first run of the model that overlaps. */
+	for (n = 0; model_run(n, &run); n++) {
+		if (rl_overlap(&run, start, end) != RL_NOOVERLAP)
+			break;
+	}
+	if (ot == RL_NOOVERLAP) {
+		assert(!model_run(n, &run));
+	} else {
+		assert_equal_int(ot, rl_overlap(&run, start, end));
+		assert_equal_ll(overlap->rl_start, run.rl_start);
+		assert_equal_ll(overlap->rl_end, run.rl_end);
+	}
+}
+
+static void
+random_range(off_t *start, off_t *end)
+{
+	*start = random() % DOMAIN;
+	switch (random() % 8) {
+	case 0:
+		*end = RL_INFINITY;
+		break;
+	case 1:
+		*end = *start + random() % (DOMAIN - *start);
+		break;
+	default:
+		*end = *start + random() % 8;
+		if (*end >= DOMAIN)
+			*end = DOMAIN - 1;
+		break;
+	}
+}
+
+static void
+test_differential(void)
+{
+	struct rl_head rl;
+	off_t start, end;
+	int pass, op;
+
+	srandom(2001);
+	for (pass = 0; pass < 200; pass++) {
+		rl_init(&rl);
+		memset(model, 0, sizeof(model));
+		model_tail = 0;
+
+		for (op = 0; op < 2000; op++) {
+			random_range(&start, &end);
+			switch (random() % 4) {
+			case 0:
+			case 1:
+				/* Mostly small ranges, so the list fills up. */
+				if (end == RL_INFINITY && random() % 4)
+					end = start;
+				rl_add(start, end, &rl);
+				model_set(start, end, 1);
+				break;
+			case 2:
+				rl_remove(start, end, &rl);
+				model_set(start, end, 0);
+				break;
+			case 3:
+				check_scan(&rl, start, end);
+				/* Then walk forwards, as hfs_bmap does. */
+				for (start = start + 7; start < DOMAIN; start += 64)
+					check_scan(&rl, start, start + 63);
+				break;
+			}
+			check_list(&rl);
+		}
+
+		rl_remove(0, RL_INFINITY, &rl);
+		assert(RL_EMPTY(&rl));
+		assert(rl.rl_root == NULL);
+	}
+}
+
+/*
+ * rl_scan under a shared lock: several threads look up a list that
+ * doesn't change, each walking forwards from its own places, so that
+ * they keep moving the hint under each other.
+ */
+#define SCAN_THREADS	4
+
+struct scan_thread {
+	pthread_t thread;
+	struct rl_head *rl;
+	unsigned seed;
+};
+
+static void *
+scan_thread(void *arg)
+{
+	struct scan_thread *st = arg;
+	struct rl_entry *overlap, *expected;
+	off_t start;
+	int i;
+
+	for (i = 0; i < 2000; i++) {
+		for (start = rand_r(&st->seed) % DOMAIN; start < DOMAIN; start += 1 + rand_r(&st->seed) % 64) {
+			assert_equal_int(rl_scan(st->rl, start, start + 3, &overlap), list_scan(st->rl, start, start + 3, &expected));
+			assert(overlap == expected);
+		}
+	}
+	return NULL;
+}
+
+static void
+test_concurrent_scan(void)
+{
+	struct scan_thread threads[SCAN_THREADS];
+	struct rl_head rl;
+	off_t start;
+	int i;
+
+	rl_init(&rl);
+	for (start = 0; start < DOMAIN; start += 5)
+		rl_add(start, start + 1, &rl);
+
+	for (i = 0; i < SCAN_THREADS; i++) {
+		threads[i].rl = &rl;
+		threads[i].seed = i + 1;
+		assert_no_err(pthread_create(&threads[i].thread, NULL, scan_thread, &threads[i]));
+	}
+	for (i = 0; i < SCAN_THREADS; i++)
+		assert_no_err(pthread_join(threads[i].thread, NULL));
+
+	rl_remove(0, RL_INFINITY, &rl);
+	assert(rl.rl_hint == NULL);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * A file written sparsely: every other 4K block is a hole, and the
+ * holes were written in a scattered order.  Map it in 64K pieces
+ * front to back, as a sequential read does, and then at random
+ * offsets, through the tree and through the old list walk.
+ */
+static void
+benchmark(int nranges)
+{
+	struct rl_head rl;
+	struct rl_entry *overlap;
+	const off_t bsize = 4096, iosize = 65536;
+	off_t fsize = 2 * bsize * nranges, pos;
+	double t0, t_add, t_seq, t_seq_list, t_rand, t_rand_list;
+	unsigned long nseq = 0, nrand, nlist, stride, sum = 0;
+	int i, j, *order;
+
+	order = calloc(nranges, sizeof(*order));
+	for (i = 0; i < nranges; i++)
+		order[i] = i;
+	srandom(nranges);
+	for (i = nranges - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		int t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	rl_init(&rl);
+	t0 = now();
+	for (i = 0; i < nranges; i++)
+		rl_add(2 * bsize * order[i], 2 * bsize * order[i] + bsize - 1, &rl);
+	t_add = now() - t0;
+
+	t0 = now();
+	for (pos = 0; pos < fsize; pos += iosize, nseq++)
+		sum += rl_scan(&rl, pos, pos + iosize - 1, &overlap);
+	t_seq = now() - t0;
+
+	/* The list walks are slow enough to sample every stride'th window. */
+	nlist = (nseq < 1000) ? nseq : 1000;
+	stride = nseq / nlist;
+	t0 = now();
+	for (pos = 0; pos < fsize; pos += stride * iosize)
+		sum += list_scan(&rl, pos, pos + iosize - 1, &overlap);
+	t_seq_list = now() - t0;
+
+	nrand = nseq;
+	srandom(1);
+	t0 = now();
+	for (i = 0; i < (int)nrand; i++) {
+		pos = (random() % (fsize / bsize)) * bsize;
+		sum += rl_scan(&rl, pos, pos + iosize - 1, &overlap);
+	}
+	t_rand = now() - t0;
+
+	srandom(1);
+	t0 = now();
+	for (i = 0; i < (int)nlist; i++) {
+		pos = (random() % (fsize / bsize)) * bsize;
+		sum += list_scan(&rl, pos, pos + iosize - 1, &overlap);
+	}
+	t_rand_list = now() - t0;
+
+	printf("%7d ranges: add %6.0f ns, sequential scan %5.0f ns (list %8.0f ns), "
+	       "random scan %5.0f ns (list %8.0f ns)\n",
+	       nranges, t_add * 1e9 / nranges,
+	       t_seq * 1e9 / nseq, t_seq_list * 1e9 / ((nseq + stride - 1) / stride),
+	       t_rand * 1e9 / nrand, t_rand_list * 1e9 / nlist);
+
+	rl_remove(0, RL_INFINITY, &rl);
+	assert(RL_EMPTY(&rl));
+	free(order);
+	(void)sum;
+}
 
 int main (void)
 {
@@ -90,6 +421,13 @@ int main (void)
 
 	CHECK(21, 21, RL_NOOVERLAP);
 
+	test_differential();
+	test_concurrent_scan();
+
+	benchmark(1000);
+	benchmark(10000);
+	benchmark(100000);
+
 	printf("[PASSED] rangelist_test\n");
 
 	return 0;